@@ -3,14 +3,26 @@
 #endif
 
 
-#include "winnet.h"
+#include "netmux.h"
+#include "message.h"
 #include "logger.h"
 #include "ssdp.h"
+#include "natpmp.h"
+#include "peer.h"
+#include "transfer.h"
 
 #define DEFAULT_PORT "5050"
 #define DEFAULT_IP "162.55.179.66"
 #define MAX_BUFFER_SIZE 1024
 #define CONNECTION_TIMEOUT 10000
+#define HANDSHAKE_TIMEOUT 2000                          // ms the server has to send its handshake after accept
+#define DOWNLOAD_DIRECTORY "downloads"                  // files peers send us are written here
+#define LOG_FORMAT_VARIABLE "P2PCHAT_LOG_FORMAT" // "binary" writes .plog files for logtool, "json" .jsonl files
+#define LOG_FILE_SIZE ( 64 * 1024 * 1024 )         // a day's log is split into parts of this size
+#define LOG_RATE_LIMIT 20                          // records per second a single statement may write
+#define LOG_RATE_BURST 100                         // records a quiet statement may write at once
+#define LOG_FORWARD_VARIABLE "P2PCHAT_LOG_FORWARD" // local UDP port records are also forwarded to as JSON
+#define COMPRESSION_VARIABLE "P2PCHAT_COMPRESSION" // "off" declines the frame compression the server offers
 
 /**
 * 
@@ -41,6 +53,117 @@ CleanUpConnection(
     SOCKET Socket
 );
 
+/**
+* State shared between the input loop and the thread reading frames from the server.
+*/
+typedef struct _CHAT_CONTEXT
+{
+    SOCKET          ServerSocket;
+    NET_MUX         Mux;           // streams to the server, chat is never queued behind bulk transfers
+    PCSTR           ServerIp;
+    PCSTR           ServerPort;
+    volatile LONG   Connected;
+    BOOL            IsPeerEnabled; // UDP socket registered with the rendezvous
+    PEER_SESSION    Peer;
+    SSDP_ADVERTISER Lan;           // LAN discovery, only started when peer to peer is enabled
+    TRANSFER_SESSION Transfer;     // files to and from the peer, relayed on the bulk streams
+    UINT32          ClientId;      // from the handshake, 0 without one
+    UINT32          NextSequence;  // of the next chat message, touched only by the input loop
+} CHAT_CONTEXT, *PCHAT_CONTEXT;
+
+/**
+* Sends a single frame to the server on one of the connection's streams.
+*
+* @return TRUE if the frame was queued or sent, FALSE otherwise.
+*/
+static
+BOOL
+SendFrame(
+    _In_ PNET_MUX Mux,
+    _In_ UINT16 StreamId,
+    _In_ MESSAGE_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+);
+
+/**
+* Reads frames from the server until the connection closes: relayed chat, peer introductions and
+* file transfers.
+*/
+static
+DWORD
+WINAPI
+ServerReceiveThread(
+    _In_ LPVOID lpData
+);
+
+/**
+* Reads the handshake frame the server sends right after accept.
+*
+* @param Socket         Connected server socket.
+* @param PublicIpBuffer Receives the address the server observed us connect from.
+* @param BufferSize     Size of PublicIpBuffer.
+* @param pPublicPort    Receives the observed port.
+* @param pClientId      Receives the id the server assigned to us.
+* @param pToken         Receives the token authenticating our UDP registration.
+* @param pCapabilities  Receives the PROTOCOL_CAPABILITY_* the server offers.
+*
+* @return 1 if a valid handshake was received, 0 if the server sent nothing within HANDSHAKE_TIMEOUT
+*         and the stream is untouched, SOCKET_ERROR if the connection failed or the server sent
+*         something else, after which the stream is out of step and the connection has to be closed.
+*/
+static
+INT
+ReceiveHandshake(
+    _In_  SOCKET Socket,
+    _Out_ PSTR PublicIpBuffer,
+    _In_  INT64 BufferSize,
+    _Out_ PUINT16 pPublicPort,
+    _Out_ PUINT32 pClientId,
+    _Out_ PUINT32 pToken,
+    _Out_ PUINT32 pCapabilities
+);
+
+/**
+* Takes up the compression the server offers unless COMPRESSION_VARIABLE declines it, and
+* compresses our chat frames from then on.
+*/
+static
+VOID
+NegotiateCompression(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT32 Offered
+);
+
+/**
+* Shared state for racing UPnP against NAT-PMP/PCP, whichever resolver answers first wins.
+* Losing resolvers may still be running after the winner returns so the state is reference counted.
+*/
+typedef struct _PUBLIC_IP_RACE
+{
+    volatile LONG References; // main thread plus one per resolver thread
+    volatile LONG Pending;    // resolvers which have not finished yet
+    volatile LONG Resolved;   // set by the first resolver to succeed
+    HANDLE        DoneEvent;  // signalled on the first success or once every resolver failed
+    CHAR          PublicIp[64];
+    PCSTR         Source;
+} PUBLIC_IP_RACE, *PPUBLIC_IP_RACE;
+
+/**
+* Resolves the public IP address by running UPnP and NAT-PMP/PCP in parallel.
+*
+* @param PublicIpBuffer Buffer receiving the public IP address.
+* @param BufferSize     Size of PublicIpBuffer.
+*
+* @return TRUE if any resolver found the address, FALSE otherwise.
+*/
+static
+BOOL
+ResolvePublicIpAddress(
+    _Out_ PSTR PublicIpBuffer,
+    _In_  INT64 BufferSize
+);
+
 static void EnsureDirectoryExists(LPCSTR dirPath)
 {
     DWORD attrib = GetFileAttributesA(dirPath);
@@ -88,7 +211,8 @@ bool CombinePaths(const char* dir, const char* file, char* outBuf, size_t bufSiz
 }
 
 INT main(
-    VOID
+    INT   argc,
+    PSTR* argv
 )
 {
     CHAR ModulePath[MAX_PATH] = { 0 };
@@ -111,7 +235,29 @@ INT main(
 
     EnsureDirectoryExists(LogPath);
 
+    CHAR LogFormat[16] = { 0 };
+    DWORD LogFormatSize = GetEnvironmentVariableA( LOG_FORMAT_VARIABLE, LogFormat, sizeof( LogFormat ) );
+    if( LogFormatSize > 0 && LogFormatSize < sizeof( LogFormat ) && _stricmp( LogFormat, "binary" ) == 0 )
+    {
+        LoggerSetFormat( LOG_FORMAT_BINARY );
+    }
+    else if( LogFormatSize > 0 && LogFormatSize < sizeof( LogFormat ) && _stricmp( LogFormat, "json" ) == 0 )
+    {
+        LoggerSetFormat( LOG_FORMAT_JSON );
+    }
+
     LoggerInitFile( LogPath, 14 );
+    LoggerSetRotationSize( LOG_FILE_SIZE );
+    LoggerStartCompression();
+
+    // a flooding peer or a flapping network must not turn one statement into a log storm
+    LoggerSetRateLimit( LOG_RATE_LIMIT, LOG_RATE_BURST );
+
+    // keep socket threads off the disk, only warnings and errors may wait for the writer
+    LoggerStartAsync( 0, LOG_OVERFLOW_DROP_BELOW, LOG_LEVEL_WARN );
+
+    // TRACE stays in memory and only reaches the file when an error, or '/trace', dumps it
+    LoggerStartFlightRecorder( 0, LOG_LEVEL_TRACE );
 
 #ifdef _DEBUG
     LoggerSetLevel(LOG_LEVEL_DEBUG);
@@ -119,6 +265,9 @@ INT main(
     LoggerSetLevel(LOG_LEVEL_INFO);
 #endif
 
+    // errors also show up in the terminal, written by their own thread so the chat never waits on it
+    LoggerAddConsoleSink( stderr, LOG_LEVEL_ERROR );
+
     // Initialise Winsock dll
     if (!InitWinSock())
     {
@@ -126,121 +275,249 @@ INT main(
         return 1;
     }
 
-    UPNP_DEVICE Device = { 0 };
-    CHAR PublicIp[64] = { 0 };
+    CHAR LogForward[8] = { 0 };
+    DWORD LogForwardSize = GetEnvironmentVariableA( LOG_FORWARD_VARIABLE, LogForward, sizeof( LogForward ) );
+    if( LogForwardSize > 0 && LogForwardSize < sizeof( LogForward ) )
+    {
+        LoggerAddUdpSink( (USHORT)strtoul( LogForward, NULL, 10 ), LOG_FORMAT_JSON, LOG_LEVEL_DEBUG );
+    }
 
-    if( !DiscoverUPnPDevice( &Device ) )
+    // allow overriding the relay so several clients can be run against a local server
+    PCSTR ServerIp   = ( argc > 1 ) ? argv[1] : DEFAULT_IP;
+    PCSTR ServerPort = ( argc > 2 ) ? argv[2] : DEFAULT_PORT;
+
+    SOCKET ConnectServer = INVALID_SOCKET;
+    if( !ConnectToServer( ServerIp, ServerPort, &ConnectServer ) )
     {
-        printf("Failed to discover UPnP device\n");
         CleanUpWinSock();
         return 1;
     }
 
-    printf("Discovered UPnP device: %s:%d\n", Device.Host, Device.Port);
+    printf( "Connected to server at %s:%s\n", ServerIp, ServerPort );
 
-    if( !GetDeviceDescription( &Device ) )
+    // the server reflects the address it saw us connect from, which makes UPnP unnecessary
+    CHAR PublicIp[64] = { 0 };
+    UINT16 PublicPort = 0;
+    UINT32 ClientId = 0;
+    UINT32 Token = 0;
+    UINT32 Offered = 0;
+
+    INT Handshake = ReceiveHandshake( ConnectServer, PublicIp, sizeof(PublicIp), &PublicPort, &ClientId, &Token, &Offered );
+    BOOL HasHandshake = ( Handshake > 0 );
+
+    if( Handshake == SOCKET_ERROR )
     {
-        printf("Failed to get device description\n");
+        printf("Server did not send a valid handshake, disconnecting\n");
+        CleanUpConnection( ConnectServer );
         CleanUpWinSock();
         return 1;
     }
 
-    printf("Control URL: %s\n", Device.ControlUrl );
-
-    if( !GetPublicIpAddress( &Device, PublicIp, sizeof(PublicIp) ) )
+    if( HasHandshake )
+    {
+        printf("Public IP Address: %s:%u (observed by server)\n", PublicIp, PublicPort);
+    }
+    else if( ResolvePublicIpAddress( PublicIp, sizeof(PublicIp) ) )
+    {
+        printf("Public IP Address: %s\n", PublicIp);
+    }
+    else
     {
         printf("Failed to get public IP address\n");
+        CleanUpConnection( ConnectServer );
         CleanUpWinSock();
         return 1;
     }
 
-    printf("Public IP Address: %s\n", PublicIp);
+    // the receive thread blocks on the socket from here on, the connect timeout no longer applies
+    NetSetReceiveTimeout( ConnectServer, 0 );
 
-    PCSTR ServerIp   = DEFAULT_IP;
-    PCSTR ServerPort = DEFAULT_PORT;
+    CHAT_CONTEXT Chat = { 0 };
+    Chat.ServerSocket = ConnectServer;
+    Chat.ServerIp = ServerIp;
+    Chat.ServerPort = ServerPort;
+    Chat.Connected = TRUE;
+    Chat.ClientId = ClientId;
+    NetMuxInitialise( &Chat.Mux, ConnectServer );
+    NegotiateCompression( &Chat.Mux, Offered );
 
-    SOCKET ConnectServer = NULL;
-    if( !ConnectToServer( ServerIp, ServerPort, &ConnectServer ) )
+    if( !TransferInitialise( &Chat.Transfer, &Chat.Mux, DOWNLOAD_DIRECTORY ) )
     {
-        CleanUpWinSock();
+        printf( "Unable to prepare file transfers: %d\n", GetLastError( ) );
+        NetMuxCleanUp( &Chat.Mux );
+        CleanUpConnection( ConnectServer );
+        CleanUpWinSock( );
         return 1;
     }
 
-    printf( "Connected to server at %s:%s\n", ServerIp, ServerPort );
-    printf( "Type 'exit' to quit\n\n" );
+    if( HasHandshake && PeerSessionInitialise( &Chat.Peer, ConnectServer, ClientId, Token ) )
+    {
+        REGISTER_ENDPOINT_MESSAGE Register;
+        if( PeerSessionRegister( &Chat.Peer, &Register.Private ) &&
+            SendFrame( &Chat.Mux, STREAM_CONTROL, MESSAGE_TYPE_REGISTER_ENDPOINT, &Register, sizeof( Register ) ) )
+        {
+            Chat.IsPeerEnabled = TRUE;
+            printf( "Your client id is %u, type '/connect <id>' to talk to another client directly\n", ClientId );
+            printf( "Once connected, type '/send <file>' to send the peer a file\n" );
 
-    CHAR SendBuffer[MAX_BUFFER_SIZE];
-    CHAR RecvBuffer[MAX_BUFFER_SIZE];
+            if( SsdpStartAdvertiser( &Chat.Lan, ClientId, &Chat.Peer.LocalAddress ) )
+            {
+                PeerSessionAttachLan( &Chat.Peer, &Chat.Lan );
+                printf( "Advertising on the LAN, type '/lan' to list clients nearby\n" );
+            }
+        }
+    }
+
+    HANDLE hReceiveThread = CreateThread( NULL, 0, ServerReceiveThread, &Chat, 0, NULL );
+    if( hReceiveThread == NULL )
+    {
+        printf( "Unable to create receive thread: %d\n", GetLastError( ) );
+        PeerSessionCleanUp( &Chat.Peer );
+        TransferCleanUp( &Chat.Transfer );
+        NetMuxCleanUp( &Chat.Mux );
+        CleanUpConnection( ConnectServer );
+        CleanUpWinSock( );
+        return 1;
+    }
 
+    printf( "Type '/ping' to time the server, '/away', '/busy' or '/back' to tell your peer, 'exit' to quit\n\n" );
+
+    CHAR SendBuffer[MAX_BUFFER_SIZE];
     INT Result;
-    BOOL Connected = TRUE;
 
-    while( Connected )
+    while( Chat.Connected )
     {
         Result = GetLine( "Enter message to send: ", SendBuffer, sizeof( SendBuffer ) );
 
+        if( !Chat.Connected )
+        {
+            break; // server went away while we were waiting for input
+        }
+
         if( Result )
         {
             printf( "Either no input or input too large (max %d characters)\n", MAX_BUFFER_SIZE - 1 );
             continue;
         }
 
-        if( _stricmp(SendBuffer, "exit") == 0 )
+        INT Length = (INT)strlen( SendBuffer );
+
+        if( _stricmp( SendBuffer, "/lan" ) == 0 )
         {
-            Connected = FALSE;
+            SsdpPrintLanPeers( &Chat.Lan );
+            continue;
         }
 
-        INT TotalBytesSent = 0;
-        INT BytesRemaining = (INT)strlen( SendBuffer );
+        if( _stricmp( SendBuffer, "/trace" ) == 0 )
+        {
+            LoggerDumpFlightRecorder( );
+            printf( "Recent trace written to the log file\n" );
+            continue;
+        }
 
-        while( TotalBytesSent < BytesRemaining )
+        if( _stricmp( SendBuffer, "/ping" ) == 0 )
         {
-            INT BytesSent = send( 
-                ConnectServer, 
-                SendBuffer + TotalBytesSent, 
-                BytesRemaining - TotalBytesSent, 
-                0 
-            );
-
-            if( BytesSent == SOCKET_ERROR )
+            CONTROL_MESSAGE Ping;
+            if( !SendFrame( &Chat.Mux, STREAM_CONTROL, MESSAGE_TYPE_CONTROL, &Ping, MessageControlEncode( &Ping, MESSAGE_CONTROL_PING, GetTickCount64( ), NULL, 0 ) ) )
             {
                 printf( "Send failed: %d\n", WSAGetLastError( ) );
-                Connected = FALSE;
-                break;
+                Chat.Connected = FALSE;
             }
+            continue;
+        }
 
-            TotalBytesSent += BytesSent;
-
+        UINT8 State = ( _stricmp( SendBuffer, "/away" ) == 0 ) ? MESSAGE_PRESENCE_AWAY :
+                      ( _stricmp( SendBuffer, "/busy" ) == 0 ) ? MESSAGE_PRESENCE_BUSY :
+                      ( _stricmp( SendBuffer, "/back" ) == 0 ) ? MESSAGE_PRESENCE_ONLINE : 0;
+        if( State != 0 )
+        {
+            // the server fills in who we are and tells the peer it paired us with, if any
+            PRESENCE_MESSAGE Presence;
+            if( !SendFrame( &Chat.Mux, STREAM_CHAT, MESSAGE_TYPE_PRESENCE, &Presence, MessagePresenceEncode( &Presence, 0, State, NULL, 0 ) ) )
+            {
+                printf( "Send failed: %d\n", WSAGetLastError( ) );
+                Chat.Connected = FALSE;
+            }
+            continue;
         }
 
-        if( !Connected )
+        if( _strnicmp( SendBuffer, "/send ", 6 ) == 0 )
         {
-            break;
+            // relayed to the peer the server introduced, the server answers if there is none
+            if( !Chat.IsPeerEnabled )
+            {
+                printf( "Peer to peer is not available on this connection\n" );
+            }
+            else
+            {
+                TransferSendFile( &Chat.Transfer, SendBuffer + 6 );
+            }
+            continue;
         }
 
-        ZeroMemory( RecvBuffer, sizeof( RecvBuffer ) );
-        INT BytesRecieved = recv( ConnectServer, RecvBuffer, sizeof( RecvBuffer ) - 1, 0 );
+        if( _strnicmp( SendBuffer, "/connect ", 9 ) == 0 )
+        {
+            UINT32 PeerId = (UINT32)strtoul( SendBuffer + 9, NULL, 10 );
+            PEER_CONNECT_MESSAGE Connect;
+            Connect.PeerId = htonl( PeerId );
+
+            if( !Chat.IsPeerEnabled )
+            {
+                printf( "Peer to peer is not available on this connection\n" );
+            }
+            else if( PeerSessionConnectLan( &Chat.Peer, PeerId ) )
+            {
+                printf( "Peer %u is on the LAN, connecting directly\n", PeerId );
+            }
+            else if( !SendFrame( &Chat.Mux, STREAM_CONTROL, MESSAGE_TYPE_PEER_CONNECT, &Connect, sizeof( Connect ) ) )
+            {
+                printf( "Send failed: %d\n", WSAGetLastError( ) );
+                Chat.Connected = FALSE;
+            }
+            continue;
+        }
 
-        if( BytesRecieved > 0 )
+        if( _stricmp(SendBuffer, "exit") == 0 )
         {
-            RecvBuffer[BytesRecieved] = '\0';
-            printf( "Recieved '%s' from %s:%s\n", RecvBuffer, ServerIp, ServerPort );
+            // on the chat stream, so the server hands on what we said before it lets us go
+            LEAVE_MESSAGE Leave;
+            SendFrame( &Chat.Mux, STREAM_CHAT, MESSAGE_TYPE_LEAVE, &Leave, MessageLeaveEncode( &Leave, 0, MESSAGE_LEAVE_QUIT, NULL, 0 ) );
+            Chat.Connected = FALSE;
+            break;
         }
-        else if ( BytesRecieved == 0 )
+
+        if( Chat.IsPeerEnabled && PeerSessionSend( &Chat.Peer, SendBuffer, Length ) )
         {
-            printf( "Connection closed by server\n" );
-            Connected = FALSE;
+            continue; // delivered straight to the peer, the relay never sees it
         }
-        else
+
+        if( Length > (INT)MESSAGE_MAX_CHAT_TEXT )
         {
-            printf( "Recieve failed: %d\n", WSAGetLastError( ) );
-            Connected = FALSE;
+            printf( "Message too long for the relay (max %u characters)\n", (UINT)MESSAGE_MAX_CHAT_TEXT );
+            continue;
         }
 
+        CHAR Message[PROTOCOL_MAX_PAYLOAD_SIZE];
+        UINT16 MessageLength = MessageChatEncode( Message, ++Chat.NextSequence, 0, SendBuffer, (UINT16)Length );
+
+        if( !SendFrame( &Chat.Mux, STREAM_CHAT, MESSAGE_TYPE_CHAT, Message, MessageLength ) )
+        {
+            printf( "Send failed: %d\n", WSAGetLastError( ) );
+            Chat.Connected = FALSE;
+        }
     }
 
     CleanUpConnection( ConnectServer );
+
+    WaitForSingleObject( hReceiveThread, INFINITE );
+    CloseHandle( hReceiveThread );
+    TransferCleanUp( &Chat.Transfer );
+    NetMuxCleanUp( &Chat.Mux );
+
+    PeerSessionCleanUp( &Chat.Peer );
+    SsdpStopAdvertiser( &Chat.Lan );
     CleanUpWinSock( );
+    LoggerCleanUp( );
 
     printf( "Terminating...\n" );
     
@@ -321,8 +598,7 @@ ConnectToServer(
         }
 
         // set timeout for when attempting to connect
-        DWORD Timeout = CONNECTION_TIMEOUT;
-        if( setsockopt( *ConnectSocket, SOL_SOCKET, SO_RCVTIMEO, (PCSTR)&Timeout, sizeof( Timeout ) ) == SOCKET_ERROR )
+        if( !NetSetReceiveTimeout( *ConnectSocket, CONNECTION_TIMEOUT ) )
         {
             printf( "Failed to set connection timeout: %d\n", WSAGetLastError( ) );
         }
@@ -364,3 +640,498 @@ CleanUpConnection(
 
     closesocket( Socket );
 }
+
+
+/**
+* Drops a reference on the race state, the last owner frees it.
+*/
+static
+VOID
+ReleasePublicIpRace(
+    _In_ PPUBLIC_IP_RACE pRace
+)
+{
+    if( InterlockedDecrement( &pRace->References ) == 0 )
+    {
+        CloseHandle( pRace->DoneEvent );
+        free( pRace );
+    }
+}
+
+/**
+* Called by a resolver when it finishes, publishes the address if it is the first to succeed.
+*/
+static
+VOID
+CompletePublicIpResolver(
+    _In_     PPUBLIC_IP_RACE pRace,
+    _In_opt_ PCSTR PublicIp,
+    _In_     PCSTR Source
+)
+{
+    if( PublicIp != NULL && InterlockedCompareExchange( &pRace->Resolved, 1, 0 ) == 0 )
+    {
+        strncpy_s( pRace->PublicIp, sizeof( pRace->PublicIp ), PublicIp, _TRUNCATE );
+        pRace->Source = Source;
+        SetEvent( pRace->DoneEvent );
+    }
+
+    if( InterlockedDecrement( &pRace->Pending ) == 0 )
+    {
+        SetEvent( pRace->DoneEvent ); // everyone finished, wake main thread even if all failed
+    }
+
+    ReleasePublicIpRace( pRace );
+}
+
+static
+DWORD
+WINAPI
+UpnpResolverThread(
+    _In_ LPVOID lpData
+)
+{
+    PPUBLIC_IP_RACE pRace = (PPUBLIC_IP_RACE)lpData;
+
+    UPNP_DEVICE Device = { 0 };
+    CHAR PublicIp[64] = { 0 };
+
+    if( !DiscoverUPnPDevice( &Device ) )
+    {
+        LOG_INFO( "Failed to discover UPnP device\n" );
+        CompletePublicIpResolver( pRace, NULL, "UPnP" );
+        return 1;
+    }
+
+    LOG_INFO( "Discovered UPnP device: %s:%d\n", Device.Host, Device.Port );
+
+    if( !GetDeviceDescription( &Device ) )
+    {
+        LOG_INFO( "Failed to get device description\n" );
+        CompletePublicIpResolver( pRace, NULL, "UPnP" );
+        return 1;
+    }
+
+    LOG_INFO( "Control URL: %s\n", Device.ControlUrl );
+
+    if( !GetPublicIpAddress( &Device, PublicIp, sizeof( PublicIp ) ) )
+    {
+        CompletePublicIpResolver( pRace, NULL, "UPnP" );
+        return 1;
+    }
+
+    CompletePublicIpResolver( pRace, PublicIp, "UPnP" );
+    return 0;
+}
+
+static
+DWORD
+WINAPI
+NatPmpResolverThread(
+    _In_ LPVOID lpData
+)
+{
+    PPUBLIC_IP_RACE pRace = (PPUBLIC_IP_RACE)lpData;
+
+    struct sockaddr_in Gateway;
+    CHAR PublicIp[64] = { 0 };
+
+    if( !NatPmpGetDefaultGateway( &Gateway ) ||
+        !NatPmpGetPublicIpAddress( &Gateway, PublicIp, sizeof( PublicIp ) ) )
+    {
+        LOG_INFO( "NAT-PMP/PCP did not return a public address\n" );
+        CompletePublicIpResolver( pRace, NULL, "NAT-PMP/PCP" );
+        return 1;
+    }
+
+    CompletePublicIpResolver( pRace, PublicIp, "NAT-PMP/PCP" );
+    return 0;
+}
+
+static
+BOOL
+ResolvePublicIpAddress(
+    _Out_ PSTR PublicIpBuffer,
+    _In_  INT64 BufferSize
+)
+{
+    static const LPTHREAD_START_ROUTINE Resolvers[] = { NatPmpResolverThread, UpnpResolverThread };
+
+    PPUBLIC_IP_RACE pRace = (PPUBLIC_IP_RACE)calloc( 1, sizeof( PUBLIC_IP_RACE ) );
+    if( pRace == NULL )
+    {
+        return FALSE;
+    }
+
+    pRace->DoneEvent = CreateEventA( NULL, TRUE, FALSE, NULL );
+    if( pRace->DoneEvent == NULL )
+    {
+        free( pRace );
+        return FALSE;
+    }
+
+    pRace->References = 1;
+    pRace->Pending = 1; // held by the main thread until every resolver has been started
+
+    for( INT i = 0; i < (INT)ARRAYSIZE( Resolvers ); ++i )
+    {
+        InterlockedIncrement( &pRace->References );
+        InterlockedIncrement( &pRace->Pending );
+
+        HANDLE hResolver = CreateThread( NULL, 0, Resolvers[i], pRace, 0, NULL );
+        if( hResolver == NULL )
+        {
+            LOG_DEBUG( "Unable to create resolver thread: %d\n", GetLastError( ) );
+            InterlockedDecrement( &pRace->Pending );
+            InterlockedDecrement( &pRace->References );
+            continue;
+        }
+
+        CloseHandle( hResolver );
+    }
+
+    if( InterlockedDecrement( &pRace->Pending ) == 0 )
+    {
+        SetEvent( pRace->DoneEvent );
+    }
+
+    WaitForSingleObject( pRace->DoneEvent, INFINITE );
+
+    BOOL IsResolved = ( pRace->Resolved != 0 );
+    if( IsResolved )
+    {
+        strncpy_s( PublicIpBuffer, (size_t)BufferSize, pRace->PublicIp, _TRUNCATE );
+        LOG_INFO( "Public IP address %s resolved via %s\n", pRace->PublicIp, pRace->Source );
+    }
+
+    ReleasePublicIpRace( pRace );
+    return IsResolved;
+}
+
+static
+INT
+ReceiveHandshake(
+    _In_  SOCKET Socket,
+    _Out_ PSTR PublicIpBuffer,
+    _In_  INT64 BufferSize,
+    _Out_ PUINT16 pPublicPort,
+    _Out_ PUINT32 pClientId,
+    _Out_ PUINT32 pToken,
+    _Out_ PUINT32 pCapabilities
+)
+{
+    MESSAGE_HEADER Header;
+    HANDSHAKE_MESSAGE Handshake;
+
+    // a server that sends no handshake sends nothing until we do, so there is no need to wait
+    // out the whole connection timeout for it, and nothing of the stream is consumed
+    if( !NetWaitReadable( Socket, HANDSHAKE_TIMEOUT ) )
+    {
+        LOG_INFO( "No handshake received from server within %d ms\n", HANDSHAKE_TIMEOUT );
+        return 0;
+    }
+
+    if( NetReceiveExact( Socket, &Header, sizeof( Header ) ) <= 0 )
+    {
+        LOG_INFO( "Connection failed before the handshake: %d\n", WSAGetLastError( ) );
+        return SOCKET_ERROR;
+    }
+
+    if( ntohs( Header.Type ) != MESSAGE_TYPE_HANDSHAKE || ntohs( Header.Length ) != sizeof( Handshake ) )
+    {
+        LOG_INFO( "Unexpected first frame from server: type %u length %u\n", ntohs( Header.Type ), ntohs( Header.Length ) );
+        return SOCKET_ERROR;
+    }
+
+    if( NetReceiveExact( Socket, &Handshake, sizeof( Handshake ) ) <= 0 )
+    {
+        LOG_INFO( "Truncated handshake from server: %d\n", WSAGetLastError( ) );
+        return SOCKET_ERROR;
+    }
+
+    if( Handshake.Version != PROTOCOL_VERSION )
+    {
+        LOG_INFO( "Server speaks protocol version %u, expected %u\n", Handshake.Version, PROTOCOL_VERSION );
+        return SOCKET_ERROR;
+    }
+
+    INT Family = ( Handshake.Family == PROTOCOL_ADDRESS_FAMILY_IPV6 ) ? AF_INET6 : AF_INET;
+    if( inet_ntop( Family, Handshake.ObservedAddress, PublicIpBuffer, (size_t)BufferSize ) == NULL )
+    {
+        LOG_INFO( "Invalid observed address in handshake\n" );
+        return SOCKET_ERROR;
+    }
+
+    *pPublicPort = ntohs( Handshake.ObservedPort );
+    *pClientId = ntohl( Handshake.ClientId );
+    *pToken = ntohl( Handshake.Token );
+    *pCapabilities = ntohl( Handshake.Capabilities );
+
+    LOG_INFO( "Server observed us at %s:%u\n", PublicIpBuffer, *pPublicPort );
+    return 1;
+}
+
+static
+VOID
+NegotiateCompression(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT32 Offered
+)
+{
+    CHAR Setting[16];
+    DWORD SettingSize = GetEnvironmentVariableA( COMPRESSION_VARIABLE, Setting, sizeof( Setting ) );
+
+    CAPABILITIES_MESSAGE Capabilities;
+    Capabilities.Capabilities = Offered & ( PROTOCOL_CAPABILITY_COMPRESSION | PROTOCOL_CAPABILITY_DICTIONARY );
+
+    if( Capabilities.Capabilities == 0 || ( SettingSize > 0 && SettingSize < sizeof( Setting ) && _stricmp( Setting, "off" ) == 0 ) )
+    {
+        return;
+    }
+
+    NET_PACK_MODE Mode = NetPackModeOf( Capabilities.Capabilities );
+    Capabilities.Capabilities = htonl( Capabilities.Capabilities );
+
+    // the server expands our frames only once it has this, nothing else is queued yet to overtake it
+    if( NetMuxSend( Mux, STREAM_CONTROL, MESSAGE_TYPE_CAPABILITIES, &Capabilities, sizeof( Capabilities ) ) == NET_IO_COMPLETE )
+    {
+        NetMuxSetCompression( Mux, STREAM_CHAT, Mode );
+        LOG_INFO( "Compressing chat frames with the server's %s compression\n", ( Mode == NET_PACK_DICTIONARY ) ? "dictionary" : "block" );
+    }
+}
+
+static
+BOOL
+SendFrame(
+    _In_ PNET_MUX Mux,
+    _In_ UINT16 StreamId,
+    _In_ MESSAGE_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    if( Length > MAX_BUFFER_SIZE )
+    {
+        return FALSE;
+    }
+
+    return NetMuxSend( Mux, StreamId, Type, Payload, Length ) == NET_IO_COMPLETE;
+}
+
+static
+DWORD
+WINAPI
+ServerReceiveThread(
+    _In_ LPVOID lpData
+)
+{
+    PCHAT_CONTEXT pChat = (PCHAT_CONTEXT)lpData;
+    NET_CHUNK_POOL Chunks;
+    NET_READ_BUFFER Received;
+    CHAR Scratch[PROTOCOL_MAX_BULK_PAYLOAD_SIZE]; // only for a frame split over two chunks
+    CHAR Expanded[PROTOCOL_MAX_PAYLOAD_SIZE];     // the original of a compressed frame
+    MESSAGE_HEADER Header;
+
+    NetChunkPoolInitialise( &Chunks, 1 );
+    NetBufferInitialise( &Received, &Chunks );
+
+    while( pChat->Connected )
+    {
+        if( NetBufferFill( &Received, pChat->ServerSocket, sizeof( Header ) ) != NET_IO_COMPLETE )
+        {
+            break;
+        }
+
+        NetBufferRead( &Received, &Header, sizeof( Header ) );
+
+        UINT16 WireLength = ntohs( Header.Length );
+        UINT16 StreamId = ntohs( Header.StreamId );
+        UINT16 Flags = ntohs( Header.Flags );
+        if( WireLength > PROTOCOL_MAX_FRAME_PAYLOAD( StreamId ) )
+        {
+            printf( "\nServer sent an oversized frame (%u bytes)\n", WireLength );
+            break;
+        }
+
+        if( !NetMuxReceived( &pChat->Mux, StreamId, WireLength ) )
+        {
+            printf( "\nServer overran the window of stream %u\n", StreamId );
+            break;
+        }
+
+        if( NetBufferFill( &Received, pChat->ServerSocket, WireLength ) != NET_IO_COMPLETE )
+        {
+            break;
+        }
+
+        // bulk frames come from the peer as it sent them, which is never compressed
+        const CHAR* Payload;
+        UINT16 Length;
+        if( ( Flags != 0 && StreamId >= STREAM_BULK ) ||
+            !NetPackExpand( Flags, NetBufferView( &Received, WireLength, Scratch ), WireLength, PROTOCOL_MAX_PAYLOAD_SIZE, Expanded, &Payload, &Length ) )
+        {
+            printf( "\nServer sent a corrupt compressed frame\n" );
+            break;
+        }
+
+        switch( ntohs( Header.Type ) )
+        {
+        case MESSAGE_TYPE_CHAT:
+        {
+            const CHAT_MESSAGE* pMessage = MessageChatView( Payload, Length );
+            if( pMessage == NULL )
+            {
+                LOG_INFO( "Malformed chat message from server\n" );
+                break;
+            }
+
+            UINT16 TextLength;
+            const CHAR* Text = MessageChatTail( pMessage, Length, &TextLength );
+            UINT32 SenderId = MessageChatSenderId( pMessage );
+
+            if( SenderId == pChat->ClientId )
+            {
+                printf( "\nRecieved '%.*s' from %s:%s\n", TextLength, Text, pChat->ServerIp, pChat->ServerPort );
+            }
+            else
+            {
+                printf( "\nRecieved '%.*s' from client %u\n", TextLength, Text, SenderId );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_ACK:
+        {
+            const ACK_MESSAGE* pAck = MessageAckView( Payload, Length );
+            if( pAck != NULL )
+            {
+                LOG_DEBUG( "Server handed on chat message %u\n", MessageAckSequence( pAck ) );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_JOIN:
+        {
+            const JOIN_MESSAGE* pJoin = MessageJoinView( Payload, Length );
+            if( pJoin != NULL )
+            {
+                printf( "\nPaired with client %u\n", MessageJoinClientId( pJoin ) );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_LEAVE:
+        {
+            const LEAVE_MESSAGE* pLeave = MessageLeaveView( Payload, Length );
+            if( pLeave != NULL )
+            {
+                UINT16 Reason = MessageLeaveReason( pLeave );
+                printf( "\nClient %u %s\n",
+                        MessageLeaveClientId( pLeave ),
+                        ( Reason == MESSAGE_LEAVE_QUIT ) ? "left" : ( Reason == MESSAGE_LEAVE_TIMEOUT ) ? "timed out" :
+                        ( Reason == MESSAGE_LEAVE_REPAIRED ) ? "paired with another client" : "disconnected" );
+                TransferPeerUnavailable( &pChat->Transfer );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_PRESENCE:
+        {
+            const PRESENCE_MESSAGE* pPresence = MessagePresenceView( Payload, Length );
+            if( pPresence != NULL )
+            {
+                UINT8 State = MessagePresenceState( pPresence );
+                printf( "\nClient %u is %s\n",
+                        MessagePresenceClientId( pPresence ),
+                        ( State == MESSAGE_PRESENCE_AWAY ) ? "away" : ( State == MESSAGE_PRESENCE_BUSY ) ? "busy" : "back" );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_CONTROL:
+        {
+            const CONTROL_MESSAGE* pControl = MessageControlView( Payload, Length );
+            if( pControl != NULL && MessageControlCommand( pControl ) == MESSAGE_CONTROL_PONG )
+            {
+                printf( "\nServer answered in %llu ms\n", (unsigned long long)( GetTickCount64( ) - MessageControlArgument( pControl ) ) );
+            }
+            else if( pControl != NULL && MessageControlCommand( pControl ) == MESSAGE_CONTROL_PING )
+            {
+                CONTROL_MESSAGE Pong;
+                SendFrame( &pChat->Mux, STREAM_CONTROL, MESSAGE_TYPE_CONTROL, &Pong, MessageControlEncode( &Pong, MESSAGE_CONTROL_PONG, MessageControlArgument( pControl ), NULL, 0 ) );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_ERROR:
+        {
+            const ERROR_MESSAGE* pError = MessageErrorView( Payload, Length );
+            if( pError != NULL )
+            {
+                UINT16 DescriptionLength;
+                const CHAR* Description = MessageErrorTail( pError, Length, &DescriptionLength );
+                printf( "\nServer error %u on message type %u: %.*s\n", MessageErrorCode( pError ), MessageErrorType( pError ), DescriptionLength, Description );
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_PEER_ENDPOINTS:
+            if( pChat->IsPeerEnabled && Length == sizeof( PEER_ENDPOINTS_MESSAGE ) )
+            {
+                const PEER_ENDPOINTS_MESSAGE* pEndpoints = (const PEER_ENDPOINTS_MESSAGE*)Payload;
+                printf( "\nServer introduced peer %u, punching...\n", ntohl( pEndpoints->PeerId ) );
+                PeerSessionBeginPunch( &pChat->Peer, pEndpoints );
+            }
+            break;
+
+        case MESSAGE_TYPE_PEER_UNAVAILABLE:
+            if( Length == sizeof( PEER_UNAVAILABLE_MESSAGE ) )
+            {
+                UINT32 PeerId = ntohl( ( (const PEER_UNAVAILABLE_MESSAGE*)Payload )->PeerId );
+                if( PeerId == 0 )
+                {
+                    // a bulk frame reached the relay before any '/connect' through the server paired us
+                    printf( "\nThe server has not paired you with a peer, files are relayed only to a peer it introduced\n" );
+                }
+                else
+                {
+                    printf( "\nPeer %u is not available\n", PeerId );
+                }
+                TransferPeerUnavailable( &pChat->Transfer );
+            }
+            break;
+
+        case MESSAGE_TYPE_FILE_OFFER:
+        case MESSAGE_TYPE_FILE_ACCEPT:
+        case MESSAGE_TYPE_FILE_DATA:
+            // written to disk from the receive buffer, consumed below like any other frame
+            TransferHandleFrame( &pChat->Transfer, ntohs( Header.Type ), Payload, Length );
+            break;
+
+        case MESSAGE_TYPE_WINDOW_UPDATE:
+            if( !NetMuxWindowUpdate( &pChat->Mux, Payload, Length ) )
+            {
+                LOG_INFO( "Bad window update from server\n" );
+            }
+            break;
+
+        default:
+            LOG_DEBUG( "Ignoring frame type %u from server\n", ntohs( Header.Type ) );
+            break;
+        }
+
+        NetBufferConsume( &Received, WireLength );
+        NetMuxConsumed( &pChat->Mux, StreamId, WireLength );
+    }
+
+    NetBufferCleanUp( &Received );
+    NetChunkPoolCleanUp( &Chunks );
+
+    if( pChat->Connected )
+    {
+        printf( "\nConnection closed by server\n" );
+        pChat->Connected = FALSE;
+    }
+
+    return 0;
+}
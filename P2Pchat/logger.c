@@ -1,4 +1,5 @@
 #include "logger.h"
+#include "logpack.h"
 
 #include <assert.h>
 #include <stdarg.h>
@@ -7,6 +8,8 @@
 #include <time.h>
 #include <errno.h>
 
+#include "winnet.h"
+
 //////////////////////////////////////////
 //
 //          INTERNAL GLOBALS
@@ -23,20 +26,244 @@
 
 #define DEFAULT_LOG_FILE_EXETENSION ".txt" 
 
+#define LOG_RECORD_HEADER_SIZE    (TIMESTAMP_BUFFER_SIZE + MAXIMUM_FILENAME_SIZE + 48) // "[timestamp] [LEVEL] [file:line] "
+
+#define ASYNC_RECORD_SIZE         512      // Records longer than this are truncated in async mode
+#define ASYNC_DEFAULT_CAPACITY    8192     // Slots in the ring, must be a power of two
+#define ASYNC_POLL_INTERVAL       10       // ms the writer sleeps when the ring is empty
+#define ASYNC_BATCH_SIZE          256      // Records written between flushes
+
+typedef struct _LOG_RING_SLOT
+{
+    volatile LONG64 Sequence;                  // Equals the position when free, position + 1 when published
+    LOG_LEVEL       Level;
+    ULONG           Length;
+    CHAR            Record[ASYNC_RECORD_SIZE]; // Formatted line or binary record
+} LOG_RING_SLOT, * PLOG_RING_SLOT;
+
+/**
+* Bounded multi-producer ring (Vyukov). Producers claim a position with a single CAS and publish the
+* slot by bumping its sequence, the writer thread is the only consumer so dequeuing needs no CAS.
+*/
+typedef struct _LOG_RING
+{
+    PLOG_RING_SLOT   Slots;
+    ULONG            Capacity;
+    ULONG            Mask;
+    CHAR             Padding0[64];
+    volatile LONG64  EnqueuePosition;          // Contended by producers, kept on its own cache line
+    CHAR             Padding1[64];
+    volatile LONG64  DequeuePosition;          // Written by the writer thread only
+    CHAR             Padding2[64];
+} LOG_RING, * PLOG_RING;
+
+typedef struct _LOGGER_ASYNC_STATE
+{
+    BOOL                IsEnabled;
+    LOG_RING            Ring;
+    LOG_OVERFLOW_POLICY Policy;
+    LOG_LEVEL           DropBelow;             // Threshold for LOG_OVERFLOW_DROP_BELOW
+    HANDLE              WriterThread;
+    HANDLE              WakeEvent;             // Signalled when the ring fills up or an error is logged
+    volatile LONG       Running;
+    volatile LONG64     Dropped;               // Records lost to a full ring since the last report
+} LOGGER_ASYNC_STATE, * PLOGGER_ASYNC_STATE;
+
+#define SINK_DEFAULT_CAPACITY     1024     // Slots in a console or UDP sink's ring
+#define SINK_BATCH_SIZE           64       // Records a sink writes between flushes
+
+/**
+* Console or UDP sink. Producers copy the already formatted record into the sink's ring, the sink's
+* thread is the only one touching the stream or socket and never takes the logger lock.
+*/
+typedef struct _LOG_SINK_STATE
+{
+    volatile LONG       IsEnabled;
+    volatile LONG       Level;                 // Lowest level the sink takes
+    LOG_FORMAT          Format;                // Text or JSON
+    LOG_RING            Ring;
+    HANDLE              Thread;
+    HANDLE              WakeEvent;             // Signalled when the ring fills up or an error is queued
+    volatile LONG       Running;
+    volatile LONG64     Dropped;               // Records lost to a full ring or socket since the last report
+    FILE*               Stream;                // LOG_SINK_CONSOLE
+    SOCKET              Socket;                // LOG_SINK_UDP
+    struct sockaddr_in  Address;               // LOG_SINK_UDP, the collector
+} LOG_SINK_STATE, * PLOG_SINK_STATE;
+
+#define ROTATION_CHECK_INTERVAL   60000    // ms between checks of the wall clock, catches clock changes
+#define ROTATION_PREPARE_MARGIN   60000    // ms before midnight the next day's file is opened
+#define ROTATION_MINIMUM_SIZE     65536    // Smallest size limit, a file always fits a few records
+
+#define SEGMENT_SIZE              ( 1024 * 1024 ) // Bytes of a log file mapped at a time, a multiple of 64 KB
+#define FLUSH_INTERVAL            1000     // ms between flushes of the mapped segment
+#define FLUSH_SIZE                ( 256 * 1024 )  // Unflushed bytes that bring the next flush forward
+
+#define RECORDER_DEFAULT_RECORDS  256      // Records kept per thread, must be a power of two
+#define RECORDER_ARGUMENT_SIZE    200      // Raw arguments or message kept per record, truncated beyond
+
+/**
+* One captured record. The owning thread zeroes the sequence before it overwrites the slot and sets it
+* to the record's index + 1 when done, a dump copies the slot and keeps it only if the sequence read
+* before and after the copy is that index + 1.
+*/
+typedef struct _LOG_RECORDER_SLOT
+{
+    volatile LONG64 Sequence;
+    PLOG_SITE       Site;
+    DWORD           ThreadId;
+    BOOL            IsText;                            // Arguments holds the formatted message
+    UINT64          Ticks;
+    ULONG           Length;                            // Bytes of raw arguments
+    CHAR            Arguments[RECORDER_ARGUMENT_SIZE];
+} LOG_RECORDER_SLOT, * PLOG_RECORDER_SLOT;
+
+/**
+* Circular buffer of one thread, written without locking by that thread only. The ring of a thread
+* that exits is handed to the next thread that needs one, its records stay until they are overwritten.
+*/
+typedef struct _LOG_RECORDER_RING
+{
+    struct _LOG_RECORDER_RING* Next;
+    volatile LONG              IsOwned;
+    volatile LONG64            Head;                   // Index of the next record
+    LONG64                     Dumped;                 // Head at the last dump, guarded by the logger lock
+    PLOG_RECORDER_SLOT         Slots;
+} LOG_RECORDER_RING, * PLOG_RECORDER_RING;
+
+typedef struct _LOGGER_RECORDER_STATE
+{
+    BOOL               IsEnabled;
+    LOG_LEVEL          CaptureLevel;                   // Lowest level kept in memory
+    ULONG              Capacity;                       // Records per ring
+    DWORD              FlsIndex;                       // Ring of the calling thread
+    PLOG_RECORDER_RING Rings;                          // Every ring, guarded by the logger lock
+    INT64              TicksPerSecond;                 // Clock of the text timestamps
+    INT64              BaseTicks;
+    UINT64             BaseTime;                       // Local FILETIME at BaseTicks
+} LOGGER_RECORDER_STATE, * PLOGGER_RECORDER_STATE;
+
+#define RATE_LIMIT_SUMMARY        "last message repeated %ld times" // Written for a site's records dropped by the rate limit
+
+/**
+* Per call site token bucket, kept as the time the site's bucket is empty until (GCRA). A record
+* takes one Interval from the bucket, it is dropped while the bucket is more than Window ahead of
+* the clock. A single compare-exchange updates it, so checking costs no lock.
+*/
+typedef struct _LOGGER_RATE_LIMIT
+{
+    INT64 Interval;                                     // Performance counter ticks per record, 0 for no limit
+    INT64 Window;                                       // Ticks the bucket may run ahead of the clock, Burst - 1 intervals
+} LOGGER_RATE_LIMIT, * PLOGGER_RATE_LIMIT;
+
+/**
+* Log file the logger writes to. Files are written through a mapped segment of SEGMENT_SIZE bytes
+* that is preallocated on disk, so a record is a copy into memory and costs no system call. The
+* console is written through its stdio stream.
+*/
+typedef struct _LOG_FILE
+{
+    FILE*  Stream;                                      // Console stream, NULL for a mapped file
+    HANDLE Handle;                                      // Mapped file, NULL for the console
+    PSTR   View;                                        // Segment the next record goes to
+    UINT64 ViewOffset;                                  // File offset of View
+    ULONG  Used;                                        // Bytes of View holding records
+    ULONG  Flushed;                                     // Bytes of View already flushed
+} LOG_FILE, * PLOG_FILE;
+
+/**
+* Background thread that keeps file system work away from the write path: it opens the next file
+* ahead of a switch, closes the files switched away from, flushes the mapped segment and enforces
+* retention.
+*/
+typedef struct _LOGGER_MAINTENANCE_STATE
+{
+    BOOL          IsEnabled;
+    HANDLE        Thread;
+    HANDLE        WakeEvent;
+    volatile LONG Running;
+    BOOL          IsCleanUpPending;                     // Retention scan requested
+    BOOL          IsPreparePending;                     // NextFilename should be opened
+    BOOL          IsFlushPending;                       // FLUSH_SIZE bytes are waiting to be flushed
+    SYSTEMTIME    NextDate;                             // Date and part of the file being prepared
+    ULONG         NextPart;
+    CHAR          NextFilename[MAXIMUM_FILENAME_SIZE];
+    LOG_FILE      NextFile;                             // Opened ahead of the switch, closed until ready
+    BOOL          IsNextEmpty;                          // NextFile was created by the preparation
+    LOG_FILE      RetiredFile;                          // Switched away from, closed by the thread
+    CHAR          RetiredFilename[MAXIMUM_FILENAME_SIZE];
+    BOOL          IsRetiredUnused;                      // RetiredFile was prepared, never written and is deleted
+} LOGGER_MAINTENANCE_STATE, * PLOGGER_MAINTENANCE_STATE;
+
+/**
+* Low priority thread that compresses the files the logger rotated away from, so only the file
+* being written stays uncompressed. Woken whenever a retired file has been closed.
+*/
+typedef struct _LOGGER_COMPRESSION_STATE
+{
+    BOOL          IsEnabled;
+    HANDLE        Thread;
+    HANDLE        WakeEvent;
+    volatile LONG Running;                              // Also stops a file half way through
+} LOGGER_COMPRESSION_STATE, * PLOGGER_COMPRESSION_STATE;
+
+/**
+* Time index of the current file, one entry per span of about LOG_INDEX_INTERVAL bytes. The span
+* being written keeps the earliest and latest time of its records, as timestamps for text and JSON
+* files and as ticks for binary ones, and becomes an entry once the next record would take it past
+* the interval.
+*/
+typedef struct _LOG_INDEX_STATE
+{
+    HANDLE             Handle;                          // Index file, opened with the first entry
+    UINT64             SpanOffset;                      // File offset the span being written starts at
+    BOOL               HasTime;                         // A record of the span carried a time
+    CHAR               Earliest[TIMESTAMP_BUFFER_SIZE]; // Text and JSON files, YYYY-MM-DD HH:MM:SS.mmm
+    CHAR               Latest[TIMESTAMP_BUFFER_SIZE];
+    UINT64             EarliestTicks;                   // Binary files
+    UINT64             LatestTicks;
+    LOG_SESSION_RECORD Session;                         // Binary files, ties the ticks to the wall clock
+} LOG_INDEX_STATE, * PLOG_INDEX_STATE;
+
 typedef struct _LOGGER_STATE
 {
     CRITICAL_SECTION Lock;                                   // Critical section for thread safety
-    FILE*            FileStream;                             // File stream for logging
+    LOG_FILE         File;                                   // Mapped log file or console stream
     CHAR             BaseFilePath[MAXIMUM_FILENAME_SIZE];    // Base filename for log files
     CHAR             CurrentFilename[MAXIMUM_FILENAME_SIZE]; // Current log file name
-    LOG_LEVEL        Level;                                  // Current log level
     BOOL             IsInitialized;                          // Flag to check if logger is initialized
-    SYSTEMTIME       LastRotationTime;                       // Last time the log file was rotated
+    SYSTEMTIME       LastRotationTime;                       // Date of the current log file
+    ULONGLONG        NextDayTick;                            // GetTickCount64() at the next local midnight
+    ULONGLONG        NextClockTick;                          // GetTickCount64() at which the date is checked again
+    UINT64           MaximumFileSize;                        // Bytes per file before the next part starts, 0 for no limit
+    UINT64           FileSize;                               // Bytes in the current file
+    ULONG            FilePart;                               // 0 for YYYY-MM-DD.txt, n for YYYY-MM-DD.n.txt
+    LOGGER_MAINTENANCE_STATE Maintenance;                    // Rotation and retention thread, files only
+    LOGGER_COMPRESSION_STATE Compression;                    // Compresses rotated files, files only
+    LOG_INDEX_STATE  Index;                                  // Time index of the current file, files only
     INT64            MaximumFileAgeDays;                     // Maximum age of log files in days
+    LOGGER_ASYNC_STATE Async;                                // Ring and writer thread when async mode is on
+    LOG_FORMAT       Format;                                 // Text, binary or JSON records, files only
+    ULONG            DefinedFormats[LOG_MAX_SITES / 32];     // Format ids already described in the current binary file
+    LOGGER_RECORDER_STATE Recorder;                          // Per thread rings when the flight recorder is on
+    LOGGER_RATE_LIMIT RateLimit;                             // Per site token buckets, off while Interval is 0
+    LOG_SINK_STATE   Sinks[LOG_SINK_COUNT];                  // Console and UDP sinks, the other entries are unused
 } LOGGER_STATE, * PLOGGER_STATE;
 
 static LOGGER_STATE GlobalLoggerState = { 0 };
 
+volatile LONG LoggerThreshold = LOG_THRESHOLD_OFF;
+
+// Lowest level written out, LoggerThreshold is lower while the flight recorder captures more
+static volatile LONG LoggerWriteLevel = LOG_THRESHOLD_OFF;
+
+// Registered call sites, indexed by format id. Kept across LoggerCleanUp since the sites are static.
+static PLOG_SITE     LoggerSites[LOG_MAX_SITES] = { 0 };
+static volatile LONG LoggerNextFormatId = 0;
+
+// Sites with records dropped by the rate limit that were not reported yet, linked through NextSuppressed
+static PLOG_SITE volatile LoggerSuppressedSites = NULL;
+
 // Simple mapping of log levels to names
 static 
 PCSTR LOG_LEVEL_NAMES[] = {
@@ -56,6 +283,23 @@ PCSTR LOG_LEVEL_NAMES[] = {
 //
 //////////////////////////////////////////
 
+/**
+* @return Extension of the log files for the current format.
+*/
+static
+PCSTR
+LoggerFileExtension(
+    VOID
+)
+{
+    switch( GlobalLoggerState.Format )
+    {
+    case LOG_FORMAT_BINARY: return LOG_BINARY_EXTENSION;
+    case LOG_FORMAT_JSON:   return LOG_JSON_EXTENSION;
+    default:                return DEFAULT_LOG_FILE_EXETENSION;
+    }
+}
+
 /**
 * Internal helper for getting current time in format YYYY-MM-DD HH:MM:SS.mmm.
 * 
@@ -134,6 +378,7 @@ LoggerDateString(
 * Creates a file, with the name based on the current date and base file path.
 * 
 * @param SystemTime Pointer to SYSTEMTIME structure containing the current date and time.
+* @param Part       0 for the day's first file, n for the part started when file n - 1 was full.
 * @param Filename   Pointer to a buffer where the filename will be stored.
 * @param FilenameSize Size of the Filename buffer.
 * 
@@ -143,6 +388,7 @@ static
 BOOL
 LoggerCreateFilename(
     _In_  const SYSTEMTIME* SystemTime,
+    _In_  ULONG Part,
     _Out_ PSTR Filename,
     _Out_ ULONG FilenameSize
 )
@@ -158,16 +404,163 @@ LoggerCreateFilename(
         return FALSE;
     }
 
-    INT Result = _snprintf_s(
-        Filename,
-        FilenameSize,
+    INT Result;
+
+    if( Part == 0 )
+    {
+        Result = _snprintf_s(
+            Filename,
+            FilenameSize,
+            _TRUNCATE,
+            "%s\\%s%s",
+            GlobalLoggerState.BaseFilePath,
+            DateString,
+            LoggerFileExtension()
+        );
+    }
+    else
+    {
+        Result = _snprintf_s(
+            Filename,
+            FilenameSize,
+            _TRUNCATE,
+            "%s\\%s.%lu%s",
+            GlobalLoggerState.BaseFilePath,
+            DateString,
+            (unsigned long)Part,
+            LoggerFileExtension()
+        );
+    }
+
+    return Result > 0;
+}
+
+/**
+* Parses the name of a log file: YYYY-MM-DD or YYYY-MM-DD.n followed by the extension of the current
+* format, and LOG_PACK_EXTENSION once the file is compressed or LOG_INDEX_EXTENSION for its time
+* index. Files of older rotations, YYYY-MM-DD_HH_MM_SS.mmm, count as part 0 of their day.
+* 
+* @param Name     File name without the directory.
+* @param Date     Receives the date of the file.
+* @param Part     Receives the part of the day.
+* @param IsPacked Receives TRUE for a compressed file.
+* @param IsIndex  Optional, receives TRUE for the time index of a file.
+* 
+* @return TRUE if the name is one the logger writes, FALSE otherwise.
+*/
+static
+BOOL
+LoggerParseFilename(
+    _In_      PCSTR Name,
+    _Out_     PSYSTEMTIME Date,
+    _Out_     PULONG Part,
+    _Out_     PBOOL IsPacked,
+    _Out_opt_ PBOOL IsIndex
+)
+{
+    memset(Date, 0, sizeof(*Date));
+    *Part = 0;
+    *IsPacked = FALSE;
+
+    if( IsIndex != NULL )
+    {
+        *IsIndex = FALSE;
+    }
+
+    if( strnlen( Name, 11 ) != 11 || ( Name[10] != '.' && Name[10] != '_' ) ||
+        sscanf_s( Name, "%4hu-%2hu-%2hu", &Date->wYear, &Date->wMonth, &Date->wDay ) != 3 )
+    {
+        return FALSE;
+    }
+
+    PCSTR Extension = strstr(Name + 10, LoggerFileExtension());
+    if( Extension == NULL )
+    {
+        return FALSE;
+    }
+
+    PCSTR Suffix = Extension + strlen(LoggerFileExtension());
+    if( *Suffix != '\0' && strcmp( Suffix, LOG_PACK_EXTENSION ) != 0 && strcmp( Suffix, LOG_INDEX_EXTENSION ) != 0 )
+    {
+        return FALSE;
+    }
+
+    *IsPacked = strcmp( Suffix, LOG_PACK_EXTENSION ) == 0;
+
+    if( IsIndex != NULL )
+    {
+        *IsIndex = strcmp( Suffix, LOG_INDEX_EXTENSION ) == 0;
+    }
+
+    if( Name[10] == '.' && Extension != Name + 10 )
+    {
+        PSTR End = NULL;
+        *Part = strtoul(Name + 11, &End, 10);
+
+        if( End != Extension || *Part == 0 )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+* Finds the part of the day a restarted logger continues with: the last part written to, or the one
+* after it if that part has been compressed already. A compressed part is never opened again.
+* 
+* @param Date Date of the file about to be opened.
+* 
+* @return Part to open, 0 if the day has no files yet.
+*/
+static
+ULONG
+LoggerFindLastPart(
+    _In_ const SYSTEMTIME* Date
+)
+{
+    CHAR DateString[TIMESTAMP_BUFFER_SIZE] = { 0 };
+    if( !LoggerDateString( Date, DateString, sizeof(DateString) ) )
+    {
+        return 0;
+    }
+
+    CHAR SearchPattern[MAXIMUM_FILENAME_SIZE] = { 0 };
+    _snprintf_s(
+        SearchPattern,
+        sizeof(SearchPattern),
         _TRUNCATE,
-        "%s\\%s"DEFAULT_LOG_FILE_EXETENSION"",
+        "%s\\%s*",
         GlobalLoggerState.BaseFilePath,
         DateString
     );
 
-    return Result > 0;
+    WIN32_FIND_DATAA FindData;
+    HANDLE FindHandle = FindFirstFileA(SearchPattern, &FindData);
+
+    if( FindHandle == INVALID_HANDLE_VALUE )
+    {
+        return 0;
+    }
+
+    ULONG LastPart = 0;
+
+    do
+    {
+        SYSTEMTIME FileDate;
+        ULONG      Part;
+        BOOL       IsPacked;
+
+        if( LoggerParseFilename( FindData.cFileName, &FileDate, &Part, &IsPacked, NULL ) && FindData.cFileName[10] != '_' )
+        {
+            LastPart = max(LastPart, IsPacked ? Part + 1 : Part);
+        }
+    } while( FindNextFileA( FindHandle, &FindData ) );
+
+    FindClose(FindHandle);
+
+    return LastPart;
 }
 
 /**
@@ -230,7 +623,9 @@ LoggerDifferenceInDays(
 }
 
 /**
-* Cleans up old log files based on the maximum file age set in the logger state.
+* Cleans up old log files based on the maximum file age set in the logger state, compressed ones
+* included. Runs on the maintenance thread, only reads state that is fixed while the logger is
+* initialised.
 */
 static
 VOID
@@ -247,90 +642,60 @@ LoggerCleanUpDatedFiles(
     GetLocalTime(&CurrentTime);
     LoggerDifferenceInDays(&CurrentTime, GlobalLoggerState.MaximumFileAgeDays);
 
-    CHAR Filename[MAXIMUM_FILENAME_SIZE] = { 0 };
-
-
-    CHAR SearchPattern[MAXIMUM_FILENAME_SIZE] = { 0 };
-    _snprintf_s(
-        SearchPattern, 
-        sizeof(SearchPattern), 
-        _TRUNCATE,
-        "%s\\*.txt", 
-        GlobalLoggerState.BaseFilePath
-    );
-
-    WIN32_FIND_DATAA FindData;
-    HANDLE FindHandle = FindFirstFileA(SearchPattern, &FindData);
-
-    if (FindHandle == INVALID_HANDLE_VALUE)
-    {
-        return; // No files found
-    }
+    FILETIME CutoffTime;
+    SystemTimeToFileTime(&CurrentTime, &CutoffTime);
 
-    BOOL FileFound = TRUE;
+    // plain files first, then the compressed ones and the time indexes
+    PCSTR Suffixes[] = { "", LOG_PACK_EXTENSION, LOG_INDEX_EXTENSION };
 
-    while( FileFound )
+    for( ULONG i = 0; i < ARRAYSIZE( Suffixes ); ++i )
     {
-        PSTR DateStart = FindData.cFileName; 
-
-        if (DateStart == NULL)
-        {
-            continue; // Invalid filename format
-        }
-
-        PSTR DateEnd = strstr(DateStart, ".txt"); // Find the end of the date part
-
-        if (DateEnd == NULL || ( DateEnd - DateStart ) != 10 )
-        {
-            continue; // Invalid filename format
-        }
+        CHAR SearchPattern[MAXIMUM_FILENAME_SIZE] = { 0 };
+        _snprintf_s(
+            SearchPattern, 
+            sizeof(SearchPattern), 
+            _TRUNCATE,
+            "%s\\*%s%s", 
+            GlobalLoggerState.BaseFilePath,
+            LoggerFileExtension(),
+            Suffixes[i]
+        );
 
-        CHAR DateString[TIMESTAMP_BUFFER_SIZE] = { 0 };
-        strncpy_s(
-            DateString, 
-            sizeof(DateString),
-            DateStart, 
-            DateEnd - DateStart
-        ); // Copy date part
+        WIN32_FIND_DATAA FindData;
+        HANDLE FindHandle = FindFirstFileA(SearchPattern, &FindData);
 
-        SYSTEMTIME FindDataTime = { 0 };
-        if( sscanf_s(
-            DateString,
-            "%4hu-%2hu-%2hu",
-            &FindDataTime.wYear,
-            &FindDataTime.wMonth,
-            &FindDataTime.wDay
-        ) != 3)
+        if (FindHandle == INVALID_HANDLE_VALUE)
         {
-            continue; // Failed to parse date
+            continue; // No files found
         }
 
-        FILETIME FileTime;
-        FILETIME CutoffTime;
-
-        SystemTimeToFileTime(&FindDataTime, &FileTime);
-        SystemTimeToFileTime(&CurrentTime, &CutoffTime);
-
-        if (CompareFileTime(&FileTime, &CutoffTime) < 0)
+        do
         {
-            // Create full path to the file to delete
-            CHAR FullPath[MAXIMUM_FILENAME_SIZE] = { 0 };
-            _snprintf_s(
-                FullPath,
-                sizeof(FullPath),
-                _TRUNCATE,
-                "%s\\%s",
-                GlobalLoggerState.BaseFilePath,
-                FindData.cFileName
-            );
+            SYSTEMTIME FindDataTime;
+            ULONG      Part;
+            BOOL       IsPacked;
+            FILETIME   FileTime;
 
-            DeleteFileA(FullPath);
-        }
+            if( LoggerParseFilename( FindData.cFileName, &FindDataTime, &Part, &IsPacked, NULL ) &&
+                SystemTimeToFileTime( &FindDataTime, &FileTime ) && CompareFileTime( &FileTime, &CutoffTime ) < 0 )
+            {
+                // Create full path to the file to delete
+                CHAR FullPath[MAXIMUM_FILENAME_SIZE] = { 0 };
+                _snprintf_s(
+                    FullPath,
+                    sizeof(FullPath),
+                    _TRUNCATE,
+                    "%s\\%s",
+                    GlobalLoggerState.BaseFilePath,
+                    FindData.cFileName
+                );
 
-        FileFound = FindNextFileA(FindHandle, &FindData); // Get next file
-    } 
+                DeleteFileA(FullPath);
+            }
+        } while( FindNextFileA( FindHandle, &FindData ) );
 
-    FindClose(FindHandle);
+        FindClose(FindHandle);
+    }
 }
 
 /**
@@ -361,284 +726,3853 @@ LoggerIsRotationNeeded(
     ) == FALSE; // If current date is different from last rotation date, rotation is needed.
 }
 
+//////////////////////////////////////////
+//
+//          TIME INDEX
+//
+//////////////////////////////////////////
+
 /**
-* Creates a new log file name based on the current date.
+* Finds the timestamp of a text or JSON record.
 * 
-* @param NewFilename     Pointer to a buffer where the new filename will be stored.
-* @param NewFilenameSize Size of the NewFilename buffer.
-* 
-* @return TRUE if the new filename was created successfully, FALSE otherwise.
+* @return The timestamp, NULL if the record does not start with one.
 */
 static
-BOOL
-LoggerCreateRotateFile(
-    PSTR NewFilename,
-    ULONG NewFilenameSize
+PCSTR
+LoggerIndexRecordTime(
+    _In_ PCSTR Record,
+    _In_ ULONG Length
 )
 {
-    if (NewFilename == NULL || NewFilenameSize < MAXIMUM_FILENAME_SIZE)
-    {
-        return FALSE; // Invalid parameters
-    }
+    ULONG Offset = 1; // "[YYYY-MM-DD HH:MM:SS.mmm]"
 
-    CHAR TimestampBuffer[TIMESTAMP_BUFFER_SIZE] = { 0 };
-    if (!LoggerTimestamp( TimestampBuffer, sizeof(TimestampBuffer) ) )
+    if( GlobalLoggerState.Format == LOG_FORMAT_JSON )
     {
-        return FALSE; // Failed to get timestamp
-    }
-    
-    for ( PSTR p = TimestampBuffer; *p; ++p )
-    {
-        if (*p == ' ' || *p == ':')
+        Offset = sizeof(LOG_JSON_TIME_PREFIX) - 1;
+        if( Length < Offset || memcmp( Record, LOG_JSON_TIME_PREFIX, Offset ) != 0 )
         {
-            *p = '_'; // Make sure filename is vlaid 
+            return NULL;
         }
     }
+    else if( Length == 0 || Record[0] != '[' )
+    {
+        return NULL;
+    }
 
-    INT Result = _snprintf_s(
-        NewFilename,
-        NewFilenameSize,
-        _TRUNCATE,
-        "%s\\%s"DEFAULT_LOG_FILE_EXETENSION"",
-        GlobalLoggerState.BaseFilePath,
-        TimestampBuffer
-    );
-
-    return Result > 0; // TRUE if filename was created successfully
+    return ( Length >= Offset + TIMESTAMP_BUFFER_SIZE ) ? Record + Offset : NULL;
 }
 
 /**
-* Attempts to rotate the log file if needed.
-* 
-* @return TRUE if rotation was successful, FALSE otherwise.
+* Widens the time range of the span being written by one record. The caller holds
+* GlobalLoggerState.Lock.
 */
-static 
-BOOL
-LoggerTryRotation(
-    VOID
+static
+VOID
+LoggerIndexAddLocked(
+    _In_ PCSTR Record,
+    _In_ ULONG Length
 )
 {
-    SYSTEMTIME CurrentTime;
-    GetLocalTime(&CurrentTime);
+    PLOG_INDEX_STATE Index = &GlobalLoggerState.Index;
 
-    if( !LoggerIsRotationNeeded( &CurrentTime ) )
+    if( GlobalLoggerState.Format == LOG_FORMAT_BINARY )
     {
-        return FALSE; // Rotation is not needed
+        LOG_RECORD_HEADER Header;
+        UINT64            Ticks;
+
+        memcpy(&Header, Record, sizeof(Header));
+
+        if( Header.Type == LOG_RECORD_EVENT )
+        {
+            memcpy(&Ticks, Record + sizeof(Header) + FIELD_OFFSET(LOG_EVENT_RECORD, Ticks), sizeof(Ticks));
+        }
+        else if( Header.Type == LOG_RECORD_TEXT )
+        {
+            memcpy(&Ticks, Record + sizeof(Header) + FIELD_OFFSET(LOG_TEXT_RECORD, Ticks), sizeof(Ticks));
+        }
+        else
+        {
+            return;
+        }
+
+        if( !Index->HasTime || Ticks < Index->EarliestTicks )
+        {
+            Index->EarliestTicks = Ticks;
+        }
+
+        if( !Index->HasTime || Ticks > Index->LatestTicks )
+        {
+            Index->LatestTicks = Ticks;
+        }
+
+        Index->HasTime = TRUE;
+        return;
     }
 
-    if( GlobalLoggerState.FileStream != NULL )
+    // timestamps of one layout compare as strings
+    PCSTR Time = LoggerIndexRecordTime(Record, Length);
+    if( Time == NULL )
     {
-        fclose( GlobalLoggerState.FileStream );
-        GlobalLoggerState.FileStream = NULL;
+        return;
     }
 
-    CHAR NewFilename[MAXIMUM_FILENAME_SIZE] = { 0 };
-    if( !LoggerCreateRotateFile( NewFilename, sizeof(NewFilename)) )
+    ULONG TimeLength = TIMESTAMP_BUFFER_SIZE - 1;
+
+    if( !Index->HasTime || memcmp( Time, Index->Earliest, TimeLength ) < 0 )
     {
-        return FALSE; // Failed to create new filename
+        memcpy(Index->Earliest, Time, TimeLength);
     }
 
-    errno_t ErrorOpen = fopen_s(&GlobalLoggerState.FileStream, NewFilename, "a");
-    if ( ErrorOpen != 0 || GlobalLoggerState.FileStream == NULL )
+    if( !Index->HasTime || memcmp( Time, Index->Latest, TimeLength ) > 0 )
     {
-        return FALSE; // Failed to open new log file
+        memcpy(Index->Latest, Time, TimeLength);
     }
 
-    strncpy_s(
-        GlobalLoggerState.CurrentFilename,
-        sizeof(GlobalLoggerState.CurrentFilename),
-        NewFilename,
-        _TRUNCATE
-    );
-
-    GlobalLoggerState.LastRotationTime = CurrentTime; // Update last rotation time
-
-    LoggerCleanUpDatedFiles(); // Clean up old files
-
-    return TRUE;
+    Index->HasTime = TRUE;
 }
 
 /**
-* Writes a log message to the file stream with the specified log level, filename, line number, and format string.
+* Converts a time kept for the span being written.
 * 
-* @param Level      The log level of the message.
-* @param Filename   The name of the file where the log message is being written.
-* @param LineNumber The line number in the file where the log message is being written.
-* @param Format     The format string for the log message.
-* @param Args       The variable argument list containing the values to format into the log message.
+* @param Time  Timestamp of a text or JSON file.
+* @param Ticks Ticks of a binary file.
 * 
-* @return VOID
+* @return Local FILETIME, 0 if it cannot be converted.
 */
 static
-VOID
-LoggerWriteToFile(
-    _In_ LOG_LEVEL Level,
-    _In_ PCSTR Filename,
-    _In_ UINT64 LineNumber,
-    _In_ PCSTR Format,
-    _In_ va_list Args
+UINT64
+LoggerIndexTime(
+    _In_ PCSTR Time,
+    _In_ UINT64 Ticks
 )
 {
-    if( Filename == NULL || Format == NULL )
-    {
-        return; // Invalid parameters
-    }
+    PLOG_INDEX_STATE Index = &GlobalLoggerState.Index;
 
-    if( Level < LOG_LEVEL_NONE || Level > LOG_LEVEL_FATAL )
+    if( GlobalLoggerState.Format != LOG_FORMAT_BINARY )
     {
-        return; // Invalid log level
-    }
+        CHAR Line[TIMESTAMP_BUFFER_SIZE + 2];
+        INT  Length = _snprintf_s(Line, sizeof(Line), _TRUNCATE, "[%s]", Time);
 
-    CHAR Timestamp[TIMESTAMP_BUFFER_SIZE] = { 0 };
-    if( !LoggerTimestamp(Timestamp, sizeof(Timestamp)) )
-    {
-        return; // Failed to get timestamp
+        return ( Length > 0 ) ? LogPackLineTime( (const UINT8*)Line, (ULONG)Length ) : 0;
     }
 
-    CHAR LogMessage[MAXIMUM_LOG_MESSAGE_SIZE] = { 0 };
-    INT64 MessageLength = _vsnprintf_s(
-        LogMessage,
-        sizeof(LogMessage),
-        _TRUNCATE,
-        Format,
-        Args
-    );
-
-    if (MessageLength < 0)
+    if( Index->Session.TicksPerSecond == 0 )
     {
-        return; // Failed to format log message
+        return 0;
     }
 
-    EnterCriticalSection(&GlobalLoggerState.Lock);
-
-    SYSTEMTIME CurrentTime;
-    GetLocalTime(&CurrentTime);
-    BOOL IsRotationNeeded = LoggerIsRotationNeeded(&CurrentTime);
+    // records queued before a rotation may be older than the session
+    INT64 Delta = (INT64)( Ticks - Index->Session.BaseTicks );
+    INT64 Frequency = (INT64)Index->Session.TicksPerSecond;
+    INT64 Offset = ( Delta / Frequency ) * 10000000LL + ( ( Delta % Frequency ) * 10000000LL ) / Frequency;
 
-    if( IsRotationNeeded && !LoggerTryRotation() )
-    {
-        LeaveCriticalSection(&GlobalLoggerState.Lock);
-        return; // Rotation failed, do not log
-    }
+    return Index->Session.BaseTime + Offset;
+}
 
-    if (GlobalLoggerState.FileStream == NULL)
+/**
+* Appends the span being written to the index, opening the index with its first entry, and starts
+* the next span at the end of the file. Does nothing for an empty span. The caller holds
+* GlobalLoggerState.Lock.
+*/
+static
+VOID
+LoggerIndexWriteSpanLocked(
+    VOID
+)
+{
+    PLOG_INDEX_STATE Index = &GlobalLoggerState.Index;
+
+    if( GlobalLoggerState.BaseFilePath[0] == '\0' || GlobalLoggerState.FileSize <= Index->SpanOffset )
+    {
+        return;
+    }
+
+    if( Index->Handle == NULL )
+    {
+        CHAR Filename[MAXIMUM_FILENAME_SIZE] = { 0 };
+        _snprintf_s(Filename, sizeof(Filename), _TRUNCATE, "%s%s", GlobalLoggerState.CurrentFilename, LOG_INDEX_EXTENSION);
+
+        // appends only, readers see whole entries
+        HANDLE Handle = CreateFileA(
+            Filename,
+            FILE_APPEND_DATA,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+
+        LARGE_INTEGER Size;
+
+        if( Handle != INVALID_HANDLE_VALUE && GetFileSizeEx( Handle, &Size ) )
+        {
+            LOG_INDEX_HEADER Header = { LOG_INDEX_MAGIC, LOG_INDEX_VERSION, 0 };
+            DWORD            Written = 0;
+
+            Header.Flags = ( GlobalLoggerState.Format == LOG_FORMAT_BINARY ) ? LOG_PACK_FLAG_BINARY : 0;
+
+            if( Size.QuadPart == 0 && !WriteFile( Handle, &Header, sizeof(Header), &Written, NULL ) )
+            {
+                CloseHandle(Handle);
+                Handle = INVALID_HANDLE_VALUE;
+            }
+        }
+
+        // a file without an index is read whole, the span is given up but the next one is tried again
+        Index->Handle = ( Handle != INVALID_HANDLE_VALUE ) ? Handle : NULL;
+    }
+
+    if( Index->Handle != NULL )
+    {
+        LOG_PACK_BLOCK Entry = { 0 };
+        DWORD          Written = 0;
+
+        Entry.Offset = Index->SpanOffset;
+        Entry.Length = (UINT32)( GlobalLoggerState.FileSize - Index->SpanOffset );
+        Entry.PackedLength = Entry.Length;
+
+        if( Index->HasTime )
+        {
+            Entry.EarliestTime = LoggerIndexTime(Index->Earliest, Index->EarliestTicks);
+            Entry.LatestTime = LoggerIndexTime(Index->Latest, Index->LatestTicks);
+        }
+
+        WriteFile(Index->Handle, &Entry, sizeof(Entry), &Written, NULL);
+    }
+
+    Index->SpanOffset = GlobalLoggerState.FileSize;
+    Index->HasTime = FALSE;
+}
+
+/**
+* Ends the span being written if the next record would take it past LOG_INDEX_INTERVAL, so spans
+* end on records. The caller holds GlobalLoggerState.Lock.
+* 
+* @param Length Length of the record about to be written.
+*/
+static
+VOID
+LoggerIndexSplitLocked(
+    _In_ ULONG Length
+)
+{
+    UINT64 SpanLength = GlobalLoggerState.FileSize - GlobalLoggerState.Index.SpanOffset;
+
+    if( SpanLength > 0 && SpanLength + Length > LOG_INDEX_INTERVAL )
+    {
+        LoggerIndexWriteSpanLocked();
+    }
+}
+
+/**
+* Writes the last span of the current file and closes its index. The caller holds
+* GlobalLoggerState.Lock.
+*/
+static
+VOID
+LoggerIndexCloseLocked(
+    VOID
+)
+{
+    PLOG_INDEX_STATE Index = &GlobalLoggerState.Index;
+
+    LoggerIndexWriteSpanLocked();
+
+    if( Index->Handle != NULL )
+    {
+        CloseHandle(Index->Handle);
+    }
+
+    memset(Index, 0, sizeof(*Index));
+}
+
+/**
+* Starts the index of a freshly opened file, before anything is written to it. Bytes an earlier run
+* left without an entry stay unindexed, the first span starts at the end of the file. The caller
+* holds GlobalLoggerState.Lock or is initialising the logger.
+*/
+static
+VOID
+LoggerIndexBeginLocked(
+    VOID
+)
+{
+    PLOG_INDEX_STATE Index = &GlobalLoggerState.Index;
+
+    Index->SpanOffset = GlobalLoggerState.FileSize;
+    Index->HasTime = FALSE;
+}
+
+//////////////////////////////////////////
+//
+//          LOG FILES
+//
+//////////////////////////////////////////
+
+/**
+* @return TRUE if the file is open.
+*/
+static
+BOOL
+LoggerFileIsOpen(
+    _In_ const LOG_FILE* File
+)
+{
+    return File->Stream != NULL || File->Handle != NULL;
+}
+
+/**
+* Maps the segment starting at the given offset, growing the file to cover it.
+* 
+* @param File   Open log file.
+* @param Offset File offset of the segment, a multiple of SEGMENT_SIZE.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerFileMapSegment(
+    _Inout_ PLOG_FILE File,
+    _In_    UINT64 Offset
+)
+{
+    UINT64 End = Offset + SEGMENT_SIZE;
+
+    // a mapping larger than the file extends it, which preallocates the whole segment
+    HANDLE Mapping = CreateFileMappingA(File->Handle, NULL, PAGE_READWRITE, (DWORD)( End >> 32 ), (DWORD)End, NULL);
+    if( Mapping == NULL )
+    {
+        return FALSE;
+    }
+
+    PSTR View = (PSTR)MapViewOfFile(Mapping, FILE_MAP_WRITE, (DWORD)( Offset >> 32 ), (DWORD)Offset, SEGMENT_SIZE);
+    CloseHandle(Mapping); // the view keeps the mapping alive
+
+    if( View == NULL )
+    {
+        return FALSE;
+    }
+
+    File->View = View;
+    File->ViewOffset = Offset;
+    File->Used = 0;
+    File->Flushed = 0;
+
+    return TRUE;
+}
+
+/**
+* Opens a log file for appending and maps its last segment. Text files that were not closed
+* cleanly have their zero filled tail trimmed, binary files keep it as padding the decoder skips.
+* 
+* @param Filename File to open, created if it does not exist.
+* @param File     Receives the open file.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerFileOpen(
+    _In_  PCSTR Filename,
+    _Out_ PLOG_FILE File
+)
+{
+    memset(File, 0, sizeof(*File));
+
+    HANDLE Handle = CreateFileA(
+        Filename,
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if( Handle == INVALID_HANDLE_VALUE )
+    {
+        return FALSE;
+    }
+
+    LARGE_INTEGER Size;
+    if( !GetFileSizeEx( Handle, &Size ) )
+    {
+        CloseHandle(Handle);
+        return FALSE;
+    }
+
+    // a file that ends on a segment boundary may end with a whole unused segment
+    UINT64 Offset = (UINT64)Size.QuadPart - ( (UINT64)Size.QuadPart % SEGMENT_SIZE );
+    if( Offset == (UINT64)Size.QuadPart && Offset > 0 )
+    {
+        Offset -= SEGMENT_SIZE;
+    }
+
+    File->Handle = Handle;
+
+    if( !LoggerFileMapSegment( File, Offset ) )
+    {
+        CloseHandle(Handle);
+        memset(File, 0, sizeof(*File));
+        return FALSE;
+    }
+
+    File->Used = (ULONG)( (UINT64)Size.QuadPart - Offset );
+
+    if( GlobalLoggerState.Format != LOG_FORMAT_BINARY )
+    {
+        while( File->Used > 0 && File->View[File->Used - 1] == '\0' )
+        {
+            --File->Used;
+        }
+    }
+
+    File->Flushed = File->Used;
+
+    return TRUE;
+}
+
+/**
+* @return Bytes of records in the file, 0 for a console stream.
+*/
+static
+UINT64
+LoggerFileSize(
+    _In_ const LOG_FILE* File
+)
+{
+    return ( File->Handle != NULL ) ? File->ViewOffset + File->Used : 0;
+}
+
+/**
+* @return Bytes copied into the mapping since the last flush.
+*/
+static
+ULONG
+LoggerFileUnflushed(
+    _In_ const LOG_FILE* File
+)
+{
+    return File->Used - File->Flushed;
+}
+
+/**
+* Appends to a log file. A mapped file only takes a copy into the current segment, the next segment
+* is mapped when it fills up and a record may straddle the two.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerFileWrite(
+    _Inout_ PLOG_FILE File,
+    _In_    const VOID* Data,
+    _In_    ULONG Length
+)
+{
+    if( File->Stream != NULL )
+    {
+        return fwrite(Data, 1, Length, File->Stream) == Length;
+    }
+
+    const CHAR* Source = (const CHAR*)Data;
+
+    while( Length > 0 )
+    {
+        if( File->Used == SEGMENT_SIZE )
+        {
+            // the old view's dirty pages are written by the system, no flush needed to keep them
+            PSTR View = File->View;
+            if( !LoggerFileMapSegment( File, File->ViewOffset + SEGMENT_SIZE ) )
+            {
+                return FALSE;
+            }
+
+            UnmapViewOfFile(View);
+        }
+
+        ULONG Chunk = min(Length, SEGMENT_SIZE - File->Used);
+        memcpy(File->View + File->Used, Source, Chunk);
+
+        File->Used += Chunk;
+        Source += Chunk;
+        Length -= Chunk;
+    }
+
+    return TRUE;
+}
+
+/**
+* Writes a console stream out, or starts writing the dirty part of the mapped segment to disk.
+*/
+static
+VOID
+LoggerFileFlush(
+    _Inout_ PLOG_FILE File
+)
+{
+    if( File->Stream != NULL )
+    {
+        fflush(File->Stream);
+    }
+    else if( File->Handle != NULL && File->Used > File->Flushed )
+    {
+        FlushViewOfFile(File->View + File->Flushed, File->Used - File->Flushed);
+        File->Flushed = File->Used;
+    }
+}
+
+/**
+* Closes a log file. A mapped file is truncated to its records, dropping the preallocated rest of
+* the segment, and deleted if asked to.
+* 
+* @param File     File to close.
+* @param Filename Its name, for IsDelete.
+* @param IsDelete TRUE to delete the file once it is closed.
+*/
+static
+VOID
+LoggerFileClose(
+    _Inout_  PLOG_FILE File,
+    _In_opt_ PCSTR Filename,
+    _In_     BOOL IsDelete
+)
+{
+    if( File->Stream != NULL && File->Stream != stdout && File->Stream != stderr )
+    {
+        fclose(File->Stream);
+    }
+
+    if( File->Handle != NULL )
+    {
+        LARGE_INTEGER End;
+        End.QuadPart = (LONGLONG)LoggerFileSize(File);
+
+        UnmapViewOfFile(File->View);
+
+        if( SetFilePointerEx( File->Handle, End, NULL, FILE_BEGIN ) )
+        {
+            SetEndOfFile(File->Handle);
+        }
+
+        CloseHandle(File->Handle);
+
+        if( IsDelete && Filename != NULL )
+        {
+            DeleteFileA(Filename);
+        }
+    }
+
+    memset(File, 0, sizeof(*File));
+}
+
+/**
+* Applies the flush policy after records were written. Console streams are flushed right away, a
+* mapped file only once FLUSH_SIZE bytes are waiting, by the maintenance thread if it runs. The
+* maintenance thread also flushes every FLUSH_INTERVAL. The caller holds GlobalLoggerState.Lock.
+*/
+static
+VOID
+LoggerFlushLocked(
+    VOID
+)
+{
+    PLOG_FILE File = &GlobalLoggerState.File;
+
+    if( File->Stream != NULL )
+    {
+        fflush(File->Stream);
+    }
+    else if( LoggerFileUnflushed( File ) >= FLUSH_SIZE )
+    {
+        if( GlobalLoggerState.Maintenance.IsEnabled )
+        {
+            if( !GlobalLoggerState.Maintenance.IsFlushPending )
+            {
+                GlobalLoggerState.Maintenance.IsFlushPending = TRUE;
+                SetEvent(GlobalLoggerState.Maintenance.WakeEvent);
+            }
+        }
+        else
+        {
+            LoggerFileFlush(File);
+        }
+    }
+}
+
+/**
+* Prepares a freshly opened file, measures it and starts its time index. Binary files get the file header if they are
+* empty and a session record every time, which ties the ticks of the following events to the wall
+* clock, and the format records are written again for the new file.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerBeginFile(
+    VOID
+)
+{
+    GlobalLoggerState.FileSize = LoggerFileSize(&GlobalLoggerState.File);
+
+    LoggerIndexBeginLocked();
+
+    if( GlobalLoggerState.Format != LOG_FORMAT_BINARY )
+    {
+        return TRUE;
+    }
+
+    memset(GlobalLoggerState.DefinedFormats, 0, sizeof(GlobalLoggerState.DefinedFormats));
+
+    if( GlobalLoggerState.FileSize == 0 )
+    {
+        LOG_FILE_HEADER FileHeader = { LOG_BINARY_MAGIC, LOG_BINARY_VERSION, 0 };
+        if( !LoggerFileWrite( &GlobalLoggerState.File, &FileHeader, sizeof(FileHeader) ) )
+        {
+            return FALSE;
+        }
+
+        GlobalLoggerState.FileSize += sizeof(FileHeader);
+    }
+
+    struct
+    {
+        LOG_RECORD_HEADER  Header;
+        LOG_SESSION_RECORD Session;
+    } Record = { 0 };
+
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Ticks;
+    FILETIME      SystemTime;
+    FILETIME      LocalTime;
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Ticks);
+    GetSystemTimeAsFileTime(&SystemTime);
+    FileTimeToLocalFileTime(&SystemTime, &LocalTime);
+
+    Record.Header.Type = LOG_RECORD_SESSION;
+    Record.Header.Length = sizeof(Record.Session);
+    Record.Session.TicksPerSecond = (UINT64)Frequency.QuadPart;
+    Record.Session.BaseTicks = (UINT64)Ticks.QuadPart;
+    Record.Session.BaseTime = ( (UINT64)LocalTime.dwHighDateTime << 32 ) | LocalTime.dwLowDateTime;
+    Record.Session.ProcessId = GetCurrentProcessId();
+
+    if( !LoggerFileWrite( &GlobalLoggerState.File, &Record, sizeof(Record) ) )
+    {
+        return FALSE;
+    }
+
+    GlobalLoggerState.FileSize += sizeof(Record);
+    GlobalLoggerState.Index.Session = Record.Session; // converts the ticks of the index entries
+
+    return TRUE;
+}
+
+//////////////////////////////////////////
+//
+//          FILE COMPRESSION
+//
+//////////////////////////////////////////
+
+/**
+* @return The date as a number that orders like the date.
+*/
+static
+ULONG
+LoggerDateKey(
+    _In_ const SYSTEMTIME* Date
+)
+{
+    return ( (ULONG)Date->wYear << 16 ) | ( (ULONG)Date->wMonth << 8 ) | Date->wDay;
+}
+
+/**
+* Checks that a file is one the logger has rotated away from and will not open again: an earlier
+* day, or an earlier part of the current day, that is neither the current, the prepared nor the
+* retired file. The caller holds GlobalLoggerState.Lock.
+* 
+* @param Date     Date of the file.
+* @param Part     Part of the file.
+* @param Filename Full name of the file.
+* 
+* @return TRUE if the file can be compressed.
+*/
+static
+BOOL
+LoggerIsRotatedFileLocked(
+    _In_ const SYSTEMTIME* Date,
+    _In_ ULONG Part,
+    _In_ PCSTR Filename
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = &GlobalLoggerState.Maintenance;
+
+    ULONG FileDay = LoggerDateKey(Date);
+    ULONG CurrentDay = LoggerDateKey(&GlobalLoggerState.LastRotationTime);
+
+    if( FileDay > CurrentDay || ( FileDay == CurrentDay && Part >= GlobalLoggerState.FilePart ) )
+    {
+        return FALSE;
+    }
+
+    if( _stricmp( Filename, GlobalLoggerState.CurrentFilename ) == 0 )
+    {
+        return FALSE;
+    }
+
+    if( ( Maintenance->IsPreparePending || LoggerFileIsOpen( &Maintenance->NextFile ) ) &&
+        _stricmp( Filename, Maintenance->NextFilename ) == 0 )
+    {
+        return FALSE;
+    }
+
+    return !( LoggerFileIsOpen( &Maintenance->RetiredFile ) && _stricmp( Filename, Maintenance->RetiredFilename ) == 0 );
+}
+
+/**
+* Compresses every rotated log file of the current format into a LOG_PACK_EXTENSION file next to
+* it, and deletes the original once its compressed copy is complete.
+* 
+* @param Compression Compression state, compressing stops once Running drops.
+*/
+static
+VOID
+LoggerCompressRotatedFiles(
+    _In_ PLOGGER_COMPRESSION_STATE Compression
+)
+{
+    CHAR SearchPattern[MAXIMUM_FILENAME_SIZE] = { 0 };
+    _snprintf_s(
+        SearchPattern,
+        sizeof(SearchPattern),
+        _TRUNCATE,
+        "%s\\*%s",
+        GlobalLoggerState.BaseFilePath,
+        LoggerFileExtension()
+    );
+
+    WIN32_FIND_DATAA FindData;
+    HANDLE FindHandle = FindFirstFileA(SearchPattern, &FindData);
+
+    if( FindHandle == INVALID_HANDLE_VALUE )
+    {
+        return;
+    }
+
+    UINT16 Flags = ( GlobalLoggerState.Format == LOG_FORMAT_BINARY ) ? LOG_PACK_FLAG_BINARY : 0;
+
+    do
+    {
+        SYSTEMTIME Date;
+        ULONG      Part;
+        BOOL       IsPacked;
+        BOOL       IsIndex;
+
+        if( !LoggerParseFilename( FindData.cFileName, &Date, &Part, &IsPacked, &IsIndex ) || IsPacked || IsIndex )
+        {
+            continue;
+        }
+
+        CHAR Filename[MAXIMUM_FILENAME_SIZE] = { 0 };
+        CHAR PackedFilename[MAXIMUM_FILENAME_SIZE] = { 0 };
+        CHAR IndexFilename[MAXIMUM_FILENAME_SIZE] = { 0 };
+
+        _snprintf_s(Filename, sizeof(Filename), _TRUNCATE, "%s\\%s", GlobalLoggerState.BaseFilePath, FindData.cFileName);
+        _snprintf_s(PackedFilename, sizeof(PackedFilename), _TRUNCATE, "%s%s", Filename, LOG_PACK_EXTENSION);
+        _snprintf_s(IndexFilename, sizeof(IndexFilename), _TRUNCATE, "%s%s", Filename, LOG_INDEX_EXTENSION);
+
+        EnterCriticalSection(&GlobalLoggerState.Lock);
+        BOOL IsRotated = LoggerIsRotatedFileLocked(&Date, Part, Filename);
+        LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+        if( !IsRotated )
+        {
+            continue;
+        }
+
+        // a compressed copy left by an interrupted run is replaced, the compressed file has its own index
+        if( LogPackFile( Filename, PackedFilename, Flags, &Compression->Running ) )
+        {
+            DeleteFileA(Filename);
+            DeleteFileA(IndexFilename);
+        }
+        else
+        {
+            DeleteFileA(PackedFilename);
+        }
+    } while( Compression->Running && FindNextFileA( FindHandle, &FindData ) );
+
+    FindClose(FindHandle);
+}
+
+/**
+* Compresses rotated files whenever it is woken, in background mode so its CPU time and file I/O
+* give way to the rest of the process.
+*/
+static
+DWORD
+WINAPI
+LoggerCompressionThread(
+    _In_ LPVOID lpData
+)
+{
+    PLOGGER_COMPRESSION_STATE Compression = (PLOGGER_COMPRESSION_STATE)lpData;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    for( ;; )
+    {
+        WaitForSingleObject(Compression->WakeEvent, INFINITE);
+
+        if( !Compression->Running )
+        {
+            break;
+        }
+
+        LoggerCompressRotatedFiles(Compression);
+    }
+
+    return 0;
+}
+
+/**
+* Wakes the compression thread after a file has been rotated away from and closed.
+*/
+static
+VOID
+LoggerWakeCompression(
+    VOID
+)
+{
+    if( GlobalLoggerState.Compression.IsEnabled )
+    {
+        SetEvent(GlobalLoggerState.Compression.WakeEvent);
+    }
+}
+
+/**
+* Stops the compression thread, a file it is compressing stays uncompressed until the next run.
+*/
+static
+VOID
+LoggerStopCompression(
+    VOID
+)
+{
+    PLOGGER_COMPRESSION_STATE Compression = &GlobalLoggerState.Compression;
+
+    if( !Compression->IsEnabled )
+    {
+        return;
+    }
+
+    InterlockedExchange(&Compression->Running, FALSE);
+    SetEvent(Compression->WakeEvent);
+    WaitForSingleObject(Compression->Thread, INFINITE);
+
+    CloseHandle(Compression->Thread);
+    CloseHandle(Compression->WakeEvent);
+
+    memset(Compression, 0, sizeof(*Compression));
+}
+
+//////////////////////////////////////////
+//
+//          FILE ROTATION
+//
+//////////////////////////////////////////
+
+/**
+* Caches when the local date changes next, so the write path compares tick counts instead of
+* asking for the local time. The wall clock is still consulted every ROTATION_CHECK_INTERVAL in
+* case it is changed.
+* 
+* @param CurrentTime The current local time.
+*/
+static
+VOID
+LoggerScheduleNextDay(
+    _In_ const SYSTEMTIME* CurrentTime
+)
+{
+    ULONGLONG Now = GetTickCount64();
+    ULONGLONG IntoDay = ( ( CurrentTime->wHour * 60ULL + CurrentTime->wMinute ) * 60ULL + CurrentTime->wSecond ) * 1000ULL + CurrentTime->wMilliseconds;
+
+    GlobalLoggerState.NextDayTick = Now + ( 24ULL * 60 * 60 * 1000 - IntoDay );
+    GlobalLoggerState.NextClockTick = min(GlobalLoggerState.NextDayTick, Now + ROTATION_CHECK_INTERVAL);
+}
+
+/**
+* Hands a file the logger no longer writes to the maintenance thread, which closes it. Closes it
+* here if the thread is not running or still has the previous one. The caller holds
+* GlobalLoggerState.Lock.
+* 
+* @param File     File to close, closed on return as far as the caller is concerned.
+* @param Filename Its file name.
+* @param IsUnused TRUE for a prepared file that was never written to, it is deleted once closed.
+*/
+static
+VOID
+LoggerRetireFileLocked(
+    _Inout_ PLOG_FILE File,
+    _In_    PCSTR Filename,
+    _In_    BOOL IsUnused
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = &GlobalLoggerState.Maintenance;
+
+    if( Maintenance->IsEnabled && !LoggerFileIsOpen( &Maintenance->RetiredFile ) )
+    {
+        Maintenance->RetiredFile = *File;
+        Maintenance->IsRetiredUnused = IsUnused;
+        strncpy_s(Maintenance->RetiredFilename, sizeof(Maintenance->RetiredFilename), Filename, _TRUNCATE);
+        SetEvent(Maintenance->WakeEvent);
+
+        memset(File, 0, sizeof(*File));
+        return;
+    }
+
+    LoggerFileClose(File, Filename, IsUnused);
+
+    if( !IsUnused )
+    {
+        LoggerWakeCompression();
+    }
+}
+
+/**
+* Asks the maintenance thread to open the file the logger will switch to next: the next day's file
+* shortly before midnight, the next part once the current file is half full. Does nothing while the
+* right file is already prepared or being prepared. The caller holds GlobalLoggerState.Lock.
+* 
+* @param Now GetTickCount64() of the write.
+*/
+static
+VOID
+LoggerPrepareNextFileLocked(
+    _In_ ULONGLONG Now
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = &GlobalLoggerState.Maintenance;
+
+    if( !Maintenance->IsEnabled )
+    {
+        return;
+    }
+
+    SYSTEMTIME Date = GlobalLoggerState.LastRotationTime;
+    ULONG      Part;
+
+    if( Now + ROTATION_PREPARE_MARGIN >= GlobalLoggerState.NextDayTick )
+    {
+        LoggerDifferenceInDays(&Date, -1); // tomorrow
+        Part = 0;
+    }
+    else if( GlobalLoggerState.MaximumFileSize != 0 && GlobalLoggerState.FileSize >= GlobalLoggerState.MaximumFileSize / 2 )
+    {
+        Part = GlobalLoggerState.FilePart + 1;
+    }
+    else
+    {
+        return;
+    }
+
+    BOOL IsRequested = Maintenance->IsPreparePending || LoggerFileIsOpen( &Maintenance->NextFile );
+    if( IsRequested && Maintenance->NextPart == Part && LoggerCompareDate( &Maintenance->NextDate, &Date ) )
+    {
+        return;
+    }
+
+    if( LoggerFileIsOpen( &Maintenance->NextFile ) )
+    {
+        LoggerRetireFileLocked(&Maintenance->NextFile, Maintenance->NextFilename, Maintenance->IsNextEmpty);
+    }
+
+    if( !LoggerCreateFilename( &Date, Part, Maintenance->NextFilename, sizeof(Maintenance->NextFilename) ) )
+    {
+        return;
+    }
+
+    Maintenance->NextDate = Date;
+    Maintenance->NextPart = Part;
+    Maintenance->IsPreparePending = TRUE;
+
+    SetEvent(Maintenance->WakeEvent);
+}
+
+/**
+* Switches to another file. Takes the prepared file if it is the right one, so the common switch
+* is a pointer swap plus the binary file prologue, and opens the file here only if the maintenance
+* thread did not get to it in time. The old file is closed in the background.
+* The caller holds GlobalLoggerState.Lock.
+* 
+* @param Date Date of the new file.
+* @param Part Part of the new file.
+* 
+* @return TRUE if successful, FALSE if the new file could not be opened.
+*/
+static
+BOOL
+LoggerSwitchFileLocked(
+    _In_ const SYSTEMTIME* Date,
+    _In_ ULONG Part
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = &GlobalLoggerState.Maintenance;
+    LOG_FILE File = { 0 };
+    CHAR     Filename[MAXIMUM_FILENAME_SIZE] = { 0 };
+
+    if( LoggerFileIsOpen( &Maintenance->NextFile ) )
+    {
+        if( Maintenance->NextPart == Part && LoggerCompareDate( &Maintenance->NextDate, Date ) )
+        {
+            File = Maintenance->NextFile;
+            strncpy_s(Filename, sizeof(Filename), Maintenance->NextFilename, _TRUNCATE);
+            memset(&Maintenance->NextFile, 0, sizeof(Maintenance->NextFile));
+        }
+        else
+        {
+            LoggerRetireFileLocked(&Maintenance->NextFile, Maintenance->NextFilename, Maintenance->IsNextEmpty);
+        }
+    }
+
+    if( !LoggerFileIsOpen( &File ) )
+    {
+        if( !LoggerCreateFilename( Date, Part, Filename, sizeof(Filename) ) )
+        {
+            return FALSE;
+        }
+
+        if( !LoggerFileOpen( Filename, &File ) )
+        {
+            return FALSE; // Failed to open new log file
+        }
+
+        // a preparation still in flight is for this file or an older one, it must not be kept
+        Maintenance->IsPreparePending = FALSE;
+        Maintenance->NextFilename[0] = '\0';
+    }
+
+    if( LoggerFileIsOpen( &GlobalLoggerState.File ) )
+    {
+        LoggerIndexCloseLocked();
+        LoggerRetireFileLocked(&GlobalLoggerState.File, GlobalLoggerState.CurrentFilename, FALSE);
+    }
+
+    GlobalLoggerState.File = File;
+    GlobalLoggerState.LastRotationTime = *Date;
+    GlobalLoggerState.FilePart = Part;
+
+    strncpy_s(
+        GlobalLoggerState.CurrentFilename,
+        sizeof(GlobalLoggerState.CurrentFilename),
+        Filename,
+        _TRUNCATE
+    );
+
+    LoggerBeginFile();
+
+    if( Maintenance->IsEnabled )
+    {
+        Maintenance->IsCleanUpPending = TRUE; // Clean up old files
+        SetEvent(Maintenance->WakeEvent);
+    }
+
+    return TRUE;
+}
+
+/**
+* Switches files when the day changed or the record would take the file past its size limit.
+* Costs a tick count and two comparisons unless a switch is due.
+* The caller holds GlobalLoggerState.Lock.
+* 
+* @param Length Length of the record about to be written.
+* 
+* @return TRUE if the record can be written, FALSE if a due switch failed.
+*/
+static
+BOOL
+LoggerRotateLocked(
+    _In_ ULONG Length
+)
+{
+    ULONGLONG Now = GetTickCount64();
+
+    if( Now >= GlobalLoggerState.NextClockTick )
+    {
+        SYSTEMTIME CurrentTime;
+        BOOL IsRotationNeeded = LoggerIsRotationNeeded(&CurrentTime);
+
+        LoggerScheduleNextDay(&CurrentTime);
+
+        if( IsRotationNeeded )
+        {
+            return LoggerSwitchFileLocked(&CurrentTime, 0);
+        }
+    }
+
+    if( GlobalLoggerState.MaximumFileSize != 0 &&
+        GlobalLoggerState.FileSize + Length > GlobalLoggerState.MaximumFileSize )
+    {
+        return LoggerSwitchFileLocked(&GlobalLoggerState.LastRotationTime, GlobalLoggerState.FilePart + 1);
+    }
+
+    LoggerPrepareNextFileLocked(Now);
+
+    return TRUE;
+}
+
+/**
+* Opens prepared files, closes retired ones and runs the retention scan, all without the logger lock.
+* Also flushes the mapped segment every FLUSH_INTERVAL, or sooner once FLUSH_SIZE bytes are waiting.
+*/
+static
+DWORD
+WINAPI
+LoggerMaintenanceThread(
+    _In_ LPVOID lpData
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = (PLOGGER_MAINTENANCE_STATE)lpData;
+
+    for( ;; )
+    {
+        WaitForSingleObject(Maintenance->WakeEvent, FLUSH_INTERVAL);
+
+        CHAR RetiredFilename[MAXIMUM_FILENAME_SIZE] = { 0 };
+        CHAR NextFilename[MAXIMUM_FILENAME_SIZE] = { 0 };
+
+        EnterCriticalSection(&GlobalLoggerState.Lock);
+
+        // FlushViewOfFile only queues the dirty pages of one segment, short enough to hold the lock
+        LoggerFileFlush(&GlobalLoggerState.File);
+        Maintenance->IsFlushPending = FALSE;
+
+        LOG_FILE Retired = Maintenance->RetiredFile;
+        BOOL     IsRetiredUnused = Maintenance->IsRetiredUnused;
+        BOOL     IsPrepare = Maintenance->IsPreparePending;
+        BOOL     IsCleanUp = Maintenance->IsCleanUpPending;
+        BOOL     IsRunning = Maintenance->Running;
+
+        strncpy_s(RetiredFilename, sizeof(RetiredFilename), Maintenance->RetiredFilename, _TRUNCATE);
+        strncpy_s(NextFilename, sizeof(NextFilename), Maintenance->NextFilename, _TRUNCATE);
+
+        memset(&Maintenance->RetiredFile, 0, sizeof(Maintenance->RetiredFile));
+        Maintenance->IsPreparePending = FALSE;
+        Maintenance->IsCleanUpPending = FALSE;
+
+        LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+        if( LoggerFileIsOpen( &Retired ) )
+        {
+            LoggerFileClose(&Retired, RetiredFilename, IsRetiredUnused);
+
+            if( !IsRetiredUnused )
+            {
+                LoggerWakeCompression();
+            }
+        }
+
+        LOG_FILE Next;
+
+        if( IsPrepare && IsRunning && LoggerFileOpen( NextFilename, &Next ) )
+        {
+            BOOL IsEmpty = LoggerFileSize(&Next) == 0;
+
+            EnterCriticalSection(&GlobalLoggerState.Lock);
+
+            // a newer request replaced this one while the file was being opened
+            BOOL IsWanted = !Maintenance->IsPreparePending && !LoggerFileIsOpen( &Maintenance->NextFile ) &&
+                            strcmp( Maintenance->NextFilename, NextFilename ) == 0;
+
+            // or the logger could not wait and opened the file itself
+            BOOL IsInUse = strcmp( GlobalLoggerState.CurrentFilename, NextFilename ) == 0;
+
+            if( IsWanted )
+            {
+                Maintenance->NextFile = Next;
+                Maintenance->IsNextEmpty = IsEmpty;
+            }
+
+            LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+            if( !IsWanted && IsInUse )
+            {
+                // the logger's own mapping owns the end of the file, neither truncate nor delete it
+                UnmapViewOfFile(Next.View);
+                CloseHandle(Next.Handle);
+            }
+            else if( !IsWanted )
+            {
+                LoggerFileClose(&Next, NextFilename, IsEmpty);
+            }
+        }
+
+        if( IsCleanUp && IsRunning )
+        {
+            LoggerCleanUpDatedFiles();
+        }
+
+        if( !IsRunning )
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Starts the maintenance thread and queues the initial retention scan.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerStartMaintenance(
+    VOID
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = &GlobalLoggerState.Maintenance;
+
+    Maintenance->WakeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if( Maintenance->WakeEvent == NULL )
+    {
+        return FALSE;
+    }
+
+    Maintenance->Running = TRUE;
+    Maintenance->IsCleanUpPending = TRUE;
+
+    Maintenance->Thread = CreateThread(NULL, 0, LoggerMaintenanceThread, Maintenance, 0, NULL);
+    if( Maintenance->Thread == NULL )
+    {
+        CloseHandle(Maintenance->WakeEvent);
+        memset(Maintenance, 0, sizeof(*Maintenance));
+        return FALSE;
+    }
+
+    Maintenance->IsEnabled = TRUE;
+    SetEvent(Maintenance->WakeEvent);
+
+    return TRUE;
+}
+
+/**
+* Stops the maintenance thread after it has closed the retired file, and closes the prepared one.
+*/
+static
+VOID
+LoggerStopMaintenance(
+    VOID
+)
+{
+    PLOGGER_MAINTENANCE_STATE Maintenance = &GlobalLoggerState.Maintenance;
+
+    if( !Maintenance->IsEnabled )
+    {
+        return;
+    }
+
+    Maintenance->Running = FALSE;
+    SetEvent(Maintenance->WakeEvent);
+    WaitForSingleObject(Maintenance->Thread, INFINITE);
+
+    CloseHandle(Maintenance->Thread);
+    CloseHandle(Maintenance->WakeEvent);
+
+    if( LoggerFileIsOpen( &Maintenance->NextFile ) )
+    {
+        LoggerFileClose(&Maintenance->NextFile, Maintenance->NextFilename, Maintenance->IsNextEmpty);
+    }
+
+    memset(Maintenance, 0, sizeof(*Maintenance));
+}
+
+/**
+* Formats a complete log line, envelope and newline included, into the given buffer.
+* 
+* @param Buffer     Buffer receiving the line.
+* @param BufferSize Size of the buffer, the line is truncated to fit.
+* @param Level      The log level of the message.
+* @param Filename   The name of the file where the log message is being written.
+* @param LineNumber The line number in the file where the log message is being written.
+* @param Event      Event name of a structured site, written ahead of its fields, NULL otherwise.
+* @param Format     The format string for the log message.
+* @param Args       The variable argument list containing the values to format into the log message.
+* 
+* @return Length of the line, 0 if it could not be formatted.
+*/
+static
+ULONG
+LoggerFormatRecord(
+    _Out_    PSTR Buffer,
+    _In_     ULONG BufferSize,
+    _In_     LOG_LEVEL Level,
+    _In_     PCSTR Filename,
+    _In_     UINT64 LineNumber,
+    _In_opt_ PCSTR Event,
+    _In_     PCSTR Format,
+    _In_     va_list Args
+)
+{
+    CHAR Timestamp[TIMESTAMP_BUFFER_SIZE] = { 0 };
+    if( !LoggerTimestamp(Timestamp, sizeof(Timestamp)) )
+    {
+        return 0; // Failed to get timestamp
+    }
+
+    INT HeaderLength = _snprintf_s(
+        Buffer,
+        BufferSize,
+        _TRUNCATE,
+        "[%s] [%s] [%s:%llu] %s%s",
+        Timestamp,
+        LOG_LEVEL_NAMES[Level],
+        Filename,
+        (unsigned long long)LineNumber,
+        ( Event != NULL ) ? Event : "",
+        ( Event != NULL ) ? " " : ""
+    );
+
+    if( HeaderLength < 0 || (ULONG)HeaderLength + 2 >= BufferSize )
+    {
+        return 0; // No room left for the message
+    }
+
+    // leave room for the newline, a truncated message is still written
+    INT MessageLength = _vsnprintf_s(
+        Buffer + HeaderLength,
+        BufferSize - HeaderLength - 1,
+        _TRUNCATE,
+        Format,
+        Args
+    );
+
+    ULONG Length = HeaderLength + ( ( MessageLength < 0 ) ? (ULONG)strlen( Buffer + HeaderLength ) : (ULONG)MessageLength );
+    Buffer[Length++] = '\n';
+    Buffer[Length] = '\0';
+
+    return Length;
+}
+
+//////////////////////////////////////////
+//
+//          BINARY RECORDS
+//
+//////////////////////////////////////////
+
+/**
+* Gives a call site a format id and records the type of every argument its format string consumes.
+* Only the first binary write of a site parses the format string, a thread that races the one doing
+* the registration writes a text record instead of waiting.
+* 
+* @param Site Call site to register.
+* 
+* @return TRUE if the site's events can be written as raw arguments, FALSE otherwise.
+*/
+static
+BOOL
+LoggerRegisterSite(
+    _Inout_ PLOG_SITE Site
+)
+{
+    LONG State = Site->State;
+    if( State == LOG_SITE_BINARY || State == LOG_SITE_TEXT )
+    {
+        return State == LOG_SITE_BINARY; // settled, no need for the interlocked operation
+    }
+
+    State = InterlockedCompareExchange(&Site->State, LOG_SITE_REGISTERING, LOG_SITE_UNREGISTERED);
+    if( State != LOG_SITE_UNREGISTERED )
+    {
+        return State == LOG_SITE_BINARY;
+    }
+
+    BOOL  IsSupported = TRUE;
+    UINT8 ArgCount = 0;
+
+    for( PCSTR p = strchr( Site->Format, '%' ); p != NULL && IsSupported; p = strchr( p, '%' ) )
+    {
+        LOG_FORMAT_SPEC Spec;
+        IsSupported = LogFormatParseSpec(p, &Spec);
+
+        INT Needed = ( Spec.WidthFromArg ? 1 : 0 ) + ( Spec.PrecisionFromArg ? 1 : 0 ) + ( Spec.ValueType != LOG_ARG_NONE ? 1 : 0 );
+        if( ArgCount + Needed > LOG_MAX_ARGS )
+        {
+            IsSupported = FALSE;
+            break;
+        }
+
+        if( Spec.WidthFromArg )
+        {
+            Site->ArgTypes[ArgCount++] = LOG_ARG_INT32;
+        }
+
+        if( Spec.PrecisionFromArg )
+        {
+            Site->ArgTypes[ArgCount++] = LOG_ARG_INT32;
+        }
+
+        if( Spec.ValueType != LOG_ARG_NONE )
+        {
+            Site->ArgTypes[ArgCount++] = (UINT8)Spec.ValueType;
+        }
+
+        p += Spec.Length;
+    }
+
+    // the format record has to fit in a single record
+    SIZE_T DefinitionSize = sizeof(LOG_FORMAT_RECORD) + ArgCount + strlen(Site->FileName) + strlen(Site->Format) + 2;
+    if( Site->Event != NULL )
+    {
+        DefinitionSize += strlen(Site->Event) + 1;
+    }
+    if( DefinitionSize > LOG_MAX_RECORD )
+    {
+        IsSupported = FALSE;
+    }
+
+    if( IsSupported )
+    {
+        LONG FormatId = InterlockedIncrement(&LoggerNextFormatId) - 1;
+        if( FormatId < LOG_MAX_SITES )
+        {
+            Site->FormatId = (ULONG)FormatId;
+            Site->ArgCount = ArgCount;
+            LoggerSites[FormatId] = Site;
+        }
+        else
+        {
+            IsSupported = FALSE; // out of format ids
+        }
+    }
+
+    InterlockedExchange(&Site->State, IsSupported ? LOG_SITE_BINARY : LOG_SITE_TEXT);
+
+    return IsSupported;
+}
+
+/**
+* @return Bytes the arguments of a site take from the given index on, strings counted as empty.
+*/
+static
+ULONG
+LoggerReservedArgumentSize(
+    _In_ const LOG_SITE* Site,
+    _In_ UINT8 From
+)
+{
+    ULONG Size = 0;
+
+    for( UINT8 i = From; i < Site->ArgCount; ++i )
+    {
+        switch( Site->ArgTypes[i] )
+        {
+        case LOG_ARG_INT32:  Size += sizeof(INT32);  break;
+        case LOG_ARG_STRING: Size += sizeof(UINT16); break;
+        default:             Size += sizeof(UINT64); break;
+        }
+    }
+
+    return Size;
+}
+
+/**
+* Copies the raw arguments of a call into a buffer, in the layout described in logformat.h.
+* Strings are truncated so that the arguments after them still fit.
+* 
+* @param Buffer     Buffer receiving the arguments.
+* @param BufferSize Size of the buffer.
+* @param Site       Registered call site, gives the argument types.
+* @param Args       The arguments of the call.
+* 
+* @return Bytes written, 0 if even the fixed size arguments do not fit.
+*/
+static
+ULONG
+LoggerEncodeArguments(
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize,
+    _In_  const LOG_SITE* Site,
+    _In_  va_list Args
+)
+{
+    ULONG Offset = 0;
+
+    if( LoggerReservedArgumentSize( Site, 0 ) > BufferSize )
+    {
+        return 0;
+    }
+
+    for( UINT8 i = 0; i < Site->ArgCount; ++i )
+    {
+        switch( Site->ArgTypes[i] )
+        {
+        case LOG_ARG_INT32:
+        {
+            INT32 Value = va_arg(Args, INT32);
+            memcpy(Buffer + Offset, &Value, sizeof(Value));
+            Offset += sizeof(Value);
+            break;
+        }
+
+        case LOG_ARG_INT64:
+        {
+            INT64 Value = va_arg(Args, INT64);
+            memcpy(Buffer + Offset, &Value, sizeof(Value));
+            Offset += sizeof(Value);
+            break;
+        }
+
+        case LOG_ARG_DOUBLE:
+        {
+            double Value = va_arg(Args, double);
+            memcpy(Buffer + Offset, &Value, sizeof(Value));
+            Offset += sizeof(Value);
+            break;
+        }
+
+        case LOG_ARG_POINTER:
+        {
+            UINT64 Value = (UINT64)(UINT_PTR)va_arg(Args, PVOID);
+            memcpy(Buffer + Offset, &Value, sizeof(Value));
+            Offset += sizeof(Value);
+            break;
+        }
+
+        case LOG_ARG_STRING:
+        {
+            PCSTR  Value = va_arg(Args, PCSTR);
+            UINT16 Length = LOG_STRING_NULL;
+
+            if( Value != NULL )
+            {
+                ULONG Room = BufferSize - Offset - LoggerReservedArgumentSize( Site, i );
+                Length = (UINT16)strnlen(Value, min(Room, LOG_STRING_NULL - 1));
+            }
+
+            memcpy(Buffer + Offset, &Length, sizeof(Length));
+            Offset += sizeof(Length);
+
+            if( Value != NULL )
+            {
+                memcpy(Buffer + Offset, Value, Length);
+                Offset += Length;
+            }
+            break;
+        }
+        }
+    }
+
+    return Offset;
+}
+
+/**
+* Builds a binary event record: format id, performance counter and raw arguments.
+* 
+* @return Length of the record, 0 if it could not be built.
+*/
+static
+ULONG
+LoggerFormatBinaryEvent(
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize,
+    _In_  const LOG_SITE* Site,
+    _In_  va_list Args
+)
+{
+    const ULONG FixedSize = sizeof(LOG_RECORD_HEADER) + sizeof(LOG_EVENT_RECORD);
+    if( BufferSize <= FixedSize )
+    {
+        return 0;
+    }
+
+    ULONG ArgumentSize = LoggerEncodeArguments(Buffer + FixedSize, min(BufferSize - FixedSize, LOG_MAX_RECORD - sizeof(LOG_EVENT_RECORD)), Site, Args);
+    if( ArgumentSize == 0 && Site->ArgCount > 0 )
+    {
+        return 0;
+    }
+
+    LARGE_INTEGER Ticks;
+    QueryPerformanceCounter(&Ticks);
+
+    LOG_RECORD_HEADER Header;
+    Header.Type = LOG_RECORD_EVENT;
+    Header.Level = (UINT8)Site->Level;
+    Header.Length = (UINT16)( sizeof(LOG_EVENT_RECORD) + ArgumentSize );
+
+    LOG_EVENT_RECORD Event;
+    Event.FormatId = Site->FormatId;
+    Event.Ticks = (UINT64)Ticks.QuadPart;
+
+    memcpy(Buffer, &Header, sizeof(Header));
+    memcpy(Buffer + sizeof(Header), &Event, sizeof(Event));
+
+    return FixedSize + ArgumentSize;
+}
+
+/**
+* Builds a binary text record, for messages whose format string cannot be recorded raw.
+* 
+* @return Length of the record, 0 if it could not be built.
+*/
+static
+ULONG
+LoggerFormatBinaryText(
+    _Out_    PSTR Buffer,
+    _In_     ULONG BufferSize,
+    _In_     LOG_LEVEL Level,
+    _In_     PCSTR Filename,
+    _In_     UINT64 LineNumber,
+    _In_opt_ PCSTR Event,
+    _In_     PCSTR Format,
+    _In_     va_list Args
+)
+{
+    const ULONG FixedSize = sizeof(LOG_RECORD_HEADER) + sizeof(LOG_TEXT_RECORD);
+
+    BufferSize = min(BufferSize, sizeof(LOG_RECORD_HEADER) + LOG_MAX_RECORD);
+    if( BufferSize <= FixedSize + 2 )
+    {
+        return 0;
+    }
+
+    INT FilenameLength = _snprintf_s(Buffer + FixedSize, BufferSize - FixedSize - 1, _TRUNCATE, "%s", Filename);
+    if( FilenameLength < 0 )
+    {
+        FilenameLength = (INT)strlen(Buffer + FixedSize);
+    }
+
+    ULONG Offset = FixedSize + FilenameLength + 1;
+
+    if( Event != NULL )
+    {
+        INT EventLength = _snprintf_s(Buffer + Offset, BufferSize - Offset, _TRUNCATE, "%s ", Event);
+        Offset += ( EventLength < 0 ) ? (ULONG)strlen( Buffer + Offset ) : (ULONG)EventLength;
+    }
+
+    INT MessageLength = _vsnprintf_s(Buffer + Offset, BufferSize - Offset, _TRUNCATE, Format, Args);
+    if( MessageLength < 0 )
+    {
+        MessageLength = (INT)strlen(Buffer + Offset);
+    }
+
+    Offset += MessageLength + 1;
+
+    LARGE_INTEGER Ticks;
+    QueryPerformanceCounter(&Ticks);
+
+    LOG_RECORD_HEADER Header;
+    Header.Type = LOG_RECORD_TEXT;
+    Header.Level = (UINT8)Level;
+    Header.Length = (UINT16)( Offset - sizeof(Header) );
+
+    LOG_TEXT_RECORD Text;
+    Text.Ticks = (UINT64)Ticks.QuadPart;
+    Text.Line = (UINT32)LineNumber;
+
+    memcpy(Buffer, &Header, sizeof(Header));
+    memcpy(Buffer + sizeof(Header), &Text, sizeof(Text));
+
+    return Offset;
+}
+
+/**
+* Gives the JSON template of a call site. A site's template is serialized on its first JSON write
+* and kept, calls without a site and structured sites still being registered by another thread get
+* one built into Scratch. Structured sites have one member per field once registered, every other
+* site a "msg" member.
+* 
+* @param Site     The call site, NULL for calls made through LoggerWrite.
+* @param Scratch  Receives the template when the site's cannot be kept.
+* 
+* @return The template, NULL if it could not be built.
+*/
+static
+const LOG_JSON_TEMPLATE*
+LoggerJsonTemplate(
+    _Inout_opt_ PLOG_SITE Site,
+    _In_        LOG_LEVEL Level,
+    _In_        PCSTR Filename,
+    _In_        UINT64 LineNumber,
+    _Out_       PLOG_JSON_TEMPLATE Scratch
+)
+{
+    if( Site == NULL )
+    {
+        return LogFormatBuildJsonTemplate( LOG_LEVEL_NAMES[Level], Filename, (ULONG)LineNumber, NULL, NULL, Scratch ) ? Scratch : NULL;
+    }
+
+    const LOG_JSON_TEMPLATE* Template = Site->Json;
+    if( Template != NULL )
+    {
+        return Template;
+    }
+
+    BOOL IsStructured = ( Site->Event != NULL && LoggerRegisterSite( Site ) );
+
+    if( !( IsStructured && LogFormatBuildJsonTemplate( LOG_LEVEL_NAMES[Level], Filename, (ULONG)LineNumber, Site->Event, Site->Format, Scratch ) ) &&
+        !LogFormatBuildJsonTemplate( LOG_LEVEL_NAMES[Level], Filename, (ULONG)LineNumber, Site->Event, NULL, Scratch ) )
+    {
+        return NULL;
+    }
+
+    if( Site->Event != NULL && Site->State == LOG_SITE_REGISTERING )
+    {
+        return Scratch; // the fields are not known yet, ask again next time
+    }
+
+    PLOG_JSON_TEMPLATE Copy = (PLOG_JSON_TEMPLATE)malloc(sizeof(*Copy));
+    if( Copy == NULL )
+    {
+        return Scratch;
+    }
+
+    *Copy = *Scratch;
+
+    // a thread that raced this one may have installed an identical template first
+    Template = (const LOG_JSON_TEMPLATE*)InterlockedCompareExchangePointer( (PVOID volatile*)&Site->Json, Copy, NULL );
+    if( Template != NULL )
+    {
+        free(Copy);
+        return Template;
+    }
+
+    return Copy;
+}
+
+/**
+* Builds a JSON line. Structured sites copy their raw arguments the way binary events do and the
+* values are rendered next to the member names serialized in the site's template.
+* 
+* @param Site May be NULL for calls made through LoggerWrite.
+* 
+* @return Length of the line, 0 if it could not be built.
+*/
+static
+ULONG
+LoggerFormatJsonRecord(
+    _Out_       PSTR Buffer,
+    _In_        ULONG BufferSize,
+    _Inout_opt_ PLOG_SITE Site,
+    _In_        LOG_LEVEL Level,
+    _In_        PCSTR Filename,
+    _In_        UINT64 LineNumber,
+    _In_        PCSTR Format,
+    _In_        va_list Args
+)
+{
+    CHAR Timestamp[TIMESTAMP_BUFFER_SIZE] = { 0 };
+    if( !LoggerTimestamp(Timestamp, sizeof(Timestamp)) )
+    {
+        return 0;
+    }
+
+    LOG_JSON_TEMPLATE Scratch;
+    const LOG_JSON_TEMPLATE* Template = LoggerJsonTemplate(Site, Level, Filename, LineNumber, &Scratch);
+    if( Template == NULL )
+    {
+        return 0;
+    }
+
+    if( Template->HasMessage )
+    {
+        CHAR Message[MAXIMUM_LOG_MESSAGE_SIZE];
+        _vsnprintf_s(Message, sizeof(Message), _TRUNCATE, Format, Args);
+
+        return LogFormatRenderJson(Template, Timestamp, Message, NULL, 0, NULL, 0, Buffer, BufferSize);
+    }
+
+    CHAR Arguments[MAXIMUM_LOG_MESSAGE_SIZE];
+    ULONG ArgumentSize = LoggerEncodeArguments(Arguments, sizeof(Arguments), Site, Args);
+    if( ArgumentSize == 0 && Site->ArgCount > 0 )
+    {
+        return 0;
+    }
+
+    return LogFormatRenderJson(Template, Timestamp, NULL, Site->ArgTypes, Site->ArgCount, (const UINT8*)Arguments, ArgumentSize, Buffer, BufferSize);
+}
+
+/**
+* Builds the record for one log call in the given format. Registered sites become binary
+* events, everything else a formatted line or a binary text record.
+* 
+* @param Site         May be NULL for calls made through LoggerWrite.
+* @param RecordFormat GlobalLoggerState.Format for the main output, a sink's format otherwise.
+* 
+* @return Length of the record, 0 if it could not be built.
+*/
+static
+ULONG
+LoggerBuildRecord(
+    _Out_    PSTR Buffer,
+    _In_     ULONG BufferSize,
+    _In_opt_ PLOG_SITE Site,
+    _In_     LOG_LEVEL Level,
+    _In_     PCSTR Filename,
+    _In_     UINT64 LineNumber,
+    _In_     LOG_FORMAT RecordFormat,
+    _In_     PCSTR Format,
+    _In_     va_list Args
+)
+{
+    PCSTR Event = ( Site != NULL ) ? Site->Event : NULL;
+
+    if( RecordFormat == LOG_FORMAT_JSON )
+    {
+        return LoggerFormatJsonRecord(Buffer, BufferSize, Site, Level, Filename, LineNumber, Format, Args);
+    }
+
+    if( RecordFormat != LOG_FORMAT_BINARY )
+    {
+        return LoggerFormatRecord(Buffer, BufferSize, Level, Filename, LineNumber, Event, Format, Args);
+    }
+
+    if( Site != NULL && LoggerRegisterSite( Site ) )
+    {
+        return LoggerFormatBinaryEvent(Buffer, BufferSize, Site, Args);
+    }
+
+    return LoggerFormatBinaryText(Buffer, BufferSize, Level, Filename, LineNumber, Event, Format, Args);
+}
+
+/**
+* Writes the format record of an event's site, once per file, ahead of the site's first event.
+* The caller holds GlobalLoggerState.Lock.
+* 
+* @param Record Binary record about to be written.
+* 
+* @return TRUE if the record can be written, FALSE otherwise.
+*/
+static
+BOOL
+LoggerDefineFormatLocked(
+    _In_ PCSTR Record
+)
+{
+    LOG_RECORD_HEADER Header;
+    LOG_EVENT_RECORD  Event;
+
+    memcpy(&Header, Record, sizeof(Header));
+    if( Header.Type != LOG_RECORD_EVENT )
+    {
+        return TRUE;
+    }
+
+    memcpy(&Event, Record + sizeof(Header), sizeof(Event));
+
+    ULONG Bit = 1UL << ( Event.FormatId % 32 );
+    if( GlobalLoggerState.DefinedFormats[Event.FormatId / 32] & Bit )
+    {
+        return TRUE;
+    }
+
+    const LOG_SITE* Site = LoggerSites[Event.FormatId];
+    PCSTR Filename = Site->FileName;
+    SIZE_T FilenameSize = strlen(Filename) + 1;
+    SIZE_T FormatSize = strlen(Site->Format) + 1;
+    SIZE_T EventSize = ( Site->Event != NULL ) ? strlen(Site->Event) + 1 : 0;
+
+    LOG_FORMAT_RECORD Definition;
+    Definition.FormatId = Event.FormatId;
+    Definition.Line = Site->Line;
+    Definition.ArgCount = Site->ArgCount;
+
+    LOG_RECORD_HEADER DefinitionHeader = { 0 };
+    DefinitionHeader.Type = LOG_RECORD_FORMAT;
+    DefinitionHeader.Level = (UINT8)Site->Level;
+    DefinitionHeader.Length = (UINT16)( sizeof(Definition) + Site->ArgCount + FilenameSize + FormatSize + EventSize );
+
+    PLOG_FILE File = &GlobalLoggerState.File;
+    if( !LoggerFileWrite( File, &DefinitionHeader, sizeof(DefinitionHeader) ) ||
+        !LoggerFileWrite( File, &Definition, sizeof(Definition) ) ||
+        !LoggerFileWrite( File, Site->ArgTypes, Site->ArgCount ) ||
+        !LoggerFileWrite( File, Filename, (ULONG)FilenameSize ) ||
+        !LoggerFileWrite( File, Site->Format, (ULONG)FormatSize ) ||
+        ( EventSize > 0 && !LoggerFileWrite( File, Site->Event, (ULONG)EventSize ) ) )
+    {
+        return FALSE;
+    }
+
+    GlobalLoggerState.DefinedFormats[Event.FormatId / 32] |= Bit;
+    GlobalLoggerState.FileSize += sizeof(DefinitionHeader) + DefinitionHeader.Length;
+
+    return TRUE;
+}
+
+/**
+* Writes a record to the current stream, rotating first if the day changed.
+* The caller holds GlobalLoggerState.Lock and decides when to flush.
+* 
+* @param Record Record from LoggerBuildRecord.
+* @param Length Length of the record.
+* 
+* @return TRUE if the line was written, FALSE otherwise.
+*/
+static
+BOOL
+LoggerWriteRecordLocked(
+    _In_ PCSTR Record,
+    _In_ ULONG Length
+)
+{
+    if( Length == 0 )
+    {
+        return FALSE; // The record could not be built
+    }
+
+    // console streams have no base path, never rotate and are not indexed
+    BOOL IsFile = GlobalLoggerState.BaseFilePath[0] != '\0';
+
+    if( IsFile && !LoggerRotateLocked( Length ) )
+    {
+        return FALSE; // Rotation failed, do not log
+    }
+
+    if( !LoggerFileIsOpen( &GlobalLoggerState.File ) )
+    {
+        return FALSE; // No file available
+    }
+
+    if( IsFile )
+    {
+        LoggerIndexSplitLocked(Length);
+    }
+
+    if( GlobalLoggerState.Format == LOG_FORMAT_BINARY && !LoggerDefineFormatLocked( Record ) )
+    {
+        return FALSE;
+    }
+
+    if( !LoggerFileWrite( &GlobalLoggerState.File, Record, Length ) )
+    {
+        return FALSE;
+    }
+
+    GlobalLoggerState.FileSize += Length;
+
+    if( IsFile )
+    {
+        LoggerIndexAddLocked(Record, Length);
+    }
+
+    return TRUE;
+}
+
+/**
+* Writes a built record to the current stream and flushes it.
+* 
+* @param Record Record in the format of GlobalLoggerState.Format.
+* @param Length Length of the record.
+*/
+static
+VOID
+LoggerWriteRecord(
+    _In_ PCSTR Record,
+    _In_ ULONG Length
+)
+{
+    EnterCriticalSection(&GlobalLoggerState.Lock);
+
+    if( LoggerWriteRecordLocked(Record, Length) )
+    {
+        LoggerFlushLocked();
+    }
+
+    LeaveCriticalSection(&GlobalLoggerState.Lock);
+}
+
+/**
+* Writes a log message to the file stream with the specified log level, filename, line number, and format string.
+* 
+* @param Site       The call site of the message, NULL if it has none.
+* @param Level      The log level of the message.
+* @param Filename   The name of the file where the log message is being written.
+* @param LineNumber The line number in the file where the log message is being written.
+* @param Format     The format string for the log message.
+* @param Args       The variable argument list containing the values to format into the log message.
+* 
+* @return VOID
+*/
+static
+VOID
+LoggerWriteToFile(
+    _In_opt_ PLOG_SITE Site,
+    _In_ LOG_LEVEL Level,
+    _In_ PCSTR Filename,
+    _In_ UINT64 LineNumber,
+    _In_ PCSTR Format,
+    _In_ va_list Args
+)
+{
+    CHAR Record[LOG_RECORD_HEADER_SIZE + MAXIMUM_LOG_MESSAGE_SIZE];
+    ULONG Length = LoggerBuildRecord(Record, sizeof(Record), Site, Level, Filename, LineNumber, GlobalLoggerState.Format, Format, Args);
+
+    if (Length == 0)
+    {
+        return; // Failed to format log message
+    }
+
+    LoggerWriteRecord(Record, Length);
+}
+
+//////////////////////////////////////////
+//
+//          RATE LIMITING
+//
+//////////////////////////////////////////
+
+/**
+* Adds a site to the list of sites with a report due, unless it is listed already.
+* 
+* @param Site Site whose record was just dropped.
+*/
+static
+VOID
+LoggerListSuppressed(
+    _Inout_ PLOG_SITE Site
+)
+{
+    if( InterlockedCompareExchange( &Site->IsSuppressedListed, 1, 0 ) != 0 )
+    {
+        return;
+    }
+
+    PLOG_SITE Head;
+
+    do
+    {
+        Head = LoggerSuppressedSites;
+        Site->NextSuppressed = Head;
+    } while( InterlockedCompareExchangePointer( (PVOID volatile*)&LoggerSuppressedSites, Site, Head ) != Head );
+}
+
+/**
+* Builds a record from the logger itself that carries the level, file and line of a call site.
+* 
+* @return Length of the record, 0 if it could not be built.
+*/
+FORMAT_PRINTF(4, 5)
+static
+ULONG
+LoggerFormatSiteNotice(
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize,
+    _In_  const LOG_SITE* Site,
+    _In_  PCSTR Format,
+    ...
+)
+{
+    va_list Args;
+    va_start(Args, Format);
+
+    ULONG Length = LoggerBuildRecord(Buffer, BufferSize, NULL, Site->Level, Site->FileName, Site->Line, GlobalLoggerState.Format, Format, Args);
+
+    va_end(Args);
+
+    return Length;
+}
+
+/**
+* Writes how many records of a site the rate limit dropped since the last report, if any.
+* The caller holds GlobalLoggerState.Lock and decides when to flush.
+* 
+* @return TRUE if a report was written, FALSE otherwise.
+*/
+static
+BOOL
+LoggerWriteSuppressedLocked(
+    _Inout_ PLOG_SITE Site
+)
+{
+    LONG Count = InterlockedExchange(&Site->Suppressed, 0);
+    if( Count == 0 )
+    {
+        return FALSE;
+    }
+
+    CHAR Notice[LOG_RECORD_HEADER_SIZE];
+    ULONG Length = LoggerFormatSiteNotice(Notice, sizeof(Notice), Site, RATE_LIMIT_SUMMARY, (long)Count);
+
+    return LoggerWriteRecordLocked(Notice, Length);
+}
+
+/**
+* Reports every listed site. The caller holds GlobalLoggerState.Lock and decides when to flush.
+* 
+* @return Number of reports written.
+*/
+static
+ULONG
+LoggerWriteSuppressedSitesLocked(
+    VOID
+)
+{
+    if( LoggerSuppressedSites == NULL )
+    {
+        return 0;
+    }
+
+    ULONG Written = 0;
+    PLOG_SITE Site = (PLOG_SITE)InterlockedExchangePointer( (PVOID volatile*)&LoggerSuppressedSites, NULL );
+
+    while( Site != NULL )
+    {
+        PLOG_SITE Next = Site->NextSuppressed;
+
+        // unlisted before the count is taken, a drop after this lists the site again
+        InterlockedExchange(&Site->IsSuppressedListed, 0);
+
+        if( LoggerWriteSuppressedLocked( Site ) )
+        {
+            ++Written;
+        }
+
+        Site = Next;
+    }
+
+    return Written;
+}
+
+/**
+* Takes a token from a site's bucket. Called before the record is formatted, a dropped record only
+* costs reading the clock and counting it. In synchronous mode the drops of the site are reported
+* right ahead of the record that passes, in asynchronous mode the writer thread reports them.
+* 
+* @param Site Call site about to be written.
+* 
+* @return TRUE if the record may be written, FALSE if it is dropped.
+*/
+static
+BOOL
+LoggerRateLimitPass(
+    _Inout_ PLOG_SITE Site
+)
+{
+    INT64 Interval = GlobalLoggerState.RateLimit.Interval;
+    if( Interval == 0 )
+    {
+        return TRUE;
+    }
+
+    LARGE_INTEGER Now;
+    QueryPerformanceCounter(&Now);
+
+    LONG64 Due = Site->RateDue;
+
+    for( ;; )
+    {
+        if( Due - Now.QuadPart > GlobalLoggerState.RateLimit.Window )
+        {
+            if( InterlockedIncrement( &Site->Suppressed ) == 1 )
+            {
+                LoggerListSuppressed(Site); // the site goes quiet or not, its drops get reported
+            }
+            return FALSE;
+        }
+
+        LONG64 Next = max(Due, Now.QuadPart) + Interval;
+        LONG64 Seen = InterlockedCompareExchange64(&Site->RateDue, Next, Due);
+        if( Seen == Due )
+        {
+            break;
+        }
+
+        Due = Seen; // another thread took a token, try again against its value
+    }
+
+    if( Site->Suppressed != 0 && !GlobalLoggerState.Async.IsEnabled )
+    {
+        EnterCriticalSection(&GlobalLoggerState.Lock);
+        LoggerWriteSuppressedLocked(Site);
+        LeaveCriticalSection(&GlobalLoggerState.Lock); // flushed together with the record
+    }
+
+    return TRUE;
+}
+
+//////////////////////////////////////////
+//
+//          ASYNC RING BUFFER
+//
+//////////////////////////////////////////
+
+/**
+* Allocates the ring and marks every slot free for its first lap.
+* 
+* @param Ring     Ring to initialise.
+* @param Capacity Number of slots, must be a power of two.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerRingInitialise(
+    _Out_ PLOG_RING Ring,
+    _In_  ULONG Capacity
+)
+{
+    memset(Ring, 0, sizeof(*Ring));
+
+    Ring->Slots = (PLOG_RING_SLOT)malloc((SIZE_T)Capacity * sizeof(LOG_RING_SLOT));
+    if( Ring->Slots == NULL )
+    {
+        return FALSE;
+    }
+
+    for( ULONG i = 0; i < Capacity; ++i )
+    {
+        Ring->Slots[i].Sequence = i;
+    }
+
+    Ring->Capacity = Capacity;
+    Ring->Mask = Capacity - 1;
+
+    return TRUE;
+}
+
+/**
+* Claims the next free slot for a producer.
+* 
+* @param Ring      Ring to claim from.
+* @param Position  Receives the claimed position, passed back to LoggerRingPublish.
+* 
+* @return The claimed slot, NULL if the ring is full.
+*/
+static
+PLOG_RING_SLOT
+LoggerRingClaim(
+    _In_  PLOG_RING Ring,
+    _Out_ PLONG64 Position
+)
+{
+    LONG64 Current = Ring->EnqueuePosition;
+
+    for( ;; )
+    {
+        PLOG_RING_SLOT Slot = &Ring->Slots[Current & Ring->Mask];
+        LONG64 Difference = Slot->Sequence - Current;
+
+        if( Difference == 0 )
+        {
+            LONG64 Previous = InterlockedCompareExchange64(&Ring->EnqueuePosition, Current + 1, Current);
+            if( Previous == Current )
+            {
+                *Position = Current;
+                return Slot;
+            }
+
+            Current = Previous; // another producer won the slot
+        }
+        else if( Difference < 0 )
+        {
+            return NULL; // the writer has not released this slot from the previous lap
+        }
+        else
+        {
+            Current = Ring->EnqueuePosition;
+        }
+    }
+}
+
+/**
+* Hands a filled slot to the writer thread.
+*/
+static
+VOID
+LoggerRingPublish(
+    _In_ PLOG_RING_SLOT Slot,
+    _In_ LONG64 Position
+)
+{
+    InterlockedExchange64(&Slot->Sequence, Position + 1); // release, the record is visible before the sequence
+}
+
+/**
+* Returns the oldest published slot, single consumer only.
+* 
+* @return The slot, NULL if the ring is empty or the next producer has not published yet.
+*/
+static
+PLOG_RING_SLOT
+LoggerRingPeek(
+    _In_ PLOG_RING Ring
+)
+{
+    PLOG_RING_SLOT Slot = &Ring->Slots[Ring->DequeuePosition & Ring->Mask];
+    LONG64 Sequence = InterlockedCompareExchange64(&Slot->Sequence, 0, 0); // acquire
+
+    return ( Sequence == Ring->DequeuePosition + 1 ) ? Slot : NULL;
+}
+
+/**
+* Frees the slot returned by LoggerRingPeek for the producers' next lap.
+*/
+static
+VOID
+LoggerRingRelease(
+    _In_ PLOG_RING Ring,
+    _In_ PLOG_RING_SLOT Slot
+)
+{
+    LONG64 Position = Ring->DequeuePosition;
+    Ring->DequeuePosition = Position + 1;
+    InterlockedExchange64(&Slot->Sequence, Position + Ring->Capacity);
+}
+
+/**
+* @return Number of slots currently claimed, approximate while producers are active.
+*/
+static
+LONG64
+LoggerRingDepth(
+    _In_ PLOG_RING Ring
+)
+{
+    return Ring->EnqueuePosition - Ring->DequeuePosition;
+}
+
+/**
+* Builds a record for a message from the logger itself.
+* 
+* @param RecordFormat GlobalLoggerState.Format for the main output, a sink's format otherwise.
+* 
+* @return Length of the record, 0 if it could not be built.
+*/
+FORMAT_PRINTF(5, 6)
+static
+ULONG
+LoggerFormatNotice(
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize,
+    _In_  LOG_FORMAT RecordFormat,
+    _In_  LOG_LEVEL Level,
+    _In_  PCSTR Format,
+    ...
+)
+{
+    va_list Args;
+    va_start(Args, Format);
+
+    ULONG Length = LoggerBuildRecord(Buffer, BufferSize, NULL, Level, "logger", 0, RecordFormat, Format, Args);
+
+    va_end(Args);
+
+    return Length;
+}
+
+/**
+* Drains the ring into the current stream in batches, flushing once per batch rather than per line.
+*/
+static
+DWORD
+WINAPI
+LoggerWriterThread(
+    _In_ LPVOID lpData
+)
+{
+    PLOGGER_ASYNC_STATE Async = (PLOGGER_ASYNC_STATE)lpData;
+
+    for( ;; )
+    {
+        ULONG Written = 0;
+        PLOG_RING_SLOT Slot;
+
+        EnterCriticalSection(&GlobalLoggerState.Lock);
+
+        Written += LoggerWriteSuppressedSitesLocked(); // ahead of the records that passed since
+
+        while( Written < ASYNC_BATCH_SIZE && ( Slot = LoggerRingPeek( &Async->Ring ) ) != NULL )
+        {
+            LoggerWriteRecordLocked(Slot->Record, Slot->Length);
+            LoggerRingRelease(&Async->Ring, Slot);
+            ++Written;
+        }
+
+        LONG64 Dropped = InterlockedExchange64(&Async->Dropped, 0);
+        if( Dropped > 0 )
+        {
+            CHAR Notice[LOG_RECORD_HEADER_SIZE];
+            ULONG Length = LoggerFormatNotice(Notice, sizeof(Notice), GlobalLoggerState.Format, LOG_LEVEL_WARN, "%lld message(s) dropped, log ring was full", (long long)Dropped);
+
+            if( LoggerWriteRecordLocked( Notice, Length ) )
+            {
+                ++Written;
+            }
+        }
+
+        if( Written > 0 )
+        {
+            LoggerFlushLocked();
+        }
+
+        LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+        if( Written == 0 )
+        {
+            if( !Async->Running && LoggerRingDepth( &Async->Ring ) == 0 )
+            {
+                break; // stopped and fully drained
+            }
+
+            WaitForSingleObject(Async->WakeEvent, ASYNC_POLL_INTERVAL);
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Claims a slot of the async ring, applying the overflow policy while the ring is full.
+* 
+* @param Level    Level of the record about to be queued.
+* @param Position Receives the claimed position.
+* 
+* @return The claimed slot, NULL if the record was dropped and counted.
+*/
+static
+PLOG_RING_SLOT
+LoggerAsyncClaim(
+    _In_  LOG_LEVEL Level,
+    _Out_ PLONG64 Position
+)
+{
+    PLOGGER_ASYNC_STATE Async = &GlobalLoggerState.Async;
+    PLOG_RING_SLOT Slot;
+
+    while( ( Slot = LoggerRingClaim( &Async->Ring, Position ) ) == NULL )
+    {
+        BOOL IsDropped = ( Async->Policy == LOG_OVERFLOW_DROP ) ||
+                         ( Async->Policy == LOG_OVERFLOW_DROP_BELOW && Level < Async->DropBelow );
+
+        if( IsDropped || !Async->Running )
+        {
+            InterlockedIncrement64(&Async->Dropped);
+            return NULL;
+        }
+
+        SetEvent(Async->WakeEvent);
+        SwitchToThread(); // blocking policy, wait for the writer to free a slot
+    }
+
+    return Slot;
+}
+
+/**
+* Publishes a filled slot. Only wakes the writer when the ring is filling up or the record is an
+* error, otherwise the writer picks it up on its next poll.
+*/
+static
+VOID
+LoggerAsyncPublish(
+    _In_ PLOG_RING_SLOT Slot,
+    _In_ LONG64 Position
+)
+{
+    PLOGGER_ASYNC_STATE Async = &GlobalLoggerState.Async;
+
+    LoggerRingPublish(Slot, Position);
+
+    if( Slot->Level >= LOG_LEVEL_ERROR || LoggerRingDepth( &Async->Ring ) >= Async->Ring.Capacity / 2 )
+    {
+        SetEvent(Async->WakeEvent);
+    }
+}
+
+/**
+* Formats a message straight into a ring slot, so the common path is a CAS, the formatting and one
+* interlocked store.
+* 
+* @return TRUE if the record was queued or deliberately dropped, FALSE if async mode is off.
+*/
+static
+BOOL
+LoggerWriteAsync(
+    _In_opt_ PLOG_SITE Site,
+    _In_ LOG_LEVEL Level,
+    _In_ PCSTR Filename,
+    _In_ UINT64 LineNumber,
+    _In_ PCSTR Format,
+    _In_ va_list Args
+)
+{
+    LONG64 Position;
+
+    if( !GlobalLoggerState.Async.IsEnabled )
+    {
+        return FALSE;
+    }
+
+    PLOG_RING_SLOT Slot = LoggerAsyncClaim(Level, &Position);
+    if( Slot == NULL )
+    {
+        return TRUE;
+    }
+
+    Slot->Level = Level;
+    Slot->Length = LoggerBuildRecord(Slot->Record, sizeof(Slot->Record), Site, Level, Filename, LineNumber, GlobalLoggerState.Format, Format, Args);
+
+    LoggerAsyncPublish(Slot, Position);
+
+    return TRUE;
+}
+
+/**
+* Queues a record that was already built, at most ASYNC_RECORD_SIZE bytes.
+* 
+* @return TRUE if the record was queued or deliberately dropped, FALSE if async mode is off.
+*/
+static
+BOOL
+LoggerQueueRecord(
+    _In_ LOG_LEVEL Level,
+    _In_ PCSTR Record,
+    _In_ ULONG Length
+)
+{
+    LONG64 Position;
+
+    if( !GlobalLoggerState.Async.IsEnabled )
+    {
+        return FALSE;
+    }
+
+    PLOG_RING_SLOT Slot = LoggerAsyncClaim(Level, &Position);
+    if( Slot == NULL )
+    {
+        return TRUE;
+    }
+
+    Slot->Level = Level;
+    Slot->Length = min(Length, (ULONG)sizeof(Slot->Record));
+    memcpy(Slot->Record, Record, Slot->Length);
+
+    LoggerAsyncPublish(Slot, Position);
+
+    return TRUE;
+}
+
+/**
+* Stops the writer thread after it has drained the ring, and frees the ring.
+*/
+static
+VOID
+LoggerStopAsync(
+    VOID
+)
+{
+    PLOGGER_ASYNC_STATE Async = &GlobalLoggerState.Async;
+
+    if( !Async->IsEnabled )
+    {
+        return;
+    }
+
+    Async->Running = FALSE;
+    SetEvent(Async->WakeEvent);
+    WaitForSingleObject(Async->WriterThread, INFINITE);
+
+    CloseHandle(Async->WriterThread);
+    CloseHandle(Async->WakeEvent);
+    free(Async->Ring.Slots);
+
+    memset(Async, 0, sizeof(*Async));
+}
+
+//////////////////////////////////////////
+//
+//          SINKS
+//
+//////////////////////////////////////////
+
+/**
+* @return Bit ( 1 << LOG_SINK_* ) set for every console or UDP sink that takes the level.
+*/
+static
+ULONG
+LoggerSinkMask(
+    _In_ LOG_LEVEL Level
+)
+{
+    ULONG Mask = 0;
+
+    for( ULONG i = LOG_SINK_CONSOLE; i < LOG_SINK_COUNT; ++i )
+    {
+        PLOG_SINK_STATE Sink = &GlobalLoggerState.Sinks[i];
+
+        if( Sink->IsEnabled && (LONG)Level >= Sink->Level )
+        {
+            Mask |= 1UL << i;
+        }
+    }
+
+    return Mask;
+}
+
+/**
+* Copies a record into a sink's ring. Never waits, a sink that falls behind loses records rather
+* than holding up the producer or the other sinks.
+* 
+* @param Sink   Sink to queue to.
+* @param Level  Level of the record.
+* @param Record Record in the sink's format, at most ASYNC_RECORD_SIZE bytes.
+* @param Length Length of the record.
+*/
+static
+VOID
+LoggerSinkEnqueue(
+    _Inout_ PLOG_SINK_STATE Sink,
+    _In_    LOG_LEVEL Level,
+    _In_    PCSTR Record,
+    _In_    ULONG Length
+)
+{
+    LONG64 Position;
+    PLOG_RING_SLOT Slot = Sink->Running ? LoggerRingClaim( &Sink->Ring, &Position ) : NULL;
+
+    if( Slot == NULL )
+    {
+        InterlockedIncrement64(&Sink->Dropped);
+        return;
+    }
+
+    Slot->Level = Level;
+    Slot->Length = min(Length, (ULONG)sizeof(Slot->Record));
+    memcpy(Slot->Record, Record, Slot->Length);
+
+    LoggerRingPublish(Slot, Position);
+
+    if( Level >= LOG_LEVEL_ERROR || LoggerRingDepth( &Sink->Ring ) >= Sink->Ring.Capacity / 2 )
+    {
+        SetEvent(Sink->WakeEvent);
+    }
+}
+
+/**
+* Hands one record to the sink's stream or socket.
+* 
+* @return TRUE if the record was written or sent, FALSE otherwise.
+*/
+static
+BOOL
+LoggerSinkDeliver(
+    _In_ PLOG_SINK_STATE Sink,
+    _In_ PCSTR Record,
+    _In_ ULONG Length
+)
+{
+    if( Sink->Stream != NULL )
+    {
+        return fwrite(Record, 1, Length, Sink->Stream) == Length;
+    }
+
+    // one datagram per record, the socket is nonblocking so a full buffer drops the record
+    return sendto(Sink->Socket, Record, (INT)Length, 0, (const struct sockaddr*)&Sink->Address, sizeof(Sink->Address)) == (INT)Length;
+}
+
+/**
+* Drains a sink's ring in batches, flushing a console stream once per batch.
+*/
+static
+DWORD
+WINAPI
+LoggerSinkThread(
+    _In_ LPVOID lpData
+)
+{
+    PLOG_SINK_STATE Sink = (PLOG_SINK_STATE)lpData;
+
+    for( ;; )
+    {
+        ULONG Written = 0;
+        PLOG_RING_SLOT Slot;
+
+        while( Written < SINK_BATCH_SIZE && ( Slot = LoggerRingPeek( &Sink->Ring ) ) != NULL )
+        {
+            if( !LoggerSinkDeliver( Sink, Slot->Record, Slot->Length ) )
+            {
+                InterlockedIncrement64(&Sink->Dropped);
+            }
+
+            LoggerRingRelease(&Sink->Ring, Slot);
+            ++Written;
+        }
+
+        LONG64 Dropped = InterlockedExchange64(&Sink->Dropped, 0);
+        if( Dropped > 0 )
+        {
+            CHAR Notice[LOG_RECORD_HEADER_SIZE];
+            ULONG Length = LoggerFormatNotice(Notice, sizeof(Notice), Sink->Format, LOG_LEVEL_WARN, "%lld message(s) dropped, log sink fell behind", (long long)Dropped);
+
+            if( Length > 0 && LoggerSinkDeliver( Sink, Notice, Length ) )
+            {
+                ++Written;
+            }
+            else
+            {
+                InterlockedExchangeAdd64(&Sink->Dropped, Dropped); // reported once the sink catches up
+            }
+        }
+
+        if( Written > 0 && Sink->Stream != NULL )
+        {
+            fflush(Sink->Stream);
+        }
+
+        if( Written == 0 )
+        {
+            if( !Sink->Running && LoggerRingDepth( &Sink->Ring ) == 0 )
+            {
+                break; // stopped and fully drained
+            }
+
+            WaitForSingleObject(Sink->WakeEvent, ASYNC_POLL_INTERVAL);
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Allocates a sink's ring and starts its thread. The caller has set the stream or socket.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LoggerStartSink(
+    _Inout_ PLOG_SINK_STATE Sink,
+    _In_    LOG_FORMAT Format,
+    _In_    LOG_LEVEL Level
+)
+{
+    if( !LoggerRingInitialise( &Sink->Ring, SINK_DEFAULT_CAPACITY ) )
+    {
+        return FALSE;
+    }
+
+    Sink->WakeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if( Sink->WakeEvent == NULL )
+    {
+        free(Sink->Ring.Slots);
+        return FALSE;
+    }
+
+    Sink->Format = Format;
+    Sink->Level = Level;
+    Sink->Running = TRUE;
+
+    Sink->Thread = CreateThread(NULL, 0, LoggerSinkThread, Sink, 0, NULL);
+    if( Sink->Thread == NULL )
+    {
+        CloseHandle(Sink->WakeEvent);
+        free(Sink->Ring.Slots);
+        return FALSE;
+    }
+
+    InterlockedExchange(&Sink->IsEnabled, TRUE);
+
+    return TRUE;
+}
+
+/**
+* Stops every sink after its thread has drained its ring, and closes the UDP socket.
+*/
+static
+VOID
+LoggerStopSinks(
+    VOID
+)
+{
+    for( ULONG i = LOG_SINK_CONSOLE; i < LOG_SINK_COUNT; ++i )
+    {
+        PLOG_SINK_STATE Sink = &GlobalLoggerState.Sinks[i];
+
+        if( !Sink->IsEnabled )
+        {
+            continue;
+        }
+
+        InterlockedExchange(&Sink->IsEnabled, FALSE);
+        Sink->Running = FALSE;
+        SetEvent(Sink->WakeEvent);
+        WaitForSingleObject(Sink->Thread, INFINITE);
+
+        CloseHandle(Sink->Thread);
+        CloseHandle(Sink->WakeEvent);
+        free(Sink->Ring.Slots);
+
+        if( Sink->Socket != 0 && Sink->Socket != INVALID_SOCKET )
+        {
+            closesocket(Sink->Socket);
+        }
+
+        memset(Sink, 0, sizeof(*Sink));
+    }
+}
+
+/**
+* Writes one log call to the main output, if it takes the level, and to every sink in SinkMask. The
+* record is built once per format, sinks sharing the main output's format get a copy of its record.
+* 
+* @param IsWritten TRUE if the main output takes the level.
+* @param SinkMask  Sinks that take the level, from LoggerSinkMask.
+*/
+static
+VOID
+LoggerWriteFanOut(
+    _In_opt_ PLOG_SITE Site,
+    _In_ LOG_LEVEL Level,
+    _In_ PCSTR Filename,
+    _In_ UINT64 LineNumber,
+    _In_ BOOL IsWritten,
+    _In_ ULONG SinkMask,
+    _In_ PCSTR Format,
+    _In_ va_list Args
+)
+{
+    CHAR       Record[LOG_RECORD_HEADER_SIZE + MAXIMUM_LOG_MESSAGE_SIZE];
+    ULONG      Length = 0;
+    LOG_FORMAT RecordFormat = GlobalLoggerState.Format;
+    va_list    Copy;
+
+    if( IsWritten )
+    {
+        // built to the size of a ring slot in async mode, so the queued copy is whole
+        ULONG Size = GlobalLoggerState.Async.IsEnabled ? ASYNC_RECORD_SIZE : (ULONG)sizeof(Record);
+
+        va_copy(Copy, Args);
+        Length = LoggerBuildRecord(Record, Size, Site, Level, Filename, LineNumber, RecordFormat, Format, Copy);
+        va_end(Copy);
+
+        if( Length > 0 && !LoggerQueueRecord( Level, Record, Length ) )
+        {
+            LoggerWriteRecord(Record, Length);
+        }
+    }
+
+    for( ULONG i = LOG_SINK_CONSOLE; i < LOG_SINK_COUNT; ++i )
+    {
+        PLOG_SINK_STATE Sink = &GlobalLoggerState.Sinks[i];
+
+        if( ( SinkMask & ( 1UL << i ) ) == 0 )
+        {
+            continue;
+        }
+
+        if( Length == 0 || Length > ASYNC_RECORD_SIZE || RecordFormat != Sink->Format )
+        {
+            RecordFormat = Sink->Format;
+
+            va_copy(Copy, Args);
+            Length = LoggerBuildRecord(Record, ASYNC_RECORD_SIZE, Site, Level, Filename, LineNumber, RecordFormat, Format, Copy);
+            va_end(Copy);
+        }
+
+        if( Length > 0 )
+        {
+            LoggerSinkEnqueue(Sink, Level, Record, Length);
+        }
+    }
+}
+
+//////////////////////////////////////////
+//
+//          FLIGHT RECORDER
+//
+//////////////////////////////////////////
+
+/**
+* Lets the LOG_* macros through for everything that is either written, captured or taken by a sink.
+*/
+static
+VOID
+LoggerUpdateThreshold(
+    VOID
+)
+{
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
+    LONG Threshold = LoggerWriteLevel;
+
+    if( Recorder->IsEnabled && (LONG)Recorder->CaptureLevel < Threshold )
+    {
+        Threshold = Recorder->CaptureLevel;
+    }
+
+    for( ULONG i = LOG_SINK_CONSOLE; i < LOG_SINK_COUNT; ++i )
+    {
+        PLOG_SINK_STATE Sink = &GlobalLoggerState.Sinks[i];
+
+        if( Sink->IsEnabled && Sink->Level < Threshold )
+        {
+            Threshold = Sink->Level;
+        }
+    }
+
+    InterlockedExchange(&LoggerThreshold, Threshold);
+}
+
+/**
+* Releases the ring of an exiting thread for reuse.
+*/
+static
+VOID
+WINAPI
+LoggerRecorderThreadExit(
+    _In_opt_ PVOID lpFlsData
+)
+{
+    PLOG_RECORDER_RING Ring = (PLOG_RECORDER_RING)lpFlsData;
+
+    if( Ring != NULL )
+    {
+        InterlockedExchange(&Ring->IsOwned, FALSE);
+    }
+}
+
+/**
+* Returns the ring of the calling thread. Only a thread's first capture takes the logger lock, to
+* adopt the ring of a thread that exited or to allocate a new one.
+* 
+* @return The ring, NULL if it could not be allocated.
+*/
+static
+PLOG_RECORDER_RING
+LoggerRecorderThreadRing(
+    VOID
+)
+{
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
+
+    PLOG_RECORDER_RING Ring = (PLOG_RECORDER_RING)FlsGetValue(Recorder->FlsIndex);
+    if( Ring != NULL )
+    {
+        return Ring;
+    }
+
+    EnterCriticalSection(&GlobalLoggerState.Lock);
+
+    for( Ring = Recorder->Rings; Ring != NULL; Ring = Ring->Next )
+    {
+        if( InterlockedCompareExchange( &Ring->IsOwned, TRUE, FALSE ) == FALSE )
+        {
+            break;
+        }
+    }
+
+    if( Ring == NULL )
+    {
+        Ring = (PLOG_RECORDER_RING)calloc(1, sizeof(LOG_RECORDER_RING) + (SIZE_T)Recorder->Capacity * sizeof(LOG_RECORDER_SLOT));
+        if( Ring != NULL )
+        {
+            Ring->Slots = (PLOG_RECORDER_SLOT)( Ring + 1 );
+            Ring->IsOwned = TRUE;
+            Ring->Next = Recorder->Rings;
+            Recorder->Rings = Ring;
+        }
+    }
+
+    LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+    if( Ring != NULL )
+    {
+        FlsSetValue(Recorder->FlsIndex, Ring);
+    }
+
+    return Ring;
+}
+
+/**
+* Keeps a record the current level filters out in the calling thread's ring. Registered sites keep
+* their raw arguments, so the cost is the same as a binary event and no I/O.
+* 
+* @param Site The call site of the message.
+* @param Args The arguments of the call.
+*/
+static
+VOID
+LoggerRecorderCapture(
+    _Inout_ PLOG_SITE Site,
+    _In_    va_list Args
+)
+{
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
+
+    if( !Recorder->IsEnabled || Site->Level < Recorder->CaptureLevel )
+    {
+        return;
+    }
+
+    PLOG_RECORDER_RING Ring = LoggerRecorderThreadRing();
+    if( Ring == NULL )
+    {
+        return;
+    }
+
+    LONG64 Index = Ring->Head;
+    PLOG_RECORDER_SLOT Slot = &Ring->Slots[Index & ( Recorder->Capacity - 1 )];
+
+    InterlockedExchange64(&Slot->Sequence, 0); // a dump running now skips the slot
+
+    LARGE_INTEGER Ticks;
+    QueryPerformanceCounter(&Ticks);
+
+    Slot->Site = Site;
+    Slot->ThreadId = GetCurrentThreadId();
+    Slot->Ticks = (UINT64)Ticks.QuadPart;
+    Slot->IsText = !LoggerRegisterSite( Site );
+
+    if( !Slot->IsText )
+    {
+        Slot->Length = LoggerEncodeArguments(Slot->Arguments, sizeof(Slot->Arguments), Site, Args);
+        Slot->IsText = ( Slot->Length == 0 && Site->ArgCount > 0 ); // the fixed size arguments did not fit
+    }
+
+    if( Slot->IsText )
+    {
+        _vsnprintf_s(Slot->Arguments, sizeof(Slot->Arguments), _TRUNCATE, Site->Format, Args);
+        Slot->Length = 0;
+    }
+
+    InterlockedExchange64(&Slot->Sequence, Index + 1);
+    Ring->Head = Index + 1; // single writer, the exchange above already ordered the slot before it
+}
+
+/**
+* Copies the records of a ring that were not dumped yet. The caller holds GlobalLoggerState.Lock.
+* 
+* @param Ring     Ring to copy.
+* @param Snapshot Receives up to Capacity records.
+* 
+* @return Number of records copied.
+*/
+static
+ULONG
+LoggerRecorderSnapshot(
+    _Inout_ PLOG_RECORDER_RING Ring,
+    _Out_   PLOG_RECORDER_SLOT Snapshot
+)
+{
+    ULONG Capacity = GlobalLoggerState.Recorder.Capacity;
+    LONG64 Head = InterlockedCompareExchange64(&Ring->Head, 0, 0); // acquire
+    LONG64 Index = max(Ring->Dumped, Head - (LONG64)Capacity);
+    ULONG Count = 0;
+
+    for( ; Index < Head; ++Index )
+    {
+        PLOG_RECORDER_SLOT Slot = &Ring->Slots[Index & ( Capacity - 1 )];
+
+        if( InterlockedCompareExchange64( &Slot->Sequence, 0, 0 ) != Index + 1 )
+        {
+            continue; // being overwritten
+        }
+
+        memcpy(&Snapshot[Count], (const VOID*)Slot, sizeof(*Slot));
+
+        if( InterlockedCompareExchange64( &Slot->Sequence, 0, 0 ) == Index + 1 )
+        {
+            ++Count; // not touched while it was copied
+        }
+    }
+
+    Ring->Dumped = Head;
+
+    return Count;
+}
+
+/**
+* Orders captured records of all threads by their performance counter.
+*/
+static
+INT
+LoggerRecorderCompare(
+    _In_ const VOID* Left,
+    _In_ const VOID* Right
+)
+{
+    UINT64 LeftTicks = ( (const LOG_RECORDER_SLOT*)Left )->Ticks;
+    UINT64 RightTicks = ( (const LOG_RECORDER_SLOT*)Right )->Ticks;
+
+    return ( LeftTicks > RightTicks ) - ( LeftTicks < RightTicks );
+}
+
+/**
+* Converts a captured performance counter to the YYYY-MM-DD HH:MM:SS.mmm of the text log.
+* 
+* @return TRUE if the timestamp was created successfully, FALSE otherwise.
+*/
+static
+BOOL
+LoggerRecorderTimestamp(
+    _In_  UINT64 Ticks,
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize
+)
+{
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
+
+    // split so that a long running process does not overflow the multiplication
+    INT64 Elapsed = (INT64)Ticks - Recorder->BaseTicks;
+    INT64 Offset = ( Elapsed / Recorder->TicksPerSecond ) * 10000000LL +
+                   ( Elapsed % Recorder->TicksPerSecond ) * 10000000LL / Recorder->TicksPerSecond;
+
+    ULARGE_INTEGER Time;
+    Time.QuadPart = Recorder->BaseTime + Offset;
+
+    FILETIME   FileTime;
+    SYSTEMTIME SystemTime;
+
+    FileTime.dwLowDateTime = Time.LowPart;
+    FileTime.dwHighDateTime = Time.HighPart;
+
+    if( !FileTimeToSystemTime( &FileTime, &SystemTime ) )
+    {
+        return FALSE;
+    }
+
+    INT Result = _snprintf_s(
+        Buffer,
+        BufferSize,
+        _TRUNCATE,
+        "%04d-%02d-%02d %02d:%02d:%02d.%03d",
+        SystemTime.wYear,
+        SystemTime.wMonth,
+        SystemTime.wDay,
+        SystemTime.wHour,
+        SystemTime.wMinute,
+        SystemTime.wSecond,
+        SystemTime.wMilliseconds
+    );
+
+    return Result > 0;
+}
+
+/**
+* Builds the JSON line for a captured slot, with the capture time and a "tid" member.
+* 
+* @return Length of the line, 0 if it could not be built.
+*/
+static
+ULONG
+LoggerRecorderBuildJson(
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize,
+    _In_  const LOG_RECORDER_SLOT* Slot
+)
+{
+    const ULONG ThreadRoom = 24; // ,"tid":4294967295}\n
+
+    PLOG_SITE Site = Slot->Site;
+
+    CHAR Timestamp[TIMESTAMP_BUFFER_SIZE] = { 0 };
+    if( BufferSize <= ThreadRoom || !LoggerRecorderTimestamp( Slot->Ticks, Timestamp, sizeof(Timestamp) ) )
+    {
+        return 0;
+    }
+
+    LOG_JSON_TEMPLATE Scratch;
+    const LOG_JSON_TEMPLATE* Template = LoggerJsonTemplate(Site, Site->Level, Site->FileName, Site->Line, &Scratch);
+    if( Template == NULL )
+    {
+        return 0;
+    }
+
+    ULONG Length;
+
+    if( !Template->HasMessage && !Slot->IsText )
+    {
+        Length = LogFormatRenderJson(Template, Timestamp, NULL, Site->ArgTypes, Site->ArgCount, (const UINT8*)Slot->Arguments, Slot->Length, Buffer, BufferSize - ThreadRoom);
+    }
+    else
+    {
+        CHAR Message[MAXIMUM_LOG_MESSAGE_SIZE];
+
+        if( Slot->IsText )
+        {
+            strncpy_s(Message, sizeof(Message), Slot->Arguments, _TRUNCATE);
+
+            // captured while the site was being registered, its fields were formatted as a message
+            if( !Template->HasMessage )
+            {
+                if( !LogFormatBuildJsonTemplate( LOG_LEVEL_NAMES[Site->Level], Site->FileName, Site->Line, Site->Event, NULL, &Scratch ) )
+                {
+                    return 0;
+                }
+
+                Template = &Scratch;
+            }
+        }
+        else if( !LogFormatRender( Site->Format, Site->ArgTypes, Site->ArgCount, (const UINT8*)Slot->Arguments, Slot->Length, Message, sizeof(Message) ) )
+        {
+            return 0;
+        }
+
+        Length = LogFormatRenderJson(Template, Timestamp, Message, NULL, 0, NULL, 0, Buffer, BufferSize - ThreadRoom);
+    }
+
+    if( Length < 2 )
+    {
+        return 0;
+    }
+
+    // the thread id goes in place of the closing brace
+    Length -= 2;
+    INT Tail = _snprintf_s(Buffer + Length, BufferSize - Length, _TRUNCATE, ",\"tid\":%lu}\n", (unsigned long)Slot->ThreadId);
+
+    return ( Tail < 0 ) ? 0 : Length + Tail;
+}
+
+/**
+* Builds the record for a captured slot in the current format. Text lines carry the capture time and
+* the thread id, binary records the captured performance counter so that logtool orders them.
+* 
+* @return Length of the record, 0 if it could not be built.
+*/
+static
+ULONG
+LoggerRecorderBuildRecord(
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize,
+    _In_  const LOG_RECORDER_SLOT* Slot
+)
+{
+    const LOG_SITE* Site = Slot->Site;
+
+    if( GlobalLoggerState.Format == LOG_FORMAT_JSON )
+    {
+        return LoggerRecorderBuildJson(Buffer, BufferSize, Slot);
+    }
+
+    if( GlobalLoggerState.Format == LOG_FORMAT_BINARY && !Slot->IsText )
+    {
+        LOG_RECORD_HEADER Header;
+        Header.Type = LOG_RECORD_EVENT;
+        Header.Level = (UINT8)Site->Level;
+        Header.Length = (UINT16)( sizeof(LOG_EVENT_RECORD) + Slot->Length );
+
+        LOG_EVENT_RECORD Event;
+        Event.FormatId = Site->FormatId;
+        Event.Ticks = Slot->Ticks;
+
+        memcpy(Buffer, &Header, sizeof(Header));
+        memcpy(Buffer + sizeof(Header), &Event, sizeof(Event));
+        memcpy(Buffer + sizeof(Header) + sizeof(Event), Slot->Arguments, Slot->Length);
+
+        return sizeof(Header) + sizeof(Event) + Slot->Length;
+    }
+
+    CHAR  Message[MAXIMUM_LOG_MESSAGE_SIZE] = { 0 };
+    ULONG EventLength = 0;
+
+    if( Site->Event != NULL )
+    {
+        INT Written = _snprintf_s(Message, sizeof(Message), _TRUNCATE, "%s ", Site->Event);
+        EventLength = ( Written < 0 ) ? (ULONG)strlen( Message ) : (ULONG)Written;
+    }
+
+    if( Slot->IsText )
+    {
+        strncpy_s(Message + EventLength, sizeof(Message) - EventLength, Slot->Arguments, _TRUNCATE);
+    }
+    else if( !LogFormatRender( Site->Format, Site->ArgTypes, Site->ArgCount, (const UINT8*)Slot->Arguments, Slot->Length, Message + EventLength, sizeof(Message) - EventLength ) )
+    {
+        return 0;
+    }
+
+    if( GlobalLoggerState.Format == LOG_FORMAT_BINARY )
+    {
+        ULONG FilenameSize = (ULONG)strlen(Site->FileName) + 1;
+        ULONG MessageSize = (ULONG)strlen(Message) + 1;
+        ULONG Length = sizeof(LOG_RECORD_HEADER) + sizeof(LOG_TEXT_RECORD) + FilenameSize + MessageSize;
+
+        if( Length > BufferSize )
+        {
+            return 0;
+        }
+
+        LOG_RECORD_HEADER Header;
+        Header.Type = LOG_RECORD_TEXT;
+        Header.Level = (UINT8)Site->Level;
+        Header.Length = (UINT16)( Length - sizeof(Header) );
+
+        LOG_TEXT_RECORD Text;
+        Text.Ticks = Slot->Ticks;
+        Text.Line = Site->Line;
+
+        memcpy(Buffer, &Header, sizeof(Header));
+        memcpy(Buffer + sizeof(Header), &Text, sizeof(Text));
+        memcpy(Buffer + sizeof(Header) + sizeof(Text), Site->FileName, FilenameSize);
+        memcpy(Buffer + sizeof(Header) + sizeof(Text) + FilenameSize, Message, MessageSize);
+
+        return Length;
+    }
+
+    CHAR Timestamp[TIMESTAMP_BUFFER_SIZE] = { 0 };
+    if( !LoggerRecorderTimestamp( Slot->Ticks, Timestamp, sizeof(Timestamp) ) )
+    {
+        return 0;
+    }
+
+    INT Length = _snprintf_s(
+        Buffer,
+        BufferSize,
+        _TRUNCATE,
+        "[%s] [%s] [%s:%lu] [tid %lu] %s\n",
+        Timestamp,
+        LOG_LEVEL_NAMES[Site->Level],
+        Site->FileName,
+        (unsigned long)Site->Line,
+        (unsigned long)Slot->ThreadId,
+        Message
+    );
+
+    return ( Length < 0 ) ? (ULONG)strlen( Buffer ) : (ULONG)Length;
+}
+
+/**
+* Removes the recorder and frees every ring. Called once no thread can capture anymore.
+*/
+static
+VOID
+LoggerStopFlightRecorder(
+    VOID
+)
+{
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
+
+    if( !Recorder->IsEnabled )
+    {
+        return;
+    }
+
+    Recorder->IsEnabled = FALSE;
+    FlsFree(Recorder->FlsIndex);
+
+    while( Recorder->Rings != NULL )
+    {
+        PLOG_RECORDER_RING Ring = Recorder->Rings;
+        Recorder->Rings = Ring->Next;
+        free(Ring);
+    }
+
+    memset(Recorder, 0, sizeof(*Recorder));
+}
+
+//////////////////////////////////////////
+//
+//          PUBLIC FUNCTIONS
+//
+//////////////////////////////////////////
+
+INT64
+LoggerInitConsole(
+    _In_ FILE* Filestream
+)
+{
+
+    if( GlobalLoggerState.IsInitialized )
+    {
+        return -1; // Logger is already initialized
+    }
+
+    InitializeCriticalSection( &GlobalLoggerState.Lock );
+
+    GlobalLoggerState.File.Stream = Filestream;
+    GlobalLoggerState.Format = LOG_FORMAT_TEXT; // Binary records are for files only
+    GlobalLoggerState.IsInitialized = TRUE;
+    
+    memset(GlobalLoggerState.BaseFilePath, 0, sizeof(GlobalLoggerState.BaseFilePath));
+    memset(GlobalLoggerState.CurrentFilename, 0, sizeof(GlobalLoggerState.CurrentFilename));
+    memset(&GlobalLoggerState.LastRotationTime, 0, sizeof(GlobalLoggerState.LastRotationTime));
+
+    InterlockedExchange(&LoggerWriteLevel, LOG_LEVEL_INFO); // Default log level
+    LoggerUpdateThreshold();
+
+    return 0;
+}
+
+INT64
+LoggerInitFile(
+    _In_ PCSTR Path,
+    _In_ INT64 RetentionDays
+)
+{
+    if (Path == NULL || GlobalLoggerState.IsInitialized)
+    {
+        return -1; // Invalid path or logger already initialized
+    }
+
+    size_t PathLength = strnlen_s(Path, MAXIMUM_FILENAME_SIZE);
+    if( PathLength == 0 || PathLength >= MAXIMUM_FILENAME_SIZE )
+    {
+        return -1; // Path is too long
+    }
+
+    InitializeCriticalSection(&GlobalLoggerState.Lock);
+
+    strncpy_s(
+        GlobalLoggerState.BaseFilePath,
+        sizeof(GlobalLoggerState.BaseFilePath),
+        Path,
+        _TRUNCATE
+    );
+
+    PSTR Extension = strstr(GlobalLoggerState.BaseFilePath, DEFAULT_LOG_FILE_EXETENSION);
+    if( Extension != NULL )
+    {
+        *Extension = '\0'; // Remove .txt extension if present
+    }
+
+    Extension = strstr(GlobalLoggerState.BaseFilePath, ".exe");
+    if( Extension != NULL )
+    {
+        *Extension = '\0'; // Remove .exe extension if present
+    }
+
+    GlobalLoggerState.MaximumFileAgeDays = RetentionDays;
+
+    SYSTEMTIME CurrentTime;
+    GetLocalTime(&CurrentTime);
+
+    // a restart continues with the day's last part, earlier parts may have been compressed
+    ULONG Part = LoggerFindLastPart(&CurrentTime);
+
+    if( !LoggerCreateFilename(&CurrentTime, Part, GlobalLoggerState.CurrentFilename, sizeof(GlobalLoggerState.CurrentFilename)) )
+    {
+        DeleteCriticalSection(&GlobalLoggerState.Lock);
+        return -1; // Failed to create initial filename
+    }
+
+    if( !LoggerFileOpen( GlobalLoggerState.CurrentFilename, &GlobalLoggerState.File ) )
+    {
+        DeleteCriticalSection(&GlobalLoggerState.Lock);
+        return -1; // Failed to open log file
+    }
+
+    if( !LoggerBeginFile() )
+    {
+        LoggerFileClose(&GlobalLoggerState.File, NULL, FALSE);
+        DeleteCriticalSection(&GlobalLoggerState.Lock);
+        return -1; // Failed to write the binary file header
+    }
+
+    GlobalLoggerState.LastRotationTime = CurrentTime; // Set last rotation time to current time
+    GlobalLoggerState.FilePart = Part;
+    LoggerScheduleNextDay(&CurrentTime);
+
+    GlobalLoggerState.IsInitialized = TRUE;
+
+    // the thread also runs the first retention scan, without it files are switched and closed inline
+    if( !LoggerStartMaintenance() )
+    {
+        LoggerCleanUpDatedFiles(); // Clean up old files
+    }
+
+    InterlockedExchange(&LoggerWriteLevel, LOG_LEVEL_INFO); // Default log level
+    LoggerUpdateThreshold();
+
+    return 0; // Success
+}
+
+INT64
+LoggerSetFormat(
+    _In_ LOG_FORMAT Format
+)
+{
+    if( GlobalLoggerState.IsInitialized )
+    {
+        return -1; // The format of an open file cannot change
+    }
+
+    GlobalLoggerState.Format = Format;
+
+    return 0;
+}
+
+INT64
+LoggerSetRotationSize(
+    _In_ UINT64 MaximumFileSize
+)
+{
+    if( !GlobalLoggerState.IsInitialized || GlobalLoggerState.BaseFilePath[0] == '\0' )
+    {
+        return -1; // Logger is not initialized or does not write to files
+    }
+
+    if( MaximumFileSize != 0 && MaximumFileSize < ROTATION_MINIMUM_SIZE )
+    {
+        return -1;
+    }
+
+    EnterCriticalSection(&GlobalLoggerState.Lock);
+    GlobalLoggerState.MaximumFileSize = MaximumFileSize;
+    LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+    return 0;
+}
+
+INT64
+LoggerSetRateLimit(
+    _In_ ULONG MessagesPerSecond,
+    _In_ ULONG Burst
+)
+{
+    if( !GlobalLoggerState.IsInitialized )
     {
-        LeaveCriticalSection(&GlobalLoggerState.Lock);
-        return; // No file stream available
+        return -1;
     }
 
-    INT64 WrittenBytes = fprintf(
-        GlobalLoggerState.FileStream,
-        "[%s] [%s] [%s:%llu] %s\n",
-        Timestamp,
-        LOG_LEVEL_NAMES[Level],
-        Filename,
-        LineNumber,
-        LogMessage
-    );
+    if( MessagesPerSecond == 0 )
+    {
+        GlobalLoggerState.RateLimit.Interval = 0;
+        return 0;
+    }
+
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+
+    INT64 Interval = max(Frequency.QuadPart / MessagesPerSecond, 1);
+
+    // the window first, a writer that sees the new interval must not see the old window
+    InterlockedExchange64(&GlobalLoggerState.RateLimit.Window, Interval * ( max(Burst, 1) - 1 ));
+    InterlockedExchange64(&GlobalLoggerState.RateLimit.Interval, Interval);
 
-    if (WrittenBytes > 0)
+    return 0;
+}
+
+INT64
+LoggerStartCompression(
+    VOID
+)
+{
+    PLOGGER_COMPRESSION_STATE Compression = &GlobalLoggerState.Compression;
+
+    if( !GlobalLoggerState.IsInitialized || GlobalLoggerState.BaseFilePath[0] == '\0' || Compression->IsEnabled )
     {
-        fflush(GlobalLoggerState.FileStream); // Flush the stream to ensure the message is written
+        return -1; // Logger is not initialized, does not write to files or already compresses
     }
 
-    LeaveCriticalSection(&GlobalLoggerState.Lock);
+    Compression->WakeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if( Compression->WakeEvent == NULL )
+    {
+        return -1;
+    }
+
+    Compression->Running = TRUE;
+
+    Compression->Thread = CreateThread(NULL, 0, LoggerCompressionThread, Compression, 0, NULL);
+    if( Compression->Thread == NULL )
+    {
+        CloseHandle(Compression->WakeEvent);
+        memset(Compression, 0, sizeof(*Compression));
+        return -1;
+    }
+
+    Compression->IsEnabled = TRUE;
+    SetEvent(Compression->WakeEvent); // files rotated by earlier runs
+
+    return 0;
 }
 
+INT64
+LoggerStartAsync(
+    _In_ ULONG Capacity,
+    _In_ LOG_OVERFLOW_POLICY Policy,
+    _In_ LOG_LEVEL DropBelow
+)
+{
+    PLOGGER_ASYNC_STATE Async = &GlobalLoggerState.Async;
 
-//////////////////////////////////////////
-//
-//          PUBLIC FUNCTIONS
-//
-//////////////////////////////////////////
+    if( !GlobalLoggerState.IsInitialized || Async->IsEnabled )
+    {
+        return -1; // Logger is not initialized or async mode is already on
+    }
+
+    if( Capacity == 0 )
+    {
+        Capacity = ASYNC_DEFAULT_CAPACITY;
+    }
+
+    if( ( Capacity & ( Capacity - 1 ) ) != 0 )
+    {
+        return -1; // Capacity must be a power of two
+    }
+
+    if( !LoggerRingInitialise( &Async->Ring, Capacity ) )
+    {
+        return -1;
+    }
+
+    Async->Policy = Policy;
+    Async->DropBelow = DropBelow;
+    Async->Running = TRUE;
+
+    Async->WakeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if( Async->WakeEvent == NULL )
+    {
+        free(Async->Ring.Slots);
+        memset(Async, 0, sizeof(*Async));
+        return -1;
+    }
+
+    Async->WriterThread = CreateThread(NULL, 0, LoggerWriterThread, Async, 0, NULL);
+    if( Async->WriterThread == NULL )
+    {
+        CloseHandle(Async->WakeEvent);
+        free(Async->Ring.Slots);
+        memset(Async, 0, sizeof(*Async));
+        return -1;
+    }
+
+    Async->IsEnabled = TRUE;
+
+    return 0;
+}
 
 INT64
-LoggerInitConsole(
-    _In_ FILE* Filestream
+LoggerStartFlightRecorder(
+    _In_ ULONG RecordsPerThread,
+    _In_ LOG_LEVEL CaptureLevel
 )
 {
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
 
-    if( GlobalLoggerState.IsInitialized )
+    if( !GlobalLoggerState.IsInitialized || Recorder->IsEnabled )
     {
-        return -1; // Logger is already initialized
+        return -1; // Logger is not initialized or the recorder is already on
     }
 
-    InitializeCriticalSection( &GlobalLoggerState.Lock );
+    if( CaptureLevel < LOG_LEVEL_TRACE || CaptureLevel > LOG_LEVEL_FATAL )
+    {
+        return -1;
+    }
 
-    GlobalLoggerState.FileStream = Filestream;
-    GlobalLoggerState.Level = LOG_LEVEL_INFO; // Default log level
-    GlobalLoggerState.IsInitialized = TRUE;
-    
-    memset(GlobalLoggerState.BaseFilePath, 0, sizeof(GlobalLoggerState.BaseFilePath));
-    memset(GlobalLoggerState.CurrentFilename, 0, sizeof(GlobalLoggerState.CurrentFilename));
-    memset(&GlobalLoggerState.LastRotationTime, 0, sizeof(GlobalLoggerState.LastRotationTime));
+    if( RecordsPerThread == 0 )
+    {
+        RecordsPerThread = RECORDER_DEFAULT_RECORDS;
+    }
+
+    if( ( RecordsPerThread & ( RecordsPerThread - 1 ) ) != 0 )
+    {
+        return -1; // Capacity must be a power of two
+    }
+
+    Recorder->FlsIndex = FlsAlloc(LoggerRecorderThreadExit);
+    if( Recorder->FlsIndex == FLS_OUT_OF_INDEXES )
+    {
+        return -1;
+    }
+
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Ticks;
+    FILETIME      SystemTime;
+    FILETIME      LocalTime;
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Ticks);
+    GetSystemTimeAsFileTime(&SystemTime);
+    FileTimeToLocalFileTime(&SystemTime, &LocalTime);
+
+    Recorder->TicksPerSecond = Frequency.QuadPart;
+    Recorder->BaseTicks = Ticks.QuadPart;
+    Recorder->BaseTime = ( (UINT64)LocalTime.dwHighDateTime << 32 ) | LocalTime.dwLowDateTime;
+    Recorder->Capacity = RecordsPerThread;
+    Recorder->CaptureLevel = CaptureLevel;
+    Recorder->IsEnabled = TRUE;
+
+    LoggerUpdateThreshold();
 
     return 0;
 }
 
+VOID
+LoggerDumpFlightRecorder(
+    VOID
+)
+{
+    PLOGGER_RECORDER_STATE Recorder = &GlobalLoggerState.Recorder;
+
+    if( !GlobalLoggerState.IsInitialized || !Recorder->IsEnabled )
+    {
+        return;
+    }
+
+    EnterCriticalSection(&GlobalLoggerState.Lock);
+
+    ULONG RingCount = 0;
+    for( PLOG_RECORDER_RING Ring = Recorder->Rings; Ring != NULL; Ring = Ring->Next )
+    {
+        ++RingCount;
+    }
+
+    PLOG_RECORDER_SLOT Snapshot = NULL;
+    ULONG Count = 0;
+
+    if( RingCount > 0 )
+    {
+        Snapshot = (PLOG_RECORDER_SLOT)malloc((SIZE_T)RingCount * Recorder->Capacity * sizeof(LOG_RECORDER_SLOT));
+    }
+
+    if( Snapshot != NULL )
+    {
+        for( PLOG_RECORDER_RING Ring = Recorder->Rings; Ring != NULL; Ring = Ring->Next )
+        {
+            Count += LoggerRecorderSnapshot(Ring, Snapshot + Count);
+        }
+
+        qsort(Snapshot, Count, sizeof(LOG_RECORDER_SLOT), LoggerRecorderCompare);
+    }
+
+    if( Count > 0 )
+    {
+        CHAR  Record[LOG_RECORD_HEADER_SIZE + MAXIMUM_LOG_MESSAGE_SIZE];
+        ULONG Length = LoggerFormatNotice(Record, sizeof(Record), GlobalLoggerState.Format, LOG_LEVEL_INFO, "flight recorder: %lu record(s) from %lu thread(s)", (unsigned long)Count, (unsigned long)RingCount);
+
+        LoggerWriteRecordLocked(Record, Length);
+
+        for( ULONG i = 0; i < Count; ++i )
+        {
+            Length = LoggerRecorderBuildRecord(Record, sizeof(Record), &Snapshot[i]);
+            LoggerWriteRecordLocked(Record, Length);
+        }
+
+        Length = LoggerFormatNotice(Record, sizeof(Record), GlobalLoggerState.Format, LOG_LEVEL_INFO, "flight recorder: end");
+        LoggerWriteRecordLocked(Record, Length);
+
+        LoggerFlushLocked();
+    }
+
+    LeaveCriticalSection(&GlobalLoggerState.Lock);
+
+    free(Snapshot);
+}
+
 INT64
-LoggerInitFile(
-    _In_ PCSTR Path,
-    _In_ INT64 RetentionDays
+LoggerAddConsoleSink(
+    _In_ FILE* Stream,
+    _In_ LOG_LEVEL Level
 )
 {
-    if (Path == NULL || GlobalLoggerState.IsInitialized)
+    PLOG_SINK_STATE Sink = &GlobalLoggerState.Sinks[LOG_SINK_CONSOLE];
+
+    if( !GlobalLoggerState.IsInitialized || Sink->IsEnabled || Stream == NULL )
     {
-        return -1; // Invalid path or logger already initialized
+        return -1; // Logger is not initialized or the sink already exists
     }
 
-    size_t PathLength = strnlen_s(Path, MAXIMUM_FILENAME_SIZE);
-    if( PathLength == 0 || PathLength >= MAXIMUM_FILENAME_SIZE )
+    if( Level < LOG_LEVEL_NONE || Level > LOG_LEVEL_FATAL )
     {
-        return -1; // Path is too long
+        return -1;
     }
 
-    InitializeCriticalSection(&GlobalLoggerState.Lock);
+    Sink->Stream = Stream;
 
-    strncpy_s(
-        GlobalLoggerState.BaseFilePath,
-        sizeof(GlobalLoggerState.BaseFilePath),
-        Path,
-        _TRUNCATE
-    );
+    if( !LoggerStartSink( Sink, LOG_FORMAT_TEXT, Level ) )
+    {
+        memset(Sink, 0, sizeof(*Sink));
+        return -1;
+    }
 
-    PSTR Extension = strstr(GlobalLoggerState.BaseFilePath, DEFAULT_LOG_FILE_EXETENSION);
-    if( Extension != NULL )
+    LoggerUpdateThreshold();
+
+    return 0;
+}
+
+INT64
+LoggerAddUdpSink(
+    _In_ USHORT Port,
+    _In_ LOG_FORMAT Format,
+    _In_ LOG_LEVEL Level
+)
+{
+    PLOG_SINK_STATE Sink = &GlobalLoggerState.Sinks[LOG_SINK_UDP];
+
+    if( !GlobalLoggerState.IsInitialized || Sink->IsEnabled || Port == 0 )
     {
-        *Extension = '\0'; // Remove .txt extension if present
+        return -1; // Logger is not initialized or the sink already exists
     }
 
-    Extension = strstr(GlobalLoggerState.BaseFilePath, ".exe");
-    if( Extension != NULL )
+    if( ( Format != LOG_FORMAT_TEXT && Format != LOG_FORMAT_JSON ) || Level < LOG_LEVEL_NONE || Level > LOG_LEVEL_FATAL )
     {
-        *Extension = '\0'; // Remove .exe extension if present
+        return -1; // Binary records only make sense with the file's format definitions
     }
 
-    GlobalLoggerState.MaximumFileAgeDays = RetentionDays;
-    GlobalLoggerState.Level = LOG_LEVEL_INFO; // Default log level
+    Sink->Socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if( Sink->Socket == INVALID_SOCKET )
+    {
+        memset(Sink, 0, sizeof(*Sink));
+        return -1;
+    }
 
-    SYSTEMTIME CurrentTime;
-    GetLocalTime(&CurrentTime);
+    if( !NetSetNonBlocking( Sink->Socket, TRUE ) )
+    {
+        closesocket(Sink->Socket);
+        memset(Sink, 0, sizeof(*Sink));
+        return -1;
+    }
+
+    Sink->Address.sin_family = AF_INET;
+    Sink->Address.sin_port = htons(Port);
+    Sink->Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-    if( !LoggerCreateFilename(&CurrentTime, GlobalLoggerState.CurrentFilename, sizeof(GlobalLoggerState.CurrentFilename)) )
+    if( !LoggerStartSink( Sink, Format, Level ) )
     {
-        DeleteCriticalSection(&GlobalLoggerState.Lock);
-        return -1; // Failed to create initial filename
+        closesocket(Sink->Socket);
+        memset(Sink, 0, sizeof(*Sink));
+        return -1;
     }
 
-    errno_t ErrorOpen = fopen_s(&GlobalLoggerState.FileStream, GlobalLoggerState.CurrentFilename, "a");
-    if( ErrorOpen != 0 || GlobalLoggerState.FileStream == NULL )
+    LoggerUpdateThreshold();
+
+    return 0;
+}
+
+INT64
+LoggerSetSinkLevel(
+    _In_ LOG_SINK Sink,
+    _In_ LOG_LEVEL Level
+)
+{
+    if( !GlobalLoggerState.IsInitialized || Level < LOG_LEVEL_NONE || Level > LOG_LEVEL_FATAL )
     {
-        DeleteCriticalSection(&GlobalLoggerState.Lock);
-        return -1; // Failed to open log file
+        return -1;
     }
 
-    GlobalLoggerState.LastRotationTime = CurrentTime; // Set last rotation time to current time
-    GlobalLoggerState.IsInitialized = TRUE;
+    switch( Sink )
+    {
+    case LOG_SINK_MAIN:
+        LoggerSetLevel(Level);
+        return 0;
 
-    LoggerCleanUpDatedFiles(); // Clean up old files
+    case LOG_SINK_RECORDER:
+        if( !GlobalLoggerState.Recorder.IsEnabled || Level < LOG_LEVEL_TRACE )
+        {
+            return -1;
+        }
 
-    return 0; // Success
+        GlobalLoggerState.Recorder.CaptureLevel = Level;
+        break;
+
+    case LOG_SINK_CONSOLE:
+    case LOG_SINK_UDP:
+        if( !GlobalLoggerState.Sinks[Sink].IsEnabled )
+        {
+            return -1;
+        }
+
+        InterlockedExchange(&GlobalLoggerState.Sinks[Sink].Level, Level);
+        break;
+
+    default:
+        return -1;
+    }
+
+    LoggerUpdateThreshold();
+
+    return 0;
 }
 
 VOID
@@ -652,16 +4586,25 @@ LoggerCleanUp(
         return; // Logger is not initialized
     }
 
+    InterlockedExchange(&LoggerThreshold, LOG_THRESHOLD_OFF); // new statements stop at the macro
+    InterlockedExchange(&LoggerWriteLevel, LOG_THRESHOLD_OFF);
+
+    LoggerStopAsync(); // drain queued records before the stream goes away
+    LoggerStopSinks();
+    LoggerStopFlightRecorder();
+    LoggerStopMaintenance();
+    LoggerStopCompression(); // after the maintenance thread, which wakes it
+
     EnterCriticalSection( &GlobalLoggerState.Lock );
 
-    if (GlobalLoggerState.FileStream != NULL && 
-        GlobalLoggerState.FileStream != stdout && 
-        GlobalLoggerState.FileStream != stderr )
+    if( LoggerWriteSuppressedSitesLocked() > 0 )
     {
-        fclose(GlobalLoggerState.FileStream);
-    }   
+        LoggerFlushLocked();
+    }
+
+    LoggerIndexCloseLocked();
+    LoggerFileClose(&GlobalLoggerState.File, NULL, FALSE); // the console streams are left open
 
-    GlobalLoggerState.FileStream = NULL;
     GlobalLoggerState.IsInitialized = FALSE;
 
     LeaveCriticalSection(&GlobalLoggerState.Lock);
@@ -675,9 +4618,13 @@ LoggerSetLevel(
     _In_ LOG_LEVEL Level
 )
 {
-    EnterCriticalSection(&GlobalLoggerState.Lock);
-    GlobalLoggerState.Level = Level;
-    LeaveCriticalSection(&GlobalLoggerState.Lock);
+    if( !GlobalLoggerState.IsInitialized || Level < LOG_LEVEL_NONE || Level > LOG_LEVEL_FATAL )
+    {
+        return;
+    }
+
+    InterlockedExchange(&LoggerWriteLevel, Level);
+    LoggerUpdateThreshold();
 }
 
 LOG_LEVEL
@@ -690,11 +4637,7 @@ LoggerGetLevel(
         return LOG_LEVEL_NONE; // Logger is not initialized, return NONE level
     }
 
-    EnterCriticalSection(&GlobalLoggerState.Lock);
-    LOG_LEVEL Level = GlobalLoggerState.Level;
-    LeaveCriticalSection(&GlobalLoggerState.Lock);
-
-    return Level;
+    return (LOG_LEVEL)LoggerWriteLevel;
 }
 
 BOOL
@@ -707,11 +4650,7 @@ LoggerLevelEnabled(
         return FALSE;
     }
 
-    EnterCriticalSection(&GlobalLoggerState.Lock);
-    BOOL IsEnabled = (Level >= GlobalLoggerState.Level);
-    LeaveCriticalSection(&GlobalLoggerState.Lock);
-
-    return IsEnabled;
+    return (LONG)Level >= LoggerWriteLevel || LoggerSinkMask( Level ) != 0;
 }
 
 VOID
@@ -728,8 +4667,84 @@ LoggerWrite(
         return; // level is lower than the current logger level, so do not log
     }
 
+    BOOL  IsWritten = (LONG)Level >= LoggerWriteLevel;
+    ULONG SinkMask = LoggerSinkMask(Level);
+
     va_list Args;
     va_start(Args, Format);
-    LoggerWriteToFile(Level, Filename, LineNumber, Format, Args);
+
+    if( SinkMask != 0 )
+    {
+        LoggerWriteFanOut(NULL, Level, Filename, LineNumber, IsWritten, SinkMask, Format, Args);
+    }
+    else if( !LoggerWriteAsync( NULL, Level, Filename, LineNumber, Format, Args ) )
+    {
+        LoggerWriteToFile(NULL, Level, Filename, LineNumber, Format, Args);
+    }
+
+    va_end(Args);
+
+    if( Level >= LOG_LEVEL_ERROR && IsWritten )
+    {
+        LoggerDumpFlightRecorder(); // the trace that led up to the error
+    }
+}
+
+VOID
+LoggerWriteSite(
+    _Inout_ PLOG_SITE Site,
+    ...
+)
+{
+    if ( !GlobalLoggerState.IsInitialized )
+    {
+        return;
+    }
+
+    // every thread resolves the same pointer, so a race on the first write is harmless
+    PCSTR Filename = Site->FileName;
+    if( Filename == NULL )
+    {
+        Filename = ShortFileName(Site->File);
+        Site->FileName = Filename;
+    }
+
+    BOOL  IsWritten = (LONG)Site->Level >= LoggerWriteLevel;
+    ULONG SinkMask = LoggerSinkMask(Site->Level);
+
+    if( ( IsWritten || SinkMask != 0 ) && !LoggerRateLimitPass( Site ) )
+    {
+        return; // over the site's rate, counted for the next report
+    }
+
+    va_list Args;
+    va_start(Args, Site);
+
+    if( SinkMask != 0 )
+    {
+        if( !IsWritten )
+        {
+            va_list Capture;
+            va_copy(Capture, Args);
+            LoggerRecorderCapture(Site, Capture);
+            va_end(Capture);
+        }
+
+        LoggerWriteFanOut(Site, Site->Level, Filename, Site->Line, IsWritten, SinkMask, Site->Format, Args);
+    }
+    else if( !IsWritten )
+    {
+        LoggerRecorderCapture(Site, Args); // below the written level, only the flight recorder keeps it
+    }
+    else if( !LoggerWriteAsync( Site, Site->Level, Filename, Site->Line, Site->Format, Args ) )
+    {
+        LoggerWriteToFile(Site, Site->Level, Filename, Site->Line, Site->Format, Args);
+    }
+
     va_end(Args);
+
+    if( Site->Level >= LOG_LEVEL_ERROR && IsWritten )
+    {
+        LoggerDumpFlightRecorder(); // the trace that led up to the error
+    }
 }
@@ -6,11 +6,7 @@
 #include <stdint.h>
 #include <string.h>
 
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif // !WIN32_LEAN_AND_MEAN
-
-#include <windows.h>
+#include "logformat.h"
 
 typedef enum
 {
@@ -23,6 +19,27 @@ typedef enum
     LOG_LEVEL_FATAL = 6
 } LOG_LEVEL;
 
+#define LOG_THRESHOLD_OFF ( LOG_LEVEL_FATAL + 1 ) // LoggerThreshold while the logger is not initialised
+
+/**
+* Statements below this level are compiled out together with their arguments. A number rather than
+* a LOG_LEVEL so the preprocessor can test it: 1 TRACE, 2 DEBUG, 3 INFO, 4 WARN, 5 ERROR, 6 FATAL.
+*/
+#ifndef LOG_COMPILE_LEVEL
+#ifdef _DEBUG
+#define LOG_COMPILE_LEVEL 1
+#else
+#define LOG_COMPILE_LEVEL 2
+#endif // _DEBUG
+#endif // !LOG_COMPILE_LEVEL
+
+typedef enum
+{
+    LOG_OVERFLOW_BLOCK      = 0, // Producers wait for the writer thread, nothing is lost
+    LOG_OVERFLOW_DROP       = 1, // Records are dropped and counted while the ring is full
+    LOG_OVERFLOW_DROP_BELOW = 2  // Records below a level are dropped, the rest wait
+} LOG_OVERFLOW_POLICY;
+
 static
 __forceinline
 PCSTR
@@ -45,36 +62,167 @@ ShortFileName(
 }
 #define FILENAME ( ShortFileName( __FILE__ ) )
 
-#define LOG_TRACE( fmt, ... )                                                         \
-    do {                                                                              \
-        LoggerWrite( LOG_LEVEL_TRACE, FILENAME, __LINE__, fmt, ##__VA_ARGS__ );       \
-    }  while (0);
+typedef enum
+{
+    LOG_FORMAT_TEXT   = 0, // One formatted line per record
+    LOG_FORMAT_BINARY = 1, // Format id, ticks and raw arguments, rendered later by logtool
+    LOG_FORMAT_JSON   = 2  // One JSON object per line, structured sites keep their fields apart
+} LOG_FORMAT;
 
-#define LOG_DEBUG( fmt, ... )                                                         \
-    do {                                                                              \
-        LoggerWrite( LOG_LEVEL_DEBUG, FILENAME, __LINE__, fmt, ##__VA_ARGS__ );       \
-    } while (0)
+/**
+* Destinations a record can go to, each with its own level. The console and UDP sinks have their own
+* queue and thread, so a slow terminal or a full socket buffer only ever costs that sink records.
+*/
+typedef enum
+{
+    LOG_SINK_MAIN     = 0, // Console or rotating file of LoggerInitConsole or LoggerInitFile
+    LOG_SINK_RECORDER = 1, // Flight recorder, captures what the main sink does not write
+    LOG_SINK_CONSOLE  = 2, // Console stream added by LoggerAddConsoleSink
+    LOG_SINK_UDP      = 3, // Local forwarder added by LoggerAddUdpSink
+    LOG_SINK_COUNT
+} LOG_SINK;
 
-#define LOG_INFO(  fmt, ... )                                                         \
-    do {                                                                              \
-        LoggerWrite( LOG_LEVEL_INFO, FILENAME, __LINE__, fmt, ##__VA_ARGS__ );        \
-    } while (0);
+typedef enum
+{
+    LOG_SITE_UNREGISTERED = 0,
+    LOG_SITE_REGISTERING  = 1,
+    LOG_SITE_BINARY       = 2, // Has a format id, events carry raw arguments
+    LOG_SITE_TEXT         = 3  // Format string cannot be recorded raw, events carry the formatted message
+} LOG_SITE_STATE;
 
-#define LOG_WARN(  fmt, ... )                                                         \
-    do {                                                                              \
-        LoggerWrite( LOG_LEVEL_WARN, FILENAME, __LINE__, fmt, ##__VA_ARGS__ );        \
-    } while (0)
+/**
+* Static descriptor of a LOG_* call site. Registered on its first binary write, after which the
+* format string is never looked at again on the writing thread. Structured sites, LOG_EVENT_*, also
+* carry an event name and their format string is a list of name=%conversion fields.
+*/
+typedef struct _LOG_SITE
+{
+    LOG_LEVEL     Level;
+    PCSTR         File;
+    ULONG         Line;
+    PCSTR         Format;
+    PCSTR         Event;                  // Event name of a structured site, NULL otherwise
+    PCSTR         FileName;               // ShortFileName(File), resolved on the site's first write
+    PLOG_JSON_TEMPLATE volatile Json;     // Static JSON members, serialized on the site's first JSON write
+    volatile LONG State;                  // LOG_SITE_STATE
+    ULONG         FormatId;
+    UINT8         ArgCount;
+    UINT8         ArgTypes[LOG_MAX_ARGS]; // LOG_ARG_TYPE of every argument, in call order
+    volatile LONG64 RateDue;              // Performance counter the site's bucket is empty until, see LoggerSetRateLimit
+    volatile LONG Suppressed;             // Records dropped by the rate limit and not reported yet
+    volatile LONG IsSuppressedListed;     // The site waits in the list of sites with a report due
+    struct _LOG_SITE* volatile NextSuppressed;
+} LOG_SITE, * PLOG_SITE;
+
+/**
+* Lowest level currently written or captured by the flight recorder, LOG_THRESHOLD_OFF while the
+* logger is not initialised. Read without locking by every LOG_* statement before its arguments are evaluated.
+*/
+extern volatile LONG LoggerThreshold;
+
+/**
+* Has the compiler check the arguments of a statement against its format as it would printf's,
+* without evaluating them. ULONG and DWORD are 32 bits wide everywhere, so %lu takes a cast.
+*/
+#define LOG_CHECK_FORMAT( fmt, ... ) ( (VOID)sizeof( printf( fmt, ##__VA_ARGS__ ) ) )
 
-#define LOG_ERROR( fmt, ... )                                                         \
+#define LOG_SITE_WRITE( level, fmt, ... )                                             \
     do {                                                                              \
-        LoggerWrite( LOG_LEVEL_ERROR, FILENAME, __LINE__, fmt, ##__VA_ARGS__ );       \
+        LOG_CHECK_FORMAT( fmt, ##__VA_ARGS__ );                                       \
+        if( (LONG)( level ) >= LoggerThreshold )                                      \
+        {                                                                             \
+            static LOG_SITE LogSite = { .Level = level, .File = __FILE__,             \
+                                        .Line = __LINE__, .Format = fmt };            \
+            LoggerWriteSite( &LogSite, ##__VA_ARGS__ );                               \
+        }                                                                             \
     } while (0)
 
-#define LOG_FATAL( fmt, ... )                                                         \
+#define LOG_EVENT_WRITE( level, event, fields, ... )                                  \
     do {                                                                              \
-        LoggerWrite( LOG_LEVEL_FATAL, FILENAME, __LINE__, fmt, ##__VA_ARGS__ );       \
+        LOG_CHECK_FORMAT( fields, ##__VA_ARGS__ );                                    \
+        if( (LONG)( level ) >= LoggerThreshold )                                      \
+        {                                                                             \
+            static LOG_SITE LogSite = { .Level = level, .File = __FILE__,             \
+                                        .Line = __LINE__, .Format = fields,           \
+                                        .Event = event };                             \
+            LoggerWriteSite( &LogSite, ##__VA_ARGS__ );                               \
+        }                                                                             \
     } while (0)
 
+#define LOG_STRIPPED( fmt, ... ) do { LOG_CHECK_FORMAT( fmt, ##__VA_ARGS__ ); } while (0)
+
+#if LOG_COMPILE_LEVEL <= 1
+#define LOG_TRACE( fmt, ... ) LOG_SITE_WRITE( LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__ )
+#else
+#define LOG_TRACE( fmt, ... ) LOG_STRIPPED( fmt, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 2
+#define LOG_DEBUG( fmt, ... ) LOG_SITE_WRITE( LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__ )
+#else
+#define LOG_DEBUG( fmt, ... ) LOG_STRIPPED( fmt, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 3
+#define LOG_INFO(  fmt, ... ) LOG_SITE_WRITE( LOG_LEVEL_INFO,  fmt, ##__VA_ARGS__ )
+#else
+#define LOG_INFO(  fmt, ... ) LOG_STRIPPED( fmt, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 4
+#define LOG_WARN(  fmt, ... ) LOG_SITE_WRITE( LOG_LEVEL_WARN,  fmt, ##__VA_ARGS__ )
+#else
+#define LOG_WARN(  fmt, ... ) LOG_STRIPPED( fmt, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 5
+#define LOG_ERROR( fmt, ... ) LOG_SITE_WRITE( LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__ )
+#else
+#define LOG_ERROR( fmt, ... ) LOG_STRIPPED( fmt, ##__VA_ARGS__ )
+#endif
+
+#define LOG_FATAL( fmt, ... ) LOG_SITE_WRITE( LOG_LEVEL_FATAL, fmt, ##__VA_ARGS__ )
+
+/**
+* Structured statements. The event name is a constant and fields a list of name=%conversion pairs
+* separated by spaces, for example
+*
+*     LOG_EVENT_INFO( "peer.connected", "peer=%u addr=%s port=%u", PeerId, AddrStr, Port );
+*
+* Text files show the event name followed by the fields, JSON files get one member per field.
+*/
+#if LOG_COMPILE_LEVEL <= 1
+#define LOG_EVENT_TRACE( event, fields, ... ) LOG_EVENT_WRITE( LOG_LEVEL_TRACE, event, fields, ##__VA_ARGS__ )
+#else
+#define LOG_EVENT_TRACE( event, fields, ... ) LOG_STRIPPED( fields, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 2
+#define LOG_EVENT_DEBUG( event, fields, ... ) LOG_EVENT_WRITE( LOG_LEVEL_DEBUG, event, fields, ##__VA_ARGS__ )
+#else
+#define LOG_EVENT_DEBUG( event, fields, ... ) LOG_STRIPPED( fields, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 3
+#define LOG_EVENT_INFO(  event, fields, ... ) LOG_EVENT_WRITE( LOG_LEVEL_INFO,  event, fields, ##__VA_ARGS__ )
+#else
+#define LOG_EVENT_INFO(  event, fields, ... ) LOG_STRIPPED( fields, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 4
+#define LOG_EVENT_WARN(  event, fields, ... ) LOG_EVENT_WRITE( LOG_LEVEL_WARN,  event, fields, ##__VA_ARGS__ )
+#else
+#define LOG_EVENT_WARN(  event, fields, ... ) LOG_STRIPPED( fields, ##__VA_ARGS__ )
+#endif
+
+#if LOG_COMPILE_LEVEL <= 5
+#define LOG_EVENT_ERROR( event, fields, ... ) LOG_EVENT_WRITE( LOG_LEVEL_ERROR, event, fields, ##__VA_ARGS__ )
+#else
+#define LOG_EVENT_ERROR( event, fields, ... ) LOG_STRIPPED( fields, ##__VA_ARGS__ )
+#endif
+
+#define LOG_EVENT_FATAL( event, fields, ... ) LOG_EVENT_WRITE( LOG_LEVEL_FATAL, event, fields, ##__VA_ARGS__ )
+
 /**
 * Intialises logger using a stream to console.
 * 
@@ -110,6 +258,157 @@ LoggerInitFile(
     _In_ INT64 RetentionDays
 );
 
+/**
+* Selects how records are written to log files, must be called before LoggerInitFile. Binary files
+* use the LOG_BINARY_EXTENSION extension and are decoded with logtool, JSON files the
+* LOG_JSON_EXTENSION extension. Console output is always text.
+* 
+* @param Format LOG_FORMAT_TEXT, LOG_FORMAT_BINARY or LOG_FORMAT_JSON.
+* 
+* @return 0 if successful, -1 if the logger is already initialised.
+*/
+INT64
+LoggerSetFormat(
+    _In_ LOG_FORMAT Format
+);
+
+/**
+* Limits the size of a log file. Once a record would take the file past the limit the logger moves
+* on to the next part of the day, YYYY-MM-DD.1, YYYY-MM-DD.2 and so on. The next file is opened
+* by a background thread ahead of time, so the switch does not wait for the file system.
+* 
+* @param MaximumFileSize Bytes per file, at least 64 KB, 0 to only rotate daily.
+* 
+* @return 0 if successful, -1 if the logger does not write to files or the size is too small.
+*/
+INT64
+LoggerSetRotationSize(
+    _In_ UINT64 MaximumFileSize
+);
+
+/**
+* Compresses the files the logger rotated away from, by day or by size, on a low priority
+* background thread. Each file is replaced by a LOG_PACK_EXTENSION file with a block index, which
+* logtool reads back whole or by time range. The file being written is never touched, and files
+* left by earlier runs are compressed when the thread starts. Retention applies to both.
+* 
+* @return 0 if successful, -1 if the logger does not write to files or compression already runs.
+*/
+INT64
+LoggerStartCompression(
+    VOID
+);
+
+/**
+* Limits how often each LOG_* statement writes, with a token bucket per call site. A record over the
+* limit is dropped before its arguments are formatted and only counted, lock-free, so a statement in
+* a tight loop costs little more than a filtered one. The count is written as "last message repeated
+* N times" ahead of the site's next record, and for log files within about a second once the site
+* goes quiet. LoggerWrite calls have no site and are not limited.
+* 
+* @param MessagesPerSecond Records a site writes per second once its burst is spent, 0 for no limit.
+* @param Burst             Records a quiet site may write at once, at least 1.
+* 
+* @return 0 if successful, -1 if the logger is not initialised.
+*/
+INT64
+LoggerSetRateLimit(
+    _In_ ULONG MessagesPerSecond,
+    _In_ ULONG Burst
+);
+
+/**
+* Switches the initialised logger to asynchronous mode. LoggerWrite then only formats the record
+* into a lock-free ring and a background thread writes the ring out in batches.
+* 
+* @param Capacity  Number of records the ring holds, a power of two, 0 for the default.
+* @param Policy    What producers do when the ring is full.
+* @param DropBelow Records below this level are dropped when Policy is LOG_OVERFLOW_DROP_BELOW.
+* 
+* @return 0 if successful, -1 otherwise.
+*/
+INT64
+LoggerStartAsync(
+    _In_ ULONG Capacity,
+    _In_ LOG_OVERFLOW_POLICY Policy,
+    _In_ LOG_LEVEL DropBelow
+);
+
+/**
+* Starts the flight recorder. Records below the logger's level but at or above CaptureLevel are kept
+* in a per thread circular buffer instead of being dropped, without I/O or locking. Every record
+* written at LOG_LEVEL_ERROR or above, and LoggerDumpFlightRecorder, writes the records captured since
+* the previous dump to the log in time order.
+* 
+* @param RecordsPerThread Records each thread keeps, a power of two, 0 for the default.
+* @param CaptureLevel     Lowest level captured, usually LOG_LEVEL_TRACE.
+* 
+* @return 0 if successful, -1 otherwise.
+*/
+INT64
+LoggerStartFlightRecorder(
+    _In_ ULONG RecordsPerThread,
+    _In_ LOG_LEVEL CaptureLevel
+);
+
+/**
+* Writes the records the flight recorder captured since the previous dump to the log.
+*/
+VOID
+LoggerDumpFlightRecorder(
+    VOID
+);
+
+/**
+* Adds a console sink next to the main output, e.g. errors on stderr while everything else goes to
+* the log file. Records are formatted as text, once for every sink that takes them, and written by
+* the sink's own thread. The stream must stay open until LoggerCleanUp.
+* 
+* @param Stream Stream to write to, usually stderr.
+* @param Level  Lowest level the sink writes.
+* 
+* @return 0 if successful, -1 if the logger is not initialised or the sink already exists.
+*/
+INT64
+LoggerAddConsoleSink(
+    _In_ FILE* Stream,
+    _In_ LOG_LEVEL Level
+);
+
+/**
+* Adds a sink that forwards every record as one datagram to a collector on 127.0.0.1, e.g. a log
+* viewer or a syslog relay. Sends never block, records the socket cannot take are dropped and
+* counted. Winsock must have been started by the caller.
+* 
+* @param Port   Port of the local collector.
+* @param Format LOG_FORMAT_TEXT or LOG_FORMAT_JSON.
+* @param Level  Lowest level the sink forwards.
+* 
+* @return 0 if successful, -1 if the logger is not initialised, the sink already exists or the socket
+*         could not be created.
+*/
+INT64
+LoggerAddUdpSink(
+    _In_ USHORT Port,
+    _In_ LOG_FORMAT Format,
+    _In_ LOG_LEVEL Level
+);
+
+/**
+* Changes the level of one sink. LOG_SINK_MAIN is the same as LoggerSetLevel, LOG_SINK_RECORDER
+* changes the flight recorder's capture level.
+* 
+* @param Sink  Sink to change.
+* @param Level Lowest level the sink takes.
+* 
+* @return 0 if successful, -1 if the sink is not on or the level is invalid.
+*/
+INT64
+LoggerSetSinkLevel(
+    _In_ LOG_SINK Sink,
+    _In_ LOG_LEVEL Level
+);
+
 /**
 * Sets the log level for the logger.
 * 
@@ -132,11 +431,11 @@ LoggerGetLevel(
 );
 
 /**
-* Checks if a specific log level is enabled.
+* Checks if a specific log level is enabled, without taking the logger lock.
 * 
 * @param Level The log level to check (e.g., LOG_LEVEL_INFO, LOG_LEVEL_ERROR).
 * 
-* @return TRUE if the specified log level is enabled, FALSE otherwise.
+* @return TRUE if the main output or any console or UDP sink takes the level, FALSE otherwise.
 */
 BOOL
 LoggerLevelEnabled(
@@ -159,6 +458,19 @@ LoggerWrite(
     _In_ ULONG Line,
     _In_ PCSTR Format,
     ...
+) FORMAT_PRINTF(4, 5);
+
+/**
+* Writes a log message for a LOG_* call site. In binary mode only the site's format id, the
+* performance counter and the raw arguments are recorded.
+* 
+* @param Site The static descriptor of the call site.
+* @param ...  Variable arguments for the site's format string.
+*/
+VOID
+LoggerWriteSite(
+    _Inout_ PLOG_SITE Site,
+    ...
 );
 
 #endif // !LOGGER_H
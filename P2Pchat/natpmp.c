@@ -0,0 +1,518 @@
+#include "natpmp.h"
+#include "logger.h"
+
+#define NATPMP_OPCODE_PUBLIC_ADDRESS 0
+#define NATPMP_RESPONSE_FLAG 0x80
+
+#define NATPMP_RESULT_SUCCESS 0
+#define NATPMP_RESULT_UNSUPPORTED_VERSION 1
+
+#define PCP_OPCODE_MAP 1
+#define PCP_HEADER_SIZE 24
+#define PCP_MAP_PAYLOAD_SIZE 36
+#define PCP_NONCE_SIZE 12
+
+#define PCP_ADDRESS_PROBE_PORT 9       // discard port, only used to learn the external address
+#define PCP_ADDRESS_PROBE_LIFETIME 60  // seconds
+
+//////////////////////////////////////////
+//
+//          INTERNAL HELPERS
+//
+//////////////////////////////////////////
+
+static
+__forceinline
+VOID
+NatPmpWrite16(
+    _Out_ PUINT8 Buffer,
+    _In_  UINT16 Value
+)
+{
+    Buffer[0] = (UINT8)(Value >> 8);
+    Buffer[1] = (UINT8)(Value);
+}
+
+static
+__forceinline
+VOID
+NatPmpWrite32(
+    _Out_ PUINT8 Buffer,
+    _In_  UINT32 Value
+)
+{
+    Buffer[0] = (UINT8)(Value >> 24);
+    Buffer[1] = (UINT8)(Value >> 16);
+    Buffer[2] = (UINT8)(Value >> 8);
+    Buffer[3] = (UINT8)(Value);
+}
+
+static
+__forceinline
+UINT16
+NatPmpRead16(
+    _In_ const UINT8* Buffer
+)
+{
+    return (UINT16)((Buffer[0] << 8) | Buffer[1]);
+}
+
+static
+__forceinline
+UINT32
+NatPmpRead32(
+    _In_ const UINT8* Buffer
+)
+{
+    return ((UINT32)Buffer[0] << 24) | ((UINT32)Buffer[1] << 16) | ((UINT32)Buffer[2] << 8) | (UINT32)Buffer[3];
+}
+
+/**
+* Writes an IPv4 address as an IPv4-mapped IPv6 address (::ffff:a.b.c.d), which is how PCP carries IPv4.
+*
+* @param Buffer  16 byte destination.
+* @param Address IPv4 address in network byte order.
+*/
+static
+VOID
+NatPmpWriteMappedAddress(
+    _Out_ PUINT8 Buffer,
+    _In_  const struct in_addr* Address
+)
+{
+    memset(Buffer, 0, 10);
+    Buffer[10] = 0xFF;
+    Buffer[11] = 0xFF;
+    memcpy(Buffer + 12, Address, 4);
+}
+
+/**
+* Sends a request to the gateway and waits for a response, retransmitting with a doubling timeout.
+* The socket is connected to the gateway so datagrams from anyone else are discarded by the stack
+* and an ICMP port unreachable surfaces as an error instead of a timeout.
+*
+* @param pGateway      Address of the NAT-PMP/PCP server.
+* @param Request       Request bytes.
+* @param RequestSize   Size of the request.
+* @param Response      Buffer receiving the response.
+* @param ResponseSize  Size of the response buffer.
+*
+* @return Number of bytes received, or -1 on failure.
+*/
+static
+INT
+NatPmpTransact(
+    _In_  const struct sockaddr_in* pGateway,
+    _In_  const UINT8* Request,
+    _In_  INT RequestSize,
+    _Out_ PUINT8 Response,
+    _In_  INT ResponseSize
+)
+{
+    SOCKET GatewaySocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (GatewaySocket == INVALID_SOCKET)
+    {
+        LOG_DEBUG("Failed to create NAT-PMP socket: %d\n", WSAGetLastError());
+        return -1;
+    }
+
+    if (connect(GatewaySocket, (const struct sockaddr*)pGateway, sizeof(*pGateway)) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to connect NAT-PMP socket: %d\n", WSAGetLastError());
+        closesocket(GatewaySocket);
+        return -1;
+    }
+
+    DWORD Timeout = NATPMP_INITIAL_TIMEOUT;
+    INT BytesReceived = -1;
+
+    for (INT Attempt = 0; Attempt < NATPMP_MAX_ATTEMPTS && BytesReceived < 0; ++Attempt, Timeout *= 2)
+    {
+        if (!NetSetReceiveTimeout(GatewaySocket, Timeout))
+        {
+            LOG_DEBUG("Failed to set NAT-PMP timeout: %d\n", WSAGetLastError());
+            break;
+        }
+
+        if (send(GatewaySocket, (PCSTR)Request, RequestSize, 0) == SOCKET_ERROR)
+        {
+            LOG_DEBUG("Failed to send NAT-PMP request: %d\n", WSAGetLastError());
+            break;
+        }
+
+        BytesReceived = recv(GatewaySocket, (PSTR)Response, ResponseSize, 0);
+        if (BytesReceived == SOCKET_ERROR)
+        {
+            INT Error = WSAGetLastError();
+            if (!NetIsTimeout(Error))
+            {
+                LOG_DEBUG("Error receiving NAT-PMP response: %d\n", Error);
+                break; // gateway is not listening, no point retrying
+            }
+
+            LOG_TRACE("NAT-PMP attempt %d timed out after %lu ms\n", Attempt + 1, (unsigned long)Timeout);
+            BytesReceived = -1;
+        }
+    }
+
+    closesocket(GatewaySocket);
+
+    // every NAT-PMP and PCP response starts with version, opcode and a result code
+    if (BytesReceived >= 0 && BytesReceived < 4)
+    {
+        LOG_DEBUG("NAT-PMP response too short: %d bytes\n", BytesReceived);
+        return -1;
+    }
+
+    return BytesReceived;
+}
+
+/**
+* Requests the external address using the NAT-PMP public address opcode.
+*
+* @param pGateway       Address of the NAT-PMP server.
+* @param pPublicAddress Receives the external address.
+* @param pIsPcpServer   Set to TRUE if the server rejected the request as a PCP only server.
+*
+* @return TRUE on success, FALSE otherwise.
+*/
+static
+BOOL
+NatPmpRequestPublicAddress(
+    _In_  const struct sockaddr_in* pGateway,
+    _Out_ struct in_addr* pPublicAddress,
+    _Out_ PBOOL pIsPcpServer
+)
+{
+    UINT8 Request[2] = { NATPMP_VERSION, NATPMP_OPCODE_PUBLIC_ADDRESS };
+    UINT8 Response[NATPMP_MAX_RESPONSE_SIZE];
+
+    *pIsPcpServer = FALSE;
+
+    INT BytesReceived = NatPmpTransact(pGateway, Request, sizeof(Request), Response, sizeof(Response));
+    if (BytesReceived < 0)
+    {
+        return FALSE;
+    }
+
+    if (Response[0] == PCP_VERSION)
+    {
+        *pIsPcpServer = TRUE; // PCP server without NAT-PMP support
+        return FALSE;
+    }
+
+    if (BytesReceived < 12 ||
+        Response[0] != NATPMP_VERSION ||
+        Response[1] != (NATPMP_RESPONSE_FLAG | NATPMP_OPCODE_PUBLIC_ADDRESS))
+    {
+        LOG_DEBUG("Malformed NAT-PMP public address response\n");
+        return FALSE;
+    }
+
+    UINT16 Result = NatPmpRead16(Response + 2);
+    if (Result != NATPMP_RESULT_SUCCESS)
+    {
+        LOG_DEBUG("NAT-PMP public address request failed with result %u\n", Result);
+        return FALSE;
+    }
+
+    memcpy(pPublicAddress, Response + 8, 4);
+    return TRUE;
+}
+
+/**
+* Requests a mapping using the NAT-PMP map opcodes, used when the gateway does not speak PCP.
+*
+* @return TRUE on success, FALSE otherwise.
+*/
+static
+BOOL
+NatPmpRequestMapping(
+    _In_  const struct sockaddr_in* pGateway,
+    _In_  NATPMP_PROTOCOL Protocol,
+    _In_  UINT16 InternalPort,
+    _In_  UINT32 Lifetime,
+    _Out_ PNATPMP_MAPPING pMapping
+)
+{
+    UINT8 Request[12] = { 0 };
+    UINT8 Response[NATPMP_MAX_RESPONSE_SIZE];
+
+    Request[0] = NATPMP_VERSION;
+    Request[1] = (UINT8)Protocol;
+    NatPmpWrite16(Request + 4, InternalPort);
+    NatPmpWrite16(Request + 6, InternalPort); // suggest the same external port
+    NatPmpWrite32(Request + 8, Lifetime);
+
+    INT BytesReceived = NatPmpTransact(pGateway, Request, sizeof(Request), Response, sizeof(Response));
+    if (BytesReceived < 16 ||
+        Response[0] != NATPMP_VERSION ||
+        Response[1] != (NATPMP_RESPONSE_FLAG | (UINT8)Protocol))
+    {
+        LOG_DEBUG("Malformed or missing NAT-PMP mapping response\n");
+        return FALSE;
+    }
+
+    UINT16 Result = NatPmpRead16(Response + 2);
+    if (Result != NATPMP_RESULT_SUCCESS)
+    {
+        LOG_DEBUG("NAT-PMP mapping request failed with result %u\n", Result);
+        return FALSE;
+    }
+
+    pMapping->InternalPort = NatPmpRead16(Response + 8);
+    pMapping->ExternalPort = NatPmpRead16(Response + 10);
+    pMapping->Lifetime = NatPmpRead32(Response + 12);
+    pMapping->IsPcp = FALSE;
+
+    // NAT-PMP mapping responses do not carry the address, it needs a second exchange
+    struct in_addr PublicAddress;
+    BOOL IsPcpServer;
+    if (!NatPmpRequestPublicAddress(pGateway, &PublicAddress, &IsPcpServer))
+    {
+        return FALSE;
+    }
+
+    inet_ntop(AF_INET, &PublicAddress, pMapping->PublicIp, sizeof(pMapping->PublicIp));
+    return TRUE;
+}
+
+/**
+* Makes the nonce identifying a PCP mapping, which later requests for the mapping repeat.
+*/
+static
+VOID
+PcpMakeNonce(
+    _Out_ PUINT8 Nonce
+)
+{
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    NatPmpWrite32(Nonce + 0, (UINT32)Counter.LowPart);
+    NatPmpWrite32(Nonce + 4, (UINT32)Counter.HighPart);
+    NatPmpWrite32(Nonce + 8, GetCurrentProcessId());
+}
+
+/**
+* Requests a mapping using the PCP MAP opcode, the response carries both the port and the address.
+*
+* @param Nonce           From PcpMakeNonce, the same for every request about one mapping.
+* @param pIsNatPmpServer Set to TRUE if the gateway replied that it only speaks NAT-PMP.
+*
+* @return TRUE on success, FALSE otherwise.
+*/
+static
+BOOL
+PcpRequestMapping(
+    _In_  const struct sockaddr_in* pGateway,
+    _In_  NATPMP_PROTOCOL Protocol,
+    _In_  UINT16 InternalPort,
+    _In_  UINT32 Lifetime,
+    _In_  const UINT8* Nonce,
+    _Out_ PNATPMP_MAPPING pMapping,
+    _Out_ PBOOL pIsNatPmpServer
+)
+{
+    UINT8 Request[PCP_HEADER_SIZE + PCP_MAP_PAYLOAD_SIZE] = { 0 };
+    UINT8 Response[NATPMP_MAX_RESPONSE_SIZE];
+
+    *pIsNatPmpServer = FALSE;
+
+    // PCP wants the client address inside the request, learn it from a connected socket first
+    SOCKET ProbeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (ProbeSocket == INVALID_SOCKET)
+    {
+        LOG_DEBUG("Failed to create PCP probe socket: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    struct sockaddr_in ProbeAddress;
+    socklen_t ProbeAddressSize = sizeof(ProbeAddress);
+    if (connect(ProbeSocket, (const struct sockaddr*)pGateway, sizeof(*pGateway)) == SOCKET_ERROR ||
+        getsockname(ProbeSocket, (struct sockaddr*)&ProbeAddress, &ProbeAddressSize) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to determine PCP client address: %d\n", WSAGetLastError());
+        closesocket(ProbeSocket);
+        return FALSE;
+    }
+    closesocket(ProbeSocket);
+
+    // header
+    Request[0] = PCP_VERSION;
+    Request[1] = PCP_OPCODE_MAP;
+    NatPmpWrite32(Request + 4, Lifetime);
+    NatPmpWriteMappedAddress(Request + 8, &ProbeAddress.sin_addr);
+
+    // MAP payload
+    PUINT8 Payload = Request + PCP_HEADER_SIZE;
+
+    memcpy(Payload, Nonce, PCP_NONCE_SIZE);
+
+    Payload[12] = (Protocol == NATPMP_PROTOCOL_TCP) ? IPPROTO_TCP : IPPROTO_UDP;
+    NatPmpWrite16(Payload + 16, InternalPort);
+    NatPmpWrite16(Payload + 18, InternalPort); // suggest the same external port
+
+    struct in_addr AnyAddress = { 0 };
+    NatPmpWriteMappedAddress(Payload + 20, &AnyAddress);
+
+    INT BytesReceived = NatPmpTransact(pGateway, Request, sizeof(Request), Response, sizeof(Response));
+    if (BytesReceived < 0)
+    {
+        return FALSE;
+    }
+
+    if (Response[0] == NATPMP_VERSION)
+    {
+        *pIsNatPmpServer = TRUE; // RFC 6887 section 9, NAT-PMP only gateway
+        return FALSE;
+    }
+
+    if (BytesReceived < PCP_HEADER_SIZE + PCP_MAP_PAYLOAD_SIZE ||
+        Response[0] != PCP_VERSION ||
+        Response[1] != (NATPMP_RESPONSE_FLAG | PCP_OPCODE_MAP))
+    {
+        LOG_DEBUG("Malformed PCP MAP response\n");
+        return FALSE;
+    }
+
+    if (Response[3] != NATPMP_RESULT_SUCCESS)
+    {
+        LOG_DEBUG("PCP MAP request failed with result %u\n", Response[3]);
+        return FALSE;
+    }
+
+    const UINT8* ResponsePayload = Response + PCP_HEADER_SIZE;
+    if (memcmp(ResponsePayload, Payload, PCP_NONCE_SIZE) != 0)
+    {
+        LOG_DEBUG("PCP MAP response nonce mismatch\n");
+        return FALSE;
+    }
+
+    pMapping->Lifetime = NatPmpRead32(Response + 4);
+    pMapping->InternalPort = NatPmpRead16(ResponsePayload + 16);
+    pMapping->ExternalPort = NatPmpRead16(ResponsePayload + 18);
+    pMapping->IsPcp = TRUE;
+
+    struct in_addr PublicAddress;
+    memcpy(&PublicAddress, ResponsePayload + 20 + 12, 4); // last 4 bytes of the mapped address
+    inet_ntop(AF_INET, &PublicAddress, pMapping->PublicIp, sizeof(pMapping->PublicIp));
+
+    return TRUE;
+}
+
+//////////////////////////////////////////
+//
+//          PUBLIC FUNCTIONS
+//
+//////////////////////////////////////////
+
+BOOL
+NatPmpGetDefaultGateway(
+    _Out_ struct sockaddr_in* pGateway
+)
+{
+    struct in_addr NextHop;
+    if (!NetDefaultGateway(&NextHop))
+    {
+        LOG_DEBUG("No default route with a next hop\n");
+        return FALSE;
+    }
+
+    memset(pGateway, 0, sizeof(*pGateway));
+    pGateway->sin_family = AF_INET;
+    pGateway->sin_port = htons(NATPMP_PORT);
+    pGateway->sin_addr = NextHop;
+
+    return TRUE;
+}
+
+BOOL
+NatPmpGetPublicIpAddress(
+    _In_  const struct sockaddr_in* pGateway,
+    _Out_ PSTR PublicIpBuffer,
+    _In_  INT64 BufferSize
+)
+{
+    if (pGateway == NULL || PublicIpBuffer == NULL || BufferSize < INET_ADDRSTRLEN)
+    {
+        return FALSE;
+    }
+
+    struct in_addr PublicAddress;
+    BOOL IsPcpServer = FALSE;
+
+    if (NatPmpRequestPublicAddress(pGateway, &PublicAddress, &IsPcpServer))
+    {
+        inet_ntop(AF_INET, &PublicAddress, PublicIpBuffer, (size_t)BufferSize);
+        LOG_INFO("Public IP Address from NAT-PMP: %s\n", PublicIpBuffer);
+        return TRUE;
+    }
+
+    if (!IsPcpServer)
+    {
+        return FALSE;
+    }
+
+    // PCP has no address opcode, a short lived MAP on the discard port returns the address
+    NATPMP_MAPPING Mapping;
+    NATPMP_MAPPING Deleted;
+    BOOL IsNatPmpServer;
+    UINT8 Nonce[PCP_NONCE_SIZE];
+
+    PcpMakeNonce(Nonce);
+    if (!PcpRequestMapping(pGateway, NATPMP_PROTOCOL_UDP, PCP_ADDRESS_PROBE_PORT, PCP_ADDRESS_PROBE_LIFETIME, Nonce, &Mapping, &IsNatPmpServer))
+    {
+        return FALSE;
+    }
+
+    strncpy_s(PublicIpBuffer, (size_t)BufferSize, Mapping.PublicIp, _TRUNCATE);
+    LOG_INFO("Public IP Address from PCP: %s\n", PublicIpBuffer);
+
+    // the same MAP with a lifetime of 0 takes the probe's mapping down again
+    if (!PcpRequestMapping(pGateway, NATPMP_PROTOCOL_UDP, PCP_ADDRESS_PROBE_PORT, 0, Nonce, &Deleted, &IsNatPmpServer))
+    {
+        LOG_DEBUG("PCP address probe mapping not deleted, it lapses in %lu seconds\n", (unsigned long)Mapping.Lifetime);
+    }
+
+    return TRUE;
+}
+
+BOOL
+NatPmpAddPortMapping(
+    _In_  const struct sockaddr_in* pGateway,
+    _In_  NATPMP_PROTOCOL Protocol,
+    _In_  UINT16 InternalPort,
+    _In_  UINT32 Lifetime,
+    _Out_ PNATPMP_MAPPING pMapping
+)
+{
+    if (pGateway == NULL || pMapping == NULL)
+    {
+        return FALSE;
+    }
+
+    memset(pMapping, 0, sizeof(*pMapping));
+
+    BOOL IsNatPmpServer = FALSE;
+    UINT8 Nonce[PCP_NONCE_SIZE];
+
+    PcpMakeNonce(Nonce);
+    if (PcpRequestMapping(pGateway, Protocol, InternalPort, Lifetime, Nonce, pMapping, &IsNatPmpServer))
+    {
+        LOG_INFO("PCP mapped %s:%u -> local port %u for %lu seconds\n", pMapping->PublicIp, pMapping->ExternalPort, pMapping->InternalPort, (unsigned long)pMapping->Lifetime);
+        return TRUE;
+    }
+
+    if (!IsNatPmpServer)
+    {
+        return FALSE;
+    }
+
+    if (NatPmpRequestMapping(pGateway, Protocol, InternalPort, Lifetime, pMapping))
+    {
+        LOG_INFO("NAT-PMP mapped %s:%u -> local port %u for %lu seconds\n", pMapping->PublicIp, pMapping->ExternalPort, pMapping->InternalPort, (unsigned long)pMapping->Lifetime);
+        return TRUE;
+    }
+
+    return FALSE;
+}
@@ -0,0 +1,88 @@
+#ifndef NATPMP_H
+#define NATPMP_H
+
+#include "winnet.h"
+
+/**
+    * NAT-PMP (RFC 6886) and PCP (RFC 6887) definitions
+    *
+    * Both protocols talk to the default gateway over a single UDP exchange, which makes
+    * them a much cheaper way to learn the public IP address than SSDP + SOAP. PCP is tried
+    * first for mappings, gateways that only speak NAT-PMP answer with an unsupported version
+    * result and we fall back to the NAT-PMP opcodes.
+*/
+
+#define NATPMP_PORT 5351
+#define NATPMP_VERSION 0
+#define PCP_VERSION 2
+
+#define NATPMP_INITIAL_TIMEOUT 250 // ms, doubled on every retransmission
+#define NATPMP_MAX_ATTEMPTS 3      // 250 + 500 + 1000 ms worst case
+#define NATPMP_DEFAULT_LIFETIME 7200 // 2 hours, recommended by RFC 6886
+
+#define NATPMP_MAX_RESPONSE_SIZE 1100 // PCP messages are capped at 1100 bytes
+
+typedef enum _NATPMP_PROTOCOL
+{
+    NATPMP_PROTOCOL_UDP = 1,
+    NATPMP_PROTOCOL_TCP = 2
+} NATPMP_PROTOCOL;
+
+typedef struct _NATPMP_MAPPING
+{
+    CHAR   PublicIp[INET_ADDRSTRLEN]; // External address assigned by the gateway
+    UINT16 InternalPort;
+    UINT16 ExternalPort;
+    UINT32 Lifetime;                  // Seconds the gateway will keep the mapping
+    BOOL   IsPcp;                     // TRUE if the gateway answered with PCP, FALSE for NAT-PMP
+} NATPMP_MAPPING, *PNATPMP_MAPPING;
+
+/**
+* Looks up the default gateway of the host, which is where NAT-PMP and PCP servers listen.
+*
+* @param pGateway Receives the gateway address with the port set to NATPMP_PORT.
+*
+* @return TRUE if a default route was found, FALSE otherwise.
+*/
+BOOL
+NatPmpGetDefaultGateway(
+    _Out_ struct sockaddr_in* pGateway
+);
+
+/**
+* Asks the gateway for its external address in a single round trip.
+*
+* @param pGateway       Address of the NAT-PMP/PCP server, normally from NatPmpGetDefaultGateway.
+* @param PublicIpBuffer Buffer receiving the dotted public IP address.
+* @param BufferSize     Size of PublicIpBuffer.
+*
+* @return TRUE if the gateway returned an address, FALSE otherwise.
+*/
+BOOL
+NatPmpGetPublicIpAddress(
+    _In_  const struct sockaddr_in* pGateway,
+    _Out_ PSTR PublicIpBuffer,
+    _In_  INT64 BufferSize
+);
+
+/**
+* Requests a port mapping from the gateway, PCP first then NAT-PMP.
+*
+* @param pGateway     Address of the NAT-PMP/PCP server.
+* @param Protocol     Transport protocol to map.
+* @param InternalPort Local port that should be reachable from outside.
+* @param Lifetime     Requested lifetime in seconds, 0 deletes the mapping.
+* @param pMapping     Receives the mapping granted by the gateway.
+*
+* @return TRUE if the gateway granted the mapping, FALSE otherwise.
+*/
+BOOL
+NatPmpAddPortMapping(
+    _In_  const struct sockaddr_in* pGateway,
+    _In_  NATPMP_PROTOCOL Protocol,
+    _In_  UINT16 InternalPort,
+    _In_  UINT32 Lifetime,
+    _Out_ PNATPMP_MAPPING pMapping
+);
+
+#endif // !NATPMP_H
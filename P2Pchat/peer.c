@@ -0,0 +1,645 @@
+#include "peer.h"
+#include "logger.h"
+
+typedef struct _PEER_PUNCH_CONTEXT
+{
+    PPEER_SESSION pSession;
+    UINT32        Generation;
+} PEER_PUNCH_CONTEXT, *PPEER_PUNCH_CONTEXT;
+
+//////////////////////////////////////////
+//
+//          INTERNAL HELPERS
+//
+//////////////////////////////////////////
+
+/**
+* Sends a single datagram with the P2Pchat datagram header.
+*
+* @return TRUE if the datagram was handed to the stack, FALSE otherwise.
+*/
+static
+BOOL
+PeerSendDatagram(
+    _In_ PPEER_SESSION pSession,
+    _In_ const struct sockaddr_in* pAddress,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ UINT32 Token,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    CHAR Datagram[sizeof(DATAGRAM_HEADER) + PROTOCOL_MAX_PAYLOAD_SIZE];
+    PDATAGRAM_HEADER pHeader = (PDATAGRAM_HEADER)Datagram;
+
+    if (Length > PROTOCOL_MAX_PAYLOAD_SIZE)
+    {
+        return FALSE;
+    }
+
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->Magic = htonl(DATAGRAM_MAGIC);
+    pHeader->Type = (UINT8)Type;
+    pHeader->Length = htons(Length);
+    pHeader->SenderId = htonl(pSession->ClientId);
+    pHeader->Token = htonl(Token);
+
+    if (Length > 0)
+    {
+        memcpy(Datagram + sizeof(DATAGRAM_HEADER), Payload, Length);
+    }
+
+    INT Result = sendto(
+        pSession->UdpSocket,
+        Datagram,
+        (INT)sizeof(DATAGRAM_HEADER) + Length,
+        0,
+        (const struct sockaddr*)pAddress,
+        sizeof(*pAddress)
+    );
+
+    if (Result == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to send datagram type %d: %d\n", Type, WSAGetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+* Converts a wire endpoint to a sockaddr_in, both keep the port in network byte order.
+*/
+static
+VOID
+PeerEndpointToAddress(
+    _In_  const PROTOCOL_ENDPOINT* pEndpoint,
+    _Out_ struct sockaddr_in* pAddress
+)
+{
+    memset(pAddress, 0, sizeof(*pAddress));
+    pAddress->sin_family = AF_INET;
+    pAddress->sin_port = pEndpoint->Port;
+    memcpy(&pAddress->sin_addr, pEndpoint->Address, sizeof(pEndpoint->Address));
+}
+
+/**
+* Switches the session to the direct path using the address the peer was heard from.
+*/
+static
+VOID
+PeerMarkDirect(
+    _In_ PPEER_SESSION pSession,
+    _In_ const struct sockaddr_in* pFrom
+)
+{
+    BOOL IsNewPath = FALSE;
+
+    EnterCriticalSection(&pSession->Lock);
+    if (pSession->Path != PEER_PATH_DIRECT)
+    {
+        pSession->PeerAddress = *pFrom;
+        pSession->Path = PEER_PATH_DIRECT;
+        IsNewPath = TRUE;
+    }
+    LeaveCriticalSection(&pSession->Lock);
+
+    if (IsNewPath)
+    {
+        // the peer resets its side when it sees the path too, both start from sequence 0
+        RudpReset(&pSession->Transport);
+
+        CHAR AddrStr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &pFrom->sin_addr, AddrStr, INET_ADDRSTRLEN);
+        printf("\nDirect path to peer %u established via %s:%d\n", pSession->PeerId, AddrStr, ntohs(pFrom->sin_port));
+        LOG_EVENT_INFO("peer.direct", "peer=%u addr=%s port=%u", pSession->PeerId, AddrStr, ntohs(pFrom->sin_port));
+    }
+}
+
+/**
+* Output routine of the transport, sends to the address the peer answered the punch from.
+*/
+static
+VOID
+PeerTransportOutput(
+    _In_ PVOID Context,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    PPEER_SESSION pSession = (PPEER_SESSION)Context;
+
+    EnterCriticalSection(&pSession->Lock);
+    BOOL IsDirect = (pSession->Path == PEER_PATH_DIRECT);
+    struct sockaddr_in PeerAddress = pSession->PeerAddress;
+    UINT32 SessionToken = pSession->SessionToken;
+    LeaveCriticalSection(&pSession->Lock);
+
+    if (IsDirect)
+    {
+        PeerSendDatagram(pSession, &PeerAddress, Type, SessionToken, Payload, Length);
+    }
+}
+
+/**
+* Deliver routine of the transport, called in stream order.
+*/
+static
+VOID
+PeerTransportDeliver(
+    _In_ PVOID Context,
+    _In_ UINT8 StreamId,
+    _In_ const VOID* Data,
+    _In_ UINT16 Length
+)
+{
+    PPEER_SESSION pSession = (PPEER_SESSION)Context;
+    CHAR Text[RUDP_MAX_SEGMENT + 1];
+
+    if (StreamId != PEER_STREAM_CHAT)
+    {
+        LOG_EVENT_TRACE("peer.stream.ignored", "peer=%u stream=%u bytes=%u", pSession->PeerId, StreamId, Length);
+        return;
+    }
+
+    memcpy(Text, Data, Length);
+    Text[Length] = '\0';
+    printf("\nRecieved '%s' from peer %u (direct)\n", Text, pSession->PeerId);
+}
+
+/**
+* Reads the loss and latency to apply to the direct path from PEER_IMPAIRMENT_VARIABLE.
+*
+* @return TRUE if an impairment is configured, FALSE otherwise.
+*/
+static
+BOOL
+PeerReadImpairment(
+    _Out_ PRUDP_IMPAIRMENT pImpairment
+)
+{
+    CHAR Value[128];
+    memset(pImpairment, 0, sizeof(*pImpairment));
+
+    DWORD Size = GetEnvironmentVariableA(PEER_IMPAIRMENT_VARIABLE, Value, sizeof(Value));
+    if (Size == 0 || Size >= sizeof(Value))
+    {
+        return FALSE;
+    }
+
+    PCSTR Field;
+    if ((Field = strstr(Value, "loss=")) != NULL)
+    {
+        pImpairment->LossPercent = (UINT32)atoi(Field + 5);
+    }
+    if ((Field = strstr(Value, "delay=")) != NULL)
+    {
+        pImpairment->DelayMs = (UINT32)atoi(Field + 6);
+    }
+    if ((Field = strstr(Value, "jitter=")) != NULL)
+    {
+        pImpairment->JitterMs = (UINT32)atoi(Field + 7);
+    }
+
+    return TRUE;
+}
+
+static
+DWORD
+WINAPI
+PeerReceiveThread(
+    _In_ LPVOID lpData
+)
+{
+    PPEER_SESSION pSession = (PPEER_SESSION)lpData;
+    CHAR Datagram[sizeof(DATAGRAM_HEADER) + PROTOCOL_MAX_PAYLOAD_SIZE + 1];
+
+    while (pSession->Running)
+    {
+        EnterCriticalSection(&pSession->Lock);
+        BOOL IsDirect = (pSession->Path == PEER_PATH_DIRECT);
+        LeaveCriticalSection(&pSession->Lock);
+
+        // the transport's timers run on this thread, wake up often enough while the path is direct
+        DWORD Timeout = RudpTick(&pSession->Transport);
+        Timeout = min(Timeout, IsDirect ? RUDP_TICK_INTERVAL : PEER_RECEIVE_TIMEOUT);
+
+        if (!NetWaitReadable(pSession->UdpSocket, Timeout))
+        {
+            continue;
+        }
+
+        struct sockaddr_in From;
+        socklen_t FromSize = sizeof(From);
+
+        INT BytesReceived = recvfrom(
+            pSession->UdpSocket,
+            Datagram,
+            sizeof(Datagram) - 1,
+            0,
+            (struct sockaddr*)&From,
+            &FromSize
+        );
+
+        if (BytesReceived == SOCKET_ERROR)
+        {
+            INT Error = WSAGetLastError();
+            if (!NetIsTimeout(Error) && Error != WSAECONNRESET)
+            {
+                LOG_DEBUG("Peer receive failed: %d\n", Error);
+            }
+            continue;
+        }
+
+        PDATAGRAM_HEADER pHeader = (PDATAGRAM_HEADER)Datagram;
+        if (BytesReceived < (INT)sizeof(DATAGRAM_HEADER) ||
+            ntohl(pHeader->Magic) != DATAGRAM_MAGIC ||
+            ntohs(pHeader->Length) != BytesReceived - (INT)sizeof(DATAGRAM_HEADER))
+        {
+            continue; // not a P2Pchat datagram
+        }
+
+        UINT32 SenderId = ntohl(pHeader->SenderId);
+        UINT32 Token = ntohl(pHeader->Token);
+
+        if (pHeader->Type == DATAGRAM_TYPE_REGISTER_ACK)
+        {
+            if (Token == pSession->Token)
+            {
+                SetEvent(pSession->RegisteredEvent);
+            }
+            continue;
+        }
+
+        // everything else must come from the peer we were introduced to
+        EnterCriticalSection(&pSession->Lock);
+        BOOL IsPeer = (pSession->Path != PEER_PATH_NONE &&
+                       SenderId == pSession->PeerId &&
+                       Token == pSession->SessionToken);
+        PSSDP_ADVERTISER pLan = pSession->pLan;
+        LeaveCriticalSection(&pSession->Lock);
+
+        // or from a LAN peer that found us through SSDP and punches without an introduction
+        LAN_PEER LanPeer;
+        if (!IsPeer && pHeader->Type == DATAGRAM_TYPE_PUNCH &&
+            SsdpFindLanPeer(pLan, SenderId, &LanPeer) &&
+            Token == (LanPeer.LanToken ^ pLan->LanToken))
+        {
+            IsPeer = PeerSessionConnectLan(pSession, SenderId);
+        }
+
+        if (!IsPeer)
+        {
+            LOG_TRACE("Dropping datagram type %u from unexpected sender %u\n", pHeader->Type, SenderId);
+            continue;
+        }
+
+        switch (pHeader->Type)
+        {
+        case DATAGRAM_TYPE_PUNCH:
+            // the peer's NAT now has a binding towards us, answer so it knows the reverse path works too
+            PeerSendDatagram(pSession, &From, DATAGRAM_TYPE_PUNCH_ACK, Token, NULL, 0);
+            PeerMarkDirect(pSession, &From);
+            break;
+
+        case DATAGRAM_TYPE_PUNCH_ACK:
+            PeerMarkDirect(pSession, &From);
+            break;
+
+        case DATAGRAM_TYPE_DATA:
+        case DATAGRAM_TYPE_ACK:
+            PeerMarkDirect(pSession, &From); // our PUNCH_ACK may have been lost, the data proves the path
+            RudpInput(&pSession->Transport, pHeader->Type, Datagram + sizeof(DATAGRAM_HEADER), ntohs(pHeader->Length));
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static
+DWORD
+WINAPI
+PeerPunchThread(
+    _In_ LPVOID lpData
+)
+{
+    PPEER_PUNCH_CONTEXT pContext = (PPEER_PUNCH_CONTEXT)lpData;
+    PPEER_SESSION pSession = pContext->pSession;
+    UINT32 Generation = pContext->Generation;
+    free(pContext);
+
+    ULONGLONG Deadline = GetTickCount64() + PEER_PUNCH_TIMEOUT;
+
+    while (pSession->Running)
+    {
+        struct sockaddr_in Candidates[2];
+        UINT32 SessionToken;
+
+        EnterCriticalSection(&pSession->Lock);
+        BOOL IsPunching = (pSession->PunchGeneration == Generation && pSession->Path == PEER_PATH_PUNCHING);
+        BOOL IsExpired = (GetTickCount64() >= Deadline);
+
+        if (IsPunching && IsExpired)
+        {
+            pSession->Path = PEER_PATH_RELAY;
+        }
+
+        memcpy(Candidates, pSession->Candidates, sizeof(Candidates));
+        SessionToken = pSession->SessionToken;
+        LeaveCriticalSection(&pSession->Lock);
+
+        if (!IsPunching)
+        {
+            break; // established, superseded by a newer introduction, or torn down
+        }
+
+        if (IsExpired)
+        {
+            printf("\nHole punch to peer %u timed out, using relay\n", pSession->PeerId);
+            LOG_INFO("Hole punch to peer %u timed out, falling back to relay\n", pSession->PeerId);
+            break;
+        }
+
+        for (INT i = 0; i < (INT)ARRAYSIZE(Candidates); ++i)
+        {
+            if (Candidates[i].sin_port != 0)
+            {
+                PeerSendDatagram(pSession, &Candidates[i], DATAGRAM_TYPE_PUNCH, SessionToken, NULL, 0);
+            }
+        }
+
+        Sleep(PEER_PUNCH_INTERVAL);
+    }
+
+    InterlockedDecrement(&pSession->ActivePunches);
+    return 0;
+}
+
+//////////////////////////////////////////
+//
+//          PUBLIC FUNCTIONS
+//
+//////////////////////////////////////////
+
+BOOL
+PeerSessionInitialise(
+    _Out_ PPEER_SESSION pSession,
+    _In_  SOCKET ServerSocket,
+    _In_  UINT32 ClientId,
+    _In_  UINT32 Token
+)
+{
+    memset(pSession, 0, sizeof(*pSession));
+    pSession->UdpSocket = INVALID_SOCKET;
+    pSession->ClientId = ClientId;
+    pSession->Token = Token;
+
+    // the rendezvous port shares the relay's address and port
+    socklen_t AddressSize = sizeof(pSession->ServerAddress);
+    if (getpeername(ServerSocket, (struct sockaddr*)&pSession->ServerAddress, &AddressSize) == SOCKET_ERROR ||
+        pSession->ServerAddress.sin_family != AF_INET)
+    {
+        LOG_DEBUG("Relay is not reachable over IPv4, peer to peer disabled\n");
+        return FALSE;
+    }
+
+    // our LAN address is whatever address the relay connection left from
+    struct sockaddr_in LanAddress;
+    AddressSize = sizeof(LanAddress);
+    if (getsockname(ServerSocket, (struct sockaddr*)&LanAddress, &AddressSize) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to query local address: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    pSession->UdpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (pSession->UdpSocket == INVALID_SOCKET)
+    {
+        LOG_DEBUG("Failed to create peer socket: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    struct sockaddr_in BindAddress;
+    memset(&BindAddress, 0, sizeof(BindAddress));
+    BindAddress.sin_family = AF_INET;
+    BindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    BindAddress.sin_port = 0;
+
+    if (bind(pSession->UdpSocket, (struct sockaddr*)&BindAddress, sizeof(BindAddress)) == SOCKET_ERROR ||
+        !NetSetReceiveTimeout(pSession->UdpSocket, PEER_RECEIVE_TIMEOUT))
+    {
+        LOG_DEBUG("Failed to set up peer socket: %d\n", WSAGetLastError());
+        closesocket(pSession->UdpSocket);
+        return FALSE;
+    }
+
+    AddressSize = sizeof(pSession->LocalAddress);
+    if (getsockname(pSession->UdpSocket, (struct sockaddr*)&pSession->LocalAddress, &AddressSize) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to query peer socket port: %d\n", WSAGetLastError());
+        closesocket(pSession->UdpSocket);
+        return FALSE;
+    }
+    pSession->LocalAddress.sin_addr = LanAddress.sin_addr;
+
+    pSession->RegisteredEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (pSession->RegisteredEvent == NULL)
+    {
+        closesocket(pSession->UdpSocket);
+        return FALSE;
+    }
+
+    if (!RudpInitialise(&pSession->Transport, PeerTransportOutput, PeerTransportDeliver, pSession))
+    {
+        CloseHandle(pSession->RegisteredEvent);
+        closesocket(pSession->UdpSocket);
+        return FALSE;
+    }
+
+    RUDP_IMPAIRMENT Impairment;
+    if (PeerReadImpairment(&Impairment))
+    {
+        RudpSetImpairment(&pSession->Transport, &Impairment);
+    }
+
+    InitializeCriticalSection(&pSession->Lock);
+    pSession->Running = TRUE;
+
+    pSession->ReceiveThread = CreateThread(NULL, 0, PeerReceiveThread, pSession, 0, NULL);
+    if (pSession->ReceiveThread == NULL)
+    {
+        LOG_DEBUG("Unable to create peer receive thread: %d\n", GetLastError());
+        pSession->Running = FALSE;
+        DeleteCriticalSection(&pSession->Lock);
+        RudpCleanUp(&pSession->Transport);
+        CloseHandle(pSession->RegisteredEvent);
+        closesocket(pSession->UdpSocket);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL
+PeerSessionRegister(
+    _In_  PPEER_SESSION pSession,
+    _Out_ PPROTOCOL_ENDPOINT pPrivate
+)
+{
+    for (INT Attempt = 0; Attempt < PEER_REGISTER_ATTEMPTS; ++Attempt)
+    {
+        PeerSendDatagram(pSession, &pSession->ServerAddress, DATAGRAM_TYPE_REGISTER, pSession->Token, NULL, 0);
+
+        if (WaitForSingleObject(pSession->RegisteredEvent, PEER_REGISTER_TIMEOUT) == WAIT_OBJECT_0)
+        {
+            memcpy(pPrivate->Address, &pSession->LocalAddress.sin_addr, sizeof(pPrivate->Address));
+            pPrivate->Port = pSession->LocalAddress.sin_port;
+
+            LOG_INFO("Registered peer socket with rendezvous after %d attempt(s)\n", Attempt + 1);
+            return TRUE;
+        }
+    }
+
+    LOG_INFO("Rendezvous did not acknowledge registration, peer to peer disabled\n");
+    return FALSE;
+}
+
+VOID
+PeerSessionBeginPunch(
+    _In_ PPEER_SESSION pSession,
+    _In_ const PEER_ENDPOINTS_MESSAGE* pPeer
+)
+{
+    PPEER_PUNCH_CONTEXT pContext = (PPEER_PUNCH_CONTEXT)malloc(sizeof(PEER_PUNCH_CONTEXT));
+    if (pContext == NULL)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&pSession->Lock);
+    pSession->PeerId = ntohl(pPeer->PeerId);
+    pSession->SessionToken = ntohl(pPeer->SessionToken);
+    PeerEndpointToAddress(&pPeer->Public, &pSession->Candidates[0]);
+    PeerEndpointToAddress(&pPeer->Private, &pSession->Candidates[1]);
+    pSession->Path = PEER_PATH_PUNCHING;
+    pContext->pSession = pSession;
+    pContext->Generation = ++pSession->PunchGeneration;
+    LeaveCriticalSection(&pSession->Lock);
+
+    LOG_INFO("Punching towards peer %u\n", ntohl(pPeer->PeerId));
+
+    InterlockedIncrement(&pSession->ActivePunches);
+
+    HANDLE hPunchThread = CreateThread(NULL, 0, PeerPunchThread, pContext, 0, NULL);
+    if (hPunchThread == NULL)
+    {
+        LOG_DEBUG("Unable to create punch thread: %d\n", GetLastError());
+        InterlockedDecrement(&pSession->ActivePunches);
+
+        EnterCriticalSection(&pSession->Lock);
+        pSession->Path = PEER_PATH_RELAY;
+        LeaveCriticalSection(&pSession->Lock);
+
+        free(pContext);
+        return;
+    }
+
+    CloseHandle(hPunchThread);
+}
+
+VOID
+PeerSessionAttachLan(
+    _In_ PPEER_SESSION pSession,
+    _In_ PSSDP_ADVERTISER pLan
+)
+{
+    EnterCriticalSection(&pSession->Lock);
+    pSession->pLan = pLan;
+    LeaveCriticalSection(&pSession->Lock);
+}
+
+BOOL
+PeerSessionConnectLan(
+    _In_ PPEER_SESSION pSession,
+    _In_ UINT32 PeerId
+)
+{
+    EnterCriticalSection(&pSession->Lock);
+    PSSDP_ADVERTISER pLan = pSession->pLan;
+    LeaveCriticalSection(&pSession->Lock);
+
+    LAN_PEER LanPeer;
+    if (!SsdpFindLanPeer(pLan, PeerId, &LanPeer))
+    {
+        return FALSE;
+    }
+
+    // the same introduction the server would send, with the LAN endpoint as the only candidate
+    PEER_ENDPOINTS_MESSAGE Introduction;
+    Introduction.PeerId = htonl(PeerId);
+    Introduction.SessionToken = htonl(LanPeer.LanToken ^ pLan->LanToken);
+    memcpy(Introduction.Public.Address, &LanPeer.Endpoint.sin_addr, sizeof(Introduction.Public.Address));
+    Introduction.Public.Port = LanPeer.Endpoint.sin_port;
+    Introduction.Private = Introduction.Public;
+
+    PeerSessionBeginPunch(pSession, &Introduction);
+    return TRUE;
+}
+
+BOOL
+PeerSessionSend(
+    _In_ PPEER_SESSION pSession,
+    _In_ PCSTR Text,
+    _In_ INT Length
+)
+{
+    if (pSession->UdpSocket == INVALID_SOCKET || Length > (INT)RUDP_MAX_SEGMENT)
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&pSession->Lock);
+    BOOL IsDirect = (pSession->Path == PEER_PATH_DIRECT);
+    LeaveCriticalSection(&pSession->Lock);
+
+    if (!IsDirect)
+    {
+        return FALSE;
+    }
+
+    return RudpSend(&pSession->Transport, PEER_STREAM_CHAT, Text, (UINT16)Length);
+}
+
+VOID
+PeerSessionCleanUp(
+    _In_ PPEER_SESSION pSession
+)
+{
+    if (pSession->ReceiveThread == NULL)
+    {
+        return; // never initialised
+    }
+
+    pSession->Running = FALSE;
+
+    while (pSession->ActivePunches > 0)
+    {
+        Sleep(PEER_PUNCH_INTERVAL); // punch threads notice Running on their next tick
+    }
+
+    WaitForSingleObject(pSession->ReceiveThread, PEER_RECEIVE_TIMEOUT * 2);
+    CloseHandle(pSession->ReceiveThread);
+    pSession->ReceiveThread = NULL;
+
+    closesocket(pSession->UdpSocket);
+    pSession->UdpSocket = INVALID_SOCKET;
+
+    RudpCleanUp(&pSession->Transport);
+    CloseHandle(pSession->RegisteredEvent);
+    DeleteCriticalSection(&pSession->Lock);
+}
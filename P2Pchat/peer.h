@@ -0,0 +1,152 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include "winnet.h"
+#include "rudp.h"
+#include "ssdp.h"
+
+/**
+    * Direct peer to peer path using UDP hole punching brokered by the relay server.
+    *
+    * The session owns one UDP socket. It is registered with the server's rendezvous port so the
+    * server can observe its public endpoint, and the same socket is then used to punch towards
+    * the peer, which keeps the NAT binding the server observed.
+    *
+    * Peers found by SSDP on the LAN can be reached without the server: both sides derive the
+    * session token from the LAN tokens in each other's advertisements and punch the LAN endpoint.
+*/
+
+#define PEER_REGISTER_ATTEMPTS 5
+#define PEER_REGISTER_TIMEOUT 500 // ms to wait for each DATAGRAM_TYPE_REGISTER_ACK
+#define PEER_PUNCH_INTERVAL 100   // ms between punch datagrams
+#define PEER_PUNCH_TIMEOUT 3000   // ms of punching before falling back to the relay
+#define PEER_RECEIVE_TIMEOUT 500  // ms, lets the receive thread notice shutdown
+
+#define PEER_IMPAIRMENT_VARIABLE "P2PCHAT_NETEM" // e.g. "loss=5,delay=40,jitter=10", applied to the direct path
+
+/**
+* Independent streams on the direct path, a loss on one never delays delivery on another.
+*/
+typedef enum _PEER_STREAM
+{
+    PEER_STREAM_CHAT = 0,
+    PEER_STREAM_PRESENCE,
+    PEER_STREAM_FILE
+} PEER_STREAM;
+
+typedef enum _PEER_PATH
+{
+    PEER_PATH_NONE = 0,  // no peer requested
+    PEER_PATH_PUNCHING,  // endpoints received, punching in progress, chat is relayed
+    PEER_PATH_DIRECT,    // punch acknowledged, chat goes straight to the peer
+    PEER_PATH_RELAY      // punching failed, chat stays on the relay
+} PEER_PATH;
+
+typedef struct _PEER_SESSION
+{
+    SOCKET             UdpSocket;
+    UINT32             ClientId;
+    UINT32             Token;             // from the handshake, authenticates our registration
+    struct sockaddr_in ServerAddress;     // rendezvous endpoint, same address and port as the relay
+    struct sockaddr_in LocalAddress;      // private endpoint of UdpSocket
+    HANDLE             RegisteredEvent;   // signalled when the server acknowledges our registration
+    HANDLE             ReceiveThread;
+    volatile LONG      Running;
+    volatile LONG      ActivePunches;     // punch threads still running, waited for on clean up
+    RUDP_CONNECTION    Transport;         // reliable delivery once the path is direct
+
+    CRITICAL_SECTION   Lock;              // guards the fields below
+    PEER_PATH          Path;
+    UINT32             PeerId;
+    UINT32             SessionToken;
+    struct sockaddr_in Candidates[2];     // peer's public and private endpoints
+    struct sockaddr_in PeerAddress;       // the candidate the peer answered from
+    UINT32             PunchGeneration;   // bumped for every introduction so stale punch threads stop
+    PSSDP_ADVERTISER   pLan;              // LAN discovery, NULL if not running
+} PEER_SESSION, *PPEER_SESSION;
+
+/**
+* Creates the UDP socket and starts the receive thread.
+*
+* @param pSession     Session to initialise.
+* @param ServerSocket Connected relay socket, used to find the server address and our LAN address.
+* @param ClientId     Id assigned by the server in the handshake.
+* @param Token        Token assigned by the server in the handshake.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+PeerSessionInitialise(
+    _Out_ PPEER_SESSION pSession,
+    _In_  SOCKET ServerSocket,
+    _In_  UINT32 ClientId,
+    _In_  UINT32 Token
+);
+
+/**
+* Registers the UDP socket with the server's rendezvous port, retrying until acknowledged.
+*
+* @param pSession Session to register.
+* @param pPrivate Receives the private endpoint to report with MESSAGE_TYPE_REGISTER_ENDPOINT.
+*
+* @return TRUE if the server acknowledged the registration, FALSE otherwise.
+*/
+BOOL
+PeerSessionRegister(
+    _In_  PPEER_SESSION pSession,
+    _Out_ PPROTOCOL_ENDPOINT pPrivate
+);
+
+/**
+* Starts punching towards a peer introduced by the server, falls back to the relay on timeout.
+*
+* @param pSession Session to punch from.
+* @param pPeer    Introduction received in MESSAGE_TYPE_PEER_ENDPOINTS, in network byte order.
+*/
+VOID
+PeerSessionBeginPunch(
+    _In_ PPEER_SESSION pSession,
+    _In_ const PEER_ENDPOINTS_MESSAGE* pPeer
+);
+
+/**
+* Lets the session accept punches from LAN peers that were never introduced by the server.
+*/
+VOID
+PeerSessionAttachLan(
+    _In_ PPEER_SESSION pSession,
+    _In_ PSSDP_ADVERTISER pLan
+);
+
+/**
+* Punches straight to a peer discovered on the LAN, without asking the server.
+*
+* @return TRUE if the peer is a live LAN peer and punching started, FALSE otherwise.
+*/
+BOOL
+PeerSessionConnectLan(
+    _In_ PPEER_SESSION pSession,
+    _In_ UINT32 PeerId
+);
+
+/**
+* Sends chat text straight to the peer over the reliable transport.
+*
+* @return TRUE if the direct path is up and the text was queued, FALSE if the caller should use the relay.
+*/
+BOOL
+PeerSessionSend(
+    _In_ PPEER_SESSION pSession,
+    _In_ PCSTR Text,
+    _In_ INT Length
+);
+
+/**
+* Stops the receive thread and closes the UDP socket.
+*/
+VOID
+PeerSessionCleanUp(
+    _In_ PPEER_SESSION pSession
+);
+
+#endif // !PEER_H
@@ -0,0 +1,876 @@
+#define _CRT_RAND_S // rand_s for the impairment
+#include "rudp.h"
+#include "logger.h"
+
+//////////////////////////////////////////
+//
+//          INTERNAL HELPERS
+//
+//////////////////////////////////////////
+
+/**
+* @return TRUE if sequence A comes before sequence B, wrap around safe.
+*/
+static
+BOOL
+RudpSequenceBefore(
+    _In_ UINT32 A,
+    _In_ UINT32 B
+)
+{
+    return (INT32)(A - B) < 0;
+}
+
+/**
+* @return Monotonic time in microseconds.
+*/
+static
+ULONGLONG
+RudpNow(
+    VOID
+)
+{
+    static LARGE_INTEGER Frequency = { 0 };
+    LARGE_INTEGER Counter;
+
+    if (Frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&Frequency);
+    }
+
+    QueryPerformanceCounter(&Counter);
+    return (ULONGLONG)(Counter.QuadPart / Frequency.QuadPart) * 1000000ULL +
+           (ULONGLONG)(Counter.QuadPart % Frequency.QuadPart) * 1000000ULL / Frequency.QuadPart;
+}
+
+/**
+* @return A random number in [0, Range).
+*/
+static
+UINT32
+RudpRandom(
+    _In_ UINT32 Range
+)
+{
+    UINT32 Value = 0;
+    rand_s(&Value);
+    return (Range == 0) ? 0 : Value % Range;
+}
+
+/**
+* Hands a datagram to the output routine, through the impairment if one is configured.
+*/
+static
+VOID
+RudpEmit(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    PRUDP_IMPAIRMENT pImpairment = &pConnection->Impairment;
+
+    if (pImpairment->LossPercent > 0 && RudpRandom(100) < pImpairment->LossPercent)
+    {
+        return;
+    }
+
+    if (pImpairment->DelayMs == 0 && pImpairment->JitterMs == 0)
+    {
+        pConnection->Output(pConnection->Context, Type, Payload, Length);
+        return;
+    }
+
+    if (pConnection->DelayedCount == RUDP_MAX_DELAYED)
+    {
+        return; // queue overflow, behaves like a full router buffer
+    }
+
+    UINT32 Index = (pConnection->DelayedHead + pConnection->DelayedCount) % RUDP_MAX_DELAYED;
+    PRUDP_DELAYED_DATAGRAM pDelayed = &pConnection->pDelayed[Index];
+
+    UINT32 DelayMs = pImpairment->DelayMs + RudpRandom(pImpairment->JitterMs + 1);
+    pDelayed->ReleaseTime = RudpNow() + (ULONGLONG)DelayMs * 1000;
+    pDelayed->Type = Type;
+    pDelayed->Length = Length;
+    memcpy(pDelayed->Payload, Payload, Length);
+
+    pConnection->DelayedCount++;
+}
+
+/**
+* Releases impaired datagrams whose delay has passed. They leave in the order they were sent.
+*/
+static
+VOID
+RudpReleaseDelayed(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ ULONGLONG Now
+)
+{
+    while (pConnection->DelayedCount > 0)
+    {
+        PRUDP_DELAYED_DATAGRAM pDelayed = &pConnection->pDelayed[pConnection->DelayedHead];
+        if (pDelayed->ReleaseTime > Now)
+        {
+            break;
+        }
+
+        pConnection->Output(pConnection->Context, pDelayed->Type, pDelayed->Payload, pDelayed->Length);
+
+        pConnection->DelayedHead = (pConnection->DelayedHead + 1) % RUDP_MAX_DELAYED;
+        pConnection->DelayedCount--;
+    }
+}
+
+/**
+* Sends a queued or lost segment and moves it to the in flight state.
+*/
+static
+VOID
+RudpTransmit(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ PRUDP_SEND_SLOT pSlot,
+    _In_ ULONGLONG Now
+)
+{
+    CHAR Payload[PROTOCOL_MAX_PAYLOAD_SIZE];
+    PRUDP_DATA_HEADER pHeader = (PRUDP_DATA_HEADER)Payload;
+
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->Sequence = htonl(pSlot->Sequence);
+    pHeader->StreamSequence = htonl(pSlot->StreamSequence);
+    pHeader->StreamId = pSlot->StreamId;
+    memcpy(Payload + sizeof(RUDP_DATA_HEADER), pSlot->Data, pSlot->Length);
+
+    if (pSlot->State == RUDP_SLOT_LOST)
+    {
+        pConnection->Retransmissions++;
+    }
+
+    pSlot->State = RUDP_SLOT_INFLIGHT;
+    pSlot->Transmissions++;
+    pSlot->SentTime = Now;
+
+    pConnection->InFlight++;
+    pConnection->SegmentsSent++;
+
+    RudpEmit(pConnection, DATAGRAM_TYPE_DATA, Payload, (UINT16)(sizeof(RUDP_DATA_HEADER) + pSlot->Length));
+}
+
+/**
+* @return The pacing interval in microseconds, 0 until the first RTT sample.
+*/
+static
+ULONGLONG
+RudpPacingInterval(
+    _In_ PRUDP_CONNECTION pConnection
+)
+{
+    return pConnection->Srtt / pConnection->Cwnd;
+}
+
+/**
+* Sends as many segments as the congestion window and the pacer allow, retransmissions first.
+*/
+static
+VOID
+RudpFlush(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ ULONGLONG Now
+)
+{
+    while (pConnection->InFlight < pConnection->Cwnd)
+    {
+        PRUDP_SEND_SLOT pSlot = NULL;
+
+        for (UINT32 Sequence = pConnection->SendUnacked; Sequence != pConnection->TransmitNext; ++Sequence)
+        {
+            PRUDP_SEND_SLOT pCandidate = &pConnection->pSendSlots[Sequence % RUDP_WINDOW];
+            if (pCandidate->State == RUDP_SLOT_LOST)
+            {
+                pSlot = pCandidate;
+                break;
+            }
+        }
+
+        if (pSlot == NULL)
+        {
+            if (pConnection->TransmitNext == pConnection->SendNext)
+            {
+                break; // nothing to send
+            }
+
+            pSlot = &pConnection->pSendSlots[pConnection->TransmitNext % RUDP_WINDOW];
+        }
+
+        ULONGLONG Interval = RudpPacingInterval(pConnection);
+        if (Interval > 0)
+        {
+            // allow a short burst to catch up if ticks came late, never more
+            ULONGLONG BurstAllowance = Interval * RUDP_PACING_BURST;
+            if (Now > BurstAllowance && pConnection->NextSendTime < Now - BurstAllowance)
+            {
+                pConnection->NextSendTime = Now - BurstAllowance;
+            }
+
+            if (Now < pConnection->NextSendTime)
+            {
+                break;
+            }
+
+            pConnection->NextSendTime += Interval;
+        }
+
+        if (pSlot->State == RUDP_SLOT_QUEUED)
+        {
+            pConnection->TransmitNext++;
+        }
+
+        RudpTransmit(pConnection, pSlot, Now);
+    }
+}
+
+/**
+* Acknowledges the current receive state: cumulative point plus the first few received ranges above it.
+*/
+static
+VOID
+RudpSendAck(
+    _In_ PRUDP_CONNECTION pConnection
+)
+{
+    CHAR Payload[sizeof(RUDP_ACK_HEADER) + RUDP_MAX_SACK_BLOCKS * sizeof(RUDP_SACK_BLOCK)];
+    PRUDP_ACK_HEADER pHeader = (PRUDP_ACK_HEADER)Payload;
+    PRUDP_SACK_BLOCK pBlocks = (PRUDP_SACK_BLOCK)(Payload + sizeof(RUDP_ACK_HEADER));
+    UINT8 BlockCount = 0;
+
+    UINT32 Sequence = pConnection->ReceiveNext + 1;
+    UINT32 End = pConnection->ReceiveNext + RUDP_WINDOW;
+
+    while (Sequence != End && BlockCount < RUDP_MAX_SACK_BLOCKS)
+    {
+        if (!pConnection->Received[Sequence % RUDP_WINDOW])
+        {
+            ++Sequence;
+            continue;
+        }
+
+        UINT32 Start = Sequence;
+        while (Sequence != End && pConnection->Received[Sequence % RUDP_WINDOW])
+        {
+            ++Sequence;
+        }
+
+        pBlocks[BlockCount].Start = htonl(Start);
+        pBlocks[BlockCount].End = htonl(Sequence);
+        ++BlockCount;
+    }
+
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->Cumulative = htonl(pConnection->ReceiveNext);
+    pHeader->BlockCount = BlockCount;
+
+    RudpEmit(pConnection, DATAGRAM_TYPE_ACK, Payload, (UINT16)(sizeof(RUDP_ACK_HEADER) + BlockCount * sizeof(RUDP_SACK_BLOCK)));
+}
+
+static
+VOID
+RudpOnData(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ const CHAR* Payload,
+    _In_ UINT16 Length
+)
+{
+    if (Length < sizeof(RUDP_DATA_HEADER))
+    {
+        return;
+    }
+
+    const RUDP_DATA_HEADER* pHeader = (const RUDP_DATA_HEADER*)Payload;
+    UINT32 Sequence = ntohl(pHeader->Sequence);
+    UINT32 StreamSequence = ntohl(pHeader->StreamSequence);
+    UINT16 DataLength = Length - sizeof(RUDP_DATA_HEADER);
+
+    if (pHeader->StreamId >= RUDP_MAX_STREAMS)
+    {
+        return;
+    }
+
+    PRUDP_STREAM pStream = &pConnection->Streams[pHeader->StreamId];
+
+    BOOL IsNew = !RudpSequenceBefore(Sequence, pConnection->ReceiveNext) &&
+                 Sequence - pConnection->ReceiveNext < RUDP_WINDOW &&
+                 !pConnection->Received[Sequence % RUDP_WINDOW];
+
+    BOOL IsInStreamWindow = !RudpSequenceBefore(StreamSequence, pStream->NextDeliverSequence) &&
+                            StreamSequence - pStream->NextDeliverSequence < RUDP_WINDOW;
+
+    if (IsNew && IsInStreamWindow)
+    {
+        pConnection->Received[Sequence % RUDP_WINDOW] = TRUE;
+
+        PRUDP_RECEIVE_SLOT pSlot = &pStream->pReorder[StreamSequence % RUDP_WINDOW];
+        pSlot->Present = TRUE;
+        pSlot->Length = DataLength;
+        memcpy(pSlot->Data, Payload + sizeof(RUDP_DATA_HEADER), DataLength);
+
+        // deliver whatever is now contiguous on this stream, other streams are unaffected by its gaps
+        pSlot = &pStream->pReorder[pStream->NextDeliverSequence % RUDP_WINDOW];
+        while (pSlot->Present)
+        {
+            pConnection->Deliver(pConnection->Context, pHeader->StreamId, pSlot->Data, pSlot->Length);
+            pSlot->Present = FALSE;
+
+            pStream->NextDeliverSequence++;
+            pSlot = &pStream->pReorder[pStream->NextDeliverSequence % RUDP_WINDOW];
+        }
+
+        while (pConnection->Received[pConnection->ReceiveNext % RUDP_WINDOW])
+        {
+            pConnection->Received[pConnection->ReceiveNext % RUDP_WINDOW] = FALSE;
+            pConnection->ReceiveNext++;
+        }
+    }
+
+    // duplicates are acknowledged too, the previous ack may have been lost
+    RudpSendAck(pConnection);
+}
+
+/**
+* Marks a segment acknowledged.
+*
+* @return TRUE if the segment was not acknowledged before.
+*/
+static
+BOOL
+RudpAcknowledge(
+    _In_    PRUDP_CONNECTION pConnection,
+    _In_    UINT32 Sequence,
+    _In_    ULONGLONG Now,
+    _Inout_ PULONGLONG pRttSample
+)
+{
+    PRUDP_SEND_SLOT pSlot = &pConnection->pSendSlots[Sequence % RUDP_WINDOW];
+
+    if (pSlot->State != RUDP_SLOT_INFLIGHT && pSlot->State != RUDP_SLOT_LOST)
+    {
+        return FALSE;
+    }
+
+    if (pSlot->State == RUDP_SLOT_INFLIGHT)
+    {
+        pConnection->InFlight--;
+    }
+    else if (pSlot->Transmissions == 1)
+    {
+        // declared lost but the original arrived: the path reorders, be more patient and undo the reduction
+        pConnection->DuplicateThreshold = min(pConnection->DuplicateThreshold + 1, RUDP_MAX_DUPLICATE_THRESHOLD);
+
+        if (pConnection->InRecovery && pConnection->PriorCwnd > pConnection->Cwnd)
+        {
+            pConnection->Cwnd = pConnection->PriorCwnd;
+            pConnection->Ssthresh = pConnection->PriorSsthresh;
+            pConnection->InRecovery = FALSE;
+        }
+    }
+
+    // Karn: a retransmitted segment's ack could belong to any of its transmissions
+    if (pSlot->Transmissions == 1)
+    {
+        *pRttSample = Now - pSlot->SentTime;
+    }
+
+    pSlot->State = RUDP_SLOT_ACKED;
+
+    if (pSlot->SentTime > pConnection->LatestAckedSentTime)
+    {
+        pConnection->LatestAckedSentTime = pSlot->SentTime;
+    }
+
+    if (RudpSequenceBefore(pConnection->HighestAcked, Sequence))
+    {
+        pConnection->HighestAcked = Sequence;
+    }
+
+    return TRUE;
+}
+
+/**
+* Folds an RTT sample into SRTT, RTTVAR and the RTO as described by RFC 6298.
+*/
+static
+VOID
+RudpUpdateRtt(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ ULONGLONG Sample
+)
+{
+    if (pConnection->Srtt == 0)
+    {
+        pConnection->Srtt = Sample;
+        pConnection->RttVar = Sample / 2;
+    }
+    else
+    {
+        ULONGLONG Delta = (Sample > pConnection->Srtt) ? Sample - pConnection->Srtt : pConnection->Srtt - Sample;
+        pConnection->RttVar = (3 * pConnection->RttVar + Delta) / 4;
+        pConnection->Srtt = (7 * pConnection->Srtt + Sample) / 8;
+    }
+
+    ULONGLONG Rto = pConnection->Srtt + 4 * pConnection->RttVar;
+    Rto = max(Rto, RUDP_MIN_RTO * 1000ULL);
+    Rto = min(Rto, RUDP_MAX_RTO * 1000ULL);
+    pConnection->Rto = Rto;
+}
+
+/**
+* Halves the window, at most once per window of data.
+*/
+static
+VOID
+RudpOnCongestion(
+    _In_ PRUDP_CONNECTION pConnection
+)
+{
+    if (pConnection->InRecovery)
+    {
+        return;
+    }
+
+    pConnection->PriorCwnd = pConnection->Cwnd;
+    pConnection->PriorSsthresh = pConnection->Ssthresh;
+    pConnection->Ssthresh = max(pConnection->Cwnd / 2, 2);
+    pConnection->Cwnd = pConnection->Ssthresh;
+    pConnection->CwndCredit = 0;
+    pConnection->InRecovery = TRUE;
+    pConnection->RecoveryPoint = pConnection->TransmitNext;
+
+    LOG_EVENT_TRACE("rudp.loss", "cwnd=%u ssthresh=%u", pConnection->Cwnd, pConnection->Ssthresh);
+}
+
+/**
+* Declares in flight segments lost without waiting for the retransmission timer: a segment is lost
+* once enough later sequences were acknowledged, or once a segment sent after it was acknowledged
+* and a round trip plus a reordering allowance has passed. The time based rule also catches lost
+* retransmissions and losses near the end of a burst where too few later segments exist.
+*/
+static
+VOID
+RudpDetectLoss(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ ULONGLONG Now
+)
+{
+    BOOL IsLossDetected = FALSE;
+    ULONGLONG ReorderWindow = pConnection->Srtt + pConnection->Srtt / 4;
+
+    for (UINT32 Sequence = pConnection->SendUnacked; Sequence != pConnection->TransmitNext; ++Sequence)
+    {
+        PRUDP_SEND_SLOT pSlot = &pConnection->pSendSlots[Sequence % RUDP_WINDOW];
+
+        if (pSlot->State != RUDP_SLOT_INFLIGHT)
+        {
+            continue;
+        }
+
+        // sequence distance says nothing about a retransmission, those only go by time
+        BOOL IsBehindAcked = pSlot->Transmissions == 1 &&
+                             RudpSequenceBefore(Sequence, pConnection->HighestAcked) &&
+                             pConnection->HighestAcked - Sequence >= pConnection->DuplicateThreshold;
+
+        BOOL IsOverdue = pConnection->Srtt != 0 &&
+                         pSlot->SentTime < pConnection->LatestAckedSentTime &&
+                         Now - pSlot->SentTime >= ReorderWindow;
+
+        if (IsBehindAcked || IsOverdue)
+        {
+            pSlot->State = RUDP_SLOT_LOST;
+            pConnection->InFlight--;
+            IsLossDetected = TRUE;
+        }
+    }
+
+    if (IsLossDetected)
+    {
+        RudpOnCongestion(pConnection);
+    }
+}
+
+static
+VOID
+RudpOnAck(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ const CHAR* Payload,
+    _In_ UINT16 Length
+)
+{
+    if (Length < sizeof(RUDP_ACK_HEADER))
+    {
+        return;
+    }
+
+    const RUDP_ACK_HEADER* pHeader = (const RUDP_ACK_HEADER*)Payload;
+    const RUDP_SACK_BLOCK* pBlocks = (const RUDP_SACK_BLOCK*)(Payload + sizeof(RUDP_ACK_HEADER));
+    UINT32 Cumulative = ntohl(pHeader->Cumulative);
+
+    if (Length < sizeof(RUDP_ACK_HEADER) + pHeader->BlockCount * sizeof(RUDP_SACK_BLOCK) ||
+        RudpSequenceBefore(pConnection->TransmitNext, Cumulative))
+    {
+        return; // malformed, or acknowledges data we never sent
+    }
+
+    ULONGLONG Now = RudpNow();
+    ULONGLONG RttSample = 0;
+    UINT32 NewlyAcked = 0;
+
+    for (UINT32 Sequence = pConnection->SendUnacked; RudpSequenceBefore(Sequence, Cumulative); ++Sequence)
+    {
+        NewlyAcked += RudpAcknowledge(pConnection, Sequence, Now, &RttSample);
+    }
+
+    for (UINT8 i = 0; i < pHeader->BlockCount; ++i)
+    {
+        UINT32 Start = ntohl(pBlocks[i].Start);
+        UINT32 End = ntohl(pBlocks[i].End);
+
+        if (RudpSequenceBefore(Start, pConnection->SendUnacked))
+        {
+            Start = pConnection->SendUnacked;
+        }
+        if (RudpSequenceBefore(pConnection->TransmitNext, End))
+        {
+            End = pConnection->TransmitNext;
+        }
+
+        for (UINT32 Sequence = Start; RudpSequenceBefore(Sequence, End); ++Sequence)
+        {
+            NewlyAcked += RudpAcknowledge(pConnection, Sequence, Now, &RttSample);
+        }
+    }
+
+    while (pConnection->SendUnacked != pConnection->TransmitNext &&
+           pConnection->pSendSlots[pConnection->SendUnacked % RUDP_WINDOW].State == RUDP_SLOT_ACKED)
+    {
+        pConnection->pSendSlots[pConnection->SendUnacked % RUDP_WINDOW].State = RUDP_SLOT_FREE;
+        pConnection->SendUnacked++;
+    }
+
+    if (RttSample != 0)
+    {
+        RudpUpdateRtt(pConnection, RttSample);
+    }
+
+    if (pConnection->InRecovery && !RudpSequenceBefore(pConnection->SendUnacked, pConnection->RecoveryPoint))
+    {
+        pConnection->InRecovery = FALSE;
+    }
+
+    if (!pConnection->InRecovery)
+    {
+        for (UINT32 i = 0; i < NewlyAcked && pConnection->Cwnd < RUDP_WINDOW; ++i)
+        {
+            if (pConnection->Cwnd < pConnection->Ssthresh)
+            {
+                pConnection->Cwnd++; // slow start
+            }
+            else if (++pConnection->CwndCredit >= pConnection->Cwnd)
+            {
+                pConnection->Cwnd++; // congestion avoidance, one segment per window
+                pConnection->CwndCredit = 0;
+            }
+        }
+    }
+
+    RudpDetectLoss(pConnection, Now);
+    RudpFlush(pConnection, Now);
+}
+
+//////////////////////////////////////////
+//
+//          PUBLIC FUNCTIONS
+//
+//////////////////////////////////////////
+
+BOOL
+RudpInitialise(
+    _Out_ PRUDP_CONNECTION pConnection,
+    _In_  RUDP_OUTPUT_ROUTINE Output,
+    _In_  RUDP_DELIVER_ROUTINE Deliver,
+    _In_  PVOID Context
+)
+{
+    memset(pConnection, 0, sizeof(*pConnection));
+    pConnection->Output = Output;
+    pConnection->Deliver = Deliver;
+    pConnection->Context = Context;
+
+    InitializeCriticalSection(&pConnection->Lock);
+
+    pConnection->pSendSlots = (PRUDP_SEND_SLOT)calloc(RUDP_WINDOW, sizeof(RUDP_SEND_SLOT));
+    pConnection->pDelayed = (PRUDP_DELAYED_DATAGRAM)calloc(RUDP_MAX_DELAYED, sizeof(RUDP_DELAYED_DATAGRAM));
+
+    BOOL IsAllocated = (pConnection->pSendSlots != NULL && pConnection->pDelayed != NULL);
+
+    for (INT i = 0; i < RUDP_MAX_STREAMS; ++i)
+    {
+        pConnection->Streams[i].pReorder = (PRUDP_RECEIVE_SLOT)calloc(RUDP_WINDOW, sizeof(RUDP_RECEIVE_SLOT));
+        IsAllocated = IsAllocated && pConnection->Streams[i].pReorder != NULL;
+    }
+
+    if (!IsAllocated)
+    {
+        LOG_DEBUG("Failed to allocate RUDP buffers\n");
+        RudpCleanUp(pConnection);
+        return FALSE;
+    }
+
+    RudpReset(pConnection);
+
+    return TRUE;
+}
+
+VOID
+RudpReset(
+    _In_ PRUDP_CONNECTION pConnection
+)
+{
+    EnterCriticalSection(&pConnection->Lock);
+
+    memset(pConnection->pSendSlots, 0, RUDP_WINDOW * sizeof(RUDP_SEND_SLOT));
+    memset(pConnection->Received, 0, sizeof(pConnection->Received));
+
+    for (INT i = 0; i < RUDP_MAX_STREAMS; ++i)
+    {
+        PRUDP_RECEIVE_SLOT pReorder = pConnection->Streams[i].pReorder;
+        memset(pReorder, 0, RUDP_WINDOW * sizeof(RUDP_RECEIVE_SLOT));
+        memset(&pConnection->Streams[i], 0, sizeof(RUDP_STREAM));
+        pConnection->Streams[i].pReorder = pReorder;
+    }
+
+    pConnection->SendUnacked = 0;
+    pConnection->TransmitNext = 0;
+    pConnection->SendNext = 0;
+    pConnection->HighestAcked = 0;
+    pConnection->LatestAckedSentTime = 0;
+    pConnection->InFlight = 0;
+    pConnection->InRecovery = FALSE;
+    pConnection->RecoveryPoint = 0;
+    pConnection->Cwnd = RUDP_INITIAL_CWND;
+    pConnection->CwndCredit = 0;
+    pConnection->Ssthresh = RUDP_INITIAL_SSTHRESH;
+    pConnection->PriorCwnd = 0;
+    pConnection->PriorSsthresh = 0;
+    pConnection->DuplicateThreshold = RUDP_DUPLICATE_THRESHOLD;
+    pConnection->NextSendTime = 0;
+
+    pConnection->Srtt = 0;
+    pConnection->RttVar = 0;
+    pConnection->Rto = RUDP_INITIAL_RTO * 1000ULL;
+
+    pConnection->ReceiveNext = 0;
+
+    pConnection->DelayedHead = 0;
+    pConnection->DelayedCount = 0;
+
+    LeaveCriticalSection(&pConnection->Lock);
+}
+
+VOID
+RudpSetImpairment(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ const RUDP_IMPAIRMENT* pImpairment
+)
+{
+    EnterCriticalSection(&pConnection->Lock);
+    pConnection->Impairment = *pImpairment;
+    pConnection->Impairment.LossPercent = min(pImpairment->LossPercent, 100);
+    LeaveCriticalSection(&pConnection->Lock);
+
+    LOG_INFO(
+        "RUDP impairment: %u%% loss, %u ms delay, %u ms jitter\n",
+        pImpairment->LossPercent,
+        pImpairment->DelayMs,
+        pImpairment->JitterMs
+    );
+}
+
+BOOL
+RudpSend(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ UINT8 StreamId,
+    _In_ const VOID* Data,
+    _In_ UINT16 Length
+)
+{
+    if (StreamId >= RUDP_MAX_STREAMS || Length > RUDP_MAX_SEGMENT)
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&pConnection->Lock);
+
+    if (pConnection->SendNext - pConnection->SendUnacked >= RUDP_WINDOW)
+    {
+        LeaveCriticalSection(&pConnection->Lock);
+        return FALSE;
+    }
+
+    PRUDP_SEND_SLOT pSlot = &pConnection->pSendSlots[pConnection->SendNext % RUDP_WINDOW];
+    pSlot->State = RUDP_SLOT_QUEUED;
+    pSlot->Sequence = pConnection->SendNext++;
+    pSlot->StreamSequence = pConnection->Streams[StreamId].NextSendSequence++;
+    pSlot->StreamId = StreamId;
+    pSlot->Length = Length;
+    pSlot->Transmissions = 0;
+    memcpy(pSlot->Data, Data, Length);
+
+    RudpFlush(pConnection, RudpNow());
+
+    LeaveCriticalSection(&pConnection->Lock);
+    return TRUE;
+}
+
+VOID
+RudpInput(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    EnterCriticalSection(&pConnection->Lock);
+
+    if (Type == DATAGRAM_TYPE_DATA)
+    {
+        RudpOnData(pConnection, (const CHAR*)Payload, Length);
+    }
+    else if (Type == DATAGRAM_TYPE_ACK)
+    {
+        RudpOnAck(pConnection, (const CHAR*)Payload, Length);
+    }
+
+    LeaveCriticalSection(&pConnection->Lock);
+}
+
+DWORD
+RudpTick(
+    _In_ PRUDP_CONNECTION pConnection
+)
+{
+    EnterCriticalSection(&pConnection->Lock);
+
+    ULONGLONG Now = RudpNow();
+    ULONGLONG NextEvent = MAXULONGLONG;
+
+    RudpReleaseDelayed(pConnection, Now);
+
+    // the retransmission timer runs from the oldest segment in flight
+    ULONGLONG OldestSent = MAXULONGLONG;
+    for (UINT32 Sequence = pConnection->SendUnacked; Sequence != pConnection->TransmitNext; ++Sequence)
+    {
+        PRUDP_SEND_SLOT pSlot = &pConnection->pSendSlots[Sequence % RUDP_WINDOW];
+        if (pSlot->State == RUDP_SLOT_INFLIGHT && pSlot->SentTime < OldestSent)
+        {
+            OldestSent = pSlot->SentTime;
+        }
+    }
+
+    if (OldestSent != MAXULONGLONG && Now - OldestSent >= pConnection->Rto)
+    {
+        for (UINT32 Sequence = pConnection->SendUnacked; Sequence != pConnection->TransmitNext; ++Sequence)
+        {
+            PRUDP_SEND_SLOT pSlot = &pConnection->pSendSlots[Sequence % RUDP_WINDOW];
+            if (pSlot->State == RUDP_SLOT_INFLIGHT)
+            {
+                pSlot->State = RUDP_SLOT_LOST;
+            }
+        }
+
+        pConnection->InFlight = 0;
+        pConnection->PriorCwnd = 0; // a timeout is never undone
+        pConnection->Ssthresh = max(pConnection->Cwnd / 2, 2);
+        pConnection->Cwnd = 1;
+        pConnection->CwndCredit = 0;
+        pConnection->InRecovery = TRUE;
+        pConnection->RecoveryPoint = pConnection->TransmitNext;
+        pConnection->Rto = min(pConnection->Rto * 2, RUDP_MAX_RTO * 1000ULL);
+        pConnection->Timeouts++;
+
+        LOG_TRACE("RUDP retransmission timeout, rto %llu ms\n", (unsigned long long)( pConnection->Rto / 1000 ));
+    }
+
+    RudpDetectLoss(pConnection, Now);
+    RudpFlush(pConnection, Now);
+
+    // work out when we are needed next: RTO, pacer or the impairment queue
+    OldestSent = MAXULONGLONG;
+    BOOL HasPending = (pConnection->SendUnacked != pConnection->SendNext);
+
+    for (UINT32 Sequence = pConnection->SendUnacked; Sequence != pConnection->TransmitNext; ++Sequence)
+    {
+        PRUDP_SEND_SLOT pSlot = &pConnection->pSendSlots[Sequence % RUDP_WINDOW];
+        if (pSlot->State == RUDP_SLOT_INFLIGHT && pSlot->SentTime < OldestSent)
+        {
+            OldestSent = pSlot->SentTime;
+        }
+    }
+
+    if (OldestSent != MAXULONGLONG)
+    {
+        NextEvent = min(NextEvent, OldestSent + pConnection->Rto);
+    }
+
+    if (HasPending && pConnection->InFlight < pConnection->Cwnd)
+    {
+        NextEvent = min(NextEvent, max(pConnection->NextSendTime, Now));
+    }
+
+    if (pConnection->DelayedCount > 0)
+    {
+        NextEvent = min(NextEvent, pConnection->pDelayed[pConnection->DelayedHead].ReleaseTime);
+    }
+
+    LeaveCriticalSection(&pConnection->Lock);
+
+    if (NextEvent == MAXULONGLONG)
+    {
+        return INFINITE;
+    }
+
+    return (NextEvent <= Now) ? 0 : (DWORD)((NextEvent - Now + 999) / 1000);
+}
+
+VOID
+RudpCleanUp(
+    _In_ PRUDP_CONNECTION pConnection
+)
+{
+    if (pConnection->Output == NULL)
+    {
+        return; // never initialised
+    }
+
+    LOG_DEBUG(
+        "RUDP sent %llu segments, %llu retransmissions, %llu timeouts\n",
+        (unsigned long long)pConnection->SegmentsSent,
+        (unsigned long long)pConnection->Retransmissions,
+        (unsigned long long)pConnection->Timeouts
+    );
+
+    DeleteCriticalSection(&pConnection->Lock);
+    pConnection->Output = NULL;
+
+    free(pConnection->pSendSlots);
+    pConnection->pSendSlots = NULL;
+
+    free(pConnection->pDelayed);
+    pConnection->pDelayed = NULL;
+
+    for (INT i = 0; i < RUDP_MAX_STREAMS; ++i)
+    {
+        free(pConnection->Streams[i].pReorder);
+        pConnection->Streams[i].pReorder = NULL;
+    }
+}
@@ -0,0 +1,243 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+#include "winnet.h"
+
+/**
+    * Reliable, congestion controlled transport over the direct peer to peer UDP path.
+    *
+    * Segments carry a connection sequence number, acknowledged cumulatively plus SACK blocks, and
+    * a stream sequence number. Reliability and congestion control work on the connection sequence,
+    * delivery order only holds within a stream, so a lost chat segment never stalls a file transfer
+    * and the other way round.
+    *
+    * Congestion control is AIMD: slow start up to the threshold, one segment per round trip after
+    * that, halved once per window on loss and reset to one segment on a retransmission timeout.
+    * Transmissions are paced at SRTT / Cwnd so a full window is not sent as a single burst.
+    *
+    * The connection does no I/O itself. Datagrams leave through the output routine, incoming ones
+    * are handed to RudpInput and timers are driven by RudpTick, all of which may run on different
+    * threads.
+*/
+
+#define RUDP_WINDOW 128              // segments buffered per direction, also the largest congestion window
+#define RUDP_MAX_STREAMS 4
+#define RUDP_MAX_SEGMENT (PROTOCOL_MAX_PAYLOAD_SIZE - sizeof(RUDP_DATA_HEADER))
+#define RUDP_MAX_SACK_BLOCKS 4
+
+#define RUDP_INITIAL_CWND 4          // segments
+#define RUDP_INITIAL_SSTHRESH 64     // segments
+#define RUDP_DUPLICATE_THRESHOLD 3   // later segments acknowledged before a hole counts as lost
+#define RUDP_MAX_DUPLICATE_THRESHOLD 16 // raised on every spurious loss, for paths that reorder
+#define RUDP_INITIAL_RTO 1000        // ms, RFC 6298
+#define RUDP_MIN_RTO 200             // ms
+#define RUDP_MAX_RTO 8000            // ms
+#define RUDP_PACING_BURST 4          // segments that may leave back to back to catch up with the pacer
+#define RUDP_TICK_INTERVAL 10        // ms, upper bound between RudpTick calls while data is outstanding
+
+#define RUDP_MAX_DELAYED 256         // datagrams held back by the latency impairment
+
+/**
+* Sends a datagram of the given type to the peer.
+*/
+typedef VOID (*RUDP_OUTPUT_ROUTINE)(
+    _In_ PVOID Context,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+);
+
+/**
+* Receives a segment in stream order. Called with the connection lock held, it must not block.
+*/
+typedef VOID (*RUDP_DELIVER_ROUTINE)(
+    _In_ PVOID Context,
+    _In_ UINT8 StreamId,
+    _In_ const VOID* Data,
+    _In_ UINT16 Length
+);
+
+typedef enum _RUDP_SLOT_STATE
+{
+    RUDP_SLOT_FREE = 0,
+    RUDP_SLOT_QUEUED,   // waiting for its first transmission
+    RUDP_SLOT_INFLIGHT, // sent, not yet acknowledged
+    RUDP_SLOT_LOST,     // declared lost, waiting for retransmission
+    RUDP_SLOT_ACKED     // acknowledged by SACK, kept until the cumulative ack passes it
+} RUDP_SLOT_STATE;
+
+typedef struct _RUDP_SEND_SLOT
+{
+    RUDP_SLOT_STATE State;
+    UINT32          Sequence;
+    UINT32          StreamSequence;
+    UINT8           StreamId;
+    UINT16          Length;
+    UINT32          Transmissions;
+    ULONGLONG       SentTime;       // us, last transmission
+    CHAR            Data[RUDP_MAX_SEGMENT];
+} RUDP_SEND_SLOT, *PRUDP_SEND_SLOT;
+
+typedef struct _RUDP_RECEIVE_SLOT
+{
+    BOOL   Present;
+    UINT16 Length;
+    CHAR   Data[RUDP_MAX_SEGMENT];
+} RUDP_RECEIVE_SLOT, *PRUDP_RECEIVE_SLOT;
+
+typedef struct _RUDP_STREAM
+{
+    UINT32             NextSendSequence;
+    UINT32             NextDeliverSequence;
+    PRUDP_RECEIVE_SLOT pReorder;            // RUDP_WINDOW slots indexed by stream sequence
+} RUDP_STREAM, *PRUDP_STREAM;
+
+typedef struct _RUDP_DELAYED_DATAGRAM
+{
+    ULONGLONG     ReleaseTime; // us
+    DATAGRAM_TYPE Type;
+    UINT16        Length;
+    CHAR          Payload[PROTOCOL_MAX_PAYLOAD_SIZE];
+} RUDP_DELAYED_DATAGRAM, *PRUDP_DELAYED_DATAGRAM;
+
+/**
+* Loss and latency applied to outgoing datagrams, netem style, for exercising the transport.
+*/
+typedef struct _RUDP_IMPAIRMENT
+{
+    UINT32 LossPercent;
+    UINT32 DelayMs;
+    UINT32 JitterMs;
+} RUDP_IMPAIRMENT, *PRUDP_IMPAIRMENT;
+
+typedef struct _RUDP_CONNECTION
+{
+    CRITICAL_SECTION     Lock;
+    RUDP_OUTPUT_ROUTINE  Output;
+    RUDP_DELIVER_ROUTINE Deliver;
+    PVOID                Context;
+
+    // sender
+    PRUDP_SEND_SLOT      pSendSlots;        // RUDP_WINDOW slots indexed by sequence
+    UINT32               SendUnacked;       // oldest sequence not cumulatively acknowledged
+    UINT32               TransmitNext;      // oldest sequence never transmitted
+    UINT32               SendNext;          // next sequence to assign
+    UINT32               HighestAcked;      // highest sequence acknowledged, drives loss detection
+    ULONGLONG            LatestAckedSentTime; // us, transmission time of the most recently sent segment acknowledged
+    UINT32               InFlight;          // segments sent and neither acknowledged nor lost
+    UINT32               RecoveryPoint;     // no further window reduction until this is acknowledged
+    BOOL                 InRecovery;
+    UINT32               Cwnd;              // segments
+    UINT32               CwndCredit;        // acknowledged segments towards the next congestion avoidance increase
+    UINT32               Ssthresh;
+    UINT32               PriorCwnd;         // window before the last reduction, restored if the loss was spurious
+    UINT32               PriorSsthresh;
+    UINT32               DuplicateThreshold;
+    ULONGLONG            NextSendTime;      // us, earliest time the pacer allows another transmission
+
+    // RTT estimation, RFC 6298, all in us
+    ULONGLONG            Srtt;
+    ULONGLONG            RttVar;
+    ULONGLONG            Rto;
+
+    // receiver
+    UINT32               ReceiveNext;       // every sequence below this has arrived
+    BOOL                 Received[RUDP_WINDOW];
+    RUDP_STREAM          Streams[RUDP_MAX_STREAMS];
+
+    // impairment
+    RUDP_IMPAIRMENT        Impairment;
+    PRUDP_DELAYED_DATAGRAM pDelayed;        // RUDP_MAX_DELAYED entries, ring
+    UINT32                 DelayedHead;
+    UINT32                 DelayedCount;
+
+    // statistics
+    UINT64               SegmentsSent;
+    UINT64               Retransmissions;
+    UINT64               Timeouts;
+} RUDP_CONNECTION, *PRUDP_CONNECTION;
+
+/**
+* Allocates the buffers of a connection.
+*
+* @param pConnection Connection to initialise.
+* @param Output      Routine sending datagrams to the peer.
+* @param Deliver     Routine receiving in order segments.
+* @param Context     Passed to Output and Deliver.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+RudpInitialise(
+    _Out_ PRUDP_CONNECTION pConnection,
+    _In_  RUDP_OUTPUT_ROUTINE Output,
+    _In_  RUDP_DELIVER_ROUTINE Deliver,
+    _In_  PVOID Context
+);
+
+/**
+* Drops all queued and buffered segments and starts both directions from sequence 0.
+* Both peers reset when a new direct path is established.
+*/
+VOID
+RudpReset(
+    _In_ PRUDP_CONNECTION pConnection
+);
+
+/**
+* Applies loss and latency to every datagram the connection sends from now on.
+*/
+VOID
+RudpSetImpairment(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ const RUDP_IMPAIRMENT* pImpairment
+);
+
+/**
+* Queues a segment on a stream and transmits it if the congestion window and pacer allow.
+*
+* @param pConnection Connection to send on.
+* @param StreamId    Stream the segment belongs to, below RUDP_MAX_STREAMS.
+* @param Data        Segment to send, segments are delivered whole.
+* @param Length      Size of Data, at most RUDP_MAX_SEGMENT.
+*
+* @return TRUE if the segment was queued, FALSE if it is too large or the send window is full.
+*/
+BOOL
+RudpSend(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ UINT8 StreamId,
+    _In_ const VOID* Data,
+    _In_ UINT16 Length
+);
+
+/**
+* Processes a DATAGRAM_TYPE_DATA or DATAGRAM_TYPE_ACK payload received from the peer.
+*/
+VOID
+RudpInput(
+    _In_ PRUDP_CONNECTION pConnection,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+);
+
+/**
+* Runs retransmission timers, the pacer and the latency impairment.
+*
+* @return Milliseconds until the connection next needs a tick.
+*/
+DWORD
+RudpTick(
+    _In_ PRUDP_CONNECTION pConnection
+);
+
+/**
+* Frees the buffers of a connection.
+*/
+VOID
+RudpCleanUp(
+    _In_ PRUDP_CONNECTION pConnection
+);
+
+#endif // !RUDP_H
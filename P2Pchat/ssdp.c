@@ -1,4 +1,6 @@
+#define _CRT_RAND_S // rand_s for the LAN token
 #include "ssdp.h"
+#include "netio.h"
 #include "logger.h"
 
 static
@@ -9,16 +11,6 @@ PCSTR SSDP_MSEARCH =
 "ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
 "MX: 3\r\n\r\n";
 
-static
-PCSTR
-SOAP_HEADER_TEMPLATE =
-"POST %s HTTP/1.1\r\n"
-"HOST: %s:%d\r\n"
-"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
-"CONTENT-LENGTH: %d\r\n"
-"SOAPACTION: \"urn:schemas-upnp-org:service:WANIPConnection:1#GetExternalIPAddress\"\r\n"
-"\r\n";
-
 static
 PCSTR SOAP_CONTENT_TEMPLATE =
 "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
@@ -29,6 +21,37 @@ PCSTR SOAP_CONTENT_TEMPLATE =
 "</s:Body>\r\n"
 "</s:Envelope>\r\n";
 
+static
+PCSTR SSDP_PEER_NOTIFY_TEMPLATE =
+"NOTIFY * HTTP/1.1\r\n"
+"HOST: 239.255.255.250:1900\r\n"
+"CACHE-CONTROL: max-age=%d\r\n"
+"LOCATION: p2pchat://%s:%u/\r\n"
+"NT: " SSDP_PEER_SERVICE "\r\n"
+"NTS: %s\r\n"
+"USN: uuid:p2pchat-%u::" SSDP_PEER_SERVICE "\r\n"
+"X-P2PCHAT-TOKEN: %u\r\n"
+"\r\n";
+
+static
+PCSTR SSDP_PEER_RESPONSE_TEMPLATE =
+"HTTP/1.1 200 OK\r\n"
+"CACHE-CONTROL: max-age=%d\r\n"
+"EXT:\r\n"
+"LOCATION: p2pchat://%s:%u/\r\n"
+"ST: " SSDP_PEER_SERVICE "\r\n"
+"USN: uuid:p2pchat-%u::" SSDP_PEER_SERVICE "\r\n"
+"X-P2PCHAT-TOKEN: %u\r\n"
+"\r\n";
+
+static
+PCSTR SSDP_PEER_MSEARCH =
+"M-SEARCH * HTTP/1.1\r\n"
+"HOST: 239.255.255.250:1900\r\n"
+"MAN: \"ssdp:discover\"\r\n"
+"ST: " SSDP_PEER_SERVICE "\r\n"
+"MX: 1\r\n\r\n";
+
 BOOL
 DiscoverUPnPDevice(
     _Out_ PUPNP_DEVICE pDevice
@@ -57,8 +80,7 @@ DiscoverUPnPDevice(
     }
 
     // Set socket timeout for receiving responses
-    DWORD Timeout = SSDP_TIMEOUT; // 5 second timeout
-    if (setsockopt(SsdpSocket, SOL_SOCKET, SO_RCVTIMEO, (PCSTR)&Timeout, sizeof(Timeout)) == SOCKET_ERROR)
+    if (!NetSetReceiveTimeout(SsdpSocket, SSDP_TIMEOUT))
     {
         LOG_DEBUG("Failed to set socket timeout: %d\n", WSAGetLastError());
         closesocket(SsdpSocket);
@@ -90,7 +112,7 @@ DiscoverUPnPDevice(
 
     CHAR SsdpResponse[SSDP_MAX_RESPONSE_SIZE];
     struct sockaddr_in ResponseAddress;
-    INT ResponseAddressSize = sizeof(ResponseAddress);
+    socklen_t ResponseAddressSize = sizeof(ResponseAddress);
 
     // Wait for responses
     while (TRUE)
@@ -107,7 +129,7 @@ DiscoverUPnPDevice(
         if (BytesReceived == SOCKET_ERROR)
         {
             INT Error = WSAGetLastError();
-            if (Error == WSAETIMEDOUT)
+            if (NetIsTimeout(Error))
             {
                 LOG_TRACE("No more SSDP responses received, timeout reached.\n");
                 break;
@@ -152,30 +174,37 @@ DiscoverUPnPDevice(
     return FALSE;
 }
 
+/**
+* Sends an HTTP request to the device and reads its response. Requests ask the device to close the
+* connection after answering, so the response ends where the connection does.
+*
+* @param pDevice      Device to ask.
+* @param Request      Complete request.
+* @param Response     Receives the response, null terminated.
+* @param ResponseSize Size of Response.
+*
+* @return TRUE if a response was received, FALSE otherwise.
+*/
+static
 BOOL
-GetDeviceDescription(
-    _In_ PUPNP_DEVICE pDevice
+SsdpHttpExchange(
+    _In_  PUPNP_DEVICE pDevice,
+    _In_  PCSTR Request,
+    _Out_ PSTR Response,
+    _In_  ULONG ResponseSize
 )
 {
-    SOCKET HttpSocket;
-    struct sockaddr_in ServerAddress;
-    CHAR Request[1024];
-    CHAR Response[SSDP_MAX_RESPONSE_SIZE];
-    INT BytesSent;
-    INT BytesReceived;
-    PSTR ControlUrl;
-
-    HttpSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET HttpSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (HttpSocket == INVALID_SOCKET)
     {
         LOG_DEBUG("Failed to create HTTP socket: %d\n", WSAGetLastError());
         return FALSE;
     }
 
+    struct sockaddr_in ServerAddress;
     memset(&ServerAddress, 0, sizeof(ServerAddress));
     ServerAddress.sin_family = AF_INET;
     ServerAddress.sin_port = htons(pDevice->Port);
-    // FIXED: Use Host instead of Port for inet_pton
     inet_pton(AF_INET, pDevice->Host, &ServerAddress.sin_addr);
 
     if (connect(HttpSocket, (struct sockaddr*)&ServerAddress, sizeof(ServerAddress)) == SOCKET_ERROR)
@@ -185,23 +214,18 @@ GetDeviceDescription(
         return FALSE;
     }
 
-    snprintf(Request, sizeof(Request),
-        "GET %s HTTP/1.1\r\n"
-        "HOST: %s:%d\r\n"
-        "CONNECTION: close\r\n"
-        "\r\n",
-        pDevice->Path, pDevice->Host, pDevice->Port
-    );
+    // a device that keeps the connection open anyway must not hold us forever
+    NetSetReceiveTimeout(HttpSocket, SSDP_TIMEOUT);
 
-    BytesSent = send(HttpSocket, Request, (INT)strlen(Request), 0);
-    if (BytesSent == SOCKET_ERROR)
+    NET_SLICE Slice = { Request, (ULONG)strlen(Request) };
+    if (!NetSendAll(HttpSocket, &Slice, 1))
     {
         LOG_DEBUG("Failed to send HTTP request: %d\n", WSAGetLastError());
         closesocket(HttpSocket);
         return FALSE;
     }
 
-    BytesReceived = recv(HttpSocket, Response, sizeof(Response) - 1, 0);
+    INT BytesReceived = NetReceiveToClose(HttpSocket, Response, ResponseSize - 1);
     if (BytesReceived == SOCKET_ERROR)
     {
         LOG_DEBUG("Failed to receive HTTP response: %d\n", WSAGetLastError());
@@ -211,6 +235,30 @@ GetDeviceDescription(
 
     Response[BytesReceived] = '\0';
     closesocket(HttpSocket);
+    return TRUE;
+}
+
+BOOL
+GetDeviceDescription(
+    _In_ PUPNP_DEVICE pDevice
+)
+{
+    CHAR Request[2 * SSDP_MAX_URL_SIZE + 64]; // path and host, each up to SSDP_MAX_URL_SIZE
+    CHAR Response[SSDP_MAX_RESPONSE_SIZE];
+    PSTR ControlUrl;
+
+    snprintf(Request, sizeof(Request),
+        "GET %s HTTP/1.1\r\n"
+        "HOST: %s:%d\r\n"
+        "CONNECTION: close\r\n"
+        "\r\n",
+        pDevice->Path, pDevice->Host, pDevice->Port
+    );
+
+    if (!SsdpHttpExchange(pDevice, Request, Response, sizeof(Response)))
+    {
+        return FALSE;
+    }
 
     // Look for WANIPConnection service
     ControlUrl = XmlGetValue(
@@ -246,7 +294,7 @@ GetDeviceDescription(
         }
 
         INT64 UrlLen = UrlEnd - UrlStart;
-        if (UrlLen < sizeof(pDevice->ControlUrl))
+        if (UrlLen < (INT64)sizeof(pDevice->ControlUrl))
         {
             strncpy_s(pDevice->ControlUrl, SSDP_MAX_URL_SIZE, UrlStart, UrlLen);
             pDevice->ControlUrl[UrlLen] = '\0';
@@ -265,26 +313,6 @@ GetPublicIpAddress(
     _In_ INT64 BufferSize
 )
 {
-    SOCKET HttpSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (HttpSocket == INVALID_SOCKET)
-    {
-        LOG_DEBUG("Failed to create HTTP socket: %d\n", WSAGetLastError());
-        return FALSE;
-    }
-
-    struct sockaddr_in ServerAddress;
-    memset(&ServerAddress, 0, sizeof(ServerAddress));
-    ServerAddress.sin_family = AF_INET;
-    ServerAddress.sin_port = htons(pDevice->Port);
-    inet_pton(AF_INET, pDevice->Host, &ServerAddress.sin_addr);
-
-    if (connect(HttpSocket, (struct sockaddr*)&ServerAddress, sizeof(ServerAddress)) == SOCKET_ERROR)
-    {
-        LOG_DEBUG("Failed to connect to device: %d\n", WSAGetLastError());
-        closesocket(HttpSocket);
-        return FALSE;
-    }
-
     CHAR Request[2048];
     snprintf(
         Request,
@@ -294,6 +322,7 @@ GetPublicIpAddress(
         "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
         "CONTENT-LENGTH: %d\r\n"
         "SOAPACTION: \"urn:schemas-upnp-org:service:WANIPConnection:1#GetExternalIPAddress\"\r\n"
+        "CONNECTION: close\r\n"
         "\r\n"
         "%s",
         pDevice->ControlUrl, pDevice->Host, pDevice->Port,
@@ -301,26 +330,12 @@ GetPublicIpAddress(
         SOAP_CONTENT_TEMPLATE
     );
 
-    INT BytesSent = send(HttpSocket, Request, (INT)strlen(Request), 0);
-    if (BytesSent == SOCKET_ERROR)
-    {
-        LOG_DEBUG("Failed to send HTTP request: %d\n", WSAGetLastError());
-        closesocket(HttpSocket);
-        return FALSE;
-    }
-
     CHAR Response[SSDP_MAX_RESPONSE_SIZE];
-    INT BytesReceived = recv(HttpSocket, Response, sizeof(Response) - 1, 0);
-    if (BytesReceived == SOCKET_ERROR)
+    if (!SsdpHttpExchange(pDevice, Request, Response, sizeof(Response)))
     {
-        LOG_DEBUG("Failed to receive HTTP response: %d\n", WSAGetLastError());
-        closesocket(HttpSocket);
         return FALSE;
     }
 
-    Response[BytesReceived] = '\0';
-    closesocket(HttpSocket);
-
     PSTR IpAddress = XmlGetValue(
         Response,
         "<NewExternalIPAddress>",
@@ -467,4 +482,581 @@ ParseUrl(
     strcpy_s(Path, SSDP_MAX_URL_SIZE, PathStart); // copy path
 
     return TRUE;
-}
\ No newline at end of file
+}
+
+//////////////////////////////////////////
+//
+//           LAN PEER DISCOVERY
+//
+//////////////////////////////////////////
+
+/**
+* Copies the value of an SSDP header, matching the name case insensitively.
+*
+* @return TRUE if the header is present, FALSE otherwise.
+*/
+static
+BOOL
+SsdpGetHeader(
+    _In_  PCSTR Message,
+    _In_  PCSTR Name,
+    _Out_ PSTR Value,
+    _In_  INT ValueSize
+)
+{
+    SIZE_T NameLength = strlen(Name);
+    PCSTR Line = strstr(Message, "\r\n"); // skip the request or status line
+
+    while (Line != NULL && Line[2] != '\0')
+    {
+        Line += 2;
+
+        if (_strnicmp(Line, Name, NameLength) == 0 && Line[NameLength] == ':')
+        {
+            PCSTR Start = Line + NameLength + 1;
+            while (*Start == ' ' || *Start == '\t')
+            {
+                Start++;
+            }
+
+            PCSTR End = Start;
+            while (*End != '\r' && *End != '\n' && *End != '\0')
+            {
+                End++;
+            }
+
+            INT Length = (INT)min(End - Start, ValueSize - 1);
+            memcpy(Value, Start, Length);
+            Value[Length] = '\0';
+            return TRUE;
+        }
+
+        Line = strstr(Line, "\r\n");
+    }
+
+    return FALSE;
+}
+
+/**
+* Sends an advertisement for this client, either a NOTIFY to the group or a search response.
+*/
+static
+VOID
+SsdpSendAdvertisement(
+    _In_ PSSDP_ADVERTISER pAdvertiser,
+    _In_ const struct sockaddr_in* pDestination,
+    _In_ BOOL IsResponse,
+    _In_ PCSTR NotificationSubType
+)
+{
+    CHAR Message[SSDP_MAX_RESPONSE_SIZE];
+    CHAR AddrStr[INET_ADDRSTRLEN];
+    INT Length;
+
+    inet_ntop(AF_INET, &pAdvertiser->Endpoint.sin_addr, AddrStr, INET_ADDRSTRLEN);
+
+    if (IsResponse)
+    {
+        Length = snprintf(
+            Message,
+            sizeof(Message),
+            SSDP_PEER_RESPONSE_TEMPLATE,
+            SSDP_PEER_MAX_AGE,
+            AddrStr,
+            ntohs(pAdvertiser->Endpoint.sin_port),
+            pAdvertiser->ClientId,
+            pAdvertiser->LanToken
+        );
+    }
+    else
+    {
+        Length = snprintf(
+            Message,
+            sizeof(Message),
+            SSDP_PEER_NOTIFY_TEMPLATE,
+            SSDP_PEER_MAX_AGE,
+            AddrStr,
+            ntohs(pAdvertiser->Endpoint.sin_port),
+            NotificationSubType,
+            pAdvertiser->ClientId,
+            pAdvertiser->LanToken
+        );
+    }
+
+    if (sendto(
+        pAdvertiser->UnicastSocket,
+        Message,
+        Length,
+        0,
+        (const struct sockaddr*)pDestination,
+        sizeof(*pDestination)
+    ) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to send SSDP advertisement: %d\n", WSAGetLastError());
+    }
+}
+
+/**
+* Adds or refreshes a table entry from an ssdp:alive NOTIFY or a search response.
+*/
+static
+VOID
+SsdpUpdateLanPeer(
+    _In_ PSSDP_ADVERTISER pAdvertiser,
+    _In_ PCSTR Message
+)
+{
+    CHAR Value[SSDP_MAX_URL_SIZE];
+    CHAR AddrStr[INET_ADDRSTRLEN] = { 0 };
+    LAN_PEER Peer;
+    UINT16 Port = 0;
+    UINT32 MaxAge = SSDP_PEER_MAX_AGE;
+
+    memset(&Peer, 0, sizeof(Peer));
+
+    if (!SsdpGetHeader(Message, "USN", Value, sizeof(Value)) ||
+        sscanf_s(Value, "uuid:p2pchat-%u", &Peer.ClientId) != 1 ||
+        Peer.ClientId == pAdvertiser->ClientId)
+    {
+        return; // malformed, or our own advertisement looped back
+    }
+
+    if (!SsdpGetHeader(Message, "LOCATION", Value, sizeof(Value)) ||
+        sscanf_s(Value, "p2pchat://%15[0-9.]:%hu", AddrStr, (UINT)sizeof(AddrStr), &Port) != 2 ||
+        inet_pton(AF_INET, AddrStr, &Peer.Endpoint.sin_addr) != 1)
+    {
+        return;
+    }
+
+    if (!SsdpGetHeader(Message, "X-P2PCHAT-TOKEN", Value, sizeof(Value)))
+    {
+        return;
+    }
+    Peer.LanToken = (UINT32)strtoul(Value, NULL, 10);
+
+    if (SsdpGetHeader(Message, "CACHE-CONTROL", Value, sizeof(Value)))
+    {
+        PCSTR Field = strstr(Value, "max-age=");
+        if (Field != NULL)
+        {
+            MaxAge = (UINT32)strtoul(Field + 8, NULL, 10);
+        }
+    }
+
+    Peer.Endpoint.sin_family = AF_INET;
+    Peer.Endpoint.sin_port = htons(Port);
+    Peer.ExpiryTime = GetTickCount64() + (ULONGLONG)MaxAge * 1000;
+
+    BOOL IsNew = TRUE;
+
+    EnterCriticalSection(&pAdvertiser->Lock);
+    for (INT i = 0; i < pAdvertiser->PeerCount; ++i)
+    {
+        if (pAdvertiser->Peers[i].ClientId == Peer.ClientId)
+        {
+            pAdvertiser->Peers[i] = Peer;
+            IsNew = FALSE;
+            break;
+        }
+    }
+
+    if (IsNew && pAdvertiser->PeerCount == SSDP_MAX_LAN_PEERS)
+    {
+        IsNew = FALSE; // table full, the peer can still be reached through the relay
+    }
+    else if (IsNew)
+    {
+        pAdvertiser->Peers[pAdvertiser->PeerCount++] = Peer;
+    }
+    LeaveCriticalSection(&pAdvertiser->Lock);
+
+    if (IsNew)
+    {
+        printf("\nLAN peer %u found at %s:%u\n", Peer.ClientId, AddrStr, Port);
+        LOG_EVENT_INFO("lan.peer.found", "peer=%u addr=%s port=%u max_age=%u", Peer.ClientId, AddrStr, Port, MaxAge);
+    }
+}
+
+/**
+* Removes a peer that announced ssdp:byebye.
+*/
+static
+VOID
+SsdpRemoveLanPeer(
+    _In_ PSSDP_ADVERTISER pAdvertiser,
+    _In_ PCSTR Message
+)
+{
+    CHAR Value[SSDP_MAX_URL_SIZE];
+    UINT32 ClientId;
+
+    if (!SsdpGetHeader(Message, "USN", Value, sizeof(Value)) ||
+        sscanf_s(Value, "uuid:p2pchat-%u", &ClientId) != 1)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&pAdvertiser->Lock);
+    for (INT i = 0; i < pAdvertiser->PeerCount; ++i)
+    {
+        if (pAdvertiser->Peers[i].ClientId == ClientId)
+        {
+            pAdvertiser->Peers[i] = pAdvertiser->Peers[--pAdvertiser->PeerCount];
+            LOG_INFO("LAN peer %u left\n", ClientId);
+            break;
+        }
+    }
+    LeaveCriticalSection(&pAdvertiser->Lock);
+}
+
+/**
+* Drops entries whose max-age has run out without a fresh advertisement.
+*/
+static
+VOID
+SsdpExpireLanPeers(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+)
+{
+    ULONGLONG Now = GetTickCount64();
+
+    EnterCriticalSection(&pAdvertiser->Lock);
+    for (INT i = 0; i < pAdvertiser->PeerCount; )
+    {
+        if (pAdvertiser->Peers[i].ExpiryTime <= Now)
+        {
+            LOG_INFO("LAN peer %u expired\n", pAdvertiser->Peers[i].ClientId);
+            pAdvertiser->Peers[i] = pAdvertiser->Peers[--pAdvertiser->PeerCount];
+            continue;
+        }
+        ++i;
+    }
+    LeaveCriticalSection(&pAdvertiser->Lock);
+}
+
+/**
+* Handles a single SSDP message from either socket.
+*/
+static
+VOID
+SsdpHandleMessage(
+    _In_ PSSDP_ADVERTISER pAdvertiser,
+    _In_ PCSTR Message,
+    _In_ const struct sockaddr_in* pFrom
+)
+{
+    CHAR Value[SSDP_MAX_URL_SIZE];
+
+    if (_strnicmp(Message, "NOTIFY", 6) == 0)
+    {
+        if (!SsdpGetHeader(Message, "NT", Value, sizeof(Value)) || strcmp(Value, SSDP_PEER_SERVICE) != 0)
+        {
+            return; // routers and media servers advertise on the same group
+        }
+
+        if (!SsdpGetHeader(Message, "NTS", Value, sizeof(Value)))
+        {
+            return;
+        }
+
+        if (_stricmp(Value, "ssdp:alive") == 0)
+        {
+            SsdpUpdateLanPeer(pAdvertiser, Message);
+        }
+        else if (_stricmp(Value, "ssdp:byebye") == 0)
+        {
+            SsdpRemoveLanPeer(pAdvertiser, Message);
+        }
+    }
+    else if (_strnicmp(Message, "M-SEARCH", 8) == 0)
+    {
+        if (SsdpGetHeader(Message, "ST", Value, sizeof(Value)) &&
+            (strcmp(Value, SSDP_PEER_SERVICE) == 0 || strcmp(Value, "ssdp:all") == 0))
+        {
+            SsdpSendAdvertisement(pAdvertiser, pFrom, TRUE, NULL);
+        }
+    }
+    else if (_strnicmp(Message, "HTTP/1.1 200", 12) == 0)
+    {
+        if (SsdpGetHeader(Message, "ST", Value, sizeof(Value)) && strcmp(Value, SSDP_PEER_SERVICE) == 0)
+        {
+            SsdpUpdateLanPeer(pAdvertiser, Message);
+        }
+    }
+}
+
+static
+DWORD
+WINAPI
+SsdpAdvertiserThread(
+    _In_ LPVOID lpData
+)
+{
+    PSSDP_ADVERTISER pAdvertiser = (PSSDP_ADVERTISER)lpData;
+    CHAR Message[SSDP_MAX_RESPONSE_SIZE];
+
+    PNET_POLLER Poller = NetPollerCreate();
+    if (Poller == NULL ||
+        !NetPollerAdd(Poller, pAdvertiser->MulticastSocket, NET_POLL_READ, NULL) ||
+        !NetPollerAdd(Poller, pAdvertiser->UnicastSocket, NET_POLL_READ, NULL))
+    {
+        LOG_DEBUG("Failed to set up the SSDP advertiser poller: %d\n", WSAGetLastError());
+        if (Poller != NULL)
+        {
+            NetPollerDestroy(Poller);
+        }
+        return 1;
+    }
+
+    struct sockaddr_in MulticastAddress;
+    memset(&MulticastAddress, 0, sizeof(MulticastAddress));
+    MulticastAddress.sin_family = AF_INET;
+    MulticastAddress.sin_port = htons(SSDP_PORT);
+    inet_pton(AF_INET, SSDP_MULTICAST, &MulticastAddress.sin_addr);
+
+    // announce ourselves, then ask everyone already running to do the same
+    SsdpSendAdvertisement(pAdvertiser, &MulticastAddress, FALSE, "ssdp:alive");
+    sendto(
+        pAdvertiser->UnicastSocket,
+        SSDP_PEER_MSEARCH,
+        (INT)strlen(SSDP_PEER_MSEARCH),
+        0,
+        (struct sockaddr*)&MulticastAddress,
+        sizeof(MulticastAddress)
+    );
+
+    ULONGLONG NextNotify = GetTickCount64() + SSDP_PEER_NOTIFY_INTERVAL * 1000ULL;
+
+    while (pAdvertiser->Running)
+    {
+        NET_POLL_EVENT Events[2];
+        INT Ready = NetPollerWait(Poller, Events, ARRAYSIZE(Events), SSDP_PEER_POLL_INTERVAL);
+
+        for (INT i = 0; i < Ready; ++i)
+        {
+            struct sockaddr_in From;
+            socklen_t FromSize = sizeof(From);
+
+            INT BytesReceived = recvfrom(Events[i].Socket, Message, sizeof(Message) - 1, 0, (struct sockaddr*)&From, &FromSize);
+            if (BytesReceived > 0)
+            {
+                Message[BytesReceived] = '\0';
+                SsdpHandleMessage(pAdvertiser, Message, &From);
+            }
+        }
+
+        if (GetTickCount64() >= NextNotify)
+        {
+            SsdpSendAdvertisement(pAdvertiser, &MulticastAddress, FALSE, "ssdp:alive");
+            NextNotify += SSDP_PEER_NOTIFY_INTERVAL * 1000ULL;
+        }
+
+        SsdpExpireLanPeers(pAdvertiser);
+    }
+
+    SsdpSendAdvertisement(pAdvertiser, &MulticastAddress, FALSE, "ssdp:byebye");
+    NetPollerDestroy(Poller);
+    return 0;
+}
+
+/**
+* Creates the multicast listener on the SSDP port and the unicast socket used for sending.
+*
+* @return TRUE if both sockets are ready, FALSE otherwise. The caller closes them either way.
+*/
+static
+BOOL
+SsdpOpenAdvertiserSockets(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+)
+{
+    pAdvertiser->MulticastSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    pAdvertiser->UnicastSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (pAdvertiser->MulticastSocket == INVALID_SOCKET || pAdvertiser->UnicastSocket == INVALID_SOCKET)
+    {
+        LOG_DEBUG("Failed to create SSDP advertiser sockets: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    // every client on the host listens on the SSDP port, and so may the system's own SSDP service
+    BOOL ReuseAddr = TRUE;
+    if (setsockopt(pAdvertiser->MulticastSocket, SOL_SOCKET, SO_REUSEADDR, (PCSTR)&ReuseAddr, sizeof(ReuseAddr)) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to set socket option SO_REUSEADDR: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    struct sockaddr_in BindAddress;
+    memset(&BindAddress, 0, sizeof(BindAddress));
+    BindAddress.sin_family = AF_INET;
+    BindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    BindAddress.sin_port = htons(SSDP_PORT);
+
+    if (bind(pAdvertiser->MulticastSocket, (struct sockaddr*)&BindAddress, sizeof(BindAddress)) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to bind SSDP port: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    struct ip_mreq Membership;
+    inet_pton(AF_INET, SSDP_MULTICAST, &Membership.imr_multiaddr);
+    Membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(pAdvertiser->MulticastSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (PCSTR)&Membership, sizeof(Membership)) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to join SSDP multicast group: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    // loopback keeps several clients on one host visible to each other, TTL 2 is what UPnP recommends
+    DWORD MulticastLoop = TRUE;
+    DWORD MulticastTtl = 2;
+    setsockopt(pAdvertiser->UnicastSocket, IPPROTO_IP, IP_MULTICAST_LOOP, (PCSTR)&MulticastLoop, sizeof(MulticastLoop));
+    setsockopt(pAdvertiser->UnicastSocket, IPPROTO_IP, IP_MULTICAST_TTL, (PCSTR)&MulticastTtl, sizeof(MulticastTtl));
+
+    BindAddress.sin_port = 0;
+    if (bind(pAdvertiser->UnicastSocket, (struct sockaddr*)&BindAddress, sizeof(BindAddress)) == SOCKET_ERROR)
+    {
+        LOG_DEBUG("Failed to bind SSDP unicast socket: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+* Closes whichever advertiser sockets are open.
+*/
+static
+VOID
+SsdpCloseAdvertiserSockets(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+)
+{
+    if (pAdvertiser->MulticastSocket != INVALID_SOCKET)
+    {
+        closesocket(pAdvertiser->MulticastSocket);
+        pAdvertiser->MulticastSocket = INVALID_SOCKET;
+    }
+
+    if (pAdvertiser->UnicastSocket != INVALID_SOCKET)
+    {
+        closesocket(pAdvertiser->UnicastSocket);
+        pAdvertiser->UnicastSocket = INVALID_SOCKET;
+    }
+}
+
+BOOL
+SsdpStartAdvertiser(
+    _Out_ PSSDP_ADVERTISER pAdvertiser,
+    _In_  UINT32 ClientId,
+    _In_  const struct sockaddr_in* pEndpoint
+)
+{
+    memset(pAdvertiser, 0, sizeof(*pAdvertiser));
+    pAdvertiser->ClientId = ClientId;
+    pAdvertiser->Endpoint = *pEndpoint;
+    pAdvertiser->MulticastSocket = INVALID_SOCKET;
+    pAdvertiser->UnicastSocket = INVALID_SOCKET;
+    rand_s(&pAdvertiser->LanToken);
+
+    if (!SsdpOpenAdvertiserSockets(pAdvertiser))
+    {
+        SsdpCloseAdvertiserSockets(pAdvertiser);
+        return FALSE;
+    }
+
+    InitializeCriticalSection(&pAdvertiser->Lock);
+    pAdvertiser->Running = TRUE;
+
+    pAdvertiser->Thread = CreateThread(NULL, 0, SsdpAdvertiserThread, pAdvertiser, 0, NULL);
+    if (pAdvertiser->Thread == NULL)
+    {
+        LOG_DEBUG("Unable to create SSDP advertiser thread: %d\n", GetLastError());
+        pAdvertiser->Running = FALSE;
+        DeleteCriticalSection(&pAdvertiser->Lock);
+        SsdpCloseAdvertiserSockets(pAdvertiser);
+        return FALSE;
+    }
+
+    LOG_INFO("Advertising %s for client %u\n", SSDP_PEER_SERVICE, ClientId);
+    return TRUE;
+}
+
+BOOL
+SsdpFindLanPeer(
+    _In_  PSSDP_ADVERTISER pAdvertiser,
+    _In_  UINT32 ClientId,
+    _Out_ PLAN_PEER pPeer
+)
+{
+    BOOL IsFound = FALSE;
+
+    if (pAdvertiser == NULL || pAdvertiser->Thread == NULL)
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&pAdvertiser->Lock);
+    for (INT i = 0; i < pAdvertiser->PeerCount; ++i)
+    {
+        if (pAdvertiser->Peers[i].ClientId == ClientId && pAdvertiser->Peers[i].ExpiryTime > GetTickCount64())
+        {
+            *pPeer = pAdvertiser->Peers[i];
+            IsFound = TRUE;
+            break;
+        }
+    }
+    LeaveCriticalSection(&pAdvertiser->Lock);
+
+    return IsFound;
+}
+
+VOID
+SsdpPrintLanPeers(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+)
+{
+    if (pAdvertiser->Thread == NULL)
+    {
+        printf("LAN discovery is not running\n");
+        return;
+    }
+
+    EnterCriticalSection(&pAdvertiser->Lock);
+    printf("%d peer(s) on the LAN\n", pAdvertiser->PeerCount);
+    for (INT i = 0; i < pAdvertiser->PeerCount; ++i)
+    {
+        CHAR AddrStr[INET_ADDRSTRLEN];
+        PLAN_PEER pPeer = &pAdvertiser->Peers[i];
+
+        inet_ntop(AF_INET, &pPeer->Endpoint.sin_addr, AddrStr, INET_ADDRSTRLEN);
+        printf(
+            "  %u at %s:%u, expires in %llu s\n",
+            pPeer->ClientId,
+            AddrStr,
+            ntohs(pPeer->Endpoint.sin_port),
+            (unsigned long long)((pPeer->ExpiryTime - min(pPeer->ExpiryTime, GetTickCount64())) / 1000)
+        );
+    }
+    LeaveCriticalSection(&pAdvertiser->Lock);
+}
+
+VOID
+SsdpStopAdvertiser(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+)
+{
+    if (pAdvertiser->Thread == NULL)
+    {
+        return; // never started
+    }
+
+    pAdvertiser->Running = FALSE;
+    WaitForSingleObject(pAdvertiser->Thread, SSDP_PEER_POLL_INTERVAL * 2);
+    CloseHandle(pAdvertiser->Thread);
+    pAdvertiser->Thread = NULL;
+
+    SsdpCloseAdvertiserSockets(pAdvertiser);
+    DeleteCriticalSection(&pAdvertiser->Lock);
+}
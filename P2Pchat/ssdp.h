@@ -1,3 +1,6 @@
+#ifndef SSDP_H
+#define SSDP_H
+
 #include "winnet.h"
 #include <malloc.h>
 
@@ -15,6 +18,12 @@
 #define SSDP_MAX_URL_SIZE 512
 #define SSDP_TIMEOUT 5000 // 5 secondss
 
+#define SSDP_PEER_SERVICE "urn:p2pchat-org:service:Chat:1"
+#define SSDP_PEER_MAX_AGE 120        // seconds an advertisement stays valid
+#define SSDP_PEER_NOTIFY_INTERVAL 30 // seconds between ssdp:alive, well inside max-age so one lost NOTIFY does no harm
+#define SSDP_PEER_POLL_INTERVAL 1000 // ms, how often the advertiser thread checks for expiry and shutdown
+#define SSDP_MAX_LAN_PEERS 32
+
 
 
 
@@ -81,4 +90,87 @@ BOOL ParseUrl(
     _Out_ PSTR Host,
     _Out_ PSTR Path,
     _Out_ PINT16 Port
-);
\ No newline at end of file
+);
+
+//////////////////////////////////////////
+//
+//           LAN PEER DISCOVERY
+//
+//////////////////////////////////////////
+
+/**
+* A P2Pchat client on the local network, learnt from its NOTIFY or search response.
+*/
+typedef struct _LAN_PEER
+{
+    UINT32             ClientId;
+    UINT32             LanToken;   // combined with ours to form the session token of a LAN connection
+    struct sockaddr_in Endpoint;   // the peer's UDP socket
+    ULONGLONG          ExpiryTime; // GetTickCount64 value after which the entry is dropped
+} LAN_PEER, *PLAN_PEER;
+
+/**
+* Advertises this client as a P2Pchat service and keeps a table of the others on the LAN.
+*
+* Trust on the LAN is implicit: anyone who sees both advertisements can compute the session token.
+*/
+typedef struct _SSDP_ADVERTISER
+{
+    SOCKET             MulticastSocket; // bound to SSDP_PORT and joined to the group, receives NOTIFY and M-SEARCH
+    SOCKET             UnicastSocket;   // ephemeral port, sends everything and receives search responses
+    UINT32             ClientId;
+    UINT32             LanToken;
+    struct sockaddr_in Endpoint;        // our UDP peer socket, advertised in LOCATION
+    HANDLE             Thread;
+    volatile LONG      Running;
+
+    CRITICAL_SECTION   Lock;            // guards the table
+    LAN_PEER           Peers[SSDP_MAX_LAN_PEERS];
+    INT                PeerCount;
+} SSDP_ADVERTISER, *PSSDP_ADVERTISER;
+
+/**
+* Starts advertising, searches for peers already on the LAN and keeps the table up to date.
+*
+* @param pAdvertiser Advertiser to start.
+* @param ClientId    Our id as assigned by the server.
+* @param pEndpoint   LAN address and port of our UDP peer socket.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+SsdpStartAdvertiser(
+    _Out_ PSSDP_ADVERTISER pAdvertiser,
+    _In_  UINT32 ClientId,
+    _In_  const struct sockaddr_in* pEndpoint
+);
+
+/**
+* Looks up a live LAN peer.
+*
+* @return TRUE if the peer is in the table and has not expired, FALSE otherwise.
+*/
+BOOL
+SsdpFindLanPeer(
+    _In_  PSSDP_ADVERTISER pAdvertiser,
+    _In_  UINT32 ClientId,
+    _Out_ PLAN_PEER pPeer
+);
+
+/**
+* Prints the live LAN peers.
+*/
+VOID
+SsdpPrintLanPeers(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+);
+
+/**
+* Sends ssdp:byebye and stops the advertiser thread.
+*/
+VOID
+SsdpStopAdvertiser(
+    _In_ PSSDP_ADVERTISER pAdvertiser
+);
+
+#endif // !SSDP_H
@@ -0,0 +1,904 @@
+#define _CRT_RAND_S // rand_s for transfer ids
+
+#include "transfer.h"
+#include "checksum.h"
+#include "logger.h"
+
+/**
+* A window of the file being sent, mapped read only.
+*/
+typedef struct _TRANSFER_VIEW
+{
+    const CHAR* Base;   // NULL while nothing is mapped
+    UINT64      Start;  // file offset of Base
+    ULONG       Length;
+} TRANSFER_VIEW, *PTRANSFER_VIEW;
+
+/**
+* What the .partid file beside a .part file holds, in host byte order since it never leaves the
+* machine.
+*/
+typedef struct _TRANSFER_IDENTITY
+{
+    UINT64 Size;
+    UINT64 WriteTime;   // FILETIME
+} TRANSFER_IDENTITY, *PTRANSFER_IDENTITY;
+
+//////////////////////////////////////////
+//
+//          INTERNAL HELPERS
+//
+//////////////////////////////////////////
+
+/**
+* Reads a 64 bit value sent as two UINT32 in network byte order.
+*/
+static
+UINT64
+TransferJoin(
+    _In_ UINT32 High,
+    _In_ UINT32 Low
+)
+{
+    return ((UINT64)ntohl(High) << 32) | ntohl(Low);
+}
+
+/**
+* Writes a 64 bit value as two UINT32 in network byte order.
+*/
+static
+VOID
+TransferSplit(
+    _In_  UINT64 Value,
+    _Out_ PUINT32 pHigh,
+    _Out_ PUINT32 pLow
+)
+{
+    *pHigh = htonl((UINT32)(Value >> 32));
+    *pLow = htonl((UINT32)Value);
+}
+
+/**
+* Tells whether a name from an offer is safe to create in the download directory: a plain file
+* name, no path, no device and nothing that is not printable.
+*/
+static
+BOOL
+TransferIsValidName(
+    _In_ const CHAR* Name,
+    _In_ ULONG Length
+)
+{
+    if (Length == 0 || Length > PROTOCOL_MAX_FILE_NAME)
+    {
+        return FALSE;
+    }
+
+    if ((Length == 1 && Name[0] == '.') || (Length == 2 && Name[0] == '.' && Name[1] == '.'))
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < Length; ++i)
+    {
+        if ((UINT8)Name[i] < 0x20 || Name[i] == '/' || Name[i] == '\\' || Name[i] == ':')
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+* Builds the path of a received file in the download directory.
+*
+* @param Extension TRANSFER_PART_EXTENSION while the file is incomplete, "" once it is.
+*
+* @return FALSE if the path does not fit.
+*/
+static
+BOOL
+TransferPath(
+    _In_  PTRANSFER_SESSION pSession,
+    _In_  PCSTR Extension,
+    _Out_ PSTR Buffer,
+    _In_  SIZE_T Size
+)
+{
+    INT Written = _snprintf_s(Buffer, Size, _TRUNCATE, "%s\\%s%s", pSession->Directory, pSession->ReceiveName, Extension);
+    return Written > 0;
+}
+
+/**
+* Sends a MESSAGE_TYPE_FILE_ACCEPT naming the offset the sender is to continue from.
+*/
+static
+VOID
+TransferSendAccept(
+    _In_ PTRANSFER_SESSION pSession,
+    _In_ UINT32 TransferId,
+    _In_ UINT64 Offset
+)
+{
+    FILE_ACCEPT_MESSAGE Accept;
+    Accept.TransferId = htonl(TransferId);
+    TransferSplit(Offset, &Accept.OffsetHigh, &Accept.OffsetLow);
+
+    if (NetMuxSend(pSession->Mux, STREAM_FILE_ANSWER, MESSAGE_TYPE_FILE_ACCEPT, &Accept, sizeof(Accept)) != NET_IO_COMPLETE)
+    {
+        LOG_WARN("Failed to answer transfer %08x: %d\n", TransferId, WSAGetLastError());
+    }
+}
+
+/**
+* Stops receiving the current file, what arrived so far stays in its .part file.
+*/
+static
+VOID
+TransferCloseReceive(
+    _Inout_ PTRANSFER_SESSION pSession
+)
+{
+    if (pSession->ReceiveFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(pSession->ReceiveFile);
+        pSession->ReceiveFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+//////////////////////////////////////////
+//
+//          SENDING
+//
+//////////////////////////////////////////
+
+/**
+* Waits until at most Keep bytes of the chunks queued on STREAM_FILE are still waiting or being sent.
+*
+* @param pLastProgress Tick count of the last progress, advanced whenever a chunk leaves.
+*
+* @return FALSE if the transfer was cancelled or stalled first.
+*/
+static
+BOOL
+TransferWaitBorrowed(
+    _In_    PTRANSFER_SESSION pSession,
+    _In_    ULONG Keep,
+    _Inout_ PULONGLONG pLastProgress
+)
+{
+    ULONG Borrowed = NetMuxBorrowed(pSession->Mux, STREAM_FILE);
+
+    while (Borrowed > Keep)
+    {
+        if (pSession->Cancelled || GetTickCount64() - *pLastProgress > TRANSFER_STALL_TIMEOUT)
+        {
+            return FALSE;
+        }
+
+        NetMuxWait(pSession->Mux, TRANSFER_WAIT_SLICE);
+
+        ULONG Now = NetMuxBorrowed(pSession->Mux, STREAM_FILE);
+        if (Now < Borrowed)
+        {
+            *pLastProgress = GetTickCount64();
+        }
+
+        Borrowed = Now;
+    }
+
+    return TRUE;
+}
+
+/**
+* Drops the chunks still queued and unmaps both windows once the chunks the writer already took
+* are out, the writer finishes or fails its send either way.
+*/
+static
+VOID
+TransferReleaseViews(
+    _In_    PTRANSFER_SESSION pSession,
+    _Inout_ PTRANSFER_VIEW Views
+)
+{
+    NetMuxDiscardBorrowed(pSession->Mux, STREAM_FILE);
+
+    while (NetMuxBorrowed(pSession->Mux, STREAM_FILE) != 0)
+    {
+        NetMuxWait(pSession->Mux, TRANSFER_WAIT_SLICE);
+    }
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        if (Views[i].Base != NULL)
+        {
+            UnmapViewOfFile(Views[i].Base);
+            Views[i].Base = NULL;
+        }
+    }
+}
+
+/**
+* Offers the file, then sends chunks from the offset the receiver answers with until it confirms
+* the whole file, going back whenever it asks for a chunk again.
+*/
+static
+DWORD
+WINAPI
+TransferSendThread(
+    _In_ LPVOID lpData
+)
+{
+    PTRANSFER_SESSION pSession = (PTRANSFER_SESSION)lpData;
+    TRANSFER_VIEW Views[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } }; // the window chunks come from, then the one before
+    ULONG QueuedFromCurrent = 0;       // bytes of the chunks queued from Views[0]
+    UINT64 Size = pSession->SendSize;
+    UINT64 Offset = 0;
+    UINT64 Sent = 0;                   // chunk bytes sent, those sent again included
+    BOOL HasOffset = FALSE;
+    BOOL Confirmed = FALSE;
+    PCSTR Outcome = "was cancelled";
+    HANDLE Mapping = NULL;
+    ULONGLONG Started = GetTickCount64();
+    ULONGLONG LastProgress = Started;
+
+    CHAR Offer[sizeof(FILE_OFFER_MESSAGE) + PROTOCOL_MAX_FILE_NAME];
+    PFILE_OFFER_MESSAGE pOffer = (PFILE_OFFER_MESSAGE)Offer;
+    UINT16 NameLength = (UINT16)strlen(pSession->SendName);
+
+    pOffer->TransferId = htonl(pSession->SendId);
+    pOffer->ChunkSize = htonl(PROTOCOL_FILE_CHUNK_SIZE);
+    TransferSplit(Size, &pOffer->SizeHigh, &pOffer->SizeLow);
+    TransferSplit(pSession->SendWriteTime, &pOffer->WriteTimeHigh, &pOffer->WriteTimeLow);
+    memcpy(Offer + sizeof(FILE_OFFER_MESSAGE), pSession->SendName, NameLength);
+
+    if (Size > 0)
+    {
+        Mapping = CreateFileMappingA(pSession->SendFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+
+    if (Size > 0 && Mapping == NULL)
+    {
+        Outcome = "failed, the file cannot be mapped";
+        pSession->Cancelled = TRUE;
+    }
+    else if (NetMuxSend(pSession->Mux, STREAM_FILE, MESSAGE_TYPE_FILE_OFFER, Offer, (UINT16)(sizeof(FILE_OFFER_MESSAGE) + NameLength)) != NET_IO_COMPLETE)
+    {
+        Outcome = "failed, the offer was not sent";
+        pSession->Cancelled = TRUE;
+    }
+
+    while (!pSession->Cancelled)
+    {
+        EnterCriticalSection(&pSession->Lock);
+        BOOL HasAnswer = pSession->HasAnswer;
+        UINT64 Answer = pSession->AnswerOffset;
+        pSession->HasAnswer = FALSE;
+        LeaveCriticalSection(&pSession->Lock);
+
+        if (HasAnswer)
+        {
+            LastProgress = GetTickCount64();
+
+            if (Answer == Size)
+            {
+                Confirmed = TRUE;
+                break;
+            }
+
+            if (Answer > Size || Answer % PROTOCOL_FILE_CHUNK_SIZE != 0)
+            {
+                Outcome = "was refused by the peer";
+                break;
+            }
+
+            if (!HasOffset)
+            {
+                if (Answer != 0)
+                {
+                    printf("\nPeer has %llu bytes of '%s' already, resuming\n", (unsigned long long)Answer, pSession->SendName);
+                }
+
+                HasOffset = TRUE;
+                Offset = Answer;
+            }
+            else if (Answer != Offset)
+            {
+                // a chunk failed its check, the receiver drops everything after it anyway
+                LOG_INFO("Peer asked for '%s' again from %llu\n", pSession->SendName, (unsigned long long)Answer);
+                TransferReleaseViews(pSession, Views);
+                QueuedFromCurrent = 0;
+                Offset = Answer;
+            }
+        }
+
+        if (!HasOffset || Offset >= Size)
+        {
+            // waiting for the receiver to accept, or to confirm it has everything
+            if (GetTickCount64() - LastProgress > TRANSFER_STALL_TIMEOUT)
+            {
+                Outcome = "stalled, the peer did not answer";
+                break;
+            }
+
+            WaitForSingleObject(pSession->Answered, TRANSFER_WAIT_SLICE);
+            continue;
+        }
+
+        if (Views[0].Base == NULL || Offset < Views[0].Start || Offset >= Views[0].Start + Views[0].Length)
+        {
+            // the window before goes once its last chunk left, the current one takes its place
+            if (!TransferWaitBorrowed(pSession, QueuedFromCurrent, &LastProgress))
+            {
+                Outcome = pSession->Cancelled ? "was cancelled" : "stalled, the peer stopped reading";
+                break;
+            }
+
+            if (Views[1].Base != NULL)
+            {
+                UnmapViewOfFile(Views[1].Base);
+            }
+
+            Views[1] = Views[0];
+            Views[0].Start = Offset - Offset % TRANSFER_MAP_WINDOW;
+            Views[0].Length = (ULONG)min((UINT64)TRANSFER_MAP_WINDOW, Size - Views[0].Start);
+            Views[0].Base = (const CHAR*)MapViewOfFile(Mapping, FILE_MAP_READ, (DWORD)(Views[0].Start >> 32), (DWORD)Views[0].Start, Views[0].Length);
+            QueuedFromCurrent = 0;
+
+            if (Views[0].Base == NULL)
+            {
+                Outcome = "failed, the file cannot be mapped";
+                break;
+            }
+        }
+
+        const CHAR* Chunk = Views[0].Base + (Offset - Views[0].Start);
+        UINT16 ChunkLength = (UINT16)min((UINT64)PROTOCOL_FILE_CHUNK_SIZE, Size - Offset);
+
+        FILE_DATA_HEADER Header;
+        Header.TransferId = htonl(pSession->SendId);
+        TransferSplit(Offset, &Header.OffsetHigh, &Header.OffsetLow);
+        Header.Checksum = htonl(ChecksumCrc32c(0, Chunk, ChunkLength));
+
+        // the chunk goes from the mapping into the send, only the header is copied
+        NET_IO_STATUS Status;
+        while ((Status = NetMuxSendBorrowed(pSession->Mux, STREAM_FILE, MESSAGE_TYPE_FILE_DATA, &Header, sizeof(Header), Chunk, ChunkLength)) == NET_IO_PENDING &&
+               !pSession->Cancelled &&
+               GetTickCount64() - LastProgress <= TRANSFER_STALL_TIMEOUT)
+        {
+            NetMuxWait(pSession->Mux, TRANSFER_WAIT_SLICE);
+        }
+
+        if (Status != NET_IO_COMPLETE)
+        {
+            Outcome = (Status == NET_IO_FAILED) ? "failed, the connection was lost" :
+                      pSession->Cancelled ? "was cancelled" : "stalled, the peer stopped reading";
+            break;
+        }
+
+        LastProgress = GetTickCount64();
+        QueuedFromCurrent += sizeof(Header) + ChunkLength;
+        Offset += ChunkLength;
+        Sent += ChunkLength;
+    }
+
+    TransferReleaseViews(pSession, Views);
+
+    if (Mapping != NULL)
+    {
+        CloseHandle(Mapping);
+    }
+
+    CloseHandle(pSession->SendFile);
+    pSession->SendFile = INVALID_HANDLE_VALUE;
+
+    if (Confirmed)
+    {
+        double Seconds = max((double)(GetTickCount64() - Started), 1.0) / 1000.0;
+        printf("\nSent '%s', %.1f MB in %.1f s, %.1f MB/s\n", pSession->SendName, Sent / 1e6, Seconds, Sent / 1e6 / Seconds);
+    }
+    else
+    {
+        printf("\nSending '%s' %s\n", pSession->SendName, Outcome);
+    }
+
+    pSession->Confirmed = Confirmed;
+    InterlockedExchange(&pSession->Sending, FALSE);
+    return 0;
+}
+
+//////////////////////////////////////////
+//
+//          RECEIVING
+//
+//////////////////////////////////////////
+
+/**
+* Reads the identity of the file the .part file was received from.
+*
+* @return FALSE if there is none, as for a .part file left by an older client.
+*/
+static
+BOOL
+TransferReadIdentity(
+    _In_  PTRANSFER_SESSION pSession,
+    _Out_ PTRANSFER_IDENTITY pIdentity
+)
+{
+    CHAR Path[MAX_PATH];
+    FILE* File = NULL;
+
+    if (!TransferPath(pSession, TRANSFER_IDENTITY_EXTENSION, Path, sizeof(Path)) || fopen_s(&File, Path, "rb") != 0)
+    {
+        return FALSE;
+    }
+
+    BOOL Read = fread(pIdentity, sizeof(*pIdentity), 1, File) == 1;
+    fclose(File);
+    return Read;
+}
+
+/**
+* Records the identity of the file being received beside its .part file.
+*/
+static
+BOOL
+TransferWriteIdentity(
+    _In_ PTRANSFER_SESSION pSession,
+    _In_ const TRANSFER_IDENTITY* pIdentity
+)
+{
+    CHAR Path[MAX_PATH];
+    FILE* File = NULL;
+
+    if (!TransferPath(pSession, TRANSFER_IDENTITY_EXTENSION, Path, sizeof(Path)) || fopen_s(&File, Path, "wb") != 0)
+    {
+        return FALSE;
+    }
+
+    BOOL Written = fwrite(pIdentity, sizeof(*pIdentity), 1, File) == 1;
+    return (fclose(File) == 0) && Written;
+}
+
+/**
+* Renames a completely received file and confirms it to the sender.
+*/
+static
+VOID
+TransferCompleteReceive(
+    _Inout_ PTRANSFER_SESSION pSession
+)
+{
+    CHAR PartPath[MAX_PATH];
+    CHAR IdentityPath[MAX_PATH];
+    CHAR Path[MAX_PATH];
+
+    TransferCloseReceive(pSession);
+
+    if (TransferPath(pSession, TRANSFER_IDENTITY_EXTENSION, IdentityPath, sizeof(IdentityPath)))
+    {
+        DeleteFileA(IdentityPath);
+    }
+
+    if (!TransferPath(pSession, TRANSFER_PART_EXTENSION, PartPath, sizeof(PartPath)) ||
+        !TransferPath(pSession, "", Path, sizeof(Path)) ||
+        !MoveFileExA(PartPath, Path, MOVEFILE_REPLACE_EXISTING))
+    {
+        printf("\nReceived '%s' but could not rename it: %d\n", pSession->ReceiveName, GetLastError());
+        TransferSendAccept(pSession, pSession->ReceiveId, ~0ULL);
+        return;
+    }
+
+    UINT64 Received = pSession->ReceiveSize - pSession->ReceiveStart;
+    double Seconds = max((double)(GetTickCount64() - pSession->ReceiveStartTime), 1.0) / 1000.0;
+
+    printf("\nReceived '%s' into %s, %.1f MB in %.1f s, %.1f MB/s\n", pSession->ReceiveName, Path, Received / 1e6, Seconds, Received / 1e6 / Seconds);
+    TransferSendAccept(pSession, pSession->ReceiveId, pSession->ReceiveSize);
+    InterlockedIncrement(&pSession->Completed);
+}
+
+/**
+* Opens the .part file for an offered file and accepts it from the end of its last whole chunk,
+* or refuses it with an offset past its end if it cannot be written.
+*/
+static
+VOID
+TransferReceiveOffer(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    const CHAR* Payload,
+    _In_    UINT16 Length
+)
+{
+    FILE_OFFER_MESSAGE Offer;
+
+    if (Length < sizeof(Offer))
+    {
+        return;
+    }
+
+    memcpy(&Offer, Payload, sizeof(Offer));
+
+    UINT32 TransferId = ntohl(Offer.TransferId);
+    UINT32 ChunkSize = ntohl(Offer.ChunkSize);
+    const CHAR* Name = Payload + sizeof(Offer);
+    ULONG NameLength = Length - sizeof(Offer);
+
+    if (!TransferIsValidName(Name, NameLength) || ChunkSize == 0 || ChunkSize > PROTOCOL_FILE_CHUNK_SIZE)
+    {
+        LOG_WARN("Refusing malformed file offer %08x\n", TransferId);
+        TransferSendAccept(pSession, TransferId, ~0ULL);
+        return;
+    }
+
+    // a new offer replaces the file being received, which can be resumed later
+    TransferCloseReceive(pSession);
+
+    memcpy(pSession->ReceiveName, Name, NameLength);
+    pSession->ReceiveName[NameLength] = '\0';
+    pSession->ReceiveId = TransferId;
+    pSession->ReceiveChunkSize = ChunkSize;
+    pSession->ReceiveSize = TransferJoin(Offer.SizeHigh, Offer.SizeLow);
+    pSession->ReceiveWriteTime = TransferJoin(Offer.WriteTimeHigh, Offer.WriteTimeLow);
+    pSession->ReceiveStartTime = GetTickCount64();
+
+    if (GetFileAttributesA(pSession->Directory) == INVALID_FILE_ATTRIBUTES)
+    {
+        CreateDirectoryA(pSession->Directory, NULL);
+    }
+
+    CHAR PartPath[MAX_PATH];
+    LARGE_INTEGER Existing = { 0 };
+    LARGE_INTEGER Position;
+
+    if (TransferPath(pSession, TRANSFER_PART_EXTENSION, PartPath, sizeof(PartPath)))
+    {
+        pSession->ReceiveFile = CreateFileA(PartPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+
+    if (pSession->ReceiveFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(pSession->ReceiveFile, &Existing))
+    {
+        printf("\nCannot receive '%s' into %s: %d\n", pSession->ReceiveName, pSession->Directory, GetLastError());
+        TransferCloseReceive(pSession);
+        TransferSendAccept(pSession, TransferId, ~0ULL);
+        return;
+    }
+
+    // a .part file left by another file of this name, or by this one before it changed, starts
+    // again, and of the same file only whole chunks count, one cut short when the last transfer
+    // stopped comes again
+    TRANSFER_IDENTITY Identity = { pSession->ReceiveSize, pSession->ReceiveWriteTime };
+    TRANSFER_IDENTITY Stored;
+    BOOL SameFile = TransferReadIdentity(pSession, &Stored) && Stored.Size == Identity.Size && Stored.WriteTime == Identity.WriteTime;
+
+    UINT64 Offset = (UINT64)Existing.QuadPart;
+    Offset = (!SameFile || Offset > pSession->ReceiveSize) ? 0 : Offset - Offset % ChunkSize;
+
+    Position.QuadPart = (LONGLONG)Offset;
+    if (!SetFilePointerEx(pSession->ReceiveFile, Position, NULL, FILE_BEGIN) || !SetEndOfFile(pSession->ReceiveFile))
+    {
+        printf("\nCannot resume '%s': %d\n", pSession->ReceiveName, GetLastError());
+        TransferCloseReceive(pSession);
+        TransferSendAccept(pSession, TransferId, ~0ULL);
+        return;
+    }
+
+    // written once the .part file is empty, so it never vouches for another file's bytes
+    if (!SameFile && !TransferWriteIdentity(pSession, &Identity))
+    {
+        LOG_WARN("Cannot record the identity of '%s', an interrupted transfer starts again\n", pSession->ReceiveName);
+    }
+
+    pSession->ReceiveOffset = Offset;
+    pSession->ReceiveStart = Offset;
+
+    if (Offset != 0)
+    {
+        printf("\nReceiving '%s' (%.1f MB) from peer, resuming at %.1f MB\n", pSession->ReceiveName, pSession->ReceiveSize / 1e6, Offset / 1e6);
+    }
+    else
+    {
+        printf("\nReceiving '%s' (%.1f MB) from peer\n", pSession->ReceiveName, pSession->ReceiveSize / 1e6);
+    }
+
+    if (Offset == pSession->ReceiveSize)
+    {
+        TransferCompleteReceive(pSession);
+        return;
+    }
+
+    TransferSendAccept(pSession, TransferId, Offset);
+}
+
+/**
+* Writes a chunk to the .part file if it is the next one and its checksum holds, otherwise asks
+* for it again. Chunks after a bad one were sent before the sender went back and are dropped.
+*/
+static
+VOID
+TransferReceiveData(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    const CHAR* Payload,
+    _In_    UINT16 Length
+)
+{
+    FILE_DATA_HEADER Header;
+
+    if (pSession->ReceiveFile == INVALID_HANDLE_VALUE || Length < sizeof(Header))
+    {
+        return;
+    }
+
+    memcpy(&Header, Payload, sizeof(Header));
+
+    UINT64 Offset = TransferJoin(Header.OffsetHigh, Header.OffsetLow);
+    const CHAR* Chunk = Payload + sizeof(Header);
+    ULONG ChunkLength = Length - sizeof(Header);
+
+    if (ntohl(Header.TransferId) != pSession->ReceiveId || Offset != pSession->ReceiveOffset)
+    {
+        return;
+    }
+
+    if (ChunkLength == 0 ||
+        ChunkLength > pSession->ReceiveSize - Offset ||
+        (ChunkLength != pSession->ReceiveChunkSize && Offset + ChunkLength != pSession->ReceiveSize))
+    {
+        printf("\nPeer sent a malformed chunk of '%s', giving up\n", pSession->ReceiveName);
+        TransferCloseReceive(pSession);
+        TransferSendAccept(pSession, pSession->ReceiveId, ~0ULL);
+        return;
+    }
+
+    if (ChecksumCrc32c(0, Chunk, ChunkLength) != ntohl(Header.Checksum))
+    {
+        LOG_WARN("Chunk of '%s' at %llu failed its checksum, asking again\n", pSession->ReceiveName, (unsigned long long)Offset);
+        TransferSendAccept(pSession, pSession->ReceiveId, Offset);
+        return;
+    }
+
+    // straight from the receive buffer to the file
+    DWORD Written;
+    if (!WriteFile(pSession->ReceiveFile, Chunk, ChunkLength, &Written, NULL) || Written != ChunkLength)
+    {
+        printf("\nWriting '%s' failed: %d\n", pSession->ReceiveName, GetLastError());
+        TransferCloseReceive(pSession);
+        TransferSendAccept(pSession, pSession->ReceiveId, ~0ULL);
+        return;
+    }
+
+    pSession->ReceiveOffset += ChunkLength;
+
+    if (pSession->ReceiveOffset == pSession->ReceiveSize)
+    {
+        TransferCompleteReceive(pSession);
+    }
+}
+
+/**
+* Hands the receiver's answer to the send thread.
+*/
+static
+VOID
+TransferReceiveAccept(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    const CHAR* Payload,
+    _In_    UINT16 Length
+)
+{
+    FILE_ACCEPT_MESSAGE Accept;
+
+    if (Length != sizeof(Accept))
+    {
+        return;
+    }
+
+    memcpy(&Accept, Payload, sizeof(Accept));
+
+    EnterCriticalSection(&pSession->Lock);
+
+    BOOL Current = pSession->Sending && ntohl(Accept.TransferId) == pSession->SendId;
+    if (Current)
+    {
+        pSession->AnswerOffset = TransferJoin(Accept.OffsetHigh, Accept.OffsetLow);
+        pSession->HasAnswer = TRUE;
+    }
+
+    LeaveCriticalSection(&pSession->Lock);
+
+    if (Current)
+    {
+        SetEvent(pSession->Answered);
+    }
+}
+
+//////////////////////////////////////////
+//
+//          PUBLIC
+//
+//////////////////////////////////////////
+
+BOOL
+TransferInitialise(
+    _Out_ PTRANSFER_SESSION pSession,
+    _In_  PNET_MUX Mux,
+    _In_  PCSTR Directory
+)
+{
+    ZeroMemory(pSession, sizeof(*pSession));
+    pSession->Mux = Mux;
+    pSession->Directory = Directory;
+    pSession->SendFile = INVALID_HANDLE_VALUE;
+    pSession->ReceiveFile = INVALID_HANDLE_VALUE;
+
+    pSession->Answered = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (pSession->Answered == NULL)
+    {
+        return FALSE;
+    }
+
+    InitializeCriticalSection(&pSession->Lock);
+    return TRUE;
+}
+
+VOID
+TransferCleanUp(
+    _Inout_ PTRANSFER_SESSION pSession
+)
+{
+    if (pSession->Answered == NULL)
+    {
+        return;
+    }
+
+    InterlockedExchange(&pSession->Cancelled, TRUE);
+    SetEvent(pSession->Answered);
+
+    if (pSession->SendThread != NULL)
+    {
+        WaitForSingleObject(pSession->SendThread, INFINITE);
+        CloseHandle(pSession->SendThread);
+        pSession->SendThread = NULL;
+    }
+
+    TransferCloseReceive(pSession);
+
+    CloseHandle(pSession->Answered);
+    pSession->Answered = NULL;
+    DeleteCriticalSection(&pSession->Lock);
+}
+
+BOOL
+TransferSendFile(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    PCSTR Path
+)
+{
+    if (pSession->Sending)
+    {
+        printf("Still sending '%s'\n", pSession->SendName);
+        return FALSE;
+    }
+
+    if (pSession->SendThread != NULL)
+    {
+        WaitForSingleObject(pSession->SendThread, INFINITE);
+        CloseHandle(pSession->SendThread);
+        pSession->SendThread = NULL;
+    }
+
+    PCSTR Name = Path;
+    for (PCSTR Cursor = Path; *Cursor != '\0'; ++Cursor)
+    {
+        if (*Cursor == '/' || *Cursor == '\\')
+        {
+            Name = Cursor + 1;
+        }
+    }
+
+    if (!TransferIsValidName(Name, (ULONG)strlen(Name)))
+    {
+        printf("'%s' does not name a file that can be sent\n", Path);
+        return FALSE;
+    }
+
+    HANDLE File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER Size;
+    FILETIME WriteTime;
+
+    if (File == INVALID_HANDLE_VALUE || !GetFileSizeEx(File, &Size) || !GetFileTime(File, NULL, NULL, &WriteTime))
+    {
+        printf("Cannot open '%s': %d\n", Path, GetLastError());
+        if (File != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(File);
+        }
+        return FALSE;
+    }
+
+    UINT TransferId = 0;
+    rand_s(&TransferId);
+
+    strcpy_s(pSession->SendName, sizeof(pSession->SendName), Name);
+    pSession->SendFile = File;
+    pSession->SendSize = (UINT64)Size.QuadPart;
+    pSession->SendWriteTime = ((UINT64)WriteTime.dwHighDateTime << 32) | WriteTime.dwLowDateTime;
+    pSession->SendId = TransferId;
+    pSession->HasAnswer = FALSE;
+    pSession->Confirmed = FALSE;
+    pSession->Cancelled = FALSE;
+    pSession->Sending = TRUE;
+    ResetEvent(pSession->Answered);
+
+    pSession->SendThread = CreateThread(NULL, 0, TransferSendThread, pSession, 0, NULL);
+    if (pSession->SendThread == NULL)
+    {
+        printf("Unable to create transfer thread: %d\n", GetLastError());
+        pSession->Sending = FALSE;
+        pSession->SendFile = INVALID_HANDLE_VALUE;
+        CloseHandle(File);
+        return FALSE;
+    }
+
+    printf("Offering '%s' (%.1f MB) to the peer\n", Name, pSession->SendSize / 1e6);
+    return TRUE;
+}
+
+BOOL
+TransferWaitSent(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    DWORD Milliseconds
+)
+{
+    if (pSession->SendThread != NULL && WaitForSingleObject(pSession->SendThread, Milliseconds) != WAIT_OBJECT_0)
+    {
+        return FALSE;
+    }
+
+    return !pSession->Sending && pSession->Confirmed;
+}
+
+VOID
+TransferHandleFrame(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    UINT16 Type,
+    _In_    const CHAR* Payload,
+    _In_    UINT16 Length
+)
+{
+    switch (Type)
+    {
+    case MESSAGE_TYPE_FILE_OFFER:
+        TransferReceiveOffer(pSession, Payload, Length);
+        break;
+
+    case MESSAGE_TYPE_FILE_ACCEPT:
+        TransferReceiveAccept(pSession, Payload, Length);
+        break;
+
+    case MESSAGE_TYPE_FILE_DATA:
+        TransferReceiveData(pSession, Payload, Length);
+        break;
+
+    default:
+        break;
+    }
+}
+
+VOID
+TransferPeerUnavailable(
+    _Inout_ PTRANSFER_SESSION pSession
+)
+{
+    if (pSession->Sending)
+    {
+        InterlockedExchange(&pSession->Cancelled, TRUE);
+        SetEvent(pSession->Answered);
+    }
+
+    if (pSession->ReceiveFile != INVALID_HANDLE_VALUE)
+    {
+        printf("\nReceiving '%s' stopped at %.1f MB, it resumes when offered again\n", pSession->ReceiveName, pSession->ReceiveOffset / 1e6);
+        TransferCloseReceive(pSession);
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "netmux.h"
+
+/**
+    * File transfers with the paired peer over the relay, one outgoing and one incoming at a time.
+    *
+    * The sender maps the file TRANSFER_MAP_WINDOW bytes at a time and queues every chunk on
+    * STREAM_FILE borrowing it from the mapping, so the file is never read into a buffer: the
+    * vectored send copies it from the page cache into the socket. Two windows are mapped at once,
+    * the next one is queued while the frames of the previous one are still going out, and a window
+    * is unmapped once NetMuxBorrowed shows its last frame left.
+    *
+    * The receiver checks the CRC-32C of every chunk and writes it to "<name>.part" in its download
+    * directory from where it lies in the receive buffer, then renames the file once it is complete.
+    * Beside it "<name>.partid" keeps the size and last write time of the file the .part file was
+    * received from. An offer of a file whose .part file is still there resumes after its last whole
+    * chunk when both match the offer, and starts again from 0 when the file changed since.
+    *
+    * Memory stays flat whatever the size of the file: the sender holds two mapped windows of page
+    * cache, the relay at most one flow control window per direction and the receiver one receive
+    * chunk.
+*/
+
+#define TRANSFER_MAP_WINDOW ( 8 * 1024 * 1024 ) // bytes of the file mapped at once, a multiple of the chunk size and of the allocation granularity
+#define TRANSFER_STALL_TIMEOUT 30000           // milliseconds without progress before a transfer is given up
+#define TRANSFER_WAIT_SLICE 100                // milliseconds the send thread waits at a time, so it notices cancellation
+#define TRANSFER_PART_EXTENSION ".part"
+#define TRANSFER_IDENTITY_EXTENSION ".partid"
+
+typedef struct _TRANSFER_SESSION
+{
+    PNET_MUX         Mux;
+    PCSTR            Directory;          // received files are written here
+
+    // outgoing, Lock guards what the receive thread hands over to the send thread
+    CRITICAL_SECTION Lock;
+    HANDLE           SendThread;
+    HANDLE           Answered;           // auto reset, set when the receiver names an offset
+    volatile LONG    Sending;            // SendThread has not finished
+    volatile LONG    Cancelled;
+    BOOL             Confirmed;          // the receiver confirmed the last file sent
+    UINT32           SendId;
+    BOOL             HasAnswer;
+    UINT64           AnswerOffset;
+    HANDLE           SendFile;
+    UINT64           SendSize;
+    UINT64           SendWriteTime;      // FILETIME
+    CHAR             SendName[PROTOCOL_MAX_FILE_NAME + 1];
+
+    // incoming, touched only by the thread reading the connection
+    HANDLE           ReceiveFile;        // the .part file, INVALID_HANDLE_VALUE while nothing is received
+    UINT32           ReceiveId;
+    UINT32           ReceiveChunkSize;
+    UINT64           ReceiveSize;
+    UINT64           ReceiveWriteTime;   // FILETIME of the file on the sender
+    UINT64           ReceiveOffset;      // where the next chunk has to start
+    UINT64           ReceiveStart;       // where this transfer resumed
+    ULONGLONG        ReceiveStartTime;
+    CHAR             ReceiveName[PROTOCOL_MAX_FILE_NAME + 1];
+    volatile LONG    Completed;          // files received completely
+} TRANSFER_SESSION, *PTRANSFER_SESSION;
+
+/**
+* Prepares a session sending and receiving on the file streams of a connection.
+*
+* @param pSession  Session to prepare.
+* @param Mux       Connection to the relay, paired with a peer before a transfer starts.
+* @param Directory Directory received files are written to, created on the first offer.
+*
+* @return TRUE if the session is ready, FALSE otherwise.
+*/
+BOOL
+TransferInitialise(
+    _Out_ PTRANSFER_SESSION pSession,
+    _In_  PNET_MUX Mux,
+    _In_  PCSTR Directory
+);
+
+/**
+* Cancels the outgoing transfer and waits for its thread. An incoming file stays as its .part
+* file, the next offer of it resumes.
+*/
+VOID
+TransferCleanUp(
+    _Inout_ PTRANSFER_SESSION pSession
+);
+
+/**
+* Offers a file to the peer and sends it from a thread of its own once the peer accepts.
+*
+* @param Path File to send, the peer sees only its name.
+*
+* @return TRUE if the transfer started, FALSE if one is already running or the file cannot be
+*         opened.
+*/
+BOOL
+TransferSendFile(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    PCSTR Path
+);
+
+/**
+* Waits for the outgoing transfer to end.
+*
+* @return TRUE if the peer confirmed it received the whole file.
+*/
+BOOL
+TransferWaitSent(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    DWORD Milliseconds
+);
+
+/**
+* Handles a MESSAGE_TYPE_FILE_* frame from the peer, called by the thread reading the connection
+* with the payload where it was received.
+*/
+VOID
+TransferHandleFrame(
+    _Inout_ PTRANSFER_SESSION pSession,
+    _In_    UINT16 Type,
+    _In_    const CHAR* Payload,
+    _In_    UINT16 Length
+);
+
+/**
+* The relay no longer has the peer, the outgoing transfer is given up.
+*/
+VOID
+TransferPeerUnavailable(
+    _Inout_ PTRANSFER_SESSION pSession
+);
+
+#endif // !TRANSFER_H
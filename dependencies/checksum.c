@@ -0,0 +1,87 @@
+#include "checksum.h"
+
+static UINT32 ChecksumTables[8][256];
+static volatile LONG ChecksumTablesReady = FALSE;
+
+/**
+* Fills the tables: the first is the byte-at-a-time table, table k advances a byte's CRC over k
+* more zero bytes. Threads racing here write the same values, the flag is only set once they are in.
+*/
+static
+VOID
+ChecksumBuildTables(
+    VOID
+)
+{
+    for (UINT32 Byte = 0; Byte < 256; ++Byte)
+    {
+        UINT32 Crc = Byte;
+
+        for (ULONG Bit = 0; Bit < 8; ++Bit)
+        {
+            Crc = (Crc & 1) ? (Crc >> 1) ^ CHECKSUM_CRC32C_POLYNOMIAL : (Crc >> 1);
+        }
+
+        ChecksumTables[0][Byte] = Crc;
+    }
+
+    for (UINT32 Byte = 0; Byte < 256; ++Byte)
+    {
+        for (ULONG Table = 1; Table < 8; ++Table)
+        {
+            UINT32 Previous = ChecksumTables[Table - 1][Byte];
+            ChecksumTables[Table][Byte] = (Previous >> 8) ^ ChecksumTables[0][Previous & 0xFF];
+        }
+    }
+
+    InterlockedExchange(&ChecksumTablesReady, TRUE);
+}
+
+UINT32
+ChecksumCrc32c(
+    _In_ UINT32 Crc,
+    _In_ const VOID* Data,
+    _In_ SIZE_T Length
+)
+{
+    if (!ChecksumTablesReady)
+    {
+        ChecksumBuildTables();
+    }
+
+    const UINT8* Bytes = (const UINT8*)Data;
+    Crc = ~Crc;
+
+    // byte at a time up to an 8 byte boundary, then eight at once
+    while (Length > 0 && ((ULONG_PTR)Bytes & 7) != 0)
+    {
+        Crc = (Crc >> 8) ^ ChecksumTables[0][(Crc ^ *Bytes++) & 0xFF];
+        --Length;
+    }
+
+    while (Length >= 8)
+    {
+        UINT32 Low = Crc ^ ((UINT32)Bytes[0] | ((UINT32)Bytes[1] << 8) | ((UINT32)Bytes[2] << 16) | ((UINT32)Bytes[3] << 24));
+        UINT32 High = (UINT32)Bytes[4] | ((UINT32)Bytes[5] << 8) | ((UINT32)Bytes[6] << 16) | ((UINT32)Bytes[7] << 24);
+
+        Crc = ChecksumTables[7][Low & 0xFF] ^
+              ChecksumTables[6][(Low >> 8) & 0xFF] ^
+              ChecksumTables[5][(Low >> 16) & 0xFF] ^
+              ChecksumTables[4][Low >> 24] ^
+              ChecksumTables[3][High & 0xFF] ^
+              ChecksumTables[2][(High >> 8) & 0xFF] ^
+              ChecksumTables[1][(High >> 16) & 0xFF] ^
+              ChecksumTables[0][High >> 24];
+
+        Bytes += 8;
+        Length -= 8;
+    }
+
+    while (Length > 0)
+    {
+        Crc = (Crc >> 8) ^ ChecksumTables[0][(Crc ^ *Bytes++) & 0xFF];
+        --Length;
+    }
+
+    return ~Crc;
+}
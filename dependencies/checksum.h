@@ -0,0 +1,32 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "wincompat.h"
+
+/**
+    * CRC-32C (Castagnoli, reflected polynomial 0x82F63B78), the checksum of file transfer chunks.
+    *
+    * Computed eight bytes at a time from eight tables built on first use, over a gigabyte a second
+    * on one core without needing the SSE 4.2 instruction, so checking a chunk costs a fraction of
+    * sending it.
+*/
+
+#define CHECKSUM_CRC32C_POLYNOMIAL 0x82F63B78
+
+/**
+* Extends a CRC-32C over more data.
+*
+* @param Crc    0 for the first call, the previous result to continue over the next piece.
+* @param Data   Bytes to add.
+* @param Length Size of Data.
+*
+* @return The CRC-32C of everything passed so far.
+*/
+UINT32
+ChecksumCrc32c(
+    _In_ UINT32 Crc,
+    _In_ const VOID* Data,
+    _In_ SIZE_T Length
+);
+
+#endif // !CHECKSUM_H
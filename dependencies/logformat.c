@@ -0,0 +1,791 @@
+#include "logformat.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+* Cursor over the raw arguments of one record.
+*/
+typedef struct _LOG_FORMAT_ARGUMENTS
+{
+    const UINT8* Types;
+    UINT8        Count;
+    UINT8        Index;
+    const UINT8* Data;
+    ULONG        Length;
+    ULONG        Offset;
+} LOG_FORMAT_ARGUMENTS, *PLOG_FORMAT_ARGUMENTS;
+
+BOOL
+LogFormatParseSpec(
+    _In_  PCSTR Spec,
+    _Out_ PLOG_FORMAT_SPEC pSpec
+)
+{
+    PCSTR p = Spec + 1;
+
+    memset(pSpec, 0, sizeof(*pSpec));
+
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+    {
+        ++p;
+    }
+
+    if (*p == '*')
+    {
+        pSpec->WidthFromArg = TRUE;
+        ++p;
+    }
+    else
+    {
+        while (*p >= '0' && *p <= '9')
+        {
+            ++p;
+        }
+    }
+
+    if (*p == '.')
+    {
+        ++p;
+
+        if (*p == '*')
+        {
+            pSpec->PrecisionFromArg = TRUE;
+            ++p;
+        }
+        else
+        {
+            while (*p >= '0' && *p <= '9')
+            {
+                ++p;
+            }
+        }
+    }
+
+    pSpec->FieldLength = (ULONG)(p - Spec - 1);
+
+    if (p[0] == 'h' && p[1] == 'h')
+    {
+        pSpec->Modifier = LOG_MODIFIER_CHAR;
+        p += 2;
+    }
+    else if (p[0] == 'l' && p[1] == 'l')
+    {
+        pSpec->Modifier = LOG_MODIFIER_LONGLONG;
+        p += 2;
+    }
+    else if (p[0] == 'I' && p[1] == '6' && p[2] == '4')
+    {
+        pSpec->Modifier = LOG_MODIFIER_LONGLONG;
+        p += 3;
+    }
+    else if (p[0] == 'I' && p[1] == '3' && p[2] == '2')
+    {
+        pSpec->Modifier = LOG_MODIFIER_INT32;
+        p += 3;
+    }
+    else if (*p == 'h')
+    {
+        pSpec->Modifier = LOG_MODIFIER_SHORT;
+        ++p;
+    }
+    else if (*p == 'l')
+    {
+        pSpec->Modifier = LOG_MODIFIER_LONG;
+        ++p;
+    }
+    else if (*p == 'z' || *p == 't' || *p == 'I')
+    {
+        pSpec->Modifier = LOG_MODIFIER_SIZE;
+        ++p;
+    }
+    else if (*p == 'j')
+    {
+        pSpec->Modifier = LOG_MODIFIER_INTMAX;
+        ++p;
+    }
+    else if (*p == 'L')
+    {
+        pSpec->Modifier = LOG_MODIFIER_LONGDOUBLE;
+        ++p;
+    }
+
+    pSpec->Conversion = *p;
+    pSpec->Length = (ULONG)(p - Spec + 1);
+
+    switch (*p)
+    {
+    case '%':
+        pSpec->ValueType = LOG_ARG_NONE;
+        return pSpec->Length == 2;
+
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+        if (pSpec->Modifier == LOG_MODIFIER_LONGLONG || pSpec->Modifier == LOG_MODIFIER_INTMAX)
+        {
+            pSpec->ValueType = LOG_ARG_INT64;
+        }
+        else if (pSpec->Modifier == LOG_MODIFIER_SIZE)
+        {
+            pSpec->ValueType = (sizeof(SIZE_T) == sizeof(UINT64)) ? LOG_ARG_INT64 : LOG_ARG_INT32;
+        }
+        else if (pSpec->Modifier == LOG_MODIFIER_LONG)
+        {
+            pSpec->ValueType = (sizeof(long) == sizeof(UINT64)) ? LOG_ARG_INT64 : LOG_ARG_INT32; // 64 bits on LP64 systems
+        }
+        else if (pSpec->Modifier == LOG_MODIFIER_LONGDOUBLE)
+        {
+            return FALSE;
+        }
+        else
+        {
+            pSpec->ValueType = LOG_ARG_INT32;
+        }
+        return TRUE;
+
+    case 'c':
+        pSpec->ValueType = LOG_ARG_INT32;
+        return pSpec->Modifier == LOG_MODIFIER_NONE || pSpec->Modifier == LOG_MODIFIER_SHORT;
+
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        pSpec->ValueType = LOG_ARG_DOUBLE;
+        return pSpec->Modifier == LOG_MODIFIER_NONE ||
+               pSpec->Modifier == LOG_MODIFIER_LONG ||
+               pSpec->Modifier == LOG_MODIFIER_LONGDOUBLE;
+
+    case 's':
+        pSpec->ValueType = LOG_ARG_STRING;
+        return pSpec->Modifier == LOG_MODIFIER_NONE || pSpec->Modifier == LOG_MODIFIER_SHORT;
+
+    case 'p':
+        pSpec->ValueType = LOG_ARG_POINTER;
+        return pSpec->Modifier == LOG_MODIFIER_NONE;
+
+    default:
+        return FALSE; // %n, %S, %C, %Z and anything unknown
+    }
+}
+
+/**
+* Reads the next raw argument.
+*
+* @param pArguments    Argument cursor.
+* @param pType         Receives the argument type.
+* @param pValue        Receives the raw bits of fixed size arguments.
+* @param pString       Receives strings, NULL for a NULL pointer.
+* @param pStringLength Receives the length of strings.
+*
+* @return TRUE if successful, FALSE if the arguments end early.
+*/
+static
+BOOL
+LogFormatReadArgument(
+    _Inout_ PLOG_FORMAT_ARGUMENTS pArguments,
+    _Out_   LOG_ARG_TYPE* pType,
+    _Out_   UINT64* pValue,
+    _Out_   PCSTR* pString,
+    _Out_   UINT16* pStringLength
+)
+{
+    if (pArguments->Index >= pArguments->Count)
+    {
+        return FALSE;
+    }
+
+    LOG_ARG_TYPE Type = (LOG_ARG_TYPE)pArguments->Types[pArguments->Index++];
+    ULONG Remaining = pArguments->Length - pArguments->Offset;
+    const UINT8* Data = pArguments->Data + pArguments->Offset;
+
+    *pType = Type;
+    *pValue = 0;
+    *pString = NULL;
+    *pStringLength = 0;
+
+    switch (Type)
+    {
+    case LOG_ARG_INT32:
+    {
+        UINT32 Value;
+        if (Remaining < sizeof(Value))
+        {
+            return FALSE;
+        }
+
+        memcpy(&Value, Data, sizeof(Value));
+        *pValue = Value;
+        pArguments->Offset += sizeof(Value);
+        return TRUE;
+    }
+
+    case LOG_ARG_INT64:
+    case LOG_ARG_DOUBLE:
+    case LOG_ARG_POINTER:
+        if (Remaining < sizeof(UINT64))
+        {
+            return FALSE;
+        }
+
+        memcpy(pValue, Data, sizeof(UINT64));
+        pArguments->Offset += sizeof(UINT64);
+        return TRUE;
+
+    case LOG_ARG_STRING:
+    {
+        UINT16 Length;
+        if (Remaining < sizeof(Length))
+        {
+            return FALSE;
+        }
+
+        memcpy(&Length, Data, sizeof(Length));
+        pArguments->Offset += sizeof(Length);
+
+        if (Length == LOG_STRING_NULL)
+        {
+            return TRUE;
+        }
+
+        if (Remaining - sizeof(Length) < Length)
+        {
+            return FALSE;
+        }
+
+        *pString = (PCSTR)(Data + sizeof(Length));
+        *pStringLength = Length;
+        pArguments->Offset += Length;
+        return TRUE;
+    }
+
+    default:
+        return FALSE;
+    }
+}
+
+/**
+* Appends formatted text to a buffer, truncating at its end.
+*/
+FORMAT_PRINTF(4, 5)
+static
+VOID
+LogFormatAppend(
+    _Inout_ PSTR Buffer,
+    _In_    ULONG BufferSize,
+    _Inout_ ULONG* pLength,
+    _In_    PCSTR Format,
+    ...
+)
+{
+    if (*pLength + 1 >= BufferSize)
+    {
+        return;
+    }
+
+    va_list Args;
+    va_start(Args, Format);
+
+    INT Written = _vsnprintf_s(Buffer + *pLength, BufferSize - *pLength, _TRUNCATE, Format, Args);
+    *pLength += (Written < 0) ? (ULONG)strlen(Buffer + *pLength) : (ULONG)Written;
+
+    va_end(Args);
+}
+
+/**
+* Widens an integer argument to 64 bits the way printf would have read it.
+*/
+static
+UINT64
+LogFormatWidenInteger(
+    _In_ const LOG_FORMAT_SPEC* pSpec,
+    _In_ LOG_ARG_TYPE Type,
+    _In_ UINT64 Value
+)
+{
+    BOOL IsSigned = (pSpec->Conversion == 'd' || pSpec->Conversion == 'i');
+
+    if (pSpec->Modifier == LOG_MODIFIER_CHAR)
+    {
+        return IsSigned ? (UINT64)(INT64)(signed char)Value : (UINT64)(UINT8)Value;
+    }
+
+    if (pSpec->Modifier == LOG_MODIFIER_SHORT)
+    {
+        return IsSigned ? (UINT64)(INT64)(INT16)Value : (UINT64)(UINT16)Value;
+    }
+
+    if (Type == LOG_ARG_INT32)
+    {
+        return IsSigned ? (UINT64)(INT64)(INT32)Value : (UINT64)(UINT32)Value;
+    }
+
+    return Value;
+}
+
+BOOL
+LogFormatRender(
+    _In_  PCSTR Format,
+    _In_  const UINT8* ArgTypes,
+    _In_  UINT8 ArgCount,
+    _In_  const UINT8* Args,
+    _In_  ULONG ArgsLength,
+    _Out_ PSTR Message,
+    _In_  ULONG MessageSize
+)
+{
+    LOG_FORMAT_ARGUMENTS Arguments = { ArgTypes, ArgCount, 0, Args, ArgsLength, 0 };
+    ULONG Length = 0;
+    PCSTR p = Format;
+
+    if (MessageSize == 0)
+    {
+        return FALSE;
+    }
+
+    Message[0] = '\0';
+
+    while (*p != '\0' && Length + 1 < MessageSize)
+    {
+        if (*p != '%')
+        {
+            Message[Length++] = *p++;
+            Message[Length] = '\0';
+            continue;
+        }
+
+        LOG_FORMAT_SPEC Spec;
+        if (!LogFormatParseSpec(p, &Spec))
+        {
+            return FALSE; // the logger never records such a site raw
+        }
+
+        if (Spec.ValueType == LOG_ARG_NONE)
+        {
+            LogFormatAppend(Message, MessageSize, &Length, "%%");
+            p += Spec.Length;
+            continue;
+        }
+
+        LOG_ARG_TYPE Type;
+        UINT64       Value;
+        PCSTR        String;
+        UINT16       StringLength;
+
+        // rebuild flags and width with '*' replaced by the recorded value, the precision is kept apart
+        // because strings are not terminated and always print with an explicit one
+        CHAR  Conversion[64] = "%";
+        ULONG ConversionLength = 1;
+        INT   Precision = -1;
+        ULONG i = 0;
+
+        for (; i < Spec.FieldLength && p[1 + i] != '.'; ++i)
+        {
+            if (p[1 + i] != '*')
+            {
+                LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, "%c", p[1 + i]);
+                continue;
+            }
+
+            if (!LogFormatReadArgument(&Arguments, &Type, &Value, &String, &StringLength) || Type != LOG_ARG_INT32)
+            {
+                return FALSE;
+            }
+
+            LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, "%d", (INT32)(UINT32)Value);
+        }
+
+        if (i < Spec.FieldLength)
+        {
+            Precision = 0; // a lone '.' means zero
+
+            if (Spec.PrecisionFromArg)
+            {
+                if (!LogFormatReadArgument(&Arguments, &Type, &Value, &String, &StringLength) || Type != LOG_ARG_INT32)
+                {
+                    return FALSE;
+                }
+
+                Precision = (INT32)(UINT32)Value; // negative means none, as with printf
+            }
+            else
+            {
+                Precision = atoi(p + 2 + i);
+            }
+        }
+
+        if (!LogFormatReadArgument(&Arguments, &Type, &Value, &String, &StringLength))
+        {
+            return FALSE;
+        }
+
+        if (Type != LOG_ARG_STRING && Precision >= 0)
+        {
+            LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, ".%d", Precision);
+        }
+
+        switch (Type)
+        {
+        case LOG_ARG_STRING:
+            if (String == NULL)
+            {
+                String = "(null)";
+                StringLength = 6;
+            }
+
+            if (Precision < 0 || Precision > StringLength)
+            {
+                Precision = StringLength;
+            }
+
+            LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, ".*s");
+            LogFormatAppend(Message, MessageSize, &Length, Conversion, Precision, String);
+            break;
+
+        case LOG_ARG_DOUBLE:
+        {
+            double Double;
+            memcpy(&Double, &Value, sizeof(Double));
+
+            LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, "%c", Spec.Conversion);
+            LogFormatAppend(Message, MessageSize, &Length, Conversion, Double);
+            break;
+        }
+
+        case LOG_ARG_POINTER:
+            LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, "p");
+            LogFormatAppend(Message, MessageSize, &Length, Conversion, (PVOID)(UINT_PTR)Value);
+            break;
+
+        case LOG_ARG_INT32:
+        case LOG_ARG_INT64:
+            if (Spec.Conversion == 'c')
+            {
+                LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, "c");
+                LogFormatAppend(Message, MessageSize, &Length, Conversion, (INT)(UINT32)Value);
+            }
+            else
+            {
+                LogFormatAppend(Conversion, sizeof(Conversion), &ConversionLength, "ll%c", Spec.Conversion);
+                LogFormatAppend(Message, MessageSize, &Length, Conversion, LogFormatWidenInteger(&Spec, Type, Value));
+            }
+            break;
+
+        default:
+            return FALSE;
+        }
+
+        p += Spec.Length;
+    }
+
+    return TRUE;
+}
+
+/**
+* Appends a string as a JSON string literal, escaped and truncated so that the closing quote still
+* fits before Limit.
+*/
+static
+VOID
+LogFormatAppendJsonString(
+    _Inout_ PSTR Buffer,
+    _In_    ULONG Limit,
+    _Inout_ ULONG* pLength,
+    _In_    PCSTR String,
+    _In_    SIZE_T StringLength
+)
+{
+    static const CHAR Hex[] = "0123456789abcdef";
+    ULONG Length = *pLength;
+
+    if (Length + 2 > Limit)
+    {
+        return;
+    }
+
+    Buffer[Length++] = '"';
+
+    for (SIZE_T i = 0; i < StringLength; ++i)
+    {
+        UCHAR Character = (UCHAR)String[i];
+        CHAR  Escape[6] = { '\\', (CHAR)Character };
+        ULONG EscapeLength = 2;
+
+        switch (Character)
+        {
+        case '"':
+        case '\\':
+            break;
+
+        case '\n': Escape[1] = 'n'; break;
+        case '\r': Escape[1] = 'r'; break;
+        case '\t': Escape[1] = 't'; break;
+
+        default:
+            if (Character >= 0x20)
+            {
+                Escape[0] = (CHAR)Character;
+                EscapeLength = 1;
+            }
+            else
+            {
+                memcpy(Escape + 1, "u00", 3);
+                Escape[4] = Hex[Character >> 4];
+                Escape[5] = Hex[Character & 0xF];
+                EscapeLength = 6;
+            }
+            break;
+        }
+
+        if (Length + EscapeLength + 1 > Limit)
+        {
+            break; // keep room for the closing quote
+        }
+
+        memcpy(Buffer + Length, Escape, EscapeLength);
+        Length += EscapeLength;
+    }
+
+    Buffer[Length++] = '"';
+    *pLength = Length;
+}
+
+BOOL
+LogFormatBuildJsonTemplate(
+    _In_     PCSTR LevelName,
+    _In_     PCSTR FileName,
+    _In_     ULONG Line,
+    _In_opt_ PCSTR Event,
+    _In_opt_ PCSTR Fields,
+    _Out_    PLOG_JSON_TEMPLATE Template
+)
+{
+    // one byte short of the buffer, so a member that did not fit shows as a full buffer
+    const ULONG Limit = sizeof(Template->Text) - 1;
+    PSTR  Text = Template->Text;
+    ULONG Length = 0;
+
+    memset(Template, 0, sizeof(*Template));
+
+    LogFormatAppend(Text, Limit, &Length, "\"level\":\"%s\",\"file\":", LevelName);
+    LogFormatAppendJsonString(Text, Limit, &Length, FileName, strlen(FileName));
+    LogFormatAppend(Text, Limit, &Length, ",\"line\":%lu", (unsigned long)Line);
+
+    if (Event != NULL)
+    {
+        LogFormatAppend(Text, Limit, &Length, ",\"event\":");
+        LogFormatAppendJsonString(Text, Limit, &Length, Event, strlen(Event));
+    }
+
+    if (Length + 1 >= Limit)
+    {
+        return FALSE;
+    }
+
+    Template->StaticLength = Length;
+    Template->HasMessage = (Fields == NULL);
+
+    for (PCSTR p = Fields; p != NULL && *p != '\0'; )
+    {
+        if (*p == ' ')
+        {
+            ++p;
+            continue;
+        }
+
+        PCSTR Name = p;
+        while (isalnum((UCHAR)*p) || *p == '_' || *p == '-' || *p == '.')
+        {
+            ++p;
+        }
+
+        LOG_FORMAT_SPEC Spec;
+        if (p == Name || p[0] != '=' || p[1] != '%' || Template->FieldCount == LOG_MAX_ARGS ||
+            !LogFormatParseSpec(p + 1, &Spec) || Spec.ValueType == LOG_ARG_NONE)
+        {
+            return FALSE;
+        }
+
+        // names are restricted to characters that need no escaping
+        LogFormatAppend(Text, Limit, &Length, ",\"%.*s\":", (INT)(p - Name), Name);
+        if (Length + 1 >= Limit)
+        {
+            return FALSE;
+        }
+
+        Template->Specs[Template->FieldCount] = Spec;
+        Template->NameEnd[Template->FieldCount++] = (UINT16)Length;
+
+        p += 1 + Spec.Length;
+        if (*p != ' ' && *p != '\0')
+        {
+            return FALSE; // text glued to the value
+        }
+    }
+
+    return TRUE;
+}
+
+ULONG
+LogFormatRenderJson(
+    _In_     const LOG_JSON_TEMPLATE* Template,
+    _In_     PCSTR Timestamp,
+    _In_opt_ PCSTR Message,
+    _In_opt_ const UINT8* ArgTypes,
+    _In_     UINT8 ArgCount,
+    _In_opt_ const UINT8* Args,
+    _In_     ULONG ArgsLength,
+    _Out_    PSTR Buffer,
+    _In_     ULONG BufferSize
+)
+{
+    const ULONG MemberRoom = 48; // longest value that is not a string, with its separator
+
+    if (BufferSize < Template->StaticLength + MemberRoom + 16)
+    {
+        return 0;
+    }
+
+    // members stop short of the closing brace, the newline and the terminator
+    const ULONG Limit = BufferSize - 3;
+    ULONG Length = 0;
+
+    LogFormatAppend(Buffer, Limit, &Length, LOG_JSON_TIME_PREFIX "%s\",", Timestamp);
+    memcpy(Buffer + Length, Template->Text, Template->StaticLength);
+    Length += Template->StaticLength;
+
+    if (Template->HasMessage)
+    {
+        SIZE_T MessageLength = (Message != NULL) ? strlen(Message) : 0;
+        if (MessageLength > 0 && Message[MessageLength - 1] == '\n')
+        {
+            --MessageLength; // most call sites end their format with a newline
+        }
+
+        LogFormatAppend(Buffer, Limit, &Length, ",\"msg\":");
+        LogFormatAppendJsonString(Buffer, Limit, &Length, (Message != NULL) ? Message : "", MessageLength);
+    }
+
+    LOG_FORMAT_ARGUMENTS Arguments = { ArgTypes, ArgCount, 0, Args, ArgsLength, 0 };
+
+    for (UINT8 i = 0; i < Template->FieldCount; ++i)
+    {
+        const LOG_FORMAT_SPEC* pSpec = &Template->Specs[i];
+        ULONG NameStart = (i == 0) ? Template->StaticLength : Template->NameEnd[i - 1];
+        ULONG NameLength = Template->NameEnd[i] - NameStart;
+
+        LOG_ARG_TYPE Type;
+        UINT64       Value;
+        PCSTR        String;
+        UINT16       StringLength;
+
+        // '*' widths and precisions are recorded but have no meaning here
+        INT Skipped = (pSpec->WidthFromArg ? 1 : 0) + (pSpec->PrecisionFromArg ? 1 : 0);
+        for (INT j = 0; j < Skipped; ++j)
+        {
+            if (!LogFormatReadArgument(&Arguments, &Type, &Value, &String, &StringLength) || Type != LOG_ARG_INT32)
+            {
+                return 0;
+            }
+        }
+
+        if (!LogFormatReadArgument(&Arguments, &Type, &Value, &String, &StringLength))
+        {
+            return 0;
+        }
+
+        if (Length + NameLength + MemberRoom > Limit)
+        {
+            break; // the fields that do not fit are dropped
+        }
+
+        memcpy(Buffer + Length, Template->Text + NameStart, NameLength);
+        Length += NameLength;
+
+        switch (Type)
+        {
+        case LOG_ARG_STRING:
+            if (String == NULL)
+            {
+                LogFormatAppend(Buffer, Limit, &Length, "null");
+            }
+            else
+            {
+                LogFormatAppendJsonString(Buffer, Limit, &Length, String, StringLength);
+            }
+            break;
+
+        case LOG_ARG_DOUBLE:
+        {
+            double Double;
+            memcpy(&Double, &Value, sizeof(Double));
+
+            if (isfinite(Double))
+            {
+                LogFormatAppend(Buffer, Limit, &Length, "%.17g", Double);
+            }
+            else
+            {
+                LogFormatAppend(Buffer, Limit, &Length, "null");
+            }
+            break;
+        }
+
+        case LOG_ARG_POINTER:
+            LogFormatAppend(Buffer, Limit, &Length, "\"%p\"", (PVOID)(UINT_PTR)Value);
+            break;
+
+        case LOG_ARG_INT32:
+        case LOG_ARG_INT64:
+            Value = LogFormatWidenInteger(pSpec, Type, Value);
+
+            switch (pSpec->Conversion)
+            {
+            case 'd':
+            case 'i':
+                LogFormatAppend(Buffer, Limit, &Length, "%lld", (long long)Value);
+                break;
+
+            case 'u':
+                LogFormatAppend(Buffer, Limit, &Length, "%llu", (unsigned long long)Value);
+                break;
+
+            case 'c':
+            {
+                CHAR Character = (CHAR)Value;
+                LogFormatAppendJsonString(Buffer, Limit, &Length, &Character, 1);
+                break;
+            }
+
+            default:
+            {
+                CHAR Conversion[] = "\"%llx\"";
+                Conversion[4] = pSpec->Conversion;
+                LogFormatAppend(Buffer, Limit, &Length, Conversion, Value);
+                break;
+            }
+            }
+            break;
+
+        default:
+            return 0;
+        }
+    }
+
+    Buffer[Length++] = '}';
+    Buffer[Length++] = '\n';
+    Buffer[Length] = '\0';
+
+    return Length;
+}
@@ -0,0 +1,261 @@
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include <string.h>
+
+#include "wincompat.h"
+
+/**
+    * Binary log file layout, shared by the logger and the offline decoder.
+    *
+    * A call site registers its format string once and is given a format id. From then on a log call
+    * only records the id, the performance counter and the raw argument bytes; the format string,
+    * file and line are written once per file in a LOG_RECORD_FORMAT record and the text is rendered
+    * by the decoder.
+    *
+    * The file starts with LOG_FILE_HEADER, every record with LOG_RECORD_HEADER. Each time the logger
+    * opens a file it writes a LOG_RECORD_SESSION record, format ids and ticks are only meaningful
+    * after the session record that precedes them.
+    *
+    * The logger preallocates its files, a process that ends without closing the file leaves zero
+    * bytes behind its last record. Readers skip zero bytes between records, no record type is zero.
+    *
+    * A format record of a structured call site, LOG_EVENT_* in logger.h, carries the event name after
+    * the format string. Its format string is then a list of name=%conversion fields separated by
+    * spaces.
+    *
+    * Event arguments are stored in call order, unaligned:
+    *     LOG_ARG_INT32   4 bytes, '*' widths and precisions included
+    *     LOG_ARG_INT64   8 bytes
+    *     LOG_ARG_DOUBLE  8 bytes
+    *     LOG_ARG_POINTER 8 bytes
+    *     LOG_ARG_STRING  UINT16 length followed by the characters, no terminator,
+    *                     LOG_STRING_NULL as the length for a NULL pointer
+*/
+
+#define LOG_BINARY_MAGIC 0x474F4C50 // "PLOG"
+#define LOG_BINARY_VERSION 1
+#define LOG_BINARY_EXTENSION ".plog"
+
+#define LOG_MAX_SITES 4096          // format ids handed out per process
+#define LOG_MAX_ARGS 16             // arguments per format string, '*' included
+#define LOG_MAX_RECORD 0xFFFF       // largest record payload
+#define LOG_STRING_NULL 0xFFFF
+
+typedef enum _LOG_RECORD_TYPE
+{
+    LOG_RECORD_PADDING = 0, // zero bytes left by a preallocated file, not a record
+    LOG_RECORD_SESSION = 1,
+    LOG_RECORD_FORMAT,
+    LOG_RECORD_EVENT,
+    LOG_RECORD_TEXT     // preformatted message, for sites that could not be registered
+} LOG_RECORD_TYPE;
+
+typedef enum _LOG_ARG_TYPE
+{
+    LOG_ARG_NONE = 0,
+    LOG_ARG_INT32,
+    LOG_ARG_INT64,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER
+} LOG_ARG_TYPE;
+
+typedef enum _LOG_FORMAT_MODIFIER
+{
+    LOG_MODIFIER_NONE = 0,
+    LOG_MODIFIER_CHAR,       // hh
+    LOG_MODIFIER_SHORT,      // h
+    LOG_MODIFIER_LONG,       // l, 32 bits on Windows
+    LOG_MODIFIER_LONGLONG,   // ll, I64
+    LOG_MODIFIER_INT32,      // I32
+    LOG_MODIFIER_SIZE,       // z, t, I, pointer sized
+    LOG_MODIFIER_INTMAX,     // j
+    LOG_MODIFIER_LONGDOUBLE  // L, same as double with MSVC
+} LOG_FORMAT_MODIFIER;
+
+#pragma pack(push, 1)
+
+typedef struct _LOG_FILE_HEADER
+{
+    UINT32 Magic;
+    UINT16 Version;
+    UINT16 Reserved;
+} LOG_FILE_HEADER, *PLOG_FILE_HEADER;
+
+typedef struct _LOG_RECORD_HEADER
+{
+    UINT8  Type;      // LOG_RECORD_TYPE
+    UINT8  Level;     // LOG_LEVEL of the event, 0 for session and format records
+    UINT16 Length;    // bytes following this header
+} LOG_RECORD_HEADER, *PLOG_RECORD_HEADER;
+
+typedef struct _LOG_SESSION_RECORD
+{
+    UINT64 TicksPerSecond;
+    UINT64 BaseTicks;     // performance counter when the file was opened
+    UINT64 BaseTime;      // local FILETIME at BaseTicks
+    UINT32 ProcessId;
+} LOG_SESSION_RECORD, *PLOG_SESSION_RECORD;
+
+typedef struct _LOG_FORMAT_RECORD
+{
+    UINT32 FormatId;
+    UINT32 Line;
+    UINT8  ArgCount;
+    // UINT8 ArgTypes[ArgCount], then the file name and the format string, both NUL terminated,
+    // then the event name of a structured site, NUL terminated, absent otherwise
+} LOG_FORMAT_RECORD, *PLOG_FORMAT_RECORD;
+
+typedef struct _LOG_EVENT_RECORD
+{
+    UINT32 FormatId;
+    UINT64 Ticks;
+    // arguments
+} LOG_EVENT_RECORD, *PLOG_EVENT_RECORD;
+
+typedef struct _LOG_TEXT_RECORD
+{
+    UINT64 Ticks;
+    UINT32 Line;
+    // the file name and the message, both NUL terminated
+} LOG_TEXT_RECORD, *PLOG_TEXT_RECORD;
+
+#pragma pack(pop)
+
+/**
+* One conversion specification of a printf format string.
+*/
+typedef struct _LOG_FORMAT_SPEC
+{
+    ULONG               Length;           // characters from the '%' to the conversion, inclusive
+    ULONG               FieldLength;      // flags, width and precision after the '%'
+    BOOL                WidthFromArg;
+    BOOL                PrecisionFromArg;
+    LOG_FORMAT_MODIFIER Modifier;
+    CHAR                Conversion;
+    LOG_ARG_TYPE        ValueType;        // LOG_ARG_NONE for "%%"
+} LOG_FORMAT_SPEC, *PLOG_FORMAT_SPEC;
+
+/**
+    * JSON Lines layout, one object per record:
+    *     {"ts":"YYYY-MM-DD HH:MM:SS.mmm","level":"INFO","file":"peer.c","line":115,"event":"...",...}
+    *
+    * "event" and one member per field follow for structured call sites, "msg" with the formatted
+    * message for every other site. Integers are numbers, %x, %o, %c and %p values strings, doubles
+    * numbers or null when not finite, NULL strings null. Widths and precisions are ignored.
+*/
+
+#define LOG_JSON_EXTENSION ".jsonl"
+#define LOG_JSON_TIME_PREFIX "{\"ts\":\""  // every line starts with it, followed by the timestamp
+#define LOG_JSON_TEMPLATE_SIZE 512
+
+/**
+* The static members of a call site's JSON object, serialized once, and the member names of its
+* fields. Only the timestamp and the field values are rendered per record.
+*/
+typedef struct _LOG_JSON_TEMPLATE
+{
+    ULONG           StaticLength;                 // bytes of Text holding level, file, line and event
+    BOOL            HasMessage;                   // a "msg" member follows the static members
+    UINT8           FieldCount;
+    UINT16          NameEnd[LOG_MAX_ARGS];        // end of the ,"name": of every field in Text
+    LOG_FORMAT_SPEC Specs[LOG_MAX_ARGS];          // conversion of every field
+    CHAR            Text[LOG_JSON_TEMPLATE_SIZE];
+} LOG_JSON_TEMPLATE, *PLOG_JSON_TEMPLATE;
+
+/**
+* Parses the conversion specification starting at a '%'. Integer sizes are resolved for the process
+* parsing it, the decoder relies on the argument types stored in the format record instead.
+*
+* @param Spec  Points at the '%'.
+* @param pSpec Receives the parsed specification.
+*
+* @return TRUE if the specification can be recorded in binary form, FALSE for %n, wide characters
+*         and malformed specifications.
+*/
+BOOL
+LogFormatParseSpec(
+    _In_  PCSTR Spec,
+    _Out_ PLOG_FORMAT_SPEC pSpec
+);
+
+/**
+* Renders a format string with raw arguments recorded in the layout above. Every conversion is
+* rebuilt with the widths and precisions the call passed and printed on its own.
+*
+* @param Format      Format string of the call site.
+* @param ArgTypes    LOG_ARG_TYPE of every argument, in call order.
+* @param ArgCount    Number of entries in ArgTypes.
+* @param Args        Raw arguments.
+* @param ArgsLength  Size of Args.
+* @param Message     Receives the rendered message, truncated to fit.
+* @param MessageSize Size of Message.
+*
+* @return TRUE if successful, FALSE if the arguments do not match the format string.
+*/
+BOOL
+LogFormatRender(
+    _In_  PCSTR Format,
+    _In_  const UINT8* ArgTypes,
+    _In_  UINT8 ArgCount,
+    _In_  const UINT8* Args,
+    _In_  ULONG ArgsLength,
+    _Out_ PSTR Message,
+    _In_  ULONG MessageSize
+);
+
+/**
+* Serializes the static members of a call site's JSON object.
+*
+* @param LevelName Name of the site's level.
+* @param FileName  Source file of the site.
+* @param Line      Source line of the site.
+* @param Event     Event name of a structured site, NULL otherwise.
+* @param Fields    Field list of a structured site, NULL to render records with a "msg" member.
+* @param Template  Receives the template.
+*
+* @return TRUE if successful, FALSE if Fields is not a list of name=%conversion fields or the
+*         members do not fit.
+*/
+BOOL
+LogFormatBuildJsonTemplate(
+    _In_     PCSTR LevelName,
+    _In_     PCSTR FileName,
+    _In_     ULONG Line,
+    _In_opt_ PCSTR Event,
+    _In_opt_ PCSTR Fields,
+    _Out_    PLOG_JSON_TEMPLATE Template
+);
+
+/**
+* Renders one record as a JSON line, newline included.
+*
+* @param Template    Template of the call site.
+* @param Timestamp   YYYY-MM-DD HH:MM:SS.mmm of the record.
+* @param Message     Formatted message, used when the template has a "msg" member.
+* @param ArgTypes    LOG_ARG_TYPE of every argument, used when the template has fields.
+* @param ArgCount    Number of entries in ArgTypes.
+* @param Args        Raw arguments in the layout above.
+* @param ArgsLength  Size of Args.
+* @param Buffer      Receives the line. Strings are truncated and the fields that do not fit
+*                    dropped, the line stays valid JSON.
+* @param BufferSize  Size of Buffer.
+*
+* @return Length of the line, 0 if the buffer cannot hold the static members or the arguments do
+*         not match the fields.
+*/
+ULONG
+LogFormatRenderJson(
+    _In_     const LOG_JSON_TEMPLATE* Template,
+    _In_     PCSTR Timestamp,
+    _In_opt_ PCSTR Message,
+    _In_opt_ const UINT8* ArgTypes,
+    _In_     UINT8 ArgCount,
+    _In_opt_ const UINT8* Args,
+    _In_     ULONG ArgsLength,
+    _Out_    PSTR Buffer,
+    _In_     ULONG BufferSize
+);
+
+#endif // !LOGFORMAT_H
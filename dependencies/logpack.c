@@ -0,0 +1,877 @@
+#include "logpack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOG_PACK_RUN_LENGTH 15          // nibble value continued in the following bytes
+#define LOG_PACK_BUFFER_SIZE ( 2 * LOG_PACK_MAX_BLOCK )
+#define LOG_PACK_TIMESTAMP_LENGTH 25    // "[YYYY-MM-DD HH:MM:SS.mmm]", quoted instead in JSON lines
+
+/**
+* State of one file being compressed.
+*/
+typedef struct _LOG_PACK_WRITER
+{
+    FILE*              Input;
+    FILE*              Output;
+    UINT16             Flags;
+    volatile LONG*     Running;
+    UINT8*             Data;            // LOG_PACK_BUFFER_SIZE bytes read ahead of the next block
+    ULONG              Filled;
+    UINT8*             Packed;          // compressed form of the current block
+    PLOG_PACK_BLOCK    Blocks;
+    ULONG              BlockCount;
+    ULONG              BlockCapacity;
+    UINT64             Offset;          // end of the compressed file
+    UINT64             Length;          // bytes of the original in the blocks written so far
+    LOG_SESSION_RECORD Session;         // binary files, converts record ticks to time
+    BOOL               HasSession;
+} LOG_PACK_WRITER, *PLOG_PACK_WRITER;
+
+static
+UINT32
+LogPackRead32(
+    _In_ const UINT8* Data
+)
+{
+    UINT32 Value;
+    memcpy(&Value, Data, sizeof(Value));
+    return Value;
+}
+
+static
+ULONG
+LogPackHash(
+    _In_ UINT32 Sequence
+)
+{
+    return ( Sequence * 2654435761U ) >> ( 32 - LOG_PACK_HASH_BITS );
+}
+
+/**
+* Writes the part of a count past LOG_PACK_RUN_LENGTH.
+*
+* @return End of the written bytes, NULL if they do not fit.
+*/
+static
+UINT8*
+LogPackPutLength(
+    _Out_ UINT8* Out,
+    _In_  const UINT8* End,
+    _In_  ULONG Length
+)
+{
+    while (Length >= 0xFF)
+    {
+        if (Out >= End)
+        {
+            return NULL;
+        }
+
+        *Out++ = 0xFF;
+        Length -= 0xFF;
+    }
+
+    if (Out >= End)
+    {
+        return NULL;
+    }
+
+    *Out++ = (UINT8)Length;
+
+    return Out;
+}
+
+/**
+* Writes one sequence, MatchLength 0 for the last one.
+*
+* @return End of the written bytes, NULL if they do not fit.
+*/
+static
+UINT8*
+LogPackPutSequence(
+    _Out_ UINT8* Out,
+    _In_  const UINT8* End,
+    _In_  const UINT8* Literals,
+    _In_  ULONG LiteralLength,
+    _In_  ULONG Offset,
+    _In_  ULONG MatchLength
+)
+{
+    if (Out >= End)
+    {
+        return NULL;
+    }
+
+    UINT8* Token = Out++;
+    *Token = (UINT8)(min(LiteralLength, LOG_PACK_RUN_LENGTH) << 4);
+
+    if (LiteralLength >= LOG_PACK_RUN_LENGTH)
+    {
+        Out = LogPackPutLength(Out, End, LiteralLength - LOG_PACK_RUN_LENGTH);
+        if (Out == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    if ((ULONG)(End - Out) < LiteralLength)
+    {
+        return NULL;
+    }
+
+    memcpy(Out, Literals, LiteralLength);
+    Out += LiteralLength;
+
+    if (MatchLength == 0)
+    {
+        return Out;
+    }
+
+    if (End - Out < 2)
+    {
+        return NULL;
+    }
+
+    *Out++ = (UINT8)Offset;
+    *Out++ = (UINT8)(Offset >> 8);
+
+    ULONG Extra = MatchLength - LOG_PACK_MIN_MATCH;
+    *Token |= (UINT8)min(Extra, LOG_PACK_RUN_LENGTH);
+
+    if (Extra >= LOG_PACK_RUN_LENGTH)
+    {
+        Out = LogPackPutLength(Out, End, Extra - LOG_PACK_RUN_LENGTH);
+    }
+
+    return Out;
+}
+
+/**
+* Reads the part of a count past LOG_PACK_RUN_LENGTH and adds it to Length.
+*
+* @return TRUE if successful, FALSE if the block ends inside the count.
+*/
+static
+BOOL
+LogPackGetLength(
+    _Inout_ const UINT8** In,
+    _In_    const UINT8* End,
+    _Inout_ PULONG Length
+)
+{
+    UINT8 Byte;
+
+    do
+    {
+        if (*In >= End)
+        {
+            return FALSE;
+        }
+
+        Byte = *(*In)++;
+        *Length += Byte;
+    } while (Byte == 0xFF);
+
+    return TRUE;
+}
+
+/**
+* Extends a match of LOG_PACK_MIN_MATCH bytes as far as it goes. The candidate is a position in
+* the dictionary followed by the block, it may start in the dictionary and run on into the block.
+*
+* @param Prefix       Dictionary data, NULL if PrefixLength is 0.
+* @param PrefixLength Bytes of the dictionary, the block starts at this position.
+* @param Candidate    Position of the earlier occurrence.
+* @param Position     Position in Source of the occurrence being matched.
+*/
+static
+ULONG
+LogPackMatchLength(
+    _In_opt_ const UINT8* Prefix,
+    _In_     ULONG PrefixLength,
+    _In_     const UINT8* Source,
+    _In_     ULONG Length,
+    _In_     ULONG Candidate,
+    _In_     ULONG Position
+)
+{
+    ULONG MatchLength = LOG_PACK_MIN_MATCH;
+
+    if (Candidate < PrefixLength)
+    {
+        while (Candidate + MatchLength < PrefixLength && Position + MatchLength < Length && Prefix[Candidate + MatchLength] == Source[Position + MatchLength])
+        {
+            ++MatchLength;
+        }
+
+        if (Candidate + MatchLength < PrefixLength)
+        {
+            return MatchLength;
+        }
+    }
+
+    // the rest of the candidate lies in the block
+    ULONG Next = Candidate + MatchLength - PrefixLength;
+
+    while (Position + MatchLength < Length && Source[Next] == Source[Position + MatchLength])
+    {
+        ++Next;
+        ++MatchLength;
+    }
+
+    return MatchLength;
+}
+
+ULONG
+LogPackCompress(
+    _In_  const UINT8* Source,
+    _In_  ULONG Length,
+    _Out_ UINT8* Destination,
+    _In_  ULONG DestinationSize
+)
+{
+    return LogPackCompressDictionary(NULL, Source, Length, Destination, DestinationSize);
+}
+
+ULONG
+LogPackCompressDictionary(
+    _In_opt_ const LOG_PACK_DICTIONARY* Dictionary,
+    _In_     const UINT8* Source,
+    _In_     ULONG Length,
+    _Out_    UINT8* Destination,
+    _In_     ULONG DestinationSize
+)
+{
+    // position + 1 of the last place every hashed sequence was seen, 0 for none, positions in the
+    // block count from the end of the dictionary
+    ULONG Table[1 << LOG_PACK_HASH_BITS];
+    const UINT8* Prefix = NULL;
+    ULONG        PrefixLength = 0;
+
+    if (Dictionary != NULL)
+    {
+        memcpy(Table, Dictionary->Table, sizeof(Table));
+        Prefix = Dictionary->Data;
+        PrefixLength = Dictionary->Length;
+    }
+    else
+    {
+        memset(Table, 0, sizeof(Table));
+    }
+
+    const UINT8* End = Destination + DestinationSize;
+    UINT8*       Out = Destination;
+    ULONG        Anchor = 0;
+    ULONG        Position = 0;
+
+    while (Length >= LOG_PACK_MIN_MATCH && Position <= Length - LOG_PACK_MIN_MATCH)
+    {
+        UINT32 Sequence = LogPackRead32(Source + Position);
+        ULONG  Hash = LogPackHash(Sequence);
+        ULONG  Candidate = Table[Hash];
+        ULONG  Here = PrefixLength + Position;
+
+        Table[Hash] = Here + 1;
+
+        // the dictionary only hashes sequences that lie wholly inside it
+        if (Candidate == 0 ||
+            Here - ( Candidate - 1 ) > LOG_PACK_MAX_OFFSET ||
+            LogPackRead32( ( Candidate - 1 < PrefixLength ) ? Prefix + Candidate - 1 : Source + ( Candidate - 1 - PrefixLength ) ) != Sequence)
+        {
+            // step faster through data that does not repeat
+            Position += 1 + ( ( Position - Anchor ) >> 6 );
+            continue;
+        }
+
+        ULONG Match = Candidate - 1;
+        ULONG MatchLength = LogPackMatchLength(Prefix, PrefixLength, Source, Length, Match, Position);
+
+        Out = LogPackPutSequence(Out, End, Source + Anchor, Position - Anchor, Here - Match, MatchLength);
+        if (Out == NULL)
+        {
+            return 0;
+        }
+
+        Position += MatchLength;
+        Anchor = Position;
+    }
+
+    Out = LogPackPutSequence(Out, End, Source + Anchor, Length - Anchor, 0, 0);
+    if (Out == NULL)
+    {
+        return 0;
+    }
+
+    return (ULONG)(Out - Destination);
+}
+
+BOOL
+LogPackDecompress(
+    _In_  const UINT8* Source,
+    _In_  ULONG PackedLength,
+    _Out_ UINT8* Destination,
+    _In_  ULONG Length
+)
+{
+    return LogPackDecompressDictionary(NULL, Source, PackedLength, Destination, Length);
+}
+
+BOOL
+LogPackDecompressDictionary(
+    _In_opt_ const LOG_PACK_DICTIONARY* Dictionary,
+    _In_     const UINT8* Source,
+    _In_     ULONG PackedLength,
+    _Out_    UINT8* Destination,
+    _In_     ULONG Length
+)
+{
+    const UINT8* In = Source;
+    const UINT8* End = Source + PackedLength;
+    ULONG        Out = 0;
+    ULONG        PrefixLength = (Dictionary != NULL) ? Dictionary->Length : 0;
+
+    while (In < End)
+    {
+        UINT8 Token = *In++;
+
+        ULONG LiteralLength = Token >> 4;
+        if (LiteralLength == LOG_PACK_RUN_LENGTH && !LogPackGetLength( &In, End, &LiteralLength ))
+        {
+            return FALSE;
+        }
+
+        if ((ULONG)(End - In) < LiteralLength || Length - Out < LiteralLength)
+        {
+            return FALSE;
+        }
+
+        memcpy(Destination + Out, In, LiteralLength);
+        In += LiteralLength;
+        Out += LiteralLength;
+
+        if (In == End)
+        {
+            break; // the last sequence has no match
+        }
+
+        if (End - In < 2)
+        {
+            return FALSE;
+        }
+
+        ULONG Offset = In[0] | ( (ULONG)In[1] << 8 );
+        In += 2;
+
+        ULONG MatchLength = Token & 0x0F;
+        if (MatchLength == LOG_PACK_RUN_LENGTH && !LogPackGetLength( &In, End, &MatchLength ))
+        {
+            return FALSE;
+        }
+
+        MatchLength += LOG_PACK_MIN_MATCH;
+
+        if (Offset == 0 || Offset > Out + PrefixLength || Length - Out < MatchLength)
+        {
+            return FALSE;
+        }
+
+        if (Offset > Out)
+        {
+            // starts in the dictionary and may run on into the start of the block
+            ULONG FromDictionary = min(Offset - Out, MatchLength);
+
+            memcpy(Destination + Out, Dictionary->Data + PrefixLength - (Offset - Out), FromDictionary);
+            Out += FromDictionary;
+            MatchLength -= FromDictionary;
+
+            if (MatchLength == 0)
+            {
+                continue;
+            }
+        }
+
+        // a match may overlap the bytes it produces, copied one at a time then
+        PUINT8 Copy = Destination + Out - Offset;
+
+        if (Offset >= MatchLength)
+        {
+            memcpy(Destination + Out, Copy, MatchLength);
+        }
+        else
+        {
+            for (ULONG i = 0; i < MatchLength; ++i)
+            {
+                Destination[Out + i] = Copy[i];
+            }
+        }
+
+        Out += MatchLength;
+    }
+
+    return Out == Length;
+}
+
+VOID
+LogPackPrepareDictionary(
+    _Out_ PLOG_PACK_DICTIONARY Dictionary,
+    _In_  const UINT8* Data,
+    _In_  ULONG Length
+)
+{
+    if (Length > LOG_PACK_MAX_DICTIONARY)
+    {
+        Data += Length - LOG_PACK_MAX_DICTIONARY;
+        Length = LOG_PACK_MAX_DICTIONARY;
+    }
+
+    Dictionary->Data = Data;
+    Dictionary->Length = Length;
+    memset(Dictionary->Table, 0, sizeof(Dictionary->Table));
+
+    // later positions replace earlier ones, matches prefer the nearer occurrence like in a block
+    for (ULONG Position = 0; Length >= LOG_PACK_MIN_MATCH && Position <= Length - LOG_PACK_MIN_MATCH; ++Position)
+    {
+        Dictionary->Table[LogPackHash(LogPackRead32(Data + Position))] = Position + 1;
+    }
+}
+
+/**
+* Finds the end of the next block, the last line or record that fits in LOG_PACK_BLOCK_SIZE bytes.
+* A record that is larger than a block gets a block of its own.
+*
+* @param Data   Data read ahead, at least LOG_PACK_MAX_BLOCK bytes unless IsEnd.
+* @param Length Size of Data.
+* @param Start  Bytes at the start of Data that are not records, the binary file header.
+* @param Flags  LOG_PACK_FLAGS of the file.
+* @param IsEnd  TRUE if Data runs to the end of the file.
+*
+* @return Size of the block.
+*/
+static
+ULONG
+LogPackCut(
+    _In_ const UINT8* Data,
+    _In_ ULONG Length,
+    _In_ ULONG Start,
+    _In_ UINT16 Flags,
+    _In_ BOOL IsEnd
+)
+{
+    if (IsEnd && Length <= LOG_PACK_BLOCK_SIZE)
+    {
+        return Length;
+    }
+
+    if (( Flags & LOG_PACK_FLAG_BINARY ) == 0)
+    {
+        for (ULONG i = LOG_PACK_BLOCK_SIZE; i > 0; --i)
+        {
+            if (Data[i - 1] == '\n')
+            {
+                return i;
+            }
+        }
+
+        return LOG_PACK_BLOCK_SIZE; // a line longer than a block
+    }
+
+    ULONG Offset = min(Start, Length);
+
+    while (Offset < Length)
+    {
+        if (Data[Offset] == 0)
+        {
+            if (Offset >= LOG_PACK_BLOCK_SIZE)
+            {
+                break;
+            }
+
+            ++Offset; // padding
+            continue;
+        }
+
+        if (Length - Offset < sizeof(LOG_RECORD_HEADER))
+        {
+            return IsEnd ? Length : Offset; // truncated record at the end of the file
+        }
+
+        LOG_RECORD_HEADER Header;
+        memcpy(&Header, Data + Offset, sizeof(Header));
+
+        ULONG Record = sizeof(Header) + Header.Length;
+
+        if (Length - Offset < Record)
+        {
+            return IsEnd ? Length : Offset;
+        }
+
+        if (Offset > Start && Offset + Record > LOG_PACK_BLOCK_SIZE)
+        {
+            break;
+        }
+
+        Offset += Record;
+    }
+
+    return Offset;
+}
+
+/**
+* Widens the time range of a block by the time of one record.
+*/
+static
+VOID
+LogPackAddTime(
+    _Inout_ PLOG_PACK_BLOCK Block,
+    _In_    UINT64 Time
+)
+{
+    if (Block->EarliestTime == 0 || Time < Block->EarliestTime)
+    {
+        Block->EarliestTime = Time;
+    }
+
+    if (Time > Block->LatestTime)
+    {
+        Block->LatestTime = Time;
+    }
+}
+
+UINT64
+LogPackLineTime(
+    _In_ const UINT8* Data,
+    _In_ ULONG Length
+)
+{
+    PCSTR  Layout = "[%4hu-%2hu-%2hu %2hu:%2hu:%2hu.%3hu]";
+    SIZE_T Prefix = 0;
+
+    // JSON lines carry the same timestamp, quoted, in their first member
+    if (Length > sizeof(LOG_JSON_TIME_PREFIX) && memcmp(Data, LOG_JSON_TIME_PREFIX, sizeof(LOG_JSON_TIME_PREFIX) - 1) == 0)
+    {
+        Prefix = sizeof(LOG_JSON_TIME_PREFIX) - 2;
+        Layout = "\"%4hu-%2hu-%2hu %2hu:%2hu:%2hu.%3hu\"";
+    }
+    else if (Length == 0 || Data[0] != '[')
+    {
+        return 0;
+    }
+
+    if (Length - Prefix < LOG_PACK_TIMESTAMP_LENGTH)
+    {
+        return 0;
+    }
+
+    CHAR Timestamp[LOG_PACK_TIMESTAMP_LENGTH + 1];
+    memcpy(Timestamp, Data + Prefix, LOG_PACK_TIMESTAMP_LENGTH);
+    Timestamp[LOG_PACK_TIMESTAMP_LENGTH] = '\0';
+
+    SYSTEMTIME SystemTime = { 0 };
+    FILETIME   FileTime;
+
+    if (sscanf_s(Timestamp, Layout,
+                 &SystemTime.wYear, &SystemTime.wMonth, &SystemTime.wDay,
+                 &SystemTime.wHour, &SystemTime.wMinute, &SystemTime.wSecond,
+                 &SystemTime.wMilliseconds) != 7 ||
+        !SystemTimeToFileTime(&SystemTime, &FileTime))
+    {
+        return 0;
+    }
+
+    return ( (UINT64)FileTime.dwHighDateTime << 32 ) | FileTime.dwLowDateTime;
+}
+
+/**
+* Time of a binary record's performance counter ticks in the current session.
+*
+* @return Local FILETIME of the ticks, 0 before the first session record.
+*/
+static
+UINT64
+LogPackTicksTime(
+    _In_ const LOG_PACK_WRITER* Writer,
+    _In_ UINT64 Ticks
+)
+{
+    if (!Writer->HasSession || Writer->Session.TicksPerSecond == 0)
+    {
+        return 0;
+    }
+
+    INT64 Delta = (INT64)(Ticks - Writer->Session.BaseTicks);
+    INT64 Frequency = (INT64)Writer->Session.TicksPerSecond;
+    INT64 Offset = ( Delta / Frequency ) * 10000000LL + ( ( Delta % Frequency ) * 10000000LL ) / Frequency;
+
+    return Writer->Session.BaseTime + Offset;
+}
+
+/**
+* Finds the time range of a block, following the session records of a binary file.
+*/
+static
+VOID
+LogPackBlockTimes(
+    _Inout_ PLOG_PACK_WRITER Writer,
+    _In_    const UINT8* Data,
+    _In_    ULONG Length,
+    _In_    ULONG Start,
+    _Inout_ PLOG_PACK_BLOCK Block
+)
+{
+    if (( Writer->Flags & LOG_PACK_FLAG_BINARY ) == 0)
+    {
+        for (ULONG Line = 0; Line < Length; )
+        {
+            UINT64 Time = LogPackLineTime(Data + Line, Length - Line);
+            if (Time != 0)
+            {
+                LogPackAddTime(Block, Time);
+            }
+
+            const UINT8* Next = memchr(Data + Line, '\n', Length - Line);
+            if (Next == NULL)
+            {
+                break;
+            }
+
+            Line = (ULONG)(Next - Data) + 1;
+        }
+
+        return;
+    }
+
+    ULONG Offset = min(Start, Length);
+
+    while (Offset < Length)
+    {
+        if (Data[Offset] == 0)
+        {
+            ++Offset;
+            continue;
+        }
+
+        LOG_RECORD_HEADER Header;
+        if (Length - Offset < sizeof(Header))
+        {
+            break;
+        }
+
+        memcpy(&Header, Data + Offset, sizeof(Header));
+
+        const UINT8* Payload = Data + Offset + sizeof(Header);
+        if (Length - Offset - sizeof(Header) < Header.Length)
+        {
+            break;
+        }
+
+        UINT64 Ticks = 0;
+
+        if (Header.Type == LOG_RECORD_SESSION && Header.Length >= sizeof(Writer->Session))
+        {
+            memcpy(&Writer->Session, Payload, sizeof(Writer->Session));
+            Writer->HasSession = TRUE;
+        }
+        else if (Header.Type == LOG_RECORD_EVENT && Header.Length >= sizeof(LOG_EVENT_RECORD))
+        {
+            memcpy(&Ticks, Payload + FIELD_OFFSET(LOG_EVENT_RECORD, Ticks), sizeof(Ticks));
+        }
+        else if (Header.Type == LOG_RECORD_TEXT && Header.Length >= sizeof(LOG_TEXT_RECORD))
+        {
+            memcpy(&Ticks, Payload + FIELD_OFFSET(LOG_TEXT_RECORD, Ticks), sizeof(Ticks));
+        }
+
+        UINT64 Time = ( Ticks != 0 ) ? LogPackTicksTime( Writer, Ticks ) : 0;
+        if (Time != 0)
+        {
+            LogPackAddTime(Block, Time);
+        }
+
+        Offset += sizeof(Header) + Header.Length;
+    }
+}
+
+/**
+* Compresses the block at the start of the read ahead data and adds it to the index.
+*
+* @return TRUE if successful, FALSE if it could not be written.
+*/
+static
+BOOL
+LogPackWriteBlock(
+    _Inout_ PLOG_PACK_WRITER Writer,
+    _In_    ULONG Length,
+    _In_    ULONG Start
+)
+{
+    if (Writer->BlockCount == Writer->BlockCapacity)
+    {
+        ULONG Capacity = max(Writer->BlockCapacity * 2, 64);
+
+        PLOG_PACK_BLOCK Blocks = realloc(Writer->Blocks, Capacity * sizeof(LOG_PACK_BLOCK));
+        if (Blocks == NULL)
+        {
+            return FALSE;
+        }
+
+        Writer->Blocks = Blocks;
+        Writer->BlockCapacity = Capacity;
+    }
+
+    PLOG_PACK_BLOCK Block = &Writer->Blocks[Writer->BlockCount];
+    memset(Block, 0, sizeof(*Block));
+
+    LogPackBlockTimes(Writer, Writer->Data, Length, Start, Block);
+
+    const UINT8* Payload = Writer->Packed;
+    ULONG PackedLength = LogPackCompress(Writer->Data, Length, Writer->Packed, LOG_PACK_BOUND(LOG_PACK_MAX_BLOCK));
+
+    if (PackedLength == 0 || PackedLength >= Length)
+    {
+        Payload = Writer->Data; // stored as is
+        PackedLength = Length;
+    }
+
+    if (fwrite(Payload, 1, PackedLength, Writer->Output) != PackedLength)
+    {
+        return FALSE;
+    }
+
+    Block->Offset = Writer->Offset;
+    Block->PackedLength = PackedLength;
+    Block->Length = Length;
+
+    Writer->Offset += PackedLength;
+    Writer->Length += Length;
+    ++Writer->BlockCount;
+
+    return TRUE;
+}
+
+/**
+* Reads the original file block by block and writes the compressed file.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LogPackWrite(
+    _Inout_ PLOG_PACK_WRITER Writer
+)
+{
+    LOG_PACK_HEADER Header = { 0 };
+    Header.Magic = LOG_PACK_MAGIC;
+    Header.Version = LOG_PACK_VERSION;
+    Header.Flags = Writer->Flags;
+
+    // written again with the index offset once the blocks are out
+    if (fwrite(&Header, sizeof(Header), 1, Writer->Output) != 1)
+    {
+        return FALSE;
+    }
+
+    Writer->Offset = sizeof(Header);
+
+    BOOL  IsEnd = FALSE;
+    ULONG Start = ( Writer->Flags & LOG_PACK_FLAG_BINARY ) ? sizeof(LOG_FILE_HEADER) : 0;
+
+    for (;;)
+    {
+        if (Writer->Running != NULL && *Writer->Running == 0)
+        {
+            return FALSE;
+        }
+
+        if (!IsEnd)
+        {
+            Writer->Filled += (ULONG)fread(Writer->Data + Writer->Filled, 1, LOG_PACK_BUFFER_SIZE - Writer->Filled, Writer->Input);
+
+            if (Writer->Filled < LOG_PACK_BUFFER_SIZE)
+            {
+                if (ferror(Writer->Input))
+                {
+                    return FALSE;
+                }
+
+                IsEnd = TRUE;
+
+                while (( Writer->Flags & LOG_PACK_FLAG_BINARY ) == 0 && Writer->Filled > 0 && Writer->Data[Writer->Filled - 1] == '\0')
+                {
+                    --Writer->Filled;
+                }
+            }
+        }
+
+        if (Writer->Filled == 0)
+        {
+            break;
+        }
+
+        ULONG Length = LogPackCut(Writer->Data, Writer->Filled, Start, Writer->Flags, IsEnd);
+
+        if (!LogPackWriteBlock( Writer, Length, Start ))
+        {
+            return FALSE;
+        }
+
+        Writer->Filled -= Length;
+        memmove(Writer->Data, Writer->Data + Length, Writer->Filled);
+        Start = 0;
+    }
+
+    ULONG IndexLength = Writer->BlockCount * sizeof(LOG_PACK_BLOCK);
+    if (IndexLength > 0 && fwrite(Writer->Blocks, 1, IndexLength, Writer->Output) != IndexLength)
+    {
+        return FALSE;
+    }
+
+    Header.BlockCount = Writer->BlockCount;
+    Header.IndexOffset = Writer->Offset;
+    Header.Length = Writer->Length;
+
+    return _fseeki64(Writer->Output, 0, SEEK_SET) == 0 &&
+           fwrite(&Header, sizeof(Header), 1, Writer->Output) == 1 &&
+           fflush(Writer->Output) == 0;
+}
+
+BOOL
+LogPackFile(
+    _In_     PCSTR Source,
+    _In_     PCSTR Destination,
+    _In_     UINT16 Flags,
+    _In_opt_ volatile LONG* Running
+)
+{
+    LOG_PACK_WRITER Writer = { 0 };
+    Writer.Flags = Flags;
+    Writer.Running = Running;
+
+    if (fopen_s(&Writer.Input, Source, "rb") != 0 || Writer.Input == NULL)
+    {
+        return FALSE;
+    }
+
+    if (fopen_s(&Writer.Output, Destination, "wb") != 0 || Writer.Output == NULL)
+    {
+        fclose(Writer.Input);
+        return FALSE;
+    }
+
+    Writer.Data = malloc(LOG_PACK_BUFFER_SIZE);
+    Writer.Packed = malloc(LOG_PACK_BOUND(LOG_PACK_MAX_BLOCK));
+
+    BOOL IsPacked = Writer.Data != NULL && Writer.Packed != NULL && LogPackWrite( &Writer );
+
+    free(Writer.Blocks);
+    free(Writer.Packed);
+    free(Writer.Data);
+
+    fclose(Writer.Input);
+
+    if (fclose(Writer.Output) != 0)
+    {
+        IsPacked = FALSE;
+    }
+
+    return IsPacked;
+}
@@ -0,0 +1,224 @@
+#ifndef LOGPACK_H
+#define LOGPACK_H
+
+#include "logformat.h"
+
+/**
+    * Compressed log file layout, written by the logger's compression thread for files it rotated
+    * away from and read back by logtool.
+    *
+    * The original file is cut into blocks of about LOG_PACK_BLOCK_SIZE bytes, text files at the end
+    * of a line and binary files at the end of a record, and every block is compressed on its own
+    * with a byte oriented LZ77 coder of the LZ4 kind. The index at the end of the file gives the
+    * offset and the time of the earliest and latest record of every block, so a time range is read by
+    * decompressing only the blocks that overlap it.
+    *
+    * The file starts with LOG_PACK_HEADER, followed by the blocks and then BlockCount
+    * LOG_PACK_BLOCK entries at IndexOffset. A block that does not compress is stored as is, its
+    * PackedLength then equals its Length.
+    *
+    * A compressed block is a list of sequences, each a token, the literal run and a match:
+    *     token         high nibble literal count, low nibble match length - LOG_PACK_MIN_MATCH,
+    *                   15 in either nibble continues the count in the following bytes, each byte
+    *                   adds its value and 255 continues further
+    *     literals      copied as they are
+    *     match offset  UINT16 distance back into the decompressed data, then the match length bytes
+    * The last sequence ends after its literals and has no match.
+    *
+    * The same coder compresses frames on the relay connection (see netpack.h), where a block may
+    * also be compressed against a dictionary both ends hold: the dictionary is taken to precede the
+    * block, so a match offset may reach back past the start of the block into its end.
+*/
+
+#define LOG_PACK_MAGIC 0x425A4C50   // "PLZB"
+#define LOG_PACK_VERSION 1
+#define LOG_PACK_EXTENSION ".lzb"   // appended to the name of the original file
+
+#define LOG_PACK_BLOCK_SIZE 0x10000 // bytes a block is cut at
+#define LOG_PACK_MAX_BLOCK ( LOG_PACK_BLOCK_SIZE + sizeof(LOG_RECORD_HEADER) + LOG_MAX_RECORD )
+#define LOG_PACK_MIN_MATCH 4
+#define LOG_PACK_MAX_OFFSET 0xFFFF
+
+// largest compressed form of a block of the given size, room for the uncompressible case
+#define LOG_PACK_BOUND(Length) ( (Length) + (Length) / 255 + 16 )
+
+#define LOG_PACK_HASH_BITS 12
+#define LOG_PACK_MAX_DICTIONARY 0x8000 // bytes of a dictionary, matches into it stay within LOG_PACK_MAX_OFFSET
+
+/**
+    * Time index of a log file the logger is writing, named like the log file with
+    * LOG_INDEX_EXTENSION appended. It starts with LOG_INDEX_HEADER. The logger appends one
+    * LOG_PACK_BLOCK for each span of about LOG_INDEX_INTERVAL bytes of the log file once the span is
+    * complete, so readers never see a partial entry. Offset is where the span starts in the log
+    * file, PackedLength equals Length and a span is read like a block stored as is. Spans end on
+    * records.
+    *
+    * The end of the log file after the last entry is not indexed yet and has to be read whole. So
+    * are bytes written by a run that ended without indexing them.
+*/
+
+#define LOG_INDEX_MAGIC 0x58494C50  // "PLIX"
+#define LOG_INDEX_VERSION 1
+#define LOG_INDEX_EXTENSION ".idx"  // appended to the name of the log file
+#define LOG_INDEX_INTERVAL LOG_PACK_BLOCK_SIZE
+
+typedef enum _LOG_PACK_FLAGS
+{
+    LOG_PACK_FLAG_BINARY = 0x0001  // the original is a binary log file, blocks end on records
+} LOG_PACK_FLAGS;
+
+#pragma pack(push, 1)
+
+typedef struct _LOG_PACK_HEADER
+{
+    UINT32 Magic;
+    UINT16 Version;
+    UINT16 Flags;          // LOG_PACK_FLAGS
+    UINT32 BlockCount;
+    UINT32 Reserved;
+    UINT64 IndexOffset;
+    UINT64 Length;         // bytes in all blocks together
+} LOG_PACK_HEADER, *PLOG_PACK_HEADER;
+
+typedef struct _LOG_PACK_BLOCK
+{
+    UINT64 Offset;         // file offset of the compressed block
+    UINT64 EarliestTime;   // local FILETIME of the earliest record in the block, 0 if none has one
+    UINT64 LatestTime;     // local FILETIME of the latest record in the block
+    UINT32 PackedLength;
+    UINT32 Length;
+} LOG_PACK_BLOCK, *PLOG_PACK_BLOCK;
+
+typedef struct _LOG_INDEX_HEADER
+{
+    UINT32 Magic;
+    UINT16 Version;
+    UINT16 Flags;          // LOG_PACK_FLAGS of the log file
+} LOG_INDEX_HEADER, *PLOG_INDEX_HEADER;
+
+#pragma pack(pop)
+
+/**
+* A dictionary with the positions of its sequences hashed, prepared once by LogPackPrepareDictionary
+* and shared by every compression that uses it.
+*/
+typedef struct _LOG_PACK_DICTIONARY
+{
+    const UINT8* Data;     // owned by the caller, valid as long as the dictionary is used
+    ULONG        Length;
+    ULONG        Table[1 << LOG_PACK_HASH_BITS]; // position + 1 of the last place every hashed sequence was seen
+} LOG_PACK_DICTIONARY, *PLOG_PACK_DICTIONARY;
+
+/**
+* Compresses one block.
+*
+* @param Source            Data to compress.
+* @param Length            Size of Source, at most LOG_PACK_MAX_BLOCK.
+* @param Destination       Receives the compressed block.
+* @param DestinationSize   Size of Destination.
+*
+* @return Size of the compressed block, 0 if it does not fit in Destination.
+*/
+ULONG
+LogPackCompress(
+    _In_  const UINT8* Source,
+    _In_  ULONG Length,
+    _Out_ UINT8* Destination,
+    _In_  ULONG DestinationSize
+);
+
+/**
+* Decompresses one block, checking every length and offset against both buffers.
+*
+* @param Source       Compressed block.
+* @param PackedLength Size of Source.
+* @param Destination  Receives the original data.
+* @param Length       Size of the original data.
+*
+* @return TRUE if the block decompressed to exactly Length bytes, FALSE if it is corrupt.
+*/
+BOOL
+LogPackDecompress(
+    _In_  const UINT8* Source,
+    _In_  ULONG PackedLength,
+    _Out_ UINT8* Destination,
+    _In_  ULONG Length
+);
+
+/**
+* Hashes the sequences of a dictionary.
+*
+* @param Dictionary Receives the prepared dictionary.
+* @param Data       Dictionary data, its most useful content last, kept by the caller.
+* @param Length     Size of Data, only the last LOG_PACK_MAX_DICTIONARY bytes are used.
+*/
+VOID
+LogPackPrepareDictionary(
+    _Out_ PLOG_PACK_DICTIONARY Dictionary,
+    _In_  const UINT8* Data,
+    _In_  ULONG Length
+);
+
+/**
+* Like LogPackCompress, with matches into a dictionary as well.
+*
+* @param Dictionary Prepared dictionary, NULL to compress the block on its own.
+*/
+ULONG
+LogPackCompressDictionary(
+    _In_opt_ const LOG_PACK_DICTIONARY* Dictionary,
+    _In_     const UINT8* Source,
+    _In_     ULONG Length,
+    _Out_    UINT8* Destination,
+    _In_     ULONG DestinationSize
+);
+
+/**
+* Like LogPackDecompress, for a block compressed against a dictionary.
+*
+* @param Dictionary The dictionary the block was compressed with, NULL if none.
+*/
+BOOL
+LogPackDecompressDictionary(
+    _In_opt_ const LOG_PACK_DICTIONARY* Dictionary,
+    _In_     const UINT8* Source,
+    _In_     ULONG PackedLength,
+    _Out_    UINT8* Destination,
+    _In_     ULONG Length
+);
+
+/**
+* Reads the timestamp at the start of a text or JSON logger line.
+*
+* @param Data   Start of the line.
+* @param Length Bytes available at Data.
+*
+* @return Local FILETIME of the line, 0 if it does not start with a timestamp.
+*/
+UINT64
+LogPackLineTime(
+    _In_ const UINT8* Data,
+    _In_ ULONG Length
+);
+
+/**
+* Compresses a log file. Zero bytes at the end of a text file, left by a preallocated file that was
+* not closed cleanly, are dropped. Binary files keep them, the decoder skips them as padding.
+*
+* @param Source      Log file to compress, left in place.
+* @param Destination Compressed file to create, replaced if it exists.
+* @param Flags       LOG_PACK_FLAGS of the original.
+* @param Running     Optional, compression stops when it drops to 0.
+*
+* @return TRUE if the whole file was compressed, FALSE otherwise. Destination is incomplete then
+*         and should be deleted.
+*/
+BOOL
+LogPackFile(
+    _In_     PCSTR Source,
+    _In_     PCSTR Destination,
+    _In_     UINT16 Flags,
+    _In_opt_ volatile LONG* Running
+);
+
+#endif // !LOGPACK_H
@@ -0,0 +1,203 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include "winnet.h"
+
+/**
+    * Typed payloads of the chat level frames: MESSAGE_TYPE_CHAT, _JOIN, _LEAVE, _ACK, _PRESENCE,
+    * _CONTROL and _ERROR.
+    *
+    * Each is a packed struct of fixed size fields in network byte order, read where the frame was
+    * received: Message<Name>View checks the payload is long enough and returns it as the struct,
+    * the field accessors read one field each, and Message<Name>Tail gives the text that follows the
+    * fields in CHAT and ERROR, which is not NUL terminated. Nothing is parsed or copied up front, a
+    * handler pays only for the fields it reads. Message<Name>Encode writes a whole payload.
+    *
+    * Every message is generated from the list of its fields below, so adding a field to a list is
+    * all it takes to get its member, accessors and encode parameter. Changing a list changes the
+    * wire format and takes a new PROTOCOL_VERSION.
+*/
+
+#define MESSAGE_LEAVE_QUIT 1         // the client asked to leave
+#define MESSAGE_LEAVE_DISCONNECTED 2 // the connection closed or failed
+#define MESSAGE_LEAVE_TIMEOUT 3      // the client sent nothing for too long
+#define MESSAGE_LEAVE_REPAIRED 4     // the client paired with another client
+
+#define MESSAGE_PRESENCE_ONLINE 1
+#define MESSAGE_PRESENCE_AWAY 2
+#define MESSAGE_PRESENCE_BUSY 3
+
+#define MESSAGE_CONTROL_PING 1       // answered with MESSAGE_CONTROL_PONG carrying the same argument
+#define MESSAGE_CONTROL_PONG 2
+
+#define MESSAGE_ERROR_MALFORMED 1    // a payload was shorter than its message
+#define MESSAGE_ERROR_UNSUPPORTED 2  // a message the receiver does not handle
+#define MESSAGE_ERROR_PROTOCOL 3     // the connection broke the protocol and is closed
+#define MESSAGE_ERROR_RATE_LIMITED 4 // the client sent faster than the server's limits and is closed
+
+//
+// The fields of every message, in wire order.
+//
+
+#define MESSAGE_CHAT_FIELDS(FIELD, Name, Struct)              \
+    FIELD(Name, Struct, UINT32, Sequence) /* numbered by the sender, acknowledged by MESSAGE_TYPE_ACK */ \
+    FIELD(Name, Struct, UINT32, SenderId) /* 0 from a client, the server fills in who sent it */
+
+#define MESSAGE_JOIN_FIELDS(FIELD, Name, Struct)              \
+    FIELD(Name, Struct, UINT32, ClientId) /* client the server paired us with */
+
+#define MESSAGE_LEAVE_FIELDS(FIELD, Name, Struct)             \
+    FIELD(Name, Struct, UINT32, ClientId) /* client that left, 0 from the client leaving */ \
+    FIELD(Name, Struct, UINT16, Reason)   /* MESSAGE_LEAVE_* */
+
+#define MESSAGE_ACK_FIELDS(FIELD, Name, Struct)               \
+    FIELD(Name, Struct, UINT32, Sequence)
+
+#define MESSAGE_PRESENCE_FIELDS(FIELD, Name, Struct)          \
+    FIELD(Name, Struct, UINT32, ClientId) /* 0 from a client, the server fills it in */ \
+    FIELD(Name, Struct, UINT8,  State)    /* MESSAGE_PRESENCE_* */
+
+#define MESSAGE_CONTROL_FIELDS(FIELD, Name, Struct)           \
+    FIELD(Name, Struct, UINT16, Command)  /* MESSAGE_CONTROL_* */ \
+    FIELD(Name, Struct, UINT64, Argument)
+
+#define MESSAGE_ERROR_FIELDS(FIELD, Name, Struct)             \
+    FIELD(Name, Struct, UINT16, Code)     /* MESSAGE_ERROR_* */ \
+    FIELD(Name, Struct, UINT16, Type)     /* MESSAGE_TYPE of the frame at fault, 0 if none */
+
+//////////////////////////////////////////
+//
+//          FIELD ACCESS
+//
+//////////////////////////////////////////
+
+/**
+* Converts a 64 bit value between host and network byte order, reading its bytes as they lie in
+* memory most significant first. The same on either kind of host, where compilers turn it into a
+* single byte swap or nothing.
+*/
+static
+__forceinline
+UINT64
+MessageSwap64(
+    _In_ UINT64 Value
+)
+{
+    UINT8 Bytes[sizeof(Value)];
+    memcpy(Bytes, &Value, sizeof(Bytes));
+
+    return ( (UINT64)Bytes[0] << 56 ) | ( (UINT64)Bytes[1] << 48 ) | ( (UINT64)Bytes[2] << 40 ) | ( (UINT64)Bytes[3] << 32 ) |
+           ( (UINT64)Bytes[4] << 24 ) | ( (UINT64)Bytes[5] << 16 ) | ( (UINT64)Bytes[6] << 8 ) | Bytes[7];
+}
+
+// fields are unaligned inside the frame, memcpy compiles to a plain load
+#define MESSAGE_READ_UINT8(Field)  (*(const UINT8*)(Field))
+#define MESSAGE_READ_UINT16(Field) ntohs(MessageLoad16(Field))
+#define MESSAGE_READ_UINT32(Field) ntohl(MessageLoad32(Field))
+#define MESSAGE_READ_UINT64(Field) MessageSwap64(MessageLoad64(Field))
+
+#define MESSAGE_WRITE_UINT8(Field, Value)  (*(UINT8*)(Field) = (Value))
+#define MESSAGE_WRITE_UINT16(Field, Value) MessageStore16(Field, htons(Value))
+#define MESSAGE_WRITE_UINT32(Field, Value) MessageStore32(Field, htonl(Value))
+#define MESSAGE_WRITE_UINT64(Field, Value) MessageStore64(Field, MessageSwap64(Value))
+
+#define MESSAGE_DEFINE_LOAD_STORE(Bits)                                   \
+    static __forceinline UINT##Bits MessageLoad##Bits(_In_ const VOID* Field) \
+    {                                                                     \
+        UINT##Bits Value;                                                 \
+        memcpy(&Value, Field, sizeof(Value));                             \
+        return Value;                                                     \
+    }                                                                     \
+    static __forceinline VOID MessageStore##Bits(_Out_ VOID* Field, _In_ UINT##Bits Value) \
+    {                                                                     \
+        memcpy(Field, &Value, sizeof(Value));                             \
+    }
+
+MESSAGE_DEFINE_LOAD_STORE(16)
+MESSAGE_DEFINE_LOAD_STORE(32)
+MESSAGE_DEFINE_LOAD_STORE(64)
+
+//////////////////////////////////////////
+//
+//          GENERATORS
+//
+//////////////////////////////////////////
+
+#define MESSAGE_MEMBER(Name, Struct, Type, Field) Type Field;
+
+#define MESSAGE_ACCESSORS(Name, Struct, Type, Field)                      \
+    static __forceinline Type Message##Name##Field(_In_ const Struct* Message) \
+    {                                                                     \
+        return MESSAGE_READ_##Type(&Message->Field);                      \
+    }                                                                     \
+    static __forceinline VOID Message##Name##Set##Field(_Out_ Struct* Message, _In_ Type Value) \
+    {                                                                     \
+        MESSAGE_WRITE_##Type(&Message->Field, Value);                     \
+    }
+
+#define MESSAGE_PARAMETER(Name, Struct, Type, Field) _In_ Type Field,
+
+#define MESSAGE_ENCODE_FIELD(Name, Struct, Type, Field) Message##Name##Set##Field(Message, Field);
+
+/**
+* Generates for a message, inside #pragma pack(push, 1):
+*
+*     Struct, P##Struct             the payload as it lies in the frame
+*     Message##Name##View           the payload as Struct, NULL if it is too short
+*     Message##Name##Tail           the bytes after the fields and their count
+*     Message##Name##<Field>        reads a field
+*     Message##Name##Set<Field>     writes a field
+*     Message##Name##Encode         writes the fields and the tail to a buffer of at least
+*                                   sizeof(Struct) + TailLength bytes and returns the payload length
+*/
+#define MESSAGE_DEFINE(Name, Struct, FIELDS)                              \
+    typedef struct _##Struct                                              \
+    {                                                                     \
+        FIELDS(MESSAGE_MEMBER, Name, Struct)                              \
+    } Struct, *P##Struct;                                                 \
+                                                                          \
+    FIELDS(MESSAGE_ACCESSORS, Name, Struct)                               \
+                                                                          \
+    static __forceinline const Struct* Message##Name##View(_In_ const VOID* Payload, _In_ UINT16 Length) \
+    {                                                                     \
+        return (Length >= sizeof(Struct)) ? (const Struct*)Payload : NULL; \
+    }                                                                     \
+                                                                          \
+    static __forceinline const CHAR* Message##Name##Tail(_In_ const Struct* Message, _In_ UINT16 Length, _Out_ PUINT16 pTailLength) \
+    {                                                                     \
+        *pTailLength = (UINT16)(Length - sizeof(Struct));                 \
+        return (const CHAR*)(Message + 1);                                \
+    }                                                                     \
+                                                                          \
+    static __forceinline UINT16 Message##Name##Encode(_Out_ VOID* Buffer, FIELDS(MESSAGE_PARAMETER, Name, Struct) _In_opt_ const VOID* Tail, _In_ UINT16 TailLength) \
+    {                                                                     \
+        Struct* Message = (Struct*)Buffer;                                \
+        FIELDS(MESSAGE_ENCODE_FIELD, Name, Struct)                        \
+        if (TailLength != 0)                                              \
+        {                                                                 \
+            memcpy(Message + 1, Tail, TailLength);                        \
+        }                                                                 \
+        return (UINT16)(sizeof(Struct) + TailLength);                     \
+    }
+
+//////////////////////////////////////////
+//
+//          MESSAGES
+//
+//////////////////////////////////////////
+
+#pragma pack(push, 1)
+
+MESSAGE_DEFINE(Chat, CHAT_MESSAGE, MESSAGE_CHAT_FIELDS)             // followed by the text
+MESSAGE_DEFINE(Join, JOIN_MESSAGE, MESSAGE_JOIN_FIELDS)
+MESSAGE_DEFINE(Leave, LEAVE_MESSAGE, MESSAGE_LEAVE_FIELDS)
+MESSAGE_DEFINE(Ack, ACK_MESSAGE, MESSAGE_ACK_FIELDS)
+MESSAGE_DEFINE(Presence, PRESENCE_MESSAGE, MESSAGE_PRESENCE_FIELDS)
+MESSAGE_DEFINE(Control, CONTROL_MESSAGE, MESSAGE_CONTROL_FIELDS)
+MESSAGE_DEFINE(Error, ERROR_MESSAGE, MESSAGE_ERROR_FIELDS)          // followed by a description
+
+#pragma pack(pop)
+
+#define MESSAGE_MAX_CHAT_TEXT ( PROTOCOL_MAX_PAYLOAD_SIZE - sizeof(CHAT_MESSAGE) )
+
+#endif // !MESSAGE_H
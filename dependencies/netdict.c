@@ -0,0 +1,138 @@
+#include "netpack.h"
+
+/**
+* The shared chat dictionary, generated by 'netbench dictionary' from a corpus of 1472833 bytes.
+* Both ends of a connection have to hold these exact bytes, a new dictionary takes a new
+* capability bit (see netpack.h).
+*/
+const UINT8 NetPackDictionaryData[] =
+    " doc\? ok\012yeah, give me 28 minutes\012which version of mobile are yo"
+    "ne know why queue is so slow today\? on my way\012sounds good\012hey ca"
+    "gateway doc\?\012yeah, give me 58 minutes anyone know why mobile is "
+    "eference to `import_init'\012ok\012ok\012anyone know why scheduler is so "
+    "round\?\012thanks!\012did you see the video build failed again\? ok\012test"
+    "ur screen\? lol\012on my way\012brb brb just merged the analytics branc"
+    "nch\? error: login.c:1: undefined reference to `storage_init'\012np\012"
+    ", found it\012I'm pushing the fix for the frontend issue now\012can yo"
+    "\012ok I opened a ticket for the auth problem: #1954\012the chat servi"
+    "at work on the export demo today, quinn [17:00] WARN chat: conne"
+    "ch at 16:30\? yeah, give me 60 minutes yeah, give me 23 minutes d"
+    "e database demo today, casey brb\012yeah, give me 34 minutes\012tests "
+    "out me\012ok\012ok I'm pushing the fix for the onboarding issue now\012br"
+    "anything\012ok\012brb\012can you send me the link to the auth doc\?\012can we"
+    "he cluster review\012did you see the api build failed again\?\012here: "
+    "one know why backend is so slow today\?\012[9:15] WARN search: conne"
+    "as the cache config\012thanks!\012meeting moved to 9:45, same room let"
+    "round\?\012lol\012ok\012standup is at 18:15 yeah, give me 35 minutes\012brb I"
+    "g into it lol\012did you see the metrics build failed again\?\012that's"
+    " happy friday everyone! brb\012lol\012ok\012thanks! [14:45] WARN auth: co"
+    "ontend review\012yeah, give me 45 minutes never mind, found it\012ok\012t"
+    "u see the database build failed again\?\012lol did the search deploy"
+    " it was the login config ok\012ok ok\012ok\012just merged the chat branch"
+    "nk it's the relay cache, restarting it\012lol on my way\012jordan is o"
+    "ion of chat are you running\?\012meeting moved to 14:00, same room h"
+    "k about the storage release after lunch\? ok\012ok\012ok thanks!\012never "
+    "nd\?\012good morning everyone\012lol\012good morning everyone\012ok\012ok\012here: "
+    "e have the password for the billing dashboard\?\012lol\012lol\012ok can yo"
+    "he link to the docs doc\?\012lol\012can we talk about the mobile releas"
+    "h, give me 15 minutes\012on my way\012on my way\012yeah, give me 28 minut"
+    "see the login build failed again\?\012anyone know why profile is so "
+    "\012casey is out today, I'll cover the login review\012ok\012ok\012ok\012not ye"
+    "ve me 30 minutes ok\012lol\012yeah, give me 37 minutes\012hey drew, are y"
+    "u push\012ok error: search.c:28: undefined reference to `chat_init'"
+    "are you around\?\012did you see the chat build failed again\? that's "
+    "or the database issue now\012here: https://wiki.example.com/search/"
+    "ve me 8 minutes yeah, give me 27 minutes\012ok\012ok lol\012ok\012sam is out"
+    " me\012on my way I think it's the search cache, restarting it\012I'll "
+    "the payments migration\012on my way\012lol\012I think it's the api cache,"
+    "ogin issue now\012yeah, give me 18 minutes\012which version of api are"
+    "it\012ok\012I'm pushing the fix for the chat issue now\012thanks! tests a"
+    "t 15:15\?\012ok\012did the login deploy go out yet\?\012on my way ok\012I'm pu"
+    "'re free\012ok\012np thanks!\012on my way\012I think it's the profile cache,"
+    "ound it yeah, give me 21 minutes\012yeah, give me 22 minutes\012did yo"
+    " today\?\012thanks!\012yeah, give me 48 minutes\012lol thanks! lol the set"
+    "noor is out today, I'll cover the api review\012ok\012ok morgan is out"
+    "e to `search_init'\012ok\012what time is the standup tomorrow\? great w"
+    "eah, give me 7 minutes thanks!\012brb\012did you see the export build "
+    "e relay doc\?\012ok\012on my way\012thanks!\012ok ok\012np\012yeah, give me 2 minut"
+    "to the sync doc\?\012which version of search are you running\? thanks"
+    "e\012hey riley, are you around\?\012yeah, give me 19 minutes\012ok not yet"
+    " meeting moved to 12:00, same room\012lol\012[15:00] WARN login: conne"
+    "rting it\012ok np\012np\012lol\012sounds good\012thanks!\012yeah, give me 51 minut"
+    "und\?\012brb\012yeah, give me 5 minutes\012just merged the payments branch"
+    "t me\012lol\012anyone know why chat is so slow today\? I'll be 20 minut"
+    "push\012yeah, give me 40 minutes\012thanks!\012error: backend.c:30: undef"
+    "relay migration thanks!\012ok\012good morning everyone\012hey avery, are "
+    "e room\012thanks! ok anyone know why analytics is so slow today\? lo"
+    "u around\?\012can you send me the link to the chat doc\?\012ok\012ok\012who's "
+    "u running\? anyone know why login is so slow today\?\012ok\012lol\012standu"
+    "ve me 49 minutes\012yeah, give me 47 minutes\012thanks!\012thanks!\012here: "
+    " search dashboard\? which version of login are you running\?\012yeah,"
+    "anything\012alex is out today, I'll cover the search review I'm pus"
+    "g\012ETA 46 minutes\012brb\012ok\012ok ok ok sounds good\012the payments servic"
+    "ee\012thanks! meeting moved to 13:00, same room\012ok\012lol ok\012ok\012that's"
+    " at the lobby\012ok lol\012yeah, give me 33 minutes\012sounds good\012good m"
+    "for me\012lol\012ok\012ok\012great work on the payments demo today, sam\012good"
+    "nds good ok\012did you see the search build failed again\?\012ok\012just m"
+    "start without me it's back up, it was the payments config\012ok\012mee"
+    "now why search is so slow today\?\012yeah, give me 10 minutes sounds"
+    "yments problem: #216\012thanks!\012lol ok\012ok\012lol\012thanks!\012ok hey robin,"
+    "k yeah, give me 17 minutes\012can we talk about the payments releas"
+    "unch\?\012ok\012hey quinn, are you around\?\012sounds good\012ok hey noor, are"
+    "ard\?\012ok\012ok\012yeah, give me 14 minutes\012np [16:30] WARN payments: co"
+    "hen you have a moment\?\012hey jamie, are you around\?\012np alex, can y"
+    ", same room did the upload deploy go out yet\? sounds good\012standu"
+    "standup tomorrow\?\012never mind, found it\012thanks!\012I'll be 16 minute"
+    " the queue migration\012on my way can we talk about the import rele"
+    "r the video issue now\012ok\012yeah, give me 38 minutes\012hey kai, are y"
+    "bout the relay release after lunch\?\012did you see the relay build "
+    "he payments dashboard\?\012did the api deploy go out yet\?\012ok\012I'll wr"
+    " when you're free on my way thanks! did you see the cache build "
+    "\012alex is out today, I'll cover the docs review\012ok [12:15] WARN s"
+    "out the auth release after lunch\?\012ok\012meeting moved to 8:15, same"
+    "inutes ok meeting moved to 10:45, same room error: payments.c:48"
+    "xample.com/payments/6 yeah, give me 11 minutes hey taylor, are y"
+    " it's the cluster cache, restarting it thanks!\012the export servic"
+    "yments review yeah, give me 41 minutes\012good morning everyone ril"
+    "the settings migration\012sounds good\012lol\012ETA 43 minutes\012ok\012sure, p"
+    "e the password for the sync dashboard\?\012thanks!\012ok\012thanks!\012can yo"
+    "ion of payments are you running\?\012ok\012yeah, give me 12 minutes\012I'l"
+    " the metrics doc\?\012does anyone have the password for the gateway "
+    "5, same room\012anyone know why payments is so slow today\?\012not yet,"
+    "me the link to the payments doc\? just merged the storage branch,"
+    "machine\012yeah, give me 29 minutes\012ok\012I think it's the billing cac"
+    "the onboarding build failed again\?\012good morning everyone\012let me "
+    "\012lol\012hey morgan, are you around\? hey jordan, are you around\? ETA"
+    "ned reference to `payments_init'\012did you see the frontend build "
+    "\012hey casey, are you around\?\012hey sam, are you around\?\012I'll be 40 "
+    "er the chat review\012I'm pushing the fix for the notifications iss"
+    "you running\?\012hey alex, are you around\?\012on my way hey alex, are y"
+    "a ticket for the login problem: #5945\012thanks!\012sounds good\012I thin"
+    "r the mobile dashboard\?\012I'm in, meet at the lobby the scheduler "
+    "yments issue now\012I'm pushing the fix for the payments issue now "
+    "mo today, alex ok\012ETA 5 minutes\012ok the database service is down "
+    "8 minutes\012that's weird, it works for me thanks!\012standup is at 13"
+    "e me 4 minutes\012it's back up, it was the analytics config\012here: h"
+    "yments deploy go out yet\?\012did the profile deploy go out yet\?\012I t"
+    "\012great work on the backend demo today, jordan\012just merged the pa"
+    "ng are you running\?\012who's up for lunch at 12:15\? I'll write up t"
+    ": undefined reference to `mobile_init' I'm in, meet at the lobby"
+    "ot yet, waiting on the search migration\012I opened a ticket for th"
+    "\012on my way\012ok\012can you share your screen\?\012happy friday everyone!\012"
+    " it was the search config never mind, found it\012I think it's the "
+    "nts: connection reset by peer, retrying in 1 s\012which version of "
+    "meeting moved to 15:30, same room\012meeting moved to 13:30, same r"
+    ", can you take a look at my pull request when you have a moment\?"
+    "te up the notes and send them to the team\012can we talk about the "
+    "s weird, it works for me\012anyone know why relay is so slow today\?"
+    " release after lunch\? does anyone have the password for the rela"
+    "\012tests are green on my machine let me know if you need anything "
+    "ments cache, restarting it\012avery is out today, I'll cover the pa"
+    "s down again, looking into it\012what time is the standup tomorrow\?"
+    "thanks! good morning everyone ok here: https://wiki.example.com/"
+    "branch, please pull before you push\012I'm pushing the fix for the "
+    ", are you around\?\012ok\012sounds good sure, ping me when you're free\012"
+    " minutes late, start without me\012can you send me the link to the "
+    "\?\012did you see the payments build failed again\?\012yeah, give me 54 ";
+
+const ULONG NetPackDictionaryLength = sizeof(NetPackDictionaryData) - 1;
@@ -0,0 +1,548 @@
+#include "netio.h"
+
+/**
+* Sends what is left of the slices after the first Sent bytes with a single vectored send.
+*
+* @return Bytes sent, SOCKET_ERROR on failure.
+*/
+static
+INT
+NetSendRemaining(
+    _In_ SOCKET Socket,
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count,
+    _In_ ULONG Sent
+)
+{
+    NET_SLICE Remaining[NET_MAX_SLICES];
+    ULONG     RemainingCount = 0;
+
+    for (ULONG i = 0; i < Count && RemainingCount < NET_MAX_SLICES; ++i)
+    {
+        if (Sent >= Slices[i].Length)
+        {
+            Sent -= Slices[i].Length;
+            continue;
+        }
+
+        Remaining[RemainingCount].Data = (const CHAR*)Slices[i].Data + Sent;
+        Remaining[RemainingCount].Length = Slices[i].Length - Sent;
+        ++RemainingCount;
+        Sent = 0;
+    }
+
+    return NetSendVector(Socket, Remaining, RemainingCount);
+}
+
+/**
+* Total length of a list of slices.
+*/
+static
+ULONG
+NetSliceLength(
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count
+)
+{
+    ULONG Length = 0;
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        Length += Slices[i].Length;
+    }
+
+    return Length;
+}
+
+BOOL
+NetSendAll(
+    _In_ SOCKET Socket,
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count
+)
+{
+    ULONG Length = NetSliceLength(Slices, Count);
+    ULONG Sent = 0;
+
+    while (Sent < Length)
+    {
+        INT BytesSent = NetSendRemaining(Socket, Slices, Count, Sent);
+        if (BytesSent == SOCKET_ERROR)
+        {
+            if (!NetIsWouldBlock(WSAGetLastError()))
+            {
+                return FALSE;
+            }
+
+            // non-blocking socket with a full send buffer, give the peer a while to read
+            if (!NetWaitWritable(Socket, NET_SEND_WAIT))
+            {
+                WSASetLastError(WSAETIMEDOUT);
+                return FALSE;
+            }
+
+            continue;
+        }
+
+        Sent += (ULONG)BytesSent;
+    }
+
+    return TRUE;
+}
+
+NET_IO_STATUS
+NetSendPartial(
+    _In_    SOCKET Socket,
+    _In_    const NET_SLICE* Slices,
+    _In_    ULONG Count,
+    _Inout_ PULONG pSent
+)
+{
+    ULONG Length = NetSliceLength(Slices, Count);
+
+    while (*pSent < Length)
+    {
+        INT BytesSent = NetSendRemaining(Socket, Slices, Count, *pSent);
+        if (BytesSent == SOCKET_ERROR)
+        {
+            return NetIsWouldBlock(WSAGetLastError()) ? NET_IO_PENDING : NET_IO_FAILED;
+        }
+
+        *pSent += (ULONG)BytesSent;
+    }
+
+    return NET_IO_COMPLETE;
+}
+
+INT
+NetReceiveExact(
+    _In_  SOCKET Socket,
+    _Out_ PVOID Buffer,
+    _In_  ULONG Length
+)
+{
+    ULONG Received = 0;
+
+    while (Received < Length)
+    {
+        INT BytesReceived = recv(Socket, (PSTR)Buffer + Received, (INT)(Length - Received), 0);
+        if (BytesReceived <= 0)
+        {
+            return BytesReceived; // 0 on graceful close, SOCKET_ERROR otherwise
+        }
+
+        Received += (ULONG)BytesReceived;
+    }
+
+    return (INT)Received;
+}
+
+NET_IO_STATUS
+NetReceivePartial(
+    _In_    SOCKET Socket,
+    _Out_   PVOID Buffer,
+    _In_    ULONG Length,
+    _Inout_ PULONG pReceived
+)
+{
+    while (*pReceived < Length)
+    {
+        INT BytesReceived = recv(Socket, (PSTR)Buffer + *pReceived, (INT)(Length - *pReceived), 0);
+        if (BytesReceived == 0)
+        {
+            return NET_IO_CLOSED;
+        }
+
+        if (BytesReceived == SOCKET_ERROR)
+        {
+            return NetIsWouldBlock(WSAGetLastError()) ? NET_IO_PENDING : NET_IO_FAILED;
+        }
+
+        *pReceived += (ULONG)BytesReceived;
+    }
+
+    return NET_IO_COMPLETE;
+}
+
+INT
+NetReceiveToClose(
+    _In_  SOCKET Socket,
+    _Out_ PVOID Buffer,
+    _In_  ULONG Size
+)
+{
+    ULONG Received = 0;
+
+    while (Received < Size)
+    {
+        INT BytesReceived = recv(Socket, (PSTR)Buffer + Received, (INT)(Size - Received), 0);
+        if (BytesReceived == 0)
+        {
+            break;
+        }
+
+        if (BytesReceived == SOCKET_ERROR)
+        {
+            if (Received > 0 && NetIsTimeout(WSAGetLastError()))
+            {
+                break; // the peer answered but left the connection open
+            }
+
+            return SOCKET_ERROR;
+        }
+
+        Received += (ULONG)BytesReceived;
+    }
+
+    return (INT)Received;
+}
+
+//////////////////////////////////////////
+//
+//          CHUNK POOL
+//
+//////////////////////////////////////////
+
+VOID
+NetChunkPoolInitialise(
+    _Out_ PNET_CHUNK_POOL Pool,
+    _In_  ULONG MaxFree
+)
+{
+    for (ULONG Class = 0; Class < NET_CHUNK_CLASSES; ++Class)
+    {
+        Pool->Free[Class] = NULL;
+        Pool->FreeCount[Class] = 0;
+    }
+
+    Pool->MaxFree = MaxFree;
+}
+
+VOID
+NetChunkPoolCleanUp(
+    _Inout_ PNET_CHUNK_POOL Pool
+)
+{
+    for (ULONG Class = 0; Class < NET_CHUNK_CLASSES; ++Class)
+    {
+        while (Pool->Free[Class] != NULL)
+        {
+            PNET_CHUNK Chunk = Pool->Free[Class];
+            Pool->Free[Class] = Chunk->Next;
+            free(Chunk);
+        }
+
+        Pool->FreeCount[Class] = 0;
+    }
+}
+
+/**
+* Size class of the smallest chunk holding Length bytes, the largest class if none does.
+*/
+static
+ULONG
+NetChunkClass(
+    _In_ ULONG Length
+)
+{
+    ULONG Class = 0;
+
+    while (Class + 1 < NET_CHUNK_CLASSES && ((ULONG)NET_CHUNK_MIN_SIZE << (2 * Class)) < Length)
+    {
+        ++Class;
+    }
+
+    return Class;
+}
+
+/**
+* Takes an empty chunk of at least Length bytes from the pool, from the heap if the pool has none
+* of that size. Lengths over NET_CHUNK_SIZE get a chunk of NET_CHUNK_SIZE.
+*
+* @return The chunk, NULL if out of memory.
+*/
+static
+PNET_CHUNK
+NetChunkAllocate(
+    _In_ PNET_CHUNK_POOL Pool,
+    _In_ ULONG Length
+)
+{
+    ULONG Class = NetChunkClass(Length);
+
+    PNET_CHUNK Chunk = Pool->Free[Class];
+    if (Chunk != NULL)
+    {
+        Pool->Free[Class] = Chunk->Next;
+        --Pool->FreeCount[Class];
+    }
+    else
+    {
+        ULONG Capacity = (ULONG)NET_CHUNK_MIN_SIZE << (2 * Class);
+
+        Chunk = (PNET_CHUNK)malloc(sizeof(NET_CHUNK) + Capacity);
+        if (Chunk == NULL)
+        {
+            return NULL;
+        }
+
+        Chunk->Capacity = Capacity;
+    }
+
+    Chunk->Next = NULL;
+    Chunk->Length = 0;
+    return Chunk;
+}
+
+/**
+* Gives a chunk back to the pool, to the heap if the pool has enough of its size.
+*/
+static
+VOID
+NetChunkRelease(
+    _In_ PNET_CHUNK_POOL Pool,
+    _In_ PNET_CHUNK Chunk
+)
+{
+    ULONG Class = NetChunkClass(Chunk->Capacity);
+
+    if (Pool->FreeCount[Class] < Pool->MaxFree)
+    {
+        Chunk->Next = Pool->Free[Class];
+        Pool->Free[Class] = Chunk;
+        ++Pool->FreeCount[Class];
+        return;
+    }
+
+    free(Chunk);
+}
+
+//////////////////////////////////////////
+//
+//          READ BUFFER
+//
+//////////////////////////////////////////
+
+VOID
+NetBufferInitialise(
+    _Out_ PNET_READ_BUFFER Buffer,
+    _In_  PNET_CHUNK_POOL Pool
+)
+{
+    Buffer->Pool = Pool;
+    Buffer->Head = NULL;
+    Buffer->Tail = NULL;
+    Buffer->Offset = 0;
+    Buffer->Length = 0;
+}
+
+VOID
+NetBufferCleanUp(
+    _Inout_ PNET_READ_BUFFER Buffer
+)
+{
+    while (Buffer->Head != NULL)
+    {
+        PNET_CHUNK Chunk = Buffer->Head;
+        Buffer->Head = Chunk->Next;
+        NetChunkRelease(Buffer->Pool, Chunk);
+    }
+
+    Buffer->Tail = NULL;
+    Buffer->Offset = 0;
+    Buffer->Length = 0;
+}
+
+/**
+* Receives once into the buffer, taking a chunk for it first if the tail chunk is missing or full.
+* A new chunk is sized for the larger of Want and what the socket has waiting.
+*/
+static
+NET_IO_STATUS
+NetBufferReceiveInto(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    SOCKET Socket,
+    _In_    ULONG Want
+)
+{
+    if (Buffer->Tail == NULL || Buffer->Tail->Length == Buffer->Tail->Capacity)
+    {
+        PNET_CHUNK Chunk = NetChunkAllocate(Buffer->Pool, max(Want, NetReadableBytes(Socket)));
+        if (Chunk == NULL)
+        {
+            WSASetLastError(WSAENOBUFS);
+            return NET_IO_FAILED;
+        }
+
+        if (Buffer->Tail == NULL)
+        {
+            Buffer->Head = Chunk;
+        }
+        else
+        {
+            Buffer->Tail->Next = Chunk;
+        }
+
+        Buffer->Tail = Chunk;
+    }
+
+    PNET_CHUNK Tail = Buffer->Tail;
+
+    INT BytesReceived = recv(Socket, Tail->Data + Tail->Length, (INT)(Tail->Capacity - Tail->Length), 0);
+    if (BytesReceived <= 0)
+    {
+        NET_IO_STATUS Status = NET_IO_CLOSED;
+        if (BytesReceived == SOCKET_ERROR)
+        {
+            Status = NetIsWouldBlock(WSAGetLastError()) ? NET_IO_PENDING : NET_IO_FAILED;
+        }
+
+        // nothing arrived, an empty buffer holds no chunk while it waits
+        if (Buffer->Length == 0)
+        {
+            INT Error = WSAGetLastError();
+            NetBufferCleanUp(Buffer);
+            WSASetLastError(Error);
+        }
+
+        return Status;
+    }
+
+    Tail->Length += (ULONG)BytesReceived;
+    Buffer->Length += (ULONG)BytesReceived;
+    return NET_IO_COMPLETE;
+}
+
+NET_IO_STATUS
+NetBufferReceive(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    SOCKET Socket
+)
+{
+    return NetBufferReceiveInto(Buffer, Socket, 0);
+}
+
+NET_IO_STATUS
+NetBufferFill(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    SOCKET Socket,
+    _In_    ULONG Length
+)
+{
+    PNET_CHUNK Head = Buffer->Head;
+
+    // the unread bytes all sit in the only chunk and the rest would not fit behind them, move
+    // them to the front, or into a larger chunk if the whole run does not fit in this one
+    if (Buffer->Length < Length &&
+        Length <= NET_CHUNK_SIZE &&
+        Head != NULL &&
+        Head == Buffer->Tail &&
+        Buffer->Offset + Length > Head->Capacity)
+    {
+        if (Length > Head->Capacity)
+        {
+            PNET_CHUNK Larger = NetChunkAllocate(Buffer->Pool, Length);
+            if (Larger == NULL)
+            {
+                WSASetLastError(WSAENOBUFS);
+                return NET_IO_FAILED;
+            }
+
+            memcpy(Larger->Data, Head->Data + Buffer->Offset, Buffer->Length);
+            NetChunkRelease(Buffer->Pool, Head);
+
+            Head = Larger;
+            Buffer->Head = Larger;
+            Buffer->Tail = Larger;
+        }
+        else
+        {
+            memmove(Head->Data, Head->Data + Buffer->Offset, Buffer->Length);
+        }
+
+        Head->Length = Buffer->Length;
+        Buffer->Offset = 0;
+    }
+
+    while (Buffer->Length < Length)
+    {
+        NET_IO_STATUS Status = NetBufferReceiveInto(Buffer, Socket, Length - Buffer->Length);
+        if (Status != NET_IO_COMPLETE)
+        {
+            return Status;
+        }
+    }
+
+    return NET_IO_COMPLETE;
+}
+
+const CHAR*
+NetBufferView(
+    _In_ PNET_READ_BUFFER Buffer,
+    _In_ ULONG Length,
+    _Out_ PVOID Scratch
+)
+{
+    PNET_CHUNK Chunk = Buffer->Head;
+
+    if (Chunk == NULL || Chunk->Length - Buffer->Offset >= Length)
+    {
+        return (Chunk != NULL) ? Chunk->Data + Buffer->Offset : (const CHAR*)Scratch;
+    }
+
+    // spans chunks, gather it
+    ULONG Offset = Buffer->Offset;
+    ULONG Copied = 0;
+
+    while (Copied < Length && Chunk != NULL)
+    {
+        ULONG Available = min(Chunk->Length - Offset, Length - Copied);
+        memcpy((PSTR)Scratch + Copied, Chunk->Data + Offset, Available);
+        Copied += Available;
+        Offset = 0;
+        Chunk = Chunk->Next;
+    }
+
+    return (const CHAR*)Scratch;
+}
+
+VOID
+NetBufferConsume(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    ULONG Length
+)
+{
+    Length = min(Length, Buffer->Length);
+    Buffer->Length -= Length;
+    Buffer->Offset += Length;
+
+    while (Buffer->Head != Buffer->Tail && Buffer->Offset >= Buffer->Head->Length)
+    {
+        PNET_CHUNK Chunk = Buffer->Head;
+        Buffer->Offset -= Chunk->Length;
+        Buffer->Head = Chunk->Next;
+        NetChunkRelease(Buffer->Pool, Chunk);
+    }
+
+    // everything read, the last chunk goes back too and the next receive takes one for its data
+    if (Buffer->Length == 0)
+    {
+        NetBufferCleanUp(Buffer);
+    }
+}
+
+VOID
+NetBufferRead(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _Out_   PVOID Destination,
+    _In_    ULONG Length
+)
+{
+    const CHAR* Bytes = NetBufferView(Buffer, Length, Destination);
+    if (Bytes != (const CHAR*)Destination)
+    {
+        memcpy(Destination, Bytes, Length);
+    }
+
+    NetBufferConsume(Buffer, Length);
+}
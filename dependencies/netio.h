@@ -0,0 +1,243 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include "winnet.h"
+
+/**
+    * Socket I/O helpers shared by the client and the relay server.
+    *
+    * Sends take a list of NET_SLICE so a frame header and its payload go out in one vectored call
+    * without being copied into a frame buffer first. The blocking helpers loop until everything
+    * is sent or received. The partial ones are for non-blocking sockets: they stop when the socket
+    * would block, report how far they got and carry on from there on the next call.
+    *
+    * Received data is kept in a NET_READ_BUFFER, a read cursor over a list of NET_CHUNK taken
+    * from a NET_CHUNK_POOL. A buffer holds chunks only while it has unread bytes: the first chunk
+    * is taken when a receive brings data in, sized to what the socket has waiting, and the last
+    * one goes back to the pool as soon as everything is consumed, so an idle connection holds no
+    * receive memory. A single receive may bring in several frames. A frame whose bytes are in one
+    * chunk is handed out where it lies instead of being copied, the buffer keeps the next frame in
+    * one chunk whenever it fits.
+*/
+
+#define NET_CHUNK_CLASSES  5      // chunk sizes a pool hands out, each four times the one before
+#define NET_CHUNK_MIN_SIZE 256    // bytes of data in the smallest chunk, a chat line fits
+#define NET_CHUNK_SIZE     65536  // bytes of data in the largest chunk, a whole bulk frame fits
+#define NET_CHUNK_POOL_DEFAULT 64 // free chunks of each size a pool keeps, more are given back to the heap
+#define NET_SEND_WAIT      5000   // milliseconds NetSendAll waits for a non-blocking socket to take more
+
+typedef enum _NET_IO_STATUS
+{
+    NET_IO_COMPLETE = 0,  // everything asked for was sent or received
+    NET_IO_PENDING,       // the socket would block, the progress so far is recorded
+    NET_IO_CLOSED,        // the peer closed the connection
+    NET_IO_FAILED         // the socket failed, see WSAGetLastError
+} NET_IO_STATUS;
+
+typedef struct _NET_CHUNK
+{
+    struct _NET_CHUNK* Next;
+    ULONG              Length;   // bytes of Data filled
+    ULONG              Capacity; // bytes of Data, the size of its class
+    CHAR               Data[];
+} NET_CHUNK, *PNET_CHUNK;
+
+/**
+* Free chunks of every size class for the read buffers drawing from it. A pool belongs to one
+* thread, the buffers drawing from it are read and cleaned up by that thread only.
+*/
+typedef struct _NET_CHUNK_POOL
+{
+    PNET_CHUNK Free[NET_CHUNK_CLASSES];
+    ULONG      FreeCount[NET_CHUNK_CLASSES];
+    ULONG      MaxFree;   // free chunks kept of each class, the rest are freed
+} NET_CHUNK_POOL, *PNET_CHUNK_POOL;
+
+/**
+* Received bytes not read yet. Head holds the read cursor, receives append to Tail. Belongs to
+* one reader at a time.
+*/
+typedef struct _NET_READ_BUFFER
+{
+    PNET_CHUNK_POOL Pool;
+    PNET_CHUNK      Head;
+    PNET_CHUNK      Tail;
+    ULONG           Offset;    // read cursor within Head
+    ULONG           Length;    // unread bytes in all chunks together
+} NET_READ_BUFFER, *PNET_READ_BUFFER;
+
+/**
+* Sends all slices, looping over partial sends. On a non-blocking socket it waits up to
+* NET_SEND_WAIT for room each time the socket would block and fails with WSAETIMEDOUT after that.
+*
+* @param Socket Connected socket.
+* @param Slices Data to send, in order.
+* @param Count  Entries in Slices, at most NET_MAX_SLICES.
+*
+* @return TRUE if everything was sent, FALSE on failure.
+*/
+BOOL
+NetSendAll(
+    _In_ SOCKET Socket,
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count
+);
+
+/**
+* Sends as much of the slices as a non-blocking socket takes.
+*
+* @param Socket Connected socket.
+* @param Slices Data to send, the same every call until the send completes.
+* @param Count  Entries in Slices, at most NET_MAX_SLICES.
+* @param pSent  Bytes of the slices already sent, 0 on the first call, advanced by the call.
+*
+* @return NET_IO_COMPLETE once everything is sent, NET_IO_PENDING if the socket would block.
+*/
+NET_IO_STATUS
+NetSendPartial(
+    _In_    SOCKET Socket,
+    _In_    const NET_SLICE* Slices,
+    _In_    ULONG Count,
+    _Inout_ PULONG pSent
+);
+
+/**
+* Receives exactly Length bytes into Buffer, looping over partial receives. For blocking sockets.
+*
+* @return Length, 0 if the peer closed the connection first, SOCKET_ERROR on failure.
+*/
+INT
+NetReceiveExact(
+    _In_  SOCKET Socket,
+    _Out_ PVOID Buffer,
+    _In_  ULONG Length
+);
+
+/**
+* Receives into Buffer until it holds Length bytes or a non-blocking socket would block.
+*
+* @param pReceived Bytes of Buffer already filled, 0 on the first call, advanced by the call.
+*
+* @return NET_IO_COMPLETE once Length bytes are in, NET_IO_PENDING if the socket would block.
+*/
+NET_IO_STATUS
+NetReceivePartial(
+    _In_    SOCKET Socket,
+    _Out_   PVOID Buffer,
+    _In_    ULONG Length,
+    _Inout_ PULONG pReceived
+);
+
+/**
+* Receives until the peer closes the connection or Buffer is full, for request/response
+* exchanges where the server closes after its answer. For blocking sockets, a receive timeout
+* after some bytes arrived also ends the response.
+*
+* @return Bytes received, SOCKET_ERROR on failure.
+*/
+INT
+NetReceiveToClose(
+    _In_  SOCKET Socket,
+    _Out_ PVOID Buffer,
+    _In_  ULONG Size
+);
+
+/**
+* Prepares a chunk pool.
+*
+* @param Pool    Pool to prepare.
+* @param MaxFree Free chunks of each size to keep for reuse.
+*/
+VOID
+NetChunkPoolInitialise(
+    _Out_ PNET_CHUNK_POOL Pool,
+    _In_  ULONG MaxFree
+);
+
+/**
+* Frees the chunks a pool holds, every buffer drawing from it must be cleaned up first.
+*/
+VOID
+NetChunkPoolCleanUp(
+    _Inout_ PNET_CHUNK_POOL Pool
+);
+
+/**
+* Prepares an empty read buffer, it takes no chunk before the first receive.
+*/
+VOID
+NetBufferInitialise(
+    _Out_ PNET_READ_BUFFER Buffer,
+    _In_  PNET_CHUNK_POOL Pool
+);
+
+/**
+* Gives the buffer's chunks back to its pool, unread bytes are dropped.
+*/
+VOID
+NetBufferCleanUp(
+    _Inout_ PNET_READ_BUFFER Buffer
+);
+
+/**
+* Receives once into the buffer, as much as the socket has and the tail chunk takes. A chunk taken
+* for the receive goes straight back to the pool if nothing arrives.
+*
+* @return NET_IO_COMPLETE if bytes were added, NET_IO_PENDING if a non-blocking socket had none.
+*/
+NET_IO_STATUS
+NetBufferReceive(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    SOCKET Socket
+);
+
+/**
+* Receives until the buffer holds at least Length unread bytes, keeping them in one chunk when
+* Length fits in one, moving them into a larger chunk if need be. Blocks on a blocking socket, on a non-blocking one it returns
+* NET_IO_PENDING once the socket has no more.
+*/
+NET_IO_STATUS
+NetBufferFill(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    SOCKET Socket,
+    _In_    ULONG Length
+);
+
+/**
+* Gives access to the next Length unread bytes without consuming them. The bytes are returned
+* where they lie if they are in one chunk, otherwise they are copied to Scratch.
+*
+* @param Buffer  Buffer holding at least Length unread bytes.
+* @param Length  Bytes wanted.
+* @param Scratch At least Length bytes, used only when the bytes span chunks.
+*
+* @return The bytes, valid until the buffer is consumed or receives again.
+*/
+const CHAR*
+NetBufferView(
+    _In_ PNET_READ_BUFFER Buffer,
+    _In_ ULONG Length,
+    _Out_ PVOID Scratch
+);
+
+/**
+* Copies the next Length unread bytes out and consumes them.
+*/
+VOID
+NetBufferRead(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _Out_   PVOID Destination,
+    _In_    ULONG Length
+);
+
+/**
+* Moves the read cursor past Length bytes. Chunks read to the end go back to the pool, the last
+* one too once no unread bytes are left.
+*/
+VOID
+NetBufferConsume(
+    _Inout_ PNET_READ_BUFFER Buffer,
+    _In_    ULONG Length
+);
+
+#endif // !NETIO_H
@@ -0,0 +1,196 @@
+#include "netlimit.h"
+
+#define NET_LIMIT_SECOND 1000000000LL
+
+/**
+* @return Nanoseconds Units take to pay off at the rate of Limit.
+*/
+static
+LONG64
+NetLimitCost(
+    _In_ const NET_RATE_LIMIT* Limit,
+    _In_ ULONG Units
+)
+{
+    return (LONG64)Units * NET_LIMIT_SECOND / Limit->Rate;
+}
+
+/**
+* Takes Units from one bucket.
+*
+* @return 0 if taken, otherwise the nanoseconds until they can be.
+*/
+static
+LONG64
+NetLimitTakeRate(
+    _Inout_ volatile LONG64* Due,
+    _In_    const NET_RATE_LIMIT* Limit,
+    _In_    ULONG Units,
+    _In_    LONG64 Now
+)
+{
+    if (Limit->Rate == 0 || Units == 0)
+    {
+        return 0;
+    }
+
+    LONG64 Cost = NetLimitCost(Limit, Units);
+    LONG64 Tolerance = NetLimitCost(Limit, Limit->Burst);
+    LONG64 Seen = *Due;
+
+    while (TRUE)
+    {
+        // a full bucket owes nothing, whatever is taken is paid off from now
+        LONG64 Start = max(Seen, Now);
+        LONG64 Next = Start + Cost;
+
+        if (Start > Now && Next - Now > Tolerance)
+        {
+            // more than the burst only waits for the bucket to be full
+            return min(Next - Now - Tolerance, Start - Now);
+        }
+
+        LONG64 Previous = InterlockedCompareExchange64(Due, Next, Seen);
+        if (Previous == Seen)
+        {
+            return 0;
+        }
+
+        // another thread took from the bucket first, try again against what it left
+        Seen = Previous;
+    }
+}
+
+LONG64
+NetLimitNow(
+    VOID
+)
+{
+    LARGE_INTEGER Counter;
+    LARGE_INTEGER Frequency;
+    QueryPerformanceCounter(&Counter);
+    QueryPerformanceFrequency(&Frequency);
+
+    // split so the product cannot overflow however long the machine has been up
+    return (Counter.QuadPart / Frequency.QuadPart) * NET_LIMIT_SECOND +
+        (Counter.QuadPart % Frequency.QuadPart) * NET_LIMIT_SECOND / Frequency.QuadPart;
+}
+
+VOID
+NetLimitSet(
+    _Out_ PNET_RATE_LIMIT Limit,
+    _In_  ULONG Rate,
+    _In_  ULONG Burst
+)
+{
+    Limit->Rate = Rate;
+    Limit->Burst = max(Burst, 1);
+}
+
+LONG64
+NetLimitTake(
+    _Inout_ PNET_RATES Rates,
+    _In_    const NET_LIMITS* Limits,
+    _In_    ULONG Messages,
+    _In_    ULONG Bytes,
+    _In_    LONG64 Now
+)
+{
+    LONG64 Wait = NetLimitTakeRate(&Rates->Messages, &Limits->Messages, Messages, Now);
+    if (Wait != 0)
+    {
+        return Wait;
+    }
+
+    Wait = NetLimitTakeRate(&Rates->Bytes, &Limits->Bytes, Bytes, Now);
+    if (Wait != 0)
+    {
+        NetLimitGiveBack(Rates, Limits, Messages, 0);
+    }
+
+    return Wait;
+}
+
+VOID
+NetLimitGiveBack(
+    _Inout_ PNET_RATES Rates,
+    _In_    const NET_LIMITS* Limits,
+    _In_    ULONG Messages,
+    _In_    ULONG Bytes
+)
+{
+    if (Limits->Messages.Rate != 0 && Messages != 0)
+    {
+        InterlockedExchangeAdd64(&Rates->Messages, -NetLimitCost(&Limits->Messages, Messages));
+    }
+
+    if (Limits->Bytes.Rate != 0 && Bytes != 0)
+    {
+        InterlockedExchangeAdd64(&Rates->Bytes, -NetLimitCost(&Limits->Bytes, Bytes));
+    }
+}
+
+PNET_LIMIT_SENDER
+NetLimitAcquireSender(
+    _Inout_ PNET_LIMIT_TABLE Table,
+    _In_    UINT32 Address
+)
+{
+    ULONG Home = (Address * 2654435761u) >> (32 - NET_LIMIT_ADDRESS_BITS);
+
+    while (TRUE)
+    {
+        PNET_LIMIT_SENDER Claim = NULL;
+        LONG64 Seen = 0;
+
+        // the address's own slot first, it may still owe, otherwise the first slot nobody holds
+        for (ULONG i = 0; i < NET_LIMIT_ADDRESS_PROBES; ++i)
+        {
+            PNET_LIMIT_SENDER Sender = &Table->Senders[(Home + i) & (ARRAYSIZE(Table->Senders) - 1)];
+            LONG64 Key = Sender->Key;
+
+            if ((UINT32)((UINT64)Key >> 32) == Address)
+            {
+                Claim = Sender;
+                Seen = Key;
+                break;
+            }
+
+            if (Claim == NULL && (UINT32)Key == 0)
+            {
+                Claim = Sender;
+                Seen = Key;
+            }
+        }
+
+        if (Claim == NULL)
+        {
+            return NULL;
+        }
+
+        BOOL Own = (UINT32)((UINT64)Seen >> 32) == Address;
+        LONG64 Key = Own ? Seen + 1 : (LONG64)(((UINT64)Address << 32) | 1);
+
+        if (InterlockedCompareExchange64(&Claim->Key, Key, Seen) == Seen)
+        {
+            if (!Own)
+            {
+                // what the last address owed is not ours to pay
+                InterlockedExchange64(&Claim->Rates.Messages, 0);
+                InterlockedExchange64(&Claim->Rates.Bytes, 0);
+            }
+
+            return Claim;
+        }
+
+        // another client claimed or gave up the slot first, look again
+    }
+}
+
+VOID
+NetLimitReleaseSender(
+    _Inout_ PNET_LIMIT_SENDER Sender
+)
+{
+    InterlockedDecrement64(&Sender->Key);
+}
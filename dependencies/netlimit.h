@@ -0,0 +1,128 @@
+#ifndef NETLIMIT_H
+#define NETLIMIT_H
+
+#include "winnet.h"
+
+/**
+    * Token buckets limiting how fast a sender is served, one for the messages and one for the bytes
+    * it sends.
+    *
+    * A bucket is kept as the time at which everything taken from it is paid off, the generic cell
+    * rate algorithm: taking moves that time on by what was taken, and is refused while it lies
+    * further ahead than the burst. That is a single value, so taking from a bucket is one compare
+    * and exchange and any number of threads take from the same bucket without a lock.
+    *
+    * NET_LIMIT_TABLE holds the buckets of every sending address, so the clients connecting from one
+    * address share a limit whichever worker serves them. An address keeps its slot, and what it
+    * owes, while a client from it is connected and for as long after as nobody else needs the slot.
+*/
+
+#define NET_LIMIT_ADDRESS_BITS 15  // log2 of the addresses NET_LIMIT_TABLE tracks at once
+#define NET_LIMIT_ADDRESS_PROBES 8 // slots looked at for an address before it goes without a limit
+
+typedef struct _NET_RATE_LIMIT
+{
+    ULONG Rate;                    // units paid off per second, 0 for no limit
+    ULONG Burst;                   // units that may be taken at once
+} NET_RATE_LIMIT, *PNET_RATE_LIMIT;
+
+typedef struct _NET_LIMITS
+{
+    NET_RATE_LIMIT Messages;
+    NET_RATE_LIMIT Bytes;
+} NET_LIMITS, *PNET_LIMITS;
+
+typedef struct _NET_RATES
+{
+    volatile LONG64 Messages;      // NetLimitNow at which the messages taken are paid off
+    volatile LONG64 Bytes;         // the same for the bytes
+} NET_RATES, *PNET_RATES;
+
+typedef struct _NET_LIMIT_SENDER
+{
+    volatile LONG64 Key;           // address in the high half, clients holding the slot in the low half
+    NET_RATES Rates;
+} NET_LIMIT_SENDER, *PNET_LIMIT_SENDER;
+
+typedef struct _NET_LIMIT_TABLE
+{
+    NET_LIMIT_SENDER Senders[1 << NET_LIMIT_ADDRESS_BITS];
+} NET_LIMIT_TABLE, *PNET_LIMIT_TABLE;
+
+/**
+* @return The clock buckets are kept in, nanoseconds.
+*/
+LONG64
+NetLimitNow(
+    VOID
+);
+
+/**
+* Sets a limit, Rate units a second after a burst of Burst units.
+*/
+VOID
+NetLimitSet(
+    _Out_ PNET_RATE_LIMIT Limit,
+    _In_  ULONG Rate,
+    _In_  ULONG Burst
+);
+
+/**
+* Takes a message of some bytes from a sender's buckets, from both or from neither.
+*
+* A message larger than the burst is taken once the bucket is full, so a limit never refuses a
+* message for good.
+*
+* @param Rates    Buckets of the sender.
+* @param Limits   Limits of the buckets.
+* @param Messages Messages to take, 0 to take only bytes.
+* @param Bytes    Bytes to take.
+* @param Now      NetLimitNow.
+*
+* @return 0 if taken, otherwise the nanoseconds until they can be.
+*/
+LONG64
+NetLimitTake(
+    _Inout_ PNET_RATES Rates,
+    _In_    const NET_LIMITS* Limits,
+    _In_    ULONG Messages,
+    _In_    ULONG Bytes,
+    _In_    LONG64 Now
+);
+
+/**
+* Gives back what NetLimitTake took, for a message that was taken from one sender but refused by
+* another limit it is counted against.
+*/
+VOID
+NetLimitGiveBack(
+    _Inout_ PNET_RATES Rates,
+    _In_    const NET_LIMITS* Limits,
+    _In_    ULONG Messages,
+    _In_    ULONG Bytes
+);
+
+/**
+* Finds or claims the slot of an address for a client connecting from it.
+*
+* @param Table   Table of sending addresses.
+* @param Address IPv4 address of the client, network byte order.
+*
+* @return The slot, released with NetLimitReleaseSender, NULL if the table is too full around the
+*         address, the client is then only limited on its own.
+*/
+PNET_LIMIT_SENDER
+NetLimitAcquireSender(
+    _Inout_ PNET_LIMIT_TABLE Table,
+    _In_    UINT32 Address
+);
+
+/**
+* Gives up a slot once the client holding it is gone.
+*/
+VOID
+NetLimitReleaseSender(
+    _Inout_ PNET_LIMIT_SENDER Sender
+);
+
+#endif // !NETLIMIT_H
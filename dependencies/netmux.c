@@ -0,0 +1,591 @@
+#include "netmux.h"
+
+VOID
+NetMuxInitialise(
+    _Out_ PNET_MUX Mux,
+    _In_  SOCKET Socket
+)
+{
+    ZeroMemory(Mux, sizeof(*Mux));
+    InitializeCriticalSection(&Mux->Lock);
+    Mux->Socket = Socket;
+
+    for (UINT16 StreamId = 0; StreamId < PROTOCOL_MAX_STREAMS; ++StreamId)
+    {
+        PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+
+        Stream->Weight = (StreamId == STREAM_CONTROL || StreamId == STREAM_CHAT) ? NET_MUX_WEIGHT_INTERACTIVE : NET_MUX_WEIGHT_BULK;
+        Stream->SendWindow = PROTOCOL_STREAM_WINDOW;
+        Stream->ReceiveWindow = PROTOCOL_STREAM_WINDOW;
+    }
+}
+
+VOID
+NetMuxCleanUp(
+    _Inout_ PNET_MUX Mux
+)
+{
+    for (UINT16 StreamId = 0; StreamId < PROTOCOL_MAX_STREAMS; ++StreamId)
+    {
+        PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+
+        while (Stream->Head != NULL)
+        {
+            PNET_MUX_FRAME Frame = Stream->Head;
+            Stream->Head = Frame->Next;
+            free(Frame);
+        }
+
+        Stream->Tail = NULL;
+        Stream->Queued = 0;
+        Stream->Borrowing = 0;
+    }
+
+    if (Mux->Progress != NULL)
+    {
+        CloseHandle(Mux->Progress);
+        Mux->Progress = NULL;
+    }
+
+    DeleteCriticalSection(&Mux->Lock);
+}
+
+VOID
+NetMuxSetWeight(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    ULONG Weight
+)
+{
+    if (StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+    Mux->Streams[StreamId].Weight = max(Weight, 1);
+    LeaveCriticalSection(&Mux->Lock);
+}
+
+VOID
+NetMuxSetCompression(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    NET_PACK_MODE Mode
+)
+{
+    if (StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return;
+    }
+
+    InterlockedExchange(&Mux->Streams[StreamId].Compression, (LONG)Mode);
+}
+
+/**
+* Tells whether the first frame queued on a stream fits its window, caller holds the lock.
+*/
+static
+BOOL
+NetMuxCanSend(
+    _In_ PNET_MUX Mux,
+    _In_ UINT16 StreamId
+)
+{
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+
+    return Stream->Head != NULL &&
+           (StreamId == STREAM_CONTROL || Stream->Head->Length <= Stream->SendWindow);
+}
+
+/**
+* Takes the next frame to send off its queue in deficit round robin order, caller holds the lock.
+*
+* @return The frame, NULL if no stream has one it may send.
+*/
+static
+PNET_MUX_FRAME
+NetMuxNextFrame(
+    _Inout_ PNET_MUX Mux
+)
+{
+    // a stream with a frame larger than its quantum saves up over several rounds, so the search
+    // only ends once a whole round found no stream with anything it may send
+    ULONG Idle = 0;
+
+    while (Idle < PROTOCOL_MAX_STREAMS)
+    {
+        UINT16 StreamId = (UINT16)Mux->Current;
+        PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+
+        if (NetMuxCanSend(Mux, StreamId))
+        {
+            Idle = 0;
+
+            if (!Mux->TurnStarted)
+            {
+                Stream->Deficit += Stream->Weight * NET_MUX_QUANTUM;
+                Mux->TurnStarted = TRUE;
+            }
+
+            PNET_MUX_FRAME Frame = Stream->Head;
+            ULONG Size = sizeof(MESSAGE_HEADER) + Frame->Length;
+
+            if (Size <= Stream->Deficit)
+            {
+                Stream->Deficit -= Size;
+                Stream->Head = Frame->Next;
+                if (Stream->Head == NULL)
+                {
+                    Stream->Tail = NULL;
+                }
+
+                Stream->Queued -= Frame->Length;
+                if (StreamId != STREAM_CONTROL)
+                {
+                    Stream->SendWindow -= Frame->Length;
+                }
+
+                return Frame;
+            }
+        }
+        else
+        {
+            // a stream with nothing it may send does not save up for later
+            Stream->Deficit = 0;
+            ++Idle;
+        }
+
+        Mux->Current = (Mux->Current + 1) % PROTOCOL_MAX_STREAMS;
+        Mux->TurnStarted = FALSE;
+    }
+
+    return NULL;
+}
+
+/**
+* Sends queued frames until none may be sent, unless another thread is already doing so.
+*
+* @return FALSE if the connection failed.
+*/
+static
+BOOL
+NetMuxFlush(
+    _Inout_ PNET_MUX Mux
+)
+{
+    EnterCriticalSection(&Mux->Lock);
+
+    if (Mux->Writing || Mux->Failed)
+    {
+        BOOL Healthy = !Mux->Failed;
+        LeaveCriticalSection(&Mux->Lock);
+        return Healthy;
+    }
+
+    Mux->Writing = TRUE;
+
+    while (TRUE)
+    {
+        PNET_MUX_FRAME Batch[NET_MAX_SLICES];
+        NET_SLICE      Slices[NET_MAX_SLICES];
+        ULONG          Frames = 0;
+        ULONG          Count = 0;
+
+        // a frame takes two slices when it borrows part of its payload
+        while (Count + 2 <= NET_MAX_SLICES && (Batch[Frames] = NetMuxNextFrame(Mux)) != NULL)
+        {
+            PNET_MUX_FRAME Frame = Batch[Frames++];
+
+            Slices[Count].Data = Frame->Data;
+            Slices[Count].Length = sizeof(MESSAGE_HEADER) + Frame->CopiedLength;
+            ++Count;
+
+            if (Frame->Borrowed != NULL)
+            {
+                Slices[Count].Data = Frame->Borrowed;
+                Slices[Count].Length = Frame->Length - Frame->CopiedLength;
+                ++Count;
+            }
+        }
+
+        if (Frames == 0)
+        {
+            break;
+        }
+
+        // the lock is not held while sending, other threads keep queueing and the next batch
+        // picks up what they queued
+        LeaveCriticalSection(&Mux->Lock);
+
+        BOOL Sent = NetSendAll(Mux->Socket, Slices, Count);
+        INT Error = WSAGetLastError();
+
+        EnterCriticalSection(&Mux->Lock);
+
+        for (ULONG i = 0; i < Frames; ++i)
+        {
+            if (Batch[i]->Borrowed != NULL)
+            {
+                Mux->Streams[Batch[i]->StreamId].Borrowing -= Batch[i]->Length;
+            }
+
+            free(Batch[i]);
+        }
+
+        if (Mux->Progress != NULL)
+        {
+            SetEvent(Mux->Progress);
+        }
+
+        if (!Sent)
+        {
+            Mux->Failed = TRUE;
+            WSASetLastError(Error);
+            break;
+        }
+    }
+
+    Mux->Writing = FALSE;
+    BOOL Healthy = !Mux->Failed;
+
+    LeaveCriticalSection(&Mux->Lock);
+    return Healthy;
+}
+
+NET_IO_STATUS
+NetMuxSend(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    MESSAGE_TYPE Type,
+    _In_    const VOID* Payload,
+    _In_    UINT16 Length
+)
+{
+    return NetMuxSendBorrowed(Mux, StreamId, Type, Payload, Length, NULL, 0);
+}
+
+NET_IO_STATUS
+NetMuxSendBorrowed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    MESSAGE_TYPE Type,
+    _In_    const VOID* Prefix,
+    _In_    UINT16 PrefixLength,
+    _In_    const VOID* Data,
+    _In_    UINT16 DataLength
+)
+{
+    ULONG Length = (ULONG)PrefixLength + DataLength;
+
+    if (StreamId >= PROTOCOL_MAX_STREAMS || Length > PROTOCOL_MAX_FRAME_PAYLOAD(StreamId))
+    {
+        WSASetLastError(WSAEINVAL);
+        return NET_IO_FAILED;
+    }
+
+    PNET_MUX_FRAME Frame = (PNET_MUX_FRAME)malloc(sizeof(NET_MUX_FRAME) + sizeof(MESSAGE_HEADER) + PrefixLength);
+    if (Frame == NULL)
+    {
+        WSASetLastError(WSAENOBUFS);
+        return NET_IO_FAILED;
+    }
+
+    // a copied payload is compressed straight into the frame, which it only fits if it shrinks
+    UINT16 Flags = 0;
+    UINT16 Packed = 0;
+    if (DataLength == 0)
+    {
+        Packed = NetPackCompress((NET_PACK_MODE)Mux->Streams[StreamId].Compression, Prefix, PrefixLength, Frame->Data + sizeof(MESSAGE_HEADER), &Flags);
+    }
+
+    if (Packed != 0)
+    {
+        Length = Packed;
+        PrefixLength = Packed;
+    }
+    else
+    {
+        memcpy(Frame->Data + sizeof(MESSAGE_HEADER), Prefix, PrefixLength);
+    }
+
+    MESSAGE_HEADER Header;
+    Header.Type = htons((UINT16)Type);
+    Header.Length = htons((UINT16)Length);
+    Header.StreamId = htons(StreamId);
+    Header.Flags = htons(Flags);
+
+    Frame->Next = NULL;
+    Frame->StreamId = StreamId;
+    Frame->Length = (UINT16)Length;
+    Frame->CopiedLength = PrefixLength;
+    Frame->Borrowed = (DataLength != 0) ? (const CHAR*)Data : NULL;
+    memcpy(Frame->Data, &Header, sizeof(Header));
+
+    EnterCriticalSection(&Mux->Lock);
+
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+
+    if (Mux->Failed || (StreamId != STREAM_CONTROL && Stream->Queued + Length > NET_MUX_QUEUE_LIMIT))
+    {
+        NET_IO_STATUS Status = Mux->Failed ? NET_IO_FAILED : NET_IO_PENDING;
+        LeaveCriticalSection(&Mux->Lock);
+        free(Frame);
+        return Status;
+    }
+
+    if (Stream->Tail == NULL)
+    {
+        Stream->Head = Frame;
+    }
+    else
+    {
+        Stream->Tail->Next = Frame;
+    }
+
+    Stream->Tail = Frame;
+    Stream->Queued += Length;
+    if (Frame->Borrowed != NULL)
+    {
+        Stream->Borrowing += Length;
+    }
+
+    LeaveCriticalSection(&Mux->Lock);
+
+    return NetMuxFlush(Mux) ? NET_IO_COMPLETE : NET_IO_FAILED;
+}
+
+ULONG
+NetMuxBorrowed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId
+)
+{
+    if (StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return 0;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+    ULONG Borrowing = Mux->Streams[StreamId].Borrowing;
+    LeaveCriticalSection(&Mux->Lock);
+
+    return Borrowing;
+}
+
+VOID
+NetMuxDiscardBorrowed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId
+)
+{
+    if (StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+    PNET_MUX_FRAME* Link = &Stream->Head;
+
+    Stream->Tail = NULL;
+    while (*Link != NULL)
+    {
+        PNET_MUX_FRAME Frame = *Link;
+
+        if (Frame->Borrowed != NULL)
+        {
+            *Link = Frame->Next;
+            Stream->Queued -= Frame->Length;
+            Stream->Borrowing -= Frame->Length;
+            free(Frame);
+        }
+        else
+        {
+            Stream->Tail = Frame;
+            Link = &Frame->Next;
+        }
+    }
+
+    LeaveCriticalSection(&Mux->Lock);
+}
+
+VOID
+NetMuxWait(
+    _Inout_ PNET_MUX Mux,
+    _In_    DWORD Milliseconds
+)
+{
+    // made on first use, a connection nobody waits on never needs one
+    EnterCriticalSection(&Mux->Lock);
+    if (Mux->Progress == NULL)
+    {
+        Mux->Progress = CreateEventA(NULL, FALSE, FALSE, NULL);
+    }
+    HANDLE Progress = Mux->Progress;
+    LeaveCriticalSection(&Mux->Lock);
+
+    if (Progress == NULL)
+    {
+        Sleep(1);
+        return;
+    }
+
+    WaitForSingleObject(Progress, Milliseconds);
+}
+
+BOOL
+NetMuxReceived(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    UINT16 Length
+)
+{
+    if (StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return FALSE;
+    }
+
+    if (StreamId == STREAM_CONTROL)
+    {
+        return TRUE;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+    BOOL InWindow = Length <= Stream->ReceiveWindow;
+    if (InWindow)
+    {
+        Stream->ReceiveWindow -= Length;
+    }
+
+    LeaveCriticalSection(&Mux->Lock);
+    return InWindow;
+}
+
+/**
+* Sends a MESSAGE_TYPE_WINDOW_UPDATE granting a stream Increment more bytes.
+*/
+static
+VOID
+NetMuxSendUpdate(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    ULONG Increment
+)
+{
+    WINDOW_UPDATE_MESSAGE Update;
+    Update.StreamId = htons(StreamId);
+    Update.Reserved = 0;
+    Update.Increment = htonl(Increment);
+
+    NetMuxSend(Mux, STREAM_CONTROL, MESSAGE_TYPE_WINDOW_UPDATE, &Update, sizeof(Update));
+}
+
+VOID
+NetMuxConsumed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    UINT16 Length
+)
+{
+    if (StreamId == STREAM_CONTROL || StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+    ULONG Increment = 0;
+
+    Stream->Consumed += Length;
+    if (Stream->Consumed >= PROTOCOL_STREAM_WINDOW / 2)
+    {
+        Increment = Stream->Consumed;
+        Stream->ReceiveWindow += (LONG)Increment;
+        Stream->Consumed = 0;
+    }
+
+    LeaveCriticalSection(&Mux->Lock);
+
+    if (Increment != 0)
+    {
+        NetMuxSendUpdate(Mux, StreamId, Increment);
+    }
+}
+
+VOID
+NetMuxGrant(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    ULONG Increment
+)
+{
+    if (StreamId == STREAM_CONTROL || StreamId >= PROTOCOL_MAX_STREAMS)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+    ULONG Outstanding = (ULONG)(PROTOCOL_STREAM_WINDOW - Stream->ReceiveWindow);
+
+    Increment = min(Increment, Outstanding);
+    Stream->ReceiveWindow += (LONG)Increment;
+    Stream->Consumed = min(Stream->Consumed, Outstanding - Increment);
+
+    LeaveCriticalSection(&Mux->Lock);
+
+    if (Increment != 0)
+    {
+        NetMuxSendUpdate(Mux, StreamId, Increment);
+    }
+}
+
+BOOL
+NetMuxWindowUpdate(
+    _Inout_ PNET_MUX Mux,
+    _In_    const VOID* Payload,
+    _In_    UINT16 Length
+)
+{
+    WINDOW_UPDATE_MESSAGE Update;
+
+    if (Length != sizeof(Update))
+    {
+        return FALSE;
+    }
+
+    memcpy(&Update, Payload, sizeof(Update));
+
+    UINT16 StreamId = ntohs(Update.StreamId);
+    UINT32 Increment = ntohl(Update.Increment);
+
+    if (StreamId == STREAM_CONTROL || StreamId >= PROTOCOL_MAX_STREAMS || Increment > PROTOCOL_STREAM_WINDOW)
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&Mux->Lock);
+
+    PNET_MUX_STREAM Stream = &Mux->Streams[StreamId];
+    BOOL Valid = Stream->SendWindow + (LONG)Increment <= PROTOCOL_STREAM_WINDOW;
+    if (Valid)
+    {
+        Stream->SendWindow += (LONG)Increment;
+    }
+
+    if (Mux->Progress != NULL)
+    {
+        SetEvent(Mux->Progress);
+    }
+
+    LeaveCriticalSection(&Mux->Lock);
+
+    // frames the window held back go out now
+    return Valid && NetMuxFlush(Mux);
+}
@@ -0,0 +1,244 @@
+#ifndef NETMUX_H
+#define NETMUX_H
+
+#include "netio.h"
+#include "netpack.h"
+
+/**
+    * Logical streams multiplexed over one framed TCP connection, shared by the client and the
+    * relay server.
+    *
+    * Frames are queued per stream and sent by one writer at a time, which takes them off the queues
+    * in deficit weighted round robin: on its turn a stream may send its weight in NET_MUX_QUANTUM
+    * bytes, so an interactive frame waits behind at most one turn of a bulk stream however much the
+    * bulk stream has queued. Whichever thread finds no writer at work becomes the writer and sends
+    * until the queues are empty, the others only queue.
+    *
+    * Every stream but STREAM_CONTROL is flow controlled with a window of PROTOCOL_STREAM_WINDOW
+    * payload bytes. A stream out of window keeps its frames queued without holding up the others
+    * and the receiver grants more with MESSAGE_TYPE_WINDOW_UPDATE as it consumes what it received.
+    * The window also bounds how much of a bulk stream sits in the socket's send buffer in front of
+    * a chat frame.
+    *
+    * A frame may borrow the bulk of its payload instead of copying it, a file chunk then goes from
+    * the sender's mapping of the file straight into the vectored send. The caller keeps borrowed
+    * memory valid until NetMuxBorrowed shows the stream has sent the frame.
+    *
+    * A stream given a NET_PACK_MODE compresses the frames it queues as they are copied into the
+    * queue, see netpack.h. Borrowed payloads are never compressed, they go out as they lie.
+*/
+
+#define NET_MUX_QUANTUM PROTOCOL_MAX_PAYLOAD_SIZE          // bytes a stream may send per unit of weight on its turn
+#define NET_MUX_QUEUE_LIMIT (4 * PROTOCOL_STREAM_WINDOW)   // payload bytes queued on a stream before sends are refused
+#define NET_MUX_WEIGHT_INTERACTIVE 16                      // STREAM_CONTROL and STREAM_CHAT
+#define NET_MUX_WEIGHT_BULK 1                              // every other stream unless changed
+
+/**
+* A frame waiting in a stream's queue, header included so it leaves with no further copy.
+*/
+typedef struct _NET_MUX_FRAME
+{
+    struct _NET_MUX_FRAME* Next;
+    UINT16                 StreamId;
+    UINT16                 Length;       // payload bytes, the borrowed ones included
+    UINT16                 CopiedLength; // payload bytes in Data
+    const CHAR*            Borrowed;     // rest of the payload, owned by the caller, NULL if none
+    CHAR                   Data[];       // MESSAGE_HEADER followed by the copied part of the payload
+} NET_MUX_FRAME, *PNET_MUX_FRAME;
+
+typedef struct _NET_MUX_STREAM
+{
+    PNET_MUX_FRAME Head;          // queued frames, oldest first
+    PNET_MUX_FRAME Tail;
+    ULONG          Queued;        // payload bytes queued
+    ULONG          Borrowing;     // payload bytes of frames that borrow memory, queued or being sent
+    ULONG          Weight;
+    ULONG          Deficit;       // bytes the stream may still send on its current turn
+    LONG           SendWindow;    // payload bytes the peer takes before it grants more
+    LONG           ReceiveWindow; // payload bytes the peer may still send us
+    ULONG          Consumed;      // payload bytes consumed and not granted back yet
+    volatile LONG  Compression;   // NET_PACK_MODE of the frames queued from now on
+} NET_MUX_STREAM, *PNET_MUX_STREAM;
+
+typedef struct _NET_MUX
+{
+    CRITICAL_SECTION Lock;
+    SOCKET           Socket;
+    BOOL             Writing;     // a thread is sending, the others only queue
+    BOOL             Failed;      // a send failed, every later one fails too
+    ULONG            Current;     // stream whose turn it is
+    BOOL             TurnStarted; // Current has been given its quantum for this turn
+    HANDLE           Progress;    // auto reset, set after every batch sent, made by the first NetMuxWait
+    NET_MUX_STREAM   Streams[PROTOCOL_MAX_STREAMS];
+} NET_MUX, *PNET_MUX;
+
+/**
+* Prepares the streams of a connection with full windows, STREAM_CONTROL and STREAM_CHAT weighted
+* as interactive and the rest as bulk.
+*
+* @param Mux    Multiplexer to prepare.
+* @param Socket Connected socket the frames are sent on, blocking or not.
+*/
+VOID
+NetMuxInitialise(
+    _Out_ PNET_MUX Mux,
+    _In_  SOCKET Socket
+);
+
+/**
+* Drops the frames still queued. The socket is left open.
+*/
+VOID
+NetMuxCleanUp(
+    _Inout_ PNET_MUX Mux
+);
+
+/**
+* Changes the share of the connection a stream gets while others have frames queued.
+*
+* @param Weight Quanta per turn, at least 1.
+*/
+VOID
+NetMuxSetWeight(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    ULONG Weight
+);
+
+/**
+* Compresses the frames queued on a stream from now on, for the mode the connection negotiated.
+* Windows count payload bytes as they go on the wire, after compression.
+*/
+VOID
+NetMuxSetCompression(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    NET_PACK_MODE Mode
+);
+
+/**
+* Queues a frame on a stream and sends what the windows allow, unless another thread is already
+* sending, which then sends this frame too. Safe to call from any thread.
+*
+* @param Mux      Connection to send on.
+* @param StreamId Stream below PROTOCOL_MAX_STREAMS.
+* @param Type     MESSAGE_TYPE of the frame.
+* @param Payload  Payload, copied before the call returns.
+* @param Length   Size of Payload, at most PROTOCOL_MAX_FRAME_PAYLOAD of the stream.
+*
+* @return NET_IO_COMPLETE if the frame was queued, NET_IO_PENDING if the stream already has
+*         NET_MUX_QUEUE_LIMIT bytes queued and the frame was not, NET_IO_FAILED if the frame is
+*         invalid or the connection failed.
+*/
+NET_IO_STATUS
+NetMuxSend(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    MESSAGE_TYPE Type,
+    _In_    const VOID* Payload,
+    _In_    UINT16 Length
+);
+
+/**
+* Like NetMuxSend, but only Prefix is copied. Data is sent from where it lies and has to stay
+* valid and unchanged until NetMuxBorrowed of the stream no longer counts the frame.
+*
+* @param Prefix       Start of the payload, copied.
+* @param PrefixLength Size of Prefix.
+* @param Data         Rest of the payload, borrowed.
+* @param DataLength   Size of Data, together with PrefixLength at most PROTOCOL_MAX_FRAME_PAYLOAD.
+*/
+NET_IO_STATUS
+NetMuxSendBorrowed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    MESSAGE_TYPE Type,
+    _In_    const VOID* Prefix,
+    _In_    UINT16 PrefixLength,
+    _In_    const VOID* Data,
+    _In_    UINT16 DataLength
+);
+
+/**
+* Payload bytes of the frames on a stream that borrow memory, queued or being sent. Frames leave
+* in order, so a borrowing frame is sent once this drops to no more than the payload of the
+* borrowing frames queued after it.
+*/
+ULONG
+NetMuxBorrowed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId
+);
+
+/**
+* Drops the frames queued on a stream that borrow part of their payload, for a sender giving up
+* on what it queued. Frames the writer already took still go out, NetMuxBorrowed counts them.
+*/
+VOID
+NetMuxDiscardBorrowed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId
+);
+
+/**
+* Waits until the writer sends a batch or a window update arrives, for a thread whose send was
+* refused with NET_IO_PENDING or that waits for NetMuxBorrowed to drop.
+*
+* @param Milliseconds Longest wait.
+*/
+VOID
+NetMuxWait(
+    _Inout_ PNET_MUX Mux,
+    _In_    DWORD Milliseconds
+);
+
+/**
+* Accounts for a frame received from the peer, before it is handled.
+*
+* @return FALSE if the stream does not exist or the peer sent more than its window, either of
+*         which ends the connection.
+*/
+BOOL
+NetMuxReceived(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    UINT16 Length
+);
+
+/**
+* Gives the window of a handled frame back to the peer. Updates are batched, one goes out once
+* half a window has been consumed on the stream.
+*/
+VOID
+NetMuxConsumed(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    UINT16 Length
+);
+
+/**
+* Gives the peer window it has used on a stream back without waiting for the frames to be
+* consumed here, for a relay that hands its frames on and grants as the far end consumes them.
+* Clamped to what the peer has outstanding, so granting PROTOCOL_STREAM_WINDOW restores the whole
+* window. The update goes out at once.
+*/
+VOID
+NetMuxGrant(
+    _Inout_ PNET_MUX Mux,
+    _In_    UINT16 StreamId,
+    _In_    ULONG Increment
+);
+
+/**
+* Applies a MESSAGE_TYPE_WINDOW_UPDATE from the peer and sends the frames it unblocks.
+*
+* @return FALSE if the update is malformed or sending the unblocked frames failed.
+*/
+BOOL
+NetMuxWindowUpdate(
+    _Inout_ PNET_MUX Mux,
+    _In_    const VOID* Payload,
+    _In_    UINT16 Length
+);
+
+#endif // !NETMUX_H
@@ -0,0 +1,116 @@
+#include "netpack.h"
+
+static LOG_PACK_DICTIONARY NetPackShared;
+static volatile LONG NetPackSharedReady = FALSE;
+
+NET_PACK_MODE
+NetPackModeOf(
+    _In_ UINT32 Capabilities
+)
+{
+    if ((Capabilities & PROTOCOL_CAPABILITY_DICTIONARY) != 0)
+    {
+        return NET_PACK_DICTIONARY;
+    }
+
+    return ((Capabilities & PROTOCOL_CAPABILITY_COMPRESSION) != 0) ? NET_PACK_BLOCK : NET_PACK_NONE;
+}
+
+const LOG_PACK_DICTIONARY*
+NetPackDictionary(
+    VOID
+)
+{
+    // threads racing here prepare the same table, the flag is only set once it is complete
+    if (!NetPackSharedReady)
+    {
+        LogPackPrepareDictionary(&NetPackShared, NetPackDictionaryData, NetPackDictionaryLength);
+        InterlockedExchange(&NetPackSharedReady, TRUE);
+    }
+
+    return &NetPackShared;
+}
+
+UINT16
+NetPackCompress(
+    _In_  NET_PACK_MODE Mode,
+    _In_  const VOID* Payload,
+    _In_  UINT16 Length,
+    _Out_ CHAR* Buffer,
+    _Out_ PUINT16 pFlags
+)
+{
+    *pFlags = 0;
+
+    UINT16 Threshold = (Mode == NET_PACK_DICTIONARY) ? NET_PACK_DICTIONARY_THRESHOLD : NET_PACK_THRESHOLD;
+    if (Mode == NET_PACK_NONE || Length < Threshold)
+    {
+        return 0;
+    }
+
+    const LOG_PACK_DICTIONARY* Dictionary = (Mode == NET_PACK_DICTIONARY) ? NetPackDictionary() : NULL;
+
+    // the block has to come out at least a byte smaller than the payload, length included
+    ULONG Packed = LogPackCompressDictionary(
+        Dictionary,
+        (const UINT8*)Payload,
+        Length,
+        (UINT8*)Buffer + sizeof(UINT16),
+        Length - sizeof(UINT16) - 1
+    );
+
+    if (Packed == 0)
+    {
+        return 0;
+    }
+
+    UINT16 OriginalLength = htons(Length);
+    memcpy(Buffer, &OriginalLength, sizeof(OriginalLength));
+
+    *pFlags = (Dictionary != NULL) ? (MESSAGE_FLAG_COMPRESSED | MESSAGE_FLAG_DICTIONARY) : MESSAGE_FLAG_COMPRESSED;
+    return (UINT16)(Packed + sizeof(UINT16));
+}
+
+BOOL
+NetPackExpand(
+    _In_  UINT16 Flags,
+    _In_  const CHAR* Payload,
+    _In_  UINT16 Length,
+    _In_  UINT16 MaxLength,
+    _Out_ CHAR* Buffer,
+    _Out_ const CHAR** pPayload,
+    _Out_ PUINT16 pLength
+)
+{
+    if ((Flags & MESSAGE_FLAG_COMPRESSED) == 0)
+    {
+        *pPayload = Payload;
+        *pLength = Length;
+        return (Flags & MESSAGE_FLAG_DICTIONARY) == 0;
+    }
+
+    UINT16 OriginalLength;
+    if (Length < sizeof(OriginalLength))
+    {
+        return FALSE;
+    }
+
+    memcpy(&OriginalLength, Payload, sizeof(OriginalLength));
+    OriginalLength = ntohs(OriginalLength);
+
+    if (OriginalLength > MaxLength)
+    {
+        return FALSE;
+    }
+
+    const LOG_PACK_DICTIONARY* Dictionary = ((Flags & MESSAGE_FLAG_DICTIONARY) != 0) ? NetPackDictionary() : NULL;
+
+    if (!LogPackDecompressDictionary(Dictionary, (const UINT8*)Payload + sizeof(OriginalLength), Length - sizeof(OriginalLength), (UINT8*)Buffer, OriginalLength))
+    {
+        return FALSE;
+    }
+
+    *pPayload = Buffer;
+    *pLength = OriginalLength;
+    return TRUE;
+}
@@ -0,0 +1,95 @@
+#ifndef NETPACK_H
+#define NETPACK_H
+
+#include "logpack.h"
+#include "winnet.h"
+
+/**
+    * Compression of frame payloads on the relay connection, taken up per connection with
+    * PROTOCOL_CAPABILITY_COMPRESSION and PROTOCOL_CAPABILITY_DICTIONARY.
+    *
+    * A compressed payload is the length of the original (UINT16, network byte order) followed by
+    * the original compressed as one logpack block, against the shared chat dictionary when the
+    * frame has MESSAGE_FLAG_DICTIONARY. A payload is compressed only from the threshold of its mode
+    * up and only if it comes out smaller, everything else is sent as it is, so short control frames
+    * and data that does not compress cost nothing but the attempt.
+    *
+    * The shared dictionary is NetPackDictionaryData in netdict.c, a sample of phrases common in chat
+    * text picked by 'netbench dictionary' from a training corpus. Both ends have to hold the same
+    * bytes, a different dictionary needs a capability bit of its own.
+*/
+
+#define NET_PACK_THRESHOLD 128           // payload bytes from which a frame is compressed on its own
+#define NET_PACK_DICTIONARY_THRESHOLD 16 // the same against the dictionary, which pays off on far shorter text
+
+typedef enum _NET_PACK_MODE
+{
+    NET_PACK_NONE = 0,
+    NET_PACK_BLOCK,                      // PROTOCOL_CAPABILITY_COMPRESSION
+    NET_PACK_DICTIONARY                  // PROTOCOL_CAPABILITY_DICTIONARY as well
+} NET_PACK_MODE;
+
+extern const UINT8 NetPackDictionaryData[];
+extern const ULONG NetPackDictionaryLength;
+
+/**
+* @return The mode a connection that took up Capabilities compresses with.
+*/
+NET_PACK_MODE
+NetPackModeOf(
+    _In_ UINT32 Capabilities
+);
+
+/**
+* @return The shared chat dictionary, prepared on first use.
+*/
+const LOG_PACK_DICTIONARY*
+NetPackDictionary(
+    VOID
+);
+
+/**
+* Compresses a payload if it is long enough and comes out smaller.
+*
+* @param Mode    How the connection compresses.
+* @param Payload Payload to send.
+* @param Length  Size of Payload.
+* @param Buffer  Receives the compressed payload, at least Length bytes.
+* @param pFlags  Receives the MESSAGE_FLAG_* of the frame, 0 if it is not compressed.
+*
+* @return Size of the compressed payload in Buffer, 0 if the payload is to be sent as it is.
+*/
+UINT16
+NetPackCompress(
+    _In_  NET_PACK_MODE Mode,
+    _In_  const VOID* Payload,
+    _In_  UINT16 Length,
+    _Out_ CHAR* Buffer,
+    _Out_ PUINT16 pFlags
+);
+
+/**
+* Gives the original payload of a received frame.
+*
+* @param Flags     MESSAGE_FLAG_* of the frame.
+* @param Payload   Payload as received.
+* @param Length    Size of Payload.
+* @param MaxLength Largest original payload the stream takes.
+* @param Buffer    Receives the original of a compressed payload, at least MaxLength bytes.
+* @param pPayload  Receives the original, Payload itself if the frame is not compressed.
+* @param pLength   Receives the size of the original.
+*
+* @return FALSE if the payload is corrupt or expands past MaxLength.
+*/
+BOOL
+NetPackExpand(
+    _In_  UINT16 Flags,
+    _In_  const CHAR* Payload,
+    _In_  UINT16 Length,
+    _In_  UINT16 MaxLength,
+    _Out_ CHAR* Buffer,
+    _Out_ const CHAR** pPayload,
+    _Out_ PUINT16 pLength
+);
+
+#endif // !NETPACK_H
@@ -0,0 +1,382 @@
+#ifndef _WIN32
+
+#include "winnet.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#define NET_ROUTE_TABLE "/proc/net/route"
+#define NET_POLLER_BATCH 64 // epoll events fetched per wait, more are returned by the next one
+
+/**
+* The poller is an epoll instance. epoll keeps one word per socket, which holds the socket, the
+* contexts are kept in an array indexed by socket. Like the Windows poller it belongs to the thread
+* that waits on it.
+*/
+struct _NET_POLLER
+{
+    INT    Descriptor;
+    PVOID* Contexts;
+    ULONG  Capacity;  // entries in Contexts, sockets up to Capacity - 1 fit
+};
+
+BOOL
+InitWinSock(
+    VOID
+)
+{
+    // a peer that goes away while we send must fail the send, not end the process
+    signal(SIGPIPE, SIG_IGN);
+    return TRUE;
+}
+
+VOID
+CleanUpWinSock(
+    VOID
+)
+{
+}
+
+BOOL
+NetIsTimeout(
+    _In_ INT Error
+)
+{
+    return Error == EAGAIN || Error == EWOULDBLOCK || Error == ETIMEDOUT;
+}
+
+BOOL
+NetIsWouldBlock(
+    _In_ INT Error
+)
+{
+    return Error == EAGAIN || Error == EWOULDBLOCK || Error == EINPROGRESS;
+}
+
+BOOL
+NetSetNonBlocking(
+    _In_ SOCKET Socket,
+    _In_ BOOL NonBlocking
+)
+{
+    INT Flags = fcntl(Socket, F_GETFL, 0);
+    if (Flags < 0)
+    {
+        return FALSE;
+    }
+
+    Flags = NonBlocking ? (Flags | O_NONBLOCK) : (Flags & ~O_NONBLOCK);
+    return fcntl(Socket, F_SETFL, Flags) == 0;
+}
+
+BOOL
+NetSetReceiveTimeout(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+)
+{
+    struct timeval Timeout;
+    Timeout.tv_sec = Milliseconds / 1000;
+    Timeout.tv_usec = (Milliseconds % 1000) * 1000;
+
+    return setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout)) == 0;
+}
+
+BOOL
+NetSetReusePort(
+    _In_ SOCKET Socket
+)
+{
+    INT Enable = 1;
+    return setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, &Enable, sizeof(Enable)) == 0;
+}
+
+/**
+* Reads the default route from the kernel's routing table. Every line after the header is
+* "Iface Destination Gateway Flags ...", addresses as hexadecimal numbers in network byte order.
+*/
+BOOL
+NetDefaultGateway(
+    _Out_ struct in_addr* pGateway
+)
+{
+    FILE* Routes = NULL;
+    if (fopen_s(&Routes, NET_ROUTE_TABLE, "r") != 0 || Routes == NULL)
+    {
+        return FALSE;
+    }
+
+    CHAR Line[256];
+    BOOL Found = FALSE;
+
+    // skip the header
+    if (fgets(Line, sizeof(Line), Routes) != NULL)
+    {
+        while (!Found && fgets(Line, sizeof(Line), Routes) != NULL)
+        {
+            CHAR     Interface[64];
+            unsigned Destination;
+            unsigned Gateway;
+            unsigned Flags;
+
+            if (sscanf(Line, "%63s %x %x %x", Interface, &Destination, &Gateway, &Flags) == 4 &&
+                Destination == 0 && Gateway != 0 && (Flags & 0x0002) != 0) // RTF_GATEWAY
+            {
+                pGateway->s_addr = Gateway;
+                Found = TRUE;
+            }
+        }
+    }
+
+    fclose(Routes);
+    return Found;
+}
+
+INT
+NetSendVector(
+    _In_ SOCKET Socket,
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count
+)
+{
+    struct iovec Buffers[NET_MAX_SLICES];
+
+    if (Count > NET_MAX_SLICES)
+    {
+        errno = EINVAL;
+        return SOCKET_ERROR;
+    }
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        Buffers[i].iov_base = (PVOID)Slices[i].Data;
+        Buffers[i].iov_len = Slices[i].Length;
+    }
+
+    struct msghdr Message;
+    memset(&Message, 0, sizeof(Message));
+    Message.msg_iov = Buffers;
+    Message.msg_iovlen = Count;
+
+    ssize_t BytesSent = sendmsg(Socket, &Message, MSG_NOSIGNAL);
+    return (BytesSent < 0) ? SOCKET_ERROR : (INT)BytesSent;
+}
+
+BOOL
+NetWaitReadable(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+)
+{
+    struct pollfd Poll;
+    Poll.fd = Socket;
+    Poll.events = POLLIN;
+    Poll.revents = 0;
+
+    return poll(&Poll, 1, (Milliseconds == INFINITE) ? -1 : (INT)Milliseconds) > 0;
+}
+
+BOOL
+NetWaitWritable(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+)
+{
+    struct pollfd Poll;
+    Poll.fd = Socket;
+    Poll.events = POLLOUT;
+    Poll.revents = 0;
+
+    return poll(&Poll, 1, (Milliseconds == INFINITE) ? -1 : (INT)Milliseconds) > 0;
+}
+
+ULONG
+NetReadableBytes(
+    _In_ SOCKET Socket
+)
+{
+    INT Bytes = 0;
+    if (ioctl(Socket, FIONREAD, &Bytes) != 0 || Bytes < 0)
+    {
+        return 0;
+    }
+
+    return (ULONG)Bytes;
+}
+
+PNET_POLLER
+NetPollerCreate(
+    VOID
+)
+{
+    PNET_POLLER Poller = (PNET_POLLER)calloc(1, sizeof(NET_POLLER));
+    if (Poller == NULL)
+    {
+        return NULL;
+    }
+
+    Poller->Descriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (Poller->Descriptor < 0)
+    {
+        free(Poller);
+        return NULL;
+    }
+
+    return Poller;
+}
+
+VOID
+NetPollerDestroy(
+    _In_ PNET_POLLER Poller
+)
+{
+    close(Poller->Descriptor);
+    free(Poller->Contexts);
+    free(Poller);
+}
+
+/**
+* Applies an epoll_ctl operation for a socket and records its context.
+*/
+static
+BOOL
+NetPollerControl(
+    _In_     PNET_POLLER Poller,
+    _In_     INT Operation,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+)
+{
+    if (Socket < 0)
+    {
+        errno = EBADF;
+        return FALSE;
+    }
+
+    if ((ULONG)Socket >= Poller->Capacity)
+    {
+        ULONG Capacity = max(Poller->Capacity * 2, (ULONG)Socket + 1);
+        Capacity = max(Capacity, NET_POLLER_BATCH);
+
+        PVOID* Contexts = (PVOID*)realloc(Poller->Contexts, Capacity * sizeof(PVOID));
+        if (Contexts == NULL)
+        {
+            errno = ENOMEM;
+            return FALSE;
+        }
+
+        memset(Contexts + Poller->Capacity, 0, (Capacity - Poller->Capacity) * sizeof(PVOID));
+        Poller->Contexts = Contexts;
+        Poller->Capacity = Capacity;
+    }
+
+    struct epoll_event Event;
+    memset(&Event, 0, sizeof(Event));
+    Event.data.fd = Socket;
+
+    if (Events & NET_POLL_READ)
+    {
+        Event.events |= EPOLLIN;
+    }
+
+    if (Events & NET_POLL_WRITE)
+    {
+        Event.events |= EPOLLOUT;
+    }
+
+    if (epoll_ctl(Poller->Descriptor, Operation, Socket, &Event) != 0)
+    {
+        return FALSE;
+    }
+
+    Poller->Contexts[Socket] = Context;
+    return TRUE;
+}
+
+BOOL
+NetPollerAdd(
+    _In_     PNET_POLLER Poller,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+)
+{
+    return NetPollerControl(Poller, EPOLL_CTL_ADD, Socket, Events, Context);
+}
+
+BOOL
+NetPollerModify(
+    _In_     PNET_POLLER Poller,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+)
+{
+    return NetPollerControl(Poller, EPOLL_CTL_MOD, Socket, Events, Context);
+}
+
+BOOL
+NetPollerRemove(
+    _In_ PNET_POLLER Poller,
+    _In_ SOCKET Socket
+)
+{
+    if (epoll_ctl(Poller->Descriptor, EPOLL_CTL_DEL, Socket, NULL) != 0)
+    {
+        return FALSE;
+    }
+
+    Poller->Contexts[Socket] = NULL;
+    return TRUE;
+}
+
+INT
+NetPollerWait(
+    _In_  PNET_POLLER Poller,
+    _Out_ PNET_POLL_EVENT Events,
+    _In_  INT MaxEvents,
+    _In_  DWORD Milliseconds
+)
+{
+    struct epoll_event Ready[NET_POLLER_BATCH];
+    INT Timeout = (Milliseconds == INFINITE) ? -1 : (INT)Milliseconds;
+
+    INT Count = epoll_wait(Poller->Descriptor, Ready, min(MaxEvents, NET_POLLER_BATCH), Timeout);
+    if (Count < 0)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (INT i = 0; i < Count; ++i)
+    {
+        SOCKET Socket = Ready[i].data.fd;
+
+        Events[i].Socket = Socket;
+        Events[i].Context = Poller->Contexts[Socket];
+        Events[i].Events = 0;
+
+        if (Ready[i].events & EPOLLIN)
+        {
+            Events[i].Events |= NET_POLL_READ;
+        }
+
+        if (Ready[i].events & EPOLLOUT)
+        {
+            Events[i].Events |= NET_POLL_WRITE;
+        }
+
+        if (Ready[i].events & (EPOLLERR | EPOLLHUP))
+        {
+            Events[i].Events |= NET_POLL_ERROR;
+        }
+    }
+
+    return Count;
+}
+
+#endif // !_WIN32
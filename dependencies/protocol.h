@@ -0,0 +1,240 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "wincompat.h"
+
+/**
+    * Wire protocol shared by the client and the relay server.
+    *
+    * Every TCP frame starts with a MESSAGE_HEADER, every UDP datagram with a DATAGRAM_HEADER.
+    * All multi-byte fields are in network byte order.
+    *
+    * A TCP connection carries several logical streams, each frame names its stream. STREAM_CONTROL
+    * carries the handshake, peer setup and window updates, STREAM_CHAT interactive chat, the
+    * streams from STREAM_BULK up bulk transfers. Every stream but STREAM_CONTROL is flow controlled:
+    * a sender may have PROTOCOL_STREAM_WINDOW payload bytes outstanding on it and the receiver
+    * grants more with MESSAGE_TYPE_WINDOW_UPDATE as it consumes them (see netmux.h).
+    *
+    * File transfers run on STREAM_FILE and STREAM_FILE_ANSWER between two paired clients, relayed
+    * by the server frame by frame. The sender offers the file with MESSAGE_TYPE_FILE_OFFER, the receiver answers with
+    * MESSAGE_TYPE_FILE_ACCEPT naming the offset to send from, which is where its partial copy ends
+    * when resuming a copy of the same file, size and last write time alike. Each MESSAGE_TYPE_FILE_DATA carries one chunk of PROTOCOL_FILE_CHUNK_SIZE bytes
+    * (the last may be shorter) behind a FILE_DATA_HEADER with its offset and CRC-32C. A chunk that
+    * fails its checksum is asked for again with another FILE_ACCEPT, one naming the file size
+    * confirms the whole file arrived and one past the file size refuses or abandons it. Bulk frames
+    * may be up to PROTOCOL_MAX_BULK_PAYLOAD_SIZE.
+    *
+    * Compression is negotiated when the client connects. The handshake lists the
+    * PROTOCOL_CAPABILITY_* bits the server offers and the client answers with
+    * MESSAGE_TYPE_CAPABILITIES naming those it takes up. From then on either side may set
+    * MESSAGE_FLAG_COMPRESSED on a frame whose payload is then compressed as described in netpack.h,
+    * and also MESSAGE_FLAG_DICTIONARY if both took up PROTOCOL_CAPABILITY_DICTIONARY. Lengths and
+    * windows count the bytes on the wire. Clients never compress the streams from STREAM_BULK up,
+    * the server relays those as they are.
+    *
+    * Chat, join, leave, ack, presence, control and error payloads are the typed messages of
+    * message.h, read in place from the receive buffer. Leaving and pinging are messages of their
+    * own, no chat text is ever interpreted as a command.
+    *
+    * Peer to peer setup: after the handshake the client registers its UDP socket by sending
+    * DATAGRAM_TYPE_REGISTER to the server's UDP port (same number as the TCP port) and tells the
+    * server its private endpoint with MESSAGE_TYPE_REGISTER_ENDPOINT. A MESSAGE_TYPE_PEER_CONNECT
+    * makes the server send MESSAGE_TYPE_PEER_ENDPOINTS to both peers at once, which then punch
+    * towards each other's public and private endpoints. Chat goes over the relay until a punch
+    * is acknowledged.
+    *
+    * Once the path is direct, DATAGRAM_TYPE_DATA and DATAGRAM_TYPE_ACK carry the reliable transport
+    * (see rudp.h): every data segment has a connection sequence number used for acknowledgement and
+    * loss detection, and a stream sequence number used for in order delivery within its stream.
+*/
+
+#define PROTOCOL_VERSION 6
+
+#define PROTOCOL_ADDRESS_FAMILY_IPV4 4
+#define PROTOCOL_ADDRESS_FAMILY_IPV6 6
+
+#define PROTOCOL_MAX_PAYLOAD_SIZE 1024 // largest payload accepted in a single frame or datagram
+#define PROTOCOL_FILE_CHUNK_SIZE 32768 // file bytes in a MESSAGE_TYPE_FILE_DATA frame
+#define PROTOCOL_MAX_BULK_PAYLOAD_SIZE ( PROTOCOL_FILE_CHUNK_SIZE + PROTOCOL_MAX_PAYLOAD_SIZE ) // largest payload of a frame on a bulk stream
+#define PROTOCOL_MAX_FILE_NAME 255     // bytes of the name in a MESSAGE_TYPE_FILE_OFFER
+
+#define PROTOCOL_MAX_STREAMS 8         // streams per TCP connection
+#define PROTOCOL_STREAM_WINDOW 65536   // payload bytes a sender may have outstanding on a stream
+
+#define STREAM_CONTROL 0               // handshake, peer setup and window updates, not flow controlled
+#define STREAM_CHAT    1               // interactive chat
+#define STREAM_BULK    2               // first stream for history replays and file transfers
+#define STREAM_FILE    STREAM_BULK     // file offers and chunks
+#define STREAM_FILE_ANSWER ( STREAM_BULK + 1 ) // file accepts, never queued behind chunks going the other way
+
+#define PROTOCOL_MAX_FRAME_PAYLOAD(StreamId) ( ( (StreamId) >= STREAM_BULK ) ? PROTOCOL_MAX_BULK_PAYLOAD_SIZE : PROTOCOL_MAX_PAYLOAD_SIZE ) // largest payload of a frame on the stream
+
+#define PROTOCOL_CAPABILITY_COMPRESSION 0x00000001 // frames may be compressed on their own
+#define PROTOCOL_CAPABILITY_DICTIONARY  0x00000002 // frames may be compressed against the shared chat dictionary
+
+#define MESSAGE_FLAG_COMPRESSED 0x0001 // the payload is compressed, see netpack.h
+#define MESSAGE_FLAG_DICTIONARY 0x0002 // with MESSAGE_FLAG_COMPRESSED, against the shared chat dictionary
+
+#define DATAGRAM_MAGIC 0x50325043 // 'P2PC'
+
+typedef enum _MESSAGE_TYPE
+{
+    MESSAGE_TYPE_HANDSHAKE = 1,         // server -> client, sent right after accept
+    MESSAGE_TYPE_CHAT,                  // both ways on STREAM_CHAT, CHAT_MESSAGE and the text, echoed or relayed to the peer
+    MESSAGE_TYPE_REGISTER_ENDPOINT,     // client -> server, private UDP endpoint of the client
+    MESSAGE_TYPE_PEER_CONNECT,          // client -> server, ask to be introduced to another client
+    MESSAGE_TYPE_PEER_ENDPOINTS,        // server -> client, endpoints of the peer to punch towards
+    MESSAGE_TYPE_PEER_UNAVAILABLE,      // server -> client, requested peer is unknown or not registered
+    MESSAGE_TYPE_WINDOW_UPDATE,         // both ways on STREAM_CONTROL, grants a stream more window
+    MESSAGE_TYPE_FILE_OFFER,            // sender -> receiver on STREAM_FILE, relayed, announces a file
+    MESSAGE_TYPE_FILE_ACCEPT,           // receiver -> sender on STREAM_FILE_ANSWER, relayed, offset to send from
+    MESSAGE_TYPE_FILE_DATA,             // sender -> receiver on STREAM_FILE, relayed, one chunk of the file
+    MESSAGE_TYPE_CAPABILITIES,          // client -> server on STREAM_CONTROL, capabilities taken up from the handshake
+    MESSAGE_TYPE_JOIN,                  // server -> client on STREAM_CHAT, the server paired us with a client
+    MESSAGE_TYPE_LEAVE,                 // both ways on STREAM_CHAT, the client leaves, or our peer left
+    MESSAGE_TYPE_ACK,                   // server -> client on STREAM_CHAT, a chat message was handed on
+    MESSAGE_TYPE_PRESENCE,              // both ways on STREAM_CHAT, relayed to the peer with the sender filled in
+    MESSAGE_TYPE_CONTROL,               // both ways on STREAM_CONTROL, commands that are not chat
+    MESSAGE_TYPE_ERROR,                 // server -> client on STREAM_CONTROL, what the server refused
+} MESSAGE_TYPE;
+
+typedef enum _DATAGRAM_TYPE
+{
+    DATAGRAM_TYPE_REGISTER = 1,         // client -> server, lets the server observe the public UDP endpoint
+    DATAGRAM_TYPE_REGISTER_ACK,         // server -> client
+    DATAGRAM_TYPE_PUNCH,                // peer -> peer, opens the NAT binding
+    DATAGRAM_TYPE_PUNCH_ACK,            // peer -> peer, confirms the path works in both directions
+    DATAGRAM_TYPE_DATA,                 // peer -> peer, RUDP_DATA_HEADER followed by the segment
+    DATAGRAM_TYPE_ACK,                  // peer -> peer, RUDP_ACK_HEADER followed by SACK blocks
+} DATAGRAM_TYPE;
+
+#pragma pack(push, 1)
+
+typedef struct _MESSAGE_HEADER
+{
+    UINT16 Type;
+    UINT16 Length;   // payload length, not including the header
+    UINT16 StreamId; // below PROTOCOL_MAX_STREAMS
+    UINT16 Flags;    // MESSAGE_FLAG_*
+} MESSAGE_HEADER, *PMESSAGE_HEADER ;
+
+typedef struct _DATAGRAM_HEADER
+{
+    UINT32 Magic;    // DATAGRAM_MAGIC
+    UINT8  Type;     // DATAGRAM_TYPE
+    UINT8  Reserved;
+    UINT16 Length;   // payload length, not including the header
+    UINT32 SenderId; // client id of the sender, 0 for the server
+    UINT32 Token;    // client token for REGISTER, session token between peers
+} DATAGRAM_HEADER, *PDATAGRAM_HEADER;
+
+typedef struct _PROTOCOL_ENDPOINT
+{
+    UINT8  Address[4]; // IPv4 address
+    UINT16 Port;
+} PROTOCOL_ENDPOINT, *PPROTOCOL_ENDPOINT;
+
+/**
+* Public endpoint of the client as observed by the server, STUN style.
+*/
+typedef struct _HANDSHAKE_MESSAGE
+{
+    UINT8  Version;             // PROTOCOL_VERSION
+    UINT8  Family;              // PROTOCOL_ADDRESS_FAMILY_*
+    UINT16 ObservedPort;
+    UINT8  ObservedAddress[16]; // IPv4 addresses use the first 4 bytes
+    UINT32 ClientId;            // id other clients use to reach us
+    UINT32 Token;               // secret proving ownership of ClientId in DATAGRAM_TYPE_REGISTER
+    UINT32 Capabilities;        // PROTOCOL_CAPABILITY_* the server offers
+} HANDSHAKE_MESSAGE, *PHANDSHAKE_MESSAGE;
+
+typedef struct _REGISTER_ENDPOINT_MESSAGE
+{
+    PROTOCOL_ENDPOINT Private; // local address and port of the client's UDP socket
+} REGISTER_ENDPOINT_MESSAGE, *PREGISTER_ENDPOINT_MESSAGE;
+
+typedef struct _CAPABILITIES_MESSAGE
+{
+    UINT32 Capabilities; // PROTOCOL_CAPABILITY_* the client takes up, a subset of those offered
+} CAPABILITIES_MESSAGE, *PCAPABILITIES_MESSAGE;
+
+typedef struct _PEER_CONNECT_MESSAGE
+{
+    UINT32 PeerId;
+} PEER_CONNECT_MESSAGE, *PPEER_CONNECT_MESSAGE;
+
+typedef struct _PEER_ENDPOINTS_MESSAGE
+{
+    UINT32            PeerId;
+    UINT32            SessionToken; // shared by both peers, carried in every datagram between them
+    PROTOCOL_ENDPOINT Public;       // peer's UDP endpoint as observed by the server
+    PROTOCOL_ENDPOINT Private;      // peer's UDP endpoint as reported by the peer
+} PEER_ENDPOINTS_MESSAGE, *PPEER_ENDPOINTS_MESSAGE;
+
+typedef struct _PEER_UNAVAILABLE_MESSAGE
+{
+    UINT32 PeerId;
+} PEER_UNAVAILABLE_MESSAGE, *PPEER_UNAVAILABLE_MESSAGE;
+
+typedef struct _WINDOW_UPDATE_MESSAGE
+{
+    UINT16 StreamId;
+    UINT16 Reserved;
+    UINT32 Increment; // payload bytes the sender of the update consumed on the stream
+} WINDOW_UPDATE_MESSAGE, *PWINDOW_UPDATE_MESSAGE;
+
+/**
+* Followed by the file's name, without a path and not NUL terminated.
+*/
+typedef struct _FILE_OFFER_MESSAGE
+{
+    UINT32 TransferId; // chosen by the sender, names the transfer in every later message
+    UINT32 ChunkSize;  // PROTOCOL_FILE_CHUNK_SIZE
+    UINT32 SizeHigh;   // size of the file in bytes
+    UINT32 SizeLow;
+    UINT32 WriteTimeHigh; // last write time of the file as a FILETIME, with the size what a partial copy has to match
+    UINT32 WriteTimeLow;
+} FILE_OFFER_MESSAGE, *PFILE_OFFER_MESSAGE;
+
+typedef struct _FILE_ACCEPT_MESSAGE
+{
+    UINT32 TransferId;
+    UINT32 OffsetHigh; // a multiple of the chunk size, or the file size once it is complete
+    UINT32 OffsetLow;
+} FILE_ACCEPT_MESSAGE, *PFILE_ACCEPT_MESSAGE;
+
+/**
+* Followed by the chunk.
+*/
+typedef struct _FILE_DATA_HEADER
+{
+    UINT32 TransferId;
+    UINT32 OffsetHigh; // offset of the chunk in the file
+    UINT32 OffsetLow;
+    UINT32 Checksum;   // CRC-32C of the chunk
+} FILE_DATA_HEADER, *PFILE_DATA_HEADER;
+
+typedef struct _RUDP_DATA_HEADER
+{
+    UINT32 Sequence;       // connection wide, acknowledged by the receiver
+    UINT32 StreamSequence; // per stream, defines delivery order
+    UINT8  StreamId;
+    UINT8  Reserved[3];
+} RUDP_DATA_HEADER, *PRUDP_DATA_HEADER;
+
+typedef struct _RUDP_SACK_BLOCK
+{
+    UINT32 Start; // first sequence received
+    UINT32 End;   // one past the last sequence received
+} RUDP_SACK_BLOCK, *PRUDP_SACK_BLOCK;
+
+typedef struct _RUDP_ACK_HEADER
+{
+    UINT32 Cumulative; // every sequence below this has been received
+    UINT8  BlockCount; // RUDP_SACK_BLOCKs following the header
+    UINT8  Reserved[3];
+} RUDP_ACK_HEADER, *PRUDP_ACK_HEADER;
+
+#pragma pack(pop)
+
+#endif // !PROTOCOL_H
@@ -0,0 +1,1858 @@
+#ifndef _WIN32
+
+#define _GNU_SOURCE // pthread_mutexattr_settype, tm_gmtoff
+
+#include "wincompat.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//////////////////////////////////////////
+//
+//          HANDLES
+//
+//////////////////////////////////////////
+
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL // 1970-01-01 in 100 ns units since 1601-01-01
+#define FILETIME_PER_SECOND 10000000ULL
+
+typedef enum _WIN_HANDLE_KIND
+{
+    WIN_HANDLE_FILE = 1,
+    WIN_HANDLE_MAPPING,
+    WIN_HANDLE_THREAD,
+    WIN_HANDLE_EVENT,
+    WIN_HANDLE_FIND,
+    WIN_HANDLE_PROCESS
+} WIN_HANDLE_KIND;
+
+typedef struct _WIN_HANDLE
+{
+    WIN_HANDLE_KIND Kind;
+    INT             Descriptor;     // files and mappings, a mapping owns a duplicate of the file's
+
+    // threads and events
+    pthread_mutex_t Lock;
+    pthread_cond_t  Signal;
+    BOOL            IsSignaled;     // event set, or thread finished
+    BOOL            IsManualReset;
+    LONG            References;     // a thread's handle is freed by whichever of it and CloseHandle ends last
+
+    LPTHREAD_START_ROUTINE StartAddress;
+    LPVOID          Parameter;
+
+    // FindFirstFileA
+    DIR*            Directory;
+    CHAR            DirectoryPath[MAX_PATH];
+    CHAR            Pattern[MAX_PATH];
+
+    // processes, IsSignaled once the child has been waited for
+    pid_t           Process;
+    DWORD           ExitCode;
+} WIN_HANDLE, *PWIN_HANDLE;
+
+extern char** environ;
+
+/**
+* A mapped view, UnmapViewOfFile is only given the address and munmap needs the length too.
+*/
+typedef struct _WIN_VIEW
+{
+    PVOID              Address;
+    SIZE_T             Length;
+    struct _WIN_VIEW*  Next;
+} WIN_VIEW, *PWIN_VIEW;
+
+static pthread_mutex_t GlobalViewLock = PTHREAD_MUTEX_INITIALIZER;
+static PWIN_VIEW       GlobalViews = NULL;
+
+static __thread DWORD  GlobalLastError = 0;
+
+/**
+* Records errno as the calling thread's last error.
+*
+* @return FALSE, for failing functions to return.
+*/
+static
+BOOL
+WinCompatFail(
+    VOID
+)
+{
+    GlobalLastError = (DWORD)errno;
+    return FALSE;
+}
+
+/**
+* Copies a path, turning '\' separators into '/'.
+*
+* @param Path        Path as the caller wrote it.
+* @param Buffer      Receives the translated path.
+* @param BufferSize  Size of Buffer.
+*
+* @return Buffer, or NULL if the path does not fit.
+*/
+static
+PCSTR
+WinCompatPath(
+    _In_  PCSTR Path,
+    _Out_ PSTR Buffer,
+    _In_  SIZE_T BufferSize
+)
+{
+    SIZE_T Length = strlen(Path);
+    if (Length >= BufferSize)
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    for (SIZE_T i = 0; i <= Length; ++i)
+    {
+        Buffer[i] = (Path[i] == '\\') ? '/' : Path[i];
+    }
+
+    return Buffer;
+}
+
+/**
+* Allocates a handle of the given kind with its lock and condition ready.
+*/
+static
+PWIN_HANDLE
+WinCompatAllocateHandle(
+    _In_ WIN_HANDLE_KIND Kind
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)calloc(1, sizeof(WIN_HANDLE));
+    if (Handle == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_condattr_t Attributes;
+    pthread_condattr_init(&Attributes);
+    pthread_condattr_setclock(&Attributes, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&Handle->Lock, NULL);
+    pthread_cond_init(&Handle->Signal, &Attributes);
+    pthread_condattr_destroy(&Attributes);
+
+    Handle->Kind = Kind;
+    Handle->Descriptor = -1;
+    Handle->References = 1;
+    return Handle;
+}
+
+static
+VOID
+WinCompatFreeHandle(
+    _In_ PWIN_HANDLE Handle
+)
+{
+    pthread_cond_destroy(&Handle->Signal);
+    pthread_mutex_destroy(&Handle->Lock);
+    free(Handle);
+}
+
+/**
+* Drops a reference on a thread handle.
+*/
+static
+VOID
+WinCompatReleaseThread(
+    _In_ PWIN_HANDLE Handle
+)
+{
+    if (InterlockedDecrement(&Handle->References) == 0)
+    {
+        WinCompatFreeHandle(Handle);
+    }
+}
+
+/**
+* Collects the exit status of a child process once it has ended.
+*
+* @param Block Wait for the child to end rather than only look.
+*
+* @return TRUE once the child has ended, FALSE while it runs.
+*/
+static
+BOOL
+WinCompatReapProcess(
+    _In_ PWIN_HANDLE Handle,
+    _In_ BOOL Block
+)
+{
+    if (Handle->IsSignaled)
+    {
+        return TRUE;
+    }
+
+    INT Status;
+    pid_t Result;
+    do
+    {
+        Result = waitpid(Handle->Process, &Status, Block ? 0 : WNOHANG);
+    } while (Result < 0 && errno == EINTR);
+
+    if (Result != Handle->Process)
+    {
+        return FALSE;
+    }
+
+    // a child ended by a signal has no exit code, TerminateProcess sets the one it was given
+    if (WIFEXITED(Status))
+    {
+        Handle->ExitCode = (DWORD)WEXITSTATUS(Status);
+    }
+    else if (Handle->ExitCode == STILL_ACTIVE)
+    {
+        Handle->ExitCode = 128 + (DWORD)WTERMSIG(Status);
+    }
+
+    Handle->IsSignaled = TRUE;
+    return TRUE;
+}
+
+/**
+* WaitForSingleObject for a process, a child's end cannot be waited for with a timeout so it is
+* looked for every few milliseconds.
+*/
+static
+DWORD
+WinCompatWaitProcess(
+    _In_ PWIN_HANDLE Handle,
+    _In_ DWORD Milliseconds
+)
+{
+    ULONGLONG Deadline = GetTickCount64() + Milliseconds;
+
+    while (!WinCompatReapProcess(Handle, Milliseconds == INFINITE))
+    {
+        ULONGLONG Now = GetTickCount64();
+        if (Now >= Deadline)
+        {
+            return WAIT_TIMEOUT;
+        }
+
+        Sleep((DWORD)min(Deadline - Now, 5));
+    }
+
+    return WAIT_OBJECT_0;
+}
+
+//////////////////////////////////////////
+//
+//          THREADS AND SYNCHRONISATION
+//
+//////////////////////////////////////////
+
+VOID
+InitializeCriticalSection(
+    _Out_ LPCRITICAL_SECTION CriticalSection
+)
+{
+    // critical sections may be entered again by the thread that owns them
+    pthread_mutexattr_t Attributes;
+    pthread_mutexattr_init(&Attributes);
+    pthread_mutexattr_settype(&Attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(CriticalSection, &Attributes);
+    pthread_mutexattr_destroy(&Attributes);
+}
+
+VOID
+DeleteCriticalSection(
+    _Inout_ LPCRITICAL_SECTION CriticalSection
+)
+{
+    pthread_mutex_destroy(CriticalSection);
+}
+
+static
+PVOID
+WinCompatThreadStart(
+    _In_ PVOID Parameter
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Parameter;
+
+    Handle->StartAddress(Handle->Parameter);
+
+    pthread_mutex_lock(&Handle->Lock);
+    Handle->IsSignaled = TRUE;
+    pthread_cond_broadcast(&Handle->Signal);
+    pthread_mutex_unlock(&Handle->Lock);
+
+    WinCompatReleaseThread(Handle);
+    return NULL;
+}
+
+HANDLE
+CreateThread(
+    _In_opt_  PVOID Attributes,
+    _In_      SIZE_T StackSize,
+    _In_      LPTHREAD_START_ROUTINE StartAddress,
+    _In_opt_  LPVOID Parameter,
+    _In_      DWORD Flags,
+    _Out_opt_ LPDWORD ThreadId
+)
+{
+    (void)Attributes;
+    (void)Flags;
+
+    PWIN_HANDLE Handle = WinCompatAllocateHandle(WIN_HANDLE_THREAD);
+    if (Handle == NULL)
+    {
+        WinCompatFail();
+        return NULL;
+    }
+
+    Handle->StartAddress = StartAddress;
+    Handle->Parameter = Parameter;
+    Handle->References = 2; // the caller's handle and the running thread
+
+    pthread_attr_t ThreadAttributes;
+    pthread_attr_init(&ThreadAttributes);
+    pthread_attr_setdetachstate(&ThreadAttributes, PTHREAD_CREATE_DETACHED);
+    if (StackSize != 0)
+    {
+        pthread_attr_setstacksize(&ThreadAttributes, StackSize);
+    }
+
+    pthread_t Thread;
+    INT Result = pthread_create(&Thread, &ThreadAttributes, WinCompatThreadStart, Handle);
+    pthread_attr_destroy(&ThreadAttributes);
+
+    if (Result != 0)
+    {
+        errno = Result;
+        WinCompatFail();
+        WinCompatFreeHandle(Handle);
+        return NULL;
+    }
+
+    if (ThreadId != NULL)
+    {
+        *ThreadId = (DWORD)(UINT_PTR)Thread;
+    }
+
+    return Handle;
+}
+
+HANDLE
+CreateEventA(
+    _In_opt_ PVOID Attributes,
+    _In_     BOOL ManualReset,
+    _In_     BOOL InitialState,
+    _In_opt_ LPCSTR Name
+)
+{
+    (void)Attributes;
+    (void)Name;
+
+    PWIN_HANDLE Handle = WinCompatAllocateHandle(WIN_HANDLE_EVENT);
+    if (Handle == NULL)
+    {
+        WinCompatFail();
+        return NULL;
+    }
+
+    Handle->IsManualReset = ManualReset;
+    Handle->IsSignaled = InitialState;
+    return Handle;
+}
+
+BOOL
+SetEvent(
+    _In_ HANDLE Event
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Event;
+
+    pthread_mutex_lock(&Handle->Lock);
+    Handle->IsSignaled = TRUE;
+    if (Handle->IsManualReset)
+    {
+        pthread_cond_broadcast(&Handle->Signal);
+    }
+    else
+    {
+        pthread_cond_signal(&Handle->Signal);
+    }
+    pthread_mutex_unlock(&Handle->Lock);
+
+    return TRUE;
+}
+
+BOOL
+ResetEvent(
+    _In_ HANDLE Event
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Event;
+
+    pthread_mutex_lock(&Handle->Lock);
+    Handle->IsSignaled = FALSE;
+    pthread_mutex_unlock(&Handle->Lock);
+
+    return TRUE;
+}
+
+DWORD
+WaitForSingleObject(
+    _In_ HANDLE Object,
+    _In_ DWORD Milliseconds
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Object;
+    if (Handle != NULL && Handle->Kind == WIN_HANDLE_PROCESS)
+    {
+        return WinCompatWaitProcess(Handle, Milliseconds);
+    }
+
+    if (Handle == NULL || (Handle->Kind != WIN_HANDLE_THREAD && Handle->Kind != WIN_HANDLE_EVENT))
+    {
+        GlobalLastError = EINVAL;
+        return WAIT_FAILED;
+    }
+
+    struct timespec Deadline;
+    clock_gettime(CLOCK_MONOTONIC, &Deadline);
+    Deadline.tv_sec += Milliseconds / 1000;
+    Deadline.tv_nsec += (long)(Milliseconds % 1000) * 1000000L;
+    if (Deadline.tv_nsec >= 1000000000L)
+    {
+        Deadline.tv_sec += 1;
+        Deadline.tv_nsec -= 1000000000L;
+    }
+
+    DWORD Result = WAIT_OBJECT_0;
+
+    pthread_mutex_lock(&Handle->Lock);
+
+    while (!Handle->IsSignaled)
+    {
+        if (Milliseconds == INFINITE)
+        {
+            pthread_cond_wait(&Handle->Signal, &Handle->Lock);
+        }
+        else if (Milliseconds == 0 || pthread_cond_timedwait(&Handle->Signal, &Handle->Lock, &Deadline) == ETIMEDOUT)
+        {
+            Result = Handle->IsSignaled ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+            break;
+        }
+    }
+
+    // an auto reset event lets one waiter through, a finished thread stays signaled
+    if (Result == WAIT_OBJECT_0 && Handle->Kind == WIN_HANDLE_EVENT && !Handle->IsManualReset)
+    {
+        Handle->IsSignaled = FALSE;
+    }
+
+    pthread_mutex_unlock(&Handle->Lock);
+    return Result;
+}
+
+BOOL
+CloseHandle(
+    _In_ HANDLE Object
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Object;
+    if (Handle == NULL || Object == INVALID_HANDLE_VALUE)
+    {
+        GlobalLastError = EBADF;
+        return FALSE;
+    }
+
+    switch (Handle->Kind)
+    {
+    case WIN_HANDLE_THREAD:
+        WinCompatReleaseThread(Handle); // the thread itself keeps running
+        return TRUE;
+
+    case WIN_HANDLE_FILE:
+    case WIN_HANDLE_MAPPING:
+        close(Handle->Descriptor);
+        break;
+
+    default:
+        break;
+    }
+
+    WinCompatFreeHandle(Handle);
+    return TRUE;
+}
+
+HANDLE
+GetCurrentProcess(
+    VOID
+)
+{
+    return (HANDLE)(LONG_PTR)-1; // pseudo handle, as on Windows
+}
+
+HANDLE
+GetCurrentThread(
+    VOID
+)
+{
+    return (HANDLE)(LONG_PTR)-2; // pseudo handle, as on Windows
+}
+
+DWORD
+GetCurrentThreadId(
+    VOID
+)
+{
+    return (DWORD)gettid();
+}
+
+DWORD
+GetCurrentProcessId(
+    VOID
+)
+{
+    return (DWORD)getpid();
+}
+
+BOOL
+SetThreadPriority(
+    _In_ HANDLE Thread,
+    _In_ INT Priority
+)
+{
+    // background threads are only a hint on Windows too, normal priority is a valid answer
+    (void)Thread;
+    (void)Priority;
+    return TRUE;
+}
+
+VOID
+Sleep(
+    _In_ DWORD Milliseconds
+)
+{
+    struct timespec Duration;
+    Duration.tv_sec = Milliseconds / 1000;
+    Duration.tv_nsec = (long)(Milliseconds % 1000) * 1000000L;
+
+    while (nanosleep(&Duration, &Duration) != 0 && errno == EINTR)
+    {
+    }
+}
+
+BOOL
+SwitchToThread(
+    VOID
+)
+{
+    return sched_yield() == 0;
+}
+
+/**
+* Fiber local storage maps onto thread specific data, the callback runs when a thread exits with a
+* value set, as it does on Windows.
+*/
+DWORD
+FlsAlloc(
+    _In_opt_ PFLS_CALLBACK_FUNCTION Callback
+)
+{
+    pthread_key_t Key;
+    if (pthread_key_create(&Key, (VOID (*)(PVOID))Callback) != 0)
+    {
+        return FLS_OUT_OF_INDEXES;
+    }
+
+    return (DWORD)Key;
+}
+
+BOOL
+FlsFree(
+    _In_ DWORD Index
+)
+{
+    return pthread_key_delete((pthread_key_t)Index) == 0;
+}
+
+PVOID
+FlsGetValue(
+    _In_ DWORD Index
+)
+{
+    return pthread_getspecific((pthread_key_t)Index);
+}
+
+BOOL
+FlsSetValue(
+    _In_     DWORD Index,
+    _In_opt_ PVOID Value
+)
+{
+    return pthread_setspecific((pthread_key_t)Index, Value) == 0;
+}
+
+DWORD
+GetLastError(
+    VOID
+)
+{
+    return GlobalLastError;
+}
+
+VOID
+GetSystemInfo(
+    _Out_ LPSYSTEM_INFO SystemInfo
+)
+{
+    SystemInfo->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE);
+    SystemInfo->dwNumberOfProcessors = (DWORD)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/**
+* Only for the current process, read from the VmHWM and VmRSS lines of /proc/self/status.
+*/
+BOOL
+GetProcessMemoryInfo(
+    _In_  HANDLE Process,
+    _Out_ PPROCESS_MEMORY_COUNTERS Counters,
+    _In_  DWORD Size
+)
+{
+    (void)Process;
+
+    if (Size < sizeof(PROCESS_MEMORY_COUNTERS))
+    {
+        GlobalLastError = EINVAL;
+        return FALSE;
+    }
+
+    FILE* Status = fopen("/proc/self/status", "r");
+    if (Status == NULL)
+    {
+        return WinCompatFail();
+    }
+
+    ZeroMemory(Counters, sizeof(PROCESS_MEMORY_COUNTERS));
+    Counters->cb = sizeof(PROCESS_MEMORY_COUNTERS);
+
+    CHAR Line[256];
+    unsigned long long Kilobytes;
+    while (fgets(Line, sizeof(Line), Status) != NULL)
+    {
+        if (sscanf(Line, "VmHWM: %llu kB", &Kilobytes) == 1)
+        {
+            Counters->PeakWorkingSetSize = (SIZE_T)Kilobytes * 1024;
+        }
+        else if (sscanf(Line, "VmRSS: %llu kB", &Kilobytes) == 1)
+        {
+            Counters->WorkingSetSize = (SIZE_T)Kilobytes * 1024;
+        }
+    }
+
+    fclose(Status);
+    return TRUE;
+}
+
+DWORD
+GetModuleFileNameA(
+    _In_opt_ HANDLE Module,
+    _Out_    LPSTR Filename,
+    _In_     DWORD Size
+)
+{
+    (void)Module;
+
+    if (Size == 0)
+    {
+        return 0;
+    }
+
+    ssize_t Length = readlink("/proc/self/exe", Filename, Size - 1);
+    if (Length < 0)
+    {
+        WinCompatFail();
+        Filename[0] = '\0';
+        return 0;
+    }
+
+    Filename[Length] = '\0';
+    return (DWORD)Length;
+}
+
+DWORD
+GetEnvironmentVariableA(
+    _In_      LPCSTR Name,
+    _Out_opt_ LPSTR Buffer,
+    _In_      DWORD Size
+)
+{
+    PCSTR Value = getenv(Name);
+    if (Value == NULL)
+    {
+        GlobalLastError = ENOENT;
+        return 0;
+    }
+
+    DWORD Length = (DWORD)strlen(Value);
+    if (Buffer == NULL || Length >= Size)
+    {
+        return Length + 1; // size needed, terminator included
+    }
+
+    memcpy(Buffer, Value, Length + 1);
+    return Length;
+}
+
+BOOL
+SetEnvironmentVariableA(
+    _In_     LPCSTR Name,
+    _In_opt_ LPCSTR Value
+)
+{
+    INT Result = (Value == NULL) ? unsetenv(Name) : setenv(Name, Value, 1);
+    return (Result == 0) ? TRUE : WinCompatFail();
+}
+
+//////////////////////////////////////////
+//
+//          PROCESSES
+//
+//////////////////////////////////////////
+
+BOOL
+CreateProcessA(
+    _In_opt_    LPCSTR ApplicationName,
+    _Inout_opt_ LPSTR CommandLine,
+    _In_opt_    PVOID ProcessAttributes,
+    _In_opt_    PVOID ThreadAttributes,
+    _In_        BOOL InheritHandles,
+    _In_        DWORD CreationFlags,
+    _In_opt_    LPVOID Environment,
+    _In_opt_    LPCSTR CurrentDirectory,
+    _In_        LPSTARTUPINFOA StartupInfo,
+    _Out_       LPPROCESS_INFORMATION ProcessInformation
+)
+{
+    (void)ProcessAttributes;
+    (void)ThreadAttributes;
+    (void)InheritHandles;
+    (void)CreationFlags;
+    (void)StartupInfo;
+
+    // the child inherits our environment, standard handles and directory
+    if (Environment != NULL || CurrentDirectory != NULL || (ApplicationName == NULL && CommandLine == NULL))
+    {
+        GlobalLastError = EINVAL;
+        return FALSE;
+    }
+
+    // split the command line like the C runtime does, on blanks outside double quotes, into a
+    // copy that also holds the argument vector
+    PCSTR Cursor = (CommandLine != NULL) ? CommandLine : "";
+    SIZE_T Length = strlen(Cursor);
+    SIZE_T MaxArguments = Length / 2 + 2;
+    PSTR* Arguments = (PSTR*)malloc(MaxArguments * sizeof(PSTR) + Length + MaxArguments);
+    if (Arguments == NULL)
+    {
+        GlobalLastError = ENOMEM;
+        return FALSE;
+    }
+
+    PSTR Write = (PSTR)(Arguments + MaxArguments);
+    SIZE_T Count = 0;
+
+    while (TRUE)
+    {
+        while (*Cursor == ' ' || *Cursor == '\t')
+        {
+            ++Cursor;
+        }
+
+        if (*Cursor == '\0')
+        {
+            break;
+        }
+
+        BOOL Quoted = FALSE;
+        Arguments[Count++] = Write;
+
+        for (; *Cursor != '\0' && (Quoted || (*Cursor != ' ' && *Cursor != '\t')); ++Cursor)
+        {
+            if (*Cursor == '"')
+            {
+                Quoted = !Quoted;
+            }
+            else
+            {
+                *Write++ = *Cursor;
+            }
+        }
+
+        *Write++ = '\0';
+    }
+    Arguments[Count] = NULL;
+
+    CHAR Path[MAX_PATH];
+    PCSTR Program = (ApplicationName != NULL) ? ApplicationName : Arguments[0];
+    if (Program == NULL || WinCompatPath(Program, Path, sizeof(Path)) == NULL)
+    {
+        free(Arguments);
+        GlobalLastError = (Program == NULL) ? EINVAL : ENAMETOOLONG;
+        return FALSE;
+    }
+
+    PWIN_HANDLE Handle = WinCompatAllocateHandle(WIN_HANDLE_PROCESS);
+    if (Handle == NULL)
+    {
+        free(Arguments);
+        return WinCompatFail();
+    }
+
+    PSTR NoArguments[2] = { Path, NULL };
+
+    // like Windows, a name without a directory is looked up on the search path
+    INT Result = posix_spawnp(&Handle->Process, Path, NULL, NULL, (Count > 0) ? Arguments : NoArguments, environ);
+    free(Arguments);
+
+    if (Result != 0)
+    {
+        errno = Result;
+        WinCompatFail();
+        WinCompatFreeHandle(Handle);
+        return FALSE;
+    }
+
+    Handle->ExitCode = STILL_ACTIVE;
+
+    ProcessInformation->hProcess = Handle;
+    ProcessInformation->hThread = NULL;
+    ProcessInformation->dwProcessId = (DWORD)Handle->Process;
+    ProcessInformation->dwThreadId = 0;
+    return TRUE;
+}
+
+BOOL
+TerminateProcess(
+    _In_ HANDLE Process,
+    _In_ UINT ExitCode
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Process;
+    if (Handle == NULL || Handle->Kind != WIN_HANDLE_PROCESS)
+    {
+        GlobalLastError = EINVAL;
+        return FALSE;
+    }
+
+    if (Handle->IsSignaled)
+    {
+        return TRUE;
+    }
+
+    if (kill(Handle->Process, SIGKILL) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    Handle->ExitCode = ExitCode;
+    WinCompatReapProcess(Handle, TRUE);
+    return TRUE;
+}
+
+BOOL
+GetExitCodeProcess(
+    _In_  HANDLE Process,
+    _Out_ LPDWORD ExitCode
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Process;
+    if (Handle == NULL || Handle->Kind != WIN_HANDLE_PROCESS)
+    {
+        GlobalLastError = EINVAL;
+        return FALSE;
+    }
+
+    WinCompatReapProcess(Handle, FALSE);
+    *ExitCode = Handle->ExitCode;
+    return TRUE;
+}
+
+//////////////////////////////////////////
+//
+//          TIME
+//
+//////////////////////////////////////////
+
+static
+VOID
+WinCompatTimeToSystemTime(
+    _In_  const struct tm* Time,
+    _In_  ULONG Milliseconds,
+    _Out_ LPSYSTEMTIME SystemTime
+)
+{
+    SystemTime->wYear = (WORD)( Time->tm_year + 1900 );
+    SystemTime->wMonth = (WORD)( Time->tm_mon + 1 );
+    SystemTime->wDayOfWeek = (WORD)Time->tm_wday;
+    SystemTime->wDay = (WORD)Time->tm_mday;
+    SystemTime->wHour = (WORD)Time->tm_hour;
+    SystemTime->wMinute = (WORD)Time->tm_min;
+    SystemTime->wSecond = (WORD)Time->tm_sec;
+    SystemTime->wMilliseconds = (WORD)Milliseconds;
+}
+
+static
+VOID
+WinCompatSetFileTime(
+    _In_  UINT64 Value,
+    _Out_ LPFILETIME FileTime
+)
+{
+    FileTime->dwLowDateTime = (DWORD)Value;
+    FileTime->dwHighDateTime = (DWORD)( Value >> 32 );
+}
+
+static
+UINT64
+WinCompatGetFileTime(
+    _In_ const FILETIME* FileTime
+)
+{
+    return ( (UINT64)FileTime->dwHighDateTime << 32 ) | FileTime->dwLowDateTime;
+}
+
+VOID
+GetLocalTime(
+    _Out_ LPSYSTEMTIME SystemTime
+)
+{
+    struct timespec Now;
+    struct tm       Local;
+
+    clock_gettime(CLOCK_REALTIME, &Now);
+    localtime_r(&Now.tv_sec, &Local);
+    WinCompatTimeToSystemTime(&Local, (ULONG)( Now.tv_nsec / 1000000L ), SystemTime);
+}
+
+VOID
+GetSystemTimeAsFileTime(
+    _Out_ LPFILETIME FileTime
+)
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_REALTIME, &Now);
+
+    WinCompatSetFileTime(
+        FILETIME_UNIX_EPOCH + (UINT64)Now.tv_sec * FILETIME_PER_SECOND + (UINT64)Now.tv_nsec / 100,
+        FileTime
+    );
+}
+
+BOOL
+SystemTimeToFileTime(
+    _In_  const SYSTEMTIME* SystemTime,
+    _Out_ LPFILETIME FileTime
+)
+{
+    struct tm Time;
+    memset(&Time, 0, sizeof(Time));
+    Time.tm_year = SystemTime->wYear - 1900;
+    Time.tm_mon = SystemTime->wMonth - 1;
+    Time.tm_mday = SystemTime->wDay;
+    Time.tm_hour = SystemTime->wHour;
+    Time.tm_min = SystemTime->wMinute;
+    Time.tm_sec = SystemTime->wSecond;
+
+    if (SystemTime->wMonth < 1 || SystemTime->wMonth > 12 || SystemTime->wDay < 1 || SystemTime->wDay > 31 ||
+        SystemTime->wHour > 23 || SystemTime->wMinute > 59 || SystemTime->wSecond > 59 || SystemTime->wMilliseconds > 999)
+    {
+        GlobalLastError = EINVAL;
+        return FALSE;
+    }
+
+    // the fields are taken as they are, whatever zone they are in, exactly like Windows does
+    INT64 Seconds = (INT64)timegm(&Time);
+    WinCompatSetFileTime(
+        (UINT64)( (INT64)FILETIME_UNIX_EPOCH + Seconds * (INT64)FILETIME_PER_SECOND ) + SystemTime->wMilliseconds * 10000ULL,
+        FileTime
+    );
+    return TRUE;
+}
+
+BOOL
+FileTimeToSystemTime(
+    _In_  const FILETIME* FileTime,
+    _Out_ LPSYSTEMTIME SystemTime
+)
+{
+    UINT64 Value = WinCompatGetFileTime(FileTime);
+    INT64  Seconds = (INT64)( Value / FILETIME_PER_SECOND ) - (INT64)( FILETIME_UNIX_EPOCH / FILETIME_PER_SECOND );
+    time_t Time = (time_t)Seconds;
+
+    struct tm Universal;
+    if (gmtime_r(&Time, &Universal) == NULL)
+    {
+        return WinCompatFail();
+    }
+
+    WinCompatTimeToSystemTime(&Universal, (ULONG)( ( Value / 10000 ) % 1000 ), SystemTime);
+    return TRUE;
+}
+
+BOOL
+FileTimeToLocalFileTime(
+    _In_  const FILETIME* FileTime,
+    _Out_ LPFILETIME LocalFileTime
+)
+{
+    UINT64 Value = WinCompatGetFileTime(FileTime);
+    time_t Time = (time_t)( (INT64)( Value / FILETIME_PER_SECOND ) - (INT64)( FILETIME_UNIX_EPOCH / FILETIME_PER_SECOND ) );
+
+    struct tm Local;
+    if (localtime_r(&Time, &Local) == NULL)
+    {
+        return WinCompatFail();
+    }
+
+    WinCompatSetFileTime((UINT64)( (INT64)Value + (INT64)Local.tm_gmtoff * (INT64)FILETIME_PER_SECOND ), LocalFileTime);
+    return TRUE;
+}
+
+LONG
+CompareFileTime(
+    _In_ const FILETIME* First,
+    _In_ const FILETIME* Second
+)
+{
+    UINT64 A = WinCompatGetFileTime(First);
+    UINT64 B = WinCompatGetFileTime(Second);
+    return ( A < B ) ? -1 : ( A > B ) ? 1 : 0;
+}
+
+ULONGLONG
+GetTickCount64(
+    VOID
+)
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (ULONGLONG)Now.tv_sec * 1000ULL + (ULONGLONG)Now.tv_nsec / 1000000ULL;
+}
+
+BOOL
+QueryPerformanceCounter(
+    _Out_ PLARGE_INTEGER Counter
+)
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    Counter->QuadPart = (LONGLONG)Now.tv_sec * 1000000000LL + Now.tv_nsec;
+    return TRUE;
+}
+
+BOOL
+QueryPerformanceFrequency(
+    _Out_ PLARGE_INTEGER Frequency
+)
+{
+    Frequency->QuadPart = 1000000000LL; // the counter is CLOCK_MONOTONIC in nanoseconds
+    return TRUE;
+}
+
+//////////////////////////////////////////
+//
+//          FILES
+//
+//////////////////////////////////////////
+
+HANDLE
+CreateFileA(
+    _In_     LPCSTR Filename,
+    _In_     DWORD Access,
+    _In_     DWORD ShareMode,
+    _In_opt_ PVOID Attributes,
+    _In_     DWORD Disposition,
+    _In_     DWORD Flags,
+    _In_opt_ HANDLE Template
+)
+{
+    (void)ShareMode; // POSIX files are always shared, deleting an open one unlinks it
+    (void)Attributes;
+    (void)Flags;
+    (void)Template;
+
+    CHAR Path[MAX_PATH];
+    if (WinCompatPath(Filename, Path, sizeof(Path)) == NULL)
+    {
+        WinCompatFail();
+        return INVALID_HANDLE_VALUE;
+    }
+
+    INT OpenFlags = O_CLOEXEC;
+
+    if ((Access & GENERIC_READ) && (Access & (GENERIC_WRITE | FILE_APPEND_DATA)))
+    {
+        OpenFlags |= O_RDWR;
+    }
+    else if (Access & (GENERIC_WRITE | FILE_APPEND_DATA))
+    {
+        OpenFlags |= O_WRONLY;
+    }
+    else
+    {
+        OpenFlags |= O_RDONLY;
+    }
+
+    if ((Access & FILE_APPEND_DATA) && !(Access & GENERIC_WRITE))
+    {
+        OpenFlags |= O_APPEND;
+    }
+
+    switch (Disposition)
+    {
+    case CREATE_ALWAYS:
+        OpenFlags |= O_CREAT | O_TRUNC;
+        break;
+
+    case OPEN_ALWAYS:
+        OpenFlags |= O_CREAT;
+        break;
+
+    default:
+        break;
+    }
+
+    INT Descriptor = open(Path, OpenFlags, 0644);
+    if (Descriptor < 0)
+    {
+        WinCompatFail();
+        return INVALID_HANDLE_VALUE;
+    }
+
+    PWIN_HANDLE Handle = WinCompatAllocateHandle(WIN_HANDLE_FILE);
+    if (Handle == NULL)
+    {
+        WinCompatFail();
+        close(Descriptor);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    Handle->Descriptor = Descriptor;
+    return Handle;
+}
+
+BOOL
+WriteFile(
+    _In_        HANDLE File,
+    _In_        LPCVOID Buffer,
+    _In_        DWORD Length,
+    _Out_opt_   LPDWORD Written,
+    _Inout_opt_ PVOID Overlapped
+)
+{
+    (void)Overlapped;
+
+    PWIN_HANDLE Handle = (PWIN_HANDLE)File;
+    const UINT8* Data = (const UINT8*)Buffer;
+    DWORD Total = 0;
+
+    while (Total < Length)
+    {
+        ssize_t Result = write(Handle->Descriptor, Data + Total, Length - Total);
+        if (Result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        Total += (DWORD)Result;
+    }
+
+    if (Written != NULL)
+    {
+        *Written = Total;
+    }
+
+    return ( Total == Length ) ? TRUE : WinCompatFail();
+}
+
+BOOL
+GetFileSizeEx(
+    _In_  HANDLE File,
+    _Out_ PLARGE_INTEGER Size
+)
+{
+    struct stat Status;
+    if (fstat(((PWIN_HANDLE)File)->Descriptor, &Status) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    Size->QuadPart = (LONGLONG)Status.st_size;
+    return TRUE;
+}
+
+BOOL
+GetFileTime(
+    _In_      HANDLE File,
+    _Out_opt_ LPFILETIME CreationTime,
+    _Out_opt_ LPFILETIME LastAccessTime,
+    _Out_opt_ LPFILETIME LastWriteTime
+)
+{
+    struct stat Status;
+    if (fstat(((PWIN_HANDLE)File)->Descriptor, &Status) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    // POSIX keeps no creation time, the last status change stands in for it
+    if (CreationTime != NULL)
+    {
+        WinCompatSetFileTime(FILETIME_UNIX_EPOCH + (UINT64)Status.st_ctim.tv_sec * FILETIME_PER_SECOND + (UINT64)Status.st_ctim.tv_nsec / 100, CreationTime);
+    }
+
+    if (LastAccessTime != NULL)
+    {
+        WinCompatSetFileTime(FILETIME_UNIX_EPOCH + (UINT64)Status.st_atim.tv_sec * FILETIME_PER_SECOND + (UINT64)Status.st_atim.tv_nsec / 100, LastAccessTime);
+    }
+
+    if (LastWriteTime != NULL)
+    {
+        WinCompatSetFileTime(FILETIME_UNIX_EPOCH + (UINT64)Status.st_mtim.tv_sec * FILETIME_PER_SECOND + (UINT64)Status.st_mtim.tv_nsec / 100, LastWriteTime);
+    }
+
+    return TRUE;
+}
+
+BOOL
+SetFilePointerEx(
+    _In_      HANDLE File,
+    _In_      LARGE_INTEGER Distance,
+    _Out_opt_ PLARGE_INTEGER NewPointer,
+    _In_      DWORD Method
+)
+{
+    INT Whence = ( Method == FILE_END ) ? SEEK_END : ( Method == FILE_CURRENT ) ? SEEK_CUR : SEEK_SET;
+
+    off_t Position = lseek(((PWIN_HANDLE)File)->Descriptor, (off_t)Distance.QuadPart, Whence);
+    if (Position < 0)
+    {
+        return WinCompatFail();
+    }
+
+    if (NewPointer != NULL)
+    {
+        NewPointer->QuadPart = (LONGLONG)Position;
+    }
+
+    return TRUE;
+}
+
+BOOL
+SetEndOfFile(
+    _In_ HANDLE File
+)
+{
+    INT   Descriptor = ((PWIN_HANDLE)File)->Descriptor;
+    off_t Position = lseek(Descriptor, 0, SEEK_CUR);
+
+    if (Position < 0 || ftruncate(Descriptor, Position) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    return TRUE;
+}
+
+BOOL
+DeleteFileA(
+    _In_ LPCSTR Filename
+)
+{
+    CHAR Path[MAX_PATH];
+    if (WinCompatPath(Filename, Path, sizeof(Path)) == NULL || unlink(Path) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    return TRUE;
+}
+
+/**
+* rename always replaces the target, without MOVEFILE_REPLACE_EXISTING an existing one fails the
+* move like on Windows.
+*/
+BOOL
+MoveFileExA(
+    _In_ LPCSTR Existing,
+    _In_ LPCSTR New,
+    _In_ DWORD Flags
+)
+{
+    CHAR From[MAX_PATH];
+    CHAR To[MAX_PATH];
+
+    if (WinCompatPath(Existing, From, sizeof(From)) == NULL || WinCompatPath(New, To, sizeof(To)) == NULL)
+    {
+        return WinCompatFail();
+    }
+
+    struct stat Status;
+    if (!(Flags & MOVEFILE_REPLACE_EXISTING) && stat(To, &Status) == 0)
+    {
+        GlobalLastError = EEXIST;
+        return FALSE;
+    }
+
+    if (rename(From, To) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    return TRUE;
+}
+
+BOOL
+CreateDirectoryA(
+    _In_     LPCSTR PathName,
+    _In_opt_ PVOID Attributes
+)
+{
+    (void)Attributes;
+
+    CHAR Path[MAX_PATH];
+    if (WinCompatPath(PathName, Path, sizeof(Path)) == NULL || mkdir(Path, 0755) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    return TRUE;
+}
+
+DWORD
+GetFileAttributesA(
+    _In_ LPCSTR Filename
+)
+{
+    CHAR        Path[MAX_PATH];
+    struct stat Status;
+
+    if (WinCompatPath(Filename, Path, sizeof(Path)) == NULL || stat(Path, &Status) != 0)
+    {
+        WinCompatFail();
+        return INVALID_FILE_ATTRIBUTES;
+    }
+
+    return S_ISDIR(Status.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+}
+
+/**
+* A mapping only remembers the file, views are mapped from it. Like on Windows, a mapping larger than
+* the file extends the file.
+*/
+HANDLE
+CreateFileMappingA(
+    _In_     HANDLE File,
+    _In_opt_ PVOID Attributes,
+    _In_     DWORD Protect,
+    _In_     DWORD MaximumSizeHigh,
+    _In_     DWORD MaximumSizeLow,
+    _In_opt_ LPCSTR Name
+)
+{
+    (void)Attributes;
+    (void)Name;
+
+    INT    Descriptor = ((PWIN_HANDLE)File)->Descriptor;
+    UINT64 Size = ( (UINT64)MaximumSizeHigh << 32 ) | MaximumSizeLow;
+
+    struct stat Status;
+    if (fstat(Descriptor, &Status) != 0)
+    {
+        WinCompatFail();
+        return NULL;
+    }
+
+    if (Protect == PAGE_READWRITE && Size > (UINT64)Status.st_size && ftruncate(Descriptor, (off_t)Size) != 0)
+    {
+        WinCompatFail();
+        return NULL;
+    }
+
+    PWIN_HANDLE Handle = WinCompatAllocateHandle(WIN_HANDLE_MAPPING);
+    if (Handle == NULL)
+    {
+        WinCompatFail();
+        return NULL;
+    }
+
+    Handle->Descriptor = dup(Descriptor);
+    if (Handle->Descriptor < 0)
+    {
+        WinCompatFail();
+        WinCompatFreeHandle(Handle);
+        return NULL;
+    }
+
+    return Handle;
+}
+
+LPVOID
+MapViewOfFile(
+    _In_ HANDLE Mapping,
+    _In_ DWORD Access,
+    _In_ DWORD OffsetHigh,
+    _In_ DWORD OffsetLow,
+    _In_ SIZE_T Length
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Mapping;
+    INT Protection = ( Access & FILE_MAP_WRITE ) ? ( PROT_READ | PROT_WRITE ) : PROT_READ;
+
+    PWIN_VIEW View = (PWIN_VIEW)malloc(sizeof(WIN_VIEW));
+    if (View == NULL)
+    {
+        GlobalLastError = ENOMEM;
+        return NULL;
+    }
+
+    PVOID Address = mmap(NULL, Length, Protection, MAP_SHARED, Handle->Descriptor, (off_t)( ( (UINT64)OffsetHigh << 32 ) | OffsetLow ));
+    if (Address == MAP_FAILED)
+    {
+        WinCompatFail();
+        free(View);
+        return NULL;
+    }
+
+    View->Address = Address;
+    View->Length = Length;
+
+    pthread_mutex_lock(&GlobalViewLock);
+    View->Next = GlobalViews;
+    GlobalViews = View;
+    pthread_mutex_unlock(&GlobalViewLock);
+
+    return Address;
+}
+
+BOOL
+UnmapViewOfFile(
+    _In_ LPCVOID Address
+)
+{
+    pthread_mutex_lock(&GlobalViewLock);
+
+    PWIN_VIEW* Link = &GlobalViews;
+    while (*Link != NULL && (*Link)->Address != Address)
+    {
+        Link = &(*Link)->Next;
+    }
+
+    PWIN_VIEW View = *Link;
+    if (View != NULL)
+    {
+        *Link = View->Next;
+    }
+
+    pthread_mutex_unlock(&GlobalViewLock);
+
+    if (View == NULL)
+    {
+        GlobalLastError = EINVAL;
+        return FALSE;
+    }
+
+    munmap(View->Address, View->Length);
+    free(View);
+    return TRUE;
+}
+
+BOOL
+FlushViewOfFile(
+    _In_ LPCVOID Address,
+    _In_ SIZE_T Length
+)
+{
+    // msync wants a page aligned start, Windows rounds down the same way
+    UINT_PTR PageSize = (UINT_PTR)sysconf(_SC_PAGESIZE);
+    UINT_PTR Start = (UINT_PTR)Address & ~( PageSize - 1 );
+
+    if (msync((PVOID)Start, Length + ( (UINT_PTR)Address - Start ), MS_ASYNC) != 0)
+    {
+        return WinCompatFail();
+    }
+
+    return TRUE;
+}
+
+/**
+* Finds the next directory entry matching the handle's pattern.
+*/
+static
+BOOL
+WinCompatFindNext(
+    _In_  PWIN_HANDLE Handle,
+    _Out_ PWIN32_FIND_DATAA FindData
+)
+{
+    struct dirent* Entry;
+
+    while ((Entry = readdir(Handle->Directory)) != NULL)
+    {
+        if (fnmatch(Handle->Pattern, Entry->d_name, FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+
+        CHAR        Path[MAX_PATH * 2];
+        struct stat Status;
+
+        snprintf(Path, sizeof(Path), "%s/%s", Handle->DirectoryPath, Entry->d_name);
+        if (stat(Path, &Status) != 0)
+        {
+            continue; // deleted since readdir saw it
+        }
+
+        UINT64 WriteTime = FILETIME_UNIX_EPOCH + (UINT64)Status.st_mtim.tv_sec * FILETIME_PER_SECOND + (UINT64)Status.st_mtim.tv_nsec / 100;
+
+        memset(FindData, 0, sizeof(*FindData));
+        FindData->dwFileAttributes = S_ISDIR(Status.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+        WinCompatSetFileTime(WriteTime, &FindData->ftLastWriteTime);
+        FindData->nFileSizeHigh = (DWORD)( (UINT64)Status.st_size >> 32 );
+        FindData->nFileSizeLow = (DWORD)Status.st_size;
+        snprintf(FindData->cFileName, sizeof(FindData->cFileName), "%s", Entry->d_name);
+        return TRUE;
+    }
+
+    GlobalLastError = ENOENT;
+    return FALSE;
+}
+
+HANDLE
+FindFirstFileA(
+    _In_  LPCSTR Pattern,
+    _Out_ PWIN32_FIND_DATAA FindData
+)
+{
+    CHAR Path[MAX_PATH];
+    if (WinCompatPath(Pattern, Path, sizeof(Path)) == NULL)
+    {
+        WinCompatFail();
+        return INVALID_HANDLE_VALUE;
+    }
+
+    PWIN_HANDLE Handle = WinCompatAllocateHandle(WIN_HANDLE_FIND);
+    if (Handle == NULL)
+    {
+        WinCompatFail();
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // wildcards are only allowed in the last component, as on Windows
+    PSTR Separator = strrchr(Path, '/');
+    if (Separator != NULL)
+    {
+        *Separator = '\0';
+        snprintf(Handle->DirectoryPath, sizeof(Handle->DirectoryPath), "%s", ( Separator == Path ) ? "/" : Path);
+        snprintf(Handle->Pattern, sizeof(Handle->Pattern), "%s", Separator + 1);
+    }
+    else
+    {
+        snprintf(Handle->DirectoryPath, sizeof(Handle->DirectoryPath), ".");
+        snprintf(Handle->Pattern, sizeof(Handle->Pattern), "%s", Path);
+    }
+
+    Handle->Directory = opendir(Handle->DirectoryPath);
+    if (Handle->Directory == NULL)
+    {
+        WinCompatFail();
+        WinCompatFreeHandle(Handle);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (!WinCompatFindNext(Handle, FindData))
+    {
+        closedir(Handle->Directory);
+        WinCompatFreeHandle(Handle);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return Handle;
+}
+
+BOOL
+FindNextFileA(
+    _In_  HANDLE Find,
+    _Out_ PWIN32_FIND_DATAA FindData
+)
+{
+    return WinCompatFindNext((PWIN_HANDLE)Find, FindData);
+}
+
+BOOL
+FindClose(
+    _In_ HANDLE Find
+)
+{
+    PWIN_HANDLE Handle = (PWIN_HANDLE)Find;
+
+    closedir(Handle->Directory);
+    WinCompatFreeHandle(Handle);
+    return TRUE;
+}
+
+//////////////////////////////////////////
+//
+//          C RUNTIME
+//
+//////////////////////////////////////////
+
+errno_t
+rand_s(
+    _Out_ UINT* Value
+)
+{
+    while (getrandom(Value, sizeof(*Value), 0) != (ssize_t)sizeof(*Value))
+    {
+        if (errno != EINTR)
+        {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+errno_t
+strcpy_s(
+    _Out_ PSTR Destination,
+    _In_  SIZE_T Size,
+    _In_  PCSTR Source
+)
+{
+    SIZE_T Length = strlen(Source);
+    if (Destination == NULL || Size == 0)
+    {
+        return EINVAL;
+    }
+
+    if (Length >= Size)
+    {
+        Destination[0] = '\0';
+        return ERANGE;
+    }
+
+    memcpy(Destination, Source, Length + 1);
+    return 0;
+}
+
+errno_t
+strncpy_s(
+    _Out_ PSTR Destination,
+    _In_  SIZE_T Size,
+    _In_  PCSTR Source,
+    _In_  SIZE_T Count
+)
+{
+    if (Destination == NULL || Size == 0)
+    {
+        return EINVAL;
+    }
+
+    // _TRUNCATE copies what fits, any other count must fit with its terminator
+    SIZE_T Length = strnlen(Source, ( Count == _TRUNCATE ) ? Size - 1 : Count);
+    if (Length >= Size)
+    {
+        Destination[0] = '\0';
+        return ERANGE;
+    }
+
+    memcpy(Destination, Source, Length);
+    Destination[Length] = '\0';
+    return ( Count == _TRUNCATE && Source[Length] != '\0' ) ? STRUNCATE : 0;
+}
+
+SIZE_T
+strnlen_s(
+    _In_opt_ PCSTR String,
+    _In_     SIZE_T Size
+)
+{
+    return ( String == NULL ) ? 0 : strnlen(String, Size);
+}
+
+/**
+* Formats like vsnprintf with the _TRUNCATE semantics of the secure CRT: output that does not fit is
+* cut, stays terminated, and -1 is returned.
+*/
+INT
+_vsnprintf_s(
+    _Out_ PSTR Buffer,
+    _In_  SIZE_T Size,
+    _In_  SIZE_T Count,
+    _In_  PCSTR Format,
+    _In_  va_list Args
+)
+{
+    if (Buffer == NULL || Size == 0)
+    {
+        return -1;
+    }
+
+    SIZE_T Limit = ( Count == _TRUNCATE || Count >= Size ) ? Size : Count + 1;
+
+    INT Written = vsnprintf(Buffer, Limit, Format, Args);
+    if (Written < 0 || (SIZE_T)Written >= Limit)
+    {
+        return -1;
+    }
+
+    return Written;
+}
+
+INT
+_snprintf_s(
+    _Out_ PSTR Buffer,
+    _In_  SIZE_T Size,
+    _In_  SIZE_T Count,
+    _In_  PCSTR Format,
+    ...
+)
+{
+    va_list Args;
+    va_start(Args, Format);
+    INT Written = _vsnprintf_s(Buffer, Size, Count, Format, Args);
+    va_end(Args);
+
+    return Written;
+}
+
+#define SSCANF_MAX_ARGUMENTS 16
+
+/**
+* sscanf_s takes a buffer size after every %s, %c and %[ argument, sscanf does not. The arguments
+* are collected without the sizes and handed to sscanf, which ignores the unused ones.
+*/
+INT
+sscanf_s(
+    _In_ PCSTR Buffer,
+    _In_ PCSTR Format,
+    ...
+)
+{
+    PVOID Arguments[SSCANF_MAX_ARGUMENTS] = { 0 };
+    INT   Count = 0;
+
+    va_list Args;
+    va_start(Args, Format);
+
+    for (PCSTR p = Format; *p != '\0'; ++p)
+    {
+        if (*p != '%')
+        {
+            continue;
+        }
+
+        ++p;
+        if (*p == '%')
+        {
+            continue;
+        }
+
+        BOOL IsSuppressed = ( *p == '*' );
+
+        while (*p != '\0' && strchr("0123456789hljztL*", *p) != NULL)
+        {
+            ++p;
+        }
+
+        BOOL IsSized = ( *p == 's' || *p == 'c' || *p == '[' );
+
+        if (*p == '[')
+        {
+            p += ( p[1] == '^' ) ? 2 : 1;
+            p += ( *p == ']' ) ? 1 : 0;
+            while (*p != '\0' && *p != ']')
+            {
+                ++p;
+            }
+        }
+
+        if (*p == '\0')
+        {
+            break;
+        }
+
+        if (IsSuppressed)
+        {
+            continue;
+        }
+
+        if (Count == SSCANF_MAX_ARGUMENTS)
+        {
+            va_end(Args);
+            return -1;
+        }
+
+        Arguments[Count++] = va_arg(Args, PVOID);
+
+        if (IsSized)
+        {
+            (void)va_arg(Args, UINT);
+        }
+    }
+
+    va_end(Args);
+
+    return sscanf(
+        Buffer, Format,
+        Arguments[0], Arguments[1], Arguments[2], Arguments[3], Arguments[4], Arguments[5], Arguments[6], Arguments[7],
+        Arguments[8], Arguments[9], Arguments[10], Arguments[11], Arguments[12], Arguments[13], Arguments[14], Arguments[15]
+    );
+}
+
+errno_t
+fopen_s(
+    _Out_ FILE** File,
+    _In_  PCSTR Filename,
+    _In_  PCSTR Mode
+)
+{
+    CHAR Path[MAX_PATH];
+    if (WinCompatPath(Filename, Path, sizeof(Path)) == NULL)
+    {
+        *File = NULL;
+        return errno;
+    }
+
+    *File = fopen(Path, Mode);
+    return ( *File == NULL ) ? errno : 0;
+}
+
+errno_t
+tmpfile_s(
+    _Out_ FILE** File
+)
+{
+    *File = tmpfile();
+    return ( *File == NULL ) ? errno : 0;
+}
+
+#endif // !_WIN32
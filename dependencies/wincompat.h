@@ -0,0 +1,397 @@
+#ifndef WINCOMPAT_H
+#define WINCOMPAT_H
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif // !WIN32_LEAN_AND_MEAN
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#define FORMAT_PRINTF( FormatIndex, FirstIndex ) // only GCC and Clang check variadic formats
+
+#else // !_WIN32
+
+/**
+    * The part of the Win32 API the client, the relay server and the log tools use, for POSIX systems.
+    *
+    * Everything outside winnet.h is written against Win32, this header provides the same names on
+    * top of pthreads, mmap and the C library so the code builds unchanged. Networking is not part of
+    * it, see winnet.h.
+    *
+    * Types follow the Windows data model: LONG, ULONG and DWORD stay 32 bits wide, binary log files
+    * and wire structures are the same on both systems. Paths may use '\' as the separator, every
+    * function taking a path translates it. HANDLE points to a WIN_HANDLE, which keeps the kind of
+    * object it refers to so CloseHandle and WaitForSingleObject can tell files, mappings, threads,
+    * events and processes apart.
+    *
+    * Only what the code calls is here, and only with the flags it passes.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//////////////////////////////////////////
+//
+//          TYPES
+//
+//////////////////////////////////////////
+
+#define VOID void
+
+typedef void*               PVOID;
+typedef void*               LPVOID;
+typedef const void*         LPCVOID;
+typedef void*               HANDLE;
+
+typedef int                 BOOL, *PBOOL;
+typedef char                CHAR, *PCHAR, *PSTR, *LPSTR;
+typedef const char*         PCSTR;
+typedef const char*         LPCSTR;
+typedef unsigned char       BYTE, UCHAR, *PBYTE, *PUCHAR;
+typedef short               SHORT;
+typedef unsigned short      WORD, USHORT;
+typedef int                 INT, *PINT;
+typedef unsigned int        UINT, *PUINT;
+typedef int32_t             LONG, *PLONG;
+typedef uint32_t            ULONG, *PULONG, DWORD, *PDWORD, *LPDWORD;
+typedef int64_t             LONGLONG, LONG64, *PLONG64;
+typedef uint64_t            ULONGLONG, *PULONGLONG, ULONG64, DWORD64;
+
+typedef int8_t              INT8;
+typedef int16_t             INT16, *PINT16;
+typedef int32_t             INT32, *PINT32;
+typedef int64_t             INT64, *PINT64;
+typedef uint8_t             UINT8, *PUINT8;
+typedef uint16_t            UINT16, *PUINT16;
+typedef uint32_t            UINT32, *PUINT32;
+typedef uint64_t            UINT64, *PUINT64;
+
+typedef intptr_t            INT_PTR, LONG_PTR;
+typedef uintptr_t           UINT_PTR, ULONG_PTR, DWORD_PTR;
+typedef size_t              SIZE_T, *PSIZE_T;
+typedef int                 errno_t;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG  HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        DWORD HighPart;
+    };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER, *PULARGE_INTEGER;
+
+typedef struct _SYSTEMTIME
+{
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME, *PSYSTEMTIME, *LPSYSTEMTIME;
+
+typedef struct _FILETIME
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME, *PFILETIME, *LPFILETIME;
+
+typedef pthread_mutex_t CRITICAL_SECTION, *PCRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+typedef struct _WIN32_FIND_DATAA
+{
+    DWORD    dwFileAttributes;
+    FILETIME ftLastWriteTime;
+    DWORD    nFileSizeHigh;
+    DWORD    nFileSizeLow;
+    CHAR     cFileName[260];
+} WIN32_FIND_DATAA, *PWIN32_FIND_DATAA;
+
+typedef struct _SYSTEM_INFO
+{
+    DWORD dwPageSize;
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO, *LPSYSTEM_INFO;
+
+typedef struct _STARTUPINFOA
+{
+    DWORD cb;
+} STARTUPINFOA, *LPSTARTUPINFOA;
+
+typedef struct _PROCESS_INFORMATION
+{
+    HANDLE hProcess;
+    HANDLE hThread;                     // always NULL, a process has no handle to its first thread here
+    DWORD  dwProcessId;
+    DWORD  dwThreadId;
+} PROCESS_INFORMATION, *LPPROCESS_INFORMATION;
+
+typedef struct _PROCESS_MEMORY_COUNTERS
+{
+    DWORD  cb;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+} PROCESS_MEMORY_COUNTERS, *PPROCESS_MEMORY_COUNTERS;
+
+//////////////////////////////////////////
+//
+//          CONSTANTS
+//
+//////////////////////////////////////////
+
+#define TRUE  1
+#define FALSE 0
+
+#define WINAPI
+#define CALLBACK
+#define __cdecl
+#define __forceinline inline __attribute__((always_inline))
+
+// the arguments of a variadic function are checked against its format like printf's
+#define FORMAT_PRINTF( FormatIndex, FirstIndex ) __attribute__((format(printf, FormatIndex, FirstIndex)))
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+
+#define MAX_PATH 260
+
+#define MAXUINT64     ((UINT64)~((UINT64)0))
+#define MAXULONG      ((ULONG)~((ULONG)0))
+#define MAXULONGLONG  ((ULONGLONG)~((ULONGLONG)0))
+
+#define INFINITE       0xFFFFFFFF
+#define WAIT_OBJECT_0  0
+#define WAIT_TIMEOUT   258
+#define WAIT_FAILED    ((DWORD)0xFFFFFFFF)
+#define STILL_ACTIVE   259
+
+#define INVALID_HANDLE_VALUE    ((HANDLE)(LONG_PTR)-1)
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+
+#define FILE_ATTRIBUTE_DIRECTORY 0x00000010
+#define FILE_ATTRIBUTE_NORMAL    0x00000080
+
+#define GENERIC_READ     0x80000000
+#define GENERIC_WRITE    0x40000000
+#define FILE_APPEND_DATA 0x00000004
+
+#define FILE_SHARE_READ   0x00000001
+#define FILE_SHARE_WRITE  0x00000002
+#define FILE_SHARE_DELETE 0x00000004
+
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS   4
+
+#define MOVEFILE_REPLACE_EXISTING 0x00000001
+
+#define FILE_BEGIN   0
+#define FILE_CURRENT 1
+#define FILE_END     2
+
+#define PAGE_READONLY  0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_WRITE 0x0002
+#define FILE_MAP_READ  0x0004
+
+#define THREAD_MODE_BACKGROUND_BEGIN 0x00010000
+#define THREAD_MODE_BACKGROUND_END   0x00020000
+
+#define FLS_OUT_OF_INDEXES ((DWORD)0xFFFFFFFF)
+
+#define _TRUNCATE ((size_t)-1)
+#define STRUNCATE 80
+#define _O_BINARY 0
+
+#define LOBYTE(w)         ((BYTE)((w) & 0xFF))
+#define HIBYTE(w)         ((BYTE)(((w) >> 8) & 0xFF))
+#define MAKEWORD(a, b)    ((WORD)(((BYTE)(a)) | ((WORD)((BYTE)(b))) << 8))
+#define ARRAYSIZE(a)      (sizeof(a) / sizeof((a)[0]))
+#define FIELD_OFFSET(t, f) ((LONG)offsetof(t, f))
+
+#define ZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+//////////////////////////////////////////
+//
+//          INTERLOCKED
+//
+//////////////////////////////////////////
+
+#define InterlockedIncrement(Target)                          __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target)                          __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value)                    __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(Target, Value)                 __atomic_fetch_add((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(Target, Value, Comparand)  __sync_val_compare_and_swap((Target), (Comparand), (Value))
+
+#define InterlockedIncrement64        InterlockedIncrement
+#define InterlockedDecrement64        InterlockedDecrement
+#define InterlockedExchange64         InterlockedExchange
+#define InterlockedExchangeAdd64      InterlockedExchangeAdd
+#define InterlockedCompareExchange64  InterlockedCompareExchange
+
+#define InterlockedExchangePointer    InterlockedExchange
+#define InterlockedCompareExchangePointer InterlockedCompareExchange
+
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+//////////////////////////////////////////
+//
+//          THREADS AND SYNCHRONISATION
+//
+//////////////////////////////////////////
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+typedef VOID (WINAPI *PFLS_CALLBACK_FUNCTION)(PVOID);
+
+VOID InitializeCriticalSection(_Out_ LPCRITICAL_SECTION CriticalSection);
+VOID DeleteCriticalSection(_Inout_ LPCRITICAL_SECTION CriticalSection);
+
+#define EnterCriticalSection(CriticalSection) pthread_mutex_lock(CriticalSection)
+#define LeaveCriticalSection(CriticalSection) pthread_mutex_unlock(CriticalSection)
+
+HANDLE CreateThread(_In_opt_ PVOID Attributes, _In_ SIZE_T StackSize, _In_ LPTHREAD_START_ROUTINE StartAddress, _In_opt_ LPVOID Parameter, _In_ DWORD Flags, _Out_opt_ LPDWORD ThreadId);
+HANDLE CreateEventA(_In_opt_ PVOID Attributes, _In_ BOOL ManualReset, _In_ BOOL InitialState, _In_opt_ LPCSTR Name);
+BOOL   SetEvent(_In_ HANDLE Event);
+BOOL   ResetEvent(_In_ HANDLE Event);
+DWORD  WaitForSingleObject(_In_ HANDLE Handle, _In_ DWORD Milliseconds);
+BOOL   CloseHandle(_In_ HANDLE Handle);
+
+HANDLE GetCurrentProcess(VOID);
+HANDLE GetCurrentThread(VOID);
+DWORD  GetCurrentThreadId(VOID);
+DWORD  GetCurrentProcessId(VOID);
+BOOL   SetThreadPriority(_In_ HANDLE Thread, _In_ INT Priority);
+VOID   Sleep(_In_ DWORD Milliseconds);
+BOOL   SwitchToThread(VOID);
+
+DWORD  FlsAlloc(_In_opt_ PFLS_CALLBACK_FUNCTION Callback);
+BOOL   FlsFree(_In_ DWORD Index);
+PVOID  FlsGetValue(_In_ DWORD Index);
+BOOL   FlsSetValue(_In_ DWORD Index, _In_opt_ PVOID Value);
+
+DWORD  GetLastError(VOID);
+VOID   GetSystemInfo(_Out_ LPSYSTEM_INFO SystemInfo);
+BOOL   GetProcessMemoryInfo(_In_ HANDLE Process, _Out_ PPROCESS_MEMORY_COUNTERS Counters, _In_ DWORD Size);
+
+DWORD  GetModuleFileNameA(_In_opt_ HANDLE Module, _Out_ LPSTR Filename, _In_ DWORD Size);
+DWORD  GetEnvironmentVariableA(_In_ LPCSTR Name, _Out_opt_ LPSTR Buffer, _In_ DWORD Size);
+BOOL   SetEnvironmentVariableA(_In_ LPCSTR Name, _In_opt_ LPCSTR Value);
+
+//////////////////////////////////////////
+//
+//          PROCESSES
+//
+//////////////////////////////////////////
+
+BOOL   CreateProcessA(_In_opt_ LPCSTR ApplicationName, _Inout_opt_ LPSTR CommandLine, _In_opt_ PVOID ProcessAttributes, _In_opt_ PVOID ThreadAttributes, _In_ BOOL InheritHandles, _In_ DWORD CreationFlags, _In_opt_ LPVOID Environment, _In_opt_ LPCSTR CurrentDirectory, _In_ LPSTARTUPINFOA StartupInfo, _Out_ LPPROCESS_INFORMATION ProcessInformation);
+BOOL   TerminateProcess(_In_ HANDLE Process, _In_ UINT ExitCode);
+BOOL   GetExitCodeProcess(_In_ HANDLE Process, _Out_ LPDWORD ExitCode);
+
+//////////////////////////////////////////
+//
+//          TIME
+//
+//////////////////////////////////////////
+
+VOID      GetLocalTime(_Out_ LPSYSTEMTIME SystemTime);
+VOID      GetSystemTimeAsFileTime(_Out_ LPFILETIME FileTime);
+BOOL      SystemTimeToFileTime(_In_ const SYSTEMTIME* SystemTime, _Out_ LPFILETIME FileTime);
+BOOL      FileTimeToSystemTime(_In_ const FILETIME* FileTime, _Out_ LPSYSTEMTIME SystemTime);
+BOOL      FileTimeToLocalFileTime(_In_ const FILETIME* FileTime, _Out_ LPFILETIME LocalFileTime);
+LONG      CompareFileTime(_In_ const FILETIME* First, _In_ const FILETIME* Second);
+ULONGLONG GetTickCount64(VOID);
+BOOL      QueryPerformanceCounter(_Out_ PLARGE_INTEGER Counter);
+BOOL      QueryPerformanceFrequency(_Out_ PLARGE_INTEGER Frequency);
+
+//////////////////////////////////////////
+//
+//          FILES
+//
+//////////////////////////////////////////
+
+HANDLE CreateFileA(_In_ LPCSTR Filename, _In_ DWORD Access, _In_ DWORD ShareMode, _In_opt_ PVOID Attributes, _In_ DWORD Disposition, _In_ DWORD Flags, _In_opt_ HANDLE Template);
+BOOL   WriteFile(_In_ HANDLE File, _In_ LPCVOID Buffer, _In_ DWORD Length, _Out_opt_ LPDWORD Written, _Inout_opt_ PVOID Overlapped);
+BOOL   GetFileSizeEx(_In_ HANDLE File, _Out_ PLARGE_INTEGER Size);
+BOOL   GetFileTime(_In_ HANDLE File, _Out_opt_ LPFILETIME CreationTime, _Out_opt_ LPFILETIME LastAccessTime, _Out_opt_ LPFILETIME LastWriteTime);
+BOOL   SetFilePointerEx(_In_ HANDLE File, _In_ LARGE_INTEGER Distance, _Out_opt_ PLARGE_INTEGER NewPointer, _In_ DWORD Method);
+BOOL   SetEndOfFile(_In_ HANDLE File);
+BOOL   DeleteFileA(_In_ LPCSTR Filename);
+BOOL   MoveFileExA(_In_ LPCSTR Existing, _In_ LPCSTR New, _In_ DWORD Flags);
+BOOL   CreateDirectoryA(_In_ LPCSTR Path, _In_opt_ PVOID Attributes);
+DWORD  GetFileAttributesA(_In_ LPCSTR Filename);
+
+HANDLE CreateFileMappingA(_In_ HANDLE File, _In_opt_ PVOID Attributes, _In_ DWORD Protect, _In_ DWORD MaximumSizeHigh, _In_ DWORD MaximumSizeLow, _In_opt_ LPCSTR Name);
+LPVOID MapViewOfFile(_In_ HANDLE Mapping, _In_ DWORD Access, _In_ DWORD OffsetHigh, _In_ DWORD OffsetLow, _In_ SIZE_T Length);
+BOOL   UnmapViewOfFile(_In_ LPCVOID View);
+BOOL   FlushViewOfFile(_In_ LPCVOID Address, _In_ SIZE_T Length);
+
+HANDLE FindFirstFileA(_In_ LPCSTR Pattern, _Out_ PWIN32_FIND_DATAA FindData);
+BOOL   FindNextFileA(_In_ HANDLE Find, _Out_ PWIN32_FIND_DATAA FindData);
+BOOL   FindClose(_In_ HANDLE Find);
+
+//////////////////////////////////////////
+//
+//          C RUNTIME
+//
+//////////////////////////////////////////
+
+#define _stricmp  strcasecmp
+#define _strnicmp strncasecmp
+#define _strtoui64 strtoull
+#define _fileno   fileno
+#define _setmode(Descriptor, Mode) ( (void)(Descriptor), (void)(Mode) ) // no text mode to leave
+#define _fseeki64 fseeko
+#define _ftelli64 ftello
+
+errno_t rand_s(_Out_ UINT* Value);
+errno_t strcpy_s(_Out_ PSTR Destination, _In_ SIZE_T Size, _In_ PCSTR Source);
+errno_t strncpy_s(_Out_ PSTR Destination, _In_ SIZE_T Size, _In_ PCSTR Source, _In_ SIZE_T Count);
+SIZE_T  strnlen_s(_In_opt_ PCSTR String, _In_ SIZE_T Size);
+INT     _snprintf_s(_Out_ PSTR Buffer, _In_ SIZE_T Size, _In_ SIZE_T Count, _In_ PCSTR Format, ...) FORMAT_PRINTF(4, 5);
+INT     _vsnprintf_s(_Out_ PSTR Buffer, _In_ SIZE_T Size, _In_ SIZE_T Count, _In_ PCSTR Format, _In_ va_list Args);
+INT     sscanf_s(_In_ PCSTR Buffer, _In_ PCSTR Format, ...);
+errno_t fopen_s(_Out_ FILE** File, _In_ PCSTR Filename, _In_ PCSTR Mode);
+errno_t tmpfile_s(_Out_ FILE** File);
+
+#endif // !_WIN32
+
+#endif // !WINCOMPAT_H
@@ -0,0 +1,403 @@
+#ifdef _WIN32
+
+#include "winnet.h"
+
+#define NET_POLLER_INITIAL_CAPACITY 16
+
+/**
+* WSAPoll takes the whole set on every call, the poller keeps it as an array with the contexts
+* alongside. It belongs to the thread that waits on it.
+*/
+struct _NET_POLLER
+{
+    WSAPOLLFD* Sockets;
+    PVOID*     Contexts;
+    ULONG      Count;
+    ULONG      Capacity;
+};
+
+BOOL
+InitWinSock(
+    VOID
+)
+{
+    WSADATA WsaData;
+    INT Result;
+
+    // initialize winsock dll
+    Result = WSAStartup(MAKEWORD(2, 2), &WsaData);
+    if (Result != 0)
+    {
+        printf("WSAStartup failed: %d\n", Result);
+        return FALSE;
+    }
+
+    // check if winsock dll supports ver 2.2
+    if( LOBYTE( WsaData.wVersion ) != 2 || HIBYTE(WsaData.wVersion) != 2 )
+    {
+        printf("Win sock dll does not support 2.2");
+        CleanUpWinSock();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID CleanUpWinSock(
+    VOID
+)
+{
+    WSACleanup();
+}
+
+BOOL
+NetIsTimeout(
+    _In_ INT Error
+)
+{
+    return Error == WSAETIMEDOUT;
+}
+
+BOOL
+NetIsWouldBlock(
+    _In_ INT Error
+)
+{
+    return Error == WSAEWOULDBLOCK;
+}
+
+BOOL
+NetSetNonBlocking(
+    _In_ SOCKET Socket,
+    _In_ BOOL NonBlocking
+)
+{
+    u_long Mode = NonBlocking ? 1 : 0;
+    return ioctlsocket(Socket, FIONBIO, &Mode) != SOCKET_ERROR;
+}
+
+BOOL
+NetSetReceiveTimeout(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+)
+{
+    return setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, (PCSTR)&Milliseconds, sizeof(Milliseconds)) != SOCKET_ERROR;
+}
+
+BOOL
+NetSetReusePort(
+    _In_ SOCKET Socket
+)
+{
+    UNREFERENCED_PARAMETER(Socket);
+    return FALSE; // SO_REUSEADDR on Windows lets any socket steal the port, it is not the same thing
+}
+
+BOOL
+NetDefaultGateway(
+    _Out_ struct in_addr* pGateway
+)
+{
+    MIB_IPFORWARDROW Route;
+    memset(&Route, 0, sizeof(Route));
+
+    // best route to 0.0.0.0 is the default route
+    if (GetBestRoute(0, 0, &Route) != NO_ERROR || Route.dwForwardNextHop == 0)
+    {
+        return FALSE;
+    }
+
+    pGateway->s_addr = Route.dwForwardNextHop;
+    return TRUE;
+}
+
+INT
+NetSendVector(
+    _In_ SOCKET Socket,
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count
+)
+{
+    WSABUF Buffers[NET_MAX_SLICES];
+    DWORD  BytesSent = 0;
+
+    if (Count > NET_MAX_SLICES)
+    {
+        WSASetLastError(WSAEINVAL);
+        return SOCKET_ERROR;
+    }
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        Buffers[i].buf = (CHAR*)Slices[i].Data;
+        Buffers[i].len = Slices[i].Length;
+    }
+
+    if (WSASend(Socket, Buffers, Count, &BytesSent, 0, NULL, NULL) == SOCKET_ERROR)
+    {
+        return SOCKET_ERROR;
+    }
+
+    return (INT)BytesSent;
+}
+
+BOOL
+NetWaitReadable(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+)
+{
+    WSAPOLLFD Poll;
+    Poll.fd = Socket;
+    Poll.events = POLLRDNORM;
+    Poll.revents = 0;
+
+    return WSAPoll(&Poll, 1, (Milliseconds == INFINITE) ? -1 : (INT)Milliseconds) > 0;
+}
+
+BOOL
+NetWaitWritable(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+)
+{
+    WSAPOLLFD Poll;
+    Poll.fd = Socket;
+    Poll.events = POLLWRNORM;
+    Poll.revents = 0;
+
+    return WSAPoll(&Poll, 1, (Milliseconds == INFINITE) ? -1 : (INT)Milliseconds) > 0;
+}
+
+ULONG
+NetReadableBytes(
+    _In_ SOCKET Socket
+)
+{
+    u_long Bytes = 0;
+    if (ioctlsocket(Socket, FIONREAD, &Bytes) == SOCKET_ERROR)
+    {
+        return 0;
+    }
+
+    return (ULONG)Bytes;
+}
+
+PNET_POLLER
+NetPollerCreate(
+    VOID
+)
+{
+    PNET_POLLER Poller = (PNET_POLLER)calloc(1, sizeof(NET_POLLER));
+    if (Poller == NULL)
+    {
+        return NULL;
+    }
+
+    Poller->Sockets = (WSAPOLLFD*)malloc(NET_POLLER_INITIAL_CAPACITY * sizeof(WSAPOLLFD));
+    Poller->Contexts = (PVOID*)malloc(NET_POLLER_INITIAL_CAPACITY * sizeof(PVOID));
+    Poller->Capacity = NET_POLLER_INITIAL_CAPACITY;
+
+    if (Poller->Sockets == NULL || Poller->Contexts == NULL)
+    {
+        NetPollerDestroy(Poller);
+        return NULL;
+    }
+
+    return Poller;
+}
+
+VOID
+NetPollerDestroy(
+    _In_ PNET_POLLER Poller
+)
+{
+    free(Poller->Sockets);
+    free(Poller->Contexts);
+    free(Poller);
+}
+
+/**
+* Finds a socket's slot in the poller, Count if it is not in it.
+*/
+static
+ULONG
+NetPollerFind(
+    _In_ PNET_POLLER Poller,
+    _In_ SOCKET Socket
+)
+{
+    ULONG i = 0;
+    while (i < Poller->Count && Poller->Sockets[i].fd != Socket)
+    {
+        ++i;
+    }
+
+    return i;
+}
+
+static
+SHORT
+NetPollerMask(
+    _In_ ULONG Events
+)
+{
+    SHORT Mask = 0;
+
+    if (Events & NET_POLL_READ)
+    {
+        Mask |= POLLRDNORM;
+    }
+
+    if (Events & NET_POLL_WRITE)
+    {
+        Mask |= POLLWRNORM;
+    }
+
+    return Mask;
+}
+
+BOOL
+NetPollerAdd(
+    _In_     PNET_POLLER Poller,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+)
+{
+    if (NetPollerFind(Poller, Socket) != Poller->Count)
+    {
+        WSASetLastError(WSAEINVAL);
+        return FALSE;
+    }
+
+    if (Poller->Count == Poller->Capacity)
+    {
+        ULONG Capacity = Poller->Capacity * 2;
+
+        WSAPOLLFD* Sockets = (WSAPOLLFD*)realloc(Poller->Sockets, Capacity * sizeof(WSAPOLLFD));
+        if (Sockets == NULL)
+        {
+            WSASetLastError(WSAENOBUFS);
+            return FALSE;
+        }
+        Poller->Sockets = Sockets;
+
+        PVOID* Contexts = (PVOID*)realloc(Poller->Contexts, Capacity * sizeof(PVOID));
+        if (Contexts == NULL)
+        {
+            WSASetLastError(WSAENOBUFS);
+            return FALSE;
+        }
+        Poller->Contexts = Contexts;
+
+        Poller->Capacity = Capacity;
+    }
+
+    Poller->Sockets[Poller->Count].fd = Socket;
+    Poller->Sockets[Poller->Count].events = NetPollerMask(Events);
+    Poller->Sockets[Poller->Count].revents = 0;
+    Poller->Contexts[Poller->Count] = Context;
+    ++Poller->Count;
+
+    return TRUE;
+}
+
+BOOL
+NetPollerModify(
+    _In_     PNET_POLLER Poller,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+)
+{
+    ULONG i = NetPollerFind(Poller, Socket);
+    if (i == Poller->Count)
+    {
+        WSASetLastError(WSAENOTSOCK);
+        return FALSE;
+    }
+
+    Poller->Sockets[i].events = NetPollerMask(Events);
+    Poller->Contexts[i] = Context;
+    return TRUE;
+}
+
+BOOL
+NetPollerRemove(
+    _In_ PNET_POLLER Poller,
+    _In_ SOCKET Socket
+)
+{
+    ULONG i = NetPollerFind(Poller, Socket);
+    if (i == Poller->Count)
+    {
+        WSASetLastError(WSAENOTSOCK);
+        return FALSE;
+    }
+
+    // the last slot fills the hole, order does not matter to WSAPoll
+    --Poller->Count;
+    Poller->Sockets[i] = Poller->Sockets[Poller->Count];
+    Poller->Contexts[i] = Poller->Contexts[Poller->Count];
+    return TRUE;
+}
+
+INT
+NetPollerWait(
+    _In_  PNET_POLLER Poller,
+    _Out_ PNET_POLL_EVENT Events,
+    _In_  INT MaxEvents,
+    _In_  DWORD Milliseconds
+)
+{
+    INT Timeout = (Milliseconds == INFINITE) ? -1 : (INT)Milliseconds;
+
+    if (Poller->Count == 0)
+    {
+        Sleep(Milliseconds); // WSAPoll fails on an empty set, an empty epoll set just waits
+        return 0;
+    }
+
+    INT Ready = WSAPoll(Poller->Sockets, Poller->Count, Timeout);
+    if (Ready <= 0)
+    {
+        return Ready;
+    }
+
+    INT Count = 0;
+    for (ULONG i = 0; i < Poller->Count && Count < MaxEvents; ++i)
+    {
+        SHORT Returned = Poller->Sockets[i].revents;
+        if (Returned == 0)
+        {
+            continue;
+        }
+
+        Events[Count].Socket = Poller->Sockets[i].fd;
+        Events[Count].Context = Poller->Contexts[i];
+        Events[Count].Events = 0;
+
+        if (Returned & (POLLRDNORM | POLLRDBAND))
+        {
+            Events[Count].Events |= NET_POLL_READ;
+        }
+
+        if (Returned & POLLWRNORM)
+        {
+            Events[Count].Events |= NET_POLL_WRITE;
+        }
+
+        if (Returned & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            Events[Count].Events |= NET_POLL_ERROR;
+        }
+
+        ++Count;
+    }
+
+    return Count;
+}
+
+#endif // _WIN32
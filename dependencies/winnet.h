@@ -0,0 +1,330 @@
+#ifndef WINNET_H
+#define WINNET_H
+
+/**
+    * Networking layer shared by the client, the relay server and the logger's UDP sink.
+    *
+    * On Windows it is Winsock, implemented in winnet.c. On POSIX systems it is BSD sockets with an
+    * epoll poller, implemented in posixnet.c, and the Winsock names the rest of the code is written
+    * against (SOCKET, INVALID_SOCKET, SOCKET_ERROR, closesocket, WSAGetLastError and the error
+    * codes it checks) are defined here on top of them.
+    *
+    * Whatever differs beyond a name goes through the Net* functions: receive timeouts, blocking
+    * mode, socket options with no common form, the error a timed out receive reports and waiting on
+    * more than one socket.
+*/
+
+#include "wincompat.h"
+
+#ifdef _WIN32
+
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Iphlpapi.lib") // For GetBestRoute
+
+#else // !_WIN32
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef INT SOCKET;
+typedef unsigned short u_short;
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR   (-1)
+
+#define SD_RECEIVE SHUT_RD
+#define SD_SEND    SHUT_WR
+#define SD_BOTH    SHUT_RDWR
+
+#define closesocket      close
+#define WSAGetLastError() errno
+#define WSASetLastError(Error) ( errno = (Error) )
+
+#define WSAEINTR        EINTR
+#define WSAEWOULDBLOCK  EWOULDBLOCK
+#define WSAEMSGSIZE     EMSGSIZE
+#define WSAENOBUFS      ENOBUFS
+#define WSAEINVAL       EINVAL
+#define WSAECONNABORTED ECONNABORTED
+#define WSAECONNRESET   ECONNRESET
+#define WSAETIMEDOUT    ETIMEDOUT
+
+#endif // !_WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+
+#define NET_POLL_READ  0x0001 // data, a datagram or a connection to accept is waiting
+#define NET_POLL_WRITE 0x0002 // a send would not block
+#define NET_POLL_ERROR 0x0004 // the socket failed or the peer hung up, reported whether asked for or not
+
+#define NET_MAX_SLICES 8 // slices a single vectored send takes
+
+/**
+* Readiness poller, level triggered: a socket is reported for as long as it stays ready. A poller
+* belongs to the thread that waits on it, sockets are added and removed by that thread.
+*/
+typedef struct _NET_POLLER NET_POLLER, *PNET_POLLER;
+
+typedef struct _NET_POLL_EVENT
+{
+    SOCKET Socket;
+    ULONG  Events;  // NET_POLL_*
+    PVOID  Context; // as given to NetPollerAdd
+} NET_POLL_EVENT, *PNET_POLL_EVENT;
+
+/**
+* One piece of a vectored send, WSABUF on Windows and struct iovec elsewhere.
+*/
+typedef struct _NET_SLICE
+{
+    const VOID* Data;
+    ULONG       Length;
+} NET_SLICE, *PNET_SLICE;
+
+/**
+*  Initalises the socket library, WSAStartup on Windows. On POSIX systems it makes a send to a
+*  closed connection fail with EPIPE instead of raising SIGPIPE.
+*
+*  @returns TRUE if successful, FALSE otherwise.
+*/
+BOOL
+InitWinSock(
+    VOID
+);
+
+/**
+* Calls win sock dll clean up routines (WSACleanup) as-well as internel cleanup.
+*/
+VOID
+CleanUpWinSock(
+    VOID
+);
+
+/**
+* Tells whether a receive failed because its SO_RCVTIMEO timeout ran out. Winsock reports
+* WSAETIMEDOUT, POSIX systems EAGAIN.
+*
+* @param Error Code from WSAGetLastError.
+*
+* @return TRUE if the error is a receive timeout.
+*/
+BOOL
+NetIsTimeout(
+    _In_ INT Error
+);
+
+/**
+* Tells whether a call on a non-blocking socket failed only because it would have blocked.
+*
+* @param Error Code from WSAGetLastError.
+*
+* @return TRUE if the call should be retried once the socket is ready.
+*/
+BOOL
+NetIsWouldBlock(
+    _In_ INT Error
+);
+
+/**
+* Switches a socket between blocking and non-blocking mode.
+*
+* @param Socket      Socket to change.
+* @param NonBlocking TRUE for non-blocking.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+NetSetNonBlocking(
+    _In_ SOCKET Socket,
+    _In_ BOOL NonBlocking
+);
+
+/**
+* Sets how long a blocking receive waits before it fails, see NetIsTimeout.
+*
+* @param Socket       Socket to change.
+* @param Milliseconds Timeout, 0 waits forever.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+NetSetReceiveTimeout(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+);
+
+/**
+* Lets a listening socket share its port with other sockets of the same user, SO_REUSEPORT, so
+* several processes or threads can each accept on their own socket and the kernel balances
+* connections between them.
+*
+* @param Socket Socket to change, before it is bound.
+*
+* @return TRUE if successful, FALSE where the option does not exist, as on Windows.
+*/
+BOOL
+NetSetReusePort(
+    _In_ SOCKET Socket
+);
+
+/**
+* Looks up the IPv4 address of the default gateway.
+*
+* @param pGateway Receives the gateway address.
+*
+* @return TRUE if a default route exists, FALSE otherwise.
+*/
+BOOL
+NetDefaultGateway(
+    _Out_ struct in_addr* pGateway
+);
+
+/**
+* Sends the slices in order with a single call, WSASend on Windows and sendmsg elsewhere. Like
+* send it may send less than everything, netio.h has the loops that finish the job.
+*
+* @param Socket Connected socket.
+* @param Slices Data to send.
+* @param Count  Entries in Slices, at most NET_MAX_SLICES.
+*
+* @return Bytes sent, SOCKET_ERROR on failure.
+*/
+INT
+NetSendVector(
+    _In_ SOCKET Socket,
+    _In_ const NET_SLICE* Slices,
+    _In_ ULONG Count
+);
+
+/**
+* Waits until a socket has something to receive.
+*
+* @param Socket       Socket to wait on.
+* @param Milliseconds How long to wait, INFINITE for no limit.
+*
+* @return TRUE if the socket is readable or failed, FALSE if the time ran out.
+*/
+BOOL
+NetWaitReadable(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+);
+
+/**
+* Waits until a send on a socket would not block.
+*
+* @param Socket       Socket to wait on.
+* @param Milliseconds How long to wait, INFINITE for no limit.
+*
+* @return TRUE if the socket is writable or failed, FALSE if the time ran out.
+*/
+BOOL
+NetWaitWritable(
+    _In_ SOCKET Socket,
+    _In_ DWORD Milliseconds
+);
+
+/**
+* Tells how many bytes a receive on a stream socket would return right now, FIONREAD.
+*
+* @param Socket Connected socket.
+*
+* @return Bytes waiting, 0 if none or on failure.
+*/
+ULONG
+NetReadableBytes(
+    _In_ SOCKET Socket
+);
+
+/**
+* Creates a readiness poller, an epoll instance on Linux and a WSAPoll set on Windows.
+*
+* @return The poller, NULL on failure.
+*/
+PNET_POLLER
+NetPollerCreate(
+    VOID
+);
+
+/**
+* Destroys a poller. The sockets in it are left open.
+*/
+VOID
+NetPollerDestroy(
+    _In_ PNET_POLLER Poller
+);
+
+/**
+* Adds a socket to a poller. A socket is in a poller at most once.
+*
+* @param Poller  Poller to add to.
+* @param Socket  Socket to watch.
+* @param Events  NET_POLL_READ and/or NET_POLL_WRITE.
+* @param Context Returned with every event for the socket.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+NetPollerAdd(
+    _In_     PNET_POLLER Poller,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+);
+
+/**
+* Changes the events watched for a socket already in a poller.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+NetPollerModify(
+    _In_     PNET_POLLER Poller,
+    _In_     SOCKET Socket,
+    _In_     ULONG Events,
+    _In_opt_ PVOID Context
+);
+
+/**
+* Removes a socket from a poller, before the socket is closed.
+*
+* @return TRUE if successful, FALSE otherwise.
+*/
+BOOL
+NetPollerRemove(
+    _In_ PNET_POLLER Poller,
+    _In_ SOCKET Socket
+);
+
+/**
+* Waits for sockets in a poller to become ready.
+*
+* @param Poller       Poller to wait on.
+* @param Events       Receives one entry per ready socket.
+* @param MaxEvents    Entries in Events.
+* @param Milliseconds How long to wait, INFINITE for no limit.
+*
+* @return Number of entries filled in, 0 if the time ran out, -1 on failure.
+*/
+INT
+NetPollerWait(
+    _In_  PNET_POLLER Poller,
+    _Out_ PNET_POLL_EVENT Events,
+    _In_  INT MaxEvents,
+    _In_  DWORD Milliseconds
+);
+
+#endif // !WINNET_H
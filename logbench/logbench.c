@@ -0,0 +1,559 @@
+#include "logger.h"
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+/**
+    * Micro benchmarks for the client's logger.
+    *
+    *     logbench [iterations] [threads] [results]
+    *
+    * Measures the cost of statements the logger filters out, which every TRACE and DEBUG line in
+    * the client pays in a release build, and of statements written to a log file in both formats.
+    *
+    * Then runs the suite: 1, 2, 4 ... up to threads threads writing to each output at each level
+    * filter, timing every call with the time stamp counter, which adds about 20 ns to each figure.
+    * One CSV row per run goes to the results file with the latency percentiles and the sustained
+    * rate, so runs can be compared. The rotate outputs switch files
+    * every 64 KB, which also runs retention and compression in the background during the run.
+    * The log files are left in the logbench directory.
+*/
+
+#define LOGBENCH_DEFAULT_ITERATIONS 100000000ULL
+#define LOGBENCH_WRITE_DIVISOR 100           // written statements per filtered statement
+#define LOGBENCH_SUITE_DIVISOR 1000          // calls per thread and suite run per filtered statement
+#define LOGBENCH_DIRECTORY "logbench"
+#define LOGBENCH_ROTATE_DIRECTORY "logbench\\rotate"
+#define LOGBENCH_ROTATE_SIZE ( 64 * 1024 )   // the smallest size LoggerSetRotationSize takes
+#define LOGBENCH_ROTATE_RETENTION 1          // days, every file switch also runs a retention scan
+#define LOGBENCH_RESULTS LOGBENCH_DIRECTORY "\\results.csv"
+#define LOGBENCH_MIX 3                       // statements cycle through DEBUG, INFO and WARN
+
+typedef enum _LOGBENCH_TARGET
+{
+    LOGBENCH_DISCARD = 0, // Console stream opened on NUL, the cost of the logger without the I/O
+    LOGBENCH_CONSOLE = 1, // stderr, so the results on stdout can be redirected
+    LOGBENCH_FILE    = 2, // Daily file, never rotated during a run
+    LOGBENCH_ROTATE  = 3  // Rotated by size with compression and retention running
+} LOGBENCH_TARGET;
+
+typedef struct _LOGBENCH_OUTPUT
+{
+    PCSTR           Name;
+    LOGBENCH_TARGET Target;
+    BOOL            IsAsync;
+} LOGBENCH_OUTPUT, * PLOGBENCH_OUTPUT;
+
+typedef struct _LOGBENCH_THREAD
+{
+    HANDLE  Thread;
+    HANDLE  StartEvent;                      // Shared, set once every thread of the run exists
+    ULONG   Index;
+    ULONG   Calls;
+    PUINT64 Ticks;                           // Time stamp counter ticks of every call
+} LOGBENCH_THREAD, * PLOGBENCH_THREAD;
+
+static const LOGBENCH_OUTPUT LogBenchOutputs[] = {
+    { "discard",      LOGBENCH_DISCARD, FALSE },
+    { "console",      LOGBENCH_CONSOLE, FALSE },
+    { "file",         LOGBENCH_FILE,    FALSE },
+    { "file-async",   LOGBENCH_FILE,    TRUE  },
+    { "rotate",       LOGBENCH_ROTATE,  FALSE },
+    { "rotate-async", LOGBENCH_ROTATE,  TRUE  }
+};
+
+static const LOG_LEVEL LogBenchLevels[] = {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+static const PCSTR LogBenchLevelNames[] = { "NONE", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL" };
+
+static volatile LONG BenchSink = 0;
+static volatile LONG ArgumentEvaluations = 0;
+
+/**
+* Argument with a side effect, shows whether a filtered statement evaluated its arguments.
+*/
+static
+INT
+LogBenchExpensiveArgument(
+    VOID
+)
+{
+    return InterlockedIncrement(&ArgumentEvaluations);
+}
+
+/**
+* @return Performance counter ticks.
+*/
+static
+INT64
+LogBenchNow(
+    VOID
+)
+{
+    LARGE_INTEGER Ticks;
+    QueryPerformanceCounter(&Ticks);
+    return Ticks.QuadPart;
+}
+
+/**
+* @return Nanoseconds per iteration between two tick counts.
+*/
+static
+double
+LogBenchNanoseconds(
+    _In_ INT64 Start,
+    _In_ INT64 End,
+    _In_ ULONGLONG Iterations
+)
+{
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+
+    return (double)(End - Start) * 1e9 / (double)Frequency.QuadPart / (double)Iterations;
+}
+
+/**
+* Writes statements to a log file in the given format.
+* 
+* @param Format     Log file format.
+* @param Iterations Statements to write.
+* 
+* @return Nanoseconds per statement, negative if the logger could not be initialised.
+*/
+static
+double
+LogBenchWrite(
+    _In_ LOG_FORMAT Format,
+    _In_ ULONGLONG Iterations
+)
+{
+    LoggerSetFormat(Format);
+    CreateDirectoryA(LOGBENCH_DIRECTORY, NULL);
+
+    if (LoggerInitFile(LOGBENCH_DIRECTORY, 0) != 0)
+    {
+        return -1.0;
+    }
+
+    LoggerSetLevel(LOG_LEVEL_INFO);
+
+    INT64 Start = LogBenchNow();
+    for (ULONGLONG i = 0; i < Iterations; ++i)
+    {
+        LOG_INFO("Received %llu bytes from peer %u on stream %u\n", (unsigned long long)i, 17u, 2u);
+    }
+    double Written = LogBenchNanoseconds(Start, LogBenchNow(), Iterations);
+
+    LoggerCleanUp();
+
+    return Written;
+}
+
+/**
+* Measures how long a time stamp counter tick is against the performance counter.
+* 
+* @return Nanoseconds per tick.
+*/
+static
+double
+LogBenchCalibrate(
+    VOID
+)
+{
+    INT64   Start = LogBenchNow();
+    UINT64  StartTicks = __rdtsc();
+
+    Sleep(100);
+
+    INT64   End = LogBenchNow();
+    UINT64  EndTicks = __rdtsc();
+
+    return LogBenchNanoseconds(Start, End, 1) / (double)(EndTicks - StartTicks);
+}
+
+/**
+* qsort comparison for tick counts.
+*/
+static
+INT
+__cdecl
+LogBenchCompareTicks(
+    _In_ const VOID* Left,
+    _In_ const VOID* Right
+)
+{
+    UINT64 A = *(const UINT64*)Left;
+    UINT64 B = *(const UINT64*)Right;
+
+    return (A > B) - (A < B);
+}
+
+/**
+* Writes the statement mix as fast as it can, timing every call.
+*/
+static
+DWORD
+WINAPI
+LogBenchWorker(
+    _In_ LPVOID lpData
+)
+{
+    PLOGBENCH_THREAD Thread = (PLOGBENCH_THREAD)lpData;
+
+    WaitForSingleObject(Thread->StartEvent, INFINITE);
+
+    for (ULONG i = 0; i < Thread->Calls; ++i)
+    {
+        UINT64 Start = __rdtsc();
+
+        switch (i % LOGBENCH_MIX)
+        {
+        case 0:
+            LOG_DEBUG("Received %lu bytes from peer %u on stream %u\n", (unsigned long)i, Thread->Index, 2u);
+            break;
+        case 1:
+            LOG_INFO("Received %lu bytes from peer %u on stream %u\n", (unsigned long)i, Thread->Index, 2u);
+            break;
+        default:
+            LOG_WARN("Received %lu bytes from peer %u on stream %u\n", (unsigned long)i, Thread->Index, 2u);
+            break;
+        }
+
+        Thread->Ticks[i] = __rdtsc() - Start;
+    }
+
+    return 0;
+}
+
+/**
+* Initialises the logger for one output.
+* 
+* @param Output Output to write to.
+* 
+* @return TRUE if successful, FALSE otherwise.
+*/
+static
+BOOL
+LogBenchOpen(
+    _In_ const LOGBENCH_OUTPUT* Output
+)
+{
+    INT64 Result = -1;
+    FILE* Discard = NULL;
+
+    switch (Output->Target)
+    {
+    case LOGBENCH_DISCARD:
+        // LoggerCleanUp closes the stream
+        if (fopen_s(&Discard, "NUL", "w") == 0 && Discard != NULL)
+        {
+            Result = LoggerInitConsole(Discard);
+            if (Result != 0)
+            {
+                fclose(Discard);
+            }
+        }
+        break;
+
+    case LOGBENCH_CONSOLE:
+        Result = LoggerInitConsole(stderr);
+        break;
+
+    case LOGBENCH_FILE:
+        LoggerSetFormat(LOG_FORMAT_TEXT);
+        Result = LoggerInitFile(LOGBENCH_DIRECTORY, 0);
+        break;
+
+    case LOGBENCH_ROTATE:
+        LoggerSetFormat(LOG_FORMAT_TEXT);
+        Result = LoggerInitFile(LOGBENCH_ROTATE_DIRECTORY, LOGBENCH_ROTATE_RETENTION);
+        if (Result == 0)
+        {
+            LoggerSetRotationSize(LOGBENCH_ROTATE_SIZE);
+            LoggerStartCompression();
+        }
+        break;
+    }
+
+    if (Result != 0)
+    {
+        return FALSE;
+    }
+
+    if (Output->IsAsync)
+    {
+        // blocking, so the rate is what the writer sustains rather than what it drops
+        LoggerStartAsync(0, LOG_OVERFLOW_BLOCK, LOG_LEVEL_NONE);
+    }
+
+    return TRUE;
+}
+
+/**
+* Runs one configuration of the suite and appends its row to the results.
+* 
+* @param Output        Output to write to.
+* @param ThreadCount   Threads writing at once.
+* @param Level         Level filter of the logger.
+* @param Calls         Statements per thread.
+* @param NsPerTick     From LogBenchCalibrate.
+* @param Results       CSV file.
+* 
+* @return TRUE if the run completed, FALSE otherwise.
+*/
+static
+BOOL
+LogBenchRun(
+    _In_ const LOGBENCH_OUTPUT* Output,
+    _In_ ULONG ThreadCount,
+    _In_ LOG_LEVEL Level,
+    _In_ ULONG Calls,
+    _In_ double NsPerTick,
+    _In_ FILE* Results
+)
+{
+    ULONGLONG TotalCalls = (ULONGLONG)ThreadCount * Calls;
+
+    PLOGBENCH_THREAD Threads = (PLOGBENCH_THREAD)calloc(ThreadCount, sizeof(LOGBENCH_THREAD));
+    PUINT64 Ticks = (PUINT64)malloc((SIZE_T)TotalCalls * sizeof(UINT64));
+    HANDLE StartEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+    if (Threads == NULL || Ticks == NULL || StartEvent == NULL || !LogBenchOpen(Output))
+    {
+        free(Threads);
+        free(Ticks);
+        if (StartEvent != NULL)
+        {
+            CloseHandle(StartEvent);
+        }
+        return FALSE;
+    }
+
+    LoggerSetLevel(Level);
+
+    ULONG Started = 0;
+    for (; Started < ThreadCount; ++Started)
+    {
+        Threads[Started].StartEvent = StartEvent;
+        Threads[Started].Index = Started;
+        Threads[Started].Calls = Calls;
+        Threads[Started].Ticks = Ticks + (SIZE_T)Started * Calls;
+        Threads[Started].Thread = CreateThread(NULL, 0, LogBenchWorker, &Threads[Started], 0, NULL);
+
+        if (Threads[Started].Thread == NULL)
+        {
+            break;
+        }
+    }
+
+    INT64 Start = LogBenchNow();
+    SetEvent(StartEvent);
+
+    for (ULONG i = 0; i < Started; ++i)
+    {
+        WaitForSingleObject(Threads[i].Thread, INFINITE);
+        CloseHandle(Threads[i].Thread);
+    }
+
+    INT64 Produced = LogBenchNow();
+
+    LoggerCleanUp(); // drains the async ring, the sustained rate includes the writer catching up
+
+    INT64 End = LogBenchNow();
+
+    CloseHandle(StartEvent);
+    free(Threads);
+
+    if (Started < ThreadCount)
+    {
+        free(Ticks);
+        return FALSE;
+    }
+
+    // the mix cycles through DEBUG, INFO and WARN, count the calls of the levels that pass
+    ULONGLONG Written = 0;
+    for (ULONG i = 0; i < LOGBENCH_MIX; ++i)
+    {
+        if (LOG_LEVEL_DEBUG + i >= (ULONG)Level)
+        {
+            Written += (ULONGLONG)ThreadCount * ( ( Calls + LOGBENCH_MIX - 1 - i ) / LOGBENCH_MIX );
+        }
+    }
+
+    UINT64 Sum = 0;
+    for (ULONGLONG i = 0; i < TotalCalls; ++i)
+    {
+        Sum += Ticks[i];
+    }
+
+    qsort(Ticks, (SIZE_T)TotalCalls, sizeof(UINT64), LogBenchCompareTicks);
+
+    double Seconds = LogBenchNanoseconds(Start, End, 1) / 1e9;
+    double Mean = (double)Sum / (double)TotalCalls * NsPerTick;
+    double P50 = (double)Ticks[TotalCalls / 2] * NsPerTick;
+    double P99 = (double)Ticks[TotalCalls * 99 / 100] * NsPerTick;
+    double P999 = (double)Ticks[TotalCalls * 999 / 1000] * NsPerTick;
+    double Max = (double)Ticks[TotalCalls - 1] * NsPerTick;
+    double CallsPerSecond = (double)TotalCalls / ( LogBenchNanoseconds(Start, Produced, 1) / 1e9 );
+    double LinesPerSecond = (double)Written / Seconds;
+
+    free(Ticks);
+
+    fprintf(
+        Results,
+        "%s,%lu,%s,%llu,%llu,%.6f,%.0f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+        Output->Name,
+        (unsigned long)ThreadCount,
+        LogBenchLevelNames[Level],
+        (unsigned long long)TotalCalls,
+        (unsigned long long)Written,
+        Seconds,
+        CallsPerSecond,
+        LinesPerSecond,
+        Mean,
+        P50,
+        P99,
+        P999,
+        Max
+    );
+    fflush(Results);
+
+    printf(
+        "%-12s %3lu threads %-5s p50 %8.1f ns  p99 %8.1f ns  p99.9 %9.1f ns  %10.0f lines/s\n",
+        Output->Name,
+        (unsigned long)ThreadCount,
+        LogBenchLevelNames[Level],
+        P50,
+        P99,
+        P999,
+        LinesPerSecond
+    );
+
+    return TRUE;
+}
+
+INT
+main(
+    INT argc,
+    PSTR* argv
+)
+{
+    ULONGLONG Iterations = LOGBENCH_DEFAULT_ITERATIONS;
+    ULONG     MaximumThreads;
+    PCSTR     ResultsPath = ( argc > 3 ) ? argv[3] : LOGBENCH_RESULTS;
+
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    MaximumThreads = SystemInfo.dwNumberOfProcessors;
+
+    if (argc > 1)
+    {
+        Iterations = _strtoui64(argv[1], NULL, 10);
+    }
+
+    if (argc > 2)
+    {
+        MaximumThreads = strtoul(argv[2], NULL, 10);
+    }
+
+    if (Iterations == 0 || MaximumThreads == 0)
+    {
+        printf("usage: logbench [iterations] [threads] [results]\n");
+        return 1;
+    }
+
+    if (LoggerInitConsole(stdout) != 0)
+    {
+        printf("Failed to initialise logger\n");
+        return 1;
+    }
+
+    LoggerSetLevel(LOG_LEVEL_INFO);
+
+    // the loop body the log statements replace, a single volatile store
+    INT64 Start = LogBenchNow();
+    for (ULONGLONG i = 0; i < Iterations; ++i)
+    {
+        BenchSink = (LONG)i;
+    }
+    double Baseline = LogBenchNanoseconds(Start, LogBenchNow(), Iterations);
+
+    // filtered at runtime: one lock-free read of the threshold
+    Start = LogBenchNow();
+    for (ULONGLONG i = 0; i < Iterations; ++i)
+    {
+        BenchSink = (LONG)i;
+        LOG_DEBUG("filtered %llu %d\n", (unsigned long long)i, LogBenchExpensiveArgument());
+    }
+    double Filtered = LogBenchNanoseconds(Start, LogBenchNow(), Iterations);
+
+    // below LOG_COMPILE_LEVEL in release builds, nothing is left of the statement
+    Start = LogBenchNow();
+    for (ULONGLONG i = 0; i < Iterations; ++i)
+    {
+        BenchSink = (LONG)i;
+        LOG_TRACE("stripped %llu %d\n", (unsigned long long)i, LogBenchExpensiveArgument());
+    }
+    double Stripped = LogBenchNanoseconds(Start, LogBenchNow(), Iterations);
+
+    printf("iterations           %llu\n", (unsigned long long)Iterations);
+    printf("compile level        %d\n", LOG_COMPILE_LEVEL);
+    printf("baseline loop        %.3f ns\n", Baseline);
+    printf("filtered LOG_DEBUG   %.3f ns (+%.3f)\n", Filtered, Filtered - Baseline);
+    printf("LOG_TRACE            %.3f ns (+%.3f)\n", Stripped, Stripped - Baseline);
+    printf("arguments evaluated  %ld\n", (long)ArgumentEvaluations);
+
+    LoggerCleanUp();
+
+    ULONGLONG Writes = max(Iterations / LOGBENCH_WRITE_DIVISOR, 1);
+
+    double Text = LogBenchWrite(LOG_FORMAT_TEXT, Writes);
+    double Binary = LogBenchWrite(LOG_FORMAT_BINARY, Writes);
+
+    printf("written statements   %llu\n", (unsigned long long)Writes);
+    printf("text file LOG_INFO   %.3f ns\n", Text);
+    printf("binary file LOG_INFO %.3f ns\n", Binary);
+
+    ULONG Calls = (ULONG)min(max(Iterations / LOGBENCH_SUITE_DIVISOR, 1), MAXULONG);
+
+    CreateDirectoryA(LOGBENCH_DIRECTORY, NULL);
+    CreateDirectoryA(LOGBENCH_ROTATE_DIRECTORY, NULL);
+
+    FILE* Results = NULL;
+    if (fopen_s(&Results, ResultsPath, "w") != 0 || Results == NULL)
+    {
+        printf("Failed to open %s\n", ResultsPath);
+        return 1;
+    }
+
+    double NsPerTick = LogBenchCalibrate();
+
+    fprintf(Results, "output,threads,level,calls,written,seconds,calls_per_sec,lines_per_sec,ns_mean,ns_p50,ns_p99,ns_p999,ns_max\n");
+    printf("suite                %lu calls per thread, up to %lu threads, results in %s\n", (unsigned long)Calls, (unsigned long)MaximumThreads, ResultsPath);
+
+    for (ULONG i = 0; i < ARRAYSIZE(LogBenchOutputs); ++i)
+    {
+        // 1, 2, 4 ... and the maximum itself when it is not a power of two
+        for (ULONG ThreadCount = 1; ThreadCount <= MaximumThreads; ThreadCount = ( ThreadCount == MaximumThreads ) ? ThreadCount + 1 : min(ThreadCount * 2, MaximumThreads))
+        {
+            for (ULONG j = 0; j < ARRAYSIZE(LogBenchLevels); ++j)
+            {
+                if (!LogBenchRun(&LogBenchOutputs[i], ThreadCount, LogBenchLevels[j], Calls, NsPerTick, Results))
+                {
+                    printf("%-12s %3lu threads %-5s failed\n", LogBenchOutputs[i].Name, (unsigned long)ThreadCount, LogBenchLevelNames[LogBenchLevels[j]]);
+                }
+            }
+        }
+    }
+
+    fclose(Results);
+
+    return 0;
+}
@@ -0,0 +1,1489 @@
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logformat.h"
+#include "logpack.h"
+
+/**
+    * Offline tools for the client's log files.
+    *
+    *     logtool decode <file.plog[.lzb]> [minimum level]
+    *
+    * Renders every record as the line the text logger would have written. Compressed binary files
+    * are decompressed first.
+    *
+    *     logtool json <file.plog[.lzb]> [minimum level]
+    *
+    * Renders every record as the line the JSON logger would have written, one member per field for
+    * structured call sites.
+    *
+    *     logtool unpack <file.lzb> ["YYYY-MM-DD HH:MM:SS" ["YYYY-MM-DD HH:MM:SS"]]
+    *
+    * Writes the original of a compressed log file to stdout, or the part of it between two local
+    * times. Only the blocks whose records overlap the range are decompressed, text lines outside it
+    * are dropped. A binary range also keeps the session and format records before it, so it can be
+    * decoded, and is cut at block boundaries.
+    *
+    *     logtool query <file[.lzb]> "YYYY-MM-DD HH:MM:SS" "YYYY-MM-DD HH:MM:SS" [minimum level [source file]]
+    *
+    * Writes the records of a log file between two local times, at or above a level and from source
+    * files whose name contains the given text. Text and JSON lines are written as they are, binary
+    * records decoded to text. The time index the logger writes next to the file, or the block index
+    * of a compressed file, tells which parts of the file to read; text spans outside the range are
+    * skipped, binary ones are still read for their format records. Parts the index does not cover are
+    * read whole.
+*/
+
+#define LOGTOOL_MESSAGE_SIZE 4096
+#define LOGTOOL_TIMESTAMP_SIZE 32
+#define LOGTOOL_UNINDEXED 1      // EarliestTime of a part of a log file its index does not cover
+
+/**
+* Records selected from a log file.
+*/
+typedef struct _LOGTOOL_QUERY
+{
+    UINT64 From;            // local FILETIME, 0 for the whole file
+    UINT64 To;
+    UINT8  MinimumLevel;
+    PCSTR  Source;          // part of the source file name, NULL for every file
+} LOGTOOL_QUERY, *PLOGTOOL_QUERY;
+
+typedef struct _LOGTOOL_FORMAT
+{
+    BOOL   IsDefined;
+    UINT32 Line;
+    UINT8  ArgCount;
+    UINT8  ArgTypes[LOG_MAX_ARGS];
+    PSTR   File;    // all three point into Storage
+    PSTR   Format;
+    PSTR   Event;   // NULL for sites that are not structured
+    PSTR   Storage;
+    PLOG_JSON_TEMPLATE Json; // built on the site's first event rendered as JSON
+} LOGTOOL_FORMAT, *PLOGTOOL_FORMAT;
+
+typedef struct _LOGTOOL_DECODER
+{
+    LOG_SESSION_RECORD Session;
+    BOOL               HasSession;
+    UINT8              MinimumLevel;
+    UINT64             From;                   // events outside From and To are skipped, From 0 for none
+    UINT64             To;
+    PCSTR              Source;                 // events from other source files are skipped, NULL for none
+    BOOL               IsJson;                 // print JSON lines instead of text lines
+    LOGTOOL_FORMAT     Formats[LOG_MAX_SITES]; // format ids of the current session
+    UINT64             Undecodable;
+} LOGTOOL_DECODER, *PLOGTOOL_DECODER;
+
+static LOGTOOL_DECODER GlobalDecoder = { 0 };
+
+static UINT8 RecordBuffer[LOG_MAX_RECORD + 1];
+
+static
+PCSTR LOG_LEVEL_NAMES[] = {
+    "NONE",
+    "TRACE",
+    "DEBUG",
+    "INFO",
+    "WARN",
+    "ERROR",
+    "FATAL"
+};
+
+#define LOGTOOL_LEVEL_COUNT ( sizeof(LOG_LEVEL_NAMES) / sizeof(LOG_LEVEL_NAMES[0]) )
+
+/**
+* Forgets the format records of the previous session, ids are only unique within a session.
+*/
+static
+VOID
+LogToolResetFormats(
+    _Inout_ PLOGTOOL_DECODER pDecoder
+)
+{
+    for (ULONG i = 0; i < LOG_MAX_SITES; ++i)
+    {
+        free(pDecoder->Formats[i].Storage);
+        free(pDecoder->Formats[i].Json);
+    }
+
+    memset(pDecoder->Formats, 0, sizeof(pDecoder->Formats));
+}
+
+/**
+* Converts event ticks to local wall clock time using the session record.
+*
+* @return Local FILETIME of the event, 0 before the first session record.
+*/
+static
+UINT64
+LogToolTicksTime(
+    _In_ const LOGTOOL_DECODER* pDecoder,
+    _In_ UINT64 Ticks
+)
+{
+    if (!pDecoder->HasSession || pDecoder->Session.TicksPerSecond == 0)
+    {
+        return 0;
+    }
+
+    // events queued before a rotation may be older than the session that follows them
+    INT64 Delta = (INT64)(Ticks - pDecoder->Session.BaseTicks);
+    INT64 Frequency = (INT64)pDecoder->Session.TicksPerSecond;
+    INT64 Offset = (Delta / Frequency) * 10000000LL + ((Delta % Frequency) * 10000000LL) / Frequency;
+
+    return pDecoder->Session.BaseTime + Offset;
+}
+
+/**
+* Formats event ticks as local wall clock time.
+*
+* @param pDecoder   Decoder holding the current session.
+* @param Ticks      Performance counter of the event.
+* @param Buffer     Receives YYYY-MM-DD HH:MM:SS.mmm.
+* @param BufferSize Size of the buffer.
+*/
+static
+VOID
+LogToolTimestamp(
+    _In_  const LOGTOOL_DECODER* pDecoder,
+    _In_  UINT64 Ticks,
+    _Out_ PSTR Buffer,
+    _In_  ULONG BufferSize
+)
+{
+    UINT64 Time = LogToolTicksTime(pDecoder, Ticks);
+
+    if (Time == 0)
+    {
+        _snprintf_s(Buffer, BufferSize, _TRUNCATE, "---------- --:--:--.---");
+        return;
+    }
+
+    FILETIME   FileTime;
+    SYSTEMTIME SystemTime;
+
+    FileTime.dwLowDateTime = (DWORD)Time;
+    FileTime.dwHighDateTime = (DWORD)(Time >> 32);
+    FileTimeToSystemTime(&FileTime, &SystemTime); // already local, no conversion
+
+    _snprintf_s(
+        Buffer,
+        BufferSize,
+        _TRUNCATE,
+        "%04d-%02d-%02d %02d:%02d:%02d.%03d",
+        SystemTime.wYear,
+        SystemTime.wMonth,
+        SystemTime.wDay,
+        SystemTime.wHour,
+        SystemTime.wMinute,
+        SystemTime.wSecond,
+        SystemTime.wMilliseconds
+    );
+}
+
+/**
+* @return Name of a record's level.
+*/
+static
+PCSTR
+LogToolLevelName(
+    _In_ UINT8 Level
+)
+{
+    return (Level < LOGTOOL_LEVEL_COUNT) ? LOG_LEVEL_NAMES[Level] : "?";
+}
+
+/**
+* @return TRUE if an event falls in the decoder's time range and comes from its source file.
+*/
+static
+BOOL
+LogToolIsSelected(
+    _In_ const LOGTOOL_DECODER* pDecoder,
+    _In_ UINT64 Ticks,
+    _In_ PCSTR File
+)
+{
+    if (pDecoder->From != 0)
+    {
+        UINT64 Time = LogToolTicksTime(pDecoder, Ticks);
+
+        if (Time < pDecoder->From || Time > pDecoder->To)
+        {
+            return FALSE;
+        }
+    }
+
+    return pDecoder->Source == NULL || strstr(File, pDecoder->Source) != NULL;
+}
+
+/**
+* Prints one decoded record in the text logger's layout, or the JSON logger's.
+*
+* @param Event Event name of a structured site, NULL otherwise.
+*/
+static
+VOID
+LogToolPrint(
+    _In_     const LOGTOOL_DECODER* pDecoder,
+    _In_     UINT8 Level,
+    _In_     UINT64 Ticks,
+    _In_     PCSTR File,
+    _In_     UINT32 Line,
+    _In_opt_ PCSTR Event,
+    _In_     PCSTR Message
+)
+{
+    static CHAR Json[LOGTOOL_MESSAGE_SIZE];
+
+    CHAR Timestamp[LOGTOOL_TIMESTAMP_SIZE];
+    LogToolTimestamp(pDecoder, Ticks, Timestamp, sizeof(Timestamp));
+
+    if (pDecoder->IsJson)
+    {
+        LOG_JSON_TEMPLATE Template;
+
+        if (LogFormatBuildJsonTemplate(LogToolLevelName(Level), File, Line, Event, NULL, &Template) &&
+            LogFormatRenderJson(&Template, Timestamp, Message, NULL, 0, NULL, 0, Json, sizeof(Json)) > 0)
+        {
+            fputs(Json, stdout);
+        }
+        return;
+    }
+
+    SIZE_T MessageLength = strlen(Message);
+    if (MessageLength > 0 && Message[MessageLength - 1] == '\n')
+    {
+        --MessageLength; // most call sites end their format with a newline already
+    }
+
+    printf(
+        "[%s] [%s] [%s:%u] %s%s%.*s\n",
+        Timestamp,
+        LogToolLevelName(Level),
+        File,
+        Line,
+        (Event != NULL) ? Event : "",
+        (Event != NULL) ? " " : "",
+        (INT)MessageLength,
+        Message
+    );
+}
+
+/**
+* Stores the format record of a site for the events that follow it.
+*
+* @return TRUE if successful, FALSE if the record is malformed.
+*/
+static
+BOOL
+LogToolDefineFormat(
+    _Inout_ PLOGTOOL_DECODER pDecoder,
+    _In_    const UINT8* Payload,
+    _In_    UINT16 Length
+)
+{
+    LOG_FORMAT_RECORD Definition;
+
+    if (Length < sizeof(Definition))
+    {
+        return FALSE;
+    }
+
+    memcpy(&Definition, Payload, sizeof(Definition));
+
+    if (Definition.FormatId >= LOG_MAX_SITES || Definition.ArgCount > LOG_MAX_ARGS ||
+        Length < sizeof(Definition) + Definition.ArgCount + 2)
+    {
+        return FALSE;
+    }
+
+    ULONG  StringsLength = Length - sizeof(Definition) - Definition.ArgCount;
+    PCSTR  Strings = (PCSTR)(Payload + sizeof(Definition) + Definition.ArgCount);
+
+    // both strings must be terminated inside the record
+    PCSTR FileEnd = memchr(Strings, '\0', StringsLength);
+    PCSTR FormatEnd = (FileEnd != NULL) ? memchr(FileEnd + 1, '\0', StringsLength - (FileEnd + 1 - Strings)) : NULL;
+    if (FormatEnd == NULL)
+    {
+        return FALSE;
+    }
+
+    // so must the event name of a structured site, when there is one
+    ULONG EventLength = StringsLength - (ULONG)(FormatEnd + 1 - Strings);
+    if (EventLength > 0 && memchr(FormatEnd + 1, '\0', EventLength) == NULL)
+    {
+        return FALSE;
+    }
+
+    PLOGTOOL_FORMAT pFormat = &pDecoder->Formats[Definition.FormatId];
+    free(pFormat->Storage);
+    free(pFormat->Json);
+    pFormat->Json = NULL;
+
+    pFormat->Storage = (PSTR)malloc(StringsLength);
+    if (pFormat->Storage == NULL)
+    {
+        pFormat->IsDefined = FALSE;
+        return FALSE;
+    }
+
+    memcpy(pFormat->Storage, Strings, StringsLength);
+    memcpy(pFormat->ArgTypes, Payload + sizeof(Definition), Definition.ArgCount);
+
+    pFormat->IsDefined = TRUE;
+    pFormat->Line = Definition.Line;
+    pFormat->ArgCount = Definition.ArgCount;
+    pFormat->File = pFormat->Storage;
+    pFormat->Format = pFormat->Storage + (FileEnd - Strings) + 1;
+    pFormat->Event = (EventLength > 0) ? pFormat->Storage + (FormatEnd - Strings) + 1 : NULL;
+
+    return TRUE;
+}
+
+/**
+* Decodes an event record against the format record of its site.
+*/
+static
+VOID
+LogToolDecodeEvent(
+    _Inout_ PLOGTOOL_DECODER pDecoder,
+    _In_    UINT8 Level,
+    _In_    const UINT8* Payload,
+    _In_    UINT16 Length
+)
+{
+    static CHAR Message[LOGTOOL_MESSAGE_SIZE];
+    LOG_EVENT_RECORD Event;
+
+    if (Length < sizeof(Event))
+    {
+        ++pDecoder->Undecodable;
+        return;
+    }
+
+    memcpy(&Event, Payload, sizeof(Event));
+
+    if (Event.FormatId >= LOG_MAX_SITES || !pDecoder->Formats[Event.FormatId].IsDefined)
+    {
+        ++pDecoder->Undecodable;
+        return;
+    }
+
+    PLOGTOOL_FORMAT pFormat = &pDecoder->Formats[Event.FormatId];
+
+    if (!LogToolIsSelected(pDecoder, Event.Ticks, pFormat->File))
+    {
+        return;
+    }
+
+    // structured sites render their fields as members of their own
+    if (pDecoder->IsJson && pFormat->Event != NULL)
+    {
+        if (pFormat->Json == NULL && (pFormat->Json = (PLOG_JSON_TEMPLATE)malloc(sizeof(LOG_JSON_TEMPLATE))) != NULL &&
+            !LogFormatBuildJsonTemplate(LogToolLevelName(Level), pFormat->File, pFormat->Line, pFormat->Event, pFormat->Format, pFormat->Json))
+        {
+            free(pFormat->Json);
+            pFormat->Json = NULL;
+        }
+
+        if (pFormat->Json != NULL)
+        {
+            CHAR Timestamp[LOGTOOL_TIMESTAMP_SIZE];
+            LogToolTimestamp(pDecoder, Event.Ticks, Timestamp, sizeof(Timestamp));
+
+            if (LogFormatRenderJson(
+                    pFormat->Json,
+                    Timestamp,
+                    NULL,
+                    pFormat->ArgTypes,
+                    pFormat->ArgCount,
+                    Payload + sizeof(Event),
+                    Length - sizeof(Event),
+                    Message,
+                    sizeof(Message)) == 0)
+            {
+                ++pDecoder->Undecodable;
+                return;
+            }
+
+            fputs(Message, stdout);
+            return;
+        }
+    }
+
+    if (!LogFormatRender(
+            pFormat->Format,
+            pFormat->ArgTypes,
+            pFormat->ArgCount,
+            Payload + sizeof(Event),
+            Length - sizeof(Event),
+            Message,
+            sizeof(Message)))
+    {
+        ++pDecoder->Undecodable;
+        return;
+    }
+
+    LogToolPrint(pDecoder, Level, Event.Ticks, pFormat->File, pFormat->Line, pFormat->Event, Message);
+}
+
+/**
+* Prints a preformatted text record.
+*/
+static
+VOID
+LogToolDecodeText(
+    _Inout_ PLOGTOOL_DECODER pDecoder,
+    _In_    UINT8 Level,
+    _In_    const UINT8* Payload,
+    _In_    UINT16 Length
+)
+{
+    LOG_TEXT_RECORD Text;
+
+    if (Length < sizeof(Text) + 2)
+    {
+        ++pDecoder->Undecodable;
+        return;
+    }
+
+    memcpy(&Text, Payload, sizeof(Text));
+
+    PCSTR  Strings = (PCSTR)(Payload + sizeof(Text));
+    ULONG  StringsLength = Length - sizeof(Text);
+    PCSTR  FileEnd = memchr(Strings, '\0', StringsLength);
+
+    if (FileEnd == NULL || memchr(FileEnd + 1, '\0', StringsLength - (FileEnd + 1 - Strings)) == NULL)
+    {
+        ++pDecoder->Undecodable;
+        return;
+    }
+
+    if (LogToolIsSelected(pDecoder, Text.Ticks, Strings))
+    {
+        LogToolPrint(pDecoder, Level, Text.Ticks, Strings, Text.Line, NULL, FileEnd + 1);
+    }
+}
+
+/**
+* Decodes a binary log file to stdout.
+*
+* @param Stream       Binary log file, positioned at its start.
+* @param Path         Name of the file, for messages.
+* @param MinimumLevel Events below this level are skipped.
+*
+* @return 0 if the whole file was decoded, 1 otherwise.
+*/
+static
+INT
+LogToolDecodeStream(
+    _In_ FILE* Stream,
+    _In_ PCSTR Path,
+    _In_ UINT8 MinimumLevel
+)
+{
+    PLOGTOOL_DECODER pDecoder = &GlobalDecoder;
+
+    LOG_FILE_HEADER FileHeader;
+    if (fread(&FileHeader, sizeof(FileHeader), 1, Stream) != 1 ||
+        FileHeader.Magic != LOG_BINARY_MAGIC ||
+        FileHeader.Version != LOG_BINARY_VERSION)
+    {
+        printf("%s is not a binary log file\n", Path);
+        return 1;
+    }
+
+    pDecoder->MinimumLevel = MinimumLevel;
+
+    INT Result = 0;
+    LOG_RECORD_HEADER Header;
+
+    while (fread(&Header, sizeof(Header), 1, Stream) == 1)
+    {
+        if (Header.Type == LOG_RECORD_PADDING)
+        {
+            // step back to the byte after this zero and skip the rest of the padding
+            _fseeki64(Stream, 1 - (INT64)sizeof(Header), SEEK_CUR);
+
+            INT Byte;
+            while ((Byte = fgetc(Stream)) == 0)
+            {
+            }
+
+            if (Byte == EOF)
+            {
+                break;
+            }
+
+            ungetc(Byte, Stream);
+            continue;
+        }
+
+        if (Header.Length > 0 && fread(RecordBuffer, 1, Header.Length, Stream) != Header.Length)
+        {
+            printf("Truncated record at the end of %s\n", Path);
+            Result = 1;
+            break;
+        }
+
+        switch (Header.Type)
+        {
+        case LOG_RECORD_SESSION:
+            if (Header.Length >= sizeof(pDecoder->Session))
+            {
+                memcpy(&pDecoder->Session, RecordBuffer, sizeof(pDecoder->Session));
+                pDecoder->HasSession = TRUE;
+                LogToolResetFormats(pDecoder);
+            }
+            break;
+
+        case LOG_RECORD_FORMAT:
+            if (!LogToolDefineFormat(pDecoder, RecordBuffer, Header.Length))
+            {
+                ++pDecoder->Undecodable;
+            }
+            break;
+
+        case LOG_RECORD_EVENT:
+            if (Header.Level >= pDecoder->MinimumLevel)
+            {
+                LogToolDecodeEvent(pDecoder, Header.Level, RecordBuffer, Header.Length);
+            }
+            break;
+
+        case LOG_RECORD_TEXT:
+            if (Header.Level >= pDecoder->MinimumLevel)
+            {
+                LogToolDecodeText(pDecoder, Header.Level, RecordBuffer, Header.Length);
+            }
+            break;
+
+        default:
+            ++pDecoder->Undecodable; // newer record type, skipped by its length
+            break;
+        }
+    }
+
+    if (pDecoder->Undecodable > 0)
+    {
+        fprintf(stderr, "%llu record(s) could not be decoded\n", (unsigned long long)pDecoder->Undecodable);
+    }
+
+    LogToolResetFormats(pDecoder);
+
+    return Result;
+}
+
+/**
+* Reads the header and the block index of a compressed log file.
+*
+* @param Stream  Compressed log file.
+* @param Path    Name of the file, for messages.
+* @param pHeader Receives the header.
+* @param pBlocks Receives the index, freed by the caller.
+*
+* @return TRUE if successful, FALSE if the file is not a compressed log file.
+*/
+static
+BOOL
+LogToolReadPack(
+    _In_  FILE* Stream,
+    _In_  PCSTR Path,
+    _Out_ PLOG_PACK_HEADER pHeader,
+    _Out_ PLOG_PACK_BLOCK* pBlocks
+)
+{
+    *pBlocks = NULL;
+
+    if (_fseeki64(Stream, 0, SEEK_SET) != 0 ||
+        fread(pHeader, sizeof(*pHeader), 1, Stream) != 1 ||
+        pHeader->Magic != LOG_PACK_MAGIC ||
+        pHeader->Version != LOG_PACK_VERSION ||
+        pHeader->IndexOffset == 0)
+    {
+        printf("%s is not a compressed log file\n", Path);
+        return FALSE;
+    }
+
+    PLOG_PACK_BLOCK Blocks = calloc(max(pHeader->BlockCount, 1), sizeof(LOG_PACK_BLOCK));
+    if (Blocks == NULL)
+    {
+        return FALSE;
+    }
+
+    if (_fseeki64(Stream, (INT64)pHeader->IndexOffset, SEEK_SET) != 0 ||
+        fread(Blocks, sizeof(LOG_PACK_BLOCK), pHeader->BlockCount, Stream) != pHeader->BlockCount)
+    {
+        printf("Truncated index in %s\n", Path);
+        free(Blocks);
+        return FALSE;
+    }
+
+    *pBlocks = Blocks;
+
+    return TRUE;
+}
+
+/**
+* Reads and decompresses one block.
+*
+* @return TRUE if successful, FALSE if the block is corrupt.
+*/
+static
+BOOL
+LogToolReadBlock(
+    _In_  FILE* Stream,
+    _In_  const LOG_PACK_BLOCK* Block,
+    _Out_ PUINT8 Packed,
+    _Out_ PUINT8 Data
+)
+{
+    if (Block->Length > LOG_PACK_MAX_BLOCK || Block->PackedLength > Block->Length)
+    {
+        return FALSE;
+    }
+
+    if (_fseeki64(Stream, (INT64)Block->Offset, SEEK_SET) != 0 ||
+        fread(Packed, 1, Block->PackedLength, Stream) != Block->PackedLength)
+    {
+        return FALSE;
+    }
+
+    if (Block->PackedLength == Block->Length)
+    {
+        memcpy(Data, Packed, Block->Length); // stored as is
+        return TRUE;
+    }
+
+    return LogPackDecompress(Packed, Block->PackedLength, Data, Block->Length);
+}
+
+/**
+* Finds a piece of text in a line.
+*
+* @return The character after the text, NULL if the line does not contain it.
+*/
+static
+PCSTR
+LogToolFind(
+    _In_ PCSTR Start,
+    _In_ PCSTR End,
+    _In_ PCSTR Text
+)
+{
+    SIZE_T Length = strlen(Text);
+
+    for (PCSTR Next = Start; (SIZE_T)(End - Next) >= Length; ++Next)
+    {
+        Next = memchr(Next, Text[0], End - Next);
+        if (Next == NULL || (SIZE_T)(End - Next) < Length)
+        {
+            break;
+        }
+
+        if (memcmp(Next, Text, Length) == 0)
+        {
+            return Next + Length;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+* Checks the level and the source file of a text or JSON logger line, "[time] [LEVEL] [file:line] "
+* or the "level" and "file" members. Lines whose fields cannot be found are kept.
+*
+* @return TRUE if the line passes the query's level and source filters.
+*/
+static
+BOOL
+LogToolIsLineSelected(
+    _In_ const UINT8* Line,
+    _In_ ULONG Length,
+    _In_ const LOGTOOL_QUERY* Query
+)
+{
+    if (Query->MinimumLevel == 0 && Query->Source == NULL)
+    {
+        return TRUE;
+    }
+
+    PCSTR End = (PCSTR)Line + Length;
+    PCSTR Level;
+    PCSTR File;
+    CHAR  Close;
+
+    if (Line[0] == '[')
+    {
+        Level = LogToolFind((PCSTR)Line, End, "] [");
+        File = (Level != NULL) ? LogToolFind(Level, End, "] [") : NULL;
+        Close = ']';
+    }
+    else
+    {
+        Level = LogToolFind((PCSTR)Line, End, "\"level\":\"");
+        File = LogToolFind((PCSTR)Line, End, "\"file\":\"");
+        Close = '"';
+    }
+
+    PCSTR LevelEnd = (Level != NULL) ? memchr(Level, Close, End - Level) : NULL;
+    PCSTR FileEnd = (File != NULL) ? memchr(File, Close, End - File) : NULL;
+
+    if (LevelEnd == NULL || FileEnd == NULL)
+    {
+        return TRUE;
+    }
+
+    for (UINT8 i = 0; i < Query->MinimumLevel; ++i)
+    {
+        if (strlen(LOG_LEVEL_NAMES[i]) == (SIZE_T)(LevelEnd - Level) && memcmp(Level, LOG_LEVEL_NAMES[i], LevelEnd - Level) == 0)
+        {
+            return FALSE;
+        }
+    }
+
+    // the text layout follows the file name with its line number
+    if (Close == ']')
+    {
+        PCSTR Colon = FileEnd;
+        while (Colon > File && *Colon != ':')
+        {
+            --Colon;
+        }
+
+        FileEnd = (Colon > File) ? Colon : FileEnd;
+    }
+
+    return Query->Source == NULL || LogToolFind(File, FileEnd, Query->Source) != NULL;
+}
+
+/**
+* Writes the text lines of a block that fall in the range and pass the query's filters. A line
+* without a timestamp belongs to the line before it, zero bytes left by a preallocated file are
+* dropped.
+*
+* @param IsSelected Whether the last line before this block was written, updated.
+*/
+static
+BOOL
+LogToolWriteLines(
+    _In_    const UINT8* Data,
+    _In_    ULONG Length,
+    _In_    const LOGTOOL_QUERY* Query,
+    _Inout_ PBOOL IsSelected,
+    _In_    FILE* Output
+)
+{
+    for (ULONG Line = 0; Line < Length; )
+    {
+        const UINT8* End = memchr(Data + Line, '\n', Length - Line);
+        ULONG LineLength = (End != NULL) ? (ULONG)(End - Data) + 1 - Line : Length - Line;
+
+        if (Data[Line] == '\0')
+        {
+            Line += LineLength;
+            continue;
+        }
+
+        UINT64 Time = LogPackLineTime(Data + Line, LineLength);
+        if (Time != 0)
+        {
+            *IsSelected = Time >= Query->From && Time <= Query->To && LogToolIsLineSelected(Data + Line, LineLength, Query);
+        }
+
+        if (*IsSelected && fwrite(Data + Line, 1, LineLength, Output) != LineLength)
+        {
+            return FALSE;
+        }
+
+        Line += LineLength;
+    }
+
+    return TRUE;
+}
+
+/**
+* Writes the session and format records of a binary block, and the file header if the block has it.
+*/
+static
+BOOL
+LogToolWriteDefinitions(
+    _In_ const UINT8* Data,
+    _In_ ULONG Length,
+    _In_ BOOL IsFirst,
+    _In_ FILE* Output
+)
+{
+    ULONG Offset = 0;
+
+    if (IsFirst)
+    {
+        Offset = min(sizeof(LOG_FILE_HEADER), Length);
+
+        if (fwrite(Data, 1, Offset, Output) != Offset)
+        {
+            return FALSE;
+        }
+    }
+
+    while (Offset < Length)
+    {
+        LOG_RECORD_HEADER Header;
+
+        if (Data[Offset] == 0)
+        {
+            ++Offset; // padding
+            continue;
+        }
+
+        if (Length - Offset < sizeof(Header))
+        {
+            break;
+        }
+
+        memcpy(&Header, Data + Offset, sizeof(Header));
+
+        ULONG Record = sizeof(Header) + Header.Length;
+        if (Length - Offset < Record)
+        {
+            break;
+        }
+
+        if ((Header.Type == LOG_RECORD_SESSION || Header.Type == LOG_RECORD_FORMAT) &&
+            fwrite(Data + Offset, 1, Record, Output) != Record)
+        {
+            return FALSE;
+        }
+
+        Offset += Record;
+    }
+
+    return TRUE;
+}
+
+/**
+* @return TRUE if records of the block fall between the two times.
+*/
+static
+BOOL
+LogToolIsOverlapping(
+    _In_ const LOG_PACK_BLOCK* Block,
+    _In_ UINT64 From,
+    _In_ UINT64 To
+)
+{
+    return Block->EarliestTime != 0 && Block->EarliestTime <= To && Block->LatestTime >= From;
+}
+
+/**
+* Writes the blocks of a log file, or the part of them a query selects. Text blocks outside the
+* range are skipped, binary ones only give their session and format records. Nothing past the last
+* block the range overlaps is read.
+*
+* @param Stream     Compressed or plain log file.
+* @param Path       Name of the file, for messages.
+* @param Blocks     Blocks in file order, starting with the file's first byte. A plain file's are
+*                   stored as is, LOGTOOL_UNINDEXED ones may be cut anywhere.
+* @param BlockCount Number of blocks.
+* @param IsBinary   TRUE for the blocks of a binary log file.
+* @param Query      Range and filters, From 0 for all of it.
+* @param Output     Receives the original data.
+* @param Read       Receives the number of blocks read.
+*
+* @return 0 if successful, 1 otherwise.
+*/
+static
+INT
+LogToolWriteBlocks(
+    _In_  FILE* Stream,
+    _In_  PCSTR Path,
+    _In_  const LOG_PACK_BLOCK* Blocks,
+    _In_  ULONG BlockCount,
+    _In_  BOOL IsBinary,
+    _In_  const LOGTOOL_QUERY* Query,
+    _In_  FILE* Output,
+    _Out_ PULONG Read
+)
+{
+    BOOL IsRange = Query->From != 0;
+
+    ULONG LastBlock = IsRange ? 0 : BlockCount;
+    for (ULONG i = 0; IsRange && i < BlockCount; ++i)
+    {
+        if (LogToolIsOverlapping(&Blocks[i], Query->From, Query->To))
+        {
+            LastBlock = i + 1;
+        }
+    }
+
+    PUINT8 Packed = malloc(LOG_PACK_MAX_BLOCK);
+    PUINT8 Data = malloc(LOG_PACK_MAX_BLOCK);
+    INT    Result = (Packed != NULL && Data != NULL) ? 0 : 1;
+    BOOL   IsSelected = FALSE;
+    ULONG  Carry = 0;
+
+    *Read = 0;
+
+    for (ULONG i = 0; Result == 0 && i < LastBlock; ++i)
+    {
+        LOG_PACK_BLOCK Block = Blocks[i];
+        BOOL IsOverlapping = !IsRange || LogToolIsOverlapping(&Block, Query->From, Query->To);
+
+        if (!IsOverlapping && !IsBinary)
+        {
+            IsSelected = FALSE;
+            continue; // text blocks outside the range are not even read
+        }
+
+        // the unfinished last line of the previous unindexed block is read again with this one
+        Block.Offset -= Carry;
+        Block.Length += Carry;
+        Block.PackedLength += Carry;
+        Carry = 0;
+
+        if (!LogToolReadBlock( Stream, &Block, Packed, Data ))
+        {
+            fprintf(stderr, "Block %lu of %s is corrupt\n", (unsigned long)i, Path);
+            Result = 1;
+            break;
+        }
+
+        ++*Read;
+
+        ULONG Length = Block.Length;
+
+        if (!IsBinary && Block.EarliestTime == LOGTOOL_UNINDEXED && i + 1 < LastBlock &&
+            Blocks[i + 1].EarliestTime == LOGTOOL_UNINDEXED)
+        {
+            const UINT8* LastLine = Data + Length;
+            while (LastLine > Data && LastLine[-1] != '\n')
+            {
+                --LastLine;
+            }
+
+            if (LastLine > Data && (ULONG)(Data + Length - LastLine) <= LOG_PACK_MAX_BLOCK - LOG_PACK_BLOCK_SIZE)
+            {
+                Carry = (ULONG)(Data + Length - LastLine);
+                Length -= Carry;
+            }
+        }
+
+        BOOL IsWritten;
+
+        if (!IsRange || (IsBinary && IsOverlapping))
+        {
+            IsWritten = fwrite(Data, 1, Length, Output) == Length;
+        }
+        else if (IsBinary)
+        {
+            IsWritten = LogToolWriteDefinitions(Data, Length, i == 0, Output);
+        }
+        else
+        {
+            IsWritten = LogToolWriteLines(Data, Length, Query, &IsSelected, Output);
+        }
+
+        if (!IsWritten)
+        {
+            Result = 1;
+        }
+    }
+
+    free(Data);
+    free(Packed);
+
+    return Result;
+}
+
+/**
+* Writes the original of a compressed log file, or the part of it between two times.
+*
+* @param Stream Compressed log file.
+* @param Path   Name of the file, for messages.
+* @param From   Local FILETIME the range starts at, 0 for the whole file.
+* @param To     Local FILETIME the range ends at.
+* @param Output Receives the original data.
+*
+* @return 0 if successful, 1 otherwise.
+*/
+static
+INT
+LogToolUnpackStream(
+    _In_ FILE* Stream,
+    _In_ PCSTR Path,
+    _In_ UINT64 From,
+    _In_ UINT64 To,
+    _In_ FILE* Output
+)
+{
+    LOG_PACK_HEADER Header;
+    PLOG_PACK_BLOCK Blocks;
+
+    if (!LogToolReadPack(Stream, Path, &Header, &Blocks))
+    {
+        return 1;
+    }
+
+    LOGTOOL_QUERY Query = { From, To, 0, NULL };
+    BOOL          IsBinary = (Header.Flags & LOG_PACK_FLAG_BINARY) != 0;
+    ULONG         Decompressed = 0;
+
+    INT Result = LogToolWriteBlocks(Stream, Path, Blocks, Header.BlockCount, IsBinary, &Query, Output, &Decompressed);
+
+    if (From != 0)
+    {
+        fprintf(stderr, "%lu of %lu block(s) decompressed\n", (unsigned long)Decompressed, (unsigned long)Header.BlockCount);
+    }
+
+    free(Blocks);
+
+    return Result;
+}
+
+/**
+* Decodes a binary log file to stdout, decompressing it first if it was compressed.
+*
+* @param Path         File to decode.
+* @param MinimumLevel Events below this level are skipped.
+*
+* @return 0 if the whole file was decoded, 1 otherwise.
+*/
+static
+INT
+LogToolDecode(
+    _In_ PCSTR Path,
+    _In_ UINT8 MinimumLevel
+)
+{
+    FILE* Stream = NULL;
+
+    if (fopen_s(&Stream, Path, "rb") != 0 || Stream == NULL)
+    {
+        printf("Unable to open %s\n", Path);
+        return 1;
+    }
+
+    UINT32 Magic = 0;
+    if (fread(&Magic, sizeof(Magic), 1, Stream) != 1 || Magic != LOG_PACK_MAGIC)
+    {
+        rewind(Stream);
+
+        INT Result = LogToolDecodeStream(Stream, Path, MinimumLevel);
+        fclose(Stream);
+        return Result;
+    }
+
+    FILE* Unpacked = NULL;
+    if (tmpfile_s(&Unpacked) != 0 || Unpacked == NULL)
+    {
+        printf("Unable to create a temporary file for %s\n", Path);
+        fclose(Stream);
+        return 1;
+    }
+
+    INT Result = LogToolUnpackStream(Stream, Path, 0, 0, Unpacked);
+    fclose(Stream);
+
+    if (Result == 0)
+    {
+        rewind(Unpacked);
+        Result = LogToolDecodeStream(Unpacked, Path, MinimumLevel);
+    }
+
+    fclose(Unpacked);
+
+    return Result;
+}
+
+/**
+* Parses a local time given as YYYY-MM-DD, optionally followed by HH:MM or HH:MM:SS.
+*
+* @return Local FILETIME, 0 if the time is malformed.
+*/
+static
+UINT64
+LogToolParseTime(
+    _In_ PCSTR Text
+)
+{
+    SYSTEMTIME SystemTime = { 0 };
+    FILETIME   FileTime;
+
+    INT Fields = sscanf_s(Text, "%4hu-%2hu-%2hu %2hu:%2hu:%2hu",
+                          &SystemTime.wYear, &SystemTime.wMonth, &SystemTime.wDay,
+                          &SystemTime.wHour, &SystemTime.wMinute, &SystemTime.wSecond);
+
+    if (Fields < 3 || Fields == 4 || !SystemTimeToFileTime(&SystemTime, &FileTime))
+    {
+        return 0;
+    }
+
+    return ((UINT64)FileTime.dwHighDateTime << 32) | FileTime.dwLowDateTime;
+}
+
+/**
+* Writes the original of a compressed log file to stdout.
+*
+* @param Path File to decompress.
+* @param From Local FILETIME the range starts at, 0 for the whole file.
+* @param To   Local FILETIME the range ends at.
+*
+* @return 0 if successful, 1 otherwise.
+*/
+static
+INT
+LogToolUnpack(
+    _In_ PCSTR Path,
+    _In_ UINT64 From,
+    _In_ UINT64 To
+)
+{
+    FILE* Stream = NULL;
+
+    if (fopen_s(&Stream, Path, "rb") != 0 || Stream == NULL)
+    {
+        printf("Unable to open %s\n", Path);
+        return 1;
+    }
+
+    _setmode(_fileno(stdout), _O_BINARY); // binary originals and text line endings pass through as they are
+
+    INT Result = LogToolUnpackStream(Stream, Path, From, To, stdout);
+    fclose(Stream);
+
+    return Result;
+}
+
+/**
+* Adds a block to a growing list.
+*
+* @return TRUE if successful, FALSE if out of memory.
+*/
+static
+BOOL
+LogToolAddBlock(
+    _Inout_ PLOG_PACK_BLOCK* pBlocks,
+    _Inout_ PULONG BlockCount,
+    _Inout_ PULONG Capacity,
+    _In_    const LOG_PACK_BLOCK* Block
+)
+{
+    if (*BlockCount == *Capacity)
+    {
+        ULONG Grown = max(*Capacity * 2, 64);
+        PLOG_PACK_BLOCK Blocks = realloc(*pBlocks, Grown * sizeof(LOG_PACK_BLOCK));
+        if (Blocks == NULL)
+        {
+            return FALSE;
+        }
+
+        *pBlocks = Blocks;
+        *Capacity = Grown;
+    }
+
+    (*pBlocks)[(*BlockCount)++] = *Block;
+
+    return TRUE;
+}
+
+/**
+* Adds the bytes of a plain log file between two offsets as LOGTOOL_UNINDEXED blocks of at most
+* LOG_PACK_BLOCK_SIZE bytes.
+*
+* @return TRUE if successful, FALSE if out of memory.
+*/
+static
+BOOL
+LogToolAddUnindexed(
+    _Inout_ PLOG_PACK_BLOCK* pBlocks,
+    _Inout_ PULONG BlockCount,
+    _Inout_ PULONG Capacity,
+    _In_    UINT64 Offset,
+    _In_    UINT64 End
+)
+{
+    while (Offset < End)
+    {
+        LOG_PACK_BLOCK Block = { 0 };
+
+        Block.Offset = Offset;
+        Block.EarliestTime = LOGTOOL_UNINDEXED;
+        Block.LatestTime = MAXUINT64;
+        Block.Length = (UINT32)min(End - Offset, LOG_PACK_BLOCK_SIZE);
+        Block.PackedLength = Block.Length;
+
+        if (!LogToolAddBlock(pBlocks, BlockCount, Capacity, &Block))
+        {
+            return FALSE;
+        }
+
+        Offset += Block.Length;
+    }
+
+    return TRUE;
+}
+
+/**
+* Lists the spans of a plain log file from its time index. Entries that do not fit the file, and
+* the parts of the file no entry covers, become LOGTOOL_UNINDEXED blocks.
+*
+* @param Path        Log file, its index is Path with LOG_INDEX_EXTENSION appended.
+* @param Size        Size of the log file.
+* @param pBlocks     Receives the spans in file order, freed by the caller.
+* @param BlockCount  Receives the number of spans.
+*
+* @return TRUE if successful, FALSE if out of memory.
+*/
+static
+BOOL
+LogToolReadIndex(
+    _In_  PCSTR Path,
+    _In_  UINT64 Size,
+    _Out_ PLOG_PACK_BLOCK* pBlocks,
+    _Out_ PULONG BlockCount
+)
+{
+    CHAR IndexPath[MAX_PATH];
+    _snprintf_s(IndexPath, sizeof(IndexPath), _TRUNCATE, "%s%s", Path, LOG_INDEX_EXTENSION);
+
+    FILE*            Index = NULL;
+    LOG_INDEX_HEADER Header = { 0 };
+
+    BOOL IsIndexed = fopen_s(&Index, IndexPath, "rb") == 0 && Index != NULL &&
+                     fread(&Header, sizeof(Header), 1, Index) == 1 &&
+                     Header.Magic == LOG_INDEX_MAGIC && Header.Version == LOG_INDEX_VERSION;
+
+    if (!IsIndexed)
+    {
+        fprintf(stderr, "%s has no time index, reading all of it\n", Path);
+    }
+
+    *pBlocks = NULL;
+    *BlockCount = 0;
+
+    ULONG          Capacity = 0;
+    UINT64         Offset = 0;
+    LOG_PACK_BLOCK Entry;
+    BOOL           IsListed = TRUE;
+
+    while (IsListed && IsIndexed && fread(&Entry, sizeof(Entry), 1, Index) == 1)
+    {
+        // entries of a file that was cut short, or overlapping a span already listed, are not trusted
+        if (Entry.Offset < Offset || Entry.Length == 0 || Entry.Length > LOG_PACK_MAX_BLOCK ||
+            Entry.PackedLength != Entry.Length || Entry.Offset + Entry.Length > Size)
+        {
+            continue;
+        }
+
+        IsListed = LogToolAddUnindexed(pBlocks, BlockCount, &Capacity, Offset, Entry.Offset) &&
+                   LogToolAddBlock(pBlocks, BlockCount, &Capacity, &Entry);
+
+        Offset = Entry.Offset + Entry.Length;
+    }
+
+    if (Index != NULL)
+    {
+        fclose(Index);
+    }
+
+    // the span being written and whatever a run left unindexed
+    return IsListed && LogToolAddUnindexed(pBlocks, BlockCount, &Capacity, Offset, Size);
+}
+
+/**
+* Writes the records of a log file a query selects to stdout, reading only the spans its index
+* places in the range.
+*
+* @param Path  Plain or compressed log file.
+* @param Query Range and filters.
+*
+* @return 0 if successful, 1 otherwise.
+*/
+static
+INT
+LogToolQuery(
+    _In_ PCSTR Path,
+    _In_ const LOGTOOL_QUERY* Query
+)
+{
+    FILE* Stream = NULL;
+
+    if (fopen_s(&Stream, Path, "rb") != 0 || Stream == NULL)
+    {
+        printf("Unable to open %s\n", Path);
+        return 1;
+    }
+
+    PLOG_PACK_BLOCK Blocks = NULL;
+    ULONG           BlockCount = 0;
+    BOOL            IsBinary = FALSE;
+    BOOL            IsListed;
+    UINT32          Magic = 0;
+
+    fread(&Magic, sizeof(Magic), 1, Stream);
+
+    if (Magic == LOG_PACK_MAGIC)
+    {
+        LOG_PACK_HEADER Header;
+
+        IsListed = LogToolReadPack(Stream, Path, &Header, &Blocks);
+        BlockCount = IsListed ? Header.BlockCount : 0;
+        IsBinary = (Header.Flags & LOG_PACK_FLAG_BINARY) != 0;
+    }
+    else
+    {
+        _fseeki64(Stream, 0, SEEK_END);
+
+        IsListed = LogToolReadIndex(Path, (UINT64)_ftelli64(Stream), &Blocks, &BlockCount);
+        IsBinary = Magic == LOG_BINARY_MAGIC;
+    }
+
+    FILE* Output = stdout;
+
+    if (IsListed && IsBinary && (tmpfile_s(&Output) != 0 || Output == NULL))
+    {
+        printf("Unable to create a temporary file for %s\n", Path);
+        IsListed = FALSE;
+        Output = NULL;
+    }
+
+    ULONG Read = 0;
+    INT   Result = 1;
+
+    if (IsListed)
+    {
+        _setmode(_fileno(stdout), _O_BINARY); // lines are written as they are in the file
+
+        Result = LogToolWriteBlocks(Stream, Path, Blocks, BlockCount, IsBinary, Query, Output, &Read);
+
+        fprintf(stderr, "%lu of %lu span(s) read\n", (unsigned long)Read, (unsigned long)BlockCount);
+    }
+
+    fclose(Stream);
+    free(Blocks);
+
+    // binary records are decoded to text, filtered by their own times
+    if (IsBinary && Output != NULL)
+    {
+        if (Result == 0)
+        {
+            GlobalDecoder.From = Query->From;
+            GlobalDecoder.To = Query->To;
+            GlobalDecoder.Source = Query->Source;
+
+            rewind(Output);
+            Result = LogToolDecodeStream(Output, Path, Query->MinimumLevel);
+        }
+
+        fclose(Output);
+    }
+
+    return Result;
+}
+
+/**
+* @return The level with the given name, LOGTOOL_LEVEL_COUNT if there is none.
+*/
+static
+UINT8
+LogToolParseLevel(
+    _In_ PCSTR Name
+)
+{
+    for (UINT8 Level = 0; Level < LOGTOOL_LEVEL_COUNT; ++Level)
+    {
+        if (_stricmp(Name, LOG_LEVEL_NAMES[Level]) == 0)
+        {
+            return Level;
+        }
+    }
+
+    return LOGTOOL_LEVEL_COUNT;
+}
+
+static
+VOID
+LogToolUsage(
+    VOID
+)
+{
+    printf("usage: logtool decode <file%s[%s]> [TRACE|DEBUG|INFO|WARN|ERROR|FATAL]\n", LOG_BINARY_EXTENSION, LOG_PACK_EXTENSION);
+    printf("       logtool json <file%s[%s]> [TRACE|DEBUG|INFO|WARN|ERROR|FATAL]\n", LOG_BINARY_EXTENSION, LOG_PACK_EXTENSION);
+    printf("       logtool unpack <file%s> [\"YYYY-MM-DD HH:MM:SS\" [\"YYYY-MM-DD HH:MM:SS\"]]\n", LOG_PACK_EXTENSION);
+    printf("       logtool query <file[%s]> \"YYYY-MM-DD HH:MM:SS\" \"YYYY-MM-DD HH:MM:SS\" [TRACE|DEBUG|INFO|WARN|ERROR|FATAL [source file]]\n", LOG_PACK_EXTENSION);
+}
+
+INT
+main(
+    INT argc,
+    PSTR* argv
+)
+{
+    if (argc >= 3 && _stricmp(argv[1], "unpack") == 0)
+    {
+        UINT64 From = 0;
+        UINT64 To = MAXUINT64;
+
+        if (argc > 3 && (From = LogToolParseTime(argv[3])) == 0)
+        {
+            LogToolUsage();
+            return 1;
+        }
+
+        if (argc > 4 && (To = LogToolParseTime(argv[4])) == 0)
+        {
+            LogToolUsage();
+            return 1;
+        }
+
+        return LogToolUnpack(argv[2], From, To);
+    }
+
+    if (argc >= 5 && _stricmp(argv[1], "query") == 0)
+    {
+        LOGTOOL_QUERY Query = { 0 };
+
+        Query.From = LogToolParseTime(argv[3]);
+        Query.To = LogToolParseTime(argv[4]);
+        Query.MinimumLevel = (argc > 5) ? LogToolParseLevel(argv[5]) : 0;
+        Query.Source = (argc > 6) ? argv[6] : NULL;
+
+        if (Query.From == 0 || Query.To == 0 || Query.MinimumLevel == LOGTOOL_LEVEL_COUNT)
+        {
+            LogToolUsage();
+            return 1;
+        }
+
+        return LogToolQuery(argv[2], &Query);
+    }
+
+    if (argc < 3 || (_stricmp(argv[1], "decode") != 0 && _stricmp(argv[1], "json") != 0))
+    {
+        LogToolUsage();
+        return 1;
+    }
+
+    GlobalDecoder.IsJson = (_stricmp(argv[1], "json") == 0);
+
+    UINT8 MinimumLevel = 0;
+
+    if (argc > 3)
+    {
+        MinimumLevel = LogToolParseLevel(argv[3]);
+        if (MinimumLevel == LOGTOOL_LEVEL_COUNT)
+        {
+            LogToolUsage();
+            return 1;
+        }
+    }
+
+    return LogToolDecode(argv[2], MinimumLevel);
+}
@@ -0,0 +1,3031 @@
+#ifdef __linux__
+#define _GNU_SOURCE // unshare, setns
+#endif // __linux__
+
+#include "transfer.h"
+#include "rudp.h"
+#include "logger.h"
+#include "netpack.h"
+#include "netlimit.h"
+#include "message.h"
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <psapi.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#endif // __linux__
+
+/**
+    * Benchmarks for the client's use of the relay connection.
+    *
+    *     netbench transfer <file> [server [port]]
+    *     netbench compress [corpus]
+    *     netbench corpus <file> [messages [seed]]
+    *     netbench dictionary <corpus> <netdict.c>
+    *     netbench messages
+    *     netbench flood <server> [port]
+    *     netbench impair [bytes [Mbit/s]]
+    *
+    * Sends the file between two ends in this process and reports the throughput and the largest
+    * working set sampled while it went, which stays flat whatever the size of the file:
+    *
+    *     raw     the file's mapping written to a loopback TCP connection and the other end writing
+    *             what it reads to disk, the line rate of this machine for the same copy
+    *     direct  the file transfer over two multiplexed connection ends joined by loopback TCP,
+    *             the cost of framing, checksums and flow control
+    *     relay   the file transfer through a running relay server, both ends registered with it
+    *             and paired like two clients after '/connect', only when a server is given
+    *
+    * Every received copy is compared with the file and deleted, received files go to the
+    * netbench\received directory.
+    *
+    * The compression suite compresses and expands every message of a chat corpus, one per line, in
+    * each NET_PACK_MODE, once as chat frames of one message each and once joined into frames of
+    * PROTOCOL_FILE_CHUNK_SIZE bytes like a history replay would send them, and reports the bytes on
+    * the wire, headers included, and the time per frame. Without a corpus it generates one from a
+    * seed other than the one the shipped dictionary was trained with, so it is not measured on its
+    * own training text. 'corpus' writes such a generated corpus and 'dictionary' trains netdict.c
+    * on one.
+    *
+    * The message suite encodes the generated corpus as the typed messages of message.h and times
+    * encoding them and reading every field back where it lies.
+    *
+    * The flood suite times pings to a running relay server from one client, once on its own and
+    * once while a client from another address floods the server with chat, which shows what the
+    * flooder costs the other clients of its worker under the server's rate limits. A relay run of
+    * the transfer suite is held to the server's byte limits as well.
+    *
+    * The impairment suite sends the same bytes over the RUDP of a direct peer path and over TCP
+    * across an emulated link between two network namespaces, clean and under the loss and delay
+    * netem would add, and reports the throughput of both. This process passes the packets between
+    * a tun device in each namespace and drops and delays them itself, so it needs Linux and
+    * CAP_NET_ADMIN but neither netem nor anything outside it.
+*/
+
+#define NETBENCH_DEFAULT_PORT "5050"
+#define NETBENCH_RECEIVE_DIRECTORY "netbench\\received"
+#define NETBENCH_RAW_NAME "raw.bin"
+#define NETBENCH_RAW_BUFFER ( 64 * 1024 )        // bytes the raw receiver reads at a time
+#define NETBENCH_SAMPLE_INTERVAL 50              // milliseconds between working set samples
+#define NETBENCH_RUN_TIMEOUT ( 60 * 60 * 1000 )  // milliseconds a single run may take
+#define NETBENCH_REGISTER_ATTEMPTS 5
+#define NETBENCH_REGISTER_TIMEOUT 1000           // milliseconds to wait for each registration ack
+#define NETBENCH_PAIR_TIMEOUT 5000               // milliseconds to wait for the server to pair the ends
+#define NETBENCH_CORPUS_MESSAGES 20000           // messages in a generated corpus
+#define NETBENCH_TRAIN_SEED 1                    // seed of the corpus the shipped dictionary was trained on
+#define NETBENCH_BENCH_SEED 2                    // seed of the corpus the compression suite measures
+#define NETBENCH_COMPRESS_ROUNDS 5               // times every frame is compressed and expanded
+#define NETBENCH_DICTIONARY_SIZE 8192            // bytes of a trained dictionary
+#define NETBENCH_SEGMENT_LENGTH 64               // bytes of each piece of the corpus the dictionary is made of
+#define NETBENCH_DMER 8                          // bytes of the sequences segments are scored by
+#define NETBENCH_DMER_BITS 22                    // log2 of the buckets sequences are counted in
+#define NETBENCH_MESSAGE_ROUNDS 200              // times the message suite goes through its frames
+#define NETBENCH_PINGS 200                       // pings the flood suite times in each run
+#define NETBENCH_PING_INTERVAL 25                // milliseconds between pings, slower than a server limits a client to
+#define NETBENCH_PING_TIMEOUT 2000               // milliseconds a ping may take before it counts as lost
+#define NETBENCH_FLOOD_SOURCE "127.0.0.2"        // address the flooding client connects from, not the measured one's
+#define NETBENCH_FLOOD_WARMUP 500                // milliseconds the flood runs before pings are timed
+#define NETBENCH_LIMIT_TAKES 10000000            // limit checks the flood suite times
+#define NETBENCH_IMPAIR_SIZE ( 2 * 1024 * 1024 ) // bytes each impairment run sends
+#define NETBENCH_IMPAIR_RATE 100                 // Mbit/s of the emulated link
+#define NETBENCH_IMPAIR_TIMEOUT 120000           // milliseconds an impairment run may take
+#define NETBENCH_RUDP_STREAM 2                   // stream the RUDP runs send on, a peer session's file stream
+#define NETBENCH_LINK_ADDRESS 0x0A4D0001         // 10.77.0.1, the first end of the emulated link
+#define NETBENCH_LINK_MTU 1500
+#define NETBENCH_LINK_LIMIT 1000                 // packets each direction of the link holds, as netem's default
+#define NETBENCH_MESSAGE_FRAMES ( 4 * sizeof(MESSAGE_HEADER) + sizeof(CHAT_MESSAGE) + sizeof(ACK_MESSAGE) + sizeof(PRESENCE_MESSAGE) + sizeof(CONTROL_MESSAGE) )
+
+/**
+* One end of a connection carrying file transfers, what a client holds for its relay connection.
+*/
+typedef struct _NETBENCH_END
+{
+    SOCKET           Socket;
+    NET_MUX          Mux;
+    TRANSFER_SESSION Transfer;
+    HANDLE           Thread;             // reads the connection
+    HANDLE           Paired;             // manual reset, set once the server introduced the other end
+    UINT32           ClientId;           // from the server's handshake, relay runs only
+    UINT32           Token;
+    HANDLE           Ponged;             // auto reset, set on every pong from the server
+    volatile LONG64  Pong;               // argument of the last pong
+} NETBENCH_END, *PNETBENCH_END;
+
+/**
+* A client flooding the server, for the flood suite.
+*/
+typedef struct _NETBENCH_FLOOD
+{
+    NETBENCH_END       End;
+    HANDLE             Thread;           // sends the flood
+    volatile LONG      Stop;
+    volatile ULONGLONG Sent;             // chat frames queued
+} NETBENCH_FLOOD, *PNETBENCH_FLOOD;
+
+typedef struct _NETBENCH_RAW
+{
+    SOCKET Socket;
+    HANDLE File;
+    UINT64 Size;
+    BOOL   Succeeded;
+} NETBENCH_RAW, *PNETBENCH_RAW;
+
+typedef struct _NETBENCH_RESULT
+{
+    double Seconds;
+    SIZE_T StartWorkingSet;              // bytes before the run
+    SIZE_T PeakWorkingSet;               // largest sample during the run
+} NETBENCH_RESULT, *PNETBENCH_RESULT;
+
+typedef struct _NETBENCH_TEXT
+{
+    CHAR*  Data;
+    SIZE_T Size;
+    SIZE_T Capacity;
+} NETBENCH_TEXT, *PNETBENCH_TEXT;
+
+typedef struct _NETBENCH_MESSAGE
+{
+    const CHAR* Text;
+    UINT16      Length;
+} NETBENCH_MESSAGE, *PNETBENCH_MESSAGE;
+
+typedef struct _NETBENCH_SEGMENT
+{
+    SIZE_T Start;                        // offset in the corpus
+    UINT64 Score;                        // how often its sequences occur in the corpus
+} NETBENCH_SEGMENT, *PNETBENCH_SEGMENT;
+
+//
+// What the generated corpus is made of. Each message is one to six templates with %n replaced by
+// a name, %w by a topic, %d by a number and %t by a time; earlier entries are picked more often.
+//
+static const PCSTR NetBenchTemplates[] =
+{
+    "ok",
+    "lol",
+    "thanks!",
+    "yeah, give me %d minutes",
+    "hey %n, are you around?",
+    "sounds good",
+    "np",
+    "brb",
+    "on my way",
+    "good morning everyone",
+    "did you see the %w build failed again?",
+    "can you send me the link to the %w doc?",
+    "here: https://wiki.example.com/%w/%d",
+    "meeting moved to %t, same room",
+    "I'm pushing the fix for the %w issue now",
+    "anyone know why %w is so slow today?",
+    "I think it's the %w cache, restarting it",
+    "can we talk about the %w release after lunch?",
+    "sure, ping me when you're free",
+    "%n is out today, I'll cover the %w review",
+    "just merged the %w branch, please pull before you push",
+    "tests are green on my machine",
+    "which version of %w are you running?",
+    "I'll be %d minutes late, start without me",
+    "what time is the standup tomorrow?",
+    "standup is at %t",
+    "does anyone have the password for the %w dashboard?",
+    "never mind, found it",
+    "that's weird, it works for me",
+    "can you share your screen?",
+    "the %w service is down again, looking into it",
+    "it's back up, it was the %w config",
+    "let me know if you need anything",
+    "happy friday everyone!",
+    "who's up for lunch at %t?",
+    "I'm in, meet at the lobby",
+    "error: %w.c:%d: undefined reference to `%w_init'",
+    "[%t] WARN %w: connection reset by peer, retrying in %d s",
+    "I opened a ticket for the %w problem: #%d%d",
+    "%n, can you take a look at my pull request when you have a moment?",
+    "did the %w deploy go out yet?",
+    "not yet, waiting on the %w migration",
+    "ETA %d minutes",
+    "great work on the %w demo today, %n",
+    "I'll write up the notes and send them to the team",
+};
+
+static const PCSTR NetBenchNames[] =
+{
+    "alex", "sam", "jordan", "taylor", "morgan", "casey", "riley",
+    "jamie", "quinn", "avery", "robin", "drew", "kai", "noor",
+};
+
+static const PCSTR NetBenchWords[] =
+{
+    "payments", "search", "login", "chat", "relay", "mobile", "api", "database",
+    "frontend", "backend", "analytics", "billing", "auth", "gateway", "scheduler",
+    "storage", "cache", "metrics", "docs", "onboarding", "export", "import",
+    "notifications", "profile", "settings", "upload", "video", "sync", "queue", "cluster",
+};
+
+static volatile LONG SamplerRunning = FALSE;
+static volatile LONG64 SampledPeak = 0;
+
+/**
+* @return Bytes of the process's working set now.
+*/
+static
+SIZE_T
+NetBenchWorkingSet(
+    VOID
+)
+{
+    PROCESS_MEMORY_COUNTERS Counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+    {
+        return 0;
+    }
+
+    return Counters.WorkingSetSize;
+}
+
+/**
+* Samples the working set until SamplerRunning drops, keeping the largest in SampledPeak. The
+* peak the system keeps cannot be reset between runs, so each run samples its own.
+*/
+static
+DWORD
+WINAPI
+NetBenchSampler(
+    _In_ LPVOID lpData
+)
+{
+    (void)lpData;
+
+    while (SamplerRunning)
+    {
+        LONG64 Now = (LONG64)NetBenchWorkingSet();
+        if (Now > SampledPeak)
+        {
+            SampledPeak = Now;
+        }
+
+        Sleep(NETBENCH_SAMPLE_INTERVAL);
+    }
+
+    return 0;
+}
+
+/**
+* @return Seconds between two performance counter readings.
+*/
+static
+double
+NetBenchSeconds(
+    _In_ INT64 Start,
+    _In_ INT64 End
+)
+{
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+
+    return (double)(End - Start) / (double)Frequency.QuadPart;
+}
+
+/**
+* @return Performance counter ticks.
+*/
+static
+INT64
+NetBenchNow(
+    VOID
+)
+{
+    LARGE_INTEGER Ticks;
+    QueryPerformanceCounter(&Ticks);
+    return Ticks.QuadPart;
+}
+
+//////////////////////////////////////////
+//
+//          CONNECTIONS
+//
+//////////////////////////////////////////
+
+/**
+* Connects two sockets to each other over loopback.
+*/
+static
+BOOL
+NetBenchLoopbackPair(
+    _Out_ SOCKET* pFirst,
+    _Out_ SOCKET* pSecond
+)
+{
+    struct sockaddr_in Address;
+    socklen_t AddressSize = sizeof(Address);
+
+    *pFirst = INVALID_SOCKET;
+    *pSecond = INVALID_SOCKET;
+
+    ZeroMemory(&Address, sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Address.sin_port = 0;
+
+    SOCKET Listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (Listener == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+
+    if (bind(Listener, (struct sockaddr*)&Address, sizeof(Address)) == SOCKET_ERROR ||
+        listen(Listener, 1) == SOCKET_ERROR ||
+        getsockname(Listener, (struct sockaddr*)&Address, &AddressSize) == SOCKET_ERROR)
+    {
+        closesocket(Listener);
+        return FALSE;
+    }
+
+    *pFirst = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*pFirst == INVALID_SOCKET || connect(*pFirst, (struct sockaddr*)&Address, sizeof(Address)) == SOCKET_ERROR)
+    {
+        if (*pFirst != INVALID_SOCKET)
+        {
+            closesocket(*pFirst);
+            *pFirst = INVALID_SOCKET;
+        }
+        closesocket(Listener);
+        return FALSE;
+    }
+
+    *pSecond = accept(Listener, NULL, NULL);
+    closesocket(Listener);
+
+    if (*pSecond == INVALID_SOCKET)
+    {
+        closesocket(*pFirst);
+        *pFirst = INVALID_SOCKET;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+* Connects to the relay server and reads its handshake.
+*
+* @param Source Local address to connect from, NULL for any.
+*/
+static
+BOOL
+NetBenchConnectServer(
+    _Inout_  PNETBENCH_END pEnd,
+    _In_     PCSTR Server,
+    _In_     PCSTR Port,
+    _In_opt_ PCSTR Source
+)
+{
+    struct addrinfo Hints;
+    struct addrinfo* Result = NULL;
+
+    ZeroMemory(&Hints, sizeof(Hints));
+    Hints.ai_family = AF_INET;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_protocol = IPPROTO_TCP;
+
+    if (getaddrinfo(Server, Port, &Hints, &Result) != 0)
+    {
+        return FALSE;
+    }
+
+    struct sockaddr_in Local;
+    ZeroMemory(&Local, sizeof(Local));
+    Local.sin_family = AF_INET;
+
+    pEnd->Socket = socket(Result->ai_family, Result->ai_socktype, Result->ai_protocol);
+    if (pEnd->Socket == INVALID_SOCKET ||
+        (Source != NULL && (inet_pton(AF_INET, Source, &Local.sin_addr) != 1 || bind(pEnd->Socket, (struct sockaddr*)&Local, sizeof(Local)) == SOCKET_ERROR)) ||
+        connect(pEnd->Socket, Result->ai_addr, (INT)Result->ai_addrlen) == SOCKET_ERROR)
+    {
+        freeaddrinfo(Result);
+        return FALSE;
+    }
+
+    freeaddrinfo(Result);
+
+    MESSAGE_HEADER Header;
+    HANDSHAKE_MESSAGE Handshake;
+
+    if (NetReceiveExact(pEnd->Socket, &Header, sizeof(Header)) <= 0 ||
+        ntohs(Header.Type) != MESSAGE_TYPE_HANDSHAKE ||
+        ntohs(Header.Length) != sizeof(Handshake) ||
+        NetReceiveExact(pEnd->Socket, &Handshake, sizeof(Handshake)) <= 0 ||
+        Handshake.Version != PROTOCOL_VERSION)
+    {
+        printf("No handshake from %s:%s, or a different protocol version\n", Server, Port);
+        return FALSE;
+    }
+
+    pEnd->ClientId = ntohl(Handshake.ClientId);
+    pEnd->Token = ntohl(Handshake.Token);
+    return TRUE;
+}
+
+/**
+* Registers a UDP endpoint for the end with the server, which pairs only registered clients.
+*/
+static
+BOOL
+NetBenchRegister(
+    _In_ PNETBENCH_END pEnd
+)
+{
+    struct sockaddr_in ServerAddress;
+    socklen_t AddressSize = sizeof(ServerAddress);
+
+    if (getpeername(pEnd->Socket, (struct sockaddr*)&ServerAddress, &AddressSize) == SOCKET_ERROR)
+    {
+        return FALSE;
+    }
+
+    SOCKET Datagrams = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (Datagrams == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+
+    NetSetReceiveTimeout(Datagrams, NETBENCH_REGISTER_TIMEOUT);
+
+    DATAGRAM_HEADER Register;
+    ZeroMemory(&Register, sizeof(Register));
+    Register.Magic = htonl(DATAGRAM_MAGIC);
+    Register.Type = DATAGRAM_TYPE_REGISTER;
+    Register.SenderId = htonl(pEnd->ClientId);
+    Register.Token = htonl(pEnd->Token);
+
+    BOOL Registered = FALSE;
+    for (INT Attempt = 0; Attempt < NETBENCH_REGISTER_ATTEMPTS && !Registered; ++Attempt)
+    {
+        DATAGRAM_HEADER Ack;
+
+        sendto(Datagrams, (PCSTR)&Register, sizeof(Register), 0, (struct sockaddr*)&ServerAddress, sizeof(ServerAddress));
+
+        INT Received = recv(Datagrams, (PCHAR)&Ack, sizeof(Ack), 0);
+        Registered = Received == (INT)sizeof(Ack) && Ack.Type == DATAGRAM_TYPE_REGISTER_ACK;
+    }
+
+    closesocket(Datagrams);
+    return Registered;
+}
+
+/**
+* Reads the connection of an end like the client's receive thread does, handing file frames to
+* its transfer session.
+*/
+static
+DWORD
+WINAPI
+NetBenchReceiveThread(
+    _In_ LPVOID lpData
+)
+{
+    PNETBENCH_END pEnd = (PNETBENCH_END)lpData;
+    NET_CHUNK_POOL Chunks;
+    NET_READ_BUFFER Received;
+    CHAR Scratch[PROTOCOL_MAX_BULK_PAYLOAD_SIZE];
+    MESSAGE_HEADER Header;
+
+    NetChunkPoolInitialise(&Chunks, 1);
+    NetBufferInitialise(&Received, &Chunks);
+
+    while (NetBufferFill(&Received, pEnd->Socket, sizeof(Header)) == NET_IO_COMPLETE)
+    {
+        NetBufferRead(&Received, &Header, sizeof(Header));
+
+        UINT16 Length = ntohs(Header.Length);
+        UINT16 StreamId = ntohs(Header.StreamId);
+
+        // the ends never take up compression, the server sends them nothing compressed
+        if (Header.Flags != 0 ||
+            Length > PROTOCOL_MAX_FRAME_PAYLOAD(StreamId) ||
+            !NetMuxReceived(&pEnd->Mux, StreamId, Length) ||
+            NetBufferFill(&Received, pEnd->Socket, Length) != NET_IO_COMPLETE)
+        {
+            break;
+        }
+
+        const CHAR* Payload = NetBufferView(&Received, Length, Scratch);
+
+        switch (ntohs(Header.Type))
+        {
+        case MESSAGE_TYPE_PEER_ENDPOINTS:
+            SetEvent(pEnd->Paired);
+            break;
+
+        case MESSAGE_TYPE_PEER_UNAVAILABLE:
+        case MESSAGE_TYPE_LEAVE:
+            TransferPeerUnavailable(&pEnd->Transfer);
+            break;
+
+        case MESSAGE_TYPE_FILE_OFFER:
+        case MESSAGE_TYPE_FILE_ACCEPT:
+        case MESSAGE_TYPE_FILE_DATA:
+            TransferHandleFrame(&pEnd->Transfer, ntohs(Header.Type), Payload, Length);
+            break;
+
+        case MESSAGE_TYPE_WINDOW_UPDATE:
+            NetMuxWindowUpdate(&pEnd->Mux, Payload, Length);
+            break;
+
+        case MESSAGE_TYPE_CONTROL:
+        {
+            const CONTROL_MESSAGE* pControl = MessageControlView(Payload, Length);
+            if (pControl != NULL && MessageControlCommand(pControl) == MESSAGE_CONTROL_PONG)
+            {
+                pEnd->Pong = (LONG64)MessageControlArgument(pControl);
+                SetEvent(pEnd->Ponged);
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+
+        NetBufferConsume(&Received, Length);
+        NetMuxConsumed(&pEnd->Mux, StreamId, Length);
+    }
+
+    NetBufferCleanUp(&Received);
+    NetChunkPoolCleanUp(&Chunks);
+
+    // a send waiting on the other end gives up instead of stalling
+    TransferPeerUnavailable(&pEnd->Transfer);
+    return 0;
+}
+
+/**
+* Starts reading a connected end.
+*/
+static
+BOOL
+NetBenchStartEnd(
+    _Inout_ PNETBENCH_END pEnd
+)
+{
+    NetMuxInitialise(&pEnd->Mux, pEnd->Socket);
+
+    pEnd->Paired = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (pEnd->Paired == NULL)
+    {
+        return FALSE;
+    }
+
+    pEnd->Ponged = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (pEnd->Ponged == NULL)
+    {
+        CloseHandle(pEnd->Paired);
+        pEnd->Paired = NULL;
+        return FALSE;
+    }
+
+    if (!TransferInitialise(&pEnd->Transfer, &pEnd->Mux, NETBENCH_RECEIVE_DIRECTORY))
+    {
+        CloseHandle(pEnd->Ponged);
+        CloseHandle(pEnd->Paired);
+        pEnd->Ponged = NULL;
+        pEnd->Paired = NULL;
+        return FALSE;
+    }
+
+    pEnd->Thread = CreateThread(NULL, 0, NetBenchReceiveThread, pEnd, 0, NULL);
+    if (pEnd->Thread == NULL)
+    {
+        TransferCleanUp(&pEnd->Transfer);
+        CloseHandle(pEnd->Ponged);
+        CloseHandle(pEnd->Paired);
+        pEnd->Ponged = NULL;
+        pEnd->Paired = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+* Closes an end, started or not, in the order the client does.
+*/
+static
+VOID
+NetBenchStopEnd(
+    _Inout_ PNETBENCH_END pEnd
+)
+{
+    if (pEnd->Socket != INVALID_SOCKET)
+    {
+        shutdown(pEnd->Socket, SD_BOTH);
+    }
+
+    if (pEnd->Thread != NULL)
+    {
+        WaitForSingleObject(pEnd->Thread, INFINITE);
+        CloseHandle(pEnd->Thread);
+        pEnd->Thread = NULL;
+
+        TransferCleanUp(&pEnd->Transfer);
+        NetMuxCleanUp(&pEnd->Mux);
+    }
+
+    if (pEnd->Paired != NULL)
+    {
+        CloseHandle(pEnd->Paired);
+        pEnd->Paired = NULL;
+    }
+
+    if (pEnd->Ponged != NULL)
+    {
+        CloseHandle(pEnd->Ponged);
+        pEnd->Ponged = NULL;
+    }
+
+    if (pEnd->Socket != INVALID_SOCKET)
+    {
+        closesocket(pEnd->Socket);
+        pEnd->Socket = INVALID_SOCKET;
+    }
+}
+
+//////////////////////////////////////////
+//
+//          TRANSFER SUITE
+//
+//////////////////////////////////////////
+
+/**
+* Writes the file's mapping to the socket a window at a time.
+*/
+static
+DWORD
+WINAPI
+NetBenchRawSender(
+    _In_ LPVOID lpData
+)
+{
+    PNETBENCH_RAW pRaw = (PNETBENCH_RAW)lpData;
+    HANDLE Mapping = CreateFileMappingA(pRaw->File, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    pRaw->Succeeded = Mapping != NULL;
+
+    for (UINT64 Offset = 0; pRaw->Succeeded && Offset < pRaw->Size; Offset += TRANSFER_MAP_WINDOW)
+    {
+        ULONG Length = (ULONG)min((UINT64)TRANSFER_MAP_WINDOW, pRaw->Size - Offset);
+        const CHAR* View = (const CHAR*)MapViewOfFile(Mapping, FILE_MAP_READ, (DWORD)(Offset >> 32), (DWORD)Offset, Length);
+        if (View == NULL)
+        {
+            pRaw->Succeeded = FALSE;
+            break;
+        }
+
+        NET_SLICE Slice;
+        Slice.Data = View;
+        Slice.Length = Length;
+        pRaw->Succeeded = NetSendAll(pRaw->Socket, &Slice, 1);
+
+        UnmapViewOfFile(View);
+    }
+
+    if (Mapping != NULL)
+    {
+        CloseHandle(Mapping);
+    }
+
+    shutdown(pRaw->Socket, SD_SEND);
+    return 0;
+}
+
+/**
+* Copies the file over a plain loopback TCP connection into the receive directory.
+*/
+static
+BOOL
+NetBenchRunRaw(
+    _In_  PCSTR Path,
+    _In_  PCSTR ReceivedPath,
+    _Out_ PNETBENCH_RESULT pResult
+)
+{
+    NETBENCH_RAW Raw;
+    SOCKET Receiver;
+    LARGE_INTEGER Size;
+    BOOL Succeeded = FALSE;
+
+    ZeroMemory(&Raw, sizeof(Raw));
+
+    Raw.File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (Raw.File == INVALID_HANDLE_VALUE || !GetFileSizeEx(Raw.File, &Size))
+    {
+        return FALSE;
+    }
+
+    Raw.Size = (UINT64)Size.QuadPart;
+
+    HANDLE Output = CreateFileA(ReceivedPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    CHAR* Buffer = (CHAR*)malloc(NETBENCH_RAW_BUFFER);
+
+    if (Output != INVALID_HANDLE_VALUE && Buffer != NULL && NetBenchLoopbackPair(&Raw.Socket, &Receiver))
+    {
+        INT64 Start = NetBenchNow();
+
+        HANDLE Sender = CreateThread(NULL, 0, NetBenchRawSender, &Raw, 0, NULL);
+        if (Sender != NULL)
+        {
+            UINT64 Received = 0;
+            INT Length;
+            DWORD Written;
+
+            while ((Length = recv(Receiver, Buffer, NETBENCH_RAW_BUFFER, 0)) > 0)
+            {
+                if (!WriteFile(Output, Buffer, (DWORD)Length, &Written, NULL) || Written != (DWORD)Length)
+                {
+                    break;
+                }
+                Received += (UINT64)Length;
+            }
+
+            WaitForSingleObject(Sender, INFINITE);
+            CloseHandle(Sender);
+
+            pResult->Seconds = NetBenchSeconds(Start, NetBenchNow());
+            Succeeded = Raw.Succeeded && Received == Raw.Size;
+        }
+
+        closesocket(Receiver);
+        closesocket(Raw.Socket);
+    }
+
+    free(Buffer);
+    if (Output != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(Output);
+    }
+    CloseHandle(Raw.File);
+
+    return Succeeded;
+}
+
+/**
+* Sends the file from one end to the other with a file transfer, through the relay server when
+* one is given and over a loopback connection between the ends otherwise.
+*/
+static
+BOOL
+NetBenchRunTransfer(
+    _In_     PCSTR Path,
+    _In_opt_ PCSTR Server,
+    _In_opt_ PCSTR Port,
+    _Out_    PNETBENCH_RESULT pResult
+)
+{
+    NETBENCH_END Ends[2];
+    BOOL Succeeded = FALSE;
+
+    ZeroMemory(Ends, sizeof(Ends));
+    Ends[0].Socket = INVALID_SOCKET;
+    Ends[1].Socket = INVALID_SOCKET;
+
+    BOOL Connected;
+    if (Server == NULL)
+    {
+        Connected = NetBenchLoopbackPair(&Ends[0].Socket, &Ends[1].Socket);
+    }
+    else
+    {
+        Connected = NetBenchConnectServer(&Ends[0], Server, Port, NULL) &&
+                    NetBenchConnectServer(&Ends[1], Server, Port, NULL) &&
+                    NetBenchRegister(&Ends[0]) &&
+                    NetBenchRegister(&Ends[1]);
+    }
+
+    if (Connected && NetBenchStartEnd(&Ends[0]) && NetBenchStartEnd(&Ends[1]))
+    {
+        BOOL Paired = TRUE;
+
+        if (Server != NULL)
+        {
+            // the relay passes file streams on only between clients it introduced
+            PEER_CONNECT_MESSAGE Connect;
+            Connect.PeerId = htonl(Ends[1].ClientId);
+
+            Paired = NetMuxSend(&Ends[0].Mux, STREAM_CONTROL, MESSAGE_TYPE_PEER_CONNECT, &Connect, sizeof(Connect)) == NET_IO_COMPLETE &&
+                     WaitForSingleObject(Ends[0].Paired, NETBENCH_PAIR_TIMEOUT) == WAIT_OBJECT_0 &&
+                     WaitForSingleObject(Ends[1].Paired, NETBENCH_PAIR_TIMEOUT) == WAIT_OBJECT_0;
+
+            if (!Paired)
+            {
+                printf("The server did not pair clients %u and %u\n", Ends[0].ClientId, Ends[1].ClientId);
+            }
+        }
+
+        INT64 Start = NetBenchNow();
+
+        if (Paired && TransferSendFile(&Ends[0].Transfer, Path))
+        {
+            Succeeded = TransferWaitSent(&Ends[0].Transfer, NETBENCH_RUN_TIMEOUT) && Ends[1].Transfer.Completed == 1;
+            pResult->Seconds = NetBenchSeconds(Start, NetBenchNow());
+        }
+    }
+
+    NetBenchStopEnd(&Ends[0]);
+    NetBenchStopEnd(&Ends[1]);
+
+    return Succeeded;
+}
+
+/**
+* Compares two files a mapped window at a time.
+*/
+static
+BOOL
+NetBenchSameContent(
+    _In_ PCSTR First,
+    _In_ PCSTR Second
+)
+{
+    HANDLE Files[2];
+    HANDLE Mappings[2] = { NULL, NULL };
+    LARGE_INTEGER Sizes[2];
+    BOOL Same = TRUE;
+
+    Files[0] = CreateFileA(First, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    Files[1] = CreateFileA(Second, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        Same = Same && Files[i] != INVALID_HANDLE_VALUE && GetFileSizeEx(Files[i], &Sizes[i]);
+    }
+
+    Same = Same && Sizes[0].QuadPart == Sizes[1].QuadPart;
+
+    for (ULONG i = 0; i < 2 && Same && Sizes[0].QuadPart > 0; ++i)
+    {
+        Mappings[i] = CreateFileMappingA(Files[i], NULL, PAGE_READONLY, 0, 0, NULL);
+        Same = Mappings[i] != NULL;
+    }
+
+    for (UINT64 Offset = 0; Same && Offset < (UINT64)Sizes[0].QuadPart; Offset += TRANSFER_MAP_WINDOW)
+    {
+        ULONG Length = (ULONG)min((UINT64)TRANSFER_MAP_WINDOW, (UINT64)Sizes[0].QuadPart - Offset);
+        LPVOID Views[2];
+
+        for (ULONG i = 0; i < 2; ++i)
+        {
+            Views[i] = MapViewOfFile(Mappings[i], FILE_MAP_READ, (DWORD)(Offset >> 32), (DWORD)Offset, Length);
+        }
+
+        Same = Views[0] != NULL && Views[1] != NULL && memcmp(Views[0], Views[1], Length) == 0;
+
+        for (ULONG i = 0; i < 2; ++i)
+        {
+            if (Views[i] != NULL)
+            {
+                UnmapViewOfFile(Views[i]);
+            }
+        }
+    }
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        if (Mappings[i] != NULL)
+        {
+            CloseHandle(Mappings[i]);
+        }
+
+        if (Files[i] != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(Files[i]);
+        }
+    }
+
+    return Same;
+}
+
+/**
+* Runs one way of sending the file with the working set sampled, checks the copy and reports.
+*
+* @param Server NULL for the raw and direct runs.
+*/
+static
+BOOL
+NetBenchTransferRun(
+    _In_     PCSTR Name,
+    _In_     PCSTR Path,
+    _In_     UINT64 Size,
+    _In_opt_ PCSTR Server,
+    _In_opt_ PCSTR Port
+)
+{
+    CHAR ReceivedPath[MAX_PATH];
+    CHAR PartPath[MAX_PATH];
+    NETBENCH_RESULT Result;
+    BOOL IsRaw = strcmp(Name, "raw") == 0;
+
+    PCSTR BaseName = Path;
+    for (PCSTR Cursor = Path; *Cursor != '\0'; ++Cursor)
+    {
+        if (*Cursor == '/' || *Cursor == '\\')
+        {
+            BaseName = Cursor + 1;
+        }
+    }
+
+    _snprintf_s(ReceivedPath, sizeof(ReceivedPath), _TRUNCATE, "%s\\%s", NETBENCH_RECEIVE_DIRECTORY, IsRaw ? NETBENCH_RAW_NAME : BaseName);
+    _snprintf_s(PartPath, sizeof(PartPath), _TRUNCATE, "%s%s", ReceivedPath, TRANSFER_PART_EXTENSION);
+
+    // a copy left by an earlier run would be resumed instead of sent
+    DeleteFileA(ReceivedPath);
+    DeleteFileA(PartPath);
+
+    ZeroMemory(&Result, sizeof(Result));
+    Result.StartWorkingSet = NetBenchWorkingSet();
+    SampledPeak = (LONG64)Result.StartWorkingSet;
+    SamplerRunning = TRUE;
+
+    HANDLE Sampler = CreateThread(NULL, 0, NetBenchSampler, NULL, 0, NULL);
+
+    BOOL Succeeded = IsRaw ? NetBenchRunRaw(Path, ReceivedPath, &Result) : NetBenchRunTransfer(Path, Server, Port, &Result);
+
+    SamplerRunning = FALSE;
+    if (Sampler != NULL)
+    {
+        WaitForSingleObject(Sampler, INFINITE);
+        CloseHandle(Sampler);
+    }
+    Result.PeakWorkingSet = (SIZE_T)SampledPeak;
+
+    if (!Succeeded)
+    {
+        printf("%-7s failed\n", Name);
+        return FALSE;
+    }
+
+    BOOL Same = NetBenchSameContent(Path, ReceivedPath);
+    DeleteFileA(ReceivedPath);
+
+    printf(
+        "%-7s %10.1f MB %8.2f s %9.1f MB/s  working set %7.1f MB, peak %7.1f MB  %s\n",
+        Name,
+        Size / 1e6,
+        Result.Seconds,
+        Size / 1e6 / max(Result.Seconds, 1e-9),
+        Result.StartWorkingSet / 1e6,
+        Result.PeakWorkingSet / 1e6,
+        Same ? "copy verified" : "COPY DIFFERS"
+    );
+
+    return Same;
+}
+
+/**
+* The transfer suite, see the top of the file.
+*/
+static
+INT
+NetBenchTransfer(
+    _In_     PCSTR Path,
+    _In_opt_ PCSTR Server,
+    _In_opt_ PCSTR Port
+)
+{
+    HANDLE File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER Size;
+
+    if (File == INVALID_HANDLE_VALUE || !GetFileSizeEx(File, &Size))
+    {
+        printf("Cannot open %s: %d\n", Path, GetLastError());
+        return 1;
+    }
+    CloseHandle(File);
+
+    CreateDirectoryA("netbench", NULL);
+    CreateDirectoryA(NETBENCH_RECEIVE_DIRECTORY, NULL);
+
+    printf("chunk %u bytes, stream window %u bytes, mapped window %u bytes\n", PROTOCOL_FILE_CHUNK_SIZE, PROTOCOL_STREAM_WINDOW, TRANSFER_MAP_WINDOW);
+
+    BOOL Succeeded = NetBenchTransferRun("raw", Path, (UINT64)Size.QuadPart, NULL, NULL);
+    Succeeded = NetBenchTransferRun("direct", Path, (UINT64)Size.QuadPart, NULL, NULL) && Succeeded;
+
+    if (Server != NULL)
+    {
+        Succeeded = NetBenchTransferRun("relay", Path, (UINT64)Size.QuadPart, Server, Port) && Succeeded;
+    }
+
+    return Succeeded ? 0 : 1;
+}
+
+//////////////////////////////////////////
+//
+//          COMPRESSION SUITE
+//
+//////////////////////////////////////////
+
+/**
+* Appends to a growing buffer.
+*/
+static
+BOOL
+NetBenchAppend(
+    _Inout_ PNETBENCH_TEXT pText,
+    _In_    const CHAR* Data,
+    _In_    SIZE_T Length
+)
+{
+    if (pText->Size + Length > pText->Capacity)
+    {
+        SIZE_T Capacity = max(pText->Capacity * 2, pText->Size + Length + 4096);
+        CHAR* Grown = (CHAR*)realloc(pText->Data, Capacity);
+        if (Grown == NULL)
+        {
+            return FALSE;
+        }
+
+        pText->Data = Grown;
+        pText->Capacity = Capacity;
+    }
+
+    memcpy(pText->Data + pText->Size, Data, Length);
+    pText->Size += Length;
+    return TRUE;
+}
+
+/**
+* xorshift64*, the same sequence for the same seed on every system.
+*/
+static
+UINT32
+NetBenchRandom(
+    _Inout_ PUINT64 pState
+)
+{
+    *pState ^= *pState >> 12;
+    *pState ^= *pState << 25;
+    *pState ^= *pState >> 27;
+    return (UINT32)((*pState * 2685821657736338717ULL) >> 32);
+}
+
+/**
+* Picks an entry of a list, the first ones far more often, like words in real text.
+*/
+static
+ULONG
+NetBenchPick(
+    _Inout_ PUINT64 pState,
+    _In_    ULONG Count
+)
+{
+    double Uniform = (double)(NetBenchRandom(pState) >> 8) / 16777216.0;
+    return (ULONG)(Count * Uniform * Uniform);
+}
+
+/**
+* Writes one chat message made of one or more lines of NetBenchTemplates, filled in.
+*/
+static
+BOOL
+NetBenchGenerateMessage(
+    _Inout_ PUINT64 pState,
+    _Inout_ PNETBENCH_TEXT pText
+)
+{
+    ULONG Roll = NetBenchRandom(pState) % 100;
+    ULONG Parts = (Roll < 70) ? 1 : (Roll < 95) ? 2 : 3 + NetBenchRandom(pState) % 4;
+
+    for (ULONG Part = 0; Part < Parts; ++Part)
+    {
+        PCSTR Template = NetBenchTemplates[NetBenchPick(pState, ARRAYSIZE(NetBenchTemplates))];
+        CHAR Field[32];
+
+        if (Part > 0 && !NetBenchAppend(pText, " ", 1))
+        {
+            return FALSE;
+        }
+
+        for (PCSTR Cursor = Template; *Cursor != '\0'; ++Cursor)
+        {
+            PCSTR Value = Field;
+
+            if (Cursor[0] != '%' || Cursor[1] == '\0')
+            {
+                Field[0] = *Cursor;
+                Field[1] = '\0';
+            }
+            else
+            {
+                switch (*++Cursor)
+                {
+                case 'n':
+                    Value = NetBenchNames[NetBenchPick(pState, ARRAYSIZE(NetBenchNames))];
+                    break;
+
+                case 'w':
+                    Value = NetBenchWords[NetBenchPick(pState, ARRAYSIZE(NetBenchWords))];
+                    break;
+
+                case 'd':
+                    _snprintf_s(Field, sizeof(Field), _TRUNCATE, "%u", 1 + NetBenchRandom(pState) % 60);
+                    break;
+
+                case 't':
+                    _snprintf_s(Field, sizeof(Field), _TRUNCATE, "%u:%02u", 8 + NetBenchRandom(pState) % 11, (NetBenchRandom(pState) % 4) * 15);
+                    break;
+
+                default:
+                    Field[0] = *Cursor;
+                    Field[1] = '\0';
+                    break;
+                }
+            }
+
+            if (!NetBenchAppend(pText, Value, strlen(Value)))
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    return NetBenchAppend(pText, "\n", 1);
+}
+
+/**
+* Generates a synthetic corpus, one message per line.
+*/
+static
+BOOL
+NetBenchGenerateCorpus(
+    _In_  UINT64 Seed,
+    _In_  ULONG Messages,
+    _Out_ PNETBENCH_TEXT pText
+)
+{
+    UINT64 State = Seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    ZeroMemory(pText, sizeof(*pText));
+
+    for (ULONG i = 0; i < Messages; ++i)
+    {
+        if (!NetBenchGenerateMessage(&State, pText))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+* Reads a whole corpus file.
+*/
+static
+BOOL
+NetBenchReadCorpus(
+    _In_  PCSTR Path,
+    _Out_ PNETBENCH_TEXT pText
+)
+{
+    FILE* File = NULL;
+    CHAR Block[65536];
+    SIZE_T Read;
+
+    ZeroMemory(pText, sizeof(*pText));
+
+    if (fopen_s(&File, Path, "rb") != 0 || File == NULL)
+    {
+        return FALSE;
+    }
+
+    while ((Read = fread(Block, 1, sizeof(Block), File)) > 0)
+    {
+        if (!NetBenchAppend(pText, Block, Read))
+        {
+            fclose(File);
+            return FALSE;
+        }
+    }
+
+    fclose(File);
+    return TRUE;
+}
+
+/**
+* Cuts a corpus into its lines, each a chat message, cut at PROTOCOL_MAX_PAYLOAD_SIZE like the
+* client cuts what is typed.
+*
+* @return Number of messages, 0 if there are none or they do not fit in memory.
+*/
+static
+ULONG
+NetBenchSplit(
+    _In_  PNETBENCH_TEXT pText,
+    _Out_ PNETBENCH_MESSAGE* pMessages
+)
+{
+    ULONG Count = 0;
+    ULONG Capacity = 0;
+    PNETBENCH_MESSAGE Messages = NULL;
+    SIZE_T Start = 0;
+
+    for (SIZE_T i = 0; i <= pText->Size; ++i)
+    {
+        if (i < pText->Size && pText->Data[i] != '\n')
+        {
+            continue;
+        }
+
+        SIZE_T Length = i - Start;
+        if (Length > 0 && pText->Data[Start + Length - 1] == '\r')
+        {
+            --Length;
+        }
+
+        if (Length > 0)
+        {
+            if (Count == Capacity)
+            {
+                Capacity = max(Capacity * 2, 1024);
+                PNETBENCH_MESSAGE Grown = (PNETBENCH_MESSAGE)realloc(Messages, Capacity * sizeof(NETBENCH_MESSAGE));
+                if (Grown == NULL)
+                {
+                    free(Messages);
+                    return 0;
+                }
+                Messages = Grown;
+            }
+
+            Messages[Count].Text = pText->Data + Start;
+            Messages[Count].Length = (UINT16)min(Length, (SIZE_T)PROTOCOL_MAX_PAYLOAD_SIZE);
+            ++Count;
+        }
+
+        Start = i + 1;
+    }
+
+    *pMessages = Messages;
+    return Count;
+}
+
+/**
+* Joins consecutive messages, a newline after each, into frames of up to PROTOCOL_FILE_CHUNK_SIZE
+* bytes, the frames a history replay would send on a bulk stream.
+*/
+static
+ULONG
+NetBenchBatch(
+    _In_  const NETBENCH_MESSAGE* Messages,
+    _In_  ULONG Count,
+    _Out_ PNETBENCH_TEXT pBatches,
+    _Out_ PNETBENCH_MESSAGE* pFrames
+)
+{
+    ULONG Frames = 0;
+    SIZE_T FrameStart = 0;
+
+    ZeroMemory(pBatches, sizeof(*pBatches));
+    *pFrames = (PNETBENCH_MESSAGE)malloc(((SIZE_T)Count + 1) * sizeof(NETBENCH_MESSAGE));
+    if (*pFrames == NULL)
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        if (pBatches->Size - FrameStart + Messages[i].Length + 1 > PROTOCOL_FILE_CHUNK_SIZE)
+        {
+            (*pFrames)[Frames].Length = (UINT16)(pBatches->Size - FrameStart);
+            (*pFrames)[Frames++].Text = (const CHAR*)(ULONG_PTR)FrameStart; // made a pointer once the buffer stops moving
+            FrameStart = pBatches->Size;
+        }
+
+        if (!NetBenchAppend(pBatches, Messages[i].Text, Messages[i].Length) || !NetBenchAppend(pBatches, "\n", 1))
+        {
+            return 0;
+        }
+    }
+
+    if (pBatches->Size > FrameStart)
+    {
+        (*pFrames)[Frames].Length = (UINT16)(pBatches->Size - FrameStart);
+        (*pFrames)[Frames++].Text = (const CHAR*)(ULONG_PTR)FrameStart;
+    }
+
+    for (ULONG i = 0; i < Frames; ++i)
+    {
+        (*pFrames)[i].Text = pBatches->Data + (ULONG_PTR)(*pFrames)[i].Text;
+    }
+
+    return Frames;
+}
+
+/**
+* Compresses and expands every frame with one mode, checking each comes back unchanged, and
+* reports the bytes on the wire and the time per frame. The expansion includes the comparison with
+* the original.
+*/
+static
+BOOL
+NetBenchCompressRun(
+    _In_ PCSTR Name,
+    _In_ NET_PACK_MODE Mode,
+    _In_ const NETBENCH_MESSAGE* Frames,
+    _In_ ULONG Count
+)
+{
+    static const PCSTR ModeNames[] = { "none", "block", "dictionary" };
+    UINT64 RawBytes = 0;
+    UINT64 WireBytes = 0;
+    ULONG Compressed = 0;
+    BOOL Intact = TRUE;
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        RawBytes += sizeof(MESSAGE_HEADER) + Frames[i].Length;
+    }
+
+    // every frame as it goes on the wire, compressed ones in Packed, each frame's slot as large as
+    // the frame so nothing has to be copied while the clock runs
+    CHAR* Packed = (CHAR*)malloc((SIZE_T)RawBytes);
+    PNETBENCH_MESSAGE Wire = (PNETBENCH_MESSAGE)malloc((SIZE_T)Count * sizeof(NETBENCH_MESSAGE));
+    PUINT16 Flags = (PUINT16)malloc((SIZE_T)Count * sizeof(UINT16));
+    CHAR* Expanded = (CHAR*)malloc(PROTOCOL_MAX_BULK_PAYLOAD_SIZE);
+
+    if (Packed == NULL || Wire == NULL || Flags == NULL || Expanded == NULL)
+    {
+        free(Packed);
+        free(Wire);
+        free(Flags);
+        free(Expanded);
+        return FALSE;
+    }
+
+    // the dictionary is prepared once per process, not per frame
+    NetPackDictionary();
+
+    INT64 Start = NetBenchNow();
+    for (ULONG Round = 0; Round < NETBENCH_COMPRESS_ROUNDS; ++Round)
+    {
+        CHAR* Slot = Packed;
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            UINT16 Length = NetPackCompress(Mode, Frames[i].Text, Frames[i].Length, Slot, &Flags[i]);
+
+            Wire[i].Text = (Length != 0) ? Slot : Frames[i].Text;
+            Wire[i].Length = (Length != 0) ? Length : Frames[i].Length;
+            Slot += Frames[i].Length;
+        }
+    }
+    double CompressSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    Start = NetBenchNow();
+    for (ULONG Round = 0; Round < NETBENCH_COMPRESS_ROUNDS; ++Round)
+    {
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            const CHAR* Original;
+            UINT16 OriginalLength;
+
+            if (!NetPackExpand(Flags[i], Wire[i].Text, Wire[i].Length, PROTOCOL_MAX_BULK_PAYLOAD_SIZE, Expanded, &Original, &OriginalLength) ||
+                OriginalLength != Frames[i].Length ||
+                memcmp(Original, Frames[i].Text, OriginalLength) != 0)
+            {
+                Intact = FALSE;
+            }
+        }
+    }
+    double ExpandSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        WireBytes += sizeof(MESSAGE_HEADER) + Wire[i].Length;
+        Compressed += (Flags[i] != 0) ? 1 : 0;
+    }
+
+    double Calls = (double)Count * NETBENCH_COMPRESS_ROUNDS;
+    double Payload = (double)(RawBytes - (UINT64)Count * sizeof(MESSAGE_HEADER)) * NETBENCH_COMPRESS_ROUNDS;
+
+    printf(
+        "%-7s %-10s %7lu frames %6.1f%% packed  wire %8.3f MB of %8.3f MB (%5.1f%%)  compress %7.0f ns %7.1f MB/s  expand %6.0f ns %7.1f MB/s  %s\n",
+        Name,
+        ModeNames[Mode],
+        (unsigned long)Count,
+        100.0 * Compressed / max(Count, 1),
+        WireBytes / 1e6,
+        RawBytes / 1e6,
+        100.0 * WireBytes / max(RawBytes, 1),
+        CompressSeconds * 1e9 / Calls,
+        Payload / 1e6 / max(CompressSeconds, 1e-9),
+        ExpandSeconds * 1e9 / Calls,
+        Payload / 1e6 / max(ExpandSeconds, 1e-9),
+        Intact ? "intact" : "CORRUPTED"
+    );
+
+    free(Packed);
+    free(Wire);
+    free(Flags);
+    free(Expanded);
+    return Intact;
+}
+
+/**
+* How much a message of each length saves with either mode when every message is compressed, the
+* figures NET_PACK_THRESHOLD and NET_PACK_DICTIONARY_THRESHOLD are chosen from.
+*/
+static
+VOID
+NetBenchThresholds(
+    _In_ const NETBENCH_MESSAGE* Messages,
+    _In_ ULONG Count
+)
+{
+    static const UINT16 Bounds[] = { 16, 32, 64, 128, 256, 512, PROTOCOL_MAX_PAYLOAD_SIZE + 1 };
+    UINT8 Packed[LOG_PACK_BOUND(PROTOCOL_MAX_PAYLOAD_SIZE)];
+
+    printf("length     messages   block saves   dictionary saves (2 byte length included, net of the raw size)\n");
+
+    for (ULONG Bucket = 0; Bucket < ARRAYSIZE(Bounds); ++Bucket)
+    {
+        UINT16 Low = (Bucket == 0) ? 0 : Bounds[Bucket - 1];
+        ULONG InBucket = 0;
+        INT64 Raw = 0;
+        INT64 Block = 0;
+        INT64 Dictionary = 0;
+
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            if (Messages[i].Length < Low || Messages[i].Length >= Bounds[Bucket])
+            {
+                continue;
+            }
+
+            ++InBucket;
+            Raw += Messages[i].Length;
+            Block += sizeof(UINT16) + LogPackCompress((const UINT8*)Messages[i].Text, Messages[i].Length, Packed, sizeof(Packed));
+            Dictionary += sizeof(UINT16) + LogPackCompressDictionary(NetPackDictionary(), (const UINT8*)Messages[i].Text, Messages[i].Length, Packed, sizeof(Packed));
+        }
+
+        if (InBucket > 0)
+        {
+            printf(
+                "%4u-%-4u  %8lu   %10.1f%%   %15.1f%%\n",
+                Low,
+                Bounds[Bucket] - 1,
+                (unsigned long)InBucket,
+                100.0 * (Raw - Block) / Raw,
+                100.0 * (Raw - Dictionary) / Raw
+            );
+        }
+    }
+}
+
+/**
+* The compression suite: chat frames one message each, then history replay frames, with every
+* mode, and what compressing pays at each message length.
+*
+* @param Path Corpus with one message per line, NULL for a generated one.
+*/
+static
+INT
+NetBenchCompress(
+    _In_opt_ PCSTR Path
+)
+{
+    NETBENCH_TEXT Corpus;
+    NETBENCH_TEXT Batches;
+    PNETBENCH_MESSAGE Messages = NULL;
+    PNETBENCH_MESSAGE Frames = NULL;
+
+    BOOL Loaded = (Path != NULL) ? NetBenchReadCorpus(Path, &Corpus) : NetBenchGenerateCorpus(NETBENCH_BENCH_SEED, NETBENCH_CORPUS_MESSAGES, &Corpus);
+    if (!Loaded)
+    {
+        printf("Cannot read %s\n", (Path != NULL) ? Path : "the generated corpus");
+        return 1;
+    }
+
+    ULONG Count = NetBenchSplit(&Corpus, &Messages);
+    ULONG FrameCount = (Count != 0) ? NetBenchBatch(Messages, Count, &Batches, &Frames) : 0;
+
+    if (FrameCount == 0)
+    {
+        printf("No messages in %s\n", (Path != NULL) ? Path : "the generated corpus");
+        free(Corpus.Data);
+        free(Messages);
+        return 1;
+    }
+
+    printf(
+        "corpus %s, %lu messages, %.2f MB, %.1f bytes each, dictionary %lu bytes, thresholds %u and %u bytes\n",
+        (Path != NULL) ? Path : "generated",
+        (unsigned long)Count,
+        Corpus.Size / 1e6,
+        (double)Corpus.Size / Count,
+        (unsigned long)NetPackDictionaryLength,
+        NET_PACK_THRESHOLD,
+        NET_PACK_DICTIONARY_THRESHOLD
+    );
+
+    BOOL Intact = TRUE;
+    for (ULONG Mode = NET_PACK_NONE; Mode <= NET_PACK_DICTIONARY; ++Mode)
+    {
+        Intact = NetBenchCompressRun("chat", (NET_PACK_MODE)Mode, Messages, Count) && Intact;
+    }
+
+    for (ULONG Mode = NET_PACK_NONE; Mode <= NET_PACK_DICTIONARY; ++Mode)
+    {
+        Intact = NetBenchCompressRun("replay", (NET_PACK_MODE)Mode, Frames, FrameCount) && Intact;
+    }
+
+    NetBenchThresholds(Messages, Count);
+
+    free(Frames);
+    free(Batches.Data);
+    free(Messages);
+    free(Corpus.Data);
+
+    return Intact ? 0 : 1;
+}
+
+/**
+* Writes a generated corpus, for training a dictionary or feeding the compression suite.
+*/
+static
+INT
+NetBenchWriteCorpus(
+    _In_ PCSTR Path,
+    _In_ ULONG Messages,
+    _In_ UINT64 Seed
+)
+{
+    NETBENCH_TEXT Corpus;
+    FILE* File = NULL;
+
+    if (!NetBenchGenerateCorpus(Seed, Messages, &Corpus) || fopen_s(&File, Path, "wb") != 0 || File == NULL)
+    {
+        printf("Cannot write %s\n", Path);
+        free(Corpus.Data);
+        return 1;
+    }
+
+    BOOL Written = fwrite(Corpus.Data, 1, Corpus.Size, File) == Corpus.Size;
+    fclose(File);
+    free(Corpus.Data);
+
+    printf("%lu messages, %zu bytes written to %s\n", (unsigned long)Messages, Corpus.Size, Path);
+    return Written ? 0 : 1;
+}
+
+static
+ULONG
+NetBenchDmerHash(
+    _In_ const CHAR* Data
+)
+{
+    UINT64 Value;
+    memcpy(&Value, Data, sizeof(Value));
+    return (ULONG)((Value * 0x9E3779B97F4A7C15ULL) >> (64 - NETBENCH_DMER_BITS));
+}
+
+static
+INT
+__cdecl
+NetBenchCompareSegments(
+    _In_ const VOID* First,
+    _In_ const VOID* Second
+)
+{
+    UINT64 Left = ((const NETBENCH_SEGMENT*)First)->Score;
+    UINT64 Right = ((const NETBENCH_SEGMENT*)Second)->Score;
+    return (Left > Right) - (Left < Right);
+}
+
+/**
+* Trains a dictionary on a corpus and writes it as netdict.c.
+*
+* The corpus is cut into one epoch per segment of the dictionary. From every epoch the segment of
+* NETBENCH_SEGMENT_LENGTH bytes is taken whose NETBENCH_DMER byte sequences are the most frequent
+* in the whole corpus, and the sequences it holds stop counting, so later segments bring in
+* something new. The best segments go last, where LogPackPrepareDictionary keeps them if the
+* dictionary is ever cut.
+*/
+static
+INT
+NetBenchTrain(
+    _In_ PCSTR CorpusPath,
+    _In_ PCSTR OutputPath
+)
+{
+    NETBENCH_TEXT Corpus;
+
+    if (!NetBenchReadCorpus(CorpusPath, &Corpus) || Corpus.Size < NETBENCH_DICTIONARY_SIZE * 4)
+    {
+        printf("Cannot read %s or it is too small to train on\n", CorpusPath);
+        free(Corpus.Data);
+        return 1;
+    }
+
+    PUINT32 Counts = (PUINT32)calloc((SIZE_T)1 << NETBENCH_DMER_BITS, sizeof(UINT32));
+    ULONG SegmentCount = NETBENCH_DICTIONARY_SIZE / NETBENCH_SEGMENT_LENGTH;
+    PNETBENCH_SEGMENT Segments = (PNETBENCH_SEGMENT)calloc(SegmentCount, sizeof(NETBENCH_SEGMENT));
+    FILE* Output = NULL;
+
+    if (Counts == NULL || Segments == NULL)
+    {
+        free(Counts);
+        free(Segments);
+        free(Corpus.Data);
+        return 1;
+    }
+
+    SIZE_T Positions = Corpus.Size - NETBENCH_DMER + 1;
+    for (SIZE_T i = 0; i < Positions; ++i)
+    {
+        ++Counts[NetBenchDmerHash(Corpus.Data + i)];
+    }
+
+    SIZE_T EpochLength = Corpus.Size / SegmentCount;
+    ULONG Dmers = NETBENCH_SEGMENT_LENGTH - NETBENCH_DMER + 1;
+
+    for (ULONG Epoch = 0; Epoch < SegmentCount; ++Epoch)
+    {
+        SIZE_T First = Epoch * EpochLength;
+        SIZE_T Last = min(First + EpochLength, Corpus.Size - NETBENCH_SEGMENT_LENGTH);
+        UINT64 Score = 0;
+
+        for (ULONG i = 0; i < Dmers; ++i)
+        {
+            Score += Counts[NetBenchDmerHash(Corpus.Data + First + i)];
+        }
+
+        Segments[Epoch].Start = First;
+        Segments[Epoch].Score = Score;
+
+        // slide the segment through the epoch a byte at a time
+        for (SIZE_T Start = First + 1; Start <= Last; ++Start)
+        {
+            Score -= Counts[NetBenchDmerHash(Corpus.Data + Start - 1)];
+            Score += Counts[NetBenchDmerHash(Corpus.Data + Start + Dmers - 1)];
+
+            if (Score > Segments[Epoch].Score)
+            {
+                Segments[Epoch].Start = Start;
+                Segments[Epoch].Score = Score;
+            }
+        }
+
+        for (ULONG i = 0; i < Dmers; ++i)
+        {
+            Counts[NetBenchDmerHash(Corpus.Data + Segments[Epoch].Start + i)] = 0;
+        }
+    }
+
+    qsort(Segments, SegmentCount, sizeof(NETBENCH_SEGMENT), NetBenchCompareSegments);
+
+    if (fopen_s(&Output, OutputPath, "w") != 0 || Output == NULL)
+    {
+        printf("Cannot write %s\n", OutputPath);
+        free(Counts);
+        free(Segments);
+        free(Corpus.Data);
+        return 1;
+    }
+
+    fprintf(Output, "#include \"netpack.h\"\n\n");
+    fprintf(Output, "/**\n");
+    fprintf(Output, "* The shared chat dictionary, generated by 'netbench dictionary' from a corpus of %zu bytes.\n", Corpus.Size);
+    fprintf(Output, "* Both ends of a connection have to hold these exact bytes, a new dictionary takes a new\n");
+    fprintf(Output, "* capability bit (see netpack.h).\n");
+    fprintf(Output, "*/\n");
+    fprintf(Output, "const UINT8 NetPackDictionaryData[] =\n");
+
+    for (ULONG i = 0; i < SegmentCount; ++i)
+    {
+        const CHAR* Segment = Corpus.Data + Segments[i].Start;
+
+        fprintf(Output, "    \"");
+        for (ULONG j = 0; j < NETBENCH_SEGMENT_LENGTH; ++j)
+        {
+            UINT8 Byte = (UINT8)Segment[j];
+
+            if (Byte == '"' || Byte == '\\' || Byte == '?')
+            {
+                fprintf(Output, "\\%c", Byte);
+            }
+            else if (Byte < 0x20 || Byte >= 0x7F)
+            {
+                fprintf(Output, "\\%03o", Byte);
+            }
+            else
+            {
+                fputc(Byte, Output);
+            }
+        }
+        fprintf(Output, "\"%s\n", (i + 1 == SegmentCount) ? ";" : "");
+    }
+
+    fprintf(Output, "\nconst ULONG NetPackDictionaryLength = sizeof(NetPackDictionaryData) - 1;\n");
+    fclose(Output);
+
+    printf("%lu segments of %u bytes from %s written to %s\n", (unsigned long)SegmentCount, NETBENCH_SEGMENT_LENGTH, CorpusPath, OutputPath);
+
+    free(Counts);
+    free(Segments);
+    free(Corpus.Data);
+    return 0;
+}
+
+//////////////////////////////////////////
+//
+//          MESSAGE SUITE
+//
+//////////////////////////////////////////
+
+/**
+* Frames the message suite decodes: every corpus message as chat, an ack after every fourth, a
+* presence change after every sixteenth and a ping after every thirty second, back to back in one
+* buffer the way they lie in a receive chunk.
+*
+* @param Frames Receives the frames, at least NETBENCH_MESSAGE_FRAMES bytes per message and the text.
+*
+* @return Bytes of frames written to Frames.
+*/
+static
+SIZE_T
+NetBenchEncodeMessages(
+    _In_  const NETBENCH_MESSAGE* Messages,
+    _In_  ULONG Count,
+    _Out_ CHAR* Frames,
+    _Out_ PULONG pFrameCount
+)
+{
+    SIZE_T Size = 0;
+    ULONG FrameCount = 0;
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        for (ULONG Kind = 0; Kind < 4; ++Kind)
+        {
+            PMESSAGE_HEADER Header = (PMESSAGE_HEADER)(Frames + Size);
+            CHAR* Payload = (CHAR*)(Header + 1);
+            UINT16 Type;
+            UINT16 Length;
+
+            if (Kind == 0)
+            {
+                UINT16 TextLength = (UINT16)min(Messages[i].Length, (UINT16)MESSAGE_MAX_CHAT_TEXT);
+                Type = MESSAGE_TYPE_CHAT;
+                Length = MessageChatEncode(Payload, i, 1 + i % 64, Messages[i].Text, TextLength);
+            }
+            else if (Kind == 1 && i % 4 == 0)
+            {
+                Type = MESSAGE_TYPE_ACK;
+                Length = MessageAckEncode(Payload, i, NULL, 0);
+            }
+            else if (Kind == 2 && i % 16 == 0)
+            {
+                Type = MESSAGE_TYPE_PRESENCE;
+                Length = MessagePresenceEncode(Payload, 1 + i % 64, MESSAGE_PRESENCE_AWAY, NULL, 0);
+            }
+            else if (Kind == 3 && i % 32 == 0)
+            {
+                Type = MESSAGE_TYPE_CONTROL;
+                Length = MessageControlEncode(Payload, MESSAGE_CONTROL_PING, i, NULL, 0);
+            }
+            else
+            {
+                continue;
+            }
+
+            Header->Type = htons(Type);
+            Header->Length = htons(Length);
+            Header->StreamId = htons(STREAM_CHAT);
+            Header->Flags = 0;
+
+            Size += sizeof(MESSAGE_HEADER) + Length;
+            ++FrameCount;
+        }
+    }
+
+    *pFrameCount = FrameCount;
+    return Size;
+}
+
+/**
+* Walks the frames like a receive loop and reads every field of every message in place.
+*
+* @return A sum of the fields, so none of the reads can be left out.
+*/
+static
+UINT64
+NetBenchDecodeMessages(
+    _In_ const CHAR* Frames,
+    _In_ SIZE_T Size
+)
+{
+    UINT64 Sum = 0;
+
+    for (SIZE_T Offset = 0; Offset < Size;)
+    {
+        MESSAGE_HEADER Header;
+        memcpy(&Header, Frames + Offset, sizeof(Header));
+
+        const CHAR* Payload = Frames + Offset + sizeof(Header);
+        UINT16 Length = ntohs(Header.Length);
+
+        switch (ntohs(Header.Type))
+        {
+        case MESSAGE_TYPE_CHAT:
+        {
+            const CHAT_MESSAGE* pChat = MessageChatView(Payload, Length);
+            if (pChat != NULL)
+            {
+                UINT16 TextLength;
+                const CHAR* Text = MessageChatTail(pChat, Length, &TextLength);
+                Sum += MessageChatSequence(pChat) + MessageChatSenderId(pChat) + TextLength + (UINT8)Text[0];
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_ACK:
+        {
+            const ACK_MESSAGE* pAck = MessageAckView(Payload, Length);
+            Sum += (pAck != NULL) ? MessageAckSequence(pAck) : 0;
+            break;
+        }
+
+        case MESSAGE_TYPE_PRESENCE:
+        {
+            const PRESENCE_MESSAGE* pPresence = MessagePresenceView(Payload, Length);
+            Sum += (pPresence != NULL) ? MessagePresenceClientId(pPresence) + MessagePresenceState(pPresence) : 0;
+            break;
+        }
+
+        case MESSAGE_TYPE_CONTROL:
+        {
+            const CONTROL_MESSAGE* pControl = MessageControlView(Payload, Length);
+            Sum += (pControl != NULL) ? MessageControlCommand(pControl) + MessageControlArgument(pControl) : 0;
+            break;
+        }
+
+        default:
+            break;
+        }
+
+        Offset += sizeof(Header) + Length;
+    }
+
+    return Sum;
+}
+
+/**
+* What the relay did per chat message before the schema: the payload was the text and every
+* message was compared with the commands that end the connection.
+*/
+static
+UINT64
+NetBenchMatchCommands(
+    _In_ const NETBENCH_MESSAGE* Messages,
+    _In_ ULONG Count
+)
+{
+    UINT64 Sum = 0;
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        const CHAR* Payload = Messages[i].Text;
+        UINT16 Length = Messages[i].Length;
+
+        if (Length == 4 && (_strnicmp(Payload, "quit", 4) == 0 || _strnicmp(Payload, "exit", 4) == 0))
+        {
+            ++Sum;
+        }
+
+        Sum += Length + (UINT8)Payload[0];
+    }
+
+    return Sum;
+}
+
+/**
+* The message suite: the time to encode and to decode each typed message, against the command
+* matching the typed control messages replaced.
+*/
+static
+INT
+NetBenchMessages(
+    VOID
+)
+{
+    NETBENCH_TEXT Corpus;
+    PNETBENCH_MESSAGE Messages = NULL;
+    CHAR* Frames = NULL;
+    ULONG FrameCount = 0;
+
+    if (!NetBenchGenerateCorpus(NETBENCH_BENCH_SEED, NETBENCH_CORPUS_MESSAGES, &Corpus))
+    {
+        printf("Cannot generate the corpus\n");
+        return 1;
+    }
+
+    ULONG Count = NetBenchSplit(&Corpus, &Messages);
+    if (Count != 0)
+    {
+        Frames = (CHAR*)malloc((SIZE_T)Count * NETBENCH_MESSAGE_FRAMES + Corpus.Size);
+    }
+
+    if (Frames == NULL)
+    {
+        free(Messages);
+        free(Corpus.Data);
+        return 1;
+    }
+
+    SIZE_T Size = NetBenchEncodeMessages(Messages, Count, Frames, &FrameCount);
+    volatile UINT64 Sink = 0;
+    double Calls = (double)FrameCount * NETBENCH_MESSAGE_ROUNDS;
+
+    INT64 Start = NetBenchNow();
+    for (ULONG Round = 0; Round < NETBENCH_MESSAGE_ROUNDS; ++Round)
+    {
+        ULONG Ignored;
+        Sink += NetBenchEncodeMessages(Messages, Count, Frames, &Ignored) + (UINT8)Frames[Round % Size];
+    }
+    double EncodeSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    Start = NetBenchNow();
+    for (ULONG Round = 0; Round < NETBENCH_MESSAGE_ROUNDS; ++Round)
+    {
+        Sink += NetBenchDecodeMessages(Frames, Size);
+    }
+    double DecodeSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    Start = NetBenchNow();
+    for (ULONG Round = 0; Round < NETBENCH_MESSAGE_ROUNDS; ++Round)
+    {
+        Sink += NetBenchMatchCommands(Messages, Count);
+    }
+    double MatchSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    printf("%lu frames (%lu chat), %.2f MB, %u rounds\n", (unsigned long)FrameCount, (unsigned long)Count, Size / 1e6, NETBENCH_MESSAGE_ROUNDS);
+    printf("encode            %6.2f ns per message\n", EncodeSeconds * 1e9 / Calls);
+    printf("decode            %6.2f ns per message, every field read in place\n", DecodeSeconds * 1e9 / Calls);
+    printf("command matching  %6.2f ns per chat message, the string compare it replaced\n", MatchSeconds * 1e9 / ((double)Count * NETBENCH_MESSAGE_ROUNDS));
+
+    free(Frames);
+    free(Messages);
+    free(Corpus.Data);
+
+    return (Sink != 0) ? 0 : 1;
+}
+
+//////////////////////////////////////////
+//
+//          FLOOD SUITE
+//
+//////////////////////////////////////////
+
+/**
+* Sends chat frames on a connection as fast as its window lets it until told to stop.
+*/
+static
+DWORD
+WINAPI
+NetBenchFloodThread(
+    _In_ LPVOID lpData
+)
+{
+    PNETBENCH_FLOOD pFlood = (PNETBENCH_FLOOD)lpData;
+    static const CHAR Text[] = "flooding the relay with chat it has to handle, echo and print";
+
+    while (!pFlood->Stop)
+    {
+        CHAR Chat[sizeof(CHAT_MESSAGE) + sizeof(Text)];
+        UINT16 Length = MessageChatEncode(Chat, (UINT32)pFlood->Sent, 0, Text, sizeof(Text) - 1);
+
+        NET_IO_STATUS Status = NetMuxSend(&pFlood->End.Mux, STREAM_CHAT, MESSAGE_TYPE_CHAT, Chat, Length);
+        if (Status == NET_IO_FAILED)
+        {
+            break;
+        }
+
+        if (Status == NET_IO_PENDING)
+        {
+            NetMuxWait(&pFlood->End.Mux, 100);
+        }
+        else
+        {
+            ++pFlood->Sent;
+        }
+    }
+
+    return 0;
+}
+
+static
+INT
+__cdecl
+NetBenchCompareSamples(
+    _In_ const VOID* First,
+    _In_ const VOID* Second
+)
+{
+    double Left = *(const double*)First;
+    double Right = *(const double*)Second;
+    return (Left > Right) - (Left < Right);
+}
+
+/**
+* Times NETBENCH_PINGS pings of the server from an end, NETBENCH_PING_INTERVAL apart.
+*
+* @param Samples Receives the round trip of every ping answered, in milliseconds, sorted.
+*
+* @return Pings answered.
+*/
+static
+ULONG
+NetBenchPing(
+    _Inout_ PNETBENCH_END pEnd,
+    _Out_   double* Samples
+)
+{
+    ULONG Answered = 0;
+
+    for (ULONG i = 1; i <= NETBENCH_PINGS; ++i)
+    {
+        CONTROL_MESSAGE Ping;
+        UINT16 Length = MessageControlEncode(&Ping, MESSAGE_CONTROL_PING, i, NULL, 0);
+
+        INT64 Start = NetBenchNow();
+        if (NetMuxSend(&pEnd->Mux, STREAM_CONTROL, MESSAGE_TYPE_CONTROL, &Ping, Length) != NET_IO_COMPLETE)
+        {
+            break;
+        }
+
+        // a late answer to an earlier ping does not count for this one
+        while (pEnd->Pong != (LONG64)i && WaitForSingleObject(pEnd->Ponged, NETBENCH_PING_TIMEOUT) == WAIT_OBJECT_0)
+        {
+        }
+
+        if (pEnd->Pong == (LONG64)i)
+        {
+            Samples[Answered++] = NetBenchSeconds(Start, NetBenchNow()) * 1000.0;
+        }
+
+        Sleep(NETBENCH_PING_INTERVAL);
+    }
+
+    qsort(Samples, Answered, sizeof(*Samples), NetBenchCompareSamples);
+    return Answered;
+}
+
+/**
+* Pings the server from one client, with another client from another address flooding it with
+* chat or not, and prints the round trips.
+*/
+static
+BOOL
+NetBenchFloodRun(
+    _In_ PCSTR Name,
+    _In_ PCSTR Server,
+    _In_ PCSTR Port,
+    _In_ BOOL Flooding
+)
+{
+    NETBENCH_END Quiet;
+    NETBENCH_FLOOD Flood;
+    static double Samples[NETBENCH_PINGS];
+
+    ZeroMemory(&Quiet, sizeof(Quiet));
+    ZeroMemory(&Flood, sizeof(Flood));
+    Quiet.Socket = INVALID_SOCKET;
+    Flood.End.Socket = INVALID_SOCKET;
+
+    BOOL Started = NetBenchConnectServer(&Quiet, Server, Port, NULL) && NetBenchStartEnd(&Quiet);
+
+    if (Started && Flooding)
+    {
+        Started = NetBenchConnectServer(&Flood.End, Server, Port, NETBENCH_FLOOD_SOURCE) && NetBenchStartEnd(&Flood.End);
+        Flood.Thread = Started ? CreateThread(NULL, 0, NetBenchFloodThread, &Flood, 0, NULL) : NULL;
+        Started = Flood.Thread != NULL;
+
+        Sleep(NETBENCH_FLOOD_WARMUP);
+    }
+
+    ULONG Answered = 0;
+    ULONGLONG FloodStart = Flood.Sent;
+    INT64 Start = NetBenchNow();
+
+    if (Started)
+    {
+        Answered = NetBenchPing(&Quiet, Samples);
+    }
+
+    double Seconds = NetBenchSeconds(Start, NetBenchNow());
+    ULONGLONG Flooded = Flood.Sent - FloodStart;
+
+    // a flooder the server disconnected has stopped by now
+    BOOL FloodConnected = Flood.Thread != NULL && WaitForSingleObject(Flood.Thread, 0) == WAIT_TIMEOUT;
+
+    if (Flood.Thread != NULL)
+    {
+        Flood.Stop = TRUE;
+        WaitForSingleObject(Flood.Thread, INFINITE);
+        CloseHandle(Flood.Thread);
+    }
+
+    NetBenchStopEnd(&Flood.End);
+    NetBenchStopEnd(&Quiet);
+
+    if (Answered == 0)
+    {
+        printf("%-10s no ping answered\n", Name);
+        return FALSE;
+    }
+
+    printf(
+        "%-10s median %7.3f ms  p99 %7.3f ms  max %7.3f ms  lost %3lu",
+        Name,
+        Samples[Answered / 2],
+        Samples[(Answered * 99) / 100],
+        Samples[Answered - 1],
+        (unsigned long)(NETBENCH_PINGS - Answered)
+    );
+
+    if (Flooding)
+    {
+        printf("  flood %8.0f frames/s%s", Flooded / Seconds, FloodConnected ? "" : ", disconnected");
+    }
+
+    printf("\n");
+    return TRUE;
+}
+
+/**
+* The flood suite: the round trip of one client's pings to the server on its own and while
+* another client floods the server with chat.
+*
+* The flooder connects from NETBENCH_FLOOD_SOURCE, so the measured client is limited by neither
+* its limits nor the flooder's address's. The server's limits and action are its own, set in its
+* environment; run the suite against a server with and without limits to compare.
+*/
+static
+INT
+NetBenchFlood(
+    _In_ PCSTR Server,
+    _In_ PCSTR Port
+)
+{
+    // the check a server adds to every frame, against limits it never reaches, and the clock it
+    // reads once for every client it serves
+    NET_LIMITS Limits;
+    NET_RATES Rates;
+    ZeroMemory(&Rates, sizeof(Rates));
+    NetLimitSet(&Limits.Messages, MAXULONG, MAXULONG);
+    NetLimitSet(&Limits.Bytes, MAXULONG, MAXULONG);
+
+    LONG64 Now = NetLimitNow();
+    LONG64 Refused = 0;
+
+    INT64 Start = NetBenchNow();
+    for (ULONG i = 0; i < NETBENCH_LIMIT_TAKES; ++i)
+    {
+        Refused += NetLimitTake(&Rates, &Limits, 1, 64, Now);
+    }
+    double TakeSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    volatile LONG64 Sink = 0;
+    Start = NetBenchNow();
+    for (ULONG i = 0; i < NETBENCH_LIMIT_TAKES; ++i)
+    {
+        Sink += NetLimitNow();
+    }
+    double ClockSeconds = NetBenchSeconds(Start, NetBenchNow());
+
+    printf(
+        "limit check %.1f ns per bucket pair%s, clock %.1f ns per read\n",
+        TakeSeconds * 1e9 / NETBENCH_LIMIT_TAKES,
+        (Refused != 0) ? " (some refused)" : "",
+        ClockSeconds * 1e9 / NETBENCH_LIMIT_TAKES
+    );
+    printf("%u pings %u ms apart, flooding from %s\n", NETBENCH_PINGS, NETBENCH_PING_INTERVAL, NETBENCH_FLOOD_SOURCE);
+
+    BOOL Succeeded = NetBenchFloodRun("quiet", Server, Port, FALSE);
+    Succeeded = NetBenchFloodRun("flooded", Server, Port, TRUE) && Succeeded;
+
+    return Succeeded ? 0 : 1;
+}
+
+//////////////////////////////////////////
+//
+//          IMPAIRMENT SUITE
+//
+//////////////////////////////////////////
+
+#ifdef __linux__
+
+/**
+* A packet on its way across the emulated link.
+*/
+typedef struct _NETBENCH_PACKET
+{
+    LONG64 Due;                          // NetLimitNow at which it leaves the link
+    UINT16 Length;
+    CHAR   Data[NETBENCH_LINK_MTU];
+} NETBENCH_PACKET, *PNETBENCH_PACKET;
+
+/**
+* One direction of the link, a FIFO of packets being serialised and delayed.
+*/
+typedef struct _NETBENCH_LINK_QUEUE
+{
+    PNETBENCH_PACKET Packets;            // NETBENCH_LINK_LIMIT, ring
+    ULONG            Head;
+    ULONG            Count;
+    LONG64           Free;               // NetLimitNow at which the link has sent everything it holds
+} NETBENCH_LINK_QUEUE, *PNETBENCH_LINK_QUEUE;
+
+/**
+* Two network namespaces joined by a tun device in each, with this process passing the packets
+* between the two devices. Everything crossing from one end to the other goes through the queues
+* of the link, TCP segments as much as RUDP datagrams.
+*/
+typedef struct _NETBENCH_LINK
+{
+    INT                 Tun[2];          // the device of each end
+    INT                 Namespace[2];    // the network namespace of each end
+    NETBENCH_LINK_QUEUE Queues[2];       // packets from Tun[i] to the other end
+    ULONG               LossPercent;
+    ULONG               DelayMs;         // each way
+    ULONG               RateMbits;
+    UINT64              Random;
+    UINT64              Dropped;         // packets lost on purpose or to a full queue
+    HANDLE              Thread;          // passes the packets
+    volatile LONG       Running;
+} NETBENCH_LINK, *PNETBENCH_LINK;
+
+/**
+* One end of a RUDP connection over the link, what a peer session holds for its direct path.
+*/
+typedef struct _NETBENCH_RUDP_END
+{
+    SOCKET             Socket;
+    struct sockaddr_in Peer;
+    RUDP_CONNECTION    Connection;
+    HANDLE             Thread;           // receives and runs the connection's timers
+    volatile LONG      Running;
+    volatile LONG64    Delivered;        // bytes delivered in stream order
+} NETBENCH_RUDP_END, *PNETBENCH_RUDP_END;
+
+typedef struct _NETBENCH_STREAM_END
+{
+    SOCKET          Socket;
+    UINT64          Expected;
+    volatile LONG64 Received;
+} NETBENCH_STREAM_END, *PNETBENCH_STREAM_END;
+
+//
+// The impairments every transport is run under, netem's loss and delay on both directions.
+//
+static const struct
+{
+    ULONG LossPercent;
+    ULONG DelayMs;
+} NetBenchImpairments[] =
+{
+    { 0, 0 },
+    { 1, 0 },
+    { 5, 0 },
+    { 0, 25 },
+    { 1, 25 },
+    { 5, 25 },
+};
+
+/**
+* Sets the address of one end of the link.
+*/
+static
+VOID
+NetBenchLinkAddress(
+    _In_  ULONG Index,
+    _In_  UINT16 Port,
+    _Out_ struct sockaddr_in* pAddress
+)
+{
+    ZeroMemory(pAddress, sizeof(*pAddress));
+    pAddress->sin_family = AF_INET;
+    pAddress->sin_addr.s_addr = htonl(NETBENCH_LINK_ADDRESS + Index);
+    pAddress->sin_port = htons(Port);
+}
+
+/**
+* Creates a socket in the namespace of one end, bound to its address.
+*/
+static
+SOCKET
+NetBenchLinkSocket(
+    _In_ PNETBENCH_LINK pLink,
+    _In_ ULONG Index,
+    _In_ INT Type,
+    _In_ INT Protocol
+)
+{
+    struct sockaddr_in Address;
+    NetBenchLinkAddress(Index, 0, &Address);
+
+    if (setns(pLink->Namespace[Index], CLONE_NEWNET) != 0)
+    {
+        return INVALID_SOCKET;
+    }
+
+    SOCKET Socket = socket(AF_INET, Type, Protocol);
+    if (Socket != INVALID_SOCKET && bind(Socket, (struct sockaddr*)&Address, sizeof(Address)) == SOCKET_ERROR)
+    {
+        closesocket(Socket);
+        Socket = INVALID_SOCKET;
+    }
+
+    return Socket;
+}
+
+/**
+* Moves the calling thread into a new network namespace and brings up the tun device of one end
+* of the link in it, pointing at the other end.
+*/
+static
+BOOL
+NetBenchOpenLinkEnd(
+    _Inout_ PNETBENCH_LINK pLink,
+    _In_    ULONG Index
+)
+{
+    // a namespace of its own, or the kernel would deliver between the ends without the link
+    if (unshare(CLONE_NEWNET) != 0)
+    {
+        printf("Cannot create a network namespace, the impairment suite needs CAP_NET_ADMIN: %d\n", errno);
+        return FALSE;
+    }
+
+    pLink->Namespace[Index] = open("/proc/thread-self/ns/net", O_RDONLY);
+    pLink->Tun[Index] = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (pLink->Namespace[Index] < 0 || pLink->Tun[Index] < 0)
+    {
+        printf("Cannot open a tun device: %d\n", errno);
+        return FALSE;
+    }
+
+    struct ifreq Request;
+    ZeroMemory(&Request, sizeof(Request));
+    Request.ifr_flags = IFF_TUN | IFF_NO_PI;
+    _snprintf_s(Request.ifr_name, sizeof(Request.ifr_name), _TRUNCATE, "netbench%lu", (unsigned long)Index);
+
+    SOCKET Control = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    BOOL Succeeded = Control != INVALID_SOCKET && ioctl(pLink->Tun[Index], TUNSETIFF, &Request) == 0;
+
+    NetBenchLinkAddress(Index, 0, (struct sockaddr_in*)&Request.ifr_addr);
+    Succeeded = Succeeded && ioctl(Control, SIOCSIFADDR, &Request) == 0;
+
+    NetBenchLinkAddress(1 - Index, 0, (struct sockaddr_in*)&Request.ifr_dstaddr);
+    Succeeded = Succeeded && ioctl(Control, SIOCSIFDSTADDR, &Request) == 0;
+
+    Succeeded = Succeeded && ioctl(Control, SIOCGIFFLAGS, &Request) == 0;
+    Request.ifr_flags |= IFF_UP | IFF_RUNNING;
+    Succeeded = Succeeded && ioctl(Control, SIOCSIFFLAGS, &Request) == 0;
+
+    if (Control != INVALID_SOCKET)
+    {
+        closesocket(Control);
+    }
+
+    if (!Succeeded)
+    {
+        printf("Cannot set up %s: %d\n", Request.ifr_name, errno);
+        return FALSE;
+    }
+
+    // every TCP run starts from the same window, not from what the last one left in the cache
+    INT Sysctl = open("/proc/sys/net/ipv4/tcp_no_metrics_save", O_WRONLY);
+    if (Sysctl >= 0)
+    {
+        if (write(Sysctl, "1", 1) != 1)
+        {
+            printf("Cannot turn off TCP metrics caching, TCP runs may start from each other's window\n");
+        }
+        close(Sysctl);
+    }
+
+    return TRUE;
+}
+
+/**
+* Queues the packets waiting on one end's device for the other end, dropping the ones the loss
+* rate picks and the ones a full queue has no room for.
+*/
+static
+VOID
+NetBenchLinkRead(
+    _Inout_ PNETBENCH_LINK pLink,
+    _In_    ULONG Index
+)
+{
+    PNETBENCH_LINK_QUEUE pQueue = &pLink->Queues[Index];
+    NETBENCH_PACKET Overflow;
+
+    while (TRUE)
+    {
+        PNETBENCH_PACKET pPacket = (pQueue->Count < NETBENCH_LINK_LIMIT)
+            ? &pQueue->Packets[(pQueue->Head + pQueue->Count) % NETBENCH_LINK_LIMIT]
+            : &Overflow;
+
+        ssize_t Length = read(pLink->Tun[Index], pPacket->Data, sizeof(pPacket->Data));
+        if (Length <= 0)
+        {
+            break;
+        }
+
+        if (pPacket == &Overflow || NetBenchRandom(&pLink->Random) % 100 < pLink->LossPercent)
+        {
+            ++pLink->Dropped;
+            continue;
+        }
+
+        // serialised at the link's rate behind what it already holds, then delayed
+        LONG64 Now = NetLimitNow();
+        pQueue->Free = max(pQueue->Free, Now) + (LONG64)Length * 8 * 1000 / pLink->RateMbits;
+        pPacket->Due = pQueue->Free + (LONG64)pLink->DelayMs * 1000000;
+        pPacket->Length = (UINT16)Length;
+        ++pQueue->Count;
+    }
+}
+
+static
+DWORD
+WINAPI
+NetBenchLinkThread(
+    _In_ LPVOID lpData
+)
+{
+    PNETBENCH_LINK pLink = (PNETBENCH_LINK)lpData;
+
+    while (pLink->Running)
+    {
+        LONG64 Now = NetLimitNow();
+        INT Timeout = 100;
+
+        for (ULONG i = 0; i < 2; ++i)
+        {
+            PNETBENCH_LINK_QUEUE pQueue = &pLink->Queues[i];
+
+            while (pQueue->Count > 0 && pQueue->Packets[pQueue->Head].Due <= Now)
+            {
+                PNETBENCH_PACKET pPacket = &pQueue->Packets[pQueue->Head];
+                if (write(pLink->Tun[1 - i], pPacket->Data, pPacket->Length) < 0)
+                {
+                    ++pLink->Dropped;
+                }
+
+                pQueue->Head = (pQueue->Head + 1) % NETBENCH_LINK_LIMIT;
+                --pQueue->Count;
+            }
+
+            if (pQueue->Count > 0)
+            {
+                Timeout = min(Timeout, (INT)((pQueue->Packets[pQueue->Head].Due - Now + 999999) / 1000000));
+            }
+        }
+
+        struct pollfd Polls[2];
+        for (ULONG i = 0; i < 2; ++i)
+        {
+            Polls[i].fd = pLink->Tun[i];
+            Polls[i].events = POLLIN;
+            Polls[i].revents = 0;
+        }
+
+        if (poll(Polls, 2, Timeout) > 0)
+        {
+            for (ULONG i = 0; i < 2; ++i)
+            {
+                if (Polls[i].revents & POLLIN)
+                {
+                    NetBenchLinkRead(pLink, i);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Sets up both ends of the link and starts passing packets between them.
+*/
+static
+BOOL
+NetBenchOpenLink(
+    _Out_ PNETBENCH_LINK pLink,
+    _In_  ULONG RateMbits
+)
+{
+    ZeroMemory(pLink, sizeof(*pLink));
+    pLink->Tun[0] = pLink->Tun[1] = -1;
+    pLink->Namespace[0] = pLink->Namespace[1] = -1;
+    pLink->RateMbits = RateMbits;
+    pLink->Random = NETBENCH_BENCH_SEED;
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        pLink->Queues[i].Packets = (PNETBENCH_PACKET)malloc(NETBENCH_LINK_LIMIT * sizeof(NETBENCH_PACKET));
+        if (pLink->Queues[i].Packets == NULL || !NetBenchOpenLinkEnd(pLink, i))
+        {
+            return FALSE;
+        }
+    }
+
+    pLink->Running = TRUE;
+    pLink->Thread = CreateThread(NULL, 0, NetBenchLinkThread, pLink, 0, NULL);
+    return pLink->Thread != NULL;
+}
+
+static
+VOID
+NetBenchCloseLink(
+    _Inout_ PNETBENCH_LINK pLink
+)
+{
+    if (pLink->Thread != NULL)
+    {
+        pLink->Running = FALSE;
+        WaitForSingleObject(pLink->Thread, INFINITE);
+        CloseHandle(pLink->Thread);
+    }
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        if (pLink->Tun[i] >= 0)
+        {
+            close(pLink->Tun[i]);
+        }
+
+        if (pLink->Namespace[i] >= 0)
+        {
+            close(pLink->Namespace[i]);
+        }
+
+        free(pLink->Queues[i].Packets);
+    }
+}
+
+/**
+* Output routine of a RUDP end, the datagram type in front of the payload.
+*/
+static
+VOID
+NetBenchRudpOutput(
+    _In_ PVOID Context,
+    _In_ DATAGRAM_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    PNETBENCH_RUDP_END pEnd = (PNETBENCH_RUDP_END)Context;
+    CHAR Datagram[1 + PROTOCOL_MAX_PAYLOAD_SIZE];
+
+    Datagram[0] = (CHAR)Type;
+    memcpy(Datagram + 1, Payload, Length);
+    sendto(pEnd->Socket, Datagram, 1 + Length, 0, (struct sockaddr*)&pEnd->Peer, sizeof(pEnd->Peer));
+}
+
+static
+VOID
+NetBenchRudpDeliver(
+    _In_ PVOID Context,
+    _In_ UINT8 StreamId,
+    _In_ const VOID* Data,
+    _In_ UINT16 Length
+)
+{
+    PNETBENCH_RUDP_END pEnd = (PNETBENCH_RUDP_END)Context;
+
+    (void)StreamId;
+    (void)Data;
+
+    InterlockedExchangeAdd64(&pEnd->Delivered, Length);
+}
+
+/**
+* Receives the datagrams of a RUDP end and runs its timers, like the peer session's receive thread.
+*/
+static
+DWORD
+WINAPI
+NetBenchRudpThread(
+    _In_ LPVOID lpData
+)
+{
+    PNETBENCH_RUDP_END pEnd = (PNETBENCH_RUDP_END)lpData;
+    CHAR Datagram[1 + PROTOCOL_MAX_PAYLOAD_SIZE];
+
+    while (pEnd->Running)
+    {
+        DWORD Timeout = min(RudpTick(&pEnd->Connection), RUDP_TICK_INTERVAL);
+
+        if (!NetWaitReadable(pEnd->Socket, Timeout))
+        {
+            continue;
+        }
+
+        INT Received = recv(pEnd->Socket, Datagram, sizeof(Datagram), 0);
+        if (Received > 1)
+        {
+            RudpInput(&pEnd->Connection, (DATAGRAM_TYPE)(UINT8)Datagram[0], Datagram + 1, (UINT16)(Received - 1));
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Sends Size bytes over a new RUDP connection across the link.
+*
+* @return Seconds until the other end had them all, negative if it did not in time.
+*/
+static
+double
+NetBenchRunRudp(
+    _Inout_ PNETBENCH_LINK pLink,
+    _In_    UINT64 Size,
+    _Out_   UINT64* pRetransmissions
+)
+{
+    NETBENCH_RUDP_END Ends[2];
+    CHAR Segment[RUDP_MAX_SEGMENT];
+    double Seconds = -1.0;
+
+    ZeroMemory(Ends, sizeof(Ends));
+    ZeroMemory(Segment, sizeof(Segment));
+    *pRetransmissions = 0;
+
+    BOOL Started = TRUE;
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        Ends[i].Socket = NetBenchLinkSocket(pLink, i, SOCK_DGRAM, IPPROTO_UDP);
+        Started = Started && Ends[i].Socket != INVALID_SOCKET;
+    }
+
+    for (ULONG i = 0; i < 2 && Started; ++i)
+    {
+        socklen_t AddressSize = sizeof(Ends[i].Peer);
+        Started = getsockname(Ends[1 - i].Socket, (struct sockaddr*)&Ends[i].Peer, &AddressSize) == 0 &&
+                  RudpInitialise(&Ends[i].Connection, NetBenchRudpOutput, NetBenchRudpDeliver, &Ends[i]);
+
+        Ends[i].Running = Started;
+        Ends[i].Thread = Started ? CreateThread(NULL, 0, NetBenchRudpThread, &Ends[i], 0, NULL) : NULL;
+        Started = Started && Ends[i].Thread != NULL;
+    }
+
+    if (Started)
+    {
+        INT64 Start = NetBenchNow();
+        ULONGLONG Deadline = GetTickCount64() + NETBENCH_IMPAIR_TIMEOUT;
+        UINT64 Sent = 0;
+
+        // the send window fills up, the receive thread makes room as acknowledgements arrive
+        while (Sent < Size && GetTickCount64() < Deadline)
+        {
+            UINT16 Length = (UINT16)min((UINT64)RUDP_MAX_SEGMENT, Size - Sent);
+            if (RudpSend(&Ends[0].Connection, NETBENCH_RUDP_STREAM, Segment, Length))
+            {
+                Sent += Length;
+            }
+            else
+            {
+                Sleep(1);
+            }
+        }
+
+        while ((UINT64)Ends[1].Delivered < Size && GetTickCount64() < Deadline)
+        {
+            Sleep(1);
+        }
+
+        if ((UINT64)Ends[1].Delivered == Size)
+        {
+            Seconds = NetBenchSeconds(Start, NetBenchNow());
+        }
+
+        *pRetransmissions = Ends[0].Connection.Retransmissions;
+    }
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        if (Ends[i].Thread != NULL)
+        {
+            Ends[i].Running = FALSE;
+            WaitForSingleObject(Ends[i].Thread, INFINITE);
+            CloseHandle(Ends[i].Thread);
+            RudpCleanUp(&Ends[i].Connection);
+        }
+
+        if (Ends[i].Socket != INVALID_SOCKET)
+        {
+            closesocket(Ends[i].Socket);
+        }
+    }
+
+    return Seconds;
+}
+
+/**
+* Reads a TCP connection until everything sent on it arrived.
+*/
+static
+DWORD
+WINAPI
+NetBenchStreamThread(
+    _In_ LPVOID lpData
+)
+{
+    PNETBENCH_STREAM_END pEnd = (PNETBENCH_STREAM_END)lpData;
+    CHAR* Buffer = (CHAR*)malloc(NETBENCH_RAW_BUFFER);
+    INT Length;
+
+    while (Buffer != NULL && (UINT64)pEnd->Received < pEnd->Expected &&
+           (Length = recv(pEnd->Socket, Buffer, NETBENCH_RAW_BUFFER, 0)) > 0)
+    {
+        InterlockedExchangeAdd64(&pEnd->Received, Length);
+    }
+
+    free(Buffer);
+    return 0;
+}
+
+/**
+* Sends Size bytes over a new TCP connection across the link.
+*
+* @return Seconds until the other end had them all, negative if it did not in time.
+*/
+static
+double
+NetBenchRunTcp(
+    _Inout_ PNETBENCH_LINK pLink,
+    _In_    UINT64 Size
+)
+{
+    NETBENCH_STREAM_END Receiver;
+    struct sockaddr_in Address;
+    socklen_t AddressSize = sizeof(Address);
+    double Seconds = -1.0;
+
+    ZeroMemory(&Receiver, sizeof(Receiver));
+    Receiver.Socket = INVALID_SOCKET;
+    Receiver.Expected = Size;
+
+    SOCKET Listener = NetBenchLinkSocket(pLink, 1, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET Sender = NetBenchLinkSocket(pLink, 0, SOCK_STREAM, IPPROTO_TCP);
+    CHAR* Buffer = (CHAR*)calloc(1, NETBENCH_RAW_BUFFER);
+
+    // the handshake crosses the link like everything else
+    if (Listener != INVALID_SOCKET && Sender != INVALID_SOCKET && Buffer != NULL &&
+        listen(Listener, 1) == 0 &&
+        getsockname(Listener, (struct sockaddr*)&Address, &AddressSize) == 0 &&
+        connect(Sender, (struct sockaddr*)&Address, sizeof(Address)) == 0)
+    {
+        Receiver.Socket = accept(Listener, NULL, NULL);
+    }
+
+    HANDLE Thread = (Receiver.Socket != INVALID_SOCKET) ? CreateThread(NULL, 0, NetBenchStreamThread, &Receiver, 0, NULL) : NULL;
+
+    if (Thread != NULL)
+    {
+        INT64 Start = NetBenchNow();
+
+        struct timeval SendTimeout = { NETBENCH_IMPAIR_TIMEOUT / 1000, 0 };
+        setsockopt(Sender, SOL_SOCKET, SO_SNDTIMEO, &SendTimeout, sizeof(SendTimeout));
+
+        BOOL Sent = TRUE;
+        for (UINT64 Offset = 0; Sent && Offset < Size; Offset += NETBENCH_RAW_BUFFER)
+        {
+            NET_SLICE Slice;
+            Slice.Data = Buffer;
+            Slice.Length = (ULONG)min((UINT64)NETBENCH_RAW_BUFFER, Size - Offset);
+            Sent = NetSendAll(Sender, &Slice, 1);
+        }
+
+        if (WaitForSingleObject(Thread, NETBENCH_IMPAIR_TIMEOUT) == WAIT_OBJECT_0 && (UINT64)Receiver.Received == Size)
+        {
+            Seconds = NetBenchSeconds(Start, NetBenchNow());
+        }
+    }
+
+    // closing the sockets ends a receiver still waiting
+    if (Sender != INVALID_SOCKET)
+    {
+        closesocket(Sender);
+    }
+
+    if (Receiver.Socket != INVALID_SOCKET)
+    {
+        shutdown(Receiver.Socket, SD_BOTH);
+    }
+
+    if (Thread != NULL)
+    {
+        WaitForSingleObject(Thread, INFINITE);
+        CloseHandle(Thread);
+    }
+
+    if (Receiver.Socket != INVALID_SOCKET)
+    {
+        closesocket(Receiver.Socket);
+    }
+
+    if (Listener != INVALID_SOCKET)
+    {
+        closesocket(Listener);
+    }
+
+    free(Buffer);
+    return Seconds;
+}
+
+/**
+* Waits for the link to hand on whatever the last run left in it.
+*/
+static
+VOID
+NetBenchDrainLink(
+    _In_ PNETBENCH_LINK pLink
+)
+{
+    while (pLink->Queues[0].Count > 0 || pLink->Queues[1].Count > 0)
+    {
+        Sleep(10);
+    }
+}
+
+#endif // __linux__
+
+/**
+* The impairment suite: the same number of bytes sent over RUDP and over TCP across a link of a
+* given rate, clean and under every loss and delay of NetBenchImpairments.
+*/
+static
+INT
+NetBenchImpair(
+    _In_ UINT64 Size,
+    _In_ ULONG RateMbits
+)
+{
+#ifdef __linux__
+    NETBENCH_LINK Link;
+    BOOL Succeeded = TRUE;
+
+    if (!NetBenchOpenLink(&Link, RateMbits))
+    {
+        NetBenchCloseLink(&Link);
+        return 1;
+    }
+
+    printf("%.1f MB each run over a %lu Mbit/s link, RUDP window %u segments of %u bytes\n",
+           Size / 1e6, (unsigned long)RateMbits, RUDP_WINDOW, (UINT32)RUDP_MAX_SEGMENT);
+    printf("loss  delay      RUDP   retransmitted       TCP\n");
+
+    for (ULONG i = 0; i < ARRAYSIZE(NetBenchImpairments); ++i)
+    {
+        // the link is only changed while nothing crosses it
+        NetBenchDrainLink(&Link);
+        Link.LossPercent = NetBenchImpairments[i].LossPercent;
+        Link.DelayMs = NetBenchImpairments[i].DelayMs;
+
+        UINT64 Retransmissions;
+        double RudpSeconds = NetBenchRunRudp(&Link, Size, &Retransmissions);
+        NetBenchDrainLink(&Link);
+        double TcpSeconds = NetBenchRunTcp(&Link, Size);
+
+        printf("%3lu%%  %3lu ms", (unsigned long)Link.LossPercent, (unsigned long)Link.DelayMs);
+
+        if (RudpSeconds > 0)
+        {
+            printf("  %5.2f MB/s  %8llu segments", Size / 1e6 / RudpSeconds, (unsigned long long)Retransmissions);
+        }
+        else
+        {
+            printf("   timed out  %8s", "");
+        }
+
+        if (TcpSeconds > 0)
+        {
+            printf("  %5.2f MB/s\n", Size / 1e6 / TcpSeconds);
+        }
+        else
+        {
+            printf("   timed out\n");
+        }
+
+        Succeeded = Succeeded && RudpSeconds > 0 && TcpSeconds > 0;
+    }
+
+    NetBenchCloseLink(&Link);
+    return Succeeded ? 0 : 1;
+#else
+    (void)Size;
+    (void)RateMbits;
+
+    printf("The impairment suite needs Linux network namespaces and tun devices\n");
+    return 1;
+#endif
+}
+
+INT
+main(
+    INT argc,
+    PSTR* argv
+)
+{
+    BOOL Transfer = argc >= 3 && _stricmp(argv[1], "transfer") == 0;
+    BOOL Compress = argc >= 2 && _stricmp(argv[1], "compress") == 0;
+    BOOL Corpus = argc >= 3 && _stricmp(argv[1], "corpus") == 0;
+    BOOL Dictionary = argc >= 4 && _stricmp(argv[1], "dictionary") == 0;
+    BOOL MessageSuite = argc >= 2 && _stricmp(argv[1], "messages") == 0;
+    BOOL Flood = argc >= 3 && _stricmp(argv[1], "flood") == 0;
+    BOOL Impair = argc >= 2 && _stricmp(argv[1], "impair") == 0;
+
+    if (!Transfer && !Compress && !Corpus && !Dictionary && !MessageSuite && !Flood && !Impair)
+    {
+        printf(
+            "usage: netbench transfer <file> [server [port]]\n"
+            "       netbench compress [corpus]\n"
+            "       netbench corpus <file> [messages [seed]]\n"
+            "       netbench dictionary <corpus> <netdict.c>\n"
+            "       netbench messages\n"
+            "       netbench flood <server> [port]\n"
+            "       netbench impair [bytes [Mbit/s]]\n"
+        );
+        return 1;
+    }
+
+    if (Compress)
+    {
+        return NetBenchCompress(( argc > 2 ) ? argv[2] : NULL);
+    }
+
+    if (Corpus)
+    {
+        ULONG Messages = ( argc > 3 ) ? strtoul(argv[3], NULL, 10) : NETBENCH_CORPUS_MESSAGES;
+        UINT64 Seed = ( argc > 4 ) ? strtoull(argv[4], NULL, 10) : NETBENCH_TRAIN_SEED;
+        return NetBenchWriteCorpus(argv[2], Messages, Seed);
+    }
+
+    if (Dictionary)
+    {
+        return NetBenchTrain(argv[2], argv[3]);
+    }
+
+    if (MessageSuite)
+    {
+        return NetBenchMessages();
+    }
+
+    if (!InitWinSock())
+    {
+        printf("Failed to initialise sockets\n");
+        return 1;
+    }
+
+    if (LoggerInitConsole(stdout) != 0)
+    {
+        printf("Failed to initialise logger\n");
+        CleanUpWinSock();
+        return 1;
+    }
+
+    LoggerSetLevel(LOG_LEVEL_WARN);
+
+    INT Result;
+    if (Flood)
+    {
+        Result = NetBenchFlood(argv[2], ( argc > 3 ) ? argv[3] : NETBENCH_DEFAULT_PORT);
+    }
+    else if (Impair)
+    {
+        UINT64 Size = ( argc > 2 ) ? strtoull(argv[2], NULL, 10) : NETBENCH_IMPAIR_SIZE;
+        ULONG RateMbits = ( argc > 3 ) ? strtoul(argv[3], NULL, 10) : NETBENCH_IMPAIR_RATE;
+        Result = NetBenchImpair(max(Size, 1), max(RateMbits, 1));
+    }
+    else
+    {
+        Result = NetBenchTransfer(argv[2], ( argc > 3 ) ? argv[3] : NULL, ( argc > 4 ) ? argv[4] : NETBENCH_DEFAULT_PORT);
+    }
+
+    LoggerCleanUp();
+    CleanUpWinSock();
+    return Result;
+}
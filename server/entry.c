@@ -1,27 +1,269 @@
-#include "winnet.h"
+#define _CRT_RAND_S // rand_s for client and session tokens
+
+#include "netmux.h"
+#include "netlimit.h"
+#include "message.h"
+
+#include <stdlib.h>
 
 #define DEFAULT_IP  "0.0.0.0"
 #define DEFAULT_PORT 5050
 #define MAX_BUFFER_SIZE 1024
-#define MAX_CLIENTS 10 
+#define CLIENT_SLOT_BITS 17
+#define MAX_CLIENTS (1 << CLIENT_SLOT_BITS) // clients connected at once, each in the table slot its id selects
+#define CLIENT_SLOT(ClientId) ((ClientId) & (MAX_CLIENTS - 1))
+#define CLIENT_IDLE_TIMEOUT 30000           // milliseconds without data before a client is dropped
+#define MAX_WORKERS 16
+#define WORKER_SWEEP_INTERVAL 1000          // milliseconds a worker waits before looking for idle clients
+#define WORKER_EVENT_BATCH 64
+#define WORKER_FRAME_BUDGET 64              // frames a client is served before the worker's other clients get a turn
+#define COMPRESSION_VARIABLE "P2PCHAT_COMPRESSION" // "block" or "dictionary" offers clients frame compression, off otherwise
+#define CLIENT_LIMIT_VARIABLE "P2PCHAT_CLIENT_LIMIT"   // "<messages> <bytes>" a second each client may send, 0 for no limit
+#define ADDRESS_LIMIT_VARIABLE "P2PCHAT_ADDRESS_LIMIT" // the same for all the clients of one address together
+#define LIMIT_ACTION_VARIABLE "P2PCHAT_LIMIT_ACTION"   // "delay", "drop" or "disconnect", what a client over a limit gets, delay otherwise
+#define DEFAULT_CLIENT_MESSAGES 50
+#define DEFAULT_CLIENT_BYTES (32 * 1024 * 1024)
+#define DEFAULT_ADDRESS_MESSAGES 200
+#define DEFAULT_ADDRESS_BYTES (128 * 1024 * 1024)
+#define LIMIT_MAX_DELAY 1000                // milliseconds a client's reads are paused for at most before it is looked at again
+#define LIMIT_REPORT_INTERVAL 10000         // milliseconds between reports of how often the limits fired
+
+typedef enum _LIMIT_ACTION
+{
+    LIMIT_DELAY = 0,                   // stop reading from the client until it is within its limits again
+    LIMIT_DROP,                        // read what is over the limits and throw it away
+    LIMIT_DISCONNECT,
+    LIMIT_ACTIONS
+} LIMIT_ACTION;
+
+typedef struct _WORKER WORKER, * PWORKER;
 
 typedef struct _CLIENT_INFO
 {
     SOCKET SocketHandle;
     struct sockaddr_in Address;
     CHAR IpAddress[INET_ADDRSTRLEN];
-    BOOL ThreadStarted;  // Add flag to ensure thread has started
+
+    volatile LONG References;          // worker plus any thread currently sending to this client
+    NET_MUX Mux;                       // streams of the connection, frames from the relay and from our own worker queue here
+    UINT32 ClientId;
+    UINT32 Token;                      // proves ownership of ClientId in UDP registrations
+
+    // receive state, touched only by the worker serving the client
+    PWORKER Worker;
+    NET_READ_BUFFER Received;          // holds chunks only while a frame is partly received
+    ULONGLONG LastActivity;            // tick count of the last receive
+    struct _CLIENT_INFO* Older;        // neighbours in the worker's activity list
+    struct _CLIENT_INFO* Newer;
+
+    // rendezvous state, guarded by the client table lock
+    BOOL UdpRegistered;
+    struct sockaddr_in UdpAddress;     // public UDP endpoint observed by the rendezvous socket
+    struct sockaddr_in PrivateAddress; // UDP endpoint the client reported for its LAN
+    UINT32 PeerId;                     // client we relay chat to, 0 if not paired
+
+    UINT32 Capabilities;               // PROTOCOL_CAPABILITY_* the client took up, touched only by its worker
+    UINT16 LeaveReason;                // MESSAGE_LEAVE_* its peer is told once the client is cleaned up
+
+    // rate limits, touched only by the worker serving the client
+    NET_RATES Rates;                   // what the client sent against its own limits
+    PNET_LIMIT_SENDER Sender;          // what every client of its address sent, NULL if the address table was too full
+    BOOL Paused;                       // out of the poller until ResumeAt
+    ULONGLONG ResumeAt;
+    struct _CLIENT_INFO* NextPaused;   // in the worker's paused list
+    ULONG Limited;                     // frames a limit fired for
 } CLIENT_INFO, * PCLIENT_INFO;
 
 /**
- * Client thread function
+ * A thread serving clients through its own poller. The listening socket is in every worker's
+ * poller, the worker that accepts a connection serves it until it closes.
+ */
+struct _WORKER
+{
+    HANDLE Thread;
+    SOCKET ServerSocket;
+    PNET_POLLER Poller;
+    NET_CHUNK_POOL Chunks;             // receive chunks of this worker's clients
+    PCLIENT_INFO Oldest;               // clients in order of their last receive, idle ones first
+    PCLIENT_INFO Newest;
+    PCLIENT_INFO Paused;               // clients whose reads are paused, in no order
+    volatile ULONGLONG Fired[LIMIT_ACTIONS]; // times each LIMIT_ACTION was taken, written only by the worker
+    CHAR Scratch[PROTOCOL_MAX_BULK_PAYLOAD_SIZE]; // only for a frame split over two chunks
+    CHAR Expanded[PROTOCOL_MAX_PAYLOAD_SIZE];     // the original of a compressed frame
+};
+
+typedef struct _CLIENT_TABLE
+{
+    CRITICAL_SECTION Lock;
+    PCLIENT_INFO Clients[MAX_CLIENTS];
+    UINT32 Count;
+    UINT32 NextClientId;
+} CLIENT_TABLE, * PCLIENT_TABLE;
+
+/**
+ * Limits every client is held to, and the buckets of the addresses they connect from, shared by
+ * the workers without a lock
+ */
+typedef struct _RATE_LIMITER
+{
+    NET_LIMITS Client;
+    NET_LIMITS Address;
+    LIMIT_ACTION Action;               // taken for chat and presence over their message limit, everything else is delayed
+    NET_LIMIT_TABLE Senders;
+    volatile LONG64 ReportAt;          // tick count the next report is due at, taken by one worker
+    ULONGLONG Reported[LIMIT_ACTIONS]; // totals of the last report, touched only by the worker reporting
+} RATE_LIMITER, * PRATE_LIMITER;
+
+static CLIENT_TABLE GlobalClientTable = { 0 };
+static WORKER GlobalWorkers[MAX_WORKERS];
+static UINT32 GlobalCapabilities = 0;  // PROTOCOL_CAPABILITY_* offered in every handshake
+static RATE_LIMITER GlobalLimiter = { 0 };
+
+/**
+ * Worker thread function, serves the clients it accepts until its poller fails
  */
 DWORD
 WINAPI
-ClientThread(
+WorkerThread(
     _In_ LPVOID lpData
 );
 
+/**
+ * Prepare a worker's poller and chunk pool and start its thread
+ */
+BOOL
+StartWorker(
+    _In_ PWORKER Worker,
+    _In_ SOCKET ServerSocket
+);
+
+/**
+ * Drains the rendezvous socket, recording the public UDP endpoint of every registering client.
+ * FALSE if the socket failed.
+ */
+BOOL
+ReceiveRendezvous(
+    _In_ SOCKET RendezvousSocket
+);
+
+/**
+ * Accepts a waiting connection, unless another worker was first, and serves it from this worker
+ */
+VOID
+AcceptClient(
+    _In_ PWORKER Worker
+);
+
+/**
+ * Receive and handle every whole frame a readable client has sent, cleaning it up if it is gone
+ */
+VOID
+ServeClient(
+    _In_ PWORKER Worker,
+    _In_ PCLIENT_INFO pClientInfo
+);
+
+/**
+ * Handle one frame from a client, FALSE if the client is to be disconnected
+ */
+BOOL
+HandleFrame(
+    _In_ PCLIENT_INFO pClientInfo,
+    _In_ UINT16 StreamId,
+    _In_ UINT16 Type,
+    _In_ const CHAR* Payload,
+    _In_ UINT16 Length
+);
+
+/**
+ * Hand a frame on a bulk stream to the paired peer as it is, FALSE if the client is to be disconnected
+ */
+BOOL
+RelayBulkFrame(
+    _In_ PCLIENT_INFO pClientInfo,
+    _In_ UINT16 StreamId,
+    _In_ UINT16 Type,
+    _In_ const CHAR* Payload,
+    _In_ UINT16 Length
+);
+
+/**
+ * Tell a client its peer left and why, giving back the window of the bulk frames the peer never consumed
+ */
+VOID
+NotifyPeerGone(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT32 PeerId,
+    _In_ UINT16 Reason
+);
+
+/**
+ * Disconnect the worker's clients that have not sent anything for CLIENT_IDLE_TIMEOUT
+ */
+VOID
+SweepIdleClients(
+    _In_ PWORKER Worker
+);
+
+/**
+ * Take a client out of its worker's poller for a while, what it sends waits in its socket
+ */
+VOID
+PauseClient(
+    _In_ PWORKER Worker,
+    _In_ PCLIENT_INFO pClient,
+    _In_ DWORD Milliseconds
+);
+
+/**
+ * Put the worker's paused clients that are due back in its poller and serve what they have buffered
+ */
+VOID
+ResumeClients(
+    _In_ PWORKER Worker
+);
+
+/**
+ * Take a frame from the buckets of a client and of its address, from both or neither. 0 if taken,
+ * otherwise the nanoseconds until it can be.
+ */
+LONG64
+TakeLimits(
+    _In_ PCLIENT_INFO pClient,
+    _In_ ULONG Messages,
+    _In_ ULONG Bytes,
+    _In_ LONG64 Now
+);
+
+/**
+ * Give back to the buckets of a client and of its address what TakeLimits took
+ */
+VOID
+GiveBackLimits(
+    _In_ PCLIENT_INFO pClient,
+    _In_ ULONG Messages,
+    _In_ ULONG Bytes
+);
+
+/**
+ * Print how often the limits fired since the last report, from whichever worker finds it due
+ */
+VOID
+ReportLimits(
+    VOID
+);
+
+/**
+ * Read a limit from the environment, a second's worth may come at once
+ */
+VOID
+ReadLimits(
+    _In_  PCSTR Variable,
+    _Out_ PNET_LIMITS Limits,
+    _In_  ULONG Messages,
+    _In_  ULONG Bytes
+);
+
 /**
  * Initialize server socket
  */
@@ -32,19 +274,107 @@ InitialiseServer(
 );
 
 /**
- * Clean up client resources
+ * Initialize the UDP socket used to observe clients' public UDP endpoints
+ */
+BOOL
+InitialiseRendezvous(
+    _In_ SOCKET* pRendezvousSocket,
+    _In_ INT Port
+);
+
+/**
+ * Clean up client resources, on the client's worker
  */
 VOID
 CleanUpClient(
     _In_ PCLIENT_INFO pClient
 );
 
+/**
+ * Send the handshake frame telling the client which address and port we observed it connect from
+ */
+BOOL
+SendHandshake(
+    _In_ PCLIENT_INFO pClient
+);
+
+/**
+ * Send a single frame to a client on one of its streams, safe to call from any thread holding a reference
+ */
+BOOL
+SendFrame(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT16 StreamId,
+    _In_ MESSAGE_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+);
+
+/**
+ * Tell a client what the server refused, TRUE if the error was queued
+ */
+BOOL
+SendError(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT16 Code,
+    _In_ UINT16 Type,
+    _In_ PCSTR Description
+);
+
+/**
+ * Add a client to the client table, assigning its id and token
+ */
+BOOL
+RegisterClient(
+    _In_ PCLIENT_INFO pClient
+);
+
+/**
+ * Look up a client by id and take a reference on it, NULL if not connected
+ */
+PCLIENT_INFO
+AcquireClient(
+    _In_ UINT32 ClientId
+);
+
+/**
+ * Drop a reference taken by AcquireClient or held by the client's worker
+ */
+VOID
+ReleaseClient(
+    _In_ PCLIENT_INFO pClient
+);
+
+/**
+ * Unpair the client a client is paired with, if it is paired back, for the client to pair with another
+ * Called with the client table locked, the partner returned is referenced
+ */
+PCLIENT_INFO
+UnpairPartner(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT32 NewPeerId
+);
+
+/**
+ * Introduce two clients to each other so they can hole punch
+ */
+VOID
+HandlePeerConnect(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT32 PeerId
+);
+
 INT main(
-    VOID
+    INT   argc,
+    PSTR* argv
 )
 {
-    PCSTR ServerIp = DEFAULT_IP;
-    INT ServerPort = DEFAULT_PORT;
+    INT ServerPort = ( argc > 1 ) ? atoi(argv[1]) : DEFAULT_PORT;
+    if (ServerPort <= 0 || ServerPort > 65535)
+    {
+        printf("usage: server [port]\n");
+        return -1;
+    }
 
     if (!InitWinSock())
     {
@@ -52,6 +382,39 @@ INT main(
         return -1;
     }
 
+    InitializeCriticalSection(&GlobalClientTable.Lock);
+
+    CHAR Compression[16];
+    DWORD CompressionSize = GetEnvironmentVariableA(COMPRESSION_VARIABLE, Compression, sizeof(Compression));
+    if (CompressionSize > 0 && CompressionSize < sizeof(Compression))
+    {
+        if (_stricmp(Compression, "dictionary") == 0)
+        {
+            GlobalCapabilities = PROTOCOL_CAPABILITY_COMPRESSION | PROTOCOL_CAPABILITY_DICTIONARY;
+        }
+        else if (_stricmp(Compression, "block") == 0)
+        {
+            GlobalCapabilities = PROTOCOL_CAPABILITY_COMPRESSION;
+        }
+    }
+
+    ReadLimits(CLIENT_LIMIT_VARIABLE, &GlobalLimiter.Client, DEFAULT_CLIENT_MESSAGES, DEFAULT_CLIENT_BYTES);
+    ReadLimits(ADDRESS_LIMIT_VARIABLE, &GlobalLimiter.Address, DEFAULT_ADDRESS_MESSAGES, DEFAULT_ADDRESS_BYTES);
+
+    CHAR Action[16];
+    DWORD ActionSize = GetEnvironmentVariableA(LIMIT_ACTION_VARIABLE, Action, sizeof(Action));
+    if (ActionSize > 0 && ActionSize < sizeof(Action))
+    {
+        if (_stricmp(Action, "drop") == 0)
+        {
+            GlobalLimiter.Action = LIMIT_DROP;
+        }
+        else if (_stricmp(Action, "disconnect") == 0)
+        {
+            GlobalLimiter.Action = LIMIT_DISCONNECT;
+        }
+    }
+
     SOCKET ServerSocket = INVALID_SOCKET;
     if (!InitialiseServer(&ServerSocket, ServerPort))
     {
@@ -59,72 +422,65 @@ INT main(
         return -1;
     }
 
-    printf("Server initialised. Listening on port %d...\n", ServerPort);
-
-    while (TRUE)
+    SOCKET RendezvousSocket = INVALID_SOCKET;
+    if (!InitialiseRendezvous(&RendezvousSocket, ServerPort))
     {
-        SOCKET ClientSocket;
-        struct sockaddr_in ClientAddress;
-        INT ClientSize = sizeof(ClientAddress);
+        closesocket(ServerSocket);
+        CleanUpWinSock();
+        return -1;
+    }
 
-        printf("Waiting for client connection...\n");
-        ClientSocket = accept(ServerSocket, (struct sockaddr*)&ClientAddress, &ClientSize);
-        if (ClientSocket == INVALID_SOCKET)
-        {
-            INT error = WSAGetLastError();
-            printf("Accepting client socket failed: %d\n", error);
-            continue;
-        }
+    // one worker per processor serves the relay, a thread per client would keep a stack per idle connection
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
 
-        printf("Client socket accepted, creating client info...\n");
+    DWORD WorkerCount = min(max(SystemInfo.dwNumberOfProcessors, 1), MAX_WORKERS);
+    DWORD Started = 0;
 
-        PCLIENT_INFO pClientInfo = (PCLIENT_INFO)malloc(sizeof(CLIENT_INFO));
-        if (pClientInfo == NULL)
-        {
-            printf("Allocation memory for client information has failed\n");
-            closesocket(ClientSocket);
-            continue;
-        }
+    while (Started < WorkerCount && StartWorker(&GlobalWorkers[Started], ServerSocket))
+    {
+        ++Started;
+    }
+
+    if (Started == 0)
+    {
+        printf("Unable to start a worker: %d\n", WSAGetLastError());
+        closesocket(RendezvousSocket);
+        closesocket(ServerSocket);
+        CleanUpWinSock();
+        return -1;
+    }
 
-        memset(pClientInfo, 0, sizeof(CLIENT_INFO));
-        pClientInfo->SocketHandle = ClientSocket;
-        pClientInfo->Address = ClientAddress;
-        pClientInfo->ThreadStarted = FALSE;
+    printf("Server initialised. Listening on port %d with %u workers (TCP relay, UDP rendezvous)...\n", ServerPort, Started);
+    if (GlobalCapabilities != 0)
+    {
+        printf("Offering %s compression of chat frames\n", (GlobalCapabilities & PROTOCOL_CAPABILITY_DICTIONARY) ? "dictionary" : "block");
+    }
 
-        // convert IP address to string
-        if (inet_ntop(AF_INET, &(ClientAddress.sin_addr), pClientInfo->IpAddress, INET_ADDRSTRLEN) == NULL)
-        {
-            printf("Failed to convert IP address\n");
-            strcpy_s(pClientInfo->IpAddress, INET_ADDRSTRLEN, "Unknown");
-        }
+    static const PCSTR ActionNames[LIMIT_ACTIONS] = { "delayed", "dropped", "disconnected" };
+    printf("Clients limited to %lu messages and %lu bytes a second each, %lu and %lu per address, %s beyond (0 is no limit)\n",
+        (unsigned long)GlobalLimiter.Client.Messages.Rate, (unsigned long)GlobalLimiter.Client.Bytes.Rate,
+        (unsigned long)GlobalLimiter.Address.Messages.Rate, (unsigned long)GlobalLimiter.Address.Bytes.Rate,
+        ActionNames[GlobalLimiter.Action]);
 
-        printf("Client connected from %s\n", pClientInfo->IpAddress);
+    // this thread serves the rendezvous socket
+    while (NetWaitReadable(RendezvousSocket, INFINITE) && ReceiveRendezvous(RendezvousSocket))
+    {
+    }
 
-        HANDLE hClientThread = CreateThread(
-            NULL,
-            0,
-            ClientThread,
-            (LPVOID)pClientInfo,
-            0,
-            NULL
-        );
+    printf("Rendezvous stopped, the relay keeps working without hole punching\n");
 
-        if (hClientThread == NULL)
-        {
-            printf("Unable to create client thread: %d\n", GetLastError());
-            free(pClientInfo);
-            closesocket(ClientSocket);
-        }
-        else
-        {
-            printf("Client thread created successfully\n");
-            // hacky, giving it a little bit of time before closing the handle
-            Sleep(10);
-            CloseHandle(hClientThread);
-        }
+    for (DWORD i = 0; i < Started; ++i)
+    {
+        WaitForSingleObject(GlobalWorkers[i].Thread, INFINITE);
+        CloseHandle(GlobalWorkers[i].Thread);
+        NetPollerDestroy(GlobalWorkers[i].Poller);
+        NetChunkPoolCleanUp(&GlobalWorkers[i].Chunks);
     }
 
+    closesocket(RendezvousSocket);
     closesocket(ServerSocket);
+    DeleteCriticalSection(&GlobalClientTable.Lock);
     CleanUpWinSock();
     return 0;
 }
@@ -175,110 +531,1121 @@ InitialiseServer(
         return FALSE;
     }
 
+    // accepted only once the poller reports a connection, one the client already gave up on must not block
+    if (!NetSetNonBlocking(*pServerSocket, TRUE))
+    {
+        printf("Cannot make server socket non-blocking: %d\n", WSAGetLastError());
+        closesocket(*pServerSocket);
+        return FALSE;
+    }
+
     return TRUE;
 }
 
-DWORD
-WINAPI
-ClientThread(
-    _In_ LPVOID lpData
+BOOL
+InitialiseRendezvous(
+    _In_ SOCKET* pRendezvousSocket,
+    _In_ INT Port
 )
 {
-    PCLIENT_INFO pClientInfo = (PCLIENT_INFO)lpData;
+    printf("Creating rendezvous socket...\n");
+    *pRendezvousSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (*pRendezvousSocket == INVALID_SOCKET)
+    {
+        printf("Unable to create rendezvous socket: %d\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    struct sockaddr_in RendezvousAddress;
+    ZeroMemory(&RendezvousAddress, sizeof(RendezvousAddress));
+    RendezvousAddress.sin_family = AF_INET;
+    RendezvousAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    RendezvousAddress.sin_port = htons((u_short)Port);
+
+    if (bind(*pRendezvousSocket, (struct sockaddr*)&RendezvousAddress, sizeof(RendezvousAddress)) == SOCKET_ERROR)
+    {
+        printf("Cannot bind rendezvous socket to port %d: %d\n", Port, WSAGetLastError());
+        closesocket(*pRendezvousSocket);
+        return FALSE;
+    }
 
-    if ( !pClientInfo )
+    if (!NetSetNonBlocking(*pRendezvousSocket, TRUE))
     {
-        printf("ERROR: ClientThread received NULL client info\n");
-        return 1;
+        printf("Cannot make rendezvous socket non-blocking: %d\n", WSAGetLastError());
+        closesocket(*pRendezvousSocket);
+        return FALSE;
     }
 
-    // Mark that the thread has started
-    pClientInfo->ThreadStarted = TRUE;
+    return TRUE;
+}
 
-    printf("Client thread started for %s...\n", pClientInfo->IpAddress);
+//////////////////////////////////////////
+//
+//          WORKERS
+//
+//////////////////////////////////////////
 
-    CHAR RecvBuffer[MAX_BUFFER_SIZE];
-    INT BytesReceived;
-    BOOL Connected = TRUE;
+BOOL
+StartWorker(
+    _In_ PWORKER Worker,
+    _In_ SOCKET ServerSocket
+)
+{
+    ZeroMemory(Worker, sizeof(*Worker));
+    Worker->ServerSocket = ServerSocket;
 
-    // Set socket timeout 
-    DWORD Timeout = 30000; // 30 seconds
-    if (setsockopt(pClientInfo->SocketHandle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout)) == SOCKET_ERROR)
+    Worker->Poller = NetPollerCreate();
+    if (Worker->Poller == NULL)
     {
-        printf("Warning: Failed to set socket timeout for %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
+        return FALSE;
     }
 
-    printf("Starting message loop for client %s...\n", pClientInfo->IpAddress);
-
-    while (Connected)
+    // the listener's context is NULL, every client's is its CLIENT_INFO
+    if (!NetPollerAdd(Worker->Poller, ServerSocket, NET_POLL_READ, NULL))
     {
-        ZeroMemory(RecvBuffer, sizeof(RecvBuffer));
+        NetPollerDestroy(Worker->Poller);
+        return FALSE;
+    }
 
-        BytesReceived = recv(pClientInfo->SocketHandle, RecvBuffer, sizeof(RecvBuffer) - 1, 0);
+    NetChunkPoolInitialise(&Worker->Chunks, NET_CHUNK_POOL_DEFAULT);
 
-        if (BytesReceived > 0)
-        {
-            RecvBuffer[BytesReceived] = '\0';
-            printf("Received '%s' from %s\n", RecvBuffer, pClientInfo->IpAddress);
+    Worker->Thread = CreateThread(
+        NULL,
+        0,
+        WorkerThread,
+        (LPVOID)Worker,
+        0,
+        NULL
+    );
 
-            // Check for quit command
-            if (_stricmp(RecvBuffer, "quit") == 0 || _stricmp(RecvBuffer, "exit") == 0)
-            {
-                printf("Client %s requested disconnect\n", pClientInfo->IpAddress);
-                Connected = FALSE;
-                continue;
-            }
+    if (Worker->Thread == NULL)
+    {
+        NetChunkPoolCleanUp(&Worker->Chunks);
+        NetPollerDestroy(Worker->Poller);
+        return FALSE;
+    }
 
-            // Echo the message back
-            INT TotalBytesSent = 0;
-            INT BytesToSend = BytesReceived;
+    return TRUE;
+}
 
-            while (TotalBytesSent < BytesToSend)
-            {
-                INT BytesSent = send(
-                    pClientInfo->SocketHandle,
-                    RecvBuffer + TotalBytesSent,
-                    BytesToSend - TotalBytesSent,
-                    0
-                );
-
-                if (BytesSent == SOCKET_ERROR)
-                {
-                    printf("Error sending to %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
-                    Connected = FALSE;
-                    break;
-                }
+DWORD
+WINAPI
+WorkerThread(
+    _In_ LPVOID lpData
+)
+{
+    PWORKER Worker = (PWORKER)lpData;
+    NET_POLL_EVENT Events[WORKER_EVENT_BATCH];
 
-                TotalBytesSent += BytesSent;
-            }
+    while (TRUE)
+    {
+        // a paused client is resumed in time however quiet the others are
+        DWORD Wait = WORKER_SWEEP_INTERVAL;
+        ULONGLONG Now = GetTickCount64();
+        for (PCLIENT_INFO pPaused = Worker->Paused; pPaused != NULL; pPaused = pPaused->NextPaused)
+        {
+            Wait = (pPaused->ResumeAt > Now) ? (DWORD)min(Wait, pPaused->ResumeAt - Now) : 0;
         }
-        else if (BytesReceived == 0)
+
+        INT Ready = NetPollerWait(Worker->Poller, Events, ARRAYSIZE(Events), Wait);
+        if (Ready < 0)
         {
-            printf("Client %s disconnected gracefully\n", pClientInfo->IpAddress);
-            Connected = FALSE;
+            printf("Worker failed waiting on its sockets: %d\n", WSAGetLastError());
+            break;
         }
-        else
+
+        for (INT i = 0; i < Ready; ++i)
         {
-            INT Error = WSAGetLastError();
-            if (Error == WSAETIMEDOUT)
-            {
-                printf("Connection to %s timed out\n", pClientInfo->IpAddress);
-            }
-            else if (Error == WSAECONNRESET)
+            PCLIENT_INFO pClientInfo = (PCLIENT_INFO)Events[i].Context;
+            if (pClientInfo == NULL)
             {
-                printf("Connection to %s was reset\n", pClientInfo->IpAddress);
+                AcceptClient(Worker);
             }
             else
             {
-                printf("Error receiving data from %s: %d\n", pClientInfo->IpAddress, Error);
+                ServeClient(Worker, pClientInfo);
             }
-            Connected = FALSE;
         }
+
+        ResumeClients(Worker);
+        SweepIdleClients(Worker);
+        ReportLimits();
     }
 
-    printf("Client thread ending for %s\n", pClientInfo->IpAddress);
-    CleanUpClient(pClientInfo);
-    return 0;
+    while (Worker->Oldest != NULL)
+    {
+        CleanUpClient(Worker->Oldest);
+    }
+
+    return 1;
+}
+
+/**
+ * Puts a client at the newest end of its worker's activity list
+ */
+static
+VOID
+LinkClient(
+    _In_ PWORKER Worker,
+    _In_ PCLIENT_INFO pClient
+)
+{
+    pClient->Older = Worker->Newest;
+    pClient->Newer = NULL;
+
+    if (Worker->Newest != NULL)
+    {
+        Worker->Newest->Newer = pClient;
+    }
+    else
+    {
+        Worker->Oldest = pClient;
+    }
+
+    Worker->Newest = pClient;
+}
+
+/**
+ * Takes a client out of its worker's activity list
+ */
+static
+VOID
+UnlinkClient(
+    _In_ PWORKER Worker,
+    _In_ PCLIENT_INFO pClient
+)
+{
+    if (pClient->Older != NULL)
+    {
+        pClient->Older->Newer = pClient->Newer;
+    }
+    else if (Worker->Oldest == pClient)
+    {
+        Worker->Oldest = pClient->Newer;
+    }
+
+    if (pClient->Newer != NULL)
+    {
+        pClient->Newer->Older = pClient->Older;
+    }
+    else if (Worker->Newest == pClient)
+    {
+        Worker->Newest = pClient->Older;
+    }
+
+    pClient->Older = NULL;
+    pClient->Newer = NULL;
+}
+
+VOID
+SweepIdleClients(
+    _In_ PWORKER Worker
+)
+{
+    ULONGLONG Now = GetTickCount64();
+
+    // the list is in order of activity, the first client still in time ends the sweep
+    while (Worker->Oldest != NULL && Now - Worker->Oldest->LastActivity >= CLIENT_IDLE_TIMEOUT)
+    {
+        printf("Connection to %s timed out\n", Worker->Oldest->IpAddress);
+        Worker->Oldest->LeaveReason = MESSAGE_LEAVE_TIMEOUT;
+        CleanUpClient(Worker->Oldest);
+    }
+}
+
+VOID
+AcceptClient(
+    _In_ PWORKER Worker
+)
+{
+    SOCKET ClientSocket;
+    struct sockaddr_in ClientAddress;
+    socklen_t ClientSize = sizeof(ClientAddress);
+
+    ClientSocket = accept(Worker->ServerSocket, (struct sockaddr*)&ClientAddress, &ClientSize);
+    if (ClientSocket == INVALID_SOCKET)
+    {
+        INT error = WSAGetLastError();
+        if (!NetIsWouldBlock(error)) // would block when another worker accepted it first
+        {
+            printf("Accepting client socket failed: %d\n", error);
+        }
+        return;
+    }
+
+    // the worker only receives what the poller says is there, NetSendAll waits out a full send buffer
+    if (!NetSetNonBlocking(ClientSocket, TRUE))
+    {
+        printf("Cannot make client socket non-blocking: %d\n", WSAGetLastError());
+        closesocket(ClientSocket);
+        return;
+    }
+
+    printf("Client socket accepted, creating client info...\n");
+
+    PCLIENT_INFO pClientInfo = (PCLIENT_INFO)malloc(sizeof(CLIENT_INFO));
+    if (pClientInfo == NULL)
+    {
+        printf("Allocation memory for client information has failed\n");
+        closesocket(ClientSocket);
+        return;
+    }
+
+    memset(pClientInfo, 0, sizeof(CLIENT_INFO));
+    pClientInfo->SocketHandle = ClientSocket;
+    pClientInfo->Address = ClientAddress;
+    pClientInfo->References = 1; // owned by the worker
+    pClientInfo->Worker = Worker;
+    pClientInfo->LeaveReason = MESSAGE_LEAVE_DISCONNECTED;
+    NetMuxInitialise(&pClientInfo->Mux, ClientSocket);
+    NetBufferInitialise(&pClientInfo->Received, &Worker->Chunks);
+
+    // convert IP address to string
+    if (inet_ntop(AF_INET, &(ClientAddress.sin_addr), pClientInfo->IpAddress, INET_ADDRSTRLEN) == NULL)
+    {
+        printf("Failed to convert IP address\n");
+        strcpy_s(pClientInfo->IpAddress, INET_ADDRSTRLEN, "Unknown");
+    }
+
+    if (!RegisterClient(pClientInfo))
+    {
+        printf("Client table full, rejecting %s\n", pClientInfo->IpAddress);
+        ReleaseClient(pClientInfo);
+        return;
+    }
+
+    printf("Client %u connected from %s\n", pClientInfo->ClientId, pClientInfo->IpAddress);
+
+    // a client reconnecting from the same address finds what the address still owes
+    pClientInfo->Sender = NetLimitAcquireSender(&GlobalLimiter.Senders, ClientAddress.sin_addr.s_addr);
+    if (pClientInfo->Sender == NULL)
+    {
+        printf("Too many addresses connected to limit %s by its address\n", pClientInfo->IpAddress);
+    }
+
+    pClientInfo->LastActivity = GetTickCount64();
+    LinkClient(Worker, pClientInfo);
+
+    if (!NetPollerAdd(Worker->Poller, ClientSocket, NET_POLL_READ, pClientInfo))
+    {
+        printf("Unable to watch client socket: %d\n", WSAGetLastError());
+        CleanUpClient(pClientInfo);
+        return;
+    }
+
+    if (!SendHandshake(pClientInfo))
+    {
+        printf("Failed to send handshake to %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
+        CleanUpClient(pClientInfo);
+    }
+}
+
+VOID
+ServeClient(
+    _In_ PWORKER Worker,
+    _In_ PCLIENT_INFO pClientInfo
+)
+{
+    PNET_READ_BUFFER Received = &pClientInfo->Received;
+    NET_IO_STATUS Status;
+    BOOL Connected = TRUE;
+    LONG64 Now = NetLimitNow();
+    ULONG Served = 0;
+
+    // handle frames until the socket has no more, a partial frame keeps its chunk until the rest arrives
+    while (Connected)
+    {
+        Status = NetBufferFill(Received, pClientInfo->SocketHandle, sizeof(MESSAGE_HEADER));
+        if (Status != NET_IO_COMPLETE)
+        {
+            break;
+        }
+
+        // a client that always has more is served again after the worker's other clients
+        if (++Served > WORKER_FRAME_BUDGET)
+        {
+            PauseClient(Worker, pClientInfo, 0);
+            Status = NET_IO_PENDING;
+            break;
+        }
+
+        MESSAGE_HEADER Header;
+        const CHAR* HeaderBytes = NetBufferView(Received, sizeof(Header), &Header);
+        if (HeaderBytes != (const CHAR*)&Header)
+        {
+            memcpy(&Header, HeaderBytes, sizeof(Header));
+        }
+
+        UINT16 Type = ntohs(Header.Type);
+        UINT16 Length = ntohs(Header.Length);
+        UINT16 StreamId = ntohs(Header.StreamId);
+        UINT16 Flags = ntohs(Header.Flags);
+
+        if (Length > PROTOCOL_MAX_FRAME_PAYLOAD(StreamId))
+        {
+            printf("Frame of %u bytes from %s exceeds limit, disconnecting\n", Length, pClientInfo->IpAddress);
+            SendError(pClientInfo, MESSAGE_ERROR_PROTOCOL, Type, "frame exceeds the payload limit of its stream");
+            Connected = FALSE;
+            break;
+        }
+
+        // the header stays unread until the whole frame is in
+        Status = NetBufferFill(Received, pClientInfo->SocketHandle, sizeof(Header) + Length);
+        if (Status != NET_IO_COMPLETE)
+        {
+            break;
+        }
+
+        // window updates are never limited, one that went missing would close the peer's stream
+        // for good, and the bulk frames they pace only take bytes
+        BOOL Drop = FALSE;
+        if (Type != MESSAGE_TYPE_WINDOW_UPDATE)
+        {
+            ULONG Messages = (StreamId >= STREAM_BULK) ? 0 : 1;
+            LIMIT_ACTION Action = GlobalLimiter.Action;
+
+            LONG64 Wait = TakeLimits(pClientInfo, Messages, 0, Now);
+            if (Wait == 0)
+            {
+                // the bytes are shared with the client's transfers, which are only ever delayed,
+                // so being short of them only delays a frame too
+                Wait = TakeLimits(pClientInfo, 0, sizeof(Header) + Length, Now);
+                if (Wait != 0)
+                {
+                    GiveBackLimits(pClientInfo, Messages, 0);
+                    Action = LIMIT_DELAY;
+                }
+            }
+
+            // only chat and presence may be lost or cost the client its connection, everything
+            // else sets up or tears down the session and only waits
+            if (StreamId != STREAM_CHAT || (Type != MESSAGE_TYPE_CHAT && Type != MESSAGE_TYPE_PRESENCE))
+            {
+                Action = LIMIT_DELAY;
+            }
+
+            if (Wait != 0)
+            {
+                ++Worker->Fired[Action];
+                ++pClientInfo->Limited;
+
+                if (Action == LIMIT_DELAY)
+                {
+                    // the frame stays in the buffer whole and is taken again once the client is resumed
+                    PauseClient(Worker, pClientInfo, (DWORD)min((Wait + 999999) / 1000000, LIMIT_MAX_DELAY));
+                    Status = NET_IO_PENDING;
+                    break;
+                }
+
+                if (Action == LIMIT_DISCONNECT)
+                {
+                    printf("Client %s is over its rate limit, disconnecting\n", pClientInfo->IpAddress);
+                    SendError(pClientInfo, MESSAGE_ERROR_RATE_LIMITED, Type, "rate limit exceeded");
+                    Connected = FALSE;
+                    break;
+                }
+
+                Drop = TRUE;
+            }
+        }
+
+        NetBufferConsume(Received, sizeof(Header));
+
+        if (!NetMuxReceived(&pClientInfo->Mux, StreamId, Length))
+        {
+            printf("Frame from %s on stream %u overruns its window, disconnecting\n", pClientInfo->IpAddress, StreamId);
+            SendError(pClientInfo, MESSAGE_ERROR_PROTOCOL, Type, "frame overruns the window of its stream");
+            Connected = FALSE;
+            break;
+        }
+
+        // bulk frames are relayed as they are, so only frames we handle may be compressed, and
+        // only the way the client took up
+        UINT32 Allowed = ((Flags & MESSAGE_FLAG_DICTIONARY) != 0) ? PROTOCOL_CAPABILITY_DICTIONARY : PROTOCOL_CAPABILITY_COMPRESSION;
+        if (Flags != 0 && (StreamId >= STREAM_BULK || (pClientInfo->Capabilities & Allowed) == 0))
+        {
+            printf("Compressed frame from %s on stream %u was not negotiated, disconnecting\n", pClientInfo->IpAddress, StreamId);
+            SendError(pClientInfo, MESSAGE_ERROR_PROTOCOL, Type, "compression was not negotiated for this frame");
+            Connected = FALSE;
+            break;
+        }
+
+        // read where it was received, consumed once the frame is handled
+        const CHAR* Payload = NetBufferView(Received, Length, Worker->Scratch);
+        if (StreamId >= STREAM_BULK)
+        {
+            // the window comes back as the peer consumes the frame, so a relayed transfer holds at
+            // most one window here per stream and direction however large the file
+            Connected = RelayBulkFrame(pClientInfo, StreamId, Type, Payload, Length);
+        }
+        else if (Drop)
+        {
+            // never handled, echoed or printed, but its window still comes back
+            NetMuxConsumed(&pClientInfo->Mux, StreamId, Length);
+        }
+        else
+        {
+            const CHAR* Original;
+            UINT16 OriginalLength;
+
+            if (!NetPackExpand(Flags, Payload, Length, PROTOCOL_MAX_PAYLOAD_SIZE, Worker->Expanded, &Original, &OriginalLength))
+            {
+                printf("Corrupt compressed frame from %s, disconnecting\n", pClientInfo->IpAddress);
+                SendError(pClientInfo, MESSAGE_ERROR_PROTOCOL, Type, "compressed frame does not expand");
+                Connected = FALSE;
+                break;
+            }
+
+            // the window counts the bytes that came in, not what they expand to
+            Connected = HandleFrame(pClientInfo, StreamId, Type, Original, OriginalLength);
+            NetMuxConsumed(&pClientInfo->Mux, StreamId, Length);
+        }
+        NetBufferConsume(Received, Length);
+    }
+
+    if (Connected)
+    {
+        if (Status == NET_IO_PENDING)
+        {
+            pClientInfo->LastActivity = GetTickCount64();
+            UnlinkClient(Worker, pClientInfo);
+            LinkClient(Worker, pClientInfo);
+            return;
+        }
+
+        INT Error = WSAGetLastError();
+        if (Status == NET_IO_CLOSED)
+        {
+            if (Received->Length > 0)
+            {
+                printf("Client %s disconnected mid frame\n", pClientInfo->IpAddress);
+            }
+            else
+            {
+                printf("Client %s disconnected gracefully\n", pClientInfo->IpAddress);
+            }
+        }
+        else if (Error == WSAECONNRESET)
+        {
+            printf("Connection to %s was reset\n", pClientInfo->IpAddress);
+        }
+        else
+        {
+            printf("Error receiving data from %s: %d\n", pClientInfo->IpAddress, Error);
+        }
+    }
+
+    CleanUpClient(pClientInfo);
+}
+
+BOOL
+HandleFrame(
+    _In_ PCLIENT_INFO pClientInfo,
+    _In_ UINT16 StreamId,
+    _In_ UINT16 Type,
+    _In_ const CHAR* Payload,
+    _In_ UINT16 Length
+)
+{
+    switch (Type)
+    {
+    case MESSAGE_TYPE_CHAT:
+    {
+        const CHAT_MESSAGE* pChat = MessageChatView(Payload, Length);
+        if (pChat == NULL)
+        {
+            printf("Malformed chat message from %s\n", pClientInfo->IpAddress);
+            return SendError(pClientInfo, MESSAGE_ERROR_MALFORMED, Type, "chat message too short");
+        }
+
+        UINT16 TextLength;
+        const CHAR* Text = MessageChatTail(pChat, Length, &TextLength);
+        UINT32 Sequence = MessageChatSequence(pChat);
+
+        printf("Received '%.*s' from %s\n", TextLength, Text, pClientInfo->IpAddress);
+
+        // handed on with the sender filled in, it fits as the client's own message had the same fields
+        CHAR Relayed[PROTOCOL_MAX_PAYLOAD_SIZE];
+        UINT16 RelayedLength = MessageChatEncode(Relayed, Sequence, pClientInfo->ClientId, Text, TextLength);
+
+        // Relay to the paired peer if there is one, otherwise echo the message back, on the stream it came in on
+        EnterCriticalSection(&GlobalClientTable.Lock);
+        UINT32 PeerId = pClientInfo->PeerId;
+        LeaveCriticalSection(&GlobalClientTable.Lock);
+
+        PCLIENT_INFO pPeer = (PeerId != 0) ? AcquireClient(PeerId) : NULL;
+        if (pPeer != NULL)
+        {
+            if (!SendFrame(pPeer, StreamId, MESSAGE_TYPE_CHAT, Relayed, RelayedLength))
+            {
+                printf("Error relaying to client %u: %d\n", PeerId, WSAGetLastError());
+            }
+            ReleaseClient(pPeer);
+        }
+        else if (!SendFrame(pClientInfo, StreamId, MESSAGE_TYPE_CHAT, Relayed, RelayedLength))
+        {
+            printf("Error sending to %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
+            return FALSE;
+        }
+
+        ACK_MESSAGE Ack;
+        if (!SendFrame(pClientInfo, StreamId, MESSAGE_TYPE_ACK, &Ack, MessageAckEncode(&Ack, Sequence, NULL, 0)))
+        {
+            printf("Error sending to %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
+            return FALSE;
+        }
+        break;
+    }
+
+    case MESSAGE_TYPE_LEAVE:
+    {
+        printf("Client %s left\n", pClientInfo->IpAddress);
+        pClientInfo->LeaveReason = MESSAGE_LEAVE_QUIT;
+        return FALSE;
+    }
+
+    case MESSAGE_TYPE_PRESENCE:
+    {
+        const PRESENCE_MESSAGE* pPresence = MessagePresenceView(Payload, Length);
+        if (pPresence == NULL)
+        {
+            printf("Malformed presence from %s\n", pClientInfo->IpAddress);
+            return SendError(pClientInfo, MESSAGE_ERROR_MALFORMED, Type, "presence message too short");
+        }
+
+        // only a paired peer sees it, with the sender filled in
+        EnterCriticalSection(&GlobalClientTable.Lock);
+        UINT32 PeerId = pClientInfo->PeerId;
+        LeaveCriticalSection(&GlobalClientTable.Lock);
+
+        PCLIENT_INFO pPeer = (PeerId != 0) ? AcquireClient(PeerId) : NULL;
+        if (pPeer != NULL)
+        {
+            PRESENCE_MESSAGE Relayed;
+            SendFrame(pPeer, StreamId, MESSAGE_TYPE_PRESENCE, &Relayed, MessagePresenceEncode(&Relayed, pClientInfo->ClientId, MessagePresenceState(pPresence), NULL, 0));
+            ReleaseClient(pPeer);
+        }
+        break;
+    }
+
+    case MESSAGE_TYPE_CONTROL:
+    {
+        const CONTROL_MESSAGE* pControl = MessageControlView(Payload, Length);
+        if (pControl == NULL)
+        {
+            printf("Malformed control message from %s\n", pClientInfo->IpAddress);
+            return SendError(pClientInfo, MESSAGE_ERROR_MALFORMED, Type, "control message too short");
+        }
+
+        UINT16 Command = MessageControlCommand(pControl);
+        if (Command == MESSAGE_CONTROL_PING)
+        {
+            CONTROL_MESSAGE Pong;
+            if (!SendFrame(pClientInfo, STREAM_CONTROL, MESSAGE_TYPE_CONTROL, &Pong, MessageControlEncode(&Pong, MESSAGE_CONTROL_PONG, MessageControlArgument(pControl), NULL, 0)))
+            {
+                printf("Error sending to %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
+                return FALSE;
+            }
+        }
+        else if (Command != MESSAGE_CONTROL_PONG)
+        {
+            return SendError(pClientInfo, MESSAGE_ERROR_UNSUPPORTED, Type, "unknown control command");
+        }
+        break;
+    }
+
+    case MESSAGE_TYPE_REGISTER_ENDPOINT:
+    {
+        if (Length != sizeof(REGISTER_ENDPOINT_MESSAGE))
+        {
+            printf("Malformed endpoint registration from %s\n", pClientInfo->IpAddress);
+            return SendError(pClientInfo, MESSAGE_ERROR_MALFORMED, Type, "endpoint registration has the wrong size");
+        }
+
+        const REGISTER_ENDPOINT_MESSAGE* pRegister = (const REGISTER_ENDPOINT_MESSAGE*)Payload;
+
+        EnterCriticalSection(&GlobalClientTable.Lock);
+        ZeroMemory(&pClientInfo->PrivateAddress, sizeof(pClientInfo->PrivateAddress));
+        pClientInfo->PrivateAddress.sin_family = AF_INET;
+        pClientInfo->PrivateAddress.sin_port = pRegister->Private.Port;
+        memcpy(&pClientInfo->PrivateAddress.sin_addr, pRegister->Private.Address, sizeof(pRegister->Private.Address));
+        LeaveCriticalSection(&GlobalClientTable.Lock);
+        break;
+    }
+
+    case MESSAGE_TYPE_PEER_CONNECT:
+    {
+        if (Length != sizeof(PEER_CONNECT_MESSAGE))
+        {
+            printf("Malformed peer connect from %s\n", pClientInfo->IpAddress);
+            return SendError(pClientInfo, MESSAGE_ERROR_MALFORMED, Type, "peer connect has the wrong size");
+        }
+
+        HandlePeerConnect(pClientInfo, ntohl(((const PEER_CONNECT_MESSAGE*)Payload)->PeerId));
+        break;
+    }
+
+    case MESSAGE_TYPE_CAPABILITIES:
+    {
+        if (Length != sizeof(CAPABILITIES_MESSAGE))
+        {
+            printf("Malformed capabilities from %s\n", pClientInfo->IpAddress);
+            return SendError(pClientInfo, MESSAGE_ERROR_MALFORMED, Type, "capabilities have the wrong size");
+        }
+
+        UINT32 Capabilities = ntohl(((const CAPABILITIES_MESSAGE*)Payload)->Capabilities);
+        if ((Capabilities & ~GlobalCapabilities) != 0)
+        {
+            printf("Client %s took up capabilities %08X that were not offered, disconnecting\n", pClientInfo->IpAddress, Capabilities);
+            SendError(pClientInfo, MESSAGE_ERROR_PROTOCOL, Type, "capabilities taken up that were not offered");
+            return FALSE;
+        }
+
+        // the client expands what we send on STREAM_CHAT from now on, bulk streams are relayed as they are
+        pClientInfo->Capabilities = Capabilities;
+        NetMuxSetCompression(&pClientInfo->Mux, STREAM_CHAT, NetPackModeOf(Capabilities));
+        break;
+    }
+
+    case MESSAGE_TYPE_WINDOW_UPDATE:
+    {
+        if (!NetMuxWindowUpdate(&pClientInfo->Mux, Payload, Length))
+        {
+            printf("Bad window update from %s, disconnecting\n", pClientInfo->IpAddress);
+            SendError(pClientInfo, MESSAGE_ERROR_PROTOCOL, Type, "malformed window update");
+            return FALSE;
+        }
+
+        // the client consumed bulk frames relayed from its peer, the peer may send as much again
+        const WINDOW_UPDATE_MESSAGE* pUpdate = (const WINDOW_UPDATE_MESSAGE*)Payload;
+        UINT16 UpdatedStream = ntohs(pUpdate->StreamId);
+        if (UpdatedStream >= STREAM_BULK)
+        {
+            EnterCriticalSection(&GlobalClientTable.Lock);
+            UINT32 PeerId = pClientInfo->PeerId;
+            LeaveCriticalSection(&GlobalClientTable.Lock);
+
+            PCLIENT_INFO pPeer = (PeerId != 0) ? AcquireClient(PeerId) : NULL;
+            if (pPeer != NULL)
+            {
+                NetMuxGrant(&pPeer->Mux, UpdatedStream, ntohl(pUpdate->Increment));
+                ReleaseClient(pPeer);
+            }
+        }
+        break;
+    }
+
+    default:
+        printf("Ignoring unknown frame type %u from %s\n", Type, pClientInfo->IpAddress);
+        return SendError(pClientInfo, MESSAGE_ERROR_UNSUPPORTED, Type, "message type not handled by the server");
+    }
+
+    return TRUE;
+}
+
+BOOL
+RelayBulkFrame(
+    _In_ PCLIENT_INFO pClientInfo,
+    _In_ UINT16 StreamId,
+    _In_ UINT16 Type,
+    _In_ const CHAR* Payload,
+    _In_ UINT16 Length
+)
+{
+    EnterCriticalSection(&GlobalClientTable.Lock);
+    UINT32 PeerId = pClientInfo->PeerId;
+    LeaveCriticalSection(&GlobalClientTable.Lock);
+
+    // never refused for a full queue, the sender's window keeps the peer's queue below the limit
+    PCLIENT_INFO pPeer = (PeerId != 0) ? AcquireClient(PeerId) : NULL;
+    if (pPeer != NULL)
+    {
+        BOOL Relayed = SendFrame(pPeer, StreamId, (MESSAGE_TYPE)Type, Payload, Length);
+        if (!Relayed)
+        {
+            printf("Error relaying to client %u: %d\n", PeerId, WSAGetLastError());
+        }
+
+        ReleaseClient(pPeer);
+        if (Relayed)
+        {
+            return TRUE;
+        }
+    }
+
+    // nobody to take it, the frame is dropped and its window given back at once
+    NetMuxGrant(&pClientInfo->Mux, StreamId, PROTOCOL_STREAM_WINDOW);
+
+    if (Type == MESSAGE_TYPE_FILE_OFFER)
+    {
+        PEER_UNAVAILABLE_MESSAGE Unavailable;
+        Unavailable.PeerId = htonl(PeerId);
+
+        if (!SendFrame(pClientInfo, STREAM_CONTROL, MESSAGE_TYPE_PEER_UNAVAILABLE, &Unavailable, sizeof(Unavailable)))
+        {
+            printf("Error sending to %s: %d\n", pClientInfo->IpAddress, WSAGetLastError());
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+VOID
+NotifyPeerGone(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT32 PeerId,
+    _In_ UINT16 Reason
+)
+{
+    for (UINT16 StreamId = STREAM_BULK; StreamId < PROTOCOL_MAX_STREAMS; ++StreamId)
+    {
+        NetMuxGrant(&pClient->Mux, StreamId, PROTOCOL_STREAM_WINDOW);
+    }
+
+    // on the chat stream, so it arrives after the last message the peer sent
+    LEAVE_MESSAGE Leave;
+    SendFrame(pClient, STREAM_CHAT, MESSAGE_TYPE_LEAVE, &Leave, MessageLeaveEncode(&Leave, PeerId, Reason, NULL, 0));
+}
+
+BOOL
+ReceiveRendezvous(
+    _In_ SOCKET RendezvousSocket
+)
+{
+    CHAR Datagram[sizeof(DATAGRAM_HEADER) + MAX_BUFFER_SIZE];
+
+    while (TRUE)
+    {
+        struct sockaddr_in SenderAddress;
+        socklen_t SenderAddressSize = sizeof(SenderAddress);
+
+        INT BytesReceived = recvfrom(
+            RendezvousSocket,
+            Datagram,
+            sizeof(Datagram),
+            0,
+            (struct sockaddr*)&SenderAddress,
+            &SenderAddressSize
+        );
+
+        if (BytesReceived == SOCKET_ERROR)
+        {
+            INT Error = WSAGetLastError();
+            if (NetIsWouldBlock(Error))
+            {
+                return TRUE; // drained, the poller reports the next datagram
+            }
+
+            if (Error == WSAECONNRESET)
+            {
+                continue; // ICMP unreachable from an earlier reply, not fatal for a UDP socket
+            }
+
+            printf("Rendezvous socket failed: %d\n", Error);
+            return FALSE;
+        }
+
+        PDATAGRAM_HEADER pHeader = (PDATAGRAM_HEADER)Datagram;
+        if (BytesReceived < (INT)sizeof(DATAGRAM_HEADER) ||
+            ntohl(pHeader->Magic) != DATAGRAM_MAGIC ||
+            pHeader->Type != DATAGRAM_TYPE_REGISTER)
+        {
+            continue; // not ours
+        }
+
+        UINT32 ClientId = ntohl(pHeader->SenderId);
+        PCLIENT_INFO pClient = AcquireClient(ClientId);
+        if (pClient == NULL)
+        {
+            continue;
+        }
+
+        if (pClient->Token != ntohl(pHeader->Token))
+        {
+            printf("Rejected UDP registration for client %u with a bad token\n", ClientId);
+            ReleaseClient(pClient);
+            continue;
+        }
+
+        EnterCriticalSection(&GlobalClientTable.Lock);
+        BOOL IsNewEndpoint = !pClient->UdpRegistered || memcmp(&pClient->UdpAddress, &SenderAddress, sizeof(SenderAddress)) != 0;
+        pClient->UdpAddress = SenderAddress;
+        pClient->UdpRegistered = TRUE;
+        LeaveCriticalSection(&GlobalClientTable.Lock);
+
+        if (IsNewEndpoint)
+        {
+            CHAR AddrStr[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &SenderAddress.sin_addr, AddrStr, INET_ADDRSTRLEN);
+            printf("Client %u registered UDP endpoint %s:%d\n", ClientId, AddrStr, ntohs(SenderAddress.sin_port));
+        }
+
+        DATAGRAM_HEADER Ack;
+        ZeroMemory(&Ack, sizeof(Ack));
+        Ack.Magic = htonl(DATAGRAM_MAGIC);
+        Ack.Type = DATAGRAM_TYPE_REGISTER_ACK;
+        Ack.Token = pHeader->Token;
+
+        sendto(RendezvousSocket, (PCSTR)&Ack, sizeof(Ack), 0, (struct sockaddr*)&SenderAddress, sizeof(SenderAddress));
+
+        ReleaseClient(pClient);
+    }
+
+    return TRUE;
+}
+
+/**
+ * Fills a PEER_ENDPOINTS message describing pPeer, caller must hold the client table lock
+ */
+static
+VOID
+DescribePeer(
+    _In_  PCLIENT_INFO pPeer,
+    _In_  UINT32 SessionToken,
+    _Out_ PPEER_ENDPOINTS_MESSAGE pMessage
+)
+{
+    ZeroMemory(pMessage, sizeof(*pMessage));
+    pMessage->PeerId = htonl(pPeer->ClientId);
+    pMessage->SessionToken = htonl(SessionToken);
+
+    memcpy(pMessage->Public.Address, &pPeer->UdpAddress.sin_addr, sizeof(pMessage->Public.Address));
+    pMessage->Public.Port = pPeer->UdpAddress.sin_port;
+
+    memcpy(pMessage->Private.Address, &pPeer->PrivateAddress.sin_addr, sizeof(pMessage->Private.Address));
+    pMessage->Private.Port = pPeer->PrivateAddress.sin_port;
+}
+
+PCLIENT_INFO
+UnpairPartner(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT32 NewPeerId
+)
+{
+    if (pClient->PeerId == 0 || pClient->PeerId == NewPeerId)
+    {
+        return NULL;
+    }
+
+    PCLIENT_INFO pPartner = GlobalClientTable.Clients[CLIENT_SLOT(pClient->PeerId)];
+    if (pPartner == NULL || pPartner->ClientId != pClient->PeerId || pPartner->PeerId != pClient->ClientId)
+    {
+        return NULL;
+    }
+
+    pPartner->PeerId = 0;
+    InterlockedIncrement(&pPartner->References);
+    return pPartner;
+}
+
+VOID
+HandlePeerConnect(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT32 PeerId
+)
+{
+    PCLIENT_INFO pPeer = (PeerId != pClient->ClientId) ? AcquireClient(PeerId) : NULL;
+
+    PEER_ENDPOINTS_MESSAGE ToClient;
+    PEER_ENDPOINTS_MESSAGE ToPeer;
+    BOOL IsReady = FALSE;
+    PCLIENT_INFO pClientPartner = NULL;
+    PCLIENT_INFO pPeerPartner = NULL;
+
+    UINT32 SessionToken = 0;
+    rand_s(&SessionToken);
+
+    EnterCriticalSection(&GlobalClientTable.Lock);
+    if (pPeer != NULL && pClient->UdpRegistered && pPeer->UdpRegistered)
+    {
+        // whoever either was paired with would otherwise keep relaying to a client that no longer
+        // relays back
+        pClientPartner = UnpairPartner(pClient, pPeer->ClientId);
+        pPeerPartner = UnpairPartner(pPeer, pClient->ClientId);
+
+        // pair both ways so chat is relayed until the punch succeeds
+        pClient->PeerId = pPeer->ClientId;
+        pPeer->PeerId = pClient->ClientId;
+
+        DescribePeer(pPeer, SessionToken, &ToClient);
+        DescribePeer(pClient, SessionToken, &ToPeer);
+        IsReady = TRUE;
+    }
+    LeaveCriticalSection(&GlobalClientTable.Lock);
+
+    if (!IsReady)
+    {
+        printf("Client %u asked for unavailable peer %u\n", pClient->ClientId, PeerId);
+
+        PEER_UNAVAILABLE_MESSAGE Unavailable;
+        Unavailable.PeerId = htonl(PeerId);
+        SendFrame(pClient, STREAM_CONTROL, MESSAGE_TYPE_PEER_UNAVAILABLE, &Unavailable, sizeof(Unavailable));
+
+        if (pPeer != NULL)
+        {
+            ReleaseClient(pPeer);
+        }
+        return;
+    }
+
+    if (pClientPartner != NULL)
+    {
+        NotifyPeerGone(pClientPartner, pClient->ClientId, MESSAGE_LEAVE_REPAIRED);
+        ReleaseClient(pClientPartner);
+    }
+
+    if (pPeerPartner != NULL)
+    {
+        NotifyPeerGone(pPeerPartner, pPeer->ClientId, MESSAGE_LEAVE_REPAIRED);
+        ReleaseClient(pPeerPartner);
+    }
+
+    // send both introductions back to back so the peers start punching at the same time
+    SendFrame(pPeer, STREAM_CONTROL, MESSAGE_TYPE_PEER_ENDPOINTS, &ToPeer, sizeof(ToPeer));
+    SendFrame(pClient, STREAM_CONTROL, MESSAGE_TYPE_PEER_ENDPOINTS, &ToClient, sizeof(ToClient));
+
+    // chat is relayed between them from now on
+    JOIN_MESSAGE Join;
+    SendFrame(pPeer, STREAM_CHAT, MESSAGE_TYPE_JOIN, &Join, MessageJoinEncode(&Join, pClient->ClientId, NULL, 0));
+    SendFrame(pClient, STREAM_CHAT, MESSAGE_TYPE_JOIN, &Join, MessageJoinEncode(&Join, pPeer->ClientId, NULL, 0));
+
+    printf("Introduced client %u to client %u\n", pClient->ClientId, pPeer->ClientId);
+    ReleaseClient(pPeer);
+}
+
+BOOL
+SendFrame(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT16 StreamId,
+    _In_ MESSAGE_TYPE Type,
+    _In_ const VOID* Payload,
+    _In_ UINT16 Length
+)
+{
+    if (Length > PROTOCOL_MAX_FRAME_PAYLOAD(StreamId))
+    {
+        return FALSE;
+    }
+
+    // queued behind the stream's earlier frames only, a chat frame does not wait for a bulk stream
+    NET_IO_STATUS Status = NetMuxSend(&pClient->Mux, StreamId, Type, Payload, Length);
+    if (Status == NET_IO_PENDING)
+    {
+        WSASetLastError(WSAENOBUFS); // the stream's queue is full, the client is not reading
+    }
+
+    return Status == NET_IO_COMPLETE;
+}
+
+BOOL
+SendError(
+    _In_ PCLIENT_INFO pClient,
+    _In_ UINT16 Code,
+    _In_ UINT16 Type,
+    _In_ PCSTR Description
+)
+{
+    CHAR Error[sizeof(ERROR_MESSAGE) + MAX_BUFFER_SIZE];
+    UINT16 DescriptionLength = (UINT16)min(strlen(Description), (SIZE_T)MAX_BUFFER_SIZE - sizeof(ERROR_MESSAGE));
+
+    // best effort, a client being disconnected may not read it
+    return SendFrame(pClient, STREAM_CONTROL, MESSAGE_TYPE_ERROR, Error, MessageErrorEncode(Error, Code, Type, Description, DescriptionLength));
+}
+
+BOOL
+SendHandshake(
+    _In_ PCLIENT_INFO pClient
+)
+{
+    HANDSHAKE_MESSAGE Handshake;
+    ZeroMemory(&Handshake, sizeof(Handshake));
+
+    Handshake.Version = PROTOCOL_VERSION;
+    Handshake.Family = PROTOCOL_ADDRESS_FAMILY_IPV4;
+    Handshake.ObservedPort = pClient->Address.sin_port; // already in network byte order
+    memcpy(Handshake.ObservedAddress, &pClient->Address.sin_addr, sizeof(pClient->Address.sin_addr));
+    Handshake.ClientId = htonl(pClient->ClientId);
+    Handshake.Token = htonl(pClient->Token);
+    Handshake.Capabilities = htonl(GlobalCapabilities);
+
+    if (!SendFrame(pClient, STREAM_CONTROL, MESSAGE_TYPE_HANDSHAKE, &Handshake, sizeof(Handshake)))
+    {
+        return FALSE;
+    }
+
+    printf("Sent handshake to %s:%d\n", pClient->IpAddress, ntohs(pClient->Address.sin_port));
+    return TRUE;
+}
+
+BOOL
+RegisterClient(
+    _In_ PCLIENT_INFO pClient
+)
+{
+    BOOL Registered = FALSE;
+
+    UINT32 Token = 0;
+    rand_s(&Token);
+
+    EnterCriticalSection(&GlobalClientTable.Lock);
+
+    if (GlobalClientTable.Count < MAX_CLIENTS)
+    {
+        // ids count up, skipping those whose slot still holds a client connected since the ids last came round
+        UINT32 ClientId;
+        do
+        {
+            ClientId = ++GlobalClientTable.NextClientId;
+        } while (ClientId == 0 || GlobalClientTable.Clients[CLIENT_SLOT(ClientId)] != NULL);
+
+        pClient->ClientId = ClientId;
+        pClient->Token = Token;
+        GlobalClientTable.Clients[CLIENT_SLOT(ClientId)] = pClient;
+        ++GlobalClientTable.Count;
+        Registered = TRUE;
+    }
+
+    LeaveCriticalSection(&GlobalClientTable.Lock);
+
+    return Registered;
+}
+
+PCLIENT_INFO
+AcquireClient(
+    _In_ UINT32 ClientId
+)
+{
+    EnterCriticalSection(&GlobalClientTable.Lock);
+
+    // the slot may hold a later client, an id from a client that left matches nothing
+    PCLIENT_INFO pClient = GlobalClientTable.Clients[CLIENT_SLOT(ClientId)];
+    if (pClient != NULL && pClient->ClientId == ClientId)
+    {
+        InterlockedIncrement(&pClient->References);
+    }
+    else
+    {
+        pClient = NULL;
+    }
+
+    LeaveCriticalSection(&GlobalClientTable.Lock);
+
+    return pClient;
+}
+
+VOID
+ReleaseClient(
+    _In_ PCLIENT_INFO pClient
+)
+{
+    if (InterlockedDecrement(&pClient->References) == 0)
+    {
+        // closed only here so a relaying thread never sends on a recycled socket handle
+        closesocket(pClient->SocketHandle);
+        NetMuxCleanUp(&pClient->Mux);
+        free(pClient);
+    }
 }
 
 VOID
@@ -290,6 +1657,57 @@ CleanUpClient(
     {
         printf("Cleaning up client %s\n", pClient->IpAddress);
 
+        // Remove from the client table so no new references can be taken, and unpair the peer if it
+        // is paired back, any other client still naming us falls back to echo as our id matches nothing
+        EnterCriticalSection(&GlobalClientTable.Lock);
+        GlobalClientTable.Clients[CLIENT_SLOT(pClient->ClientId)] = NULL;
+        --GlobalClientTable.Count;
+
+        PCLIENT_INFO pPeer = (pClient->PeerId != 0) ? GlobalClientTable.Clients[CLIENT_SLOT(pClient->PeerId)] : NULL;
+        if (pPeer != NULL && pPeer->ClientId == pClient->PeerId && pPeer->PeerId == pClient->ClientId)
+        {
+            pPeer->PeerId = 0;
+            InterlockedIncrement(&pPeer->References);
+        }
+        else
+        {
+            pPeer = NULL;
+        }
+        LeaveCriticalSection(&GlobalClientTable.Lock);
+
+        if (pPeer != NULL)
+        {
+            NotifyPeerGone(pPeer, pClient->ClientId, pClient->LeaveReason);
+            ReleaseClient(pPeer);
+        }
+
+        // Stop serving it, the worker's chunks go back to its pool here and not in ReleaseClient,
+        // which may run on whichever thread sent to the client last
+        PWORKER Worker = pClient->Worker;
+        NetPollerRemove(Worker->Poller, pClient->SocketHandle);
+        UnlinkClient(Worker, pClient);
+        NetBufferCleanUp(&pClient->Received);
+
+        if (pClient->Paused)
+        {
+            PCLIENT_INFO* pLink = &Worker->Paused;
+            while (*pLink != pClient)
+            {
+                pLink = &(*pLink)->NextPaused;
+            }
+            *pLink = pClient->NextPaused;
+        }
+
+        if (pClient->Sender != NULL)
+        {
+            NetLimitReleaseSender(pClient->Sender);
+        }
+
+        if (pClient->Limited != 0)
+        {
+            printf("Client %s went over its rate limits with %lu frames\n", pClient->IpAddress, (unsigned long)pClient->Limited);
+        }
+
         // Shutdown the socket gracefully
         int result = shutdown(pClient->SocketHandle, SD_BOTH);
         if (result == SOCKET_ERROR)
@@ -297,11 +1715,172 @@ CleanUpClient(
             printf("Shutdown failed for %s: %d\n", pClient->IpAddress, WSAGetLastError());
         }
 
-        // Close the socket
-        closesocket(pClient->SocketHandle);
-
-        // Free the memory
-        free(pClient);
+        // Close the socket and free the memory once no relay is still sending to this client
+        ReleaseClient(pClient);
         printf("Client cleanup completed\n");
     }
-}
\ No newline at end of file
+}
+
+//////////////////////////////////////////
+//
+//          RATE LIMITS
+//
+//////////////////////////////////////////
+
+VOID
+PauseClient(
+    _In_ PWORKER Worker,
+    _In_ PCLIENT_INFO pClient,
+    _In_ DWORD Milliseconds
+)
+{
+    // out of the poller rather than ignored, a readable socket would wake the worker for nothing
+    NetPollerRemove(Worker->Poller, pClient->SocketHandle);
+
+    pClient->Paused = TRUE;
+    pClient->ResumeAt = GetTickCount64() + Milliseconds;
+    pClient->NextPaused = Worker->Paused;
+    Worker->Paused = pClient;
+}
+
+VOID
+ResumeClients(
+    _In_ PWORKER Worker
+)
+{
+    ULONGLONG Now = GetTickCount64();
+    PCLIENT_INFO Due = NULL;
+    PCLIENT_INFO* pLink = &Worker->Paused;
+
+    // take the clients that are due off the list first, serving them may pause them again
+    while (*pLink != NULL)
+    {
+        PCLIENT_INFO pClient = *pLink;
+        if (pClient->ResumeAt <= Now)
+        {
+            *pLink = pClient->NextPaused;
+            pClient->Paused = FALSE;
+            pClient->NextPaused = Due;
+            Due = pClient;
+        }
+        else
+        {
+            pLink = &pClient->NextPaused;
+        }
+    }
+
+    while (Due != NULL)
+    {
+        PCLIENT_INFO pClient = Due;
+        Due = pClient->NextPaused;
+        pClient->NextPaused = NULL;
+
+        if (!NetPollerAdd(Worker->Poller, pClient->SocketHandle, NET_POLL_READ, pClient))
+        {
+            printf("Unable to watch client socket: %d\n", WSAGetLastError());
+            CleanUpClient(pClient);
+            continue;
+        }
+
+        // frames already buffered would not wake the poller
+        ServeClient(Worker, pClient);
+    }
+}
+
+LONG64
+TakeLimits(
+    _In_ PCLIENT_INFO pClient,
+    _In_ ULONG Messages,
+    _In_ ULONG Bytes,
+    _In_ LONG64 Now
+)
+{
+    LONG64 Wait = NetLimitTake(&pClient->Rates, &GlobalLimiter.Client, Messages, Bytes, Now);
+    if (Wait != 0 || pClient->Sender == NULL)
+    {
+        return Wait;
+    }
+
+    Wait = NetLimitTake(&pClient->Sender->Rates, &GlobalLimiter.Address, Messages, Bytes, Now);
+    if (Wait != 0)
+    {
+        NetLimitGiveBack(&pClient->Rates, &GlobalLimiter.Client, Messages, Bytes);
+    }
+
+    return Wait;
+}
+
+VOID
+GiveBackLimits(
+    _In_ PCLIENT_INFO pClient,
+    _In_ ULONG Messages,
+    _In_ ULONG Bytes
+)
+{
+    NetLimitGiveBack(&pClient->Rates, &GlobalLimiter.Client, Messages, Bytes);
+    if (pClient->Sender != NULL)
+    {
+        NetLimitGiveBack(&pClient->Sender->Rates, &GlobalLimiter.Address, Messages, Bytes);
+    }
+}
+
+VOID
+ReportLimits(
+    VOID
+)
+{
+    ULONGLONG Now = GetTickCount64();
+    LONG64 Due = GlobalLimiter.ReportAt;
+
+    if (Now < (ULONGLONG)Due || InterlockedCompareExchange64(&GlobalLimiter.ReportAt, (LONG64)(Now + LIMIT_REPORT_INTERVAL), Due) != Due)
+    {
+        return;
+    }
+
+    // only the worker that moved the report on gets here, the counters are read as they are
+    ULONGLONG Totals[LIMIT_ACTIONS] = { 0 };
+    for (DWORD i = 0; i < MAX_WORKERS; ++i)
+    {
+        for (DWORD Action = 0; Action < LIMIT_ACTIONS; ++Action)
+        {
+            Totals[Action] += GlobalWorkers[i].Fired[Action];
+        }
+    }
+
+    if (memcmp(Totals, GlobalLimiter.Reported, sizeof(Totals)) != 0)
+    {
+        printf("Rate limits so far: %llu frames delayed, %llu dropped, %llu clients disconnected\n",
+            (unsigned long long)Totals[LIMIT_DELAY], (unsigned long long)Totals[LIMIT_DROP], (unsigned long long)Totals[LIMIT_DISCONNECT]);
+        memcpy(GlobalLimiter.Reported, Totals, sizeof(Totals));
+    }
+}
+
+VOID
+ReadLimits(
+    _In_  PCSTR Variable,
+    _Out_ PNET_LIMITS Limits,
+    _In_  ULONG Messages,
+    _In_  ULONG Bytes
+)
+{
+    CHAR Value[64];
+    DWORD ValueSize = GetEnvironmentVariableA(Variable, Value, sizeof(Value));
+    if (ValueSize > 0 && ValueSize < sizeof(Value))
+    {
+        UINT ReadMessages;
+        UINT ReadBytes;
+
+        if (sscanf_s(Value, "%u %u", &ReadMessages, &ReadBytes) == 2)
+        {
+            Messages = ReadMessages;
+            Bytes = ReadBytes;
+        }
+        else
+        {
+            printf("Ignoring %s, expected \"<messages> <bytes>\" a second\n", Variable);
+        }
+    }
+
+    NetLimitSet(&Limits->Messages, Messages, Messages);
+    NetLimitSet(&Limits->Bytes, Bytes, Bytes);
+}
@@ -0,0 +1,67 @@
+#include "testing.h"
+#include "logger.h"
+
+/**
+    * TRACE records of the client reaching the log through the flight recorder.
+    *
+    *     flightrecorder
+    *
+    * Built with the client's compile definitions, so a build of the client that compiles its TRACE
+    * statements out fails here as well. Logs at the client's level with the flight recorder
+    * capturing TRACE, as the client sets the logger up, and checks that a TRACE record stays out of
+    * the log until a dump and is in the log after it.
+*/
+
+#define FLIGHT_RECORDER_MARKER "flight recorder trace"
+#define FLIGHT_RECORDER_LOG_SIZE 4096
+
+/**
+* Reads what the logger wrote so far.
+*
+* @return TRUE if the marker is in it.
+*/
+static
+BOOL
+FlightRecorderLogged(
+    _In_ FILE* Log
+)
+{
+    CHAR Text[FLIGHT_RECORDER_LOG_SIZE];
+
+    fflush(Log);
+    rewind(Log);
+
+    size_t Length = fread(Text, 1, sizeof(Text) - 1, Log);
+    Text[Length] = '\0';
+
+    fseek(Log, 0, SEEK_END);
+    return strstr(Text, FLIGHT_RECORDER_MARKER) != NULL;
+}
+
+INT main(
+    VOID
+)
+{
+    FILE* Log = tmpfile();
+    if (!TestCheck(Log != NULL && LoggerInitConsole(Log) == 0, "cannot start the logger"))
+    {
+        return 1;
+    }
+
+    LoggerStartFlightRecorder(0, LOG_LEVEL_TRACE);
+    LoggerSetLevel(LOG_LEVEL_INFO);
+
+    LOG_TRACE(FLIGHT_RECORDER_MARKER " %d\n", 1);
+
+    BOOL Passed = TestCheck(LOG_COMPILE_LEVEL <= 1, "TRACE statements are compiled out at level %d", LOG_COMPILE_LEVEL) &&
+                  TestCheck(!FlightRecorderLogged(Log), "TRACE record written before a dump");
+
+    LoggerDumpFlightRecorder();
+
+    Passed = Passed && TestCheck(FlightRecorderLogged(Log), "TRACE record missing from the dump");
+
+    LoggerCleanUp(); // closes the log
+
+    printf("%s\n", Passed ? "passed" : "FAILED");
+    return Passed ? 0 : 1;
+}
@@ -0,0 +1,501 @@
+#include "testing.h"
+#include "natpmp.h"
+
+/**
+    * NAT-PMP and PCP clients against a stand-in gateway.
+    *
+    *     gateway <port>
+    *
+    * The gateway runs on a thread of the test, on a port of the loopback address, and speaks either
+    * NAT-PMP only or PCP only, answering the other protocol with an unsupported version the way
+    * RFC 6887 section 9 has it. It keeps the mappings it grants, so for each protocol the test maps
+    * a port, renews the mapping, which has to keep its external port, and deletes it. Asking for
+    * the public address has to leave no mapping behind, though over PCP the address comes from a
+    * MAP. The gateway can also leave requests unanswered and notes when each arrived, for the
+    * retransmissions to be checked against the 250, 500 and 1000 ms schedule.
+*/
+
+#define GATEWAY_PUBLIC_ADDRESS "192.0.2.1"     // TEST-NET-1, what the gateway says is outside
+#define GATEWAY_MAX_LIFETIME 3600              // seconds, longer requests get this much
+#define GATEWAY_PORT_OFFSET 10000              // external ports are the internal port and this
+#define GATEWAY_MAX_MAPPINGS 8
+#define GATEWAY_MAX_REQUESTS 16                // requests whose arrival is noted
+#define GATEWAY_TIMING_EARLY 20                // milliseconds a retransmission may come early
+#define GATEWAY_TIMING_LATE 150                // milliseconds a retransmission may come late
+#define GATEWAY_INTERNAL_PORT 40000
+
+#define GATEWAY_NATPMP_OPCODE_MAP_UDP 1
+#define GATEWAY_NATPMP_OPCODE_MAP_TCP 2
+#define GATEWAY_PCP_OPCODE_MAP 1
+#define GATEWAY_PCP_HEADER_SIZE 24
+#define GATEWAY_PCP_MAP_SIZE 36
+#define GATEWAY_RESULT_UNSUPPORTED_VERSION 1
+
+typedef struct _GATEWAY_MAPPING
+{
+    UINT8  Protocol;                           // IPPROTO_UDP or IPPROTO_TCP
+    UINT16 InternalPort;
+    UINT16 ExternalPort;
+    UINT32 Lifetime;
+} GATEWAY_MAPPING, *PGATEWAY_MAPPING;
+
+typedef struct _GATEWAY
+{
+    SOCKET          Socket;
+    HANDLE          Thread;
+    volatile LONG   Running;
+    BOOL            IsPcp;                     // speaks PCP, otherwise NAT-PMP
+    volatile LONG   Ignore;                    // requests still to leave unanswered
+    volatile LONG   Requests;                  // requests received
+    ULONGLONG       Arrivals[GATEWAY_MAX_REQUESTS];
+    GATEWAY_MAPPING Mappings[GATEWAY_MAX_MAPPINGS];
+    volatile LONG   MappingCount;
+} GATEWAY, *PGATEWAY;
+
+static
+VOID
+GatewayWrite16(
+    _Out_ PUINT8 Buffer,
+    _In_  UINT16 Value
+)
+{
+    Buffer[0] = (UINT8)(Value >> 8);
+    Buffer[1] = (UINT8)(Value);
+}
+
+static
+VOID
+GatewayWrite32(
+    _Out_ PUINT8 Buffer,
+    _In_  UINT32 Value
+)
+{
+    Buffer[0] = (UINT8)(Value >> 24);
+    Buffer[1] = (UINT8)(Value >> 16);
+    Buffer[2] = (UINT8)(Value >> 8);
+    Buffer[3] = (UINT8)(Value);
+}
+
+static
+UINT16
+GatewayRead16(
+    _In_ const UINT8* Buffer
+)
+{
+    return (UINT16)((Buffer[0] << 8) | Buffer[1]);
+}
+
+static
+UINT32
+GatewayRead32(
+    _In_ const UINT8* Buffer
+)
+{
+    return ((UINT32)Buffer[0] << 24) | ((UINT32)Buffer[1] << 16) | ((UINT32)Buffer[2] << 8) | (UINT32)Buffer[3];
+}
+
+/**
+* Maps, renews or, for a lifetime of 0, deletes the mapping of an internal port.
+*
+* @return The external port, 0 once deleted or if the gateway is out of mappings.
+*/
+static
+UINT16
+GatewayMap(
+    _Inout_ PGATEWAY pGateway,
+    _In_    UINT8 Protocol,
+    _In_    UINT16 InternalPort,
+    _Inout_ UINT32* pLifetime
+)
+{
+    *pLifetime = min(*pLifetime, GATEWAY_MAX_LIFETIME);
+
+    LONG Count = pGateway->MappingCount;
+    for (LONG i = 0; i < Count; ++i)
+    {
+        PGATEWAY_MAPPING pMapping = &pGateway->Mappings[i];
+        if (pMapping->Protocol == Protocol && pMapping->InternalPort == InternalPort)
+        {
+            if (*pLifetime == 0)
+            {
+                *pMapping = pGateway->Mappings[Count - 1];
+                InterlockedDecrement(&pGateway->MappingCount);
+                return 0;
+            }
+
+            pMapping->Lifetime = *pLifetime;
+            return pMapping->ExternalPort;
+        }
+    }
+
+    if (*pLifetime == 0 || Count == GATEWAY_MAX_MAPPINGS)
+    {
+        return 0;
+    }
+
+    PGATEWAY_MAPPING pMapping = &pGateway->Mappings[Count];
+    pMapping->Protocol = Protocol;
+    pMapping->InternalPort = InternalPort;
+    pMapping->ExternalPort = (UINT16)(InternalPort + GATEWAY_PORT_OFFSET);
+    pMapping->Lifetime = *pLifetime;
+    InterlockedIncrement(&pGateway->MappingCount);
+    return pMapping->ExternalPort;
+}
+
+/**
+* Builds the answer to a NAT-PMP request.
+*
+* @return Bytes of the answer, 0 for none.
+*/
+static
+INT
+GatewayAnswerNatPmp(
+    _Inout_ PGATEWAY pGateway,
+    _In_    const UINT8* Request,
+    _In_    INT RequestSize,
+    _Out_   PUINT8 Response
+)
+{
+    UINT8 Opcode = Request[1];
+
+    if (pGateway->IsPcp)
+    {
+        // a PCP only server answers in its own version
+        ZeroMemory(Response, GATEWAY_PCP_HEADER_SIZE);
+        Response[0] = PCP_VERSION;
+        Response[1] = 0x80 | Opcode;
+        Response[3] = GATEWAY_RESULT_UNSUPPORTED_VERSION;
+        return GATEWAY_PCP_HEADER_SIZE;
+    }
+
+    ZeroMemory(Response, 16);
+    Response[0] = NATPMP_VERSION;
+    Response[1] = 0x80 | Opcode;
+    GatewayWrite32(Response + 4, (UINT32)(GetTickCount64() / 1000)); // seconds since the epoch of the mappings
+
+    if (Opcode == 0)
+    {
+        inet_pton(AF_INET, GATEWAY_PUBLIC_ADDRESS, Response + 8);
+        return 12;
+    }
+
+    if ((Opcode != GATEWAY_NATPMP_OPCODE_MAP_UDP && Opcode != GATEWAY_NATPMP_OPCODE_MAP_TCP) || RequestSize < 12)
+    {
+        return 0;
+    }
+
+    UINT16 InternalPort = GatewayRead16(Request + 4);
+    UINT32 Lifetime = GatewayRead32(Request + 8);
+    UINT16 ExternalPort = GatewayMap(pGateway, (Opcode == GATEWAY_NATPMP_OPCODE_MAP_UDP) ? IPPROTO_UDP : IPPROTO_TCP, InternalPort, &Lifetime);
+
+    GatewayWrite16(Response + 8, InternalPort);
+    GatewayWrite16(Response + 10, ExternalPort);
+    GatewayWrite32(Response + 12, Lifetime);
+    return 16;
+}
+
+/**
+* Builds the answer to a PCP request.
+*
+* @return Bytes of the answer, 0 for none.
+*/
+static
+INT
+GatewayAnswerPcp(
+    _Inout_ PGATEWAY pGateway,
+    _In_    const UINT8* Request,
+    _In_    INT RequestSize,
+    _Out_   PUINT8 Response
+)
+{
+    UINT8 Opcode = Request[1];
+
+    if (!pGateway->IsPcp)
+    {
+        // a NAT-PMP only server answers with the NAT-PMP version
+        ZeroMemory(Response, 8);
+        Response[0] = NATPMP_VERSION;
+        Response[1] = 0x80 | Opcode;
+        GatewayWrite16(Response + 2, GATEWAY_RESULT_UNSUPPORTED_VERSION);
+        return 8;
+    }
+
+    if (Opcode != GATEWAY_PCP_OPCODE_MAP || RequestSize < GATEWAY_PCP_HEADER_SIZE + GATEWAY_PCP_MAP_SIZE)
+    {
+        return 0;
+    }
+
+    const UINT8* Map = Request + GATEWAY_PCP_HEADER_SIZE;
+    UINT16 InternalPort = GatewayRead16(Map + 16);
+    UINT32 Lifetime = GatewayRead32(Request + 4);
+    UINT16 ExternalPort = GatewayMap(pGateway, Map[12], InternalPort, &Lifetime);
+
+    ZeroMemory(Response, GATEWAY_PCP_HEADER_SIZE + GATEWAY_PCP_MAP_SIZE);
+    Response[0] = PCP_VERSION;
+    Response[1] = 0x80 | Opcode;
+    GatewayWrite32(Response + 4, Lifetime);
+    GatewayWrite32(Response + 8, (UINT32)(GetTickCount64() / 1000));
+
+    // the nonce, protocol and internal port come back as they were sent
+    PUINT8 ResponseMap = Response + GATEWAY_PCP_HEADER_SIZE;
+    memcpy(ResponseMap, Map, 20);
+    GatewayWrite16(ResponseMap + 18, ExternalPort);
+    ResponseMap[30] = 0xFF;
+    ResponseMap[31] = 0xFF;
+    inet_pton(AF_INET, GATEWAY_PUBLIC_ADDRESS, ResponseMap + 32);
+    return GATEWAY_PCP_HEADER_SIZE + GATEWAY_PCP_MAP_SIZE;
+}
+
+static
+DWORD
+WINAPI
+GatewayThread(
+    _In_ LPVOID lpData
+)
+{
+    PGATEWAY pGateway = (PGATEWAY)lpData;
+    UINT8 Request[NATPMP_MAX_RESPONSE_SIZE];
+    UINT8 Response[NATPMP_MAX_RESPONSE_SIZE];
+
+    while (pGateway->Running)
+    {
+        struct sockaddr_in From;
+        socklen_t FromSize = sizeof(From);
+
+        INT Received = recvfrom(pGateway->Socket, (PSTR)Request, sizeof(Request), 0, (struct sockaddr*)&From, &FromSize);
+        if (Received < 2)
+        {
+            continue; // timed out, Running is checked again
+        }
+
+        LONG Index = InterlockedIncrement(&pGateway->Requests) - 1;
+        if (Index < GATEWAY_MAX_REQUESTS)
+        {
+            pGateway->Arrivals[Index] = GetTickCount64();
+        }
+
+        if (pGateway->Ignore > 0)
+        {
+            InterlockedDecrement(&pGateway->Ignore);
+            continue;
+        }
+
+        INT Length = (Request[0] == PCP_VERSION) ? GatewayAnswerPcp(pGateway, Request, Received, Response)
+                                                 : GatewayAnswerNatPmp(pGateway, Request, Received, Response);
+        if (Length > 0)
+        {
+            sendto(pGateway->Socket, (PCSTR)Response, Length, 0, (struct sockaddr*)&From, FromSize);
+        }
+    }
+
+    return 0;
+}
+
+static
+BOOL
+GatewayStart(
+    _Out_ PGATEWAY pGateway,
+    _In_  UINT16 Port,
+    _In_  BOOL IsPcp,
+    _Out_ struct sockaddr_in* pAddress
+)
+{
+    ZeroMemory(pGateway, sizeof(*pGateway));
+    pGateway->IsPcp = IsPcp;
+    pGateway->Running = TRUE;
+
+    ZeroMemory(pAddress, sizeof(*pAddress));
+    pAddress->sin_family = AF_INET;
+    pAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pAddress->sin_port = htons(Port);
+
+    pGateway->Socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (pGateway->Socket == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+
+    if (bind(pGateway->Socket, (struct sockaddr*)pAddress, sizeof(*pAddress)) == SOCKET_ERROR ||
+        !NetSetReceiveTimeout(pGateway->Socket, 100))
+    {
+        closesocket(pGateway->Socket);
+        return FALSE;
+    }
+
+    pGateway->Thread = CreateThread(NULL, 0, GatewayThread, pGateway, 0, NULL);
+    if (pGateway->Thread == NULL)
+    {
+        closesocket(pGateway->Socket);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+VOID
+GatewayStop(
+    _Inout_ PGATEWAY pGateway
+)
+{
+    pGateway->Running = FALSE;
+    WaitForSingleObject(pGateway->Thread, INFINITE);
+    CloseHandle(pGateway->Thread);
+    closesocket(pGateway->Socket);
+}
+
+/**
+* Maps a port, renews and deletes the mapping, and asks for the public address.
+*/
+static
+BOOL
+GatewayRunMappings(
+    _In_ UINT16 Port,
+    _In_ BOOL IsPcp
+)
+{
+    GATEWAY Gateway;
+    struct sockaddr_in Address;
+    NATPMP_MAPPING Mapping;
+    NATPMP_MAPPING Renewed;
+    NATPMP_MAPPING Deleted;
+    CHAR PublicIp[INET_ADDRSTRLEN];
+
+    printf("%s gateway\n", IsPcp ? "PCP" : "NAT-PMP");
+
+    if (!TestCheck(GatewayStart(&Gateway, Port, IsPcp, &Address), "gateway did not start on port %u", Port))
+    {
+        return FALSE;
+    }
+
+    // a PCP gateway hands out the address with a mapping of its own, which has to be deleted
+    BOOL Passed =
+        TestCheck(NatPmpGetPublicIpAddress(&Address, PublicIp, sizeof(PublicIp)), "no public address") &&
+        TestCheck(strcmp(PublicIp, GATEWAY_PUBLIC_ADDRESS) == 0, "public address %s", PublicIp) &&
+        TestCheck(Gateway.MappingCount == 0, "gateway holds %ld mappings after the address was asked for", (long)Gateway.MappingCount);
+
+    Passed = Passed &&
+        TestCheck(NatPmpAddPortMapping(&Address, NATPMP_PROTOCOL_UDP, GATEWAY_INTERNAL_PORT, NATPMP_DEFAULT_LIFETIME, &Mapping), "port was not mapped") &&
+        TestCheck(Mapping.IsPcp == IsPcp, "mapped with the wrong protocol") &&
+        TestCheck(Mapping.InternalPort == GATEWAY_INTERNAL_PORT, "mapped internal port %u", Mapping.InternalPort) &&
+        TestCheck(Mapping.ExternalPort == GATEWAY_INTERNAL_PORT + GATEWAY_PORT_OFFSET, "mapped external port %u", Mapping.ExternalPort) &&
+        TestCheck(Mapping.Lifetime == GATEWAY_MAX_LIFETIME, "mapped for %lu seconds, not the lifetime granted", (unsigned long)Mapping.Lifetime) &&
+        TestCheck(strcmp(Mapping.PublicIp, GATEWAY_PUBLIC_ADDRESS) == 0, "mapped on address %s", Mapping.PublicIp);
+
+    Passed = Passed &&
+        TestCheck(NatPmpAddPortMapping(&Address, NATPMP_PROTOCOL_UDP, GATEWAY_INTERNAL_PORT, 600, &Renewed), "mapping was not renewed") &&
+        TestCheck(Renewed.ExternalPort == Mapping.ExternalPort, "renewal moved the mapping to port %u", Renewed.ExternalPort) &&
+        TestCheck(Renewed.Lifetime == 600, "renewed for %lu seconds", (unsigned long)Renewed.Lifetime) &&
+        TestCheck(Gateway.MappingCount == 1, "gateway holds %ld mappings after the renewal", (long)Gateway.MappingCount);
+
+    Passed = Passed &&
+        TestCheck(NatPmpAddPortMapping(&Address, NATPMP_PROTOCOL_UDP, GATEWAY_INTERNAL_PORT, 0, &Deleted), "mapping was not deleted") &&
+        TestCheck(Deleted.Lifetime == 0, "deleted mapping still has %lu seconds", (unsigned long)Deleted.Lifetime) &&
+        TestCheck(Gateway.MappingCount == 0, "gateway holds %ld mappings after the delete", (long)Gateway.MappingCount);
+
+    GatewayStop(&Gateway);
+    return Passed;
+}
+
+/**
+* Checks a retransmission came the doubled timeout after the one before it.
+*/
+static
+BOOL
+GatewayCheckInterval(
+    _In_ const GATEWAY* pGateway,
+    _In_ LONG Request,
+    _In_ DWORD Expected
+)
+{
+    LONG64 Interval = (LONG64)(pGateway->Arrivals[Request] - pGateway->Arrivals[Request - 1]);
+
+    return TestCheck(Interval >= (LONG64)Expected - GATEWAY_TIMING_EARLY && Interval <= (LONG64)Expected + GATEWAY_TIMING_LATE,
+                     "request %ld came %lld ms after the one before, expected %lu ms", (long)Request + 1, (long long)Interval, (unsigned long)Expected);
+}
+
+/**
+* Leaves requests unanswered, once until the last attempt and once for good.
+*/
+static
+BOOL
+GatewayRunRetransmissions(
+    _In_ UINT16 Port
+)
+{
+    GATEWAY Gateway;
+    struct sockaddr_in Address;
+    CHAR PublicIp[INET_ADDRSTRLEN];
+
+    printf("retransmissions\n");
+
+    if (!TestCheck(GatewayStart(&Gateway, Port, FALSE, &Address), "gateway did not start on port %u", Port))
+    {
+        return FALSE;
+    }
+
+    // answered on the last attempt
+    Gateway.Ignore = NATPMP_MAX_ATTEMPTS - 1;
+    BOOL Passed =
+        TestCheck(NatPmpGetPublicIpAddress(&Address, PublicIp, sizeof(PublicIp)), "no public address on the last attempt") &&
+        TestCheck(Gateway.Requests == NATPMP_MAX_ATTEMPTS, "gateway got %ld requests", (long)Gateway.Requests) &&
+        GatewayCheckInterval(&Gateway, 1, NATPMP_INITIAL_TIMEOUT) &&
+        GatewayCheckInterval(&Gateway, 2, NATPMP_INITIAL_TIMEOUT * 2);
+
+    if (Passed)
+    {
+        printf("  answered after %llu ms\n", (unsigned long long)(Gateway.Arrivals[2] - Gateway.Arrivals[0]));
+    }
+
+    // never answered, the client gives up after the last timeout
+    Gateway.Requests = 0;
+    Gateway.Ignore = NATPMP_MAX_ATTEMPTS;
+
+    ULONGLONG Start = GetTickCount64();
+    BOOL Answered = NatPmpGetPublicIpAddress(&Address, PublicIp, sizeof(PublicIp));
+    ULONGLONG Elapsed = GetTickCount64() - Start;
+    DWORD Schedule = NATPMP_INITIAL_TIMEOUT * ((1 << NATPMP_MAX_ATTEMPTS) - 1);
+
+    Passed = Passed &&
+        TestCheck(!Answered, "an unanswered gateway gave an address") &&
+        TestCheck(Gateway.Requests == NATPMP_MAX_ATTEMPTS, "gateway got %ld requests", (long)Gateway.Requests) &&
+        GatewayCheckInterval(&Gateway, 1, NATPMP_INITIAL_TIMEOUT) &&
+        GatewayCheckInterval(&Gateway, 2, NATPMP_INITIAL_TIMEOUT * 2) &&
+        TestCheck(Elapsed + GATEWAY_TIMING_EARLY >= Schedule && Elapsed <= Schedule + GATEWAY_TIMING_LATE,
+                  "gave up after %llu ms, expected %lu ms", (unsigned long long)Elapsed, (unsigned long)Schedule);
+
+    if (Passed)
+    {
+        printf("  gave up after %llu ms\n", (unsigned long long)Elapsed);
+    }
+
+    GatewayStop(&Gateway);
+    return Passed;
+}
+
+INT main(
+    INT   argc,
+    PSTR* argv
+)
+{
+    if (argc < 2)
+    {
+        printf("usage: gateway <port>\n");
+        return 2;
+    }
+
+    if (!TestInitialise())
+    {
+        return 1;
+    }
+
+    UINT16 Port = (UINT16)atoi(argv[1]);
+
+    BOOL Passed = GatewayRunMappings(Port, FALSE);
+    Passed = GatewayRunMappings(Port, TRUE) && Passed;
+    Passed = GatewayRunRetransmissions(Port) && Passed;
+
+    TestCleanUp();
+    printf("%s\n", Passed ? "passed" : "FAILED");
+    return Passed ? 0 : 1;
+}
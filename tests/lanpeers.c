@@ -0,0 +1,186 @@
+#include "testing.h"
+#include "ssdp.h"
+
+/**
+    * LAN peer discovery between clients in processes of their own on one host.
+    *
+    *     lanpeers <port>
+    *
+    * The test advertises itself, then starts the peers one at a time, each only once the ones
+    * before it were found. A peer learns of those already running from their answers to its
+    * M-SEARCH and of those started after it from their ssdp:alive NOTIFY, so both paths have to
+    * work for every peer to find every other. Once the test has found them all it stops
+    * advertising, and every peer has to see its ssdp:byebye and drop it from the table long before
+    * its max-age runs out. Everything goes through the SSDP port and group with multicast looped
+    * back, as between clients on one machine.
+    *
+    * Client ids and the ports in LOCATION are the port given and the ones after it, the test's
+    * own first.
+    *
+    * Role the test starts itself with:
+    *
+    *     lanpeers peer <port> <index>
+*/
+
+#define LAN_PEERS_COUNT 3           // peers started, besides the test itself
+#define LAN_PEERS_TIMEOUT 10000     // milliseconds to find a peer or see it leave
+#define LAN_PEERS_ADDRESS "127.0.0.1"
+
+/**
+* Advertises client Index of those the test runs, with the port after FirstPort as its endpoint.
+*/
+static
+BOOL
+LanPeersStart(
+    _Out_ PSSDP_ADVERTISER pAdvertiser,
+    _In_  UINT16 FirstPort,
+    _In_  UINT16 Index
+)
+{
+    struct sockaddr_in Endpoint;
+    memset(&Endpoint, 0, sizeof(Endpoint));
+    Endpoint.sin_family = AF_INET;
+    Endpoint.sin_port = htons(FirstPort + Index);
+    inet_pton(AF_INET, LAN_PEERS_ADDRESS, &Endpoint.sin_addr);
+
+    return SsdpStartAdvertiser(pAdvertiser, FirstPort + Index, &Endpoint);
+}
+
+/**
+* Waits until a client is in the table, and checks the endpoint it advertised.
+*/
+static
+BOOL
+LanPeersWaitFound(
+    _In_ PSSDP_ADVERTISER pAdvertiser,
+    _In_ UINT16 FirstPort,
+    _In_ UINT16 Index
+)
+{
+    ULONGLONG Deadline = GetTickCount64() + LAN_PEERS_TIMEOUT;
+    LAN_PEER Peer;
+
+    while (!SsdpFindLanPeer(pAdvertiser, FirstPort + Index, &Peer))
+    {
+        if (GetTickCount64() >= Deadline)
+        {
+            return TestCheck(FALSE, "client %u did not find client %u", pAdvertiser->ClientId, (UINT)(FirstPort + Index));
+        }
+        Sleep(10);
+    }
+
+    CHAR AddrStr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &Peer.Endpoint.sin_addr, AddrStr, INET_ADDRSTRLEN);
+
+    return TestCheck(strcmp(AddrStr, LAN_PEERS_ADDRESS) == 0 && ntohs(Peer.Endpoint.sin_port) == FirstPort + Index,
+                     "client %u found client %u at %s:%u", pAdvertiser->ClientId, (UINT)(FirstPort + Index), AddrStr, (UINT)ntohs(Peer.Endpoint.sin_port));
+}
+
+/**
+* Runs a peer: finds the test and every other peer, whenever they started, then waits for the
+* test's ssdp:byebye.
+*
+* @return 0 if it found them all and saw the test leave.
+*/
+static
+INT
+LanPeersPeer(
+    _In_ UINT16 FirstPort,
+    _In_ UINT16 Index
+)
+{
+    SSDP_ADVERTISER Advertiser;
+    BOOL Found[LAN_PEERS_COUNT + 1] = { 0 };
+    LAN_PEER Peer;
+
+    if (!TestCheck(LanPeersStart(&Advertiser, FirstPort, Index), "client %u could not advertise", (UINT)(FirstPort + Index)))
+    {
+        return 1;
+    }
+
+    // the test may leave as soon as it found the last peer, so every client counts once seen
+    ULONGLONG Deadline = GetTickCount64() + LAN_PEERS_TIMEOUT * LAN_PEERS_COUNT;
+    BOOL Passed = FALSE;
+
+    while (!Passed && GetTickCount64() < Deadline)
+    {
+        Passed = TRUE;
+        for (UINT16 i = 0; i <= LAN_PEERS_COUNT; ++i)
+        {
+            Found[i] = Found[i] || i == Index || SsdpFindLanPeer(&Advertiser, FirstPort + i, &Peer);
+            Passed = Passed && Found[i];
+        }
+        Sleep(10);
+    }
+
+    for (UINT16 i = 0; i <= LAN_PEERS_COUNT; ++i)
+    {
+        Passed = TestCheck(Found[i], "client %u did not find client %u", (UINT)(FirstPort + Index), (UINT)(FirstPort + i)) && Passed;
+    }
+
+    if (Passed)
+    {
+        Deadline = GetTickCount64() + LAN_PEERS_TIMEOUT;
+        while (SsdpFindLanPeer(&Advertiser, FirstPort, &Peer) && GetTickCount64() < Deadline)
+        {
+            Sleep(10);
+        }
+
+        Passed = TestCheck(!SsdpFindLanPeer(&Advertiser, FirstPort, &Peer), "client %u kept client %u after its byebye", (UINT)(FirstPort + Index), (UINT)FirstPort);
+    }
+
+    SsdpStopAdvertiser(&Advertiser);
+    return Passed ? 0 : 1;
+}
+
+INT main(
+    INT   argc,
+    PSTR* argv
+)
+{
+    if (argc < 2)
+    {
+        printf("usage: lanpeers <port>\n");
+        return 2;
+    }
+
+    if (!TestInitialise())
+    {
+        return 1;
+    }
+
+    if (strcmp(argv[1], "peer") == 0 && argc == 4)
+    {
+        INT Result = LanPeersPeer((UINT16)atoi(argv[2]), (UINT16)atoi(argv[3]));
+        TestCleanUp();
+        return Result;
+    }
+
+    UINT16 FirstPort = (UINT16)atoi(argv[1]);
+    HANDLE Peers[LAN_PEERS_COUNT] = { 0 };
+    SSDP_ADVERTISER Advertiser;
+
+    BOOL Passed = TestCheck(LanPeersStart(&Advertiser, FirstPort, 0), "could not advertise");
+
+    for (UINT16 i = 1; Passed && i <= LAN_PEERS_COUNT; ++i)
+    {
+        Peers[i - 1] = TestStartRole("peer %u %u", (UINT)FirstPort, (UINT)i);
+        Passed = TestCheck(Peers[i - 1] != NULL, "peer %u did not start", (UINT)i) &&
+                 LanPeersWaitFound(&Advertiser, FirstPort, i);
+    }
+
+    // the byebye tells the peers to finish
+    SsdpStopAdvertiser(&Advertiser);
+
+    for (UINT16 i = 0; i < LAN_PEERS_COUNT; ++i)
+    {
+        if (Peers[i] != NULL)
+        {
+            Passed = TestCheck(TestStopProcess(Peers[i], Passed ? LAN_PEERS_TIMEOUT : 0) == 0, "peer %u failed", (UINT)(i + 1)) && Passed;
+        }
+    }
+
+    TestCleanUp();
+    printf("%s\n", Passed ? "passed" : "FAILED");
+    return Passed ? 0 : 1;
+}
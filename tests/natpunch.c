@@ -0,0 +1,688 @@
+#include "testing.h"
+#include "peer.h"
+
+#include <poll.h>
+
+/**
+    * Hole punching between clients behind simulated NATs, and pairing a client away from its peer.
+    *
+    *     natpunch <server> <port>
+    *
+    * Every client runs in a process of its own behind a NAT that runs in a process of its own, on
+    * the ports after the server's. The program is linked with sendto and recvfrom wrapped: in a
+    * client, every datagram goes to its NAT with the address it was meant for in front, and only
+    * datagrams from its NAT are received, with the address the NAT got them from. A client's
+    * private endpoint is then as unreachable from the other client as on another LAN, and the
+    * other client is only heard through the mappings its NAT made.
+    *
+    *     cone       one mapping for every remote, which a remote may send through once the inside
+    *                sent to it, so the clients punch through and chat over the direct path
+    *     symmetric  a mapping of its own for every remote, the endpoint the server saw is of no use
+    *                to the other client, so the punch times out and chat stays on the relay
+    *
+    * Roles the test starts itself with:
+    *
+    *     natpunch nat <cone|symmetric> <port>
+    *     natpunch client <server port> <nat port> <direct|relay> <id file> [peer id]
+*/
+
+#define NAT_PUNCH_MAX_MAPPINGS 16
+#define NAT_PUNCH_MAX_PERMITTED 8          // remotes a mapping lets in
+#define NAT_PUNCH_MAX_DATAGRAM 4096        // bytes of a datagram passed through a NAT
+#define NAT_PUNCH_ROLE_TIMEOUT 20000       // milliseconds a client may take to punch and chat
+#define NAT_PUNCH_ID_TIMEOUT 10000         // milliseconds the first client has to write its id
+#define NAT_PUNCH_LINGER 1000              // milliseconds a client stays to acknowledge what its peer sent last
+#define NAT_PUNCH_ID_FILE "tests\\natpunch-%s.id"
+
+/**
+* What a client puts in front of a datagram for its NAT and its NAT in front of what it passes on:
+* the remote end of the datagram.
+*/
+typedef struct _NAT_PUNCH_HEADER
+{
+    UINT32 Address;                        // network byte order
+    UINT16 Port;                           // network byte order
+    UINT16 Reserved;
+} NAT_PUNCH_HEADER, *PNAT_PUNCH_HEADER;
+
+typedef struct _NAT_PUNCH_MAPPING
+{
+    struct sockaddr_in Inside;             // the client's socket
+    struct sockaddr_in Remote;             // symmetric only, the one remote the mapping is for
+    SOCKET             Outside;
+    struct sockaddr_in Permitted[NAT_PUNCH_MAX_PERMITTED];
+    ULONG              PermittedCount;
+} NAT_PUNCH_MAPPING, *PNAT_PUNCH_MAPPING;
+
+// the NAT a client's datagrams go through, none outside of the client role
+static struct sockaddr_in GlobalNatAddress;
+
+//////////////////////////////////////////
+//
+//          WRAPPED SOCKET CALLS
+//
+//////////////////////////////////////////
+
+ssize_t
+__real_sendto(
+    int Socket,
+    const void* Buffer,
+    size_t Length,
+    int Flags,
+    const struct sockaddr* To,
+    socklen_t ToLength
+);
+
+ssize_t
+__real_recvfrom(
+    int Socket,
+    void* Buffer,
+    size_t Length,
+    int Flags,
+    struct sockaddr* From,
+    socklen_t* FromLength
+);
+
+/**
+* @return TRUE if both are the same IPv4 endpoint.
+*/
+static
+BOOL
+NatPunchSameEndpoint(
+    _In_ const struct sockaddr_in* pFirst,
+    _In_ const struct sockaddr_in* pSecond
+)
+{
+    return pFirst->sin_addr.s_addr == pSecond->sin_addr.s_addr && pFirst->sin_port == pSecond->sin_port;
+}
+
+/**
+* Sends a datagram to the client's NAT with where it was meant to go in front.
+*/
+ssize_t
+__wrap_sendto(
+    int Socket,
+    const void* Buffer,
+    size_t Length,
+    int Flags,
+    const struct sockaddr* To,
+    socklen_t ToLength
+)
+{
+    CHAR Datagram[sizeof(NAT_PUNCH_HEADER) + NAT_PUNCH_MAX_DATAGRAM];
+
+    if (GlobalNatAddress.sin_port == 0 || To == NULL || To->sa_family != AF_INET ||
+        Length > sizeof(Datagram) - sizeof(NAT_PUNCH_HEADER))
+    {
+        return __real_sendto(Socket, Buffer, Length, Flags, To, ToLength);
+    }
+
+    const struct sockaddr_in* pTo = (const struct sockaddr_in*)To;
+    PNAT_PUNCH_HEADER pHeader = (PNAT_PUNCH_HEADER)Datagram;
+    pHeader->Address = pTo->sin_addr.s_addr;
+    pHeader->Port = pTo->sin_port;
+    pHeader->Reserved = 0;
+    memcpy(Datagram + sizeof(NAT_PUNCH_HEADER), Buffer, Length);
+
+    ssize_t Sent = __real_sendto(
+        Socket,
+        Datagram,
+        sizeof(NAT_PUNCH_HEADER) + Length,
+        Flags,
+        (const struct sockaddr*)&GlobalNatAddress,
+        sizeof(GlobalNatAddress)
+    );
+
+    return (Sent < 0) ? Sent : (ssize_t)Length;
+}
+
+/**
+* Receives a datagram the client's NAT passed on, as if from where the NAT got it. Anything else
+* never got past the NAT and is dropped as if nothing had arrived.
+*/
+ssize_t
+__wrap_recvfrom(
+    int Socket,
+    void* Buffer,
+    size_t Length,
+    int Flags,
+    struct sockaddr* From,
+    socklen_t* FromLength
+)
+{
+    CHAR Datagram[sizeof(NAT_PUNCH_HEADER) + NAT_PUNCH_MAX_DATAGRAM];
+    struct sockaddr_in Sender;
+    socklen_t SenderLength = sizeof(Sender);
+
+    if (GlobalNatAddress.sin_port == 0)
+    {
+        return __real_recvfrom(Socket, Buffer, Length, Flags, From, FromLength);
+    }
+
+    ssize_t Received = __real_recvfrom(Socket, Datagram, sizeof(Datagram), Flags, (struct sockaddr*)&Sender, &SenderLength);
+    if (Received < 0)
+    {
+        return Received;
+    }
+
+    if (Received < (ssize_t)sizeof(NAT_PUNCH_HEADER) || !NatPunchSameEndpoint(&Sender, &GlobalNatAddress))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    const NAT_PUNCH_HEADER* pHeader = (const NAT_PUNCH_HEADER*)Datagram;
+    struct sockaddr_in Remote;
+    ZeroMemory(&Remote, sizeof(Remote));
+    Remote.sin_family = AF_INET;
+    Remote.sin_addr.s_addr = pHeader->Address;
+    Remote.sin_port = pHeader->Port;
+
+    if (From != NULL && FromLength != NULL)
+    {
+        memcpy(From, &Remote, min((size_t)*FromLength, sizeof(Remote)));
+        *FromLength = sizeof(Remote);
+    }
+
+    size_t Payload = min((size_t)Received - sizeof(NAT_PUNCH_HEADER), Length);
+    memcpy(Buffer, Datagram + sizeof(NAT_PUNCH_HEADER), Payload);
+    return (ssize_t)Payload;
+}
+
+//////////////////////////////////////////
+//
+//          ROLES
+//
+//////////////////////////////////////////
+
+/**
+* Sets an IPv4 endpoint on the loopback address.
+*/
+static
+VOID
+NatPunchLoopback(
+    _Out_ struct sockaddr_in* pAddress,
+    _In_  UINT16 Port
+)
+{
+    ZeroMemory(pAddress, sizeof(*pAddress));
+    pAddress->sin_family = AF_INET;
+    pAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pAddress->sin_port = htons(Port);
+}
+
+/**
+* Finds the mapping of an inside endpoint towards a remote, making it on first use.
+*/
+static
+PNAT_PUNCH_MAPPING
+NatPunchMap(
+    _Inout_ PNAT_PUNCH_MAPPING Mappings,
+    _Inout_ ULONG* pCount,
+    _In_    BOOL IsSymmetric,
+    _In_    const struct sockaddr_in* pInside,
+    _In_    const struct sockaddr_in* pRemote
+)
+{
+    for (ULONG i = 0; i < *pCount; ++i)
+    {
+        if (NatPunchSameEndpoint(&Mappings[i].Inside, pInside) &&
+            (!IsSymmetric || NatPunchSameEndpoint(&Mappings[i].Remote, pRemote)))
+        {
+            return &Mappings[i];
+        }
+    }
+
+    if (*pCount == NAT_PUNCH_MAX_MAPPINGS)
+    {
+        return NULL;
+    }
+
+    struct sockaddr_in Any;
+    NatPunchLoopback(&Any, 0);
+
+    SOCKET Outside = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (Outside == INVALID_SOCKET || bind(Outside, (struct sockaddr*)&Any, sizeof(Any)) == SOCKET_ERROR)
+    {
+        return NULL;
+    }
+
+    PNAT_PUNCH_MAPPING pMapping = &Mappings[(*pCount)++];
+    ZeroMemory(pMapping, sizeof(*pMapping));
+    pMapping->Inside = *pInside;
+    pMapping->Remote = *pRemote;
+    pMapping->Outside = Outside;
+    return pMapping;
+}
+
+/**
+* Passes datagrams between the clients behind it and everyone else until it is ended.
+*/
+static
+INT
+NatPunchNat(
+    _In_ PCSTR Mode,
+    _In_ UINT16 Port
+)
+{
+    NAT_PUNCH_MAPPING Mappings[NAT_PUNCH_MAX_MAPPINGS];
+    ULONG Count = 0;
+    CHAR Datagram[sizeof(NAT_PUNCH_HEADER) + NAT_PUNCH_MAX_DATAGRAM];
+    BOOL IsSymmetric = strcmp(Mode, "symmetric") == 0;
+
+    struct sockaddr_in Address;
+    NatPunchLoopback(&Address, Port);
+
+    SOCKET Inside = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (Inside == INVALID_SOCKET || bind(Inside, (struct sockaddr*)&Address, sizeof(Address)) == SOCKET_ERROR)
+    {
+        printf("NAT cannot listen on port %u: %d\n", Port, WSAGetLastError());
+        return 1;
+    }
+
+    while (TRUE)
+    {
+        struct pollfd Polls[1 + NAT_PUNCH_MAX_MAPPINGS];
+        Polls[0].fd = Inside;
+        Polls[0].events = POLLIN;
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            Polls[1 + i].fd = Mappings[i].Outside;
+            Polls[1 + i].events = POLLIN;
+        }
+
+        if (poll(Polls, 1 + Count, -1) <= 0)
+        {
+            continue;
+        }
+
+        struct sockaddr_in From;
+        socklen_t FromLength = sizeof(From);
+
+        // out: map the client's socket and let the remote answer through the mapping
+        if (Polls[0].revents & POLLIN)
+        {
+            INT Received = recvfrom(Inside, Datagram, sizeof(Datagram), 0, (struct sockaddr*)&From, &FromLength);
+            if (Received >= (INT)sizeof(NAT_PUNCH_HEADER))
+            {
+                const NAT_PUNCH_HEADER* pHeader = (const NAT_PUNCH_HEADER*)Datagram;
+                struct sockaddr_in Remote;
+                ZeroMemory(&Remote, sizeof(Remote));
+                Remote.sin_family = AF_INET;
+                Remote.sin_addr.s_addr = pHeader->Address;
+                Remote.sin_port = pHeader->Port;
+
+                PNAT_PUNCH_MAPPING pMapping = NatPunchMap(Mappings, &Count, IsSymmetric, &From, &Remote);
+                if (pMapping != NULL)
+                {
+                    ULONG i = 0;
+                    while (i < pMapping->PermittedCount && !NatPunchSameEndpoint(&pMapping->Permitted[i], &Remote))
+                    {
+                        ++i;
+                    }
+
+                    if (i == pMapping->PermittedCount && i < NAT_PUNCH_MAX_PERMITTED)
+                    {
+                        pMapping->Permitted[pMapping->PermittedCount++] = Remote;
+                    }
+
+                    sendto(pMapping->Outside, Datagram + sizeof(NAT_PUNCH_HEADER), Received - sizeof(NAT_PUNCH_HEADER), 0,
+                           (struct sockaddr*)&Remote, sizeof(Remote));
+                }
+            }
+        }
+
+        // in: only from remotes the client sent to through the same mapping
+        for (ULONG m = 0; m < Count; ++m)
+        {
+            if (!(Polls[1 + m].revents & POLLIN))
+            {
+                continue;
+            }
+
+            PNAT_PUNCH_MAPPING pMapping = &Mappings[m];
+            FromLength = sizeof(From);
+
+            INT Received = recvfrom(pMapping->Outside, Datagram + sizeof(NAT_PUNCH_HEADER), NAT_PUNCH_MAX_DATAGRAM, 0,
+                                    (struct sockaddr*)&From, &FromLength);
+            if (Received < 0)
+            {
+                continue;
+            }
+
+            BOOL IsPermitted = FALSE;
+            for (ULONG i = 0; i < pMapping->PermittedCount && !IsPermitted; ++i)
+            {
+                IsPermitted = NatPunchSameEndpoint(&pMapping->Permitted[i], &From);
+            }
+
+            if (IsPermitted)
+            {
+                PNAT_PUNCH_HEADER pHeader = (PNAT_PUNCH_HEADER)Datagram;
+                pHeader->Address = From.sin_addr.s_addr;
+                pHeader->Port = From.sin_port;
+                pHeader->Reserved = 0;
+
+                sendto(Inside, Datagram, sizeof(NAT_PUNCH_HEADER) + Received, 0,
+                       (struct sockaddr*)&pMapping->Inside, sizeof(pMapping->Inside));
+            }
+        }
+    }
+}
+
+/**
+* Waits until the direct path has carried a chat message each way.
+*/
+static
+BOOL
+NatPunchWaitDirect(
+    _In_ PPEER_SESSION pSession
+)
+{
+    ULONGLONG Deadline = GetTickCount64() + TEST_REPLY_TIMEOUT;
+    BOOL IsDone = FALSE;
+
+    while (!IsDone && GetTickCount64() < Deadline)
+    {
+        Sleep(10);
+
+        EnterCriticalSection(&pSession->Transport.Lock);
+        IsDone = pSession->Transport.ReceiveNext >= 1 && pSession->Transport.SendUnacked >= 1;
+        LeaveCriticalSection(&pSession->Transport.Lock);
+    }
+
+    return IsDone;
+}
+
+/**
+* A client behind a NAT: registers, is paired, punches and chats over whichever path it ends up
+* with, which has to be the one expected.
+*/
+static
+INT
+NatPunchClient(
+    _In_     PCSTR ServerPort,
+    _In_     UINT16 NatPort,
+    _In_     PCSTR Expected,
+    _In_     PCSTR IdFile,
+    _In_opt_ PCSTR PeerId
+)
+{
+    TEST_CLIENT Client;
+    PEER_SESSION Session;
+    REGISTER_ENDPOINT_MESSAGE Register;
+
+    NatPunchLoopback(&GlobalNatAddress, NatPort);
+
+    if (!TestCheck(TestConnectClient(&Client, ServerPort), "client did not connect through its NAT"))
+    {
+        return 1;
+    }
+
+    if (!TestCheck(PeerSessionInitialise(&Session, Client.Socket, Client.ClientId, Client.Token), "no peer session") ||
+        !TestCheck(PeerSessionRegister(&Session, &Register.Private), "peer socket was not registered through the NAT") ||
+        !TestCheck(NetMuxSend(&Client.Mux, STREAM_CONTROL, MESSAGE_TYPE_REGISTER_ENDPOINT, &Register, sizeof(Register)) == NET_IO_COMPLETE,
+                   "private endpoint was not sent"))
+    {
+        PeerSessionCleanUp(&Session);
+        TestCloseClient(&Client);
+        return 1;
+    }
+
+    BOOL Passed = TRUE;
+    if (PeerId == NULL)
+    {
+        // the other client asks for us once it knows who we are
+        CHAR Written[MAX_PATH];
+        FILE* File = NULL;
+        _snprintf_s(Written, sizeof(Written), _TRUNCATE, "%s.tmp", IdFile);
+
+        Passed = fopen_s(&File, Written, "w") == 0;
+        if (Passed)
+        {
+            fprintf(File, "%u\n", Client.ClientId);
+            fclose(File);
+            Passed = MoveFileExA(Written, IdFile, MOVEFILE_REPLACE_EXISTING);
+        }
+        TestCheck(Passed, "cannot write %s", IdFile);
+    }
+    else
+    {
+        PEER_CONNECT_MESSAGE Connect;
+        Connect.PeerId = htonl((UINT32)strtoul(PeerId, NULL, 10));
+        Passed = TestCheck(NetMuxSend(&Client.Mux, STREAM_CONTROL, MESSAGE_TYPE_PEER_CONNECT, &Connect, sizeof(Connect)) == NET_IO_COMPLETE,
+                           "cannot ask for the peer");
+    }
+
+    Passed = Passed && TestCheck(WaitForSingleObject(Client.Introduced, NAT_PUNCH_ROLE_TIMEOUT) == WAIT_OBJECT_0,
+                                 "client %u was not introduced", Client.ClientId);
+
+    PEER_PATH Path = PEER_PATH_NONE;
+    if (Passed)
+    {
+        PeerSessionBeginPunch(&Session, &Client.Endpoints);
+
+        ULONGLONG Deadline = GetTickCount64() + PEER_PUNCH_TIMEOUT + TEST_REPLY_TIMEOUT;
+        do
+        {
+            Sleep(10);
+
+            EnterCriticalSection(&Session.Lock);
+            Path = Session.Path;
+            LeaveCriticalSection(&Session.Lock);
+        } while (Path == PEER_PATH_PUNCHING && GetTickCount64() < Deadline);
+
+        if (Path == PEER_PATH_DIRECT)
+        {
+            Passed = TestCheck(strcmp(Expected, "direct") == 0, "client %u punched through, expected %s", Client.ClientId, Expected) &&
+                     TestCheck(PeerSessionSend(&Session, "direct", 6), "cannot chat over the direct path") &&
+                     TestCheck(NatPunchWaitDirect(&Session), "chat did not cross the direct path");
+        }
+        else
+        {
+            Passed = TestCheck(Path == PEER_PATH_RELAY, "client %u is still punching", Client.ClientId) &&
+                     TestCheck(strcmp(Expected, "relay") == 0, "client %u fell back to the relay, expected %s", Client.ClientId, Expected) &&
+                     TestCheck(TestSendChat(&Client, 1, "relayed"), "cannot chat over the relay");
+
+            ULONGLONG ChatDeadline = GetTickCount64() + TEST_REPLY_TIMEOUT;
+            while (Passed && Client.Chats < 1 && GetTickCount64() < ChatDeadline)
+            {
+                Sleep(10);
+            }
+            Passed = Passed && TestCheck(Client.Chats >= 1, "chat did not cross the relay");
+        }
+    }
+
+    if (Passed)
+    {
+        printf("  client %u chatted with client %u %s\n", Client.ClientId, Session.PeerId,
+               (Path == PEER_PATH_DIRECT) ? "directly" : "over the relay");
+        Sleep(NAT_PUNCH_LINGER);
+    }
+
+    PeerSessionCleanUp(&Session);
+    TestCloseClient(&Client);
+    return Passed ? 0 : 1;
+}
+
+//////////////////////////////////////////
+//
+//          TESTS
+//
+//////////////////////////////////////////
+
+/**
+* Runs two clients behind NATs of a kind and checks both end up on the path expected.
+*/
+static
+BOOL
+NatPunchRun(
+    _In_ PCSTR Port,
+    _In_ PCSTR Mode,
+    _In_ UINT16 FirstNatPort,
+    _In_ PCSTR Expected
+)
+{
+    CHAR IdFile[MAX_PATH];
+    CHAR Id[32] = { 0 };
+    BOOL Passed = TRUE;
+
+    printf("%s NATs\n", Mode);
+
+    _snprintf_s(IdFile, sizeof(IdFile), _TRUNCATE, NAT_PUNCH_ID_FILE, Mode);
+    DeleteFileA(IdFile);
+
+    HANDLE Nats[2];
+    Nats[0] = TestStartRole("nat %s %u", Mode, FirstNatPort);
+    Nats[1] = TestStartRole("nat %s %u", Mode, FirstNatPort + 1);
+
+    HANDLE Clients[2] = { NULL, NULL };
+    Clients[0] = TestStartRole("client %s %u %s \"%s\"", Port, FirstNatPort, Expected, IdFile);
+
+    // the second client asks for the first by its id
+    ULONGLONG Deadline = GetTickCount64() + NAT_PUNCH_ID_TIMEOUT;
+    while (Clients[0] != NULL && Id[0] == '\0' && GetTickCount64() < Deadline)
+    {
+        FILE* File = NULL;
+        if (fopen_s(&File, IdFile, "r") == 0)
+        {
+            if (fgets(Id, sizeof(Id), File) == NULL)
+            {
+                Id[0] = '\0';
+            }
+            fclose(File);
+        }
+
+        Id[strcspn(Id, "\r\n")] = '\0';
+        Sleep(20);
+    }
+
+    if (TestCheck(Id[0] != '\0', "first client did not start"))
+    {
+        Clients[1] = TestStartRole("client %s %u %s \"%s\" %s", Port, FirstNatPort + 1, Expected, IdFile, Id);
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(Clients); ++i)
+    {
+        Passed = Clients[i] != NULL &&
+                 TestCheck(TestStopProcess(Clients[i], NAT_PUNCH_ROLE_TIMEOUT) == 0, "client %lu failed", (unsigned long)(i + 1)) &&
+                 Passed;
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(Nats); ++i)
+    {
+        Passed = TestCheck(Nats[i] != NULL, "NAT %lu did not start", (unsigned long)(i + 1)) && Passed;
+        if (Nats[i] != NULL)
+        {
+            TestStopProcess(Nats[i], 0);
+        }
+    }
+
+    DeleteFileA(IdFile);
+    return Passed;
+}
+
+/**
+* Pairs a client with a second client and then with a third, the second has to be told it was
+* left and its chat no longer reaches the first.
+*/
+static
+BOOL
+NatPunchRepair(
+    _In_ PCSTR Port
+)
+{
+    TEST_CLIENT First;
+    TEST_CLIENT Second;
+    TEST_CLIENT Third;
+
+    printf("pairing away from a peer\n");
+
+    BOOL Passed = TestCheck(TestConnectClient(&First, Port), "first client did not connect");
+    Passed = TestCheck(TestConnectClient(&Second, Port), "second client did not connect") && Passed;
+    Passed = TestCheck(TestConnectClient(&Third, Port), "third client did not connect") && Passed;
+
+    Passed = Passed &&
+             TestCheck(TestPairClients(&First, &Second), "first and second client were not paired") &&
+             TestCheck(TestPairClients(&First, &Third), "first and third client were not paired");
+
+    ULONGLONG Deadline = GetTickCount64() + TEST_REPLY_TIMEOUT;
+    while (Passed && Second.Left == 0 && GetTickCount64() < Deadline)
+    {
+        WaitForSingleObject(Second.Answered, 100);
+    }
+
+    Passed = Passed &&
+             TestCheck(Second.Left == 1 && Second.PeerId == 0, "second client was not told the first paired with another") &&
+             TestCheck(TestSendChat(&Second, 1, "still there?"), "second client cannot chat") &&
+             TestCheck(TestSendChat(&First, 1, "hello third"), "first client cannot chat");
+
+    // the relay answers in order, once the pong is back both chat messages went wherever they go
+    Passed = Passed &&
+             TestCheck(TestPing(&Second, 1) && TestPing(&First, 1), "server no longer serves the clients");
+
+    Deadline = GetTickCount64() + TEST_REPLY_TIMEOUT;
+    while (Passed && Third.Chats == 0 && GetTickCount64() < Deadline)
+    {
+        Sleep(10);
+    }
+
+    Passed = Passed &&
+             TestCheck(First.Chats == 0, "second client's chat still reached the first") &&
+             TestCheck(Third.Chats == 1, "first client's chat did not reach the third") &&
+             TestCheck(First.Left == 0 && Third.Left == 0, "a paired client was told it was left");
+
+    TestCloseClient(&Third);
+    TestCloseClient(&Second);
+    TestCloseClient(&First);
+    return Passed;
+}
+
+INT main(
+    INT   argc,
+    PSTR* argv
+)
+{
+    if (argc < 3)
+    {
+        printf("usage: natpunch <server> <port>\n");
+        return 2;
+    }
+
+    if (!TestInitialise())
+    {
+        return 1;
+    }
+
+    INT Result;
+    if (strcmp(argv[1], "nat") == 0 && argc == 4)
+    {
+        Result = NatPunchNat(argv[2], (UINT16)atoi(argv[3]));
+    }
+    else if (strcmp(argv[1], "client") == 0 && argc >= 6)
+    {
+        Result = NatPunchClient(argv[2], (UINT16)atoi(argv[3]), argv[4], argv[5], (argc > 6) ? argv[6] : NULL);
+    }
+    else
+    {
+        CreateDirectoryA("tests", NULL);
+
+        HANDLE Process = TestStartServer(argv[1], argv[2]);
+        BOOL Passed = TestCheck(Process != NULL, "server did not start");
+
+        if (Passed)
+        {
+            UINT16 NatPort = (UINT16)(atoi(argv[2]) + 1);
+            Passed = NatPunchRepair(argv[2]);
+            Passed = NatPunchRun(argv[2], "cone", NatPort, "direct") && Passed;
+            Passed = NatPunchRun(argv[2], "symmetric", NatPort + 2, "relay") && Passed;
+            TestStopProcess(Process, 0);
+        }
+
+        printf("%s\n", Passed ? "passed" : "FAILED");
+        Result = Passed ? 0 : 1;
+    }
+
+    TestCleanUp();
+    return Result;
+}
@@ -0,0 +1,215 @@
+#include "testing.h"
+
+/**
+    * Rate limits of the relay server against a relayed file transfer.
+    *
+    *     relaylimits <server> <port>
+    *
+    * Runs a server with a byte limit well below the size of a file and, once with each of the
+    * "drop" and "disconnect" actions, has two paired clients send each other a file at the same
+    * time while both chat with messages longer than what their byte buckets keep free between
+    * two chunks. Each client hands back window for the file it receives from behind the chunks of
+    * the file it sends. The transfers are only ever delayed by the limit: both files have to
+    * arrive whole, every chat message has to be acknowledged and relayed, and both clients have
+    * to stay connected. A third client then floods chat past the message limit and has to get the
+    * action.
+    *
+    * The first file is offered over half a .part file of other bytes with no record of the file it
+    * came from, as an older client or another file of the same name leaves it, and has to be
+    * received again from the start.
+*/
+
+#define RELAY_LIMITS_CLIENT "50 262144"        // messages and bytes a second for each client
+#define RELAY_LIMITS_ADDRESS "200 1048576"     // the same for the address, every client is on loopback
+#define RELAY_LIMITS_FILE_SIZE ( 1024 * 1024 )
+#define RELAY_LIMITS_MIN_SECONDS 2             // a file takes at least this long under the client's byte limit
+#define RELAY_LIMITS_CHAT_INTERVAL 50          // milliseconds between chat messages, within the message limit
+#define RELAY_LIMITS_CHAT_LENGTH 1000          // bytes of chat text, more than a millisecond of the byte limit
+#define RELAY_LIMITS_FLOOD 200                 // chat messages sent back to back, four seconds' worth
+#define RELAY_LIMITS_TIMEOUT 30000             // milliseconds a transfer may take
+#define RELAY_LIMITS_UP "tests\\relaylimits-up.bin"
+#define RELAY_LIMITS_DOWN "tests\\relaylimits-down.bin"
+#define RELAY_LIMITS_RECEIVED_UP TEST_RECEIVE_DIRECTORY "\\relaylimits-up.bin"
+#define RELAY_LIMITS_RECEIVED_DOWN TEST_RECEIVE_DIRECTORY "\\relaylimits-down.bin"
+
+/**
+* Waits until a count reaches what is expected.
+*/
+static
+BOOL
+RelayLimitsWaitFor(
+    _In_ volatile LONG* Count,
+    _In_ LONG Expected
+)
+{
+    ULONGLONG Deadline = GetTickCount64() + TEST_REPLY_TIMEOUT;
+
+    while (*Count < Expected && GetTickCount64() < Deadline)
+    {
+        Sleep(10);
+    }
+
+    return *Count >= Expected;
+}
+
+/**
+* Has two clients send each other a file while both chat, then floods from a third.
+*/
+static
+BOOL
+RelayLimitsRun(
+    _In_ PCSTR Server,
+    _In_ PCSTR Port,
+    _In_ PCSTR Action
+)
+{
+    TEST_CLIENT Up;
+    TEST_CLIENT Down;
+    TEST_CLIENT Flooder;
+    CHAR Text[RELAY_LIMITS_CHAT_LENGTH + 1];
+    BOOL Passed = TRUE;
+
+    printf("limit action %s\n", Action);
+
+    memset(Text, 'x', RELAY_LIMITS_CHAT_LENGTH);
+    Text[RELAY_LIMITS_CHAT_LENGTH] = '\0';
+
+    SetEnvironmentVariableA("P2PCHAT_LIMIT_ACTION", Action);
+    SetEnvironmentVariableA("P2PCHAT_CLIENT_LIMIT", RELAY_LIMITS_CLIENT);
+    SetEnvironmentVariableA("P2PCHAT_ADDRESS_LIMIT", RELAY_LIMITS_ADDRESS);
+
+    HANDLE Process = TestStartServer(Server, Port);
+    if (!TestCheck(Process != NULL, "server did not start"))
+    {
+        return FALSE;
+    }
+
+    if (!TestCheck(TestConnectClient(&Up, Port), "first client did not connect"))
+    {
+        TestStopProcess(Process, 0);
+        return FALSE;
+    }
+
+    if (!TestCheck(TestConnectClient(&Down, Port), "second client did not connect"))
+    {
+        TestCloseClient(&Up);
+        TestStopProcess(Process, 0);
+        return FALSE;
+    }
+
+    DeleteFileA(RELAY_LIMITS_RECEIVED_UP);
+    DeleteFileA(RELAY_LIMITS_RECEIVED_UP TRANSFER_IDENTITY_EXTENSION);
+    DeleteFileA(RELAY_LIMITS_RECEIVED_DOWN);
+    DeleteFileA(RELAY_LIMITS_RECEIVED_DOWN TRANSFER_PART_EXTENSION);
+    DeleteFileA(RELAY_LIMITS_RECEIVED_DOWN TRANSFER_IDENTITY_EXTENSION);
+
+    Passed = TestCheck(TestPairClients(&Up, &Down), "server did not pair the clients") &&
+             TestCheck(TestWriteFile(RELAY_LIMITS_RECEIVED_UP TRANSFER_PART_EXTENSION, RELAY_LIMITS_FILE_SIZE / 2, 3), "cannot write a stale .part file") &&
+             TestCheck(TestWriteFile(RELAY_LIMITS_UP, RELAY_LIMITS_FILE_SIZE, 1), "cannot write %s", RELAY_LIMITS_UP) &&
+             TestCheck(TestWriteFile(RELAY_LIMITS_DOWN, RELAY_LIMITS_FILE_SIZE, 2), "cannot write %s", RELAY_LIMITS_DOWN) &&
+             TestCheck(TransferSendFile(&Up.Transfer, RELAY_LIMITS_UP), "first transfer did not start") &&
+             TestCheck(TransferSendFile(&Down.Transfer, RELAY_LIMITS_DOWN), "second transfer did not start");
+
+    LONG UpChats = 0;
+    LONG DownChats = 0;
+    ULONGLONG Start = GetTickCount64();
+
+    // the chunks keep both byte buckets at their edge, so chat and window updates come in when
+    // the bucket has less room than they take
+    while (Passed && (Up.Transfer.Sending || Down.Transfer.Sending) && GetTickCount64() - Start < RELAY_LIMITS_TIMEOUT)
+    {
+        Passed = TestCheck(TestSendChat(&Up, (UINT32)++UpChats, Text), "first client could not chat") &&
+                 TestCheck(TestSendChat(&Down, (UINT32)++DownChats, Text), "second client could not chat");
+        Sleep(RELAY_LIMITS_CHAT_INTERVAL);
+    }
+
+    double Seconds = (GetTickCount64() - Start) / 1000.0;
+
+    Passed = Passed &&
+             TestCheck(TransferWaitSent(&Up.Transfer, RELAY_LIMITS_TIMEOUT), "first transfer did not complete") &&
+             TestCheck(TransferWaitSent(&Down.Transfer, RELAY_LIMITS_TIMEOUT), "second transfer did not complete") &&
+             TestCheck(Up.Transfer.Completed == 1 && Down.Transfer.Completed == 1, "a client did not complete its file") &&
+             TestCheck(TestSameFiles(RELAY_LIMITS_UP, RELAY_LIMITS_RECEIVED_UP), "first received copy differs") &&
+             TestCheck(TestSameFiles(RELAY_LIMITS_DOWN, RELAY_LIMITS_RECEIVED_DOWN), "second received copy differs") &&
+             TestCheck(GetFileAttributesA(RELAY_LIMITS_RECEIVED_UP TRANSFER_IDENTITY_EXTENSION) == INVALID_FILE_ATTRIBUTES, "identity of a received file was left behind") &&
+             TestCheck(Seconds >= RELAY_LIMITS_MIN_SECONDS, "transfers took %.2f s, the byte limit was not applied", Seconds);
+
+    Passed = Passed &&
+             TestCheck(RelayLimitsWaitFor(&Up.Acked, UpChats), "first client had %ld of %ld chat messages acknowledged", (long)Up.Acked, (long)UpChats) &&
+             TestCheck(RelayLimitsWaitFor(&Down.Acked, DownChats), "second client had %ld of %ld chat messages acknowledged", (long)Down.Acked, (long)DownChats) &&
+             TestCheck(RelayLimitsWaitFor(&Down.Chats, UpChats), "second client got %ld of %ld chat messages", (long)Down.Chats, (long)UpChats) &&
+             TestCheck(RelayLimitsWaitFor(&Up.Chats, DownChats), "first client got %ld of %ld chat messages", (long)Up.Chats, (long)DownChats) &&
+             TestCheck(Up.Errors == 0 && Down.Errors == 0, "server sent %ld and %ld errors", (long)Up.Errors, (long)Down.Errors) &&
+             TestCheck(TestPing(&Up, 1) && TestPing(&Down, 1), "server no longer serves the clients");
+
+    if (Passed)
+    {
+        printf("  %u bytes each way in %.2f s with %ld chat messages each way\n", RELAY_LIMITS_FILE_SIZE, Seconds, (long)UpChats);
+    }
+
+    TestCloseClient(&Down);
+    TestCloseClient(&Up);
+
+    // chat beyond the message limit is what the action is for
+    if (Passed && TestCheck(TestConnectClient(&Flooder, Port), "flooder did not connect"))
+    {
+        LONG Flooded = 0;
+        while (Flooded < RELAY_LIMITS_FLOOD && TestSendChat(&Flooder, (UINT32)++Flooded, "flood"))
+        {
+        }
+
+        if (strcmp(Action, "drop") == 0)
+        {
+            Passed = TestCheck(TestPing(&Flooder, 1), "flooder was disconnected") &&
+                     TestCheck(Flooder.Acked < Flooded, "none of %ld flooded chat messages were dropped", (long)Flooded);
+            printf("  %ld of %ld flooded chat messages dropped\n", (long)(Flooded - Flooder.Acked), (long)Flooded);
+        }
+        else
+        {
+            RelayLimitsWaitFor(&Flooder.Closed, TRUE);
+            Passed = TestCheck(Flooder.Closed, "flooder stayed connected") &&
+                     TestCheck(Flooder.LastError == MESSAGE_ERROR_RATE_LIMITED, "flooder was not told it was rate limited");
+            printf("  flooder disconnected after %ld of %ld chat messages\n", (long)Flooder.Acked, (long)Flooded);
+        }
+
+        TestCloseClient(&Flooder);
+    }
+    else
+    {
+        Passed = FALSE;
+    }
+
+    DeleteFileA(RELAY_LIMITS_UP);
+    DeleteFileA(RELAY_LIMITS_DOWN);
+    DeleteFileA(RELAY_LIMITS_RECEIVED_UP);
+    DeleteFileA(RELAY_LIMITS_RECEIVED_DOWN);
+    TestStopProcess(Process, 0);
+    return Passed;
+}
+
+INT main(
+    INT   argc,
+    PSTR* argv
+)
+{
+    if (argc < 3)
+    {
+        printf("usage: relaylimits <server> <port>\n");
+        return 2;
+    }
+
+    if (!TestInitialise())
+    {
+        return 1;
+    }
+
+    CreateDirectoryA("tests", NULL);
+    CreateDirectoryA(TEST_RECEIVE_DIRECTORY, NULL);
+
+    BOOL Passed = RelayLimitsRun(argv[1], argv[2], "drop");
+    Passed = RelayLimitsRun(argv[1], argv[2], "disconnect") && Passed;
+
+    TestCleanUp();
+    printf("%s\n", Passed ? "passed" : "FAILED");
+    return Passed ? 0 : 1;
+}
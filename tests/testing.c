@@ -0,0 +1,656 @@
+#include "testing.h"
+#include "logger.h"
+
+#include <stdlib.h>
+
+#define TEST_MAX_COMMAND_LINE 1024
+#define TEST_FILE_BUFFER ( 64 * 1024 )    // bytes TestWriteFile and TestSameFiles handle at a time
+
+/**
+* Reads the connection of a client like the client's receive thread does, counting what the
+* server sent and handing file frames to the transfer session.
+*/
+static
+DWORD
+WINAPI
+TestReceiveThread(
+    _In_ LPVOID lpData
+)
+{
+    PTEST_CLIENT pClient = (PTEST_CLIENT)lpData;
+    NET_CHUNK_POOL Chunks;
+    NET_READ_BUFFER Received;
+    CHAR Scratch[PROTOCOL_MAX_BULK_PAYLOAD_SIZE];
+    MESSAGE_HEADER Header;
+
+    NetChunkPoolInitialise(&Chunks, 1);
+    NetBufferInitialise(&Received, &Chunks);
+
+    while (NetBufferFill(&Received, pClient->Socket, sizeof(Header)) == NET_IO_COMPLETE)
+    {
+        NetBufferRead(&Received, &Header, sizeof(Header));
+
+        UINT16 Length = ntohs(Header.Length);
+        UINT16 StreamId = ntohs(Header.StreamId);
+
+        // clients never take up compression, the server sends them nothing compressed
+        if (Header.Flags != 0 ||
+            Length > PROTOCOL_MAX_FRAME_PAYLOAD(StreamId) ||
+            !NetMuxReceived(&pClient->Mux, StreamId, Length) ||
+            NetBufferFill(&Received, pClient->Socket, Length) != NET_IO_COMPLETE)
+        {
+            break;
+        }
+
+        const CHAR* Payload = NetBufferView(&Received, Length, Scratch);
+
+        switch (ntohs(Header.Type))
+        {
+        case MESSAGE_TYPE_JOIN:
+        {
+            const JOIN_MESSAGE* pJoin = MessageJoinView(Payload, Length);
+            if (pJoin != NULL)
+            {
+                InterlockedExchange(&pClient->PeerId, (LONG)MessageJoinClientId(pJoin));
+                SetEvent(pClient->Paired);
+            }
+            break;
+        }
+
+        case MESSAGE_TYPE_LEAVE:
+            InterlockedExchange(&pClient->PeerId, 0);
+            InterlockedIncrement(&pClient->Left);
+            TransferPeerUnavailable(&pClient->Transfer);
+            SetEvent(pClient->Answered);
+            break;
+
+        case MESSAGE_TYPE_ACK:
+            InterlockedIncrement(&pClient->Acked);
+            break;
+
+        case MESSAGE_TYPE_CHAT:
+            InterlockedIncrement(&pClient->Chats);
+            break;
+
+        case MESSAGE_TYPE_ERROR:
+        {
+            const ERROR_MESSAGE* pError = MessageErrorView(Payload, Length);
+            InterlockedExchange(&pClient->LastError, (pError != NULL) ? (LONG)MessageErrorCode(pError) : 0);
+            InterlockedIncrement(&pClient->Errors);
+            SetEvent(pClient->Answered);
+            break;
+        }
+
+        case MESSAGE_TYPE_PEER_ENDPOINTS:
+            if (Length == sizeof(pClient->Endpoints))
+            {
+                memcpy(&pClient->Endpoints, Payload, Length);
+                SetEvent(pClient->Introduced);
+            }
+            break;
+
+        case MESSAGE_TYPE_PEER_UNAVAILABLE:
+            TransferPeerUnavailable(&pClient->Transfer);
+            break;
+
+        case MESSAGE_TYPE_FILE_OFFER:
+        case MESSAGE_TYPE_FILE_ACCEPT:
+        case MESSAGE_TYPE_FILE_DATA:
+            TransferHandleFrame(&pClient->Transfer, ntohs(Header.Type), Payload, Length);
+            break;
+
+        case MESSAGE_TYPE_WINDOW_UPDATE:
+            NetMuxWindowUpdate(&pClient->Mux, Payload, Length);
+            break;
+
+        case MESSAGE_TYPE_CONTROL:
+        {
+            const CONTROL_MESSAGE* pControl = MessageControlView(Payload, Length);
+            if (pControl != NULL && MessageControlCommand(pControl) == MESSAGE_CONTROL_PONG)
+            {
+                InterlockedExchange64(&pClient->Pong, (LONG64)MessageControlArgument(pControl));
+                SetEvent(pClient->Answered);
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+
+        NetBufferConsume(&Received, Length);
+        NetMuxConsumed(&pClient->Mux, StreamId, Length);
+    }
+
+    NetBufferCleanUp(&Received);
+    NetChunkPoolCleanUp(&Chunks);
+
+    InterlockedExchange(&pClient->Closed, TRUE);
+    SetEvent(pClient->Answered);
+
+    // a send waiting on the peer gives up instead of stalling
+    TransferPeerUnavailable(&pClient->Transfer);
+    return 0;
+}
+
+/**
+* Registers a UDP endpoint for the client with the server, which pairs only registered clients.
+*/
+static
+BOOL
+TestRegister(
+    _In_ PTEST_CLIENT pClient
+)
+{
+    struct sockaddr_in ServerAddress;
+    socklen_t AddressSize = sizeof(ServerAddress);
+
+    if (getpeername(pClient->Socket, (struct sockaddr*)&ServerAddress, &AddressSize) == SOCKET_ERROR)
+    {
+        return FALSE;
+    }
+
+    SOCKET Datagrams = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (Datagrams == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+
+    NetSetReceiveTimeout(Datagrams, TEST_REGISTER_TIMEOUT);
+
+    DATAGRAM_HEADER Register;
+    ZeroMemory(&Register, sizeof(Register));
+    Register.Magic = htonl(DATAGRAM_MAGIC);
+    Register.Type = DATAGRAM_TYPE_REGISTER;
+    Register.SenderId = htonl(pClient->ClientId);
+    Register.Token = htonl(pClient->Token);
+
+    BOOL Registered = FALSE;
+    for (INT Attempt = 0; Attempt < TEST_REGISTER_ATTEMPTS && !Registered; ++Attempt)
+    {
+        DATAGRAM_HEADER Ack;
+
+        sendto(Datagrams, (PCSTR)&Register, sizeof(Register), 0, (struct sockaddr*)&ServerAddress, sizeof(ServerAddress));
+
+        INT Received = recvfrom(Datagrams, (PCHAR)&Ack, sizeof(Ack), 0, NULL, NULL);
+        Registered = Received == (INT)sizeof(Ack) && Ack.Type == DATAGRAM_TYPE_REGISTER_ACK;
+    }
+
+    closesocket(Datagrams);
+    return Registered;
+}
+
+/**
+* Connects a socket to a port of the loopback address.
+*/
+static
+SOCKET
+TestConnect(
+    _In_ PCSTR Port
+)
+{
+    struct sockaddr_in Address;
+    ZeroMemory(&Address, sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Address.sin_port = htons((UINT16)atoi(Port));
+
+    SOCKET Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (Socket != INVALID_SOCKET && connect(Socket, (struct sockaddr*)&Address, sizeof(Address)) == SOCKET_ERROR)
+    {
+        closesocket(Socket);
+        Socket = INVALID_SOCKET;
+    }
+
+    return Socket;
+}
+
+BOOL
+TestInitialise(
+    VOID
+)
+{
+    if (!InitWinSock())
+    {
+        printf("Failed to initialise sockets\n");
+        return FALSE;
+    }
+
+    if (LoggerInitConsole(stdout) != 0)
+    {
+        printf("Failed to initialise logger\n");
+        CleanUpWinSock();
+        return FALSE;
+    }
+
+    LoggerSetLevel(LOG_LEVEL_WARN);
+    return TRUE;
+}
+
+VOID
+TestCleanUp(
+    VOID
+)
+{
+    LoggerCleanUp();
+    CleanUpWinSock();
+}
+
+BOOL
+TestCheck(
+    _In_ BOOL Condition,
+    _In_ PCSTR Format,
+    ...
+)
+{
+    if (!Condition)
+    {
+        va_list Args;
+        va_start(Args, Format);
+        printf("FAILED: ");
+        vprintf(Format, Args);
+        printf("\n");
+        va_end(Args);
+        fflush(stdout);
+    }
+
+    return Condition;
+}
+
+/**
+* Starts a command line that is already formatted.
+*/
+static
+HANDLE
+TestStartCommandLine(
+    _Inout_ PSTR CommandLine
+)
+{
+    STARTUPINFOA StartupInfo;
+    PROCESS_INFORMATION ProcessInformation;
+
+    ZeroMemory(&StartupInfo, sizeof(StartupInfo));
+    StartupInfo.cb = sizeof(StartupInfo);
+
+    // what the process prints goes to the test's output in order with ours
+    fflush(stdout);
+
+    if (!CreateProcessA(NULL, CommandLine, NULL, NULL, FALSE, 0, NULL, NULL, &StartupInfo, &ProcessInformation))
+    {
+        printf("Unable to start %s: %d\n", CommandLine, GetLastError());
+        return NULL;
+    }
+
+    if (ProcessInformation.hThread != NULL)
+    {
+        CloseHandle(ProcessInformation.hThread);
+    }
+
+    return ProcessInformation.hProcess;
+}
+
+HANDLE
+TestStartProcess(
+    _In_ PCSTR Format,
+    ...
+)
+{
+    CHAR CommandLine[TEST_MAX_COMMAND_LINE];
+    va_list Args;
+
+    va_start(Args, Format);
+    _vsnprintf_s(CommandLine, sizeof(CommandLine), _TRUNCATE, Format, Args);
+    va_end(Args);
+
+    return TestStartCommandLine(CommandLine);
+}
+
+HANDLE
+TestStartRole(
+    _In_ PCSTR Format,
+    ...
+)
+{
+    CHAR Program[MAX_PATH];
+    CHAR Arguments[TEST_MAX_COMMAND_LINE - MAX_PATH - 4];
+    CHAR CommandLine[TEST_MAX_COMMAND_LINE];
+    va_list Args;
+
+    DWORD Length = GetModuleFileNameA(NULL, Program, sizeof(Program));
+    if (Length == 0 || Length >= sizeof(Program))
+    {
+        printf("Unable to find the test program: %d\n", GetLastError());
+        return NULL;
+    }
+
+    va_start(Args, Format);
+    _vsnprintf_s(Arguments, sizeof(Arguments), _TRUNCATE, Format, Args);
+    va_end(Args);
+
+    _snprintf_s(CommandLine, sizeof(CommandLine), _TRUNCATE, "\"%s\" %s", Program, Arguments);
+    return TestStartCommandLine(CommandLine);
+}
+
+DWORD
+TestStopProcess(
+    _In_ HANDLE Process,
+    _In_ DWORD Milliseconds
+)
+{
+    DWORD ExitCode = STILL_ACTIVE;
+
+    if (WaitForSingleObject(Process, Milliseconds) != WAIT_OBJECT_0)
+    {
+        TerminateProcess(Process, STILL_ACTIVE);
+        WaitForSingleObject(Process, INFINITE);
+    }
+    else
+    {
+        GetExitCodeProcess(Process, &ExitCode);
+    }
+
+    CloseHandle(Process);
+    return ExitCode;
+}
+
+HANDLE
+TestStartServer(
+    _In_ PCSTR Server,
+    _In_ PCSTR Port
+)
+{
+    HANDLE Process = TestStartProcess("\"%s\" %s", Server, Port);
+    if (Process == NULL)
+    {
+        return NULL;
+    }
+
+    // the server accepts once it listens, a connection that goes away at once is only cleaned up
+    ULONGLONG Deadline = GetTickCount64() + TEST_SERVER_TIMEOUT;
+    while (GetTickCount64() < Deadline && WaitForSingleObject(Process, 0) == WAIT_TIMEOUT)
+    {
+        SOCKET Probe = TestConnect(Port);
+        if (Probe != INVALID_SOCKET)
+        {
+            closesocket(Probe);
+            return Process;
+        }
+
+        Sleep(20);
+    }
+
+    printf("The server on port %s did not start\n", Port);
+    TestStopProcess(Process, 0);
+    return NULL;
+}
+
+BOOL
+TestConnectClient(
+    _Out_ PTEST_CLIENT pClient,
+    _In_  PCSTR Port
+)
+{
+    MESSAGE_HEADER Header;
+    HANDSHAKE_MESSAGE Handshake;
+
+    ZeroMemory(pClient, sizeof(*pClient));
+
+    pClient->Socket = TestConnect(Port);
+    if (pClient->Socket == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+
+    NetSetReceiveTimeout(pClient->Socket, TEST_REPLY_TIMEOUT);
+
+    if (NetReceiveExact(pClient->Socket, &Header, sizeof(Header)) <= 0 ||
+        ntohs(Header.Type) != MESSAGE_TYPE_HANDSHAKE ||
+        ntohs(Header.Length) != sizeof(Handshake) ||
+        NetReceiveExact(pClient->Socket, &Handshake, sizeof(Handshake)) <= 0 ||
+        Handshake.Version != PROTOCOL_VERSION)
+    {
+        printf("No handshake from port %s, or a different protocol version\n", Port);
+        TestCloseClient(pClient);
+        return FALSE;
+    }
+
+    NetSetReceiveTimeout(pClient->Socket, 0);
+
+    pClient->ClientId = ntohl(Handshake.ClientId);
+    pClient->Token = ntohl(Handshake.Token);
+
+    if (!TestRegister(pClient))
+    {
+        printf("The server did not acknowledge the registration of client %u\n", pClient->ClientId);
+        TestCloseClient(pClient);
+        return FALSE;
+    }
+
+    NetMuxInitialise(&pClient->Mux, pClient->Socket);
+
+    pClient->Paired = CreateEventA(NULL, FALSE, FALSE, NULL);
+    pClient->Answered = CreateEventA(NULL, FALSE, FALSE, NULL);
+    pClient->Introduced = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (pClient->Paired == NULL || pClient->Answered == NULL || pClient->Introduced == NULL)
+    {
+        NetMuxCleanUp(&pClient->Mux);
+        TestCloseClient(pClient);
+        return FALSE;
+    }
+
+    CreateDirectoryA("tests", NULL);
+    if (!TransferInitialise(&pClient->Transfer, &pClient->Mux, TEST_RECEIVE_DIRECTORY))
+    {
+        NetMuxCleanUp(&pClient->Mux);
+        TestCloseClient(pClient);
+        return FALSE;
+    }
+
+    pClient->Thread = CreateThread(NULL, 0, TestReceiveThread, pClient, 0, NULL);
+    if (pClient->Thread == NULL)
+    {
+        TransferCleanUp(&pClient->Transfer);
+        NetMuxCleanUp(&pClient->Mux);
+        TestCloseClient(pClient);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL
+TestPairClients(
+    _Inout_ PTEST_CLIENT pClient,
+    _Inout_ PTEST_CLIENT pPeer
+)
+{
+    PEER_CONNECT_MESSAGE Connect;
+    Connect.PeerId = htonl(pPeer->ClientId);
+
+    if (NetMuxSend(&pClient->Mux, STREAM_CONTROL, MESSAGE_TYPE_PEER_CONNECT, &Connect, sizeof(Connect)) != NET_IO_COMPLETE)
+    {
+        return FALSE;
+    }
+
+    // a join of an earlier pairing does not count for this one
+    ULONGLONG Deadline = GetTickCount64() + TEST_REPLY_TIMEOUT;
+    while ((UINT32)pClient->PeerId != pPeer->ClientId || (UINT32)pPeer->PeerId != pClient->ClientId)
+    {
+        ULONGLONG Now = GetTickCount64();
+        if (Now >= Deadline)
+        {
+            return FALSE;
+        }
+
+        WaitForSingleObject(pClient->Paired, (DWORD)min(Deadline - Now, 100));
+    }
+
+    return TRUE;
+}
+
+BOOL
+TestSendChat(
+    _Inout_ PTEST_CLIENT pClient,
+    _In_    UINT32 Sequence,
+    _In_    PCSTR Text
+)
+{
+    CHAR Chat[sizeof(CHAT_MESSAGE) + MESSAGE_MAX_CHAT_TEXT];
+    UINT16 Length = MessageChatEncode(Chat, Sequence, 0, Text, (UINT16)min(strlen(Text), MESSAGE_MAX_CHAT_TEXT));
+
+    NET_IO_STATUS Status;
+    while ((Status = NetMuxSend(&pClient->Mux, STREAM_CHAT, MESSAGE_TYPE_CHAT, Chat, Length)) == NET_IO_PENDING)
+    {
+        if (pClient->Closed)
+        {
+            return FALSE;
+        }
+
+        NetMuxWait(&pClient->Mux, 100);
+    }
+
+    return Status == NET_IO_COMPLETE;
+}
+
+BOOL
+TestPing(
+    _Inout_ PTEST_CLIENT pClient,
+    _In_    UINT64 Argument
+)
+{
+    CONTROL_MESSAGE Ping;
+    UINT16 Length = MessageControlEncode(&Ping, MESSAGE_CONTROL_PING, Argument, NULL, 0);
+
+    if (NetMuxSend(&pClient->Mux, STREAM_CONTROL, MESSAGE_TYPE_CONTROL, &Ping, Length) != NET_IO_COMPLETE)
+    {
+        return FALSE;
+    }
+
+    // a late answer to an earlier ping does not count for this one
+    while (pClient->Pong != (LONG64)Argument && !pClient->Closed &&
+           WaitForSingleObject(pClient->Answered, TEST_REPLY_TIMEOUT) == WAIT_OBJECT_0)
+    {
+    }
+
+    return pClient->Pong == (LONG64)Argument;
+}
+
+VOID
+TestCloseClient(
+    _Inout_ PTEST_CLIENT pClient
+)
+{
+    if (pClient->Socket != INVALID_SOCKET)
+    {
+        shutdown(pClient->Socket, SD_BOTH);
+    }
+
+    if (pClient->Thread != NULL)
+    {
+        WaitForSingleObject(pClient->Thread, INFINITE);
+        CloseHandle(pClient->Thread);
+        pClient->Thread = NULL;
+
+        TransferCleanUp(&pClient->Transfer);
+        NetMuxCleanUp(&pClient->Mux);
+    }
+
+    if (pClient->Paired != NULL)
+    {
+        CloseHandle(pClient->Paired);
+        pClient->Paired = NULL;
+    }
+
+    if (pClient->Answered != NULL)
+    {
+        CloseHandle(pClient->Answered);
+        pClient->Answered = NULL;
+    }
+
+    if (pClient->Introduced != NULL)
+    {
+        CloseHandle(pClient->Introduced);
+        pClient->Introduced = NULL;
+    }
+
+    if (pClient->Socket != INVALID_SOCKET)
+    {
+        closesocket(pClient->Socket);
+    }
+    pClient->Socket = INVALID_SOCKET;
+}
+
+BOOL
+TestWriteFile(
+    _In_ PCSTR Path,
+    _In_ UINT64 Size,
+    _In_ UINT32 Seed
+)
+{
+    HANDLE File = CreateFileA(Path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (File == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    UINT32* Buffer = (UINT32*)malloc(TEST_FILE_BUFFER);
+    BOOL Written = Buffer != NULL;
+    UINT32 State = Seed | 1;
+
+    for (UINT64 Offset = 0; Written && Offset < Size; Offset += TEST_FILE_BUFFER)
+    {
+        // xorshift, so the file does not compress and every chunk differs
+        for (ULONG i = 0; i < TEST_FILE_BUFFER / sizeof(UINT32); ++i)
+        {
+            State ^= State << 13;
+            State ^= State >> 17;
+            State ^= State << 5;
+            Buffer[i] = State;
+        }
+
+        DWORD Length = (DWORD)min((UINT64)TEST_FILE_BUFFER, Size - Offset);
+        DWORD Bytes;
+        Written = WriteFile(File, Buffer, Length, &Bytes, NULL) && Bytes == Length;
+    }
+
+    free(Buffer);
+    CloseHandle(File);
+    return Written;
+}
+
+BOOL
+TestSameFiles(
+    _In_ PCSTR First,
+    _In_ PCSTR Second
+)
+{
+    FILE* Files[2] = { NULL, NULL };
+    CHAR* Buffers[2];
+    BOOL Same = fopen_s(&Files[0], First, "rb") == 0 && fopen_s(&Files[1], Second, "rb") == 0;
+
+    Buffers[0] = (CHAR*)malloc(TEST_FILE_BUFFER);
+    Buffers[1] = (CHAR*)malloc(TEST_FILE_BUFFER);
+    Same = Same && Buffers[0] != NULL && Buffers[1] != NULL;
+
+    while (Same)
+    {
+        SIZE_T Read = fread(Buffers[0], 1, TEST_FILE_BUFFER, Files[0]);
+        Same = fread(Buffers[1], 1, TEST_FILE_BUFFER, Files[1]) == Read && memcmp(Buffers[0], Buffers[1], Read) == 0;
+
+        if (Read < TEST_FILE_BUFFER)
+        {
+            break;
+        }
+    }
+
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        free(Buffers[i]);
+        if (Files[i] != NULL)
+        {
+            fclose(Files[i]);
+        }
+    }
+
+    return Same;
+}
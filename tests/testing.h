@@ -0,0 +1,184 @@
+#ifndef TESTING_H
+#define TESTING_H
+
+#include "transfer.h"
+#include "message.h"
+
+/**
+    * What the tests share: starting the programs under test, clients of a relay server and checks
+    * that say what failed.
+    *
+    * Every test is a program of its own that ctest runs with the programs it starts on its command
+    * line and exits with 0 when everything it checked held. Tests that need several processes start
+    * copies of themselves with a role as the first argument, see TestStartRole.
+    *
+    * A TEST_CLIENT is what a client holds for its relay connection, without the console: it reads
+    * the connection on a thread of its own and counts what the server sent it, so a test can send
+    * from the calling thread and check the counts.
+*/
+
+#define TEST_SERVER_TIMEOUT 5000   // milliseconds a started server has to accept connections
+#define TEST_REPLY_TIMEOUT 5000    // milliseconds to wait for the server to answer a request
+#define TEST_REGISTER_ATTEMPTS 5
+#define TEST_REGISTER_TIMEOUT 1000 // milliseconds to wait for each registration ack
+#define TEST_RECEIVE_DIRECTORY "tests\\received"
+
+typedef struct _TEST_CLIENT
+{
+    SOCKET                 Socket;
+    NET_MUX                Mux;
+    TRANSFER_SESSION       Transfer;
+    HANDLE                 Thread;           // reads the connection
+    HANDLE                 Paired;           // auto reset, set on every MESSAGE_TYPE_JOIN
+    HANDLE                 Answered;         // auto reset, set on every pong, leave and error
+    HANDLE                 Introduced;       // auto reset, set on every MESSAGE_TYPE_PEER_ENDPOINTS
+    PEER_ENDPOINTS_MESSAGE Endpoints;        // of the last introduction
+    UINT32                 ClientId;         // from the server's handshake
+    UINT32                 Token;
+    volatile LONG          PeerId;           // client of the last join, 0 once it left
+    volatile LONG          Acked;            // chat messages the server acknowledged
+    volatile LONG          Chats;            // chat messages relayed to us
+    volatile LONG          Left;             // leaves received
+    volatile LONG          Errors;           // errors received
+    volatile LONG          LastError;        // MESSAGE_ERROR_* of the last error
+    volatile LONG64        Pong;             // argument of the last pong
+    volatile LONG          Closed;           // the server closed the connection
+} TEST_CLIENT, *PTEST_CLIENT;
+
+/**
+* Starts the sockets and a console logger at warnings, what the modules under test expect.
+*/
+BOOL
+TestInitialise(
+    VOID
+);
+
+VOID
+TestCleanUp(
+    VOID
+);
+
+/**
+* Prints what failed when a check does not hold.
+*
+* @return Condition.
+*/
+BOOL
+TestCheck(
+    _In_ BOOL Condition,
+    _In_ PCSTR Format,
+    ...
+) FORMAT_PRINTF(2, 3);
+
+/**
+* Starts a program with a command line of printf format, the program first. A command line of
+* this test's own program is started with TestStartRole.
+*
+* @return The process, NULL if it could not be started.
+*/
+HANDLE
+TestStartProcess(
+    _In_ PCSTR Format,
+    ...
+) FORMAT_PRINTF(1, 2);
+
+/**
+* Starts a copy of the running test with a role and its arguments, "role arguments...".
+*/
+HANDLE
+TestStartRole(
+    _In_ PCSTR Format,
+    ...
+) FORMAT_PRINTF(1, 2);
+
+/**
+* Waits for a process to end, ends it if it does not in time and closes its handle.
+*
+* @return Its exit code, STILL_ACTIVE if it had to be ended.
+*/
+DWORD
+TestStopProcess(
+    _In_ HANDLE Process,
+    _In_ DWORD Milliseconds
+);
+
+/**
+* Starts a relay server on a port of the loopback address with the limits and actions the
+* P2PCHAT_ variables of our environment set, and waits until it accepts connections.
+*
+* @return The server's process, NULL if it did not start.
+*/
+HANDLE
+TestStartServer(
+    _In_ PCSTR Server,
+    _In_ PCSTR Port
+);
+
+/**
+* Connects to a relay server on the loopback address, reads its handshake, registers a UDP
+* endpoint so it may be paired and starts reading the connection.
+*/
+BOOL
+TestConnectClient(
+    _Out_ PTEST_CLIENT pClient,
+    _In_  PCSTR Port
+);
+
+/**
+* Asks the server to pair a client with another and waits until both are told.
+*/
+BOOL
+TestPairClients(
+    _Inout_ PTEST_CLIENT pClient,
+    _Inout_ PTEST_CLIENT pPeer
+);
+
+/**
+* Sends a chat message, waiting for the stream's window if it is full.
+*/
+BOOL
+TestSendChat(
+    _Inout_ PTEST_CLIENT pClient,
+    _In_    UINT32 Sequence,
+    _In_    PCSTR Text
+);
+
+/**
+* Pings the server and waits for the pong.
+*
+* @return TRUE if the server answered, so it still serves the client.
+*/
+BOOL
+TestPing(
+    _Inout_ PTEST_CLIENT pClient,
+    _In_    UINT64 Argument
+);
+
+/**
+* Closes a client, connected or not.
+*/
+VOID
+TestCloseClient(
+    _Inout_ PTEST_CLIENT pClient
+);
+
+/**
+* Writes a file of pseudo random bytes, the same for the same seed.
+*/
+BOOL
+TestWriteFile(
+    _In_ PCSTR Path,
+    _In_ UINT64 Size,
+    _In_ UINT32 Seed
+);
+
+/**
+* @return TRUE if both files exist and hold the same bytes.
+*/
+BOOL
+TestSameFiles(
+    _In_ PCSTR First,
+    _In_ PCSTR Second
+);
+
+#endif // !TESTING_H